@@ -69,6 +69,14 @@ LGPL License Terms @ref lgpl_license
 #define USB_AUDIO_TYPE_PROCESSING_UNIT		0x07
 #define USB_AUDIO_TYPE_EXTENSION_UNIT		0x08
 
+/* Table A-9: Audio Class-Specific Request Codes */
+#define USB_AUDIO_REQ_SET_CUR			0x01
+#define USB_AUDIO_REQ_GET_CUR			0x81
+
+/* Table A-19: Endpoint Control Selectors */
+#define USB_AUDIO_EP_CONTROL_SAMPLING_FREQ	0x01
+#define USB_AUDIO_EP_CONTROL_PITCH		0x02
+
 /* Table 4-2: Class-Specific AC Interface Header Descriptor (head) */
 struct usb_audio_header_descriptor_head {
 	uint8_t bLength;
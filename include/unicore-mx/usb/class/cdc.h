@@ -49,6 +49,8 @@ LGPL License Terms @ref lgpl_license
 #define USB_CDC_SUBCLASS_ACM		0x02
 /* ... */
 #define USB_CDC_SUBCLASS_ECM		0x06
+/* ... */
+#define USB_CDC_SUBCLASS_NCM		0x0D
 
 /* Table 5 Communications Interface Class Control Protocol Codes */
 #define USB_CDC_PROTOCOL_NONE		0x00
@@ -71,6 +73,8 @@ LGPL License Terms @ref lgpl_license
 #define USB_CDC_TYPE_UNION		0x06
 /* ... */
 #define USB_CDC_TYPE_ECM        	0x0F
+/* ... */
+#define USB_CDC_TYPE_NCM		0x1A
 
 /* Table 15: Class-Specific Descriptor Header Format */
 struct usb_cdc_header_descriptor {
@@ -128,8 +132,9 @@ struct usb_cdc_ecm_descriptor {
 /* Table 13: Class-Specific Request Codes for PSTN subclasses */
 /* ... */
 #define USB_CDC_REQ_SET_LINE_CODING			0x20
-/* ... */
+#define USB_CDC_REQ_GET_LINE_CODING			0x21
 #define USB_CDC_REQ_SET_CONTROL_LINE_STATE		0x22
+#define USB_CDC_REQ_SEND_BREAK				0x23
 /* ... */
 #define USB_CDC_REQ_SET_ETHERNET_MULTICAST_FILTER	0x40
 #define USB_CDC_REQ_SET_ETHERNET_PM_PATTERN_FILTER	0x41
@@ -160,6 +165,10 @@ enum usb_cdc_line_coding_bParityType {
 	USB_CDC_SPACE_PARITY = 4,
 };
 
+/* Table 18: Control Signal Bitmap Values for SetControlLineState */
+#define USB_CDC_CONTROL_LINE_DTR			(1 << 0)
+#define USB_CDC_CONTROL_LINE_RTS			(1 << 1)
+
 /* Table 30: Class-Specific Notification Codes for PSTN subclasses */
 /* ... */
 #define USB_CDC_NOTIFY_SERIAL_STATE			0x20
@@ -174,6 +183,125 @@ struct usb_cdc_notification {
 	uint16_t wLength;
 } __attribute__((packed));
 
+/* Table 20: Class-Specific Notification Codes */
+#define USB_CDC_NOTIFY_NETWORK_CONNECTION		0x00
+#define USB_CDC_NOTIFY_CONNECTION_SPEED_CHANGE		0x2A
+
+/* Table 21: ConnectionSpeedChange Data Structure */
+struct usb_cdc_connection_speed {
+	uint32_t DLBitRate;
+	uint32_t ULBitRate;
+} __attribute__((packed));
+
+
+/* Definitions for Network Control Model devices from:
+ * "Universal Serial Bus Communications Class Subclass Specification for
+ * Network Control Model Devices Revision 1.0"
+ */
+
+/* Table 4-1: NCM Communication Interface Protocol Code */
+#define USB_CDC_PROTOCOL_NCM_NONE	0x00
+
+/* Table 4-2: NCM Data Interface Protocol Code */
+#define USB_CDC_PROTOCOL_NCM_NTB	0x01
+
+/* Table 5-2: NCM Functional Descriptor */
+struct usb_cdc_ncm_descriptor {
+	uint8_t bFunctionLength;
+	uint8_t bDescriptorType;
+	uint8_t bDescriptorSubtype;
+	uint16_t bcdNcmVersion;
+	uint8_t bmNetworkCapabilities;
+} __attribute__((packed));
+
+/* bmNetworkCapabilities */
+#define USB_CDC_NCM_CAP_ETHERNET_PACKET_FILTER	(1 << 0)
+#define USB_CDC_NCM_CAP_NET_ADDRESS		(1 << 1)
+#define USB_CDC_NCM_CAP_ENCAPSULATED_COMMAND	(1 << 2)
+#define USB_CDC_NCM_CAP_MAX_DATAGRAM_SIZE	(1 << 3)
+#define USB_CDC_NCM_CAP_CRC_MODE		(1 << 4)
+#define USB_CDC_NCM_CAP_NTB_INPUT_SIZE_8	(1 << 5)
+
+/* Table 6-2: Class-Specific Request Codes for Network Control Model */
+#define USB_CDC_REQ_GET_NTB_PARAMETERS			0x80
+#define USB_CDC_REQ_GET_NET_ADDRESS			0x81
+#define USB_CDC_REQ_SET_NET_ADDRESS			0x82
+#define USB_CDC_REQ_GET_NTB_FORMAT			0x83
+#define USB_CDC_REQ_SET_NTB_FORMAT			0x84
+#define USB_CDC_REQ_GET_NTB_INPUT_SIZE			0x85
+#define USB_CDC_REQ_SET_NTB_INPUT_SIZE			0x86
+#define USB_CDC_REQ_GET_MAX_DATAGRAM_SIZE		0x87
+#define USB_CDC_REQ_SET_MAX_DATAGRAM_SIZE		0x88
+#define USB_CDC_REQ_GET_CRC_MODE			0x89
+#define USB_CDC_REQ_SET_CRC_MODE			0x8A
+
+/* Table 6-3: NTB Parameter Structure */
+struct usb_cdc_ncm_ntb_parameters {
+	uint16_t wLength;
+	uint16_t bmNtbFormatsSupported;
+	uint32_t dwNtbInMaxSize;
+	uint16_t wNdpInDivisor;
+	uint16_t wNdpInPayloadRemainder;
+	uint16_t wNdpInAlignment;
+	uint16_t wReserved;
+	uint32_t dwNtbOutMaxSize;
+	uint16_t wNdpOutDivisor;
+	uint16_t wNdpOutPayloadRemainder;
+	uint16_t wNdpOutAlignment;
+	uint16_t wNtbOutMaxDatagrams;
+} __attribute__((packed));
+
+/* bmNtbFormatsSupported */
+#define USB_CDC_NCM_NTB16_SUPPORTED	(1 << 0)
+#define USB_CDC_NCM_NTB32_SUPPORTED	(1 << 1)
+
+/* SET_NTB_FORMAT wValue */
+#define USB_CDC_NCM_NTB16_FORMAT	0x00
+#define USB_CDC_NCM_NTB32_FORMAT	0x01
+
+/* Table 3-1, 3-2: NTB Header (signature "NCMH", "ncmh") */
+#define USB_CDC_NCM_NTH16_SIGNATURE	0x484D434E
+#define USB_CDC_NCM_NTH32_SIGNATURE	0x686D636E
+
+struct usb_cdc_ncm_nth16 {
+	uint32_t dwSignature;
+	uint16_t wHeaderLength;
+	uint16_t wSequence;
+	uint16_t wBlockLength;
+	uint16_t wNdpIndex;
+} __attribute__((packed));
+
+struct usb_cdc_ncm_nth32 {
+	uint32_t dwSignature;
+	uint16_t wHeaderLength;
+	uint16_t wSequence;
+	uint32_t dwBlockLength;
+	uint32_t dwNdpIndex;
+} __attribute__((packed));
+
+/* Table 3-3, 3-4: NTB Datagram Pointer Table
+ *  (signature "NCM0", "ncm0": no CRC; "NCM1", "ncm1": CRC appended) */
+#define USB_CDC_NCM_NDP16_NOCRC_SIGNATURE	0x304D434E
+#define USB_CDC_NCM_NDP16_CRC_SIGNATURE		0x314D434E
+#define USB_CDC_NCM_NDP32_NOCRC_SIGNATURE	0x306D636E
+#define USB_CDC_NCM_NDP32_CRC_SIGNATURE		0x316D636E
+
+struct usb_cdc_ncm_ndp16 {
+	uint32_t dwSignature;
+	uint16_t wLength;
+	uint16_t wNextNdpIndex;
+	/* followed by (wDatagramIndex, wDatagramLength) pairs, ended by (0, 0) */
+} __attribute__((packed));
+
+struct usb_cdc_ncm_ndp32 {
+	uint32_t dwSignature;
+	uint16_t wLength;
+	uint16_t wReserved6;
+	uint32_t dwNextNdpIndex;
+	uint32_t dwReserved12;
+	/* followed by (dwDatagramIndex, dwDatagramLength) pairs, ended by (0, 0) */
+} __attribute__((packed));
+
 #endif
 
 /**@}*/
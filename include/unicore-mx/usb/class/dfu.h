@@ -96,6 +96,15 @@ struct usb_dfu_descriptor {
 #define USB_DFU_MANIFEST_TOLERANT	0x04
 #define USB_DFU_WILL_DETACH		0x08
 
+/* DfuSe (ST extension) commands, DFU_DNLOAD with wBlockNum 0 */
+#define DFUSE_CMD_GET_COMMANDS		0x00
+#define DFUSE_CMD_SET_ADDRESS		0x21
+#define DFUSE_CMD_ERASE			0x41
+#define DFUSE_CMD_READ_UNPROTECT	0x92
+
+/* Length of the DFU_GETSTATUS response */
+#define DFU_GETSTATUS_SIZE		6
+
 #endif
 
 /**@}*/
@@ -49,6 +49,9 @@ LGPL License Terms @ref lgpl_license
 #define USB_REQ_HID_PROTOCOL_REPORT 0x01
 
 #define USB_REQ_HID_GET_REPORT 0x01
+#define USB_REQ_HID_GET_IDLE 0x02
+#define USB_REQ_HID_GET_PROTOCOL 0x03
+#define USB_REQ_HID_SET_REPORT 0x09
 #define USB_REQ_HID_REPORT_TYPE_INPUT 0x01
 #define USB_REQ_HID_REPORT_TYPE_OUTPUT 0x02
 #define USB_REQ_HID_REPORT_TYPE_FEATURE 0x03
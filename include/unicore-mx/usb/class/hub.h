@@ -0,0 +1,125 @@
+/** @defgroup usb_hub_defines USB Hub Type Definitions
+
+@brief <b>Defined Constants and Types for the USB Hub Type Definitions</b>
+
+@ingroup USB_defines
+
+LGPL License Terms @ref lgpl_license
+*/
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USB_CLASS_HUB_H
+#define UNICOREMX_USB_CLASS_HUB_H
+
+#include <stdint.h>
+
+/*
+ * Definitions from the USB_HUB_ or usb_hub_ namespace come from:
+ * "Universal Serial Bus Specification, Revision 2.0", Chapter 11
+ */
+
+/* Hub class code (device and interface) */
+#define USB_CLASS_HUB				0x09
+
+/* Table 11-13: Hub Descriptor type */
+#define USB_DT_HUB				0x29
+
+/* Table 11-16: Hub Class Request Codes */
+#define USB_HUB_REQ_GET_STATUS			0
+#define USB_HUB_REQ_CLEAR_FEATURE		1
+#define USB_HUB_REQ_SET_FEATURE			3
+#define USB_HUB_REQ_GET_DESCRIPTOR		6
+#define USB_HUB_REQ_SET_DESCRIPTOR		7
+#define USB_HUB_REQ_CLEAR_TT_BUFFER		8
+#define USB_HUB_REQ_RESET_TT			9
+#define USB_HUB_REQ_GET_TT_STATE		10
+#define USB_HUB_REQ_STOP_TT			11
+
+/* Table 11-17: Hub Class Feature Selectors (hub) */
+#define USB_HUB_FEAT_C_HUB_LOCAL_POWER		0
+#define USB_HUB_FEAT_C_HUB_OVER_CURRENT		1
+
+/* Table 11-17: Hub Class Feature Selectors (port) */
+#define USB_HUB_FEAT_PORT_CONNECTION		0
+#define USB_HUB_FEAT_PORT_ENABLE		1
+#define USB_HUB_FEAT_PORT_SUSPEND		2
+#define USB_HUB_FEAT_PORT_OVER_CURRENT		3
+#define USB_HUB_FEAT_PORT_RESET			4
+#define USB_HUB_FEAT_PORT_POWER			8
+#define USB_HUB_FEAT_PORT_LOW_SPEED		9
+#define USB_HUB_FEAT_C_PORT_CONNECTION		16
+#define USB_HUB_FEAT_C_PORT_ENABLE		17
+#define USB_HUB_FEAT_C_PORT_SUSPEND		18
+#define USB_HUB_FEAT_C_PORT_OVER_CURRENT	19
+#define USB_HUB_FEAT_C_PORT_RESET		20
+#define USB_HUB_FEAT_PORT_TEST			21
+#define USB_HUB_FEAT_PORT_INDICATOR		22
+
+/* Table 11-21: Port Status Field, wPortStatus */
+#define USB_HUB_PORT_STATUS_CONNECTION		(1 << 0)
+#define USB_HUB_PORT_STATUS_ENABLE		(1 << 1)
+#define USB_HUB_PORT_STATUS_SUSPEND		(1 << 2)
+#define USB_HUB_PORT_STATUS_OVER_CURRENT	(1 << 3)
+#define USB_HUB_PORT_STATUS_RESET		(1 << 4)
+#define USB_HUB_PORT_STATUS_POWER		(1 << 8)
+#define USB_HUB_PORT_STATUS_LOW_SPEED		(1 << 9)
+#define USB_HUB_PORT_STATUS_HIGH_SPEED		(1 << 10)
+#define USB_HUB_PORT_STATUS_TEST		(1 << 11)
+#define USB_HUB_PORT_STATUS_INDICATOR		(1 << 12)
+
+/* Table 11-22: Port Change Field, wPortChange */
+#define USB_HUB_PORT_CHANGE_CONNECTION		(1 << 0)
+#define USB_HUB_PORT_CHANGE_ENABLE		(1 << 1)
+#define USB_HUB_PORT_CHANGE_SUSPEND		(1 << 2)
+#define USB_HUB_PORT_CHANGE_OVER_CURRENT	(1 << 3)
+#define USB_HUB_PORT_CHANGE_RESET		(1 << 4)
+
+/* Table 11-13: wHubCharacteristics */
+#define USB_HUB_CHAR_POWER_MASK			0x0003
+#define USB_HUB_CHAR_POWER_GANGED		0x0000
+#define USB_HUB_CHAR_POWER_INDIVIDUAL		0x0001
+#define USB_HUB_CHAR_COMPOUND			0x0004
+#define USB_HUB_CHAR_OVER_CURRENT_MASK		0x0018
+#define USB_HUB_CHAR_TT_THINK_TIME_MASK		0x0060
+#define USB_HUB_CHAR_PORT_INDICATOR		0x0080
+
+/* Table 11-13: Hub Descriptor (variable part not included) */
+struct usb_hub_descriptor {
+	uint8_t bDescLength;
+	uint8_t bDescriptorType;
+	uint8_t bNbrPorts;
+	uint16_t wHubCharacteristics;
+	uint8_t bPwrOn2PwrGood;
+	uint8_t bHubContrCurrent;
+	/* DeviceRemovable and PortPwrCtrlMask follow */
+} __attribute__((packed));
+
+#define USB_DT_HUB_SIZE 7
+
+/* Table 11-19 and 11-20: Hub and Port Status (GET_STATUS) */
+struct usb_hub_status {
+	uint16_t wStatus;
+	uint16_t wChange;
+} __attribute__((packed));
+
+#endif
+
+/**@}*/
@@ -62,6 +62,7 @@ LGPL License Terms @ref lgpl_license
 #define USB_MSC_PROTOCOL_CBI		0x00
 #define USB_MSC_PROTOCOL_CBI_ALT	0x01
 #define USB_MSC_PROTOCOL_BBB		0x50
+#define USB_MSC_PROTOCOL_UAS		0x62
 
 /* (B) Table 4.1 Mass Storage Request Codes */
 #define USB_MSC_REQ_CODES_ADSC		0x00
@@ -133,6 +134,117 @@ struct usb_msc_csw {
 	uint8_t  bCSWStatus;
 } __attribute__((packed));
 
+/* SCSI status (SAM) */
+#define USB_MSC_SCSI_STATUS_GOOD			0x00
+#define USB_MSC_SCSI_STATUS_CHECK_CONDITION		0x02
+#define USB_MSC_SCSI_STATUS_TASK_SET_FULL		0x28
+
+/*
+ * Definitions of USB Attached SCSI from:
+ *
+ * (C) "Universal Serial Bus Mass Storage Class - USB Attached SCSI
+ *      Protocol (UASP) Revision 1.0"
+ *
+ * (D) "T10/2095-D USB Attached SCSI (UAS)"
+ *
+ * Multi-byte fields of the information units are big endian.
+ */
+
+/* (C) 5.3.3.1: Pipe Usage Class Specific Descriptor */
+#define USB_MSC_DT_PIPE_USAGE			0x24
+
+/* (C) Table 9: Pipe ID */
+#define USB_MSC_PIPE_ID_COMMAND			0x01
+#define USB_MSC_PIPE_ID_STATUS			0x02
+#define USB_MSC_PIPE_ID_DATA_IN			0x03
+#define USB_MSC_PIPE_ID_DATA_OUT		0x04
+
+struct usb_msc_pipe_usage_descriptor {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint8_t bPipeID;
+	uint8_t Reserved;
+} __attribute__((packed));
+
+/* (D) Table 9: IU ID field */
+#define USB_MSC_UAS_IU_COMMAND			0x01
+#define USB_MSC_UAS_IU_SENSE			0x03
+#define USB_MSC_UAS_IU_RESPONSE			0x04
+#define USB_MSC_UAS_IU_TASK_MANAGEMENT		0x05
+#define USB_MSC_UAS_IU_READ_READY		0x06
+#define USB_MSC_UAS_IU_WRITE_READY		0x07
+
+/* (D) Table 10: COMMAND IU */
+struct usb_msc_uas_command_iu {
+	uint8_t bIUID;
+	uint8_t bReserved1;
+	uint16_t wTag;
+	uint8_t bTaskAttribute;
+	uint8_t bReserved5;
+	uint8_t bAddCDBLength;
+	uint8_t bReserved7;
+	uint8_t LUN[8];
+	uint8_t CDB[16];
+} __attribute__((packed));
+
+/* (D) Table 14: SENSE IU (followed by wLength bytes of sense data) */
+struct usb_msc_uas_sense_iu {
+	uint8_t bIUID;
+	uint8_t bReserved1;
+	uint16_t wTag;
+	uint16_t wStatusQualifier;
+	uint8_t bStatus;
+	uint8_t bReserved7[7];
+	uint16_t wLength;
+} __attribute__((packed));
+
+/* (D) Table 16: RESPONSE IU */
+struct usb_msc_uas_response_iu {
+	uint8_t bIUID;
+	uint8_t bReserved1;
+	uint16_t wTag;
+	uint8_t AdditionalResponseInfo[3];
+	uint8_t bResponseCode;
+} __attribute__((packed));
+
+/* (D) Table 12: TASK MANAGEMENT IU */
+struct usb_msc_uas_task_management_iu {
+	uint8_t bIUID;
+	uint8_t bReserved1;
+	uint16_t wTag;
+	uint8_t bFunction;
+	uint8_t bReserved5;
+	uint16_t wTagOfManagedTask;
+	uint8_t LUN[8];
+} __attribute__((packed));
+
+/* (D) Table 18/19: READ READY IU, WRITE READY IU */
+struct usb_msc_uas_ready_iu {
+	uint8_t bIUID;
+	uint8_t bReserved1;
+	uint16_t wTag;
+} __attribute__((packed));
+
+/* (D) Table 13: Task management function */
+#define USB_MSC_UAS_TMF_ABORT_TASK		0x01
+#define USB_MSC_UAS_TMF_ABORT_TASK_SET		0x02
+#define USB_MSC_UAS_TMF_CLEAR_TASK_SET		0x04
+#define USB_MSC_UAS_TMF_LOGICAL_UNIT_RESET	0x08
+#define USB_MSC_UAS_TMF_I_T_NEXUS_RESET		0x10
+#define USB_MSC_UAS_TMF_CLEAR_ACA		0x40
+#define USB_MSC_UAS_TMF_QUERY_TASK		0x80
+#define USB_MSC_UAS_TMF_QUERY_TASK_SET		0x81
+#define USB_MSC_UAS_TMF_QUERY_ASYNC_EVENT	0x82
+
+/* (D) Table 17: RESPONSE CODE */
+#define USB_MSC_UAS_RC_TMF_COMPLETE		0x00
+#define USB_MSC_UAS_RC_INVALID_IU		0x02
+#define USB_MSC_UAS_RC_TMF_NOT_SUPPORTED	0x04
+#define USB_MSC_UAS_RC_TMF_FAILED		0x05
+#define USB_MSC_UAS_RC_TMF_SUCCEEDED		0x08
+#define USB_MSC_UAS_RC_INCORRECT_LUN		0x09
+#define USB_MSC_UAS_RC_OVERLAPPED_TAG		0x0A
+
 #endif
 
 /**@}*/
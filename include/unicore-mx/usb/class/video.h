@@ -0,0 +1,190 @@
+/** @defgroup usb_video_defines USB Video Type Definitions
+
+@brief <b>Defined Constants and Types for the USB Video Type Definitions</b>
+
+@ingroup USB_defines
+
+LGPL License Terms @ref lgpl_license
+*/
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USB_CLASS_VIDEO_H
+#define UNICOREMX_USB_CLASS_VIDEO_H
+
+#include <stdint.h>
+
+/*
+ * Definitions from the USB_VIDEO_ or usb_video_ namespace come from:
+ * "Universal Serial Bus Device Class Definition for Video Devices,
+ *  Revision 1.5"
+ */
+
+/* Table A-1: Video Interface Class Code */
+#define USB_CLASS_VIDEO				0x0E
+
+/* Table A-2: Video Interface Subclass Codes */
+#define USB_VIDEO_SUBCLASS_UNDEFINED		0x00
+#define USB_VIDEO_SUBCLASS_VIDEOCONTROL		0x01
+#define USB_VIDEO_SUBCLASS_VIDEOSTREAMING	0x02
+#define USB_VIDEO_SUBCLASS_INTERFACE_COLLECTION	0x03
+
+/* Table A-3: Video Interface Protocol Codes */
+#define USB_VIDEO_PROTOCOL_UNDEFINED		0x00
+#define USB_VIDEO_PROTOCOL_15			0x01
+
+/* Table A-4: Video Class-Specific Descriptor Types */
+#define USB_VIDEO_DT_CS_UNDEFINED		0x20
+#define USB_VIDEO_DT_CS_DEVICE			0x21
+#define USB_VIDEO_DT_CS_CONFIGURATION		0x22
+#define USB_VIDEO_DT_CS_STRING			0x23
+#define USB_VIDEO_DT_CS_INTERFACE		0x24
+#define USB_VIDEO_DT_CS_ENDPOINT		0x25
+
+/* Table A-5: Video Class-Specific VC Interface Descriptor Subtypes */
+#define USB_VIDEO_VC_DESCRIPTOR_UNDEFINED	0x00
+#define USB_VIDEO_VC_HEADER			0x01
+#define USB_VIDEO_VC_INPUT_TERMINAL		0x02
+#define USB_VIDEO_VC_OUTPUT_TERMINAL		0x03
+#define USB_VIDEO_VC_SELECTOR_UNIT		0x04
+#define USB_VIDEO_VC_PROCESSING_UNIT		0x05
+#define USB_VIDEO_VC_EXTENSION_UNIT		0x06
+#define USB_VIDEO_VC_ENCODING_UNIT		0x07
+
+/* Table A-6: Video Class-Specific VS Interface Descriptor Subtypes */
+#define USB_VIDEO_VS_UNDEFINED			0x00
+#define USB_VIDEO_VS_INPUT_HEADER		0x01
+#define USB_VIDEO_VS_OUTPUT_HEADER		0x02
+#define USB_VIDEO_VS_STILL_IMAGE_FRAME		0x03
+#define USB_VIDEO_VS_FORMAT_UNCOMPRESSED	0x04
+#define USB_VIDEO_VS_FRAME_UNCOMPRESSED		0x05
+#define USB_VIDEO_VS_FORMAT_MJPEG		0x06
+#define USB_VIDEO_VS_FRAME_MJPEG		0x07
+#define USB_VIDEO_VS_FORMAT_MPEG2TS		0x0A
+#define USB_VIDEO_VS_FORMAT_DV			0x0C
+#define USB_VIDEO_VS_COLORFORMAT		0x0D
+#define USB_VIDEO_VS_FORMAT_FRAME_BASED		0x10
+#define USB_VIDEO_VS_FRAME_FRAME_BASED		0x11
+#define USB_VIDEO_VS_FORMAT_STREAM_BASED	0x12
+
+/* Table A-8: Video Class-Specific Request Codes */
+#define USB_VIDEO_REQ_UNDEFINED			0x00
+#define USB_VIDEO_REQ_SET_CUR			0x01
+#define USB_VIDEO_REQ_SET_CUR_ALL		0x11
+#define USB_VIDEO_REQ_GET_CUR			0x81
+#define USB_VIDEO_REQ_GET_MIN			0x82
+#define USB_VIDEO_REQ_GET_MAX			0x83
+#define USB_VIDEO_REQ_GET_RES			0x84
+#define USB_VIDEO_REQ_GET_LEN			0x85
+#define USB_VIDEO_REQ_GET_INFO			0x86
+#define USB_VIDEO_REQ_GET_DEF			0x87
+#define USB_VIDEO_REQ_GET_CUR_ALL		0x91
+#define USB_VIDEO_REQ_GET_MIN_ALL		0x92
+#define USB_VIDEO_REQ_GET_MAX_ALL		0x93
+#define USB_VIDEO_REQ_GET_RES_ALL		0x94
+#define USB_VIDEO_REQ_GET_DEF_ALL		0x97
+
+/* Table A-16: VideoStreaming Interface Control Selectors */
+#define USB_VIDEO_VS_CONTROL_UNDEFINED		0x00
+#define USB_VIDEO_VS_PROBE_CONTROL		0x01
+#define USB_VIDEO_VS_COMMIT_CONTROL		0x02
+#define USB_VIDEO_VS_STILL_PROBE_CONTROL	0x03
+#define USB_VIDEO_VS_STILL_COMMIT_CONTROL	0x04
+#define USB_VIDEO_VS_STILL_IMAGE_TRIGGER_CONTROL 0x05
+#define USB_VIDEO_VS_STREAM_ERROR_CODE_CONTROL	0x06
+#define USB_VIDEO_VS_GENERATE_KEY_FRAME_CONTROL	0x07
+#define USB_VIDEO_VS_UPDATE_FRAME_SEGMENT_CONTROL 0x08
+#define USB_VIDEO_VS_SYNCH_DELAY_CONTROL	0x09
+
+/* 4.1.2: GET_INFO capabilities */
+#define USB_VIDEO_INFO_SUPPORTS_GET		(1 << 0)
+#define USB_VIDEO_INFO_SUPPORTS_SET		(1 << 1)
+#define USB_VIDEO_INFO_DISABLED			(1 << 2)
+#define USB_VIDEO_INFO_AUTOUPDATE		(1 << 3)
+#define USB_VIDEO_INFO_ASYNCHRONOUS		(1 << 4)
+
+/* Table 4-47: Video Probe and Commit Controls */
+struct usb_video_probe_commit_control {
+	uint16_t bmHint;
+	uint8_t bFormatIndex;
+	uint8_t bFrameIndex;
+	uint32_t dwFrameInterval;
+	uint16_t wKeyFrameRate;
+	uint16_t wPFrameRate;
+	uint16_t wCompQuality;
+	uint16_t wCompWindowSize;
+	uint16_t wDelay;
+	uint32_t dwMaxVideoFrameSize;
+	uint32_t dwMaxPayloadTransferSize;
+	/* Revision 1.1 */
+	uint32_t dwClockFrequency;
+	uint8_t bmFramingInfo;
+	uint8_t bPreferedVersion;
+	uint8_t bMinVersion;
+	uint8_t bMaxVersion;
+	/* Revision 1.5 */
+	uint8_t bUsage;
+	uint8_t bBitDepthLuma;
+	uint8_t bmSettings;
+	uint8_t bMaxNumberOfRefFramesPlus1;
+	uint16_t bmRateControlModes;
+	uint64_t bmLayoutPerStream;
+} __attribute__((packed));
+
+/* Size of the probe and commit controls per revision */
+#define USB_VIDEO_PROBE_COMMIT_SIZE_10		26
+#define USB_VIDEO_PROBE_COMMIT_SIZE_11		34
+#define USB_VIDEO_PROBE_COMMIT_SIZE_15		48
+
+/* bmHint */
+#define USB_VIDEO_HINT_FRAME_INTERVAL		(1 << 0)
+#define USB_VIDEO_HINT_KEY_FRAME_RATE		(1 << 1)
+#define USB_VIDEO_HINT_P_FRAME_RATE		(1 << 2)
+#define USB_VIDEO_HINT_COMP_QUALITY		(1 << 3)
+#define USB_VIDEO_HINT_COMP_WINDOW_SIZE		(1 << 4)
+
+/* bmFramingInfo */
+#define USB_VIDEO_FRAMING_FID			(1 << 0)
+#define USB_VIDEO_FRAMING_EOF			(1 << 1)
+
+/*
+ * Definitions from "Universal Serial Bus Device Class Definition for
+ *  Video Devices: Payload Header, Revision 1.5"
+ */
+
+/* 2.4.3.3: Video and Still Image Payload Headers, bmHeaderInfo */
+#define USB_VIDEO_PAYLOAD_FID			(1 << 0)
+#define USB_VIDEO_PAYLOAD_EOF			(1 << 1)
+#define USB_VIDEO_PAYLOAD_PTS			(1 << 2)
+#define USB_VIDEO_PAYLOAD_SCR			(1 << 3)
+#define USB_VIDEO_PAYLOAD_RES			(1 << 4)
+#define USB_VIDEO_PAYLOAD_STI			(1 << 5)
+#define USB_VIDEO_PAYLOAD_ERR			(1 << 6)
+#define USB_VIDEO_PAYLOAD_EOH			(1 << 7)
+
+/* Payload header without PTS and SCR */
+struct usb_video_payload_header {
+	uint8_t bHeaderLength;
+	uint8_t bmHeaderInfo;
+} __attribute__((packed));
+
+#endif
+
+/**@}*/
@@ -0,0 +1,278 @@
+/**
+ * @defgroup usbd_audio_defines USB Audio Device Class
+ *
+ * @brief <b>Isochronous audio streaming with asynchronous feedback</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_AUDIO_H
+#define UNICOREMX_USBD_AUDIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/audio.h>
+
+/*
+ * One object stream one direction of an audio streaming interface
+ *  (Audio Class 1.0 or 2.0, the topology and descriptors are left to
+ *  application):
+ *
+ * Playback (isochronous OUT, host to device):
+ *   Packets are appended to the ring from usbd_poll() context.
+ *   The I2S/DAC DMA half (or complete) interrupt call usbd_audio_dma_fill()
+ *   to copy the next block out of the ring (silence till the ring reach
+ *   the target fill, and on underrun).
+ *   The device is the clock master (asynchronous): the number of samples
+ *   per (micro)frame the host should send is measured between SOF and
+ *   sent on the feedback endpoint, corrected to keep the ring at the
+ *   target fill.
+ *
+ * Capture (isochronous IN, device to host):
+ *   The I2S/ADC DMA interrupt call usbd_audio_dma_drain() to append the
+ *   block to the ring, each packet take the samples due for the
+ *   (micro)frame (+/- one sample to keep the ring at the target fill).
+ *
+ * The samples are copied in blocks (memcpy), there is no per-sample work.
+ * Ring index are free running and each is written by one side only, so
+ *  the DMA hooks do not mask interrupts.
+ *
+ * The application should prepare the endpoints (usbd_ep_prepare()) and call
+ *  usbd_audio_start() when the streaming alternate setting is selected
+ *  (usbd_audio_stop() for the zero bandwidth setting), forward SETUP to
+ *  usbd_audio_setup_ep0() and SOF to usbd_audio_sof().
+ */
+
+typedef struct usbd_audio usbd_audio;
+
+/**
+ * Read the audio clock
+ * @param[in] audio Audio
+ * @return free running count of samples (frames) of the audio clock
+ */
+typedef uint32_t (*usbd_audio_clock_callback)(usbd_audio *audio);
+
+/**
+ * Called from usbd_poll() context when host change the sampling frequency
+ *  (audio->rate), application should reprogram the audio clock.
+ */
+typedef void (*usbd_audio_rate_callback)(usbd_audio *audio);
+
+struct usbd_audio_config {
+	/** Isochronous data endpoint address (OUT: playback, IN: capture) */
+	uint8_t ep_addr;
+
+	/** Data endpoint size (room for one sample more than nominal) */
+	uint16_t ep_size;
+
+	/** Isochronous feedback IN endpoint address (playback, 0 = none) */
+	uint8_t ep_feedback;
+
+	/** Sampling frequency (Hz) */
+	uint32_t rate;
+
+	/** Bytes per audio frame (channels * subframe size) */
+	uint8_t frame_bytes;
+
+	/** Ring (32bit aligned) */
+	void *buffer;
+
+	/** Ring size in bytes (power of 2) */
+	size_t size;
+
+	/** Ring fill to maintain in bytes (0 = size / 2) */
+	size_t target;
+
+	/** Packet buffers (32bit aligned, 2 * @a ep_size bytes) */
+	void *packet_buffer;
+
+	/** SOF periods between feedback measurement (< 2048, 0 = 64) */
+	uint16_t feedback_period;
+
+	/**
+	 * Audio clock (can be NULL)
+	 * If NULL, the clock is the number of samples moved by the DMA hooks
+	 *  (resolution of one DMA block).
+	 */
+	usbd_audio_clock_callback clock;
+
+	/** Sampling frequency changed (can be NULL) */
+	usbd_audio_rate_callback rate_callback;
+};
+
+typedef struct usbd_audio_config usbd_audio_config;
+
+struct usbd_audio_stats {
+	/** Isochronous packets transferred */
+	uint32_t packets;
+
+	/** Isochronous packets failed (data dropped) */
+	uint32_t errors;
+
+	/** Bytes dropped because the ring was full */
+	uint32_t dropped;
+
+	/** DMA blocks padded with silence (playback: ring empty or priming) */
+	uint32_t silence;
+
+	/** Feedback value updated */
+	uint32_t feedback_updates;
+};
+
+typedef struct usbd_audio_stats usbd_audio_stats;
+
+/**
+ * Audio object.
+ */
+struct usbd_audio {
+	usbd_device *dev;
+	usbd_audio_config config;
+
+	/** Current sampling frequency (Hz) */
+	uint32_t rate;
+
+	/** Streaming (started and not stopped by configuration change) */
+	bool running;
+
+	/** SOF per second (1000 full speed, 8000 high speed) */
+	uint16_t sof_rate;
+
+	/** Fraction bits of feedback value (14: 10.14, 16: 16.16) */
+	uint8_t feedback_shift;
+
+	/** Isochronous URB in flight (data endpoint) */
+	uint8_t urbs;
+
+	struct {
+		uint32_t head; /**< Written (playback: usbd_poll(), capture: DMA) */
+		uint32_t tail; /**< Read (playback: DMA, capture: usbd_poll()) */
+	} ring;
+
+	struct {
+		uint32_t samples; /**< Samples moved by the DMA hooks */
+		bool primed; /**< Playback: ring reached target after underrun */
+	} dma;
+
+	/** Capture: fraction of sample carried to the next packet */
+	uint32_t acc;
+
+	struct {
+		uint32_t nominal; /**< rate / sof_rate (fixed point) */
+		uint32_t measured; /**< Audio clock per SOF period (fixed point) */
+		uint32_t value; /**< Sent to host (fixed point) */
+		uint32_t clock; /**< Audio clock at start of measurement */
+		uint16_t frame; /**< Frame number at start of measurement */
+		bool started; /**< Measurement started */
+		uint8_t packet[4]; /**< Feedback packet (little endian) */
+	} feedback;
+
+	/** SET_CUR/GET_CUR sampling frequency (3 bytes, little endian) */
+	uint8_t freq[4];
+
+	usbd_audio_stats stats;
+};
+
+/**
+ * Initialize audio streaming
+ * @param[out] audio Audio
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_audio_init(usbd_audio *audio, usbd_device *dev,
+				const usbd_audio_config *config);
+
+/**
+ * Handle the endpoint sampling frequency control (Audio Class 1.0)
+ * @param[in] audio Audio
+ * @param[in] setup_data Setup data
+ * @return true if handled, false if the request is not for the class
+ */
+bool usbd_audio_setup_ep0(usbd_audio *audio,
+				const struct usb_setup_data *setup_data);
+
+/**
+ * Change the sampling frequency (Audio Class 2.0 clock source request)
+ * @param[in] audio Audio
+ * @param[in] rate Sampling frequency (Hz)
+ */
+void usbd_audio_set_rate(usbd_audio *audio, uint32_t rate);
+
+/**
+ * Start streaming (streaming alternate setting selected)
+ * @param[in] audio Audio
+ * @note Before calling this function, application should prepare the endpoints.
+ */
+void usbd_audio_start(usbd_audio *audio);
+
+/**
+ * Stop streaming (zero bandwidth alternate setting selected)
+ * @param[in] audio Audio
+ */
+void usbd_audio_stop(usbd_audio *audio);
+
+/**
+ * Measure the audio clock against SOF and update the feedback value
+ * Call from the SOF callback.
+ * @param[in] audio Audio
+ */
+void usbd_audio_sof(usbd_audio *audio);
+
+/**
+ * Playback: copy the next block to the DMA buffer (DMA interrupt)
+ * Silence is written if the ring do not hold enough data.
+ * @param[in] audio Audio
+ * @param[out] buf DMA buffer
+ * @param[in] len Length in bytes (multiple of frame_bytes)
+ * @return number of bytes copied from the ring
+ */
+size_t usbd_audio_dma_fill(usbd_audio *audio, void *buf, size_t len);
+
+/**
+ * Capture: append a DMA block to the ring (DMA interrupt)
+ * @param[in] audio Audio
+ * @param[in] buf DMA buffer
+ * @param[in] len Length in bytes (multiple of frame_bytes)
+ * @return number of bytes appended (rest is dropped)
+ */
+size_t usbd_audio_dma_drain(usbd_audio *audio, const void *buf, size_t len);
+
+/**
+ * Current feedback value (samples per SOF period)
+ * @param[in] audio Audio
+ * @return 10.14 (full speed) or 16.16 (high speed) fixed point
+ */
+uint32_t usbd_audio_get_feedback(usbd_audio *audio);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] audio Audio
+ * @param[out] stats Statistics
+ */
+void usbd_audio_get_stats(usbd_audio *audio, usbd_audio_stats *stats);
+
+#endif
+
+/**@}*/
@@ -0,0 +1,267 @@
+/**
+ * @defgroup usbd_cdc_acm_defines USB CDC-ACM Device Class
+ *
+ * @brief <b>CDC Abstract Control Model (virtual serial port)</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_CDC_ACM_H
+#define UNICOREMX_USBD_CDC_ACM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/cdc.h>
+
+/*
+ * The class own the bulk IN and bulk OUT endpoint of the data interface.
+ * (descriptors and the notification endpoint are left to application)
+ *
+ * TX (device to host):
+ *   usbd_cdc_acm_write() copy data into the TX ring (single producer).
+ *   Whole packets are sent as soon as possible, directly from the ring,
+ *   with upto 2 URB queued so the endpoint never idle between URB.
+ *   A partial packet is held back till more data arrive (coalescing)
+ *   or till it has waited @a flush_us (or usbd_cdc_acm_flush()).
+ *
+ * RX (host to device):
+ *   OUT URB are submitted directly into the RX slots (2 queued).
+ *   usbd_cdc_acm_read() copy data out of the slots in order (single
+ *   consumer). Host get NAK when all the slots are full.
+ *
+ * usbd_cdc_acm_write(), usbd_cdc_acm_read() and usbd_cdc_acm_flush() are
+ *  lock-free: they only move the ring index of the application side and
+ *  never submit URB, so they can be called from any (single) context
+ *  without masking interrupts.
+ * URB are submitted from usbd_poll() context: transfer callbacks and
+ *  usbd_cdc_acm_poll(), which the application call after usbd_poll()
+ *  (same context) with the elapsed time.
+ *
+ * The application should prepare the endpoints (usbd_ep_prepare()) and
+ *  call usbd_cdc_acm_start() in set-config callback, and forward SETUP
+ *  to usbd_cdc_acm_setup_ep0().
+ */
+
+/** Maximum number of RX slots */
+#define USBD_CDC_ACM_RX_SLOTS_MAX 8
+
+typedef struct usbd_cdc_acm usbd_cdc_acm;
+
+/**
+ * Called from usbd_poll() context when a transfer complete
+ *  (RX: data become available, TX: space become available)
+ */
+typedef void (*usbd_cdc_acm_callback)(usbd_cdc_acm *acm);
+
+/**
+ * Called from usbd_poll() context when host change the line coding or
+ *  the control line state (SET_LINE_CODING, SET_CONTROL_LINE_STATE)
+ */
+typedef void (*usbd_cdc_acm_line_callback)(usbd_cdc_acm *acm);
+
+struct usbd_cdc_acm_config {
+	/** Bulk IN endpoint address (data to host) */
+	uint8_t ep_in;
+
+	/** Bulk OUT endpoint address (data from host) */
+	uint8_t ep_out;
+
+	/** Bulk endpoints size */
+	uint16_t ep_size;
+
+	/** Communication interface number (wIndex of class requests) */
+	uint8_t interface;
+
+	/** TX ring (32bit aligned) */
+	void *tx_buffer;
+
+	/** TX ring size in bytes (power of 2 or rounded down, multiple of
+	 *  @a ep_size) */
+	size_t tx_size;
+
+	/** Maximum bytes per IN URB (multiple of @a ep_size, 0 = tx_size / 2) */
+	size_t tx_chunk;
+
+	/** RX slots (32bit aligned, @a rx_slots * @a rx_chunk bytes) */
+	void *rx_buffer;
+
+	/** Bytes per RX slot (multiple of @a ep_size) */
+	size_t rx_chunk;
+
+	/** Number of RX slots (power of 2 or rounded down,
+	 *  2 - USBD_CDC_ACM_RX_SLOTS_MAX) */
+	uint8_t rx_slots;
+
+	/** Time a partial packet can wait for more data (0 = never wait) */
+	uint32_t flush_us;
+
+	/** Transfer complete (can be NULL) */
+	usbd_cdc_acm_callback callback;
+
+	/** Line coding or control line state changed (can be NULL) */
+	usbd_cdc_acm_line_callback line_callback;
+};
+
+typedef struct usbd_cdc_acm_config usbd_cdc_acm_config;
+
+struct usbd_cdc_acm_stats {
+	/** Bytes dropped by usbd_cdc_acm_write() (TX ring full) */
+	uint32_t tx_dropped;
+
+	/** Partial packets sent (flush timer or usbd_cdc_acm_flush()) */
+	uint32_t tx_flushes;
+
+	/** Number of URB failed (TX: data dropped) */
+	uint32_t errors;
+
+	/** RX endpoint went idle because all slots were full (host get NAK) */
+	uint32_t rx_overrun;
+
+	/** Number of URB completed successfully */
+	uint32_t urbs;
+
+	/** Bytes sent to host */
+	uint64_t tx_bytes;
+
+	/** Bytes received from host */
+	uint64_t rx_bytes;
+};
+
+typedef struct usbd_cdc_acm_stats usbd_cdc_acm_stats;
+
+/**
+ * CDC-ACM object.
+ * Ring index are free running, each is written by only one side
+ *  (application or usbd_poll() context).
+ */
+struct usbd_cdc_acm {
+	usbd_device *dev;
+	usbd_cdc_acm_config config;
+
+	/** Set by host (SET_LINE_CODING) */
+	struct usb_cdc_line_coding line_coding;
+
+	/** Set by host (SET_CONTROL_LINE_STATE), USB_CDC_CONTROL_LINE_* */
+	uint16_t line_state;
+
+	/** Started (and not stopped by configuration change or reset) */
+	bool running;
+
+	struct {
+		uint32_t head; /**< Written (application) */
+		uint32_t tail; /**< Sent, URB complete */
+		uint32_t sent; /**< Submitted */
+		uint32_t wait_us; /**< Time since data wait without submission */
+		bool flush; /**< Flush requested (application) */
+		uint8_t urbs; /**< URB in flight */
+
+		/** Bytes upto the next word boundary after a partial packet */
+		uint32_t bounce;
+	} tx;
+
+	struct {
+		uint32_t head; /**< Slots received */
+		uint32_t tail; /**< Slots consumed (application) */
+		uint32_t armed; /**< Slots submitted */
+		size_t pos; /**< Bytes consumed of slot @a tail (application) */
+		size_t len[USBD_CDC_ACM_RX_SLOTS_MAX]; /**< Bytes received per slot */
+	} rx;
+
+	usbd_cdc_acm_stats stats;
+};
+
+/**
+ * Initialize CDC-ACM
+ * Line coding default to 115200 8N1.
+ * @param[out] acm CDC-ACM
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_cdc_acm_init(usbd_cdc_acm *acm, usbd_device *dev,
+				const usbd_cdc_acm_config *config);
+
+/**
+ * Handle the class requests of the communication interface
+ * @param[in] acm CDC-ACM
+ * @param[in] setup_data Setup data
+ * @return true if handled, false if the request is not for the class
+ */
+bool usbd_cdc_acm_setup_ep0(usbd_cdc_acm *acm,
+				const struct usb_setup_data *setup_data);
+
+/**
+ * Start the data transfer (RX slots are armed)
+ * @param[in] acm CDC-ACM
+ * @note Before calling this function, application should prepare the endpoints.
+ */
+void usbd_cdc_acm_start(usbd_cdc_acm *acm);
+
+/**
+ * Run the flush timer and submit the URB that can be submitted
+ * Call from usbd_poll() context, usually right after usbd_poll().
+ * @param[in] acm CDC-ACM
+ * @param[in] us Time elapsed since last call (microseconds)
+ */
+void usbd_cdc_acm_poll(usbd_cdc_acm *acm, uint32_t us);
+
+/**
+ * Write data to TX ring (lock-free)
+ * @param[in] acm CDC-ACM
+ * @param[in] data Data
+ * @param[in] len Length of data
+ * @return number of bytes accepted (rest is dropped, 0 if not started)
+ */
+size_t usbd_cdc_acm_write(usbd_cdc_acm *acm, const void *data, size_t len);
+
+/**
+ * Send the partial packet without waiting for the flush timer (lock-free)
+ * Done by the next usbd_cdc_acm_poll() (or transfer callback).
+ * @param[in] acm CDC-ACM
+ */
+void usbd_cdc_acm_flush(usbd_cdc_acm *acm);
+
+/**
+ * Read data from RX slots (lock-free)
+ * Consumed slots are re-armed by the next usbd_cdc_acm_poll()
+ *  (or transfer callback).
+ * @param[in] acm CDC-ACM
+ * @param[out] data Data
+ * @param[in] len Maximum bytes to read
+ * @return number of bytes read
+ */
+size_t usbd_cdc_acm_read(usbd_cdc_acm *acm, void *data, size_t len);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] acm CDC-ACM
+ * @param[out] stats Statistics
+ * @note Counters are updated from usbd_poll() context, the copy is not atomic
+ */
+void usbd_cdc_acm_get_stats(usbd_cdc_acm *acm, usbd_cdc_acm_stats *stats);
+
+#endif
+
+/**@}*/
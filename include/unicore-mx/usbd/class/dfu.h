@@ -0,0 +1,321 @@
+/**
+ * @defgroup usbd_dfu_defines USB DFU Device Class
+ *
+ * @brief <b>DFU (and DfuSe) device with pipelined flash programming</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_DFU_H
+#define UNICOREMX_USBD_DFU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/dfu.h>
+
+/*
+ * The DFU interface (DFU mode) answer the class requests on EP0, the
+ *  flash is erased and programmed by usbd_dfu_poll() (flash worker),
+ *  called from the main loop while usbd_poll() run in interrupt (or
+ *  between the calls to usbd_poll()).
+ *
+ * Pipeline:
+ *   DNLOAD blocks are received in one of two block buffers. As soon as
+ *   a block is received it is queued to the worker and the next
+ *   GETSTATUS answer dfuDNLOAD-IDLE (bwPollTimeout 0) if the other
+ *   buffer is free: block N is programmed while block N + 1 is received.
+ *   If both buffers are full, GETSTATUS answer dfuDNBUSY with the time
+ *   needed to program the oldest block, estimated from the measured
+ *   erase and program throughput.
+ *   A worker error (erase, program) is reported by the next GETSTATUS.
+ *   The zero length DNLOAD (end of image) wait for the queue to be
+ *   programmed before manifestation.
+ *
+ * Erase:
+ *   The worker erase the sector(s) under a block before programming it,
+ *   and when idle, erase up to erase_ahead bytes after the last block
+ *   (the erase overlap the reception of the next blocks, DFU only).
+ *   With DfuSe, an ERASE command of a sector already erased by the
+ *   worker (and not programmed since) is not repeated.
+ *
+ * The flash is accessed only through the application callbacks
+ *  (sector, erase, program, read), each call should block until the
+ *  operation is done (flash_erase_sector(), flash_program()).
+ */
+
+/** Maximum DNLOAD/UPLOAD block size (wTransferSize) */
+#if !defined(USBD_DFU_TRANSFER_SIZE)
+# define USBD_DFU_TRANSFER_SIZE 2048
+#endif
+
+/** Bytes programmed per call of the program callback */
+#if !defined(USBD_DFU_PROGRAM_CHUNK)
+# define USBD_DFU_PROGRAM_CHUNK 256
+#endif
+
+/** Number of sector sizes with a measured erase time */
+#if !defined(USBD_DFU_SECTOR_SIZES)
+# define USBD_DFU_SECTOR_SIZES 4
+#endif
+
+typedef struct usbd_dfu usbd_dfu;
+
+/**
+ * Get the flash sector containing an address
+ * @param[in] dfu DFU
+ * @param[in] address Address
+ * @param[out] start Sector start address
+ * @param[out] size Sector size
+ * @return false if @a address is not in flash
+ */
+typedef bool (*usbd_dfu_sector_callback)(usbd_dfu *dfu, uint32_t address,
+				uint32_t *start, uint32_t *size);
+
+/**
+ * Erase a flash sector (block till done)
+ * @param[in] dfu DFU
+ * @param[in] start Sector start address
+ * @return false on error
+ */
+typedef bool (*usbd_dfu_erase_callback)(usbd_dfu *dfu, uint32_t start);
+
+/**
+ * Program flash (block till done)
+ * @param[in] dfu DFU
+ * @param[in] address Address
+ * @param[in] data Data (32bit aligned)
+ * @param[in] len Length of @a data (at most USBD_DFU_PROGRAM_CHUNK)
+ * @return false on error
+ */
+typedef bool (*usbd_dfu_program_callback)(usbd_dfu *dfu, uint32_t address,
+				const void *data, size_t len);
+
+/**
+ * Read memory (UPLOAD)
+ * @param[in] dfu DFU
+ * @param[in] address Address
+ * @param[out] buf Buffer
+ * @param[in] len Length to read
+ * @return number of bytes read (less than @a len: end of image)
+ */
+typedef size_t (*usbd_dfu_read_callback)(usbd_dfu *dfu, uint32_t address,
+				void *buf, size_t len);
+
+/**
+ * Manifestation (image complete and programmed, from usbd_poll() context)
+ * @param[in] dfu DFU
+ * @return false if the image is invalid (dfuERROR, errFIRMWARE)
+ */
+typedef bool (*usbd_dfu_manifest_callback)(usbd_dfu *dfu);
+
+/**
+ * DFU_DETACH received
+ * @param[in] dfu DFU
+ * @param[in] timeout wTimeout (milliseconds)
+ */
+typedef void (*usbd_dfu_detach_callback)(usbd_dfu *dfu, uint16_t timeout);
+
+struct usbd_dfu_config {
+	/** Interface number (wIndex of class requests) */
+	uint8_t interface;
+
+	/** DfuSe protocol (address pointer and commands in block 0) */
+	bool dfuse;
+
+	/** Manifestation tolerant (as in functional descriptor) */
+	bool manifest_tolerant;
+
+	/** wTransferSize (as in functional descriptor), <= USBD_DFU_TRANSFER_SIZE */
+	uint16_t transfer_size;
+
+	/** Writable region (DFU: image is written from @a base) */
+	uint32_t base, size;
+
+	/**
+	 * Bytes erased ahead of the last block when the worker is idle
+	 * (0 = none). DFU only (DfuSe host send ERASE commands).
+	 */
+	uint32_t erase_ahead;
+
+	/** Initial throughput estimates (datasheet typical), microseconds per KiB */
+	uint32_t erase_us_per_kb, program_us_per_kb;
+
+	usbd_dfu_sector_callback sector;
+	usbd_dfu_erase_callback erase;
+	usbd_dfu_program_callback program;
+
+	/** UPLOAD (can be NULL, UPLOAD not supported) */
+	usbd_dfu_read_callback read;
+
+	/** Manifestation (can be NULL) */
+	usbd_dfu_manifest_callback manifest;
+
+	/** DETACH (can be NULL) */
+	usbd_dfu_detach_callback detach;
+};
+
+typedef struct usbd_dfu_config usbd_dfu_config;
+
+struct usbd_dfu_stats {
+	/** DNLOAD blocks received */
+	uint32_t blocks;
+
+	/** Bytes programmed */
+	uint32_t programmed;
+
+	/** Sectors erased (including ahead) */
+	uint32_t erased;
+
+	/** DfuSe ERASE commands skipped (sector already erased) */
+	uint32_t erase_skipped;
+
+	/** GETSTATUS answered dfuDNBUSY (both buffers full) */
+	uint32_t busy;
+
+	/** Sum of bwPollTimeout answered (milliseconds) */
+	uint32_t poll_timeout_ms;
+
+	/** Current throughput estimates, microseconds per KiB */
+	uint32_t erase_us_per_kb, program_us_per_kb;
+};
+
+typedef struct usbd_dfu_stats usbd_dfu_stats;
+
+/** Block buffer (private) */
+struct usbd_dfu_block {
+	uint8_t kind; /**< Program, erase (DfuSe) */
+	uint16_t len; /**< Data length */
+	uint16_t done; /**< Bytes programmed */
+	uint32_t address; /**< Destination */
+	uint32_t data[USBD_DFU_TRANSFER_SIZE / 4];
+};
+
+/**
+ * DFU object.
+ */
+struct usbd_dfu {
+	usbd_device *dev;
+	usbd_dfu_config config;
+
+	/** DFU state (STATE_*) and status (DFU_STATUS_*) */
+	uint8_t state, status;
+
+	/** Worker error (DFU_STATUS_*), reported by the next GETSTATUS */
+	uint8_t error;
+
+	/** DFU: offset of the next block. DfuSe: address pointer */
+	uint32_t offset, pointer;
+
+	/** wBlockNum of the DNLOAD in progress */
+	uint16_t block_num;
+
+	/** DfuSe command received (next GETSTATUS answer dfuDNBUSY) */
+	bool command;
+
+	/** Block buffers: queue of jobs for the worker */
+	struct usbd_dfu_block block[2];
+
+	/** Oldest queued block and number of queued blocks */
+	uint8_t head, count;
+
+	/** Worker is executing an operation on the head block */
+	bool working;
+
+	/** Head block should be dropped when the worker is done (ABORT) */
+	bool discard;
+
+	/** Last operation of the worker (timed by the next call) */
+	struct {
+		uint8_t kind; /**< Erase, program */
+		bool running; /**< Flash callback in progress */
+		uint16_t frame; /**< Frame number at start */
+		uint32_t address; /**< Sector start or program address */
+		uint32_t bytes; /**< Sector size or program length */
+		uint32_t estimate; /**< Expected duration (microseconds) */
+	} op;
+
+	/** Measured erase time per sector size (not linear with size) */
+	struct {
+		uint32_t size, us;
+	} erase_time[USBD_DFU_SECTOR_SIZES];
+
+	/** Sectors erased [erased_start, erased_end), not programmed after clean */
+	uint32_t erased_start, erased_end, clean;
+
+	/** End of the last programmed block (erase ahead from here) */
+	uint32_t write_end;
+
+	/** GETSTATUS, GETSTATE, DfuSe command list */
+	uint8_t response[DFU_GETSTATUS_SIZE];
+
+	usbd_dfu_stats stats;
+};
+
+/**
+ * Initialize DFU (state dfuIDLE)
+ * @param[out] dfu DFU
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_dfu_init(usbd_dfu *dfu, usbd_device *dev,
+				const usbd_dfu_config *config);
+
+/**
+ * Handle the DFU class requests
+ * @param[in] dfu DFU
+ * @param[in] setup_data Setup data
+ * @return true if handled, false if the request is not for the class
+ */
+bool usbd_dfu_setup_ep0(usbd_dfu *dfu,
+				const struct usb_setup_data *setup_data);
+
+/**
+ * Flash worker: perform one erase, or program one chunk
+ * Call from main loop (can be preempted by usbd_poll()).
+ * @param[in] dfu DFU
+ * @param[in] us Time elapsed since last call (microseconds),
+ *  used to measure the last operation
+ * @return true if an operation was performed
+ */
+bool usbd_dfu_poll(usbd_dfu *dfu, uint32_t us);
+
+/**
+ * Get the DFU state
+ * @param[in] dfu DFU
+ * @return STATE_*
+ */
+uint8_t usbd_dfu_get_state(usbd_dfu *dfu);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] dfu DFU
+ * @param[out] stats Statistics
+ */
+void usbd_dfu_get_stats(usbd_dfu *dfu, usbd_dfu_stats *stats);
+
+#endif
+
+/**@}*/
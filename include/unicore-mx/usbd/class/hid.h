@@ -0,0 +1,266 @@
+/**
+ * @defgroup usbd_hid_defines USB HID Device Class
+ *
+ * @brief <b>HID device with report queue</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_HID_H
+#define UNICOREMX_USBD_HID_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/hid.h>
+
+/*
+ * A HID interface own the interrupt IN endpoint (and optional interrupt
+ *  OUT endpoint) and answer the HID class requests.
+ *
+ * Input reports:
+ *   Every report ID has one slot. usbd_hid_send() copy the report in its
+ *   slot and queue the slot (FIFO order of the IDs). If the slot is still
+ *   queued (host poll slower than the application produce), the report
+ *   replace the stale one: the host always read the latest report of
+ *   each ID, reports of different IDs do not overtake each other and the
+ *   application never block or get USBD_ERR_RES_UNAVAIL (one URB in flight).
+ *   After SET_IDLE, an unchanged report is not queued and the last report
+ *   is repeated every idle duration (usbd_hid_poll()).
+ *
+ * usbd_hid_send() can be called from main loop and interrupt (interrupts
+ *  are masked for the duration of the call), it submit URB when the
+ *  endpoint is idle, so it should not preempt usbd_poll() (same as
+ *  usbd_stream_write()).
+ *
+ * The application should prepare the endpoints (usbd_ep_prepare()) and
+ *  call usbd_hid_start() in set-config callback, and forward SETUP to
+ *  usbd_hid_setup_ep0() (also answer GET_DESCRIPTOR of the HID and report
+ *  descriptor).
+ */
+
+/** Maximum number of report IDs per interface */
+#define USBD_HID_REPORTS_MAX 8
+
+/** Size of the control buffer (largest feature/output report on EP0) */
+#if !defined(USBD_HID_CONTROL_SIZE)
+# define USBD_HID_CONTROL_SIZE 64
+#endif
+
+typedef struct usbd_hid usbd_hid;
+
+/**
+ * Host read a report on EP0 (GET_REPORT feature, output or input
+ *  report that was never sent)
+ * @param[in] hid HID
+ * @param[in] type USB_REQ_HID_REPORT_TYPE_*
+ * @param[in] id Report ID
+ * @param[out] buf Buffer
+ * @param[in] len Size of @a buf
+ * @return report length, 0 to stall the request
+ */
+typedef size_t (*usbd_hid_get_report_callback)(usbd_hid *hid, uint8_t type,
+				uint8_t id, void *buf, size_t len);
+
+/**
+ * Host sent a report (SET_REPORT on EP0 or output report on interrupt OUT)
+ * @param[in] hid HID
+ * @param[in] type USB_REQ_HID_REPORT_TYPE_*
+ * @param[in] id Report ID
+ * @param[in] data Report (including the ID if the interface use IDs)
+ * @param[in] len Length of @a data
+ */
+typedef void (*usbd_hid_set_report_callback)(usbd_hid *hid, uint8_t type,
+				uint8_t id, const void *data, size_t len);
+
+struct usbd_hid_report {
+	/** Report ID (0 if the interface do not use IDs) */
+	uint8_t id;
+
+	/** Report size in bytes (including the ID byte) */
+	uint16_t size;
+};
+
+typedef struct usbd_hid_report usbd_hid_report;
+
+struct usbd_hid_config {
+	/** Interrupt IN endpoint address */
+	uint8_t ep_in;
+
+	/** Interrupt OUT endpoint address (0 = none) */
+	uint8_t ep_out;
+
+	/** Endpoints size */
+	uint16_t ep_size;
+
+	/** Endpoints interval (as in endpoint descriptor) */
+	uint8_t interval;
+
+	/** Interface number (wIndex of class requests) */
+	uint8_t interface;
+
+	/** Input reports (ID 0 only if there is a single report) */
+	const usbd_hid_report *reports;
+
+	/** Number of input reports (1 - USBD_HID_REPORTS_MAX) */
+	uint8_t report_count;
+
+	/**
+	 * Report buffers (32bit aligned), (report_count + 2) * @a ep_size bytes.
+	 * One slot per input report, the report in flight, and the OUT report.
+	 */
+	void *buffer;
+
+	/** HID descriptor (as in configuration descriptor) */
+	const struct usb_hid_descriptor *hid_descriptor;
+
+	/** Report descriptor */
+	const void *report_descriptor;
+
+	/** Length of @a report_descriptor */
+	uint16_t report_descriptor_len;
+
+	/** GET_REPORT (can be NULL, stall feature/output) */
+	usbd_hid_get_report_callback get_report;
+
+	/** SET_REPORT and output reports (can be NULL) */
+	usbd_hid_set_report_callback set_report;
+};
+
+typedef struct usbd_hid_config usbd_hid_config;
+
+struct usbd_hid_stats {
+	/** Reports sent to host */
+	uint32_t sent;
+
+	/** Reports replaced by a newer report of the same ID before being sent */
+	uint32_t merged;
+
+	/** Reports not queued because unchanged (after SET_IDLE) */
+	uint32_t unchanged;
+
+	/** Reports repeated because the idle duration expired */
+	uint32_t repeated;
+
+	/** URB failed (report lost) */
+	uint32_t errors;
+};
+
+typedef struct usbd_hid_stats usbd_hid_stats;
+
+/**
+ * HID object.
+ */
+struct usbd_hid {
+	usbd_device *dev;
+	usbd_hid_config config;
+
+	/** Set by host (SET_PROTOCOL), USB_REQ_HID_PROTOCOL_* */
+	uint8_t protocol;
+
+	/** Started (and not stopped by configuration change or reset) */
+	bool running;
+
+	/** Interrupt IN URB in flight */
+	bool busy;
+
+	/** Idle duration set for all reports (SET_IDLE with report ID 0) */
+	uint8_t idle;
+
+	struct {
+		uint16_t len; /**< Length of the last report (0: none yet) */
+		bool queued; /**< Waiting in queue */
+		bool idle_set; /**< Host sent SET_IDLE */
+		uint8_t idle; /**< Idle duration (4 ms unit, 0 = infinite) */
+		uint32_t idle_us; /**< Time since last sent */
+	} report[USBD_HID_REPORTS_MAX];
+
+	/** Queued report index, in order */
+	struct {
+		uint8_t head, tail;
+		uint8_t index[USBD_HID_REPORTS_MAX];
+	} queue;
+
+	/** EP0 data stage */
+	uint8_t control[USBD_HID_CONTROL_SIZE];
+
+	/** wValue of the SET_REPORT in progress */
+	uint16_t control_value;
+
+	usbd_hid_stats stats;
+};
+
+/**
+ * Initialize HID
+ * @param[out] hid HID
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_hid_init(usbd_hid *hid, usbd_device *dev,
+				const usbd_hid_config *config);
+
+/**
+ * Handle the HID class requests and HID descriptors requests
+ * @param[in] hid HID
+ * @param[in] setup_data Setup data
+ * @return true if handled, false if the request is not for the class
+ */
+bool usbd_hid_setup_ep0(usbd_hid *hid,
+				const struct usb_setup_data *setup_data);
+
+/**
+ * Start (arm the OUT endpoint, send the queued reports)
+ * @param[in] hid HID
+ * @note Before calling this function, application should prepare the endpoints.
+ */
+void usbd_hid_start(usbd_hid *hid);
+
+/**
+ * Queue an input report
+ * @param[in] hid HID
+ * @param[in] report Report (first byte is the ID if the interface use IDs)
+ * @param[in] len Length of @a report
+ * @return false if the report ID is unknown or @a len too large
+ */
+bool usbd_hid_send(usbd_hid *hid, const void *report, size_t len);
+
+/**
+ * Run the idle timers (repeat of unchanged reports after SET_IDLE)
+ * Call from usbd_poll() context.
+ * @param[in] hid HID
+ * @param[in] us Time elapsed since last call (microseconds)
+ */
+void usbd_hid_poll(usbd_hid *hid, uint32_t us);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] hid HID
+ * @param[out] stats Statistics
+ */
+void usbd_hid_get_stats(usbd_hid *hid, usbd_hid_stats *stats);
+
+#endif
+
+/**@}*/
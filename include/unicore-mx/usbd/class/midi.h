@@ -0,0 +1,279 @@
+/**
+ * @defgroup usbd_midi_defines USB MIDI Device Class
+ *
+ * @brief <b>USB-MIDI streaming with event packet batching</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_MIDI_H
+#define UNICOREMX_USBD_MIDI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/midi.h>
+
+/*
+ * The class own the bulk IN and bulk OUT endpoint of the MIDI streaming
+ *  interface (descriptors and jacks are left to application).
+ *
+ * TX (device to host):
+ *   Messages are converted to 4 byte event packets and appended to the
+ *   TX ring (single producer). Whole bulk packets are sent as soon as
+ *   possible, directly from the ring. A partial packet is held back to
+ *   be filled with the next events, at most @a latency_frames SOF.
+ *   SysEx is streamed: usbd_midi_send_sysex() take any part of the
+ *   message, only the bytes of an incomplete event (at most 2) are
+ *   kept per cable.
+ *
+ * RX (host to device):
+ *   OUT URB are submitted into the RX slots, the events are unpacked
+ *   into one ring of MIDI bytes per cable (SysEx included), read with
+ *   usbd_midi_read(). When a cable ring is full, the unpack wait for
+ *   space (and the host get NAK when all slots are full).
+ *
+ * usbd_midi_send*(), usbd_midi_flush() and usbd_midi_read() are
+ *  lock-free and never submit URB (as usbd_cdc_acm_write()).
+ * URB are submitted from usbd_poll() context: transfer callbacks and
+ *  usbd_midi_sof(), which the application call from the SOF callback.
+ *
+ * The application should prepare the endpoints (usbd_ep_prepare()) and
+ *  call usbd_midi_start() in set-config callback.
+ */
+
+/** Maximum number of cables (virtual MIDI ports) */
+#define USBD_MIDI_CABLES_MAX 16
+
+/** Maximum number of RX slots */
+#define USBD_MIDI_RX_SLOTS_MAX 8
+
+typedef struct usbd_midi usbd_midi;
+
+/**
+ * Called from usbd_poll() context when a transfer complete
+ *  (RX: data become available, TX: space become available)
+ */
+typedef void (*usbd_midi_callback)(usbd_midi *midi);
+
+struct usbd_midi_config {
+	/** Bulk IN endpoint address (events to host) */
+	uint8_t ep_in;
+
+	/** Bulk OUT endpoint address (events from host) */
+	uint8_t ep_out;
+
+	/** Bulk endpoints size */
+	uint16_t ep_size;
+
+	/** Number of cables (1 - USBD_MIDI_CABLES_MAX) */
+	uint8_t cables;
+
+	/** TX ring (32bit aligned) */
+	void *tx_buffer;
+
+	/** TX ring size in bytes (power of 2, multiple of @a ep_size) */
+	size_t tx_size;
+
+	/** SOF a partial packet can wait for more events (0 = 1) */
+	uint8_t latency_frames;
+
+	/** RX slots (32bit aligned, @a rx_slots * @a ep_size bytes) */
+	void *rx_buffer;
+
+	/** Number of RX slots (power of 2, 2 - USBD_MIDI_RX_SLOTS_MAX) */
+	uint8_t rx_slots;
+
+	/** Cable rings, @a cables * @a rx_ring_size bytes */
+	void *rx_ring;
+
+	/** Size of each cable ring (power of 2) */
+	size_t rx_ring_size;
+
+	/** Transfer complete (can be NULL) */
+	usbd_midi_callback callback;
+};
+
+typedef struct usbd_midi_config usbd_midi_config;
+
+struct usbd_midi_stats {
+	/** Events queued for the host */
+	uint32_t tx_events;
+
+	/** Bulk packets sent to host */
+	uint32_t tx_packets;
+
+	/** Events refused (TX ring full) */
+	uint32_t tx_dropped;
+
+	/** Partial packets sent (latency cap or usbd_midi_flush()) */
+	uint32_t tx_flushes;
+
+	/** Events received from host */
+	uint32_t rx_events;
+
+	/** Events ignored (reserved CIN, unknown cable) */
+	uint32_t rx_invalid;
+
+	/** Unpack waited for space in a cable ring */
+	uint32_t rx_waits;
+
+	/** Number of URB failed (TX: events dropped) */
+	uint32_t errors;
+};
+
+typedef struct usbd_midi_stats usbd_midi_stats;
+
+/**
+ * MIDI object.
+ * Ring index are free running, each is written by only one side
+ *  (application or usbd_poll() context).
+ */
+struct usbd_midi {
+	usbd_device *dev;
+	usbd_midi_config config;
+
+	/** Started (and not stopped by configuration change or reset) */
+	bool running;
+
+	struct {
+		uint32_t head; /**< Written (application) */
+		uint32_t tail; /**< Sent, URB complete */
+		uint32_t sent; /**< Submitted */
+		uint8_t frames; /**< SOF since events wait without submission */
+		bool flush; /**< Flush requested (application) */
+		uint8_t urbs; /**< URB in flight */
+
+		/** SysEx bytes of the incomplete event, per cable (application) */
+		struct {
+			uint8_t data[3];
+			uint8_t len;
+		} sysex[USBD_MIDI_CABLES_MAX];
+	} tx;
+
+	struct {
+		uint32_t head; /**< Slots received */
+		uint32_t tail; /**< Slots unpacked */
+		uint32_t armed; /**< Slots submitted */
+		uint16_t pos; /**< Bytes unpacked of slot @a tail */
+		bool waiting; /**< Unpack wait for space in a cable ring */
+		uint16_t len[USBD_MIDI_RX_SLOTS_MAX]; /**< Bytes received per slot */
+
+		/** Cable rings: head (usbd_poll() context), tail (application) */
+		struct {
+			uint32_t head, tail;
+		} ring[USBD_MIDI_CABLES_MAX];
+	} rx;
+
+	usbd_midi_stats stats;
+};
+
+/**
+ * Initialize MIDI
+ * @param[out] midi MIDI
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_midi_init(usbd_midi *midi, usbd_device *dev,
+				const usbd_midi_config *config);
+
+/**
+ * Start the transfer (RX slots are armed)
+ * @param[in] midi MIDI
+ * @note Before calling this function, application should prepare the endpoints.
+ */
+void usbd_midi_start(usbd_midi *midi);
+
+/**
+ * Start of frame: send the partial packet when it has waited enough,
+ *  unpack the received events, submit the URB that can be submitted
+ * Call from the SOF callback (usbd_poll() context).
+ * @param[in] midi MIDI
+ */
+void usbd_midi_sof(usbd_midi *midi);
+
+/**
+ * Queue a USB-MIDI event packet (lock-free)
+ * @param[in] midi MIDI
+ * @param[in] event Event packet (cable number and CIN, 3 MIDI bytes)
+ * @return false if the TX ring is full (or not started)
+ */
+bool usbd_midi_send_event(usbd_midi *midi, const uint8_t event[4]);
+
+/**
+ * Queue a MIDI message (lock-free)
+ * Channel voice and system common/real-time messages, not SysEx.
+ * @param[in] midi MIDI
+ * @param[in] cable Cable number
+ * @param[in] msg Message (status byte first)
+ * @param[in] len Length of @a msg
+ * @return false if the message is invalid or the TX ring is full
+ */
+bool usbd_midi_send(usbd_midi *midi, uint8_t cable, const uint8_t *msg,
+				size_t len);
+
+/**
+ * Queue a part of a SysEx message (lock-free)
+ * The message start with 0xF0 and end with 0xF7, it can be given in
+ *  any number of parts. Bytes of an incomplete event are kept till the
+ *  next part.
+ * @param[in] midi MIDI
+ * @param[in] cable Cable number
+ * @param[in] data Part of the message
+ * @param[in] len Length of @a data
+ * @return number of bytes accepted (less than @a len: TX ring full,
+ *  give the rest again later)
+ */
+size_t usbd_midi_send_sysex(usbd_midi *midi, uint8_t cable,
+				const uint8_t *data, size_t len);
+
+/**
+ * Send the partial packet at the next SOF (lock-free)
+ * @param[in] midi MIDI
+ */
+void usbd_midi_flush(usbd_midi *midi);
+
+/**
+ * Read the MIDI bytes received on a cable (lock-free)
+ * Space freed is used by the next usbd_midi_sof() (or transfer callback).
+ * @param[in] midi MIDI
+ * @param[in] cable Cable number
+ * @param[out] data Data
+ * @param[in] len Maximum bytes to read
+ * @return number of bytes read
+ */
+size_t usbd_midi_read(usbd_midi *midi, uint8_t cable, void *data, size_t len);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] midi MIDI
+ * @param[out] stats Statistics
+ * @note Counters are updated from both sides, the copy is not atomic
+ */
+void usbd_midi_get_stats(usbd_midi *midi, usbd_midi_stats *stats);
+
+#endif
+
+/**@}*/
@@ -49,6 +49,13 @@
 typedef struct usbd_msc usbd_msc;
 typedef struct usbd_msc_backend usbd_msc_backend;
 
+/**
+ * Asynchronous access finished
+ * @param[in] ctx Context given to read_start or write_start
+ * @param[in] result 0 on success
+ */
+typedef void (*usbd_msc_backend_callback)(void *ctx, int result);
+
 /**
  * Information to be provided application code
  * @param vendor_id The SCSI vendor ID to return.  Maximum used length is 8.
@@ -63,6 +70,19 @@ typedef struct usbd_msc_backend usbd_msc_backend;
  * @param format_unit Format the unit (Optional - can be NULL)
  * @param lock Lock. Optional - can be NULL
  * @param unlock Unlock. Optional - can be NULL
+ * @param read_start Start reading @a count blocks from @a lba, @a done is
+ *      called (from any context, possibly before returning) when finished.
+ *      Return 0 if started, else read_block is used.
+ *      Optional - can be NULL
+ * @param write_start Start writing @a count blocks to @a lba, same as
+ *      read_start. Optional - can be NULL
+ * @param write_blocks Write @a count consecutive blocks to @a lba at once
+ *      (ie erase sector). Optional - can be NULL
+ * @param flush Write the data cached by the backend to the medium
+ *      (SYNCHRONIZE CACHE, START STOP UNIT, reset). Optional - can be NULL
+ * @note With read_start/write_start, the backend access of a buffer
+ *      overlap the bus transfers of the other buffers
+ *      (see usbd_msc_set_buffers()).
  */
 struct usbd_msc_backend {
 	const char *vendor_id;
@@ -76,6 +96,28 @@ struct usbd_msc_backend {
 	int (*format_unit)(const usbd_msc_backend *backend);
 	int (*lock)(void);
 	int (*unlock)(void);
+	int (*read_start)(const usbd_msc_backend *backend,
+				uint32_t lba, uint32_t count, void *copy_to,
+				usbd_msc_backend_callback done, void *ctx);
+	int (*write_start)(const usbd_msc_backend *backend,
+				uint32_t lba, uint32_t count, const void *copy_from,
+				usbd_msc_backend_callback done, void *ctx);
+	int (*write_blocks)(const usbd_msc_backend *backend,
+				uint32_t lba, uint32_t count, const void *copy_from);
+	int (*flush)(const usbd_msc_backend *backend);
+};
+
+/** SCSI sense data (private) */
+struct usbd_msc_sense {
+	uint8_t key;
+	uint8_t asc;
+	uint8_t ascq;
+};
+
+/** SCSI logical unit, shared by Bulk-Only and UAS (private) */
+struct usbd_msc_lun {
+	const usbd_msc_backend *backend;
+	struct usbd_msc_sense sense;
 };
 
 usbd_msc *usbd_msc_init(usbd_device *dev,
@@ -88,6 +130,31 @@ bool usbd_msc_setup_ep0(usbd_msc *ms,
 
 void usbd_msc_start(usbd_msc *ms);
 
+/**
+ * Use application buffers for READ and WRITE commands
+ * Transfers are done in chunks of @a blocks blocks. With more than one
+ *  buffer, the next chunks are read ahead (READ) and the next chunks are
+ *  received while the previous is written (WRITE).
+ * Default: a single buffer of a single block (no overlap).
+ * @param[in] ms Mass Storage
+ * @param[in] buffer Buffers (32bit aligned, @a count * @a blocks * 512 bytes)
+ * @param[in] count Number of buffers (atleast 1)
+ * @param[in] blocks Blocks (512 bytes) per buffer (atleast 1)
+ * @note Call before usbd_msc_start()
+ * @note Ignored (previous buffers kept) if @a buffer is NULL, or @a count
+ *  or @a blocks is 0
+ */
+void usbd_msc_set_buffers(usbd_msc *ms, void *buffer, uint8_t count,
+				uint16_t blocks);
+
+/**
+ * Process the backend access finished
+ * Call after usbd_poll() (same context) when the read_start/write_start
+ *  backend hooks finish from another context (interrupt).
+ * @param[in] ms Mass Storage
+ */
+void usbd_msc_poll(usbd_msc *ms);
+
 #endif
 
 /**@}*/
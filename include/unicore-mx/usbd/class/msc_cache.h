@@ -0,0 +1,178 @@
+/**
+ * @defgroup usbd_msc_cache_defines Mass Storage block cache
+ *
+ * @brief <b>Write-back block cache for Mass Storage backends</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_MSC_CACHE_H
+#define UNICOREMX_USBD_MSC_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usbd/class/msc.h>
+
+/*
+ * The cache is a usbd_msc_backend wrapping the backend of the medium
+ *  (given to usbd_msc_init() or usbd_uas_config::backend in its place).
+ *
+ * Read:
+ *   Blocks read are kept in RAM, repeated reads (FAT, directories) do not
+ *   reach the medium. Least recently used block replaced, blocks below
+ *   pin_blocks (boot sector, FAT, root directory) are replaced only when
+ *   every line hold a pinned block.
+ *
+ * Write:
+ *   Write-back: blocks written stay in RAM (dirty) till replaced or
+ *   flushed. A dirty block is written with all the dirty blocks of its
+ *   erase sector (sector_blocks) at once: with the write_blocks hook of
+ *   the medium, a single write cover the first to last dirty block of the
+ *   sector (holes filled from the cache or the medium), else write_block
+ *   is called per dirty block in increasing order.
+ *
+ * Flush:
+ *   SYNCHRONIZE CACHE, START STOP UNIT, Bulk-Only reset and UAS logical
+ *   unit reset (usbd_msc_backend::flush). The application should call
+ *   usbd_msc_cache_flush() on bus reset (usbd_register_reset_callback())
+ *   and before powering down.
+ *
+ * The cache is synchronous (no read_start/write_start): the medium is
+ *  accessed with read_block, write_block and write_blocks.
+ */
+
+typedef struct usbd_msc_cache usbd_msc_cache;
+
+struct usbd_msc_cache_config {
+	/** Backend of the medium, should remain valid */
+	const usbd_msc_backend *backend;
+
+	/**
+	 * RAM of the cache (32bit aligned, @a size bytes).
+	 * Hold the lines (512 bytes and a few bytes of state each) and a
+	 *  sector buffer (sector_blocks * 512 bytes) when the medium has
+	 *  write_blocks and sector_blocks > 1.
+	 */
+	void *buffer;
+	uint32_t size;
+
+	/** Blocks below this LBA are pinned (0 = none) */
+	uint32_t pin_blocks;
+
+	/** Blocks (512 bytes) per erase sector (atleast 1) */
+	uint16_t sector_blocks;
+};
+
+typedef struct usbd_msc_cache_config usbd_msc_cache_config;
+
+struct usbd_msc_cache_stats {
+	/** Blocks read from cache */
+	uint32_t read_hits;
+
+	/** Blocks read from medium */
+	uint32_t read_misses;
+
+	/** Blocks written to a block already in cache */
+	uint32_t write_hits;
+
+	/** Blocks written to a new line */
+	uint32_t write_misses;
+
+	/** Lines replaced */
+	uint32_t evictions;
+
+	/** Sector writes to medium (write_blocks call or write_block run) */
+	uint32_t sector_writes;
+
+	/** Blocks written to medium */
+	uint32_t blocks_written;
+
+	/** Flush requested */
+	uint32_t flushes;
+
+	/** Medium accesses failed */
+	uint32_t errors;
+};
+
+typedef struct usbd_msc_cache_stats usbd_msc_cache_stats;
+
+/** Line (private) */
+struct usbd_msc_cache_line {
+	uint32_t lba;
+
+	/** Last use (LRU) */
+	uint32_t used;
+
+	bool valid;
+	bool dirty;
+};
+
+/**
+ * Cache object.
+ */
+struct usbd_msc_cache {
+	/** Wrapping backend (first member) */
+	usbd_msc_backend backend;
+
+	usbd_msc_cache_config config;
+
+	struct usbd_msc_cache_line *line;
+	uint8_t *data;
+	uint32_t lines;
+
+	/** Sector buffer (NULL: write_block per dirty block) */
+	uint8_t *sector;
+
+	uint32_t clock;
+
+	usbd_msc_cache_stats stats;
+};
+
+/**
+ * Initialize the cache
+ * @param[out] cache Cache
+ * @param[in] config Configuration (copied)
+ * @return Wrapping backend, NULL if @a config::size is too small for a line
+ */
+const usbd_msc_backend *usbd_msc_cache_init(usbd_msc_cache *cache,
+				const usbd_msc_cache_config *config);
+
+/**
+ * Write the dirty blocks to the medium
+ * @param[in] cache Cache
+ * @return 0 on success
+ */
+int usbd_msc_cache_flush(usbd_msc_cache *cache);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] cache Cache
+ * @param[out] stats Statistics
+ */
+void usbd_msc_cache_get_stats(usbd_msc_cache *cache,
+				usbd_msc_cache_stats *stats);
+
+#endif
+
+/**@}*/
@@ -0,0 +1,330 @@
+/**
+ * @defgroup usbd_ncm_defines USB CDC-NCM Device Class
+ *
+ * @brief <b>CDC-NCM network interface with NTB aggregation</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_NCM_H
+#define UNICOREMX_USBD_NCM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/cdc.h>
+
+/*
+ * The NCM function own the bulk IN/OUT endpoints of the data interface
+ *  and the (optional) interrupt endpoint of the communication interface,
+ *  and answer the NCM class requests.
+ *
+ * TX (datagrams to host):
+ *   usbd_ncm_send() add the datagram to the open NTB without copying it:
+ *   a NTB is a scatter-gather transfer (USBD_FLAG_SEGMENTED) made of the
+ *   NTH, the datagrams (padded for alignment) and the NDP at the end.
+ *   The NTB is sent when full (dwNtbInMaxSize or USBD_NCM_TX_DATAGRAMS)
+ *   or when its oldest datagram has waited timeout_us (usbd_ncm_poll()).
+ *   The datagram memory is given back with the tx_done callback once the
+ *   NTB is sent (or dropped).
+ *   USBD_NCM_TX_NTBS NTB are used in turn: one is filled while the
+ *   others are on the bus.
+ *
+ * RX (datagrams from host):
+ *   NTB are received in the RX slots and parsed in place, each datagram
+ *   is given to the rx callback as a pointer into the slot. If the
+ *   callback refuse a datagram (ie no space in the MAC TX queue), the
+ *   parse continue from this datagram at next usbd_ncm_poll(), and the
+ *   host get NAK once all slots are full.
+ *
+ * usbd_ncm_send() and usbd_ncm_poll() can be called from main loop and
+ *  interrupt (interrupts are masked for the duration of the call), they
+ *  submit URB so they should not preempt usbd_poll() (same as
+ *  usbd_hid_send()).
+ *
+ * The application should prepare the endpoints (usbd_ep_prepare()) and
+ *  call usbd_ncm_start() when the data interface alternate setting 1 is
+ *  selected (usbd_ncm_stop() for alternate setting 0), and forward SETUP
+ *  to usbd_ncm_setup_ep0().
+ */
+
+/** Maximum number of datagrams in a NTB sent */
+#if !defined(USBD_NCM_TX_DATAGRAMS)
+# define USBD_NCM_TX_DATAGRAMS 32
+#endif
+
+/** Number of NTB to send (filled in turn) */
+#if !defined(USBD_NCM_TX_NTBS)
+# define USBD_NCM_TX_NTBS 2
+#endif
+
+/** Maximum number of RX slots */
+#define USBD_NCM_RX_SLOTS_MAX 4
+
+/** Smallest dwNtbInMaxSize the host can set (NCM 1.0, 6.2.7) */
+#define USBD_NCM_NTB_IN_SIZE_MIN 2048
+
+typedef struct usbd_ncm usbd_ncm;
+
+/**
+ * Datagram sent (or dropped): memory given to usbd_ncm_send() can be reused
+ * Called from usbd_poll() context (or usbd_ncm_stop()).
+ * @param[in] ncm NCM
+ * @param[in] cookie Cookie given to usbd_ncm_send()
+ */
+typedef void (*usbd_ncm_tx_done_callback)(usbd_ncm *ncm, void *cookie);
+
+/**
+ * Datagram received
+ * Called from usbd_poll() context (or usbd_ncm_poll()).
+ * @param[in] ncm NCM
+ * @param[in] datagram Datagram (Ethernet frame, no CRC), valid till return
+ * @param[in] len Length of @a datagram
+ * @return false if the datagram cannot be taken now (given again later)
+ */
+typedef bool (*usbd_ncm_rx_callback)(usbd_ncm *ncm, const void *datagram,
+				size_t len);
+
+struct usbd_ncm_config {
+	/** Communication interface number (wIndex of class requests) */
+	uint8_t interface;
+
+	/** Bulk IN endpoint address (NTB to host) */
+	uint8_t ep_in;
+
+	/** Bulk OUT endpoint address (NTB from host) */
+	uint8_t ep_out;
+
+	/** Bulk endpoints size */
+	uint16_t ep_size;
+
+	/** Interrupt IN endpoint address, 16 bytes (0 = no notification) */
+	uint8_t ep_notify;
+
+	/** NTB32 format supported (NTB larger than 64KiB) */
+	bool ntb32;
+
+	/** dwNtbInMaxSize: maximum NTB sent (the host can lower it) */
+	uint32_t ntb_in_size;
+
+	/** Maximum time a datagram wait in the open NTB (microseconds) */
+	uint32_t timeout_us;
+
+	/** RX slots (32bit aligned, @a rx_slots * @a ntb_out_size bytes) */
+	void *rx_buffer;
+
+	/** dwNtbOutMaxSize: size of a RX slot */
+	uint32_t ntb_out_size;
+
+	/** Number of RX slots (power of 2, 1 - USBD_NCM_RX_SLOTS_MAX) */
+	uint8_t rx_slots;
+
+	/** Maximum datagram size (as wMaxSegmentSize, ie 1514) */
+	uint16_t max_datagram;
+
+	usbd_ncm_tx_done_callback tx_done;
+	usbd_ncm_rx_callback rx;
+};
+
+typedef struct usbd_ncm_config usbd_ncm_config;
+
+struct usbd_ncm_stats {
+	/** Datagrams sent */
+	uint32_t tx_datagrams;
+
+	/** NTB sent */
+	uint32_t tx_ntbs;
+
+	/** NTB closed by timeout (not full) */
+	uint32_t tx_timeouts;
+
+	/** Datagrams refused (all NTB busy, too large or not started) */
+	uint32_t tx_dropped;
+
+	/** Datagrams received */
+	uint32_t rx_datagrams;
+
+	/** NTB received */
+	uint32_t rx_ntbs;
+
+	/** NTB (rest of) dropped: invalid header, NDP or datagram pointer */
+	uint32_t rx_invalid;
+
+	/** Parse waited for the rx callback to take a datagram */
+	uint32_t rx_waits;
+
+	/** Number of URB failed */
+	uint32_t errors;
+};
+
+typedef struct usbd_ncm_stats usbd_ncm_stats;
+
+/** NTB to send (private) */
+struct usbd_ncm_ntb {
+	/** Number of datagrams */
+	uint16_t count;
+
+	/** Length: NTH and datagrams (padded) */
+	uint32_t len;
+
+	/** usbd_ncm_send() cookie of the datagrams */
+	void *cookie[USBD_NCM_TX_DATAGRAMS];
+
+	/** NTH, (pad, datagram) per datagram, pad, NDP */
+	usbd_segment seg[3 + (2 * USBD_NCM_TX_DATAGRAMS)];
+
+	/** NTH (16 or 32) */
+	uint32_t nth[4];
+
+	/** NDP (16 or 32) with the datagram pointers and terminator */
+	uint32_t ndp[4 + (2 * (USBD_NCM_TX_DATAGRAMS + 1))];
+};
+
+/**
+ * NCM object.
+ */
+struct usbd_ncm {
+	usbd_device *dev;
+	usbd_ncm_config config;
+
+	/** Started (data interface alternate setting 1) */
+	bool running;
+
+	/** NTB format (USB_CDC_NCM_NTB*_FORMAT), dwNtbInMaxSize set by host */
+	uint8_t format;
+	uint32_t ntb_in_size;
+
+	/** Ethernet packet filter (SET_ETHERNET_PACKET_FILTER) */
+	uint16_t packet_filter;
+
+	/** Control request data stage */
+	union {
+		struct usb_cdc_ncm_ntb_parameters params;
+		uint32_t ntb_in_size;
+		uint16_t value;
+	} control;
+
+	struct {
+		struct usbd_ncm_ntb ntb[USBD_NCM_TX_NTBS];
+		uint8_t head; /**< Oldest closed NTB */
+		uint8_t closed; /**< Closed NTB (from head), submitted or not */
+		uint8_t urbs; /**< Closed NTB submitted (from head) */
+		uint16_t sequence; /**< wSequence of the next NTB */
+		uint32_t wait_us; /**< Time the open NTB has waited */
+	} tx;
+
+	struct {
+		uint32_t head; /**< Slots received */
+		uint32_t tail; /**< Slots parsed */
+		uint32_t armed; /**< Slots submitted */
+		uint32_t len[USBD_NCM_RX_SLOTS_MAX]; /**< Bytes received per slot */
+		uint32_t ndp; /**< NDP in progress (0: NTH not parsed) */
+		uint32_t entry; /**< Next datagram pointer of the NDP */
+		bool waiting; /**< Parse wait for the rx callback */
+	} rx;
+
+	struct {
+		bool connected;
+		uint32_t bitrate;
+		uint8_t pending; /**< Notifications to send */
+		bool busy; /**< Notification URB in flight */
+		uint32_t buf[4];
+	} notify;
+
+	usbd_ncm_stats stats;
+};
+
+/**
+ * Initialize NCM
+ * @param[out] ncm NCM
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_ncm_init(usbd_ncm *ncm, usbd_device *dev,
+				const usbd_ncm_config *config);
+
+/**
+ * Handle the NCM class requests
+ * @param[in] ncm NCM
+ * @param[in] setup_data Setup data
+ * @return true if handled, false if the request is not for the class
+ */
+bool usbd_ncm_setup_ep0(usbd_ncm *ncm,
+				const struct usb_setup_data *setup_data);
+
+/**
+ * Start the transfers (data interface alternate setting 1 selected)
+ * The current link state is notified.
+ * @param[in] ncm NCM
+ * @note Before calling this function, application should prepare the endpoints.
+ */
+void usbd_ncm_start(usbd_ncm *ncm);
+
+/**
+ * Stop the transfers (data interface alternate setting 0 selected)
+ * Datagrams not sent are given back (tx_done), NTB format and input
+ *  size are reset to default.
+ * @param[in] ncm NCM
+ */
+void usbd_ncm_stop(usbd_ncm *ncm);
+
+/**
+ * Set the link state (notified to host)
+ * @param[in] ncm NCM
+ * @param[in] connected Network connected
+ * @param[in] bitrate Link speed (bit per second)
+ */
+void usbd_ncm_set_link(usbd_ncm *ncm, bool connected, uint32_t bitrate);
+
+/**
+ * Queue a datagram to host (zero copy)
+ * @param[in] ncm NCM
+ * @param[in] datagram Datagram (Ethernet frame without CRC), should remain
+ *  valid till tx_done callback
+ * @param[in] len Length of @a datagram
+ * @param[in] cookie Given back to tx_done callback
+ * @return false if the datagram is not queued (tx_done is not called)
+ */
+bool usbd_ncm_send(usbd_ncm *ncm, const void *datagram, size_t len,
+				void *cookie);
+
+/**
+ * Aggregation timeout, continue the parse of received NTB
+ * Call from main loop.
+ * @param[in] ncm NCM
+ * @param[in] us Time elapsed since last call (microseconds)
+ */
+void usbd_ncm_poll(usbd_ncm *ncm, uint32_t us);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] ncm NCM
+ * @param[out] stats Statistics
+ */
+void usbd_ncm_get_stats(usbd_ncm *ncm, usbd_ncm_stats *stats);
+
+#endif
+
+/**@}*/
@@ -0,0 +1,272 @@
+/**
+ * @defgroup usbd_uas_defines USB Attached SCSI
+ *
+ * @brief <b>USB Attached SCSI (UAS) with tagged command queuing</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_UAS_H
+#define UNICOREMX_USBD_UAS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/msc.h>
+
+/*
+ * The UAS function own the four bulk pipes of the UAS alternate setting
+ *  (command, status, data-in, data-out) and use the SCSI command set of
+ *  the Bulk-Only function (same usbd_msc_backend, single LUN).
+ * Descriptors (including the Pipe Usage descriptors) are left to the
+ *  application. USB 2.0 operation (no bulk streams): the data pipes are
+ *  handed to one command at a time with READ READY / WRITE READY IU.
+ *
+ * Command queuing:
+ *   Upto queue_depth commands are accepted at once, each with its own
+ *   buffer of task_blocks blocks. The host get NAK on the command pipe
+ *   when all the tasks are busy.
+ *   Block access start as soon as the command arrive. With the
+ *   read_start/write_start backend hooks, accesses of several commands
+ *   are in flight and can finish in any order: the data pipe is given to
+ *   the command whose data is ready first, and status is sent as each
+ *   command finish (not in arrival order). Without the hooks,
+ *   read_block/write_block are called directly (one command at a time
+ *   access the medium, the others still overlap their bus transfers).
+ *   Transfers larger than task_blocks are done in chunks, the data pipe
+ *   stay with the command till its last chunk.
+ *
+ * Task management: ABORT TASK, ABORT TASK SET, CLEAR TASK SET,
+ *  LOGICAL UNIT RESET, I_T NEXUS RESET and QUERY TASK.
+ *
+ * URB are submitted from usbd_poll() context: transfer callbacks and
+ *  usbd_uas_poll(), which the application call after usbd_poll() (same
+ *  context) to pick up the backend accesses finished from interrupt.
+ *
+ * The application should prepare the endpoints (usbd_ep_prepare()) and
+ *  call usbd_uas_start() when the UAS alternate setting is selected
+ *  (usbd_uas_stop() when another one is).
+ */
+
+/** Maximum number of commands queued */
+#if !defined(USBD_UAS_QUEUE_DEPTH)
+# define USBD_UAS_QUEUE_DEPTH 8
+#endif
+
+typedef struct usbd_uas usbd_uas;
+
+struct usbd_uas_config {
+	/** Command pipe (bulk OUT) endpoint address */
+	uint8_t ep_command;
+
+	/** Status pipe (bulk IN) endpoint address */
+	uint8_t ep_status;
+
+	/** Data-in pipe (bulk IN) endpoint address */
+	uint8_t ep_data_in;
+
+	/** Data-out pipe (bulk OUT) endpoint address */
+	uint8_t ep_data_out;
+
+	/** Bulk endpoints size */
+	uint16_t ep_size;
+
+	/** Backend, should remain valid */
+	const usbd_msc_backend *backend;
+
+	/** Commands queued (upto USBD_UAS_QUEUE_DEPTH, 0 = maximum) */
+	uint8_t queue_depth;
+
+	/** Blocks (512 bytes) per task buffer (atleast 1) */
+	uint16_t task_blocks;
+
+	/** Task buffers (32bit aligned, queue_depth * task_blocks * 512 bytes) */
+	void *buffer;
+};
+
+typedef struct usbd_uas_config usbd_uas_config;
+
+struct usbd_uas_stats {
+	/** Commands received */
+	uint32_t commands;
+
+	/** Largest number of commands queued at once */
+	uint32_t queue_max;
+
+	/** Commands completed before an older one */
+	uint32_t reordered;
+
+	/** Backend accesses failed */
+	uint32_t media_errors;
+
+	/** Commands aborted (task management or stop) */
+	uint32_t aborted;
+
+	/** Task management functions received */
+	uint32_t task_management;
+
+	/** Number of URB failed */
+	uint32_t errors;
+};
+
+typedef struct usbd_uas_stats usbd_uas_stats;
+
+/** Command (private) */
+struct usbd_uas_task {
+	uint8_t state;
+
+	/** Aborted, freed when the access or URB in flight finish */
+	bool aborted;
+
+	/** Data-out command */
+	bool write;
+
+	/** Tag (as received, big endian) */
+	uint16_t tag;
+
+	/** Arrival and data ready order */
+	uint32_t arrival;
+	uint32_t ready;
+
+	/** Block command: first block, blocks, blocks done, blocks of chunk */
+	uint32_t lba;
+	uint32_t blocks;
+	uint32_t done;
+	uint32_t chunk;
+
+	/** Data length (non block command) and length host accept */
+	uint32_t length;
+	uint32_t expected;
+
+	/** SCSI status and sense data */
+	uint8_t status;
+	struct usbd_msc_sense sense;
+
+	/** Backend access finished (set from any context) and its result */
+	bool media_done;
+	int media_result;
+
+	uint8_t *buf;
+};
+
+/** Data pipe (private) */
+struct usbd_uas_pipe {
+	uint8_t ep_addr;
+
+	/** Task owning the pipe, NULL if free */
+	struct usbd_uas_task *owner;
+};
+
+/**
+ * UAS object.
+ */
+struct usbd_uas {
+	usbd_device *dev;
+	usbd_uas_config config;
+	struct usbd_msc_lun lun;
+
+	bool running;
+
+	struct usbd_uas_task task[USBD_UAS_QUEUE_DEPTH];
+	uint32_t arrival;
+	uint32_t ready;
+	unsigned media_users;
+
+	struct usbd_uas_pipe data_in, data_out;
+
+	struct {
+		bool busy;
+		uint8_t buf[64];
+	} command;
+
+	struct {
+		/** IU to send: task index and IU ID */
+		struct {
+			uint8_t task;
+			uint8_t iu_id;
+		} fifo[2 * USBD_UAS_QUEUE_DEPTH];
+		uint8_t head;
+		uint8_t count;
+
+		/** RESPONSE IU waiting (send first) */
+		bool response;
+		uint16_t response_tag;
+		uint8_t response_code;
+
+		/** IU in flight */
+		bool busy;
+		uint8_t task;
+		uint8_t iu_id;
+		uint8_t buf[34];
+	} status;
+
+	struct {
+		bool busy;
+		bool again;
+	} kick;
+
+	usbd_uas_stats stats;
+};
+
+/**
+ * Initialize UAS
+ * @param[out] uas UAS
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_uas_init(usbd_uas *uas, usbd_device *dev,
+				const usbd_uas_config *config);
+
+/**
+ * Start accepting commands (UAS alternate setting selected)
+ * @param[in] uas UAS
+ * @note Before calling this function, application should prepare the endpoints.
+ */
+void usbd_uas_start(usbd_uas *uas);
+
+/**
+ * Stop, commands queued are aborted
+ * Backend accesses in flight are waited for (usbd_uas_poll()) before
+ *  their task is reused.
+ * @param[in] uas UAS
+ */
+void usbd_uas_stop(usbd_uas *uas);
+
+/**
+ * Process the backend accesses finished
+ * Call after usbd_poll() (same context).
+ * @param[in] uas UAS
+ */
+void usbd_uas_poll(usbd_uas *uas);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] uas UAS
+ * @param[out] stats Statistics
+ */
+void usbd_uas_get_stats(usbd_uas *uas, usbd_uas_stats *stats);
+
+#endif
+
+/**@}*/
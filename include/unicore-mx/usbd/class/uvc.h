@@ -0,0 +1,300 @@
+/**
+ * @defgroup usbd_uvc_defines USB Video Device Class
+ *
+ * @brief <b>UVC video streaming with in-place payload headers</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_UVC_H
+#define UNICOREMX_USBD_UVC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usb/class/video.h>
+
+/*
+ * The UVC function own the video endpoint of a VideoStreaming interface
+ *  and answer its probe and commit controls. Descriptors and the
+ *  VideoControl interface are left to the application.
+ *
+ * Negotiation:
+ *   The formats and frames described to the host are listed in
+ *   usbd_uvc_config::frames. A probe is adjusted to the nearest entry
+ *   (frame interval clamped), dwMaxVideoFrameSize and
+ *   dwMaxPayloadTransferSize are filled by the device. A commit must name
+ *   an entry, the commit callback is then called.
+ *
+ * Frames:
+ *   usbd_uvc_queue_frame() add a frame to the queue (USBD_UVC_FRAMES)
+ *   without copying it. Each payload is a scatter-gather transfer
+ *   (USBD_FLAG_SEGMENTED) of a 2 bytes header followed by a slice of the
+ *   frame memory. The frame is given back with the frame_done callback
+ *   once its last payload is on the bus (or when dropped).
+ *   When the queue is full, the new frame is refused, or (keep_latest)
+ *   replace the newest frame not yet started.
+ *
+ * Bulk: one transfer per payload (dwMaxPayloadTransferSize), short packet
+ *   end a payload smaller than dwMaxPayloadTransferSize. The stream start
+ *   on commit (the host read only when it want frames), the application
+ *   call usbd_uvc_stop() when the host clear the endpoint halt.
+ *
+ * Isochronous: one payload per (micro)frame upto ep_size * packets
+ *   (high bandwidth: USBD_FLAG_PACKET_PER_FRAME_2/3 on OTG_HS), an empty
+ *   packet is sent when no frame is queued. The application call
+ *   usbd_uvc_start() when the alternate setting with the endpoint is
+ *   selected (usbd_uvc_stop() for alternate setting 0).
+ *
+ * usbd_uvc_queue_frame() can be called from main loop and interrupt
+ *  (interrupts are masked for the duration of the call), it submit URB
+ *  so it should not preempt usbd_poll() (same as usbd_hid_send()).
+ *
+ * The application should prepare the endpoint (usbd_ep_prepare()) and
+ *  forward SETUP to usbd_uvc_setup_ep0().
+ */
+
+/** Number of frames in the queue */
+#if !defined(USBD_UVC_FRAMES)
+# define USBD_UVC_FRAMES 4
+#endif
+
+/** Number of payloads on the bus */
+#define USBD_UVC_URBS 2
+
+typedef struct usbd_uvc usbd_uvc;
+
+/** Frame described to the host (bFormatIndex, bFrameIndex) */
+struct usbd_uvc_frame_info {
+	uint8_t format_index;
+	uint8_t frame_index;
+
+	/** dwMaxVideoFrameSize: largest frame queued */
+	uint32_t max_frame_size;
+
+	/** Frame interval (100ns): default, shortest and longest */
+	uint32_t interval_default;
+	uint32_t interval_min;
+	uint32_t interval_max;
+};
+
+typedef struct usbd_uvc_frame_info usbd_uvc_frame_info;
+
+/**
+ * Probe and commit accepted by host
+ * Called from usbd_poll() context, before the stream is (re)started.
+ * @param[in] uvc UVC
+ * @param[in] info Frame committed (entry of usbd_uvc_config::frames)
+ * @param[in] interval Frame interval committed (100ns)
+ */
+typedef void (*usbd_uvc_commit_callback)(usbd_uvc *uvc,
+				const usbd_uvc_frame_info *info, uint32_t interval);
+
+/**
+ * Frame memory given to usbd_uvc_queue_frame() can be reused
+ * Called from usbd_poll() context (or usbd_uvc_queue_frame(),
+ *  usbd_uvc_stop()).
+ * @param[in] uvc UVC
+ * @param[in] cookie Cookie given to usbd_uvc_queue_frame()
+ * @param[in] sent true if all payloads of the frame were sent
+ */
+typedef void (*usbd_uvc_frame_done_callback)(usbd_uvc *uvc, void *cookie,
+				bool sent);
+
+struct usbd_uvc_config {
+	/** VideoStreaming interface number (wIndex of the controls) */
+	uint8_t interface;
+
+	/** Video IN endpoint address */
+	uint8_t ep_addr;
+
+	/** Video endpoint type (USBD_EP_BULK or USBD_EP_ISOCHRONOUS) */
+	usbd_ep_type ep_type;
+
+	/** Video endpoint size */
+	uint16_t ep_size;
+
+	/** Isochronous: packets per (micro)frame (1 - 3) */
+	uint8_t packets;
+
+	/** Bulk: dwMaxPayloadTransferSize (0: a frame per payload) */
+	uint32_t payload_size;
+
+	/** Frames described to the host (first one is the default) */
+	const usbd_uvc_frame_info *frames;
+	uint8_t frame_count;
+
+	/** When the queue is full, replace the newest frame not yet started */
+	bool keep_latest;
+
+	usbd_uvc_commit_callback commit;
+	usbd_uvc_frame_done_callback frame_done;
+};
+
+typedef struct usbd_uvc_config usbd_uvc_config;
+
+struct usbd_uvc_stats {
+	/** Frames sent */
+	uint32_t frames;
+
+	/** Frames not started: refused, replaced or flushed on stop */
+	uint32_t frames_dropped;
+
+	/** Frames partly sent: payload failed or stream stopped */
+	uint32_t frames_incomplete;
+
+	/** Payloads sent with frame data */
+	uint32_t payloads;
+
+	/** Isochronous empty payloads (no frame queued) */
+	uint32_t idle_payloads;
+
+	/** Number of URB failed */
+	uint32_t errors;
+};
+
+typedef struct usbd_uvc_stats usbd_uvc_stats;
+
+/** Payload on the bus (private) */
+struct usbd_uvc_payload {
+	/** Header, followed by the frame slice */
+	struct usb_video_payload_header header;
+
+	/** Carry frame data */
+	bool data;
+
+	/** Last payload of the frame */
+	bool eof;
+
+	usbd_segment seg[2];
+};
+
+/** Frame queued (private) */
+struct usbd_uvc_frame {
+	const void *data;
+	size_t len;
+	void *cookie;
+};
+
+/**
+ * UVC object.
+ */
+struct usbd_uvc {
+	usbd_device *dev;
+	usbd_uvc_config config;
+
+	/** Streaming */
+	bool running;
+
+	/** Negotiation state, frame committed */
+	struct usb_video_probe_commit_control probe;
+	struct usb_video_probe_commit_control commit;
+	const usbd_uvc_frame_info *committed;
+
+	/** Bytes per payload (header included) of the frame committed */
+	uint32_t payload_size;
+
+	/** Control request data stage */
+	uint8_t selector;
+	union {
+		struct usb_video_probe_commit_control ctl;
+		uint16_t len;
+		uint8_t info;
+	} control;
+
+	struct {
+		struct usbd_uvc_frame slot[USBD_UVC_FRAMES];
+		uint8_t head; /**< Oldest frame */
+		uint8_t count; /**< Frames queued (from head) */
+		uint8_t send; /**< Frame packetized (from head) */
+		size_t offset; /**< Bytes of frame send packetized */
+		bool fid; /**< Frame ID of frame send */
+		bool error; /**< Payload of frame head failed */
+	} frame;
+
+	struct {
+		struct usbd_uvc_payload payload[USBD_UVC_URBS];
+		uint8_t head; /**< Oldest payload */
+		uint8_t count; /**< Payloads submitted */
+	} urb;
+
+	usbd_uvc_stats stats;
+};
+
+/**
+ * Initialize UVC
+ * The first entry of @a config frames is committed.
+ * @param[out] uvc UVC
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_uvc_init(usbd_uvc *uvc, usbd_device *dev,
+				const usbd_uvc_config *config);
+
+/**
+ * Handle the probe and commit controls
+ * @param[in] uvc UVC
+ * @param[in] setup_data Setup data
+ * @return true if handled, false if the request is not for the class
+ */
+bool usbd_uvc_setup_ep0(usbd_uvc *uvc,
+				const struct usb_setup_data *setup_data);
+
+/**
+ * Start the stream (isochronous: alternate setting with endpoint selected)
+ * Frames queued are dropped.
+ * @param[in] uvc UVC
+ * @note Before calling this function, application should prepare the endpoint.
+ */
+void usbd_uvc_start(usbd_uvc *uvc);
+
+/**
+ * Stop the stream (isochronous: alternate setting 0 selected)
+ * Frames queued are given back (frame_done).
+ * @param[in] uvc UVC
+ */
+void usbd_uvc_stop(usbd_uvc *uvc);
+
+/**
+ * Queue a frame to host (zero copy)
+ * @param[in] uvc UVC
+ * @param[in] data Frame, should remain valid till frame_done callback
+ * @param[in] len Length of @a data (upto dwMaxVideoFrameSize committed)
+ * @param[in] cookie Given back to frame_done callback
+ * @return false if the frame is not queued (frame_done is not called)
+ */
+bool usbd_uvc_queue_frame(usbd_uvc *uvc, const void *data, size_t len,
+				void *cookie);
+
+/**
+ * Get a copy of the statistics
+ * @param[in] uvc UVC
+ * @param[out] stats Statistics
+ */
+void usbd_uvc_get_stats(usbd_uvc *uvc, usbd_uvc_stats *stats);
+
+#endif
+
+/**@}*/
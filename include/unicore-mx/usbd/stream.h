@@ -0,0 +1,241 @@
+/**
+ * @defgroup usbd_stream_defines USB Device Stream
+ *
+ * @brief <b>Self refilling bulk endpoint streaming</b>
+ *
+ * @ingroup USBD_defines
+ *
+ * LGPL License Terms @ref lgpl_license
+ */
+
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**@{*/
+
+#ifndef UNICOREMX_USBD_STREAM_H
+#define UNICOREMX_USBD_STREAM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unicore-mx/usbd/usbd.h>
+
+/*
+ * A stream own a bulk endpoint and a ring buffer (provided by application).
+ * The ring buffer is divided into @a depth slots of @a chunk bytes.
+ * Each slot is transferred using one URB, so upto @a depth URB are
+ *  kept armed and the endpoint never idle while data (IN) or space (OUT)
+ *  is available.
+ *
+ * IN stream (device to host):
+ *   usbd_stream_write() copy data into the slot being filled.
+ *   A full slot is armed immediately. A partially filled slot is armed
+ *   when the endpoint become idle (or on usbd_stream_flush()).
+ *
+ * OUT stream (device from host):
+ *   All free slots are armed with a @a chunk bytes transfer.
+ *   (transfer complete on short packet)
+ *   usbd_stream_read() copy the received data out of the slots (in order)
+ *   and re-arm the slot as soon as it is empty.
+ *
+ * usbd_stream_write(), usbd_stream_read(), usbd_stream_flush() and
+ *  usbd_stream_space() can be called from main loop and interrupt
+ *  (interrupts are masked for the duration of the call).
+ *  They can submit URB, so they should not preempt usbd_poll()
+ *  (ie call usbd_poll() from USB interrupt, or from the same context),
+ *  unless the library is built with USBD_ENABLE_DEFERRED.
+ *
+ * The application should prepare the endpoint (usbd_ep_prepare()) before
+ *  calling usbd_stream_start() (usually in set-config callback).
+ */
+
+/** Maximum number of URB a stream can keep armed */
+#define USBD_STREAM_DEPTH_MAX 4
+
+typedef struct usbd_stream usbd_stream;
+
+/**
+ * Called (from usbd_poll() context) when a slot transfer complete.
+ * IN stream: space become available.
+ * OUT stream: data become available.
+ */
+typedef void (*usbd_stream_callback)(usbd_stream *stream);
+
+struct usbd_stream_config {
+	/** Bulk endpoint address (direction decide the stream direction) */
+	uint8_t ep_addr;
+
+	/** Endpoint size */
+	uint16_t ep_size;
+
+	/** Ring buffer memory (atleast @a depth * @a chunk bytes) */
+	void *buffer;
+
+	/** Bytes per slot (should be multiple of @a ep_size) */
+	size_t chunk;
+
+	/** Number of slots (1 - USBD_STREAM_DEPTH_MAX) */
+	uint8_t depth;
+
+	/** Notify (can be NULL) */
+	usbd_stream_callback callback;
+};
+
+typedef struct usbd_stream_config usbd_stream_config;
+
+struct usbd_stream_stats {
+	/**
+	 * IN: Endpoint went idle because no data was available.
+	 * OUT: usbd_stream_read() called while no data was available.
+	 */
+	uint32_t underrun;
+
+	/**
+	 * IN: usbd_stream_write() dropped data because all slots were in use.
+	 * OUT: Endpoint went idle because all slots were full (host get NAK).
+	 */
+	uint32_t overrun;
+
+	/** Number of URB completed successfully */
+	uint32_t urbs;
+
+	/** Number of URB failed (IN: data of slot dropped) */
+	uint32_t errors;
+
+	/** Number of bytes transferred on bus */
+	uint64_t bytes;
+};
+
+typedef struct usbd_stream_stats usbd_stream_stats;
+
+/**
+ * Stream object.
+ * Allocated by application, content is private.
+ */
+struct usbd_stream {
+	usbd_device *dev;
+	usbd_stream_config config;
+
+	struct {
+		enum {
+			USBD_STREAM_SLOT_FREE = 0,
+			USBD_STREAM_SLOT_FILL, /**< IN: producer is writing data */
+			USBD_STREAM_SLOT_ARMED, /**< URB in flight */
+			USBD_STREAM_SLOT_DATA /**< OUT: consumer is reading data */
+		} state;
+
+		/** IN: number of bytes written, OUT: number of bytes received */
+		size_t len;
+
+		/** OUT: number of bytes consumed */
+		size_t pos;
+
+		usbd_urb_id urb_id;
+	} slot[USBD_STREAM_DEPTH_MAX];
+
+	/** Slot used by application (IN: fill, OUT: consume) */
+	uint8_t app;
+
+	/** Number of slot armed */
+	uint8_t armed;
+
+	/** Stream has been started (and not stopped) */
+	bool running;
+
+	/** IN: last slot armed end with a full packet (host read not ended) */
+	bool unterminated;
+
+	/** IN: flush while all slots were armed, ZLP to arm on completion */
+	bool zlp_pending;
+
+	usbd_stream_stats stats;
+};
+
+/**
+ * Initalize stream
+ * @param[out] stream Stream
+ * @param[in] dev USB Device
+ * @param[in] config Configuration (copied)
+ */
+void usbd_stream_init(usbd_stream *stream, usbd_device *dev,
+					const usbd_stream_config *config);
+
+/**
+ * Start the stream.
+ * OUT stream: all slots are armed.
+ * @param[in] stream Stream
+ * @note Before calling this function, application should prepare the endpoint.
+ */
+void usbd_stream_start(usbd_stream *stream);
+
+/**
+ * Stop the stream.
+ * All armed URB are cancelled, and all data in slots is discarded.
+ * @param[in] stream Stream
+ * @note stream is automatically stopped if a transfer fail due to
+ *   configuration change, bus reset or disconnection
+ * @note With USBD_ENABLE_DEFERRED, call from usbd_poll() context
+ *   (same as usbd_transfer_cancel())
+ */
+void usbd_stream_stop(usbd_stream *stream);
+
+/**
+ * Write data to IN stream
+ * @param[in] stream Stream
+ * @param[in] data Data
+ * @param[in] len Length of data
+ * @return number of bytes accepted (rest is dropped)
+ */
+size_t usbd_stream_write(usbd_stream *stream, const void *data, size_t len);
+
+/**
+ * Arm the partially filled slot of IN stream (even if the endpoint is busy)
+ *  with a short packet, so that the host read complete.
+ * If the data already armed end with a full packet, a ZLP is sent instead
+ *  (when a slot become free if all are armed).
+ * @param[in] stream Stream
+ */
+void usbd_stream_flush(usbd_stream *stream);
+
+/**
+ * Read data from OUT stream
+ * @param[in] stream Stream
+ * @param[out] data Data
+ * @param[in] len Maximum bytes to read
+ * @return number of bytes read
+ */
+size_t usbd_stream_read(usbd_stream *stream, void *data, size_t len);
+
+/**
+ * IN stream: number of bytes that can be written without drop.
+ * OUT stream: number of bytes that can be read.
+ * @param[in] stream Stream
+ * @return number of bytes
+ */
+size_t usbd_stream_space(usbd_stream *stream);
+
+/**
+ * Get a copy of the stream statistics
+ * @param[in] stream Stream
+ * @param[out] stats Statistics
+ */
+void usbd_stream_get_stats(usbd_stream *stream, usbd_stream_stats *stats);
+
+#endif
+
+/**@}*/
@@ -148,7 +148,14 @@ struct usbd_backend_config {
 		USBD_FEATURE_NONE = 0,
 		USBD_PHY_EXT = (1 << 0),
 		USBD_VBUS_SENSE = (1 << 1),
-		USBD_VBUS_EXT = (1 << 2)
+		USBD_VBUS_EXT = (1 << 2),
+
+		/**
+		 * Use the peripheral internal DMA (if supported by backend).
+		 * Transfer buffer should be 32bit aligned and OUT transfer
+		 *  length should be a multiple of endpoint size.
+		 */
+		USBD_DMA = (1 << 3)
 	} feature;
 };
 
@@ -200,6 +207,8 @@ enum usbd_transfer_flags {
 	 * Transfer always end with a short packet,
 	 *  even if it means adding an extra zero length packet.
 	 * Currently only applies for bulk, control IN
+	 * On bulk, interrupt and isochronous OUT, a short packet end the transfer
+	 *  (interrupt and isochronous: the host decide the size of each packet).
 	 * Setting this flag on other transfer is NOP
 	 * Should not be set when USBD_FLAG_NO_SHORT_PACKET flag is set
 	 */
@@ -274,11 +283,40 @@ enum usbd_transfer_flags {
 	USBD_FLAG_PACKET_PER_FRAME_3 = (0x2 << 5),
 
 	/* Mask for USBD_FLAG_PACKET_PER_FRAME_n */
-	USBD_FLAG_PACKET_PER_FRAME_MASK = (0x3 << 5)
+	USBD_FLAG_PACKET_PER_FRAME_MASK = (0x3 << 5),
+
+	/**
+	 * Scatter-gather transfer.
+	 * transfer::buffer point to an array of transfer::seg_count usbd_segment
+	 *  (instead of data) and transfer::length is the total number of bytes
+	 *  (sum of segment length, the transfer fail with USBD_ERR_INVALID if not).
+	 * Data is copied directly between the segments and the peripheral memory
+	 *  (packet that straddle segments are assembled by the backend),
+	 *  so a header and payload can be sent without copying to a single buffer.
+	 *
+	 * The segment array (and the memory it point to) must remain valid
+	 *  till the transfer is not complete.
+	 * Zero length segments are allowed (skipped).
+	 * Should not be used with USBD_FLAG_NO_MEMORY_INCREMENT.
+	 */
+	USBD_FLAG_SEGMENTED = (1 << 7)
 };
 
 typedef enum usbd_transfer_flags usbd_transfer_flags;
 
+/**
+ * Segment of a scatter-gather transfer (see USBD_FLAG_SEGMENTED)
+ */
+struct usbd_segment {
+	/** Memory */
+	void *ptr;
+
+	/** Number of bytes */
+	size_t len;
+};
+
+typedef struct usbd_segment usbd_segment;
+
 /**
  * USB Transfer status
  */
@@ -377,12 +415,16 @@ struct usbd_transfer {
 	 *   backend reference to make better decision. */
 	uint16_t ep_interval;
 
-	/** Buffer to read/write */
+	/** Buffer to read/write
+	 *  (array of usbd_segment if USBD_FLAG_SEGMENTED flag is set) */
 	void *buffer;
 
 	/** Number of bytes to transfer */
 	size_t length;
 
+	/** Number of usbd_segment in @a buffer (only for USBD_FLAG_SEGMENTED) */
+	size_t seg_count;
+
 	/** Number of bytes transferred to/from @a data
 	 *  @warning Manipulated by library internally. not accepted from user
 	 */
@@ -572,6 +614,49 @@ void usbd_register_set_interface_callback(usbd_device *dev,
  */
 void usbd_poll(usbd_device *dev, uint32_t us);
 
+/**
+ * Register poll request callback (library built with USBD_ENABLE_DEFERRED) \n
+ * stack will invoke @a callback (from the submitting context) when a
+ *  transfer has been queued and usbd_poll() need to run to start it.
+ * Usually the callback set the USB interrupt pending.
+ * @param[in] dev USB Device
+ * @param[in] callback callback to be invoked
+ */
+void usbd_register_poll_request_callback(usbd_device *dev,
+					usbd_generic_callback callback);
+
+/**
+ * Register dispatch request callback (library built with USBD_ENABLE_DEFERRED) \n
+ * stack will invoke @a callback (from usbd_poll() context) when transfer
+ *  callbacks are waiting for usbd_dispatch().
+ * Usually the callback set PendSV pending.
+ * @param[in] dev USB Device
+ * @param[in] callback callback to be invoked
+ */
+void usbd_register_dispatch_request_callback(usbd_device *dev,
+					usbd_generic_callback callback);
+
+/**
+ * Perform the pending transfer callbacks.
+ *
+ * When library is built with USBD_ENABLE_DEFERRED:
+ *  - non-control transfer can be submitted from any context
+ *    (main loop, any interrupt). They are queued without locking and
+ *    started by the next usbd_poll().
+ *  - callback of non-control transfer are not performed from usbd_poll(),
+ *    but from this function (call it from PendSV or main loop).
+ *  - usbd_transfer_cancel() and usbd_transfer_cancel_ep() should only be
+ *    called from usbd_poll() context (ie setup, set-config callback)
+ *  - Control transfer and per packet callback (USBD_ONE_PACKET_DATA)
+ *    are handled as usual from usbd_poll() context.
+ * So URB lists are only touched from usbd_poll() context,
+ *  and interrupts do not need to be masked.
+ *
+ * Without USBD_ENABLE_DEFERRED, this function does nothing.
+ * @param[in] dev USB Device
+ */
+void usbd_dispatch(usbd_device *dev);
+
 /**
  * Force disconnect.
  * @param[in] dev USB Device
@@ -696,6 +781,8 @@ usbd_urb_id usbd_transfer_submit(usbd_device *dev,
  * @param[in] id Transfer ID
  * @return true on success
  * @return false on failure
+ * @note With USBD_ENABLE_DEFERRED, call from usbd_poll() context only.
+ *   Transfer that has completed but callback is pending is not cancelled.
  */
 bool usbd_transfer_cancel(usbd_device *dev, usbd_urb_id urb_id);
 
@@ -704,6 +791,7 @@ bool usbd_transfer_cancel(usbd_device *dev, usbd_urb_id urb_id);
  * @param[in] usbd_dev USB Device
  * @param[in] ep_addr Endpoint number (including direction)
  * @return Number of transfers cancelled
+ * @note With USBD_ENABLE_DEFERRED, call from usbd_poll() context only.
  */
 unsigned usbd_transfer_cancel_ep(usbd_device *dev, uint8_t ep_addr);
 
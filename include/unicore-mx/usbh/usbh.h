@@ -271,7 +271,15 @@ struct usbh_backend_config {
 		USBH_FEATURE_NONE = 0,
 		USBH_PHY_EXT = (1 << 0),
 		USBH_VBUS_SENSE = (1 << 1),
-		USBH_VBUS_EXT = (1 << 2)
+		USBH_VBUS_EXT = (1 << 2),
+
+		/**
+		 * Use the peripheral internal DMA (if supported by backend).
+		 * Bulk, interrupt and isochronous transfer buffer should be 32bit
+		 *  aligned and IN transfer length should be a multiple of
+		 *  endpoint size. Control transfers have no requirement.
+		 */
+		USBH_DMA = (1 << 3)
 	} feature;
 };
 
@@ -303,7 +311,7 @@ unsigned usbh_search_devices_by_parent(usbh_host *host, usbh_device *parent,
  * @param host USB Host
  * @param address Device bus address
  * @return reference to device object on success
- * @return NULL on failure
+ * @return NULL on failure (device at address 0 not addressable)
  */
 usbh_device *usb_device_by_address(usbh_host *host, uint8_t address);
 
@@ -320,6 +328,8 @@ void usbh_poll(usbh_host *host, uint32_t us);
  * Register a callback for connected device
  * @param host USB Host
  * @param connected Callback
+ * @note Hubs are configured by the stack and not reported,
+ *   devices connected to them are (see usbh_device_parent()).
  */
 void usbh_register_connected_callback(usbh_host *host,
 		usbh_connected_callback connected);
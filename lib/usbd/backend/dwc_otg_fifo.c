@@ -0,0 +1,234 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dwc_otg_fifo.h"
+
+#include <string.h>
+
+/* Minimum depth of a TX FIFO (required by periph) */
+#define TX_MIN_WORDS 16
+
+/* Highest goal of any endpoint type */
+#define GOAL_MAX (DWC_OTG_FIFO_BULK_PACKETS > 2 ? DWC_OTG_FIFO_BULK_PACKETS : 2)
+
+#define WORDS(bytes) (((uint32_t) (bytes) + 3) / 4)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define DIR_IN 0
+#define DIR_OUT 1
+
+/**
+ * Number of packets per (micro)frame
+ * @param[in] ep Endpoint
+ * @return 1 to 3
+ */
+static uint8_t ep_mult(const struct dwc_otg_fifo_ep *ep)
+{
+	if (ep->type != USBD_EP_ISOCHRONOUS && ep->type != USBD_EP_INTERRUPT) {
+		return 1;
+	}
+
+	switch (ep->flags & USBD_EP_PACKET_PER_FRAME_MASK) {
+	case USBD_EP_PACKET_PER_FRAME_2:
+	return 2;
+	case USBD_EP_PACKET_PER_FRAME_3:
+	return 3;
+	default:
+	return 1;
+	}
+}
+
+static bool ep_periodic(const struct dwc_otg_fifo_ep *ep)
+{
+	return ep->type == USBD_EP_ISOCHRONOUS || ep->type == USBD_EP_INTERRUPT;
+}
+
+/**
+ * Number of (micro)frames worth buffering
+ * @param[in] ep Endpoint
+ * @return goal (1 = minimum)
+ */
+static uint8_t ep_goal(const struct dwc_otg_fifo_ep *ep)
+{
+	bool dbl = ep->flags & USBD_EP_DOUBLE_BUFFER;
+
+	switch (ep->type) {
+	case USBD_EP_ISOCHRONOUS:
+	return 2;
+	case USBD_EP_INTERRUPT:
+	return (dbl || ep->interval == 1) ? 2 : 1;
+	case USBD_EP_BULK:
+	return dbl ? 2 : DWC_OTG_FIFO_BULK_PACKETS;
+	default:
+	return 1;
+	}
+}
+
+/**
+ * TX FIFO depth to buffer @a level (micro)frames of IN endpoint @a ep
+ * @param[in] ep IN Endpoint
+ * @param[in] level Number of (micro)frames (>= 1)
+ * @return words
+ */
+static uint32_t tx_words(const struct dwc_otg_fifo_ep *ep, uint8_t level)
+{
+	uint32_t words = level * ep_mult(ep) * WORDS(ep->max_size);
+	return (words > TX_MIN_WORDS) ? words : TX_MIN_WORDS;
+}
+
+/**
+ * RX FIFO used to buffer @a level (micro)frames of OUT endpoint @a ep
+ * The first packet share the room of the largest packet (RX minimum).
+ * @param[in] ep OUT Endpoint
+ * @param[in] level Number of (micro)frames (>= 1)
+ * @return words
+ */
+static uint32_t rx_words(const struct dwc_otg_fifo_ep *ep, uint8_t level)
+{
+	return (level * ep_mult(ep) - 1) * (WORDS(ep->max_size) + 1);
+}
+
+/**
+ * Grow the endpoints one level at a time (round robin)
+ * Endpoint that do not fit at a level stay at their current level.
+ * @param[in] req Endpoint set
+ * @param[inout] plan Partition
+ * @param[inout] level Current level of endpoints (0 = not used)
+ * @param[in] periodic Grow isochronous/interrupt (true) or others (false)
+ * @param[inout] surplus Unallocated words
+ */
+static void grow(const struct dwc_otg_fifo_req *req,
+		struct dwc_otg_fifo_plan *plan,
+		uint8_t level[2][DWC_OTG_FIFO_EP_COUNT], bool periodic,
+		uint32_t *surplus)
+{
+	unsigned ep_count = MIN(req->ep_count, DWC_OTG_FIFO_EP_COUNT);
+	unsigned i, k, d;
+
+	for (k = 2; k <= GOAL_MAX; k++) {
+		for (i = 1; i < ep_count; i++) {
+			for (d = DIR_IN; d <= DIR_OUT; d++) {
+				const struct dwc_otg_fifo_ep *ep;
+				uint32_t cost;
+
+				ep = (d == DIR_IN) ? &req->in[i] : &req->out[i];
+
+				if (level[d][i] != k - 1 || ep_periodic(ep) != periodic ||
+						ep_goal(ep) < k) {
+					continue;
+				}
+
+				if (d == DIR_IN) {
+					cost = tx_words(ep, k) - tx_words(ep, k - 1);
+				} else {
+					cost = rx_words(ep, k) - rx_words(ep, k - 1);
+				}
+
+				if (cost > *surplus) {
+					continue;
+				}
+
+				*surplus -= cost;
+				level[d][i] = k;
+
+				if (d == DIR_IN) {
+					plan->tx[i] += cost;
+				} else {
+					plan->rx += cost;
+				}
+			}
+		}
+	}
+}
+
+bool dwc_otg_fifo_plan(const struct dwc_otg_fifo_req *req,
+					struct dwc_otg_fifo_plan *plan)
+{
+	uint8_t level[2][DWC_OTG_FIFO_EP_COUNT];
+	unsigned ep_count = MIN(req->ep_count, DWC_OTG_FIFO_EP_COUNT);
+	uint32_t largest = WORDS(req->ep0_size);
+	uint32_t ctrl = 1, outs = 1; /* EP0 */
+	uint32_t overhead, used, rx_extra = 0;
+	uint16_t addr;
+	bool fit;
+	unsigned i;
+
+	memset(plan, 0, sizeof(*plan));
+	memset(level, 0, sizeof(level));
+
+	plan->tx[0] = MAX(largest, TX_MIN_WORDS);
+	used = plan->tx[0];
+
+	/* Minimum requirement */
+	for (i = 1; i < ep_count; i++) {
+		const struct dwc_otg_fifo_ep *in = &req->in[i];
+		const struct dwc_otg_fifo_ep *out = &req->out[i];
+
+		if (in->max_size) {
+			level[DIR_IN][i] = 1;
+			plan->tx[i] = tx_words(in, 1);
+			used += plan->tx[i];
+		}
+
+		if (out->max_size) {
+			level[DIR_OUT][i] = 1;
+			outs++;
+			if (out->type == USBD_EP_CONTROL) {
+				ctrl++;
+			}
+			largest = MAX(largest, WORDS(out->max_size));
+			rx_extra += rx_words(out, 1);
+		}
+	}
+
+	overhead = (5 * ctrl + 8) + (2 * outs + 1);
+	plan->rx = overhead + (largest + 1) + rx_extra;
+	used += plan->rx;
+
+	fit = used <= req->depth;
+	if (fit) {
+		uint32_t surplus = req->depth - used;
+
+		/* Periodic endpoints first, they cannot retry */
+		grow(req, plan, level, true, &surplus);
+		grow(req, plan, level, false, &surplus);
+
+		/* Whatever is left to RX */
+		plan->rx += surplus;
+	}
+
+	/* Layout: RX at bottom, then TX FIFO in endpoint order */
+	addr = plan->rx;
+	for (i = 0; i < ep_count; i++) {
+		uint32_t words;
+
+		if (!plan->tx[i]) {
+			continue;
+		}
+
+		plan->tx_start[i] = addr;
+		addr += plan->tx[i];
+
+		words = WORDS(i ? req->in[i].max_size : req->ep0_size);
+		plan->tx_packets[i] = MIN(plan->tx[i] / MAX(words, 1), 255);
+	}
+
+	plan->rx_packets = MIN((plan->rx - overhead) / (largest + 1), 255);
+
+	return fit;
+}
@@ -0,0 +1,100 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG device FIFO planner.
+ *
+ * The FIFO RAM is shared by the RX FIFO (all OUT endpoints) and one
+ *  dedicated TX FIFO per IN endpoint. Instead of handing out TX FIFO in
+ *  usbd_ep_prepare() order, the backend collect the complete endpoint set
+ *  (between ep_prepare_start and ep_prepare_end) and the planner compute
+ *  the partition.
+ *
+ * Every endpoint has a minimum (one (micro)frame of packets, 16 words for
+ *  a TX FIFO) and a goal (number of packets worth buffering):
+ *  - isochronous: 2 frames (the next frame is buffered while the current
+ *     one is transferred)
+ *  - interrupt: 1 frame, 2 if double buffered or interval is 1
+ *  - bulk: 2 packets if double buffered, else DWC_OTG_FIFO_BULK_PACKETS
+ *     (back to back packets without waiting for the CPU)
+ *
+ * Isochronous and interrupt endpoints get their goal first, then the
+ *  bulk endpoints are grown one packet at a time in round robin.
+ *  The result only depend on the endpoint set (not on the prepare order).
+ * What is left is given to the RX FIFO.
+ *
+ * OUT endpoints share the RX FIFO, every packet they buffer also need one
+ *  status word. The RX FIFO minimum is given by the reference manual:
+ *   (5 * number of control endpoints + 8) +
+ *   ((largest USB packet used / 4) + 1 for status information) +
+ *   (2 * number of OUT endpoints) + 1 for Global NAK
+ *
+ * This file has no register access, so it can be tested on host.
+ */
+
+#ifndef UNICOREMX_USBD_DWC_OTG_FIFO_H
+#define UNICOREMX_USBD_DWC_OTG_FIFO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usbd/usbd.h>
+
+/* Maximum number of endpoint (including EP0) of the core */
+#define DWC_OTG_FIFO_EP_COUNT 16
+
+/* Bulk endpoint goal (number of packets) */
+#ifndef DWC_OTG_FIFO_BULK_PACKETS
+# define DWC_OTG_FIFO_BULK_PACKETS 4
+#endif
+
+/** Endpoint as given to usbd_ep_prepare() */
+struct dwc_otg_fifo_ep {
+	uint16_t max_size; /**< Packet size (0 = endpoint not used) */
+	uint8_t type; /**< usbd_ep_type */
+	uint8_t flags; /**< usbd_ep_flags */
+	uint8_t interval; /**< Interval (saturated to 255) */
+};
+
+/** Complete endpoint set */
+struct dwc_otg_fifo_req {
+	uint16_t depth; /**< FIFO RAM available (in 32-bit words) */
+	uint8_t ep_count; /**< Number of endpoint of the core (including EP0) */
+	uint16_t ep0_size; /**< EP0 packet size */
+	struct dwc_otg_fifo_ep in[DWC_OTG_FIFO_EP_COUNT]; /**< indexed by number */
+	struct dwc_otg_fifo_ep out[DWC_OTG_FIFO_EP_COUNT]; /**< indexed by number */
+};
+
+/** FIFO partition (in 32-bit words) */
+struct dwc_otg_fifo_plan {
+	uint16_t rx; /**< RX FIFO size (start at 0) */
+	uint16_t tx_start[DWC_OTG_FIFO_EP_COUNT]; /**< TX FIFO start address */
+	uint16_t tx[DWC_OTG_FIFO_EP_COUNT]; /**< TX FIFO size (0 = unused) */
+	uint8_t rx_packets; /**< Largest OUT packets the RX FIFO can hold */
+	uint8_t tx_packets[DWC_OTG_FIFO_EP_COUNT]; /**< IN packets per TX FIFO */
+};
+
+/**
+ * Compute the FIFO partition of @a req
+ * @param[in] req Endpoint set
+ * @param[out] plan FIFO partition
+ * @return true on success, false if the minimum requirement do not fit
+ *  (@a plan is then the minimum requirement, beyond the FIFO depth)
+ */
+bool dwc_otg_fifo_plan(const struct dwc_otg_fifo_req *req,
+					struct dwc_otg_fifo_plan *plan);
+
+#endif
@@ -30,6 +30,7 @@
 #include <unicore-mx/cm3/common.h>
 #include <unicore-mx/usbd/usbd.h>
 #include <unicore-mx/common/dwc_otg.h>
+#include "dwc_otg_fifo.h"
 
 BEGIN_DECLS
 
@@ -55,24 +56,21 @@ BEGIN_DECLS
 #define USBD_BACKEND_EXTRA													\
 	uint32_t base_address;
 
+/* EP0 buffers of the internal DMA mode.
+ * Non-control transfer are programmed directly from URB buffer.
+ * Control transfer go through these buffers
+ *  (descriptor could be unaligned or in flash).
+ * out also receive the SETUP packets (upto 3 back to back). */
+struct dwc_otg_ep0_dma {
+	uint32_t in[16];
+	uint32_t out[16];
+};
+
 struct dwc_otg_private_data {
-	/* FIFO unused (in terms of 32-bit words).
-	 * This field is decremented one every dedicate TX FIFO allocated.
-	 *  (ie on every IN endpoint) */
-	uint16_t fifo_remaining;
-
-	/* FIFO RX size overall requirement.
-	 * 1. incremented to accomodate for control endpoint setup packet
-	 * 2. incremented to accomodate for OUT endpoint status
-	 *
-	 * (control endpoint = OUT + IN endpoint
-	 *   so, for control both need to be calculated) */
-	uint16_t fifo_rx_usage_overall;
-
-	/* FIFO Largest OUT endpoint that need to be allocated (+ 1)
-	 *  (in terms of 32-bit words).
-	 * If double buffer flag is passed, everything is multiplied with 2 */
-	uint16_t fifo_rx_usage_packet;
+	/* Endpoint set collected between ep_prepare_start and ep_prepare_end.
+	 * The FIFO RAM is partitioned (dwc_otg_fifo.h) once the complete
+	 *  set is known (in ep_prepare_end). */
+	struct dwc_otg_fifo_req fifo_req;
 
 	/* The DIEP0TSIZ and DOEP0TSIZ have pktcnt field small.
 	 *  so, to compensate, we will the values in these variables.
@@ -83,6 +81,10 @@ struct dwc_otg_private_data {
 
 	/* FIXME: used for all endpoint setup_data. */
 	struct usb_setup_data setup_data;
+
+	/* Internal DMA mode (GAHBCFG.DMAEN) if not NULL.
+	 * Given by the backend that support it (OTG_HS), see below. */
+	struct dwc_otg_ep0_dma *ep0_dma;
 };
 
 #define USBD_DEVICE_EXTRA												\
@@ -0,0 +1,303 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * STM32 FSDEV packet memory (PMA) copy kernels.
+ *
+ * PMA is accessed 16bit at a time, consecutive halfwords are @a stride
+ *  halfwords apart in CPU address space:
+ *  - stride 2: 1x16 bits/word (F102, F103, F302x{B,C}, F303x{B,C}, L1)
+ *  - stride 1: 2x16 bits/word (F04x, F07x, L0, L4, other F3)
+ *
+ * The kernels are always inlined with a constant @a stride, so each PMA
+ *  layout get its own copy loop without any multiply.
+ * Application memory is accessed 32bit wide: the misaligned head (and the
+ *  tail) are copied once, then the body is copied 8 bytes per iteration.
+ * Without unaligned access support (Cortex-M0/M0+), a buffer at odd address
+ *  is read/written with aligned words shifted by one byte.
+ *
+ * Only intended to be included by usbd_stm32_fsdev.c (and host test).
+ */
+
+#ifndef UNICOREMX_USBD_STM32_FSDEV_PMA_H
+#define UNICOREMX_USBD_STM32_FSDEV_PMA_H
+
+#include <stdint.h>
+
+#define FSDEV_PMA_INLINE static inline __attribute__((always_inline))
+
+#if defined(__ARM_FEATURE_UNALIGNED)
+typedef uint32_t fsdev_ram32 __attribute__((may_alias, aligned(1)));
+typedef uint16_t fsdev_ram16 __attribute__((may_alias, aligned(1)));
+#else
+typedef uint32_t fsdev_ram32 __attribute__((may_alias));
+typedef uint16_t fsdev_ram16 __attribute__((may_alias));
+#endif
+
+#if !defined(__ARM_FEATURE_UNALIGNED)
+/*
+ * Buffer at odd address, no unaligned access: PMA halfwords straddle
+ *  application words. The first byte is kept as carry, then aligned words
+ *  are read and shifted by one byte (funnel shift).
+ */
+
+/**
+ * Write @a len bytes from @a buf (odd address) to PMA
+ * @param[in] stride PMA halfword stride (compile time constant)
+ * @param[in] pm PMA pointer (CPU address space)
+ * @param[in] buf Buffer (odd address)
+ * @param[in] len Number of bytes
+ */
+FSDEV_PMA_INLINE void fsdev_pma_write_odd(const unsigned stride,
+		volatile uint16_t *pm, const uint8_t *buf, uint16_t len)
+{
+	uint32_t carry;
+
+	if (!len) {
+		return;
+	}
+
+	/* Low byte of the next PMA halfword */
+	carry = *buf++;
+	len--;
+
+	if (((uintptr_t) buf & 2) && len >= 2) {
+		uint32_t h = *(const fsdev_ram16 *) buf;
+		*pm = carry | (h << 8);
+		pm += stride;
+		carry = h >> 8;
+		buf += 2;
+		len -= 2;
+	}
+
+	for (; len >= 8; len -= 8) {
+		uint32_t w0 = ((const fsdev_ram32 *) buf)[0];
+		uint32_t w1 = ((const fsdev_ram32 *) buf)[1];
+		pm[0] = carry | (w0 << 8);
+		pm[stride] = w0 >> 8;
+		pm[stride * 2] = (w0 >> 24) | (w1 << 8);
+		pm[stride * 3] = w1 >> 8;
+		carry = w1 >> 24;
+		pm += stride * 4;
+		buf += 8;
+	}
+
+	if (len >= 4) {
+		uint32_t w0 = *(const fsdev_ram32 *) buf;
+		pm[0] = carry | (w0 << 8);
+		pm[stride] = w0 >> 8;
+		carry = w0 >> 24;
+		pm += stride * 2;
+		buf += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		uint32_t h = *(const fsdev_ram16 *) buf;
+		*pm = carry | (h << 8);
+		pm += stride;
+		carry = h >> 8;
+		buf += 2;
+		len -= 2;
+	}
+
+	*pm = len ? (carry | (buf[0] << 8)) : carry;
+}
+
+/**
+ * Read @a len bytes from PMA to @a buf (odd address)
+ * @param[in] stride PMA halfword stride (compile time constant)
+ * @param[out] buf Buffer (odd address)
+ * @param[in] pm PMA pointer (CPU address space)
+ * @param[in] len Number of bytes
+ */
+FSDEV_PMA_INLINE void fsdev_pma_read_odd(const unsigned stride, uint8_t *buf,
+		const volatile uint16_t *pm, uint16_t len)
+{
+	uint32_t carry;
+
+	if (!len) {
+		return;
+	}
+
+	/* High byte of the PMA halfword is the next application byte */
+	carry = *pm;
+	pm += stride;
+	*buf++ = carry;
+	carry >>= 8;
+	len--;
+
+	if (((uintptr_t) buf & 2) && len >= 2) {
+		uint32_t h = *pm;
+		pm += stride;
+		*(fsdev_ram16 *) buf = carry | (h << 8);
+		carry = h >> 8;
+		buf += 2;
+		len -= 2;
+	}
+
+	for (; len >= 8; len -= 8) {
+		uint32_t h0 = pm[0], h1 = pm[stride];
+		uint32_t h2 = pm[stride * 2], h3 = pm[stride * 3];
+		((fsdev_ram32 *) buf)[0] = carry | (h0 << 8) | (h1 << 24);
+		((fsdev_ram32 *) buf)[1] = (h1 >> 8) | (h2 << 8) | (h3 << 24);
+		carry = h3 >> 8;
+		pm += stride * 4;
+		buf += 8;
+	}
+
+	if (len >= 4) {
+		uint32_t h0 = pm[0], h1 = pm[stride];
+		*(fsdev_ram32 *) buf = carry | (h0 << 8) | (h1 << 24);
+		carry = h1 >> 8;
+		pm += stride * 2;
+		buf += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		uint32_t h = *pm;
+		*(fsdev_ram16 *) buf = carry | (h << 8);
+		carry = h >> 8;
+		buf += 2;
+		len -= 2;
+	}
+
+	if (len) {
+		*buf = carry;
+	}
+}
+#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
+
+/**
+ * Write @a len bytes from @a vbuf to PMA
+ * If @a len is odd, the last PMA halfword high byte is written 0.
+ * @param[in] stride PMA halfword stride (compile time constant)
+ * @param[in] pm PMA pointer (CPU address space)
+ * @param[in] vbuf Buffer
+ * @param[in] len Number of bytes
+ */
+FSDEV_PMA_INLINE void fsdev_pma_write(const unsigned stride,
+		volatile uint16_t *pm, const void *vbuf, uint16_t len)
+{
+	const uint8_t *buf = vbuf;
+
+#if !defined(__ARM_FEATURE_UNALIGNED)
+	if ((uintptr_t) buf & 1) {
+		fsdev_pma_write_odd(stride, pm, buf, len);
+		return;
+	}
+#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
+
+	if (((uintptr_t) buf & 2) && len >= 2) {
+		*pm = *(const fsdev_ram16 *) buf;
+		pm += stride;
+		buf += 2;
+		len -= 2;
+	}
+
+	for (; len >= 8; len -= 8) {
+		uint32_t w0 = ((const fsdev_ram32 *) buf)[0];
+		uint32_t w1 = ((const fsdev_ram32 *) buf)[1];
+		pm[0] = w0;
+		pm[stride] = w0 >> 16;
+		pm[stride * 2] = w1;
+		pm[stride * 3] = w1 >> 16;
+		pm += stride * 4;
+		buf += 8;
+	}
+
+	if (len >= 4) {
+		uint32_t w0 = *(const fsdev_ram32 *) buf;
+		pm[0] = w0;
+		pm[stride] = w0 >> 16;
+		pm += stride * 2;
+		buf += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		*pm = *(const fsdev_ram16 *) buf;
+		pm += stride;
+		buf += 2;
+		len -= 2;
+	}
+
+	if (len) {
+		*pm = buf[0];
+	}
+}
+
+/**
+ * Read @a len bytes from PMA to @a vbuf
+ * @param[in] stride PMA halfword stride (compile time constant)
+ * @param[out] vbuf Buffer
+ * @param[in] pm PMA pointer (CPU address space)
+ * @param[in] len Number of bytes
+ */
+FSDEV_PMA_INLINE void fsdev_pma_read(const unsigned stride, void *vbuf,
+		const volatile uint16_t *pm, uint16_t len)
+{
+	uint8_t *buf = vbuf;
+
+#if !defined(__ARM_FEATURE_UNALIGNED)
+	if ((uintptr_t) buf & 1) {
+		fsdev_pma_read_odd(stride, buf, pm, len);
+		return;
+	}
+#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
+
+	if (((uintptr_t) buf & 2) && len >= 2) {
+		*(fsdev_ram16 *) buf = *pm;
+		pm += stride;
+		buf += 2;
+		len -= 2;
+	}
+
+	for (; len >= 8; len -= 8) {
+		uint32_t w0 = pm[0];
+		w0 |= (uint32_t) pm[stride] << 16;
+		uint32_t w1 = pm[stride * 2];
+		w1 |= (uint32_t) pm[stride * 3] << 16;
+		((fsdev_ram32 *) buf)[0] = w0;
+		((fsdev_ram32 *) buf)[1] = w1;
+		pm += stride * 4;
+		buf += 8;
+	}
+
+	if (len >= 4) {
+		uint32_t w0 = pm[0];
+		w0 |= (uint32_t) pm[stride] << 16;
+		*(fsdev_ram32 *) buf = w0;
+		pm += stride * 2;
+		buf += 4;
+		len -= 4;
+	}
+
+	if (len >= 2) {
+		*(fsdev_ram16 *) buf = *pm;
+		pm += stride;
+		buf += 2;
+		len -= 2;
+	}
+
+	if (len) {
+		buf[0] = *pm;
+	}
+}
+
+#endif
@@ -56,14 +56,65 @@
  * This limit can be managed by
  */
 
+/* Internal DMA mode (USBD_DMA feature)
+ * ====================================
+ * GAHBCFG.DMAEN is set, the core move the data between memory and FIFO.
+ * The RX FIFO is not read by CPU (RXFLVL is not used).
+ *
+ * Non-control endpoint:
+ *  The whole transfer is programmed (DxEPTSIZ, DxEPDMA) directly from
+ *  the URB buffer and the URB complete on XFRC.
+ *  The buffer should be 32bit aligned and not segmented.
+ *  For OUT, the length should be a multiple of endpoint size
+ *  (and endpoint size a multiple of 4) because the core write the whole
+ *  packet (rounded to word) to memory.
+ *  URB not fulfilling these conditions fail with USBD_ERR_INVALID.
+ *
+ * Control endpoint 0:
+ *  Data is copied packet by packet through the struct dwc_otg_ep0_dma
+ *  buffers given by the backend (descriptor are usually unaligned or in
+ *  flash).
+ *  SETUP packets are also received by DMA, and only when EP0 OUT is enabled,
+ *  so EP0 OUT is kept armed (without CNAK) when there is no OUT transfer.
+ *
+ * Note: on Cortex-M7 with D-Cache enabled, buffers should be placed in
+ *  non-cacheable memory.
+ */
+
 /* __VA_ARGS__ are the optional argument for the register
  *   ex: endpoint number */
 #define REBASE(REG, ...)	REG(dev->backend->base_address, ##__VA_ARGS__)
 
+/* Address as seen by the core AHB master */
+#define DMA_ADDR(ptr)	((uint32_t) (uintptr_t) (ptr))
+
+/* Register poll limit of wait_bits() (far more than the core need) */
+#if !defined(USBD_DWC_OTG_WAIT_LOOPS)
+# define USBD_DWC_OTG_WAIT_LOOPS 100000
+#endif
+
 static void fifo_to_memory(volatile uint32_t *fifo, void *mem,
-		unsigned bytes);
+		size_t bytes);
 static void memory_to_fifo(const void *mem, volatile uint32_t *fifo,
-		unsigned bytes);
+		size_t bytes);
+static void urb_to_fifo(usbd_device *dev, usbd_urb *urb,
+		volatile uint32_t *fifo, size_t bytes);
+static void fifo_to_urb(usbd_device *dev, usbd_urb *urb,
+		volatile uint32_t *fifo, size_t bytes);
+static void urb_to_memory(usbd_device *dev, usbd_urb *urb, void *mem,
+		size_t bytes);
+static void memory_to_urb(usbd_device *dev, usbd_urb *urb, const void *mem,
+		size_t bytes);
+
+/**
+ * Check if the internal DMA mode is used
+ * @param[in] dev USB Device
+ * @return true if the backend gave the EP0 DMA buffers
+ */
+static inline bool dma_enabled(usbd_device *dev)
+{
+	return dev->private_data.ep0_dma != NULL;
+}
 
 /**
  * Get the number of device endpoint the periph support (including ep0)
@@ -99,9 +150,38 @@ static inline uint16_t get_fifo_depth(usbd_device *dev)
 		value = DWC_OTG_GHWCFG3_DFIFODEPTH_GET(REBASE(DWC_OTG_GHWCFG3));
 	}
 
+	if (dma_enabled(dev)) {
+		/* Top of the FIFO RAM hold the DxEPDMA registers
+		 *  (one word per endpoint direction) */
+		value -= get_ep_count(dev) * 2;
+	}
+
 	return value;
 }
 
+/**
+ * Wait for register bits to be set (or cleared) by the core.
+ * The wait is bounded, a core without clock (or wedged) never answer.
+ * @param[in] reg Register
+ * @param[in] mask Bits
+ * @param[in] set true to wait for all bits set, false for all bits cleared
+ * @return false on timeout
+ */
+static bool wait_bits(volatile uint32_t *reg, uint32_t mask, bool set)
+{
+	unsigned i;
+
+	for (i = 0; i < USBD_DWC_OTG_WAIT_LOOPS; i++) {
+		uint32_t value = *reg & mask;
+		if (set ? (value == mask) : !value) {
+			return true;
+		}
+	}
+
+	LOGF_LN("Timeout waiting for bits %s", set ? "set" : "cleared");
+	return false;
+}
+
 /**
  * Flush FIFO
  * Perform a complete flush of RX and TX
@@ -113,18 +193,18 @@ static void flush_fifo(usbd_device *dev)
 	REBASE(DWC_OTG_GRSTCTL) = DWC_OTG_GRSTCTL_RXFFLSH |
 		(DWC_OTG_GRSTCTL_TXFFLSH | DWC_OTG_GRSTCTL_TXFNUM_ALL);
 
-	while (REBASE(DWC_OTG_GRSTCTL) &
-				(DWC_OTG_GRSTCTL_RXFFLSH | DWC_OTG_GRSTCTL_TXFFLSH));
+	wait_bits(&REBASE(DWC_OTG_GRSTCTL),
+		DWC_OTG_GRSTCTL_RXFFLSH | DWC_OTG_GRSTCTL_TXFFLSH, false);
 }
 
 void dwc_otg_init(usbd_device *dev)
 {
 	/* Wait for AHB idle. */
-	while (!(REBASE(DWC_OTG_GRSTCTL) & DWC_OTG_GRSTCTL_AHBIDL));
+	wait_bits(&REBASE(DWC_OTG_GRSTCTL), DWC_OTG_GRSTCTL_AHBIDL, true);
 
 	/* Do core soft reset. */
 	REBASE(DWC_OTG_GRSTCTL) |= DWC_OTG_GRSTCTL_CSRST;
-	while (REBASE(DWC_OTG_GRSTCTL) & DWC_OTG_GRSTCTL_CSRST);
+	wait_bits(&REBASE(DWC_OTG_GRSTCTL), DWC_OTG_GRSTCTL_CSRST, false);
 
 	/* Clear SDIS because newer version have set by default */
 	REBASE(DWC_OTG_DCTL) &= ~DWC_OTG_DCTL_SDIS;
@@ -145,6 +225,14 @@ void dwc_otg_init(usbd_device *dev)
 					DWC_OTG_GINTMSK_USBSUSPM |
 					DWC_OTG_GINTMSK_WUIM;
 
+	if (dma_enabled(dev)) {
+		/* Data is moved by core, OUT complete on XFRC (not RXFLVL) */
+		REBASE(DWC_OTG_GAHBCFG) |= DWC_OTG_GAHBCFG_DMAEN |
+						DWC_OTG_GAHBCFG_HBSTLEN_INCR4;
+		REBASE(DWC_OTG_GINTMSK) = (REBASE(DWC_OTG_GINTMSK) &
+						~DWC_OTG_GINTMSK_RXFLVLM) | DWC_OTG_GINTMSK_OEPINT;
+	}
+
 	REBASE(DWC_OTG_DAINTMSK) = 0;
 	REBASE(DWC_OTG_DIEPMSK) = DWC_OTG_DIEPMSK_XFRCM | DWC_OTG_DIEPMSK_EPDM;
 	REBASE(DWC_OTG_DOEPMSK) = DWC_OTG_DOEPMSK_XFRCM | DWC_OTG_DOEPMSK_BBLERR |
@@ -185,34 +273,22 @@ static void disable_all_non_ep0(usbd_device *dev)
 }
 
 /*
- * We are going to fill the FIFO from bottom to top.
- * Using this technique we can start allocating FIFO for dedicated TX FIFO.
- * and at the end (in dwc_otg_ep_prepare_end()) the remaining space will
- *  be used for RX FIFO
- *
- * RX FIFO (Slave Mode) =
- *   (5 * number of control endpoints + 8) +                             (e1)
- *   2 * ((largest USB packet used / 4) + 1 for status information)) +   (e2)
- *   (2 * number of OUT endpoints) + 1 for Global NAK                    (e3)
- *
- * e1: tracked by dev->private_data.fifo_rx_usage_overall
- * e2: tracked by dev->private_data.fifo_rx_usage_packet
- * e3: tracked by dev->private_data.fifo_rx_usage_overall
+ * FIFO RAM is not allocated in dwc_otg_ep_prepare().
+ * The endpoints are only recorded, and in dwc_otg_ep_prepare_end()
+ *  the planner (dwc_otg_fifo.h) partition the FIFO RAM into
+ *  RX FIFO (bottom) and dedicated TX FIFO for the complete endpoint set.
  */
 
 void dwc_otg_ep_prepare_start(usbd_device *dev)
 {
-	uint16_t fifo_word = DIVIDE_AND_CEIL(dev->info->device.desc->bMaxPacketSize0, 4);
-	fifo_word = MAX(fifo_word, 16);
+	struct dwc_otg_fifo_req *req = &dev->private_data.fifo_req;
 
-	dev->private_data.fifo_rx_usage_overall = 16; /* by EP0 and constant */
-	dev->private_data.fifo_rx_usage_packet = fifo_word + 1; /* EP0 */
+	memset(req, 0, sizeof(*req));
+	req->depth = get_fifo_depth(dev);
+	req->ep_count = get_ep_count(dev);
+	req->ep0_size = dev->info->device.desc->bMaxPacketSize0;
 
 	disable_all_non_ep0(dev);
-
-	dev->private_data.fifo_remaining = get_fifo_depth(dev) - fifo_word;
-	REBASE(DWC_OTG_DIEP0TXF) = DWC_OTG_DIEP0TXF_TX0FD(fifo_word) |
-					DWC_OTG_DIEP0TXF_TX0FSA(dev->private_data.fifo_remaining);
 }
 
 /* layout of EPTYPE for DOEPxCTL and DIEPxCTL is same */
@@ -227,40 +303,34 @@ void dwc_otg_ep_prepare(usbd_device *dev, uint8_t addr,
 					usbd_ep_type type, uint16_t max_size, uint16_t interval,
 					usbd_ep_flags flags)
 {
-	(void) interval;
+	struct dwc_otg_fifo_req *req = &dev->private_data.fifo_req;
+	uint8_t num = ENDPOINT_NUMBER(addr);
+	struct dwc_otg_fifo_ep ep = {
+		.max_size = max_size,
+		.type = type,
+		.flags = flags,
+		.interval = MIN(interval, 255)
+	};
 
-	/* Allocate double the FIFO if requested */
-	if (flags & USBD_EP_DOUBLE_BUFFER) {
-		LOGF_LN("DOUBLE_BUFFER flag for endpoint 0x%"PRIx8
-			", doubling max_size", addr);
-		max_size *= 2;
+	if (num >= MIN(req->ep_count, DWC_OTG_FIFO_EP_COUNT)) {
+		LOGF_LN("Endpoint 0x%"PRIx8" not supported by periph", addr);
+		return;
 	}
 
-	uint16_t fifo_word = DIVIDE_AND_CEIL(max_size, 4);
-	fifo_word = MAX(fifo_word, 16); /* required by periph */
-	uint8_t num = ENDPOINT_NUMBER(addr);
-
 	if (IS_IN_ENDPOINT(addr)) {
-		/* FIXME: underflow */
-		dev->private_data.fifo_remaining -= fifo_word; /* IN */
-
-		REBASE(DWC_OTG_DIEPxTXF, num) = DWC_OTG_DIEPTXF_INEPTXFD(fifo_word) |
-					DWC_OTG_DIEPTXF_INEPTXSA(dev->private_data.fifo_remaining);
+		req->in[num] = ep;
 
 		REBASE(DWC_OTG_DIEPxCTL, num) = DWC_OTG_DIEPCTL_SNAK |
 						DWC_OTG_DIEPCTL_SD0PID | eptyp_map[type] |
 						DWC_OTG_DIEPCTL_USBAEP | DWC_OTG_DIEPCTL_TXFNUM(num);
 	} else {
+		req->out[num] = ep;
+
 		if (type == USBD_EP_CONTROL) {
-			dev->private_data.fifo_rx_usage_overall += 13; /* Setup */
+			/* Bidirectional, also need a TX FIFO */
+			req->in[num] = ep;
 		}
 
-		dev->private_data.fifo_rx_usage_overall += 2;
-
-		uint16_t usage = fifo_word + ((flags & USBD_EP_DOUBLE_BUFFER) ? 2 : 1);
-		dev->private_data.fifo_rx_usage_packet =
-			MAX(dev->private_data.fifo_rx_usage_packet, usage); /* OUT */
-
 		REBASE(DWC_OTG_DOEPxCTL, num) = DWC_OTG_DOEPCTL_SNAK |
 							eptyp_map[type] | DWC_OTG_DOEPCTL_USBAEP |
 							DWC_OTG_DOEPCTL_SD0PID;
@@ -269,23 +339,35 @@ void dwc_otg_ep_prepare(usbd_device *dev, uint8_t addr,
 
 void dwc_otg_ep_prepare_end(usbd_device *dev)
 {
-	uint16_t fifo_rx = dev->private_data.fifo_rx_usage_overall +
-							dev->private_data.fifo_rx_usage_packet;
-
-	LOGF_LN("FIFO Available: %"PRIu16, get_fifo_depth(dev));
-	LOGF_LN("FIFO remaining after assigning to FIFO TX: %"PRIu16,
-						dev->private_data.fifo_remaining);
-	LOGF_LN("FIFO RX (need): %"PRIu16, fifo_rx);
+	const struct dwc_otg_fifo_req *req = &dev->private_data.fifo_req;
+	struct dwc_otg_fifo_plan plan;
+	unsigned i;
 
-	if (fifo_rx > dev->private_data.fifo_remaining) {
-		LOGF_LN("We need %"PRIu16" fifo words but %"PRIu16" is only left "
-			"after memory has been allocated to dedicated TX FIFO. "
-			"(Please reduce IN endpoints memory requirement)",
-			fifo_rx, dev->private_data.fifo_remaining);
+	if (!dwc_otg_fifo_plan(req, &plan)) {
+		LOGF_LN("FIFO: endpoints need more than the %"PRIu16" words "
+			"available (Please reduce endpoints memory requirement)",
+			req->depth);
 	}
 
-	/* Assign what ever is left to FIFO RX */
-	REBASE(DWC_OTG_GRXFSIZ) = dev->private_data.fifo_remaining;
+	LOGF_LN("FIFO RX: %"PRIu16" words (%"PRIu8" packets)",
+		plan.rx, plan.rx_packets);
+
+	REBASE(DWC_OTG_GRXFSIZ) = plan.rx;
+
+	REBASE(DWC_OTG_DIEP0TXF) = DWC_OTG_DIEP0TXF_TX0FD(plan.tx[0]) |
+					DWC_OTG_DIEP0TXF_TX0FSA(plan.tx_start[0]);
+
+	for (i = 1; i < MIN(req->ep_count, DWC_OTG_FIFO_EP_COUNT); i++) {
+		if (!plan.tx[i]) {
+			continue;
+		}
+
+		LOGF_LN("FIFO TX%u: %"PRIu16" words at %"PRIu16" (%"PRIu8" packets)",
+			i, plan.tx[i], plan.tx_start[i], plan.tx_packets[i]);
+
+		REBASE(DWC_OTG_DIEPxTXF, i) = DWC_OTG_DIEPTXF_INEPTXFD(plan.tx[i]) |
+					DWC_OTG_DIEPTXF_INEPTXSA(plan.tx_start[i]);
+	}
 
 	flush_fifo(dev);
 }
@@ -406,8 +488,7 @@ static void urb_to_fifo_1pkt(usbd_device *dev, usbd_urb *urb)
 		return;
 	}
 
-	void *buffer = usbd_urb_get_buffer_pointer(dev, urb, tx_len);
-	memory_to_fifo(buffer, &REBASE(DWC_OTG_FIFO, ep_num), tx_len);
+	urb_to_fifo(dev, urb, &REBASE(DWC_OTG_FIFO, ep_num), tx_len);
 	usbd_urb_inc_data_pointer(dev, urb, tx_len);
 
 	if (transfer->transferred >= transfer->length) {
@@ -416,6 +497,44 @@ static void urb_to_fifo_1pkt(usbd_device *dev, usbd_urb *urb)
 	}
 }
 
+/**
+ * Write as many packets as the TX FIFO can hold
+ * The transfer (PKTCNT, XFRSIZ) should already cover all the packets,
+ *  so not for EP0 (one packet programmed at a time).
+ * Free space is read once, space can only grow while writing.
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block (IN endpoint only)
+ */
+static void urb_to_fifo_fill(usbd_device *dev, usbd_urb *urb)
+{
+	LOG_CALL
+
+	usbd_transfer *transfer = &urb->transfer;
+	uint8_t ep_num = ENDPOINT_NUMBER(transfer->ep_addr);
+	volatile uint32_t *fifo = &REBASE(DWC_OTG_FIFO, ep_num);
+	uint32_t dieptxfsts = REBASE(DWC_OTG_DIEPxTXFSTS, ep_num);
+	uint16_t fifo_words_avail = DWC_OTG_DIEPTXFSTS_INEPTFSAV_GET(dieptxfsts);
+	size_t rem_len;
+
+	while ((rem_len = transfer->length - transfer->transferred)) {
+		size_t tx_len = MIN(transfer->ep_size, rem_len);
+		size_t tx_words = DIVIDE_AND_CEIL(tx_len, 4);
+
+		if (tx_words > fifo_words_avail) {
+			break;
+		}
+
+		urb_to_fifo(dev, urb, fifo, tx_len);
+		usbd_urb_inc_data_pointer(dev, urb, tx_len);
+		fifo_words_avail -= tx_words;
+	}
+
+	if (transfer->transferred >= transfer->length) {
+		/* Disabling TX Empty interrupt since we have no more data */
+		REBASE(DWC_OTG_DIEPEMPMSK) &= ~DWC_OTG_DIEPEMPMSK_INEPTXFEM(ep_num);
+	}
+}
+
 static inline uint16_t calc_pktcnt(size_t transfer_len, uint16_t ep_size)
 {
 	if (!transfer_len) {
@@ -425,6 +544,165 @@ static inline uint16_t calc_pktcnt(size_t transfer_len, uint16_t ep_size)
 	return DIVIDE_AND_CEIL(transfer_len, ep_size);
 }
 
+/**
+ * Copy next packet of EP0 IN @a urb to DMA buffer and program DIEP0DMA
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] bytes Number of bytes in packet
+ */
+static void ep0_in_dma(usbd_device *dev, usbd_urb *urb, size_t bytes)
+{
+	uint32_t *buf = dev->private_data.ep0_dma->in;
+
+	if (bytes) {
+		urb_to_memory(dev, urb, buf, bytes);
+		usbd_urb_inc_data_pointer(dev, urb, bytes);
+	}
+
+	REBASE(DWC_OTG_DIEPxDMA, 0) = DMA_ADDR(buf);
+}
+
+/**
+ * Enable EP0 OUT to receive SETUP packet (DMA mode)
+ * @param[in] dev USB Device
+ * @param[in] ep_size Endpoint size
+ * @param[in] cnak DWC_OTG_DOEP0CTL_CNAK to also accept a DATA packet, else 0
+ */
+static void ep0_out_dma_arm(usbd_device *dev, uint16_t ep_size, uint32_t cnak)
+{
+	REBASE(DWC_OTG_DOEP0TSIZ) = DWC_OTG_DOEP0TSIZ_STUPCNT_3 |
+				DWC_OTG_DOEP0TSIZ_PKTCNT_1 |
+				DWC_OTG_DOEP0TSIZ_XFRSIZ(ep_size);
+
+	REBASE(DWC_OTG_DOEPxDMA, 0) = DMA_ADDR(dev->private_data.ep0_dma->out);
+
+	REBASE(DWC_OTG_DOEP0CTL) = DWC_OTG_DOEP0CTL_EPENA |
+				DWC_OTG_DOEP0CTL_EPTYP_CONTROL | ep0_mps(ep_size) |
+				DWC_OTG_DOEP0CTL_USBAEP | cnak;
+
+	REBASE(DWC_OTG_DAINTMSK) |= DWC_OTG_DAINTMSK_OEPM(0);
+}
+
+/**
+ * Keep EP0 OUT armed for SETUP packet when no OUT transfer is pending.
+ * @param[in] dev USB Device
+ */
+static void ep0_out_dma_idle(usbd_device *dev)
+{
+	if (!(REBASE(DWC_OTG_DOEP0CTL) & DWC_OTG_DOEP0CTL_EPENA)) {
+		ep0_out_dma_arm(dev, dev->info->device.desc->bMaxPacketSize0, 0);
+	}
+}
+
+/**
+ * Copy the last SETUP packet received by DMA to setup_data.
+ * Core advance DOEP0DMA by 8 bytes on every (back to back) SETUP packet.
+ * @param[in] dev USB Device
+ */
+static void ep0_out_dma_setup(usbd_device *dev)
+{
+	const uint32_t *buf = dev->private_data.ep0_dma->out;
+	uint32_t offset = REBASE(DWC_OTG_DOEPxDMA, 0) - DMA_ADDR(buf);
+
+	if (offset < 8 || offset > sizeof(dev->private_data.ep0_dma->out)) {
+		LOGF_LN("Unexpected DOEP0DMA offset %u for SETUP", (unsigned) offset);
+		offset = 8;
+	}
+
+	memcpy(&dev->private_data.setup_data, &buf[(offset - 8) / 4], 8);
+}
+
+/**
+ * Copy the DATA packet received by DMA on EP0 OUT to @a urb
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @return USBD_SUCCESS or USBD_ERR_OVERFLOW
+ */
+static usbd_transfer_status ep0_out_dma_to_urb(usbd_device *dev,
+		usbd_urb *urb)
+{
+	usbd_transfer *transfer = &urb->transfer;
+	uint32_t rem = DWC_OTG_DOEP0TSIZ_XFRSIZ_GET(REBASE(DWC_OTG_DOEP0TSIZ));
+	size_t bcnt = transfer->ep_size - rem;
+	size_t space_avail = transfer->length - transfer->transferred;
+	size_t storable_len = MIN(bcnt, space_avail);
+
+	if (storable_len) {
+		memory_to_urb(dev, urb, dev->private_data.ep0_dma->out,
+							storable_len);
+		usbd_urb_inc_data_pointer(dev, urb, storable_len);
+	}
+
+	if (bcnt > space_avail) {
+		LOGF_LN("WARN: At maximum could accomodate %u bytes but host has"
+			"sent %u bytes", space_avail, bcnt);
+		return USBD_ERR_OVERFLOW;
+	}
+
+	return USBD_SUCCESS;
+}
+
+/**
+ * Check if the URB can be transferred by DMA directly from its buffer
+ * @param[in] urb USB Request Block (non-control endpoint)
+ * @return true if possible
+ */
+static bool urb_dma_capable(usbd_urb *urb)
+{
+	usbd_transfer *transfer = &urb->transfer;
+
+	if (transfer->flags & (USBD_FLAG_SEGMENTED | USBD_FLAG_PER_PACKET_CALLBACK |
+				USBD_FLAG_NO_MEMORY_INCREMENT)) {
+		return false;
+	}
+
+	/* DMA address need to be word aligned */
+	if (DMA_ADDR(transfer->buffer) & 0x3) {
+		return false;
+	}
+
+	if (IS_OUT_ENDPOINT(transfer->ep_addr)) {
+		/* Core write whole packet (rounded to word) to memory */
+		return transfer->length && !(transfer->ep_size & 0x3) &&
+				!(transfer->length % transfer->ep_size);
+	}
+
+	return true;
+}
+
+/**
+ * Account the data moved by DMA for non-control @a urb on XFRC
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @return Transfer status
+ */
+static usbd_transfer_status urb_dma_complete(usbd_device *dev, usbd_urb *urb)
+{
+	usbd_transfer *transfer = &urb->transfer;
+	uint8_t ep_num = ENDPOINT_NUMBER(transfer->ep_addr);
+
+	if (IS_IN_ENDPOINT(transfer->ep_addr)) {
+		uint32_t dieptsiz = REBASE(DWC_OTG_DIEPxTSIZ, ep_num);
+		size_t rem = DWC_OTG_DIEPTSIZ_XFRSIZ_GET(dieptsiz);
+		usbd_urb_inc_data_pointer(dev, urb, transfer->length - rem);
+		return USBD_SUCCESS;
+	}
+
+	/* For OUT, transfer size was programmed to transfer length */
+	uint32_t doeptsiz = REBASE(DWC_OTG_DOEPxTSIZ, ep_num);
+	size_t rem = DWC_OTG_DOEPTSIZ_XFRSIZ_GET(doeptsiz);
+	usbd_urb_inc_data_pointer(dev, urb, transfer->length - rem);
+
+	if (rem && transfer->ep_type == USBD_EP_BULK &&
+			(transfer->flags & USBD_FLAG_NO_SHORT_PACKET)) {
+		/* Short packet received when it flagged
+		 *  that short packet will cause transfer failure */
+		return USBD_ERR_SHORT_PACKET;
+	}
+
+	return USBD_SUCCESS;
+}
+
 static void urb_submit_ep0(usbd_device *dev, usbd_urb *urb)
 {
 	LOG_CALL
@@ -455,12 +733,16 @@ static void urb_submit_ep0(usbd_device *dev, usbd_urb *urb)
 		REBASE(DWC_OTG_DIEP0TSIZ) = DWC_OTG_DIEP0TSIZ_PKTCNT_1 |
 					DWC_OTG_DIEP0TSIZ_XFRSIZ(xfrsiz);
 
+		if (dma_enabled(dev)) {
+			ep0_in_dma(dev, urb, xfrsiz);
+		}
+
 		REBASE(DWC_OTG_DIEP0CTL) = DWC_OTG_DIEP0CTL_EPENA | mps |
 						DWC_OTG_DIEP0CTL_EPTYP_CONTROL |
 						DWC_OTG_DIEP0CTL_CNAK | DWC_OTG_DIEP0CTL_USBAEP;
 
 		/* Push first packet to memory! */
-		if (transfer->length) {
+		if (transfer->length && !dma_enabled(dev)) {
 			urb_to_fifo_1pkt(dev, urb);
 		}
 
@@ -472,18 +754,23 @@ static void urb_submit_ep0(usbd_device *dev, usbd_urb *urb)
 
 		pktcnt--;
 
-		/* "For OUT transfers, the Transfer Size field in the endpoint’s
-		 *  Transfer Size register must be a multiple of the maximum packet
-		 * size of the endpoint, adjusted to the DWORD boundary."
-		 *  For control, the endpoint size can only be 8, 16, 32, 64 (no problem)
-		 */
-		REBASE(DWC_OTG_DOEP0TSIZ) = DWC_OTG_DOEP0TSIZ_STUPCNT_3 |
-					DWC_OTG_DOEP0TSIZ_PKTCNT_1 |
-					DWC_OTG_DOEP0TSIZ_XFRSIZ(transfer->ep_size);
+		if (dma_enabled(dev)) {
+			/* Same as SETUP arming, but also accept DATA packet */
+			ep0_out_dma_arm(dev, transfer->ep_size, DWC_OTG_DOEP0CTL_CNAK);
+		} else {
+			/* "For OUT transfers, the Transfer Size field in the endpoint’s
+			 *  Transfer Size register must be a multiple of the maximum packet
+			 * size of the endpoint, adjusted to the DWORD boundary."
+			 *  For control, the endpoint size can only be 8, 16, 32, 64
+			 *  (no problem) */
+			REBASE(DWC_OTG_DOEP0TSIZ) = DWC_OTG_DOEP0TSIZ_STUPCNT_3 |
+						DWC_OTG_DOEP0TSIZ_PKTCNT_1 |
+						DWC_OTG_DOEP0TSIZ_XFRSIZ(transfer->ep_size);
 
-		REBASE(DWC_OTG_DOEP0CTL) = DWC_OTG_DOEP0CTL_EPENA |
-					DWC_OTG_DOEP0CTL_EPTYP_CONTROL | DWC_OTG_DOEP0CTL_CNAK |
-					mps | DWC_OTG_DOEP0CTL_USBAEP;
+			REBASE(DWC_OTG_DOEP0CTL) = DWC_OTG_DOEP0CTL_EPENA |
+						DWC_OTG_DOEP0CTL_EPTYP_CONTROL | DWC_OTG_DOEP0CTL_CNAK |
+						mps | DWC_OTG_DOEP0CTL_USBAEP;
+		}
 
 		/* Enable Interrupt */
 		REBASE(DWC_OTG_DAINTMSK) |= DWC_OTG_DAINTMSK_OEPM(0);
@@ -519,6 +806,13 @@ static void urb_submit_non_ep0(usbd_device *dev, usbd_urb *urb)
 
 	usbd_transfer *transfer = &urb->transfer;
 	uint8_t ep_num = ENDPOINT_NUMBER(transfer->ep_addr);
+	bool dma = dma_enabled(dev);
+
+	if (dma && !urb_dma_capable(urb)) {
+		LOGF_LN("URB %"PRIu64" buffer/length not suitable for DMA", urb->id);
+		usbd_urb_complete(dev, urb, USBD_ERR_INVALID);
+		return;
+	}
 
 	/* Calculate the number of packet to transmit */
 	uint16_t pktcnt = calc_pktcnt(transfer->length, transfer->ep_size);
@@ -542,17 +836,22 @@ static void urb_submit_non_ep0(usbd_device *dev, usbd_urb *urb)
 					DWC_OTG_DIEPTSIZ_PKTCNT(pktcnt) |
 					DWC_OTG_DIEPTSIZ_XFRSIZ(transfer->length);
 
+		if (dma) {
+			/* Core fetch all the packets from buffer */
+			REBASE(DWC_OTG_DIEPxDMA, ep_num) = DMA_ADDR(transfer->buffer);
+		}
+
 		REBASE(DWC_OTG_DIEPxCTL, ep_num) = DWC_OTG_DIEPCTL_EPENA |
 					DWC_OTG_DIEPCTL_MPSIZ(transfer->ep_size) |
 					DWC_OTG_DIEPCTL_CNAK | DWC_OTG_DIEPCTL_TXFNUM(ep_num) |
 					eptyp_map[transfer->ep_type] | DWC_OTG_DIEPCTL_USBAEP;
 
-		/* Push first packet to memory! */
-		if (transfer->length) {
+		/* Push packets to memory! */
+		if (transfer->length && !dma) {
 			/* Enable empty interrupt mask */
 			REBASE(DWC_OTG_DIEPEMPMSK) |= DWC_OTG_DIEPEMPMSK_INEPTXFEM(ep_num);
 
-			urb_to_fifo_1pkt(dev, urb);
+			urb_to_fifo_fill(dev, urb);
 		}
 
 		/* Enable Interrupt */
@@ -571,6 +870,11 @@ static void urb_submit_non_ep0(usbd_device *dev, usbd_urb *urb)
 									DWC_OTG_DOEPTSIZ_PKTCNT(pktcnt) |
 									DWC_OTG_DOEPTSIZ_XFRSIZ(xfrsiz);
 
+		if (dma) {
+			/* Core store all the packets to buffer */
+			REBASE(DWC_OTG_DOEPxDMA, ep_num) = DMA_ADDR(transfer->buffer);
+		}
+
 		REBASE(DWC_OTG_DOEPxCTL, ep_num) = DWC_OTG_DOEPCTL_EPENA |
 					DWC_OTG_DOEPCTL_CNAK |
 					DWC_OTG_DOEPCTL_MPSIZ(transfer->ep_size) |
@@ -594,8 +898,56 @@ void dwc_otg_urb_submit(usbd_device *dev, usbd_urb *urb)
 
 void dwc_otg_urb_cancel(usbd_device *dev, usbd_urb *urb)
 {
-	(void) dev;
-	(void) urb;
+	uint8_t ep_addr = urb->transfer.ep_addr;
+	uint8_t ep_num = ENDPOINT_NUMBER(ep_addr);
+
+	if (!dma_enabled(dev) || !ep_num) {
+		/* Nothing in flight refer to URB buffer */
+		return;
+	}
+
+	/* Core would keep accessing the URB buffer, disable the endpoint */
+	if (IS_IN_ENDPOINT(ep_addr)) {
+		if (!(REBASE(DWC_OTG_DIEPxCTL, ep_num) & DWC_OTG_DIEPCTL_EPENA)) {
+			return;
+		}
+
+		/* Timeout: disconnected or wedged core, nothing more can be done */
+		REBASE(DWC_OTG_DIEPxCTL, ep_num) |= DWC_OTG_DIEPCTL_SNAK;
+		wait_bits(&REBASE(DWC_OTG_DIEPxINT, ep_num),
+			DWC_OTG_DIEPINT_INEPNE, true);
+
+		REBASE(DWC_OTG_DIEPxCTL, ep_num) |= DWC_OTG_DIEPCTL_EPDIS;
+		wait_bits(&REBASE(DWC_OTG_DIEPxINT, ep_num),
+			DWC_OTG_DIEPINT_EPDISD, true);
+
+		REBASE(DWC_OTG_DIEPxINT, ep_num) = DWC_OTG_DIEPINT_INEPNE |
+						DWC_OTG_DIEPINT_EPDISD;
+		REBASE(DWC_OTG_DAINTMSK) &= ~DWC_OTG_DAINTMSK_IEPM(ep_num);
+
+		/* Data already fetched by core */
+		REBASE(DWC_OTG_GRSTCTL) = DWC_OTG_GRSTCTL_TXFFLSH |
+						DWC_OTG_GRSTCTL_TXFNUM(ep_num);
+		wait_bits(&REBASE(DWC_OTG_GRSTCTL), DWC_OTG_GRSTCTL_TXFFLSH, false);
+	} else {
+		if (!(REBASE(DWC_OTG_DOEPxCTL, ep_num) & DWC_OTG_DOEPCTL_EPENA)) {
+			return;
+		}
+
+		/* OUT endpoint can only be disabled in global OUT NAK */
+		REBASE(DWC_OTG_DCTL) |= DWC_OTG_DCTL_SGONAK;
+		wait_bits(&REBASE(DWC_OTG_GINTSTS), DWC_OTG_GINTSTS_GONAKEFF, true);
+
+		REBASE(DWC_OTG_DOEPxCTL, ep_num) |= DWC_OTG_DOEPCTL_EPDIS |
+						DWC_OTG_DOEPCTL_SNAK;
+		wait_bits(&REBASE(DWC_OTG_DOEPxINT, ep_num),
+			DWC_OTG_DOEPINT_EPDISD, true);
+
+		REBASE(DWC_OTG_DOEPxINT, ep_num) = DWC_OTG_DOEPINT_EPDISD;
+		REBASE(DWC_OTG_DAINTMSK) &= ~DWC_OTG_DAINTMSK_OEPM(ep_num);
+
+		REBASE(DWC_OTG_DCTL) |= DWC_OTG_DCTL_CGONAK;
+	}
 }
 
 /**
@@ -643,6 +995,203 @@ static void memory_to_fifo(const void *mem, volatile uint32_t *fifo,
 	}
 }
 
+/**
+ * Copy @a bytes count from segment list to FIFO ( @a fifo)
+ * Word that straddle segments is assembled before writing to FIFO.
+ * @param[in] seg Segment
+ * @param[in] offset Offset in @a seg to start from
+ * @param[in] fifo FIFO pointer
+ * @param[in] bytes Number of bytes to copy
+ */
+static void segments_to_fifo(const usbd_segment *seg, size_t offset,
+			volatile uint32_t *fifo, size_t bytes)
+{
+	uint32_t word = 0;
+	unsigned fill = 0;
+
+	while (bytes) {
+		size_t chunk = MIN(seg->len - offset, bytes);
+		const uint8_t *mem = (const uint8_t *) seg->ptr + offset;
+
+		seg++;
+		offset = 0;
+		bytes -= chunk;
+
+		/* Complete the word started by previous segment */
+		while (fill && chunk) {
+			word |= (uint32_t) *mem++ << (fill * 8);
+			chunk--;
+			if (++fill == 4) {
+				*fifo = word;
+				word = 0;
+				fill = 0;
+			}
+		}
+
+		if (!fill && chunk >= 4) {
+			size_t whole = chunk & ~3;
+			memory_to_fifo(mem, fifo, whole);
+			mem += whole;
+			chunk -= whole;
+		}
+
+		/* Remaining (less than 4 bytes) go to next word */
+		while (chunk--) {
+			word |= (uint32_t) *mem++ << (fill * 8);
+			fill++;
+		}
+	}
+
+	if (fill) {
+		*fifo = word;
+	}
+}
+
+/**
+ * Copy @a bytes count from FIFO ( @a fifo) to segment list
+ * Word that straddle segments is split after reading from FIFO.
+ * @param[in] fifo FIFO pointer
+ * @param[in] seg Segment
+ * @param[in] offset Offset in @a seg to start from
+ * @param[in] bytes Number of bytes to copy
+ */
+static void fifo_to_segments(volatile uint32_t *fifo, const usbd_segment *seg,
+			size_t offset, size_t bytes)
+{
+	uint32_t word = 0;
+	unsigned avail = 0;
+
+	while (bytes) {
+		size_t chunk = MIN(seg->len - offset, bytes);
+		uint8_t *mem = (uint8_t *) seg->ptr + offset;
+
+		seg++;
+		offset = 0;
+		bytes -= chunk;
+
+		/* Use the remaining of word read for previous segment */
+		while (avail && chunk) {
+			*mem++ = word;
+			word >>= 8;
+			avail--;
+			chunk--;
+		}
+
+		if (chunk >= 4) {
+			size_t whole = chunk & ~3;
+			fifo_to_memory(fifo, mem, whole);
+			mem += whole;
+			chunk -= whole;
+		}
+
+		if (chunk) {
+			word = *fifo;
+			avail = 4;
+			while (chunk--) {
+				*mem++ = word;
+				word >>= 8;
+				avail--;
+			}
+		}
+	}
+}
+
+/**
+ * Copy next @a bytes of @a urb to FIFO
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] fifo FIFO pointer
+ * @param[in] bytes Number of bytes to copy
+ */
+static void urb_to_fifo(usbd_device *dev, usbd_urb *urb,
+		volatile uint32_t *fifo, size_t bytes)
+{
+	if (urb->transfer.flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, bytes, &offset);
+		segments_to_fifo(seg, offset, fifo, bytes);
+	} else {
+		void *buffer = usbd_urb_get_buffer_pointer(dev, urb, bytes);
+		memory_to_fifo(buffer, fifo, bytes);
+	}
+}
+
+/**
+ * Copy @a bytes from FIFO to @a urb (at current position)
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] fifo FIFO pointer
+ * @param[in] bytes Number of bytes to copy
+ */
+static void fifo_to_urb(usbd_device *dev, usbd_urb *urb,
+		volatile uint32_t *fifo, size_t bytes)
+{
+	if (urb->transfer.flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, bytes, &offset);
+		fifo_to_segments(fifo, seg, offset, bytes);
+	} else {
+		void *buffer = usbd_urb_get_buffer_pointer(dev, urb, bytes);
+		fifo_to_memory(fifo, buffer, bytes);
+	}
+}
+
+/**
+ * Copy next @a bytes of @a urb to memory @a mem
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] mem Memory pointer
+ * @param[in] bytes Number of bytes to copy (non zero)
+ */
+static void urb_to_memory(usbd_device *dev, usbd_urb *urb, void *mem,
+		size_t bytes)
+{
+	if (urb->transfer.flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, bytes, &offset);
+		uint8_t *dst = mem;
+
+		while (bytes) {
+			size_t chunk = MIN(seg->len - offset, bytes);
+			memcpy(dst, (const uint8_t *) seg->ptr + offset, chunk);
+			dst += chunk;
+			bytes -= chunk;
+			seg++;
+			offset = 0;
+		}
+	} else {
+		memcpy(mem, usbd_urb_get_buffer_pointer(dev, urb, bytes), bytes);
+	}
+}
+
+/**
+ * Copy @a bytes from memory @a mem to @a urb (at current position)
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] mem Memory pointer
+ * @param[in] bytes Number of bytes to copy (non zero)
+ */
+static void memory_to_urb(usbd_device *dev, usbd_urb *urb, const void *mem,
+		size_t bytes)
+{
+	if (urb->transfer.flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, bytes, &offset);
+		const uint8_t *src = mem;
+
+		while (bytes) {
+			size_t chunk = MIN(seg->len - offset, bytes);
+			memcpy((uint8_t *) seg->ptr + offset, src, chunk);
+			src += chunk;
+			bytes -= chunk;
+			seg++;
+			offset = 0;
+		}
+	} else {
+		memcpy(usbd_urb_get_buffer_pointer(dev, urb, bytes), mem, bytes);
+	}
+}
+
 /**
  * Read data from FIFO and thow it away
  * @param[in] dev USB Device
@@ -713,8 +1262,7 @@ static void fifo_to_urb_1pkt(usbd_device *dev, usbd_urb *urb, uint16_t bcnt)
 	/* Copy what ever is possible to buffer */
 	size_t space_avail = transfer->length - transfer->transferred;
 	size_t storable_len = MIN(bcnt, space_avail);
-	void *buffer = usbd_urb_get_buffer_pointer(dev, urb, storable_len);
-	fifo_to_memory(&REBASE(DWC_OTG_FIFO, 0), buffer, storable_len);
+	fifo_to_urb(dev, urb, &REBASE(DWC_OTG_FIFO, 0), storable_len);
 	usbd_urb_inc_data_pointer(dev, urb, storable_len);
 
 	if (bcnt > space_avail) {
@@ -726,8 +1274,8 @@ static void fifo_to_urb_1pkt(usbd_device *dev, usbd_urb *urb, uint16_t bcnt)
 	}
 
 	if (bcnt < transfer->ep_size) {
-		if (transfer->ep_type == USBD_EP_BULK) {
-			LOGF_LN("Short packet received for Bulk endpoint 0x%"PRIx8,
+		if (transfer->ep_type != USBD_EP_CONTROL) {
+			LOGF_LN("Short packet received for endpoint 0x%"PRIx8,
 						transfer->ep_addr);
 
 			if (transfer->flags & USBD_FLAG_SHORT_PACKET) {
@@ -844,10 +1392,14 @@ static void process_in_endpoint_interrupt(usbd_device *dev, uint8_t ep_num)
 			REBASE(DWC_OTG_DIEP0TSIZ) = DWC_OTG_DIEP0TSIZ_PKTCNT_1 |
 				DWC_OTG_DIEP0TSIZ_XFRSIZ(xfrsiz);
 
+			if (dma_enabled(dev)) {
+				ep0_in_dma(dev, urb, xfrsiz);
+			}
+
 			REBASE(DWC_OTG_DIEP0CTL) |= DWC_OTG_DIEP0CTL_EPENA |
 											DWC_OTG_DIEP0CTL_CNAK;
 
-			if (xfrsiz) {
+			if (xfrsiz && !dma_enabled(dev)) {
 				urb_to_fifo_1pkt(dev, urb);
 			}
 		} else {
@@ -862,13 +1414,24 @@ static void process_in_endpoint_interrupt(usbd_device *dev, uint8_t ep_num)
 
 			/* The URB has been processed, do the callback */
 			if (urb != NULL) {
-				usbd_urb_complete(dev, urb, USBD_SUCCESS);
+				usbd_transfer_status status = USBD_SUCCESS;
+
+				if (ep_num && dma_enabled(dev)) {
+					status = urb_dma_complete(dev, urb);
+				}
+
+				usbd_urb_complete(dev, urb, status);
 			}
 		}
 
 		return;
 	}
 
+	if (dma_enabled(dev)) {
+		/* FIFO is filled by core */
+		return;
+	}
+
 	if (REBASE(DWC_OTG_DIEPxINT, ep_num) & DWC_OTG_DIEPINT_TXFE) {
 		/* Send more data */
 		LOGF_LN("Sending more data for endpoint 0x%"PRIx8, ep_addr);
@@ -878,7 +1441,11 @@ static void process_in_endpoint_interrupt(usbd_device *dev, uint8_t ep_num)
 			 *  In this case, clearing NAK is probably a NOP */
 			REBASE(DWC_OTG_DIEPxCTL, ep_num) |= DWC_OTG_DIEPCTL_CNAK;
 
-			urb_to_fifo_1pkt(dev, urb);
+			if (ep_num) {
+				urb_to_fifo_fill(dev, urb);
+			} else {
+				urb_to_fifo_1pkt(dev, urb);
+			}
 		}
 	}
 
@@ -918,17 +1485,28 @@ static void process_out_endpoint_interrupt(usbd_device *dev, uint8_t ep_num)
 
 		LOGF_LN("Transfer Complete: endpoint 0x%"PRIx8, ep_addr);
 		usbd_urb *urb = usbd_find_active_urb(dev, ep_addr);
+		usbd_transfer_status status = USBD_SUCCESS;
 
-		if (!ep_num && urb != NULL && dev->private_data.ep0tsiz_pktcnt) {
+		if (!ep_num && urb != NULL && dma_enabled(dev)) {
+			status = ep0_out_dma_to_urb(dev, urb);
+		}
+
+		if (!ep_num && urb != NULL && dev->private_data.ep0tsiz_pktcnt &&
+				status == USBD_SUCCESS) {
 			/* We are still expecting data! */
 
 			dev->private_data.ep0tsiz_pktcnt--;
 
-			REBASE(DWC_OTG_DOEP0TSIZ) = DWC_OTG_DOEP0TSIZ_STUPCNT_3 |
-						DWC_OTG_DOEP0TSIZ_PKTCNT_1 |
-						DWC_OTG_DOEP0TSIZ_XFRSIZ(urb->transfer.ep_size);
+			if (dma_enabled(dev)) {
+				ep0_out_dma_arm(dev, urb->transfer.ep_size,
+								DWC_OTG_DOEP0CTL_CNAK);
+			} else {
+				REBASE(DWC_OTG_DOEP0TSIZ) = DWC_OTG_DOEP0TSIZ_STUPCNT_3 |
+							DWC_OTG_DOEP0TSIZ_PKTCNT_1 |
+							DWC_OTG_DOEP0TSIZ_XFRSIZ(urb->transfer.ep_size);
 
-			REBASE(DWC_OTG_DOEP0CTL) |= DWC_OTG_DOEP0CTL_EPENA;
+				REBASE(DWC_OTG_DOEP0CTL) |= DWC_OTG_DOEP0CTL_EPENA;
+			}
 		} else {
 			/* Set NAK on the endpoint */
 			REBASE(DWC_OTG_DOEPxCTL, ep_num) |= DWC_OTG_DOEPCTL_SNAK;
@@ -940,7 +1518,15 @@ static void process_out_endpoint_interrupt(usbd_device *dev, uint8_t ep_num)
 
 			/* The URB has been processed, do the callback */
 			if (urb != NULL) {
-				usbd_urb_complete(dev, urb, USBD_SUCCESS);
+				if (ep_num && dma_enabled(dev)) {
+					status = urb_dma_complete(dev, urb);
+				}
+
+				usbd_urb_complete(dev, urb, status);
+			}
+
+			if (!ep_num && dma_enabled(dev)) {
+				ep0_out_dma_idle(dev);
 			}
 		}
 	}
@@ -949,8 +1535,16 @@ static void process_out_endpoint_interrupt(usbd_device *dev, uint8_t ep_num)
 		LOGF_LN("Setup phase done for endpoint 0x%"PRIx8, ep_addr);
 		REBASE(DWC_OTG_DOEPxINT, ep_num) = DWC_OTG_DOEPINT_STUP;
 
+		if (!ep_num && dma_enabled(dev)) {
+			ep0_out_dma_setup(dev);
+		}
+
 		REBASE(DWC_OTG_DOEPxTSIZ, ep_num) |= DWC_OTG_DOEPTSIZ_STUPCNT_3;
 		usbd_handle_setup(dev, ep_num, &dev->private_data.setup_data);
+
+		if (!ep_num && dma_enabled(dev)) {
+			ep0_out_dma_idle(dev);
+		}
 	}
 
 	if (REBASE(DWC_OTG_DOEPxINT, ep_num) & DWC_OTG_DOEPINT_OTEPDIS) {
@@ -990,11 +1584,19 @@ void dwc_otg_poll(usbd_device *dev)
 		REBASE(DWC_OTG_DIEPxINT, 0) = 0xFFFF;
 		REBASE(DWC_OTG_GINTSTS) = DWC_OTG_GINTSTS_ENUMDNE;
 		usbd_handle_reset(dev);
+
+		if (dma_enabled(dev)) {
+			/* SETUP packet are only received when EP0 OUT is enabled */
+			ep0_out_dma_arm(dev, dev->info->device.desc->bMaxPacketSize0, 0);
+		}
 		return;
 	}
 
-	/* process endpoint RX data */
-	while (REBASE(DWC_OTG_GINTSTS) & DWC_OTG_GINTSTS_RXFLVL) {
+	/* process endpoint RX data (in DMA mode, RX FIFO is read by core)
+	 * All the entries are popped in one go: packets received while
+	 *  the interrupt was pending do not cost another interrupt. */
+	while (!dma_enabled(dev) &&
+			(REBASE(DWC_OTG_GINTSTS) & DWC_OTG_GINTSTS_RXFLVL)) {
 		handle_rxflvl_interrupt(dev);
 	}
 
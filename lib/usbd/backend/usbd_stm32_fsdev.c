@@ -24,12 +24,24 @@ struct stm32_fsdev_private_data {
 	/** The number of bytes of endpoint buffer memory used.
 	 *  @note used by backend */
 	uint16_t pma_used;
+
+	/** Double buffered endpoints (bit n = endpoint n) */
+	uint8_t dbl_buf;
+
+	/** Double buffered IN: packet buffer filled but not transmitted yet
+	 *  (bit 2n = buffer 0 of endpoint n, bit 2n+1 = buffer 1) */
+	uint16_t dbl_filled;
+
+	/** Double buffered IN: zero length packet still to queue
+	 *  (bit n = endpoint n) */
+	uint8_t dbl_zlp;
 };
 
 #define USBD_DEVICE_EXTRA \
 	struct stm32_fsdev_private_data private_data;
 
 #include "../usbd_private.h"
+#include "stm32_fsdev_pma.h"
 
 #include <unicore-mx/cm3/common.h>
 #include <unicore-mx/stm32/rcc.h>
@@ -218,6 +230,37 @@ static inline void set_u16_pma(uint16_t usb_local, uint16_t value)
 	MMIO16(USB_PMA_BASE + (usb_local * PMA_U16_STRIDE)) = value;
 }
 
+/*
+ * Call PMA copy kernel (stm32_fsdev_pma.h) with compile time stride.
+ * F3: the two layouts are compiled in, selected once per call.
+ */
+#define PMA_PTR(stride, usb_local) \
+	(&MMIO16(USB_PMA_BASE + ((usb_local) * (stride))))
+
+#if defined(STM32F3)
+# define PMA_KERNEL_WRITE(usb_local, buf, len) do { \
+	if (PMA_U16_STRIDE == 2) { \
+		fsdev_pma_write(2, PMA_PTR(2, usb_local), buf, len); \
+	} else { \
+		fsdev_pma_write(1, PMA_PTR(1, usb_local), buf, len); \
+	} \
+} while (0)
+# define PMA_KERNEL_READ(buf, usb_local, len) do { \
+	if (PMA_U16_STRIDE == 2) { \
+		fsdev_pma_read(2, buf, PMA_PTR(2, usb_local), len); \
+	} else { \
+		fsdev_pma_read(1, buf, PMA_PTR(1, usb_local), len); \
+	} \
+} while (0)
+#else
+# define PMA_KERNEL_WRITE(usb_local, buf, len) \
+	fsdev_pma_write(PMA_U16_STRIDE, PMA_PTR(PMA_U16_STRIDE, usb_local), \
+		buf, len)
+# define PMA_KERNEL_READ(buf, usb_local, len) \
+	fsdev_pma_read(PMA_U16_STRIDE, buf, PMA_PTR(PMA_U16_STRIDE, usb_local), \
+		len)
+#endif /* defined(STM32F3) */
+
 /**
  * Write data of @a len from @a vBuf to @a usb_local
  * @param usb_local PMA Address (in USB Local)
@@ -226,74 +269,142 @@ static inline void set_u16_pma(uint16_t usb_local, uint16_t value)
  */
 static void write_to_pma(uint16_t usb_local, const void *vBuf, uint16_t len)
 {
-	volatile uint16_t *hPM =
-		&MMIO16(USB_PMA_BASE + (usb_local * PMA_U16_STRIDE));
+	PMA_KERNEL_WRITE(usb_local, vBuf, len);
+}
 
-	len = DIVIDE_AND_CEIL(len, 2);
+/**
+ * Read data of @a len from @a usb_local to @a vBuf
+ * @param vBuf Buffer location
+ * @param usb_local PMA Address (in USB Local)
+ * @param len Number of bytes
+ */
+static void read_from_pma(void *vBuf, uint16_t usb_local, uint16_t len)
+{
+	PMA_KERNEL_READ(vBuf, usb_local, len);
+}
 
-#if !defined(__ARM_FEATURE_UNALIGNED)
-	if(((uintptr_t) vBuf) & 0x01) {
-		const uint8_t *uBuf = vBuf;
+/**
+ * Write data of @a len from segment list to @a usb_local
+ * Byte pair that straddle two segments is assembled directly in PMA.
+ * @param usb_local PMA Address (in USB Local)
+ * @param seg Segment
+ * @param offset Offset in @a seg to start from
+ * @param len Number of bytes
+ */
+static void write_segments_to_pma(uint16_t usb_local, const usbd_segment *seg,
+		size_t offset, uint16_t len)
+{
+	while (len) {
+		uint16_t chunk = MIN(seg->len - offset, len);
+		const uint8_t *buf = (const uint8_t *) seg->ptr + offset;
+
+		seg++;
+		offset = 0;
+		len -= chunk;
+
+		if ((chunk & 1) && len) {
+			/* Last byte share the PMA halfword with the next segment */
+			chunk -= 1;
+			write_to_pma(usb_local, buf, chunk);
+			usb_local += chunk;
+
+			while (!seg->len) {
+				seg++;
+			}
 
-		while (len--) {
-			*hPM = (uBuf[1] << 8) | uBuf[0];
-			hPM += PMA_U16_STRIDE;
-			uBuf += 2;
+			set_u16_pma(usb_local, buf[chunk] |
+				(*(const uint8_t *) seg->ptr << 8));
+			usb_local += 2;
+			offset = 1;
+			len -= 1;
+			continue;
 		}
 
-		return;
-	}
-#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
-
-	const uint16_t *hBuf = vBuf;
-
-	while (len--) {
-		*hPM = *hBuf++;
-		hPM += PMA_U16_STRIDE;
+		write_to_pma(usb_local, buf, chunk);
+		usb_local += chunk;
 	}
 }
 
 /**
- * Read data of @a len from @a usb_local to @a vBuf
- * @param vBuf Buffer location
+ * Read data of @a len from @a usb_local to segment list
+ * Byte pair that straddle two segments is split directly from PMA.
+ * @param seg Segment
+ * @param offset Offset in @a seg to start from
  * @param usb_local PMA Address (in USB Local)
  * @param len Number of bytes
  */
-static void read_from_pma(void *vBuf, uint16_t usb_local, uint16_t len)
+static void read_segments_from_pma(const usbd_segment *seg, size_t offset,
+		uint16_t usb_local, uint16_t len)
 {
-	const volatile uint16_t *hPM =
-		&MMIO16(USB_PMA_BASE + (usb_local * PMA_U16_STRIDE));
-	bool odd = !!(len & 1);
-	len /= 2;
-
-#if !defined(__ARM_FEATURE_UNALIGNED)
-	if(((uintptr_t) vBuf) & 0x01) {
-		uint8_t *uBuf = vBuf;
-
-		while (len--) {
-			register uint16_t value = *hPM;
-			hPM += PMA_U16_STRIDE;
-			*uBuf++ = value;
-			*uBuf++ = value >> 8;
-		}
+	while (len) {
+		uint16_t chunk = MIN(seg->len - offset, len);
+		uint8_t *buf = (uint8_t *) seg->ptr + offset;
+
+		seg++;
+		offset = 0;
+		len -= chunk;
+
+		if ((chunk & 1) && len) {
+			/* Last byte share the PMA halfword with the next segment */
+			chunk -= 1;
+			read_from_pma(buf, usb_local, chunk);
+			usb_local += chunk;
+
+			while (!seg->len) {
+				seg++;
+			}
 
-		if (odd) {
-			*uBuf = *(volatile uint8_t *) hPM;
+			uint16_t value = get_u16_pma(usb_local);
+			buf[chunk] = value;
+			*(uint8_t *) seg->ptr = value >> 8;
+			usb_local += 2;
+			offset = 1;
+			len -= 1;
+			continue;
 		}
 
-		return;
+		read_from_pma(buf, usb_local, chunk);
+		usb_local += chunk;
 	}
-#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
-
-	uint16_t *hBuf = vBuf;
+}
 
-	while (len--) {
-		*hBuf++ = *hPM;
-		hPM += PMA_U16_STRIDE;
+/**
+ * Write next @a len bytes of @a urb to @a usb_local
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param usb_local PMA Address (in USB Local)
+ * @param len Number of bytes
+ */
+static void urb_to_pma(usbd_device *dev, usbd_urb *urb, uint16_t usb_local,
+		uint16_t len)
+{
+	if (urb->transfer.flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, len, &offset);
+		write_segments_to_pma(usb_local, seg, offset, len);
+	} else {
+		void *buffer = usbd_urb_get_buffer_pointer(dev, urb, len);
+		write_to_pma(usb_local, buffer, len);
 	}
+}
 
-	if (odd) {
-		*(uint8_t *) hBuf = *(volatile uint8_t *) hPM;
+/**
+ * Read @a len bytes from @a usb_local to @a urb (at current position)
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param usb_local PMA Address (in USB Local)
+ * @param len Number of bytes
+ */
+static void pma_to_urb(usbd_device *dev, usbd_urb *urb, uint16_t usb_local,
+		uint16_t len)
+{
+	if (urb->transfer.flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, len, &offset);
+		read_segments_from_pma(seg, offset, usb_local, len);
+	} else {
+		void *buffer = usbd_urb_get_buffer_pointer(dev, urb, len);
+		read_from_pma(buffer, usb_local, len);
 	}
 }
 
@@ -345,6 +456,74 @@ static inline void ep_set_type(uint8_t num, uint16_t eptype)
 	USB_EP(num) = ep;
 }
 
+/*
+ * Double buffered endpoints
+ * =========================
+ *
+ * Bulk endpoint prepared with USBD_EP_DOUBLE_BUFFER (EP_KIND = DBL_BUF)
+ *  and isochronous endpoint (always) use two packet buffers.
+ * The BTABLE entry of the unused direction hold the second buffer, so the
+ *  reverse direction endpoint cannot be used.
+ *
+ * The DTOG bit of the endpoint direction select the buffer used by the
+ *  peripheral (toggled by hardware after each transaction).
+ * Bulk: the DTOG bit of the unused direction (SW_BUF) select the buffer
+ *  owned by application, the peripheral NAK when DTOG == SW_BUF.
+ *  Isochronous: no flow control, application use the other buffer.
+ *
+ * IN: on submit, the first packet is copied in the buffer transmitted next,
+ *  handed to the peripheral, and the second packet copied in the idle buffer.
+ *  On CTR_TX, the idle buffer (already filled) is handed to the peripheral
+ *  and the buffer just transmitted is refilled while the other is on wire.
+ *  URB data pointer is incremented when a packet is copied to PMA.
+ *
+ * OUT: on CTR_RX, if the URB expect more data, the other buffer is given
+ *  back to peripheral before copying the received packet out of PMA.
+ */
+
+/**
+ * Test if endpoint @a num use two packet buffers
+ * @param dev USB Device
+ * @param num Endpoint number (not including direction)
+ */
+static inline bool ep_is_dbl_buf(usbd_device *dev, uint8_t num)
+{
+	return !!(dev->private_data.dbl_buf & (1 << num));
+}
+
+/** Bit of usbd_device::private_data::dbl_filled for buffer @a buf of @a num */
+#define DBL_FILLED(num, buf) (1 << (((num) * 2) + (buf)))
+
+/**
+ * Toggle the SW_BUF bit of double buffered bulk endpoint
+ * @param num Endpoint number (not including direction)
+ * @param rx true for OUT endpoint, false for IN endpoint
+ */
+static inline void ep_toggle_sw_buf(uint8_t num, bool rx)
+{
+	uint16_t ep = USB_EP(num);
+	ep &= USB_EP_TYPE_MASK | USB_EP_KIND | USB_EP_EA_MASK;
+	ep |= USB_EP_CTR_RX | USB_EP_CTR_TX;
+	ep |= rx ? USB_EP_SW_BUF_RX : USB_EP_SW_BUF_TX;
+	USB_EP(num) = ep;
+}
+
+/**
+ * Test if the peripheral is blocked by the application (DTOG == SW_BUF)
+ * @param num Endpoint number (not including direction)
+ * @param rx true for OUT endpoint, false for IN endpoint
+ */
+static inline bool ep_sw_buf_blocked(uint8_t num, bool rx)
+{
+	uint16_t ep = USB_EP(num);
+
+	if (rx) {
+		return !(ep & USB_EP_DTOG_RX) == !(ep & USB_EP_SW_BUF_RX);
+	} else {
+		return !(ep & USB_EP_DTOG_TX) == !(ep & USB_EP_SW_BUF_TX);
+	}
+}
+
 /** Initialize the USB device controller hardware of the STM32. */
 static usbd_device *init(const usbd_backend_config *config)
 {
@@ -363,6 +542,7 @@ static usbd_device *init(const usbd_backend_config *config)
 	_usbd_dev.backend = &usbd_stm32_fsdev;
 	_usbd_dev.config = config;
 	_usbd_dev.private_data.pma_used = 0;
+	_usbd_dev.private_data.dbl_buf = 0;
 
 	USB_BTABLE = 0;
 	USB_ISTR = 0;
@@ -412,6 +592,10 @@ static void disable_non_ep0(usbd_device *dev)
 		USB_EP(i) = USB_EP(i) & (USB_EP_TYPE_MASK | USB_EP_EA_MASK |
 						USB_EP_STAT_RX_MASK | USB_EP_STAT_TX_MASK);
 	}
+
+	dev->private_data.dbl_buf = 0;
+	dev->private_data.dbl_filled = 0;
+	dev->private_data.dbl_zlp = 0;
 }
 
 /**
@@ -534,10 +718,18 @@ static void ep_prepare(usbd_device *dev, uint8_t addr, usbd_ep_type type,
 	LOG_CALL
 
 	(void) interval;
-	(void) flags;
 
 	uint8_t num = ENDPOINT_NUMBER(addr);
-	uint16_t reg16 = USB_EP(num) & ~(USB_EP_EA_MASK | USB_EP_TYPE_MASK);
+	uint16_t reg16 = USB_EP(num) & ~(USB_EP_EA_MASK | USB_EP_TYPE_MASK |
+										USB_EP_KIND);
+
+	/* Isochronous endpoint are always double buffered by hardware */
+	bool dbl = (type == USBD_EP_ISOCHRONOUS) ||
+		(type == USBD_EP_BULK && (flags & USBD_EP_DOUBLE_BUFFER));
+
+	if ((flags & USBD_EP_DOUBLE_BUFFER) && !dbl) {
+		LOGF_LN("DOUBLE_BUFFER flag ignored for endpoint 0x%"PRIx8, addr);
+	}
 
 	if (IS_IN_ENDPOINT(addr)) {
 		reg16 &= ~(USB_EP_STAT_RX_MASK | USB_EP_CTR_TX);
@@ -547,23 +739,52 @@ static void ep_prepare(usbd_device *dev, uint8_t addr, usbd_ep_type type,
 		reg16 &= ~(USB_EP_STAT_TX_MASK | USB_EP_CTR_RX);
 		reg16 |= USB_EP_CTR_TX;
 		reg16 ^= USB_EP_STAT_RX_NAK;
+
+		/* DTOG_RX = 0, SW_BUF = 1: peripheral can receive in buffer 0 */
+		if (dbl) {
+			reg16 ^= USB_EP_SW_BUF_RX;
+		}
+	}
+
+	if (type == USBD_EP_BULK && dbl) {
+		reg16 |= USB_EP_DBL_BUF;
 	}
 
 	USB_EP(num) = reg16 | eptype_map[type] | num;
 
+	if (dbl) {
+		dev->private_data.dbl_buf |= 1 << num;
+	} else {
+		dev->private_data.dbl_buf &= ~(1 << num);
+	}
+
+	uint16_t pma_addr = dev->private_data.pma_used;
+
 	if (IS_IN_ENDPOINT(addr)) {
 		/* convert max_size multiple of 2 (up) */
 		if (max_size & 1) {
 			max_size += 1;
 		}
 
-		set_u16_pma(USB_EP_ADDR_TX(num), dev->private_data.pma_used);
+		set_u16_pma(USB_EP_ADDR_TX(num), pma_addr);
+
+		if (dbl) {
+			set_u16_pma(USB_EP_ADDR_TX_1(num), pma_addr + max_size);
+		}
 	} else {
-		set_u16_pma(USB_EP_ADDR_RX(num), dev->private_data.pma_used);
-		set_u16_pma(USB_EP_COUNT_RX(num), calc_ep_count_rx(&max_size));
+		uint16_t count_rx = calc_ep_count_rx(&max_size);
+
+		if (dbl) {
+			set_u16_pma(USB_EP_ADDR_RX_0(num), pma_addr);
+			set_u16_pma(USB_EP_COUNT_RX_0(num), count_rx);
+			pma_addr += max_size;
+		}
+
+		set_u16_pma(USB_EP_ADDR_RX(num), pma_addr);
+		set_u16_pma(USB_EP_COUNT_RX(num), count_rx);
 	}
 
-	dev->private_data.pma_used += max_size;
+	dev->private_data.pma_used += dbl ? (max_size * 2) : max_size;
 
 	if (dev->private_data.pma_used > dev->config->priv_mem) {
 		LOG_LN(">>> WARNING: PMA overflow. "
@@ -625,8 +846,6 @@ static bool get_ep_stall(usbd_device *dev, uint8_t addr)
 
 static void set_ep_dtog(usbd_device *dev, uint8_t addr, bool dtog)
 {
-	(void) dev;
-
 	uint8_t num = ENDPOINT_NUMBER(addr);
 	uint16_t dtog_mask = IS_IN_ENDPOINT(addr) ? USB_EP_DTOG_TX : USB_EP_DTOG_RX;
 	uint16_t reg16 = USB_EP(num);
@@ -634,6 +853,12 @@ static void set_ep_dtog(usbd_device *dev, uint8_t addr, bool dtog)
 	if (dtog_cur != dtog) {
 		reg16 &= USB_EP_EA_MASK | USB_EP_KIND | USB_EP_TYPE_MASK;
 		reg16 |= USB_EP_CTR_RX | USB_EP_CTR_TX;
+
+		if (ep_is_dbl_buf(dev, num)) {
+			/* DTOG also select the buffer, keep SW_BUF relative to it */
+			dtog_mask |= USB_EP_DTOG_TX | USB_EP_DTOG_RX;
+		}
+
 		USB_EP(num) = reg16 | dtog_mask;
 	}
 }
@@ -725,7 +950,17 @@ static void process_out_interrupt(usbd_device *dev, uint8_t num)
 {
 	LOG_CALL
 
-	uint16_t len = USB_EP_COUNT_RX_COUNT_GET(get_u16_pma(USB_EP_COUNT_RX(num)));
+	uint16_t addr_rx = USB_EP_ADDR_RX(num);
+	uint16_t count_rx = USB_EP_COUNT_RX(num);
+	bool dbl = ep_is_dbl_buf(dev, num);
+
+	if (dbl && (USB_EP(num) & USB_EP_DTOG_RX)) {
+		/* DTOG_RX already toggled: packet is in buffer 0 */
+		addr_rx = USB_EP_ADDR_RX_0(num);
+		count_rx = USB_EP_COUNT_RX_0(num);
+	}
+
+	uint16_t len = USB_EP_COUNT_RX_COUNT_GET(get_u16_pma(count_rx));
 
 	ep_clear_ctr(num, true);
 
@@ -742,13 +977,21 @@ static void process_out_interrupt(usbd_device *dev, uint8_t num)
 		return;
 	}
 
-	/* Copy data from PMA to memory */
 	size_t space_avail = transfer->length - transfer->transferred;
+
+	if (dbl && transfer->ep_type == USBD_EP_BULK &&
+			len == transfer->ep_size && len < space_avail &&
+			ep_sw_buf_blocked(num, true)) {
+		/* More data expected: let the peripheral receive in the other
+		 *  buffer while this one is being copied */
+		ep_toggle_sw_buf(num, true);
+	}
+
+	/* Copy data from PMA to memory */
 	size_t storable_len = MIN(len, space_avail);
 
 	if (storable_len) {
-		void *buffer = usbd_urb_get_buffer_pointer(dev, urb, storable_len);
-		read_from_pma(buffer, get_u16_pma(USB_EP_ADDR_RX(num)), storable_len);
+		pma_to_urb(dev, urb, get_u16_pma(addr_rx), storable_len);
 		usbd_urb_inc_data_pointer(dev, urb, storable_len);
 	}
 
@@ -760,8 +1003,8 @@ static void process_out_interrupt(usbd_device *dev, uint8_t num)
 	}
 
 	if (len < transfer->ep_size) {
-		if (transfer->ep_type == USBD_EP_BULK) {
-			LOGF_LN("Short packet received for Bulk endpoint 0x%"PRIx8,
+		if (transfer->ep_type != USBD_EP_CONTROL) {
+			LOGF_LN("Short packet received for endpoint 0x%"PRIx8,
 						transfer->ep_addr);
 
 			if (transfer->flags & USBD_FLAG_SHORT_PACKET) {
@@ -784,9 +1027,78 @@ static void process_out_interrupt(usbd_device *dev, uint8_t num)
 	}
 
 	/* More data! */
+	if (dbl && transfer->ep_type == USBD_EP_BULK &&
+			ep_sw_buf_blocked(num, true)) {
+		ep_toggle_sw_buf(num, true);
+	}
+
 	ep_set_stat(num, true, USB_EP_STAT_RX_VALID);
 }
 
+/**
+ * Copy the next packet of @a urb to buffer @a buf of double buffered
+ *  IN endpoint
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param num Endpoint number
+ * @param buf Buffer (0 or 1)
+ * @return true if a packet has been copied
+ * @return false if no more packet to transmit
+ */
+static bool dbl_in_fill(usbd_device *dev, usbd_urb *urb, uint8_t num,
+						unsigned buf)
+{
+	usbd_transfer *transfer = &urb->transfer;
+	size_t len = MIN(transfer->length - transfer->transferred,
+						transfer->ep_size);
+
+	if (!len) {
+		if (!(dev->private_data.dbl_zlp & (1 << num))) {
+			return false;
+		}
+
+		dev->private_data.dbl_zlp &= ~(1 << num);
+	} else {
+		uint16_t addr_tx = buf ? USB_EP_ADDR_TX_1(num) : USB_EP_ADDR_TX_0(num);
+		urb_to_pma(dev, urb, get_u16_pma(addr_tx), len);
+		usbd_urb_inc_data_pointer(dev, urb, len);
+	}
+
+	set_u16_pma(buf ? USB_EP_COUNT_TX_1(num) : USB_EP_COUNT_TX_0(num),
+					len & 0x3FF);
+	dev->private_data.dbl_filled |= DBL_FILLED(num, buf);
+	return true;
+}
+
+/**
+ * Process double buffered endpoint IN interrupt
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param num Endpoint number
+ */
+static void process_dbl_in_interrupt(usbd_device *dev, usbd_urb *urb,
+					uint8_t num)
+{
+	/* DTOG_TX already toggled: buffer transmitted next */
+	unsigned next = !!(USB_EP(num) & USB_EP_DTOG_TX);
+
+	dev->private_data.dbl_filled &= ~DBL_FILLED(num, !next);
+
+	if (!(dev->private_data.dbl_filled & DBL_FILLED(num, next))) {
+		/* Nothing left in PMA, all data transmitted */
+		perform_urb_complete(dev, urb, USBD_SUCCESS);
+		return;
+	}
+
+	if (urb->transfer.ep_type == USBD_EP_BULK) {
+		/* Hand over the prefilled buffer */
+		ep_toggle_sw_buf(num, false);
+	}
+
+	/* Refill the transmitted buffer while the other is on wire */
+	dbl_in_fill(dev, urb, num, !next);
+}
+
 /**
  * Process endpoint IN interrupt
  * @param dev USB Device
@@ -803,6 +1115,11 @@ static void process_in_interrupt(usbd_device *dev, uint8_t num)
 		return;
 	}
 
+	if (ep_is_dbl_buf(dev, num)) {
+		process_dbl_in_interrupt(dev, urb, num);
+		return;
+	}
+
 	usbd_transfer *transfer = &urb->transfer;
 	uint16_t old_len = get_u16_pma(USB_EP_COUNT_TX(num)) & 0x3FF;
 	usbd_urb_inc_data_pointer(dev, urb, old_len);
@@ -843,8 +1160,7 @@ static void process_in_interrupt(usbd_device *dev, uint8_t num)
 
 	/* sending more data */
 	size_t len = MIN(rem, transfer->ep_size);
-	void *buffer = usbd_urb_get_buffer_pointer(dev, urb, len);
-	write_to_pma(get_u16_pma(USB_EP_ADDR_TX(num)), buffer, len);
+	urb_to_pma(dev, urb, get_u16_pma(USB_EP_ADDR_TX(num)), len);
 
 	set_u16_pma(USB_EP_COUNT_TX(num), len & 0x3FF);
 	if ((USB_EP(num) & USB_EP_STAT_TX_MASK) != USB_EP_STAT_TX_STALL) {
@@ -954,12 +1270,30 @@ static void urb_submit_in(usbd_device *dev, usbd_urb *urb)
 	/* WARN: IN, OUT endpoint have to be of same type for same endpoint number */
 	ep_set_type(num, eptype_map[transfer->ep_type]);
 
-	if (len) {
-		void *buffer = usbd_urb_get_buffer_pointer(dev, urb, len);
-		write_to_pma(get_u16_pma(USB_EP_ADDR_TX(num)), buffer, len);
-	}
+	if (ep_is_dbl_buf(dev, num)) {
+		/* Buffer transmitted next (SW_BUF == DTOG_TX: owned by application) */
+		unsigned next = !!(USB_EP(num) & USB_EP_DTOG_TX);
 
-	set_u16_pma(USB_EP_COUNT_TX(num), len & 0x3FF);
+		if (!transfer->length || (transfer->ep_type == USBD_EP_BULK &&
+				(transfer->flags & USBD_FLAG_SHORT_PACKET) &&
+				!(transfer->length % transfer->ep_size))) {
+			dev->private_data.dbl_zlp |= 1 << num;
+		}
+
+		dbl_in_fill(dev, urb, num, next);
+
+		if (transfer->ep_type == USBD_EP_BULK) {
+			ep_toggle_sw_buf(num, false);
+		}
+
+		dbl_in_fill(dev, urb, num, !next);
+	} else {
+		if (len) {
+			urb_to_pma(dev, urb, get_u16_pma(USB_EP_ADDR_TX(num)), len);
+		}
+
+		set_u16_pma(USB_EP_COUNT_TX(num), len & 0x3FF);
+	}
 
 	/* control endpoint will override stall stat */
 	if (transfer->ep_type == USBD_EP_CONTROL ||
@@ -981,6 +1315,12 @@ static void urb_submit_out(usbd_device *dev, usbd_urb *urb)
 	/* WARN: IN, OUT endpoint have to be of same type for same endpoint number */
 	ep_set_type(num, eptype_map[transfer->ep_type]);
 
+	if (transfer->ep_type == USBD_EP_BULK && ep_is_dbl_buf(dev, num) &&
+			ep_sw_buf_blocked(num, true)) {
+		/* Last transfer left the buffers with application */
+		ep_toggle_sw_buf(num, true);
+	}
+
 	if (transfer->ep_type == USBD_EP_CONTROL && !transfer->length) {
 		/* set STATUS_OUT=1 */
 		uint16_t reg16 = USB_EP(num);
@@ -1015,9 +1355,45 @@ static void urb_submit(usbd_device *dev, usbd_urb *urb)
 #endif
 }
 
+/**
+ * Discard the packets of double buffered IN endpoint still in PMA.
+ * The URB data pointer was incremented when the packet was copied, so
+ *  the untransmitted bytes are removed from @a urb transferred count.
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param num Endpoint number
+ */
+static void dbl_in_discard(usbd_device *dev, usbd_urb *urb, uint8_t num)
+{
+	uint16_t reg16 = USB_EP(num);
+	unsigned buf;
+
+	if (reg16 & USB_EP_CTR_TX) {
+		/* Transmitted, but interrupt not processed yet */
+		dev->private_data.dbl_filled &=
+			~DBL_FILLED(num, !(reg16 & USB_EP_DTOG_TX));
+	}
+
+	for (buf = 0; buf < 2; buf++) {
+		if (dev->private_data.dbl_filled & DBL_FILLED(num, buf)) {
+			uint16_t count_tx = buf ? USB_EP_COUNT_TX_1(num) :
+									USB_EP_COUNT_TX_0(num);
+			urb->transfer.transferred -= get_u16_pma(count_tx) & 0x3FF;
+		}
+	}
+
+	dev->private_data.dbl_filled &= ~(DBL_FILLED(num, 0) | DBL_FILLED(num, 1));
+	dev->private_data.dbl_zlp &= ~(1 << num);
+
+	/* Take back the buffer handed to peripheral (SW_BUF == DTOG_TX) */
+	if (urb->transfer.ep_type == USBD_EP_BULK &&
+			!ep_sw_buf_blocked(num, false)) {
+		ep_toggle_sw_buf(num, false);
+	}
+}
+
 static void urb_cancel(usbd_device *dev, usbd_urb *urb)
 {
-	(void) dev;
 	uint8_t addr = urb->transfer.ep_addr;
 	uint8_t num = ENDPOINT_NUMBER(addr);
 
@@ -1026,6 +1402,10 @@ static void urb_cancel(usbd_device *dev, usbd_urb *urb)
 		if ((USB_EP(num) & USB_EP_STAT_TX_MASK) == USB_EP_STAT_TX_VALID) {
 			ep_set_stat(num, false, USB_EP_STAT_TX_NAK);
 		}
+
+		if (ep_is_dbl_buf(dev, num)) {
+			dbl_in_discard(dev, urb, num);
+		}
 	} else {
 		if ((USB_EP(num) & USB_EP_STAT_RX_MASK) == USB_EP_STAT_RX_VALID) {
 			ep_set_stat(num, true, USB_EP_STAT_RX_NAK);
@@ -35,6 +35,9 @@ static usbd_device *init(const usbd_backend_config *config);
 
 static struct usbd_device _usbd_dev;
 
+/* EP0 buffers of the internal DMA mode (USBD_DMA) */
+static struct dwc_otg_ep0_dma _ep0_dma;
+
 const struct usbd_backend usbd_stm32_otg_hs = {
 	.init = init,
 	.set_address = dwc_otg_set_address,
@@ -155,6 +158,10 @@ static usbd_device *init(const usbd_backend_config *config)
 		}
 	}
 
+	/* Internal DMA (AHB master) */
+	_usbd_dev.private_data.ep0_dma =
+		(config->feature & USBD_DMA) ? &_ep0_dma : NULL;
+
 	dwc_otg_init(&_usbd_dev);
 
 	return &_usbd_dev;
@@ -0,0 +1,546 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/audio.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * Ring: single producer / single consumer, index in bytes.
+ *  Playback: usbd_poll() context write [head], DMA hook read [tail].
+ *  Capture: DMA hook write [head], usbd_poll() context read [tail].
+ *
+ * Feedback (playback):
+ *  Every feedback_period SOF, the audio clock advance is divided by the
+ *  number of SOF periods elapsed (from usbd_frame_number(), so SOF
+ *  callbacks delayed or merged by usbd_poll() latency are not a problem)
+ *  and smoothed. A correction proportional to (target - fill) is added
+ *  so that the ring do not drift, the clock measurement alone cannot
+ *  see the samples already accumulated.
+ */
+
+/* URB queued on the data endpoint */
+#define URBS_MAX 2
+
+/* usbd_frame_number() is 11 bits */
+#define FRAME_MASK 0x7FF
+
+#define FEEDBACK_PERIOD_DEFAULT 64
+
+/* Smoothing of the measured clock: 1 / 2^n of the new measurement */
+#define FEEDBACK_SMOOTH_SHIFT 2
+
+/* Fill error correction: 1 / 2^n of the error per SOF period */
+#define FEEDBACK_FILL_SHIFT 8
+
+/* Fill correction limit: nominal / 2^n (1.5%) */
+#define FEEDBACK_CORRECTION_SHIFT 6
+
+/* Measurement accepted: nominal +/- nominal / 2^n (12.5%) */
+#define FEEDBACK_RANGE_SHIFT 3
+
+static void data_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+static void feedback_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static inline bool is_playback(usbd_audio *audio)
+{
+	return !IS_IN_ENDPOINT(audio->config.ep_addr);
+}
+
+/**
+ * Copy from ring
+ * @param[in] audio Audio
+ * @param[out] dest Destination
+ * @param[in] index Ring index
+ * @param[in] len Length
+ */
+static void ring_read(usbd_audio *audio, void *dest, uint32_t index,
+				size_t len)
+{
+	const size_t size = audio->config.size;
+	const uint8_t *ring = audio->config.buffer;
+	size_t off = index & (size - 1);
+
+	if (off + len > size) {
+		memcpy(dest, ring + off, size - off);
+		memcpy((uint8_t *) dest + (size - off), ring, len - (size - off));
+	} else {
+		memcpy(dest, ring + off, len);
+	}
+}
+
+/**
+ * Copy to ring
+ * @param[in] audio Audio
+ * @param[in] index Ring index
+ * @param[in] src Source
+ * @param[in] len Length
+ */
+static void ring_write(usbd_audio *audio, uint32_t index, const void *src,
+				size_t len)
+{
+	const size_t size = audio->config.size;
+	uint8_t *ring = audio->config.buffer;
+	size_t off = index & (size - 1);
+
+	if (off + len > size) {
+		memcpy(ring + off, src, size - off);
+		memcpy(ring, (const uint8_t *) src + (size - off), len - (size - off));
+	} else {
+		memcpy(ring + off, src, len);
+	}
+}
+
+static void submit(usbd_audio *audio, uint8_t ep_addr, void *buf, size_t len,
+			usbd_transfer_flags flags, usbd_transfer_callback callback)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_ISOCHRONOUS,
+		.ep_addr = ep_addr,
+		.ep_size = (ep_addr == audio->config.ep_addr) ?
+				audio->config.ep_size : sizeof(audio->feedback.packet),
+		.ep_interval = 1,
+		.buffer = buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback,
+		.user_data = audio
+	};
+
+	usbd_transfer_submit(audio->dev, &transfer);
+}
+
+/**
+ * Samples to send in the next capture packet
+ * Nominal (with the fraction carried over), +/- one sample to bring the
+ *  ring back to target fill, limited to what the ring and packet hold.
+ * @param[in] audio Audio
+ * @return number of bytes
+ */
+static size_t capture_packet_len(usbd_audio *audio)
+{
+	const size_t frame_bytes = audio->config.frame_bytes;
+	uint32_t fill = (LOAD_ACQUIRE(&audio->ring.head) - audio->ring.tail) /
+				frame_bytes;
+	uint32_t target = audio->config.target / frame_bytes;
+	uint32_t n;
+
+	audio->acc += audio->rate;
+	n = audio->acc / audio->sof_rate;
+	audio->acc -= n * audio->sof_rate;
+
+	if (fill > target + n) {
+		n++;
+	} else if (fill + n < target && n) {
+		n--;
+	}
+
+	n = MIN(n, fill);
+	n = MIN(n, audio->config.ep_size / frame_bytes);
+
+	return n * frame_bytes;
+}
+
+/**
+ * Submit a data URB
+ * @param[in] audio Audio
+ * @param[in] buf Packet buffer
+ */
+static void data_submit(usbd_audio *audio, uint8_t *buf)
+{
+	if (is_playback(audio)) {
+		/* Packet size is decided by host */
+		submit(audio, audio->config.ep_addr, buf, audio->config.ep_size,
+			USBD_FLAG_SHORT_PACKET, data_callback);
+	} else {
+		size_t len = capture_packet_len(audio);
+
+		ring_read(audio, buf, audio->ring.tail, len);
+		STORE_RELEASE(&audio->ring.tail, audio->ring.tail + len);
+		submit(audio, audio->config.ep_addr, buf, len, USBD_FLAG_NONE,
+			data_callback);
+	}
+
+	audio->urbs++;
+}
+
+/**
+ * Submit feedback URB with the latest value
+ * @param[in] audio Audio
+ */
+static void feedback_submit(usbd_audio *audio)
+{
+	uint32_t value = audio->feedback.value;
+	uint8_t *packet = audio->feedback.packet;
+
+	packet[0] = value;
+	packet[1] = value >> 8;
+	packet[2] = value >> 16;
+	packet[3] = value >> 24;
+
+	/* 10.14 is sent on 3 bytes */
+	submit(audio, audio->config.ep_feedback, packet,
+		(audio->feedback_shift == 14) ? 3 : 4, USBD_FLAG_NONE,
+		feedback_callback);
+}
+
+/**
+ * Account transfer completion
+ * @param[in] audio Audio
+ * @param[in] status Status
+ * @return false if the stream is stopped (do not resubmit)
+ */
+static bool complete(usbd_audio *audio, usbd_transfer_status status)
+{
+	if (!audio->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("audio", status)) {
+	case USBD_CLASS_SUCCESS:
+	return true;
+	case USBD_CLASS_STOP:
+		audio->running = false;
+		audio->urbs = 0;
+	return false;
+	default:
+		/* Isochronous: packet is lost, stream continue */
+		audio->stats.errors++;
+	return true;
+	}
+}
+
+static void data_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_audio *audio = transfer->user_data;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(audio, status)) {
+		return;
+	}
+
+	audio->urbs--;
+
+	if (status == USBD_SUCCESS) {
+		audio->stats.packets++;
+	}
+
+	if (is_playback(audio) && status == USBD_SUCCESS) {
+		uint32_t head = audio->ring.head;
+		size_t len = transfer->transferred;
+		size_t space = audio->config.size -
+				(head - LOAD_ACQUIRE(&audio->ring.tail));
+
+		/* Whole packet or nothing, so frames stay aligned */
+		if (len > space) {
+			audio->stats.dropped += len;
+		} else {
+			ring_write(audio, head, transfer->buffer, len);
+			STORE_RELEASE(&audio->ring.head, head + len);
+		}
+	}
+
+	data_submit(audio, transfer->buffer);
+}
+
+static void feedback_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_audio *audio = transfer->user_data;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(audio, status)) {
+		return;
+	}
+
+	feedback_submit(audio);
+}
+
+/**
+ * Set rate dependent values
+ * @param[in] audio Audio
+ */
+static void rate_update(usbd_audio *audio)
+{
+	audio->feedback.nominal = ((uint64_t) audio->rate <<
+				audio->feedback_shift) / audio->sof_rate;
+	audio->feedback.measured = audio->feedback.nominal;
+	audio->feedback.value = audio->feedback.nominal;
+	audio->feedback.started = false;
+	audio->acc = 0;
+}
+
+void usbd_audio_init(usbd_audio *audio, usbd_device *dev,
+				const usbd_audio_config *config)
+{
+	memset(audio, 0, sizeof(*audio));
+	audio->dev = dev;
+	audio->config = *config;
+	audio->rate = config->rate;
+
+	if (!audio->config.target) {
+		audio->config.target = config->size / 2;
+	}
+
+	if (!audio->config.feedback_period) {
+		audio->config.feedback_period = FEEDBACK_PERIOD_DEFAULT;
+	} else if (audio->config.feedback_period > FRAME_MASK) {
+		audio->config.feedback_period = FRAME_MASK;
+	}
+
+	/* Full speed till usbd_audio_start() know the bus speed */
+	audio->sof_rate = 1000;
+	audio->feedback_shift = 14;
+	rate_update(audio);
+}
+
+void usbd_audio_set_rate(usbd_audio *audio, uint32_t rate)
+{
+	audio->rate = rate;
+	rate_update(audio);
+
+	if (audio->config.rate_callback != NULL) {
+		audio->config.rate_callback(audio);
+	}
+}
+
+static usbd_control_transfer_feedback freq_callback(usbd_device *dev,
+				const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_audio *audio;
+	const uint8_t *freq = arg->buffer;
+
+	(void) dev;
+
+	/* Data stage was received in usbd_audio::freq */
+	audio = (usbd_audio *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_audio, freq));
+
+	usbd_audio_set_rate(audio, freq[0] | (freq[1] << 8) |
+				((uint32_t) freq[2] << 16));
+
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+bool usbd_audio_setup_ep0(usbd_audio *audio,
+				const struct usb_setup_data *setup_data)
+{
+	const uint8_t mask = USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT;
+	const uint8_t value = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_ENDPOINT;
+
+	if ((setup_data->bmRequestType & mask) != value ||
+			(setup_data->wIndex & 0xFF) != audio->config.ep_addr ||
+			(setup_data->wValue >> 8) != USB_AUDIO_EP_CONTROL_SAMPLING_FREQ) {
+		return false;
+	}
+
+	switch (setup_data->bRequest) {
+	case USB_AUDIO_REQ_SET_CUR:
+		usbd_ep0_transfer(audio->dev, setup_data, audio->freq, 3,
+			freq_callback);
+	return true;
+	case USB_AUDIO_REQ_GET_CUR:
+		audio->freq[0] = audio->rate;
+		audio->freq[1] = audio->rate >> 8;
+		audio->freq[2] = audio->rate >> 16;
+		usbd_ep0_transfer(audio->dev, setup_data, audio->freq, 3, NULL);
+	return true;
+	}
+
+	return false;
+}
+
+void usbd_audio_start(usbd_audio *audio)
+{
+	uint8_t *packet = audio->config.packet_buffer;
+	bool high_speed = usbd_get_speed(audio->dev) == USBD_SPEED_HIGH;
+	unsigned i;
+
+	/* Feedback is per microframe on high speed */
+	audio->sof_rate = high_speed ? 8000 : 1000;
+	audio->feedback_shift = high_speed ? 16 : 14;
+	rate_update(audio);
+
+	audio->urbs = 0;
+	audio->running = true;
+
+	for (i = 0; i < URBS_MAX; i++) {
+		data_submit(audio, packet + (i * audio->config.ep_size));
+	}
+
+	if (audio->config.ep_feedback && is_playback(audio)) {
+		feedback_submit(audio);
+	}
+}
+
+void usbd_audio_stop(usbd_audio *audio)
+{
+	if (!audio->running) {
+		return;
+	}
+
+	audio->running = false;
+	audio->urbs = 0;
+
+	usbd_transfer_cancel_ep(audio->dev, audio->config.ep_addr);
+
+	if (audio->config.ep_feedback) {
+		usbd_transfer_cancel_ep(audio->dev, audio->config.ep_feedback);
+	}
+}
+
+/**
+ * Correction that bring the ring back to target fill
+ * @param[in] audio Audio
+ * @return correction (feedback fixed point)
+ */
+static int32_t fill_correction(usbd_audio *audio)
+{
+	const size_t frame_bytes = audio->config.frame_bytes;
+	int32_t fill = (LOAD_ACQUIRE(&audio->ring.head) -
+			LOAD_ACQUIRE(&audio->ring.tail)) / frame_bytes;
+	int32_t error = (int32_t) (audio->config.target / frame_bytes) - fill;
+	int32_t limit = audio->feedback.nominal >> FEEDBACK_CORRECTION_SHIFT;
+	int32_t corr;
+
+	corr = ((int64_t) error * (1 << audio->feedback_shift)) /
+			(1 << FEEDBACK_FILL_SHIFT);
+
+	return MAX(-limit, MIN(corr, limit));
+}
+
+void usbd_audio_sof(usbd_audio *audio)
+{
+	uint32_t nominal = audio->feedback.nominal;
+	uint32_t clock, delta, measured;
+	uint16_t frame, elapsed;
+
+	if (!audio->running || !is_playback(audio)) {
+		return;
+	}
+
+	frame = usbd_frame_number(audio->dev) & FRAME_MASK;
+	clock = (audio->config.clock != NULL) ?
+		audio->config.clock(audio) : LOAD_ACQUIRE(&audio->dma.samples);
+
+	if (!audio->feedback.started) {
+		audio->feedback.started = true;
+		audio->feedback.frame = frame;
+		audio->feedback.clock = clock;
+		return;
+	}
+
+	elapsed = (frame - audio->feedback.frame) & FRAME_MASK;
+	if (elapsed < audio->config.feedback_period) {
+		return;
+	}
+
+	delta = clock - audio->feedback.clock;
+	audio->feedback.frame = frame;
+	audio->feedback.clock = clock;
+
+	/* Audio clock not running (DMA not started) or out of range:
+	 *  keep the previous measurement */
+	measured = ((uint64_t) delta << audio->feedback_shift) / elapsed;
+	if (measured > nominal + (nominal >> FEEDBACK_RANGE_SHIFT) ||
+			measured < nominal - (nominal >> FEEDBACK_RANGE_SHIFT)) {
+		measured = audio->feedback.measured;
+	}
+
+	audio->feedback.measured += ((int32_t) (measured -
+			audio->feedback.measured)) / (1 << FEEDBACK_SMOOTH_SHIFT);
+
+	audio->feedback.value = audio->feedback.measured + fill_correction(audio);
+	audio->stats.feedback_updates++;
+}
+
+size_t usbd_audio_dma_fill(usbd_audio *audio, void *buf, size_t len)
+{
+	uint32_t tail = audio->ring.tail;
+	size_t avail = LOAD_ACQUIRE(&audio->ring.head) - tail;
+	size_t n;
+
+	audio->dma.samples += len / audio->config.frame_bytes;
+
+	/* After underrun (or at start), wait for the ring to reach the target
+	 *  fill so a late packet do not cause an other underrun */
+	if (!audio->dma.primed) {
+		if (avail < audio->config.target) {
+			memset(buf, 0, len);
+			audio->stats.silence++;
+			return 0;
+		}
+		audio->dma.primed = true;
+	}
+
+	n = MIN(avail, len);
+	n -= n % audio->config.frame_bytes;
+
+	ring_read(audio, buf, tail, n);
+	STORE_RELEASE(&audio->ring.tail, tail + n);
+
+	if (n < len) {
+		memset((uint8_t *) buf + n, 0, len - n);
+		audio->stats.silence++;
+		audio->dma.primed = false;
+	}
+
+	return n;
+}
+
+size_t usbd_audio_dma_drain(usbd_audio *audio, const void *buf, size_t len)
+{
+	uint32_t head = audio->ring.head;
+	size_t space = audio->config.size - (head - LOAD_ACQUIRE(&audio->ring.tail));
+	size_t n;
+
+	audio->dma.samples += len / audio->config.frame_bytes;
+
+	n = MIN(space, len);
+	n -= n % audio->config.frame_bytes;
+
+	ring_write(audio, head, buf, n);
+	STORE_RELEASE(&audio->ring.head, head + n);
+
+	if (n < len) {
+		audio->stats.dropped += len - n;
+	}
+
+	return n;
+}
+
+uint32_t usbd_audio_get_feedback(usbd_audio *audio)
+{
+	return audio->feedback.value;
+}
+
+void usbd_audio_get_stats(usbd_audio *audio, usbd_audio_stats *stats)
+{
+	*stats = audio->stats;
+}
@@ -0,0 +1,476 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/cdc_acm.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * Single producer / single consumer rings:
+ *
+ * TX: application write [head], usbd_poll() context submit [sent]
+ *     and complete [tail]. tail <= sent <= head.
+ * RX: usbd_poll() context submit [armed] and complete [head],
+ *     application consume [tail]. tail <= head <= armed.
+ *
+ * An index is only written by its owner, the other side load it with
+ *  acquire (and the owner store it with release) so the data copied
+ *  before the index move is visible to the other side.
+ *
+ * IN URB start on a word boundary (DMA capable backend need it).
+ *  After a partial packet, the bytes upto the next word boundary are
+ *  sent from tx::bounce.
+ */
+
+/* URB queued per direction */
+#define URBS_MAX 2
+
+static void tx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+static void rx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static inline uint8_t *rx_slot(usbd_cdc_acm *acm, uint32_t index)
+{
+	index &= acm->config.rx_slots - 1;
+	return (uint8_t *) acm->config.rx_buffer + (index * acm->config.rx_chunk);
+}
+
+/**
+ * Submit a bulk transfer
+ * @param[in] acm CDC-ACM
+ * @param[in] ep_addr Endpoint address
+ * @param[in] buf Buffer
+ * @param[in] len Length
+ * @param[in] flags Transfer flags
+ * @param[in] callback Callback
+ */
+static void submit(usbd_cdc_acm *acm, uint8_t ep_addr, void *buf,
+			size_t len, usbd_transfer_flags flags,
+			usbd_transfer_callback callback)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = acm->config.ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback,
+		.user_data = acm
+	};
+
+	usbd_transfer_submit(acm->dev, &transfer);
+}
+
+/**
+ * Stop after a non recoverable transfer failure.
+ * Data not yet sent is dropped, data received is kept for the application.
+ * @param[in] acm CDC-ACM
+ */
+static void stop(usbd_cdc_acm *acm)
+{
+	STORE_RELEASE(&acm->running, false);
+
+	acm->tx.sent = LOAD_ACQUIRE(&acm->tx.head);
+	STORE_RELEASE(&acm->tx.tail, acm->tx.sent);
+	acm->tx.urbs = 0;
+	acm->tx.wait_us = 0;
+
+	acm->rx.armed = acm->rx.head;
+}
+
+/**
+ * Submit as many IN URB as allowed
+ * Whole packets are sent right away, the last packet only when due
+ *  (flush timer expired or flush requested).
+ * @param[in] acm CDC-ACM
+ */
+static void tx_kick(usbd_cdc_acm *acm)
+{
+	const size_t ep_size = acm->config.ep_size;
+	const size_t mask = acm->config.tx_size - 1;
+	uint8_t *ring = acm->config.tx_buffer;
+
+	while (acm->running && acm->tx.urbs < URBS_MAX) {
+		uint32_t sent = acm->tx.sent;
+		size_t avail = LOAD_ACQUIRE(&acm->tx.head) - sent;
+		bool due = LOAD_ACQUIRE(&acm->tx.flush) ||
+				acm->tx.wait_us >= acm->config.flush_us;
+		usbd_transfer_flags flags = USBD_FLAG_NONE;
+		uint8_t *buf;
+		size_t len, i;
+
+		if (!avail) {
+			break;
+		}
+
+		if (sent & 3) {
+			/* Realign on word boundary */
+			len = 4 - (sent & 3);
+			if (avail < len && !due) {
+				break;
+			}
+
+			len = MIN(len, avail);
+			buf = (uint8_t *) &acm->tx.bounce;
+			for (i = 0; i < len; i++) {
+				buf[i] = ring[(sent + i) & mask];
+			}
+		} else {
+			len = MIN(avail, acm->config.tx_size - (sent & mask));
+			len = MIN(len, acm->config.tx_chunk);
+			buf = ring + (sent & mask);
+
+			if (len == avail && !due) {
+				/* Last packet (even whole) is kept: coalesced with the
+				 *  next data, or sent with the end of transfer when due */
+				len = ((len - 1) / ep_size) * ep_size;
+				if (!len) {
+					break;
+				}
+			} else if (len >= ep_size && len != avail) {
+				/* Whole packets, remainder is at the ring end */
+				len -= len % ep_size;
+			}
+		}
+
+		if (len == avail) {
+			/* End of data (due): short packet (or ZLP) end the host read */
+			flags = USBD_FLAG_SHORT_PACKET;
+			acm->stats.tx_flushes++;
+			STORE_RELEASE(&acm->tx.flush, false);
+		}
+
+		acm->tx.sent = sent + len;
+		acm->tx.urbs++;
+		acm->tx.wait_us = 0;
+		submit(acm, acm->config.ep_in, buf, len, flags, tx_callback);
+	}
+}
+
+/**
+ * Arm the free RX slots (upto URBS_MAX in flight)
+ * @param[in] acm CDC-ACM
+ */
+static void rx_kick(usbd_cdc_acm *acm)
+{
+	while (acm->running && acm->rx.armed - acm->rx.head < URBS_MAX) {
+		uint32_t armed = acm->rx.armed;
+
+		if (armed - LOAD_ACQUIRE(&acm->rx.tail) >= acm->config.rx_slots) {
+			/* All slots hold data */
+			if (armed == acm->rx.head) {
+				acm->stats.rx_overrun++;
+			}
+			break;
+		}
+
+		/* Short packet end the slot: data reach application without
+		 *  waiting for the slot to fill. */
+		acm->rx.armed = armed + 1;
+		submit(acm, acm->config.ep_out, rx_slot(acm, armed),
+			acm->config.rx_chunk, USBD_FLAG_SHORT_PACKET, rx_callback);
+	}
+}
+
+/**
+ * Account transfer completion
+ * @param[in] acm CDC-ACM
+ * @param[in] status Status
+ * @return false if the transfer should be ignored (stopped)
+ */
+static bool complete(usbd_cdc_acm *acm, usbd_transfer_status status)
+{
+	if (!acm->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("cdc-acm", status)) {
+	case USBD_CLASS_SUCCESS:
+		acm->stats.urbs++;
+	return true;
+	case USBD_CLASS_STOP:
+		stop(acm);
+	return false;
+	default:
+		acm->stats.errors++;
+	return true;
+	}
+}
+
+static void tx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_cdc_acm *acm = transfer->user_data;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(acm, status)) {
+		return;
+	}
+
+	/* URB complete in order: sent (or dropped on error) */
+	if (status == USBD_SUCCESS) {
+		acm->stats.tx_bytes += transfer->length;
+	}
+
+	acm->tx.urbs--;
+	STORE_RELEASE(&acm->tx.tail, acm->tx.tail + transfer->length);
+
+	tx_kick(acm);
+
+	if (acm->config.callback != NULL) {
+		acm->config.callback(acm);
+	}
+}
+
+static void rx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_cdc_acm *acm = transfer->user_data;
+	uint32_t head = acm->rx.head;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(acm, status)) {
+		return;
+	}
+
+	/* Partial data (in case of error) is kept, so data stay in order */
+	acm->stats.rx_bytes += transfer->transferred;
+	acm->rx.len[head & (acm->config.rx_slots - 1)] = transfer->transferred;
+	STORE_RELEASE(&acm->rx.head, head + 1);
+
+	rx_kick(acm);
+
+	if (acm->config.callback != NULL) {
+		acm->config.callback(acm);
+	}
+}
+
+/**
+ * Round down to a power of 2
+ * @param[in] value Value
+ * @return power of 2 (0 if @a value is 0)
+ */
+static size_t floor_pow2(size_t value)
+{
+	while (value & (value - 1)) {
+		value &= value - 1;
+	}
+
+	return value;
+}
+
+void usbd_cdc_acm_init(usbd_cdc_acm *acm, usbd_device *dev,
+				const usbd_cdc_acm_config *config)
+{
+	memset(acm, 0, sizeof(*acm));
+	acm->dev = dev;
+	acm->config = *config;
+
+	/* Rings are indexed with a mask */
+	if (acm->config.tx_size != floor_pow2(acm->config.tx_size)) {
+		acm->config.tx_size = floor_pow2(acm->config.tx_size);
+		LOGF_LN("cdc-acm: TX ring of %u bytes limited to %u (power of 2)",
+			(unsigned) config->tx_size, (unsigned) acm->config.tx_size);
+	}
+
+	if (!acm->config.tx_chunk) {
+		acm->config.tx_chunk = MAX(acm->config.tx_size / 2, config->ep_size);
+	}
+
+	if (acm->config.rx_slots > USBD_CDC_ACM_RX_SLOTS_MAX) {
+		LOGF_LN("cdc-acm: %"PRIu8" RX slots limited to %u",
+			config->rx_slots, USBD_CDC_ACM_RX_SLOTS_MAX);
+		acm->config.rx_slots = USBD_CDC_ACM_RX_SLOTS_MAX;
+	} else if (acm->config.rx_slots != floor_pow2(acm->config.rx_slots)) {
+		acm->config.rx_slots = floor_pow2(acm->config.rx_slots);
+		LOGF_LN("cdc-acm: %"PRIu8" RX slots limited to %"PRIu8
+			" (power of 2)", config->rx_slots, acm->config.rx_slots);
+	}
+
+	if (!acm->config.tx_size || !acm->config.rx_slots) {
+		LOG_LN("cdc-acm: no TX ring or RX slot, nothing will be transferred");
+	}
+
+	acm->line_coding.dwDTERate = 115200;
+	acm->line_coding.bCharFormat = USB_CDC_1_STOP_BITS;
+	acm->line_coding.bParityType = USB_CDC_NO_PARITY;
+	acm->line_coding.bDataBits = 8;
+}
+
+static usbd_control_transfer_feedback line_coding_callback(usbd_device *dev,
+				const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_cdc_acm *acm;
+
+	(void) dev;
+
+	/* Data stage was received in usbd_cdc_acm::line_coding */
+	acm = (usbd_cdc_acm *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_cdc_acm, line_coding));
+
+	if (acm->config.line_callback != NULL) {
+		acm->config.line_callback(acm);
+	}
+
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+bool usbd_cdc_acm_setup_ep0(usbd_cdc_acm *acm,
+				const struct usb_setup_data *setup_data)
+{
+	usbd_device *dev = acm->dev;
+
+	const uint8_t mask = USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT;
+	const uint8_t value = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
+
+	if ((setup_data->bmRequestType & mask) != value ||
+			setup_data->wIndex != acm->config.interface) {
+		return false;
+	}
+
+	switch (setup_data->bRequest) {
+	case USB_CDC_REQ_SET_LINE_CODING:
+		usbd_ep0_transfer(dev, setup_data, &acm->line_coding,
+			sizeof(acm->line_coding), line_coding_callback);
+	return true;
+	case USB_CDC_REQ_GET_LINE_CODING:
+		usbd_ep0_transfer(dev, setup_data, &acm->line_coding,
+			sizeof(acm->line_coding), NULL);
+	return true;
+	case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+		acm->line_state = setup_data->wValue;
+		if (acm->config.line_callback != NULL) {
+			acm->config.line_callback(acm);
+		}
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	case USB_CDC_REQ_SEND_BREAK:
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	}
+
+	return false;
+}
+
+void usbd_cdc_acm_start(usbd_cdc_acm *acm)
+{
+	acm->tx.sent = LOAD_ACQUIRE(&acm->tx.tail);
+	acm->tx.urbs = 0;
+	acm->tx.wait_us = 0;
+	acm->rx.armed = acm->rx.head;
+
+	STORE_RELEASE(&acm->running, true);
+
+	rx_kick(acm);
+	tx_kick(acm);
+}
+
+void usbd_cdc_acm_poll(usbd_cdc_acm *acm, uint32_t us)
+{
+	if (!acm->running) {
+		return;
+	}
+
+	rx_kick(acm);
+
+	/* Flush timer run while data wait to be submitted,
+	 *  restarted on every submission */
+	if (LOAD_ACQUIRE(&acm->tx.head) != acm->tx.sent) {
+		acm->tx.wait_us += us;
+	} else {
+		acm->tx.wait_us = 0;
+	}
+
+	tx_kick(acm);
+}
+
+size_t usbd_cdc_acm_write(usbd_cdc_acm *acm, const void *data, size_t len)
+{
+	const size_t size = acm->config.tx_size;
+	uint8_t *ring = acm->config.tx_buffer;
+	uint32_t head = acm->tx.head;
+	size_t off, n;
+
+	if (!LOAD_ACQUIRE(&acm->running)) {
+		return 0;
+	}
+
+	n = MIN(len, size - (head - LOAD_ACQUIRE(&acm->tx.tail)));
+	off = head & (size - 1);
+
+	if (off + n > size) {
+		memcpy(ring + off, data, size - off);
+		memcpy(ring, (const uint8_t *) data + (size - off), n - (size - off));
+	} else {
+		memcpy(ring + off, data, n);
+	}
+
+	STORE_RELEASE(&acm->tx.head, head + n);
+
+	if (n < len) {
+		acm->stats.tx_dropped += len - n;
+	}
+
+	return n;
+}
+
+void usbd_cdc_acm_flush(usbd_cdc_acm *acm)
+{
+	STORE_RELEASE(&acm->tx.flush, true);
+}
+
+size_t usbd_cdc_acm_read(usbd_cdc_acm *acm, void *data, size_t len)
+{
+	uint8_t *dest = data;
+	uint32_t head = LOAD_ACQUIRE(&acm->rx.head);
+	uint32_t tail = acm->rx.tail;
+	size_t done = 0;
+
+	while (done < len && tail != head) {
+		size_t slot_len = acm->rx.len[tail & (acm->config.rx_slots - 1)];
+		size_t n = MIN(slot_len - acm->rx.pos, len - done);
+
+		memcpy(dest + done, rx_slot(acm, tail) + acm->rx.pos, n);
+		acm->rx.pos += n;
+		done += n;
+
+		if (acm->rx.pos == slot_len) {
+			/* Slot consumed, re-armed from usbd_poll() context */
+			acm->rx.pos = 0;
+			STORE_RELEASE(&acm->rx.tail, ++tail);
+		}
+	}
+
+	return done;
+}
+
+void usbd_cdc_acm_get_stats(usbd_cdc_acm *acm, usbd_cdc_acm_stats *stats)
+{
+	*stats = acm->stats;
+}
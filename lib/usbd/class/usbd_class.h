@@ -0,0 +1,87 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNICOREMX_USBD_CLASS_H
+#define UNICOREMX_USBD_CLASS_H
+
+#include <stdbool.h>
+#include <unicore-mx/usbd/usbd.h>
+#include "../usbd_private.h"
+
+/*
+ * Helpers shared by the class drivers (private).
+ *
+ * A class submit its transfers from usbd_poll() context (transfer
+ *  callback) and from the application API. The callback of a transfer can
+ *  be performed on submit (completed at once, or failed), so the state used
+ *  by the callback (URB in flight, ring index) is updated before
+ *  usbd_transfer_submit(), and a submit loop re-check its condition after
+ *  every submit. State shared with the application that is not lock-free
+ *  is only touched in USBD_ATOMIC_CONTEXT() (see usbd_private.h).
+ *
+ * A class stop on the first transfer that fail with a status from
+ *  USBD_CLASS_STOP (see usbd_class_status()). The URB still in flight
+ *  complete with error and are ignored, the application start the class
+ *  again (usually from set-config callback).
+ */
+
+/* Index shared with the application by lock-free rings: the owner store it
+ *  with release (after the data), the other side load it with acquire */
+#define LOAD_ACQUIRE(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+
+/** What a class should do with a completed transfer */
+enum usbd_class_status {
+	/** Transfer succeeded */
+	USBD_CLASS_SUCCESS,
+
+	/** Transfer failed (data lost), the class continue */
+	USBD_CLASS_RETRY,
+
+	/** Not recoverable (cancel, configuration change, bus reset,
+	 *  disconnection, no URB, invalid transfer): the class stop */
+	USBD_CLASS_STOP
+};
+
+/**
+ * Sort the status of a completed transfer
+ * @param[in] name Class name (for log)
+ * @param[in] status Transfer status
+ * @return what the class should do
+ */
+static inline enum usbd_class_status usbd_class_status(const char *name,
+						usbd_transfer_status status)
+{
+	(void) name;
+
+	switch (status) {
+	case USBD_SUCCESS:
+	return USBD_CLASS_SUCCESS;
+	case USBD_ERR_CANCEL:
+	case USBD_ERR_CONFIG_CHANGE:
+	case USBD_ERR_CONN:
+	case USBD_ERR_RES_UNAVAIL:
+	case USBD_ERR_INVALID:
+		LOGF_LN("%s: stopped (status=%i)", name, status);
+	return USBD_CLASS_STOP;
+	default:
+		LOGF_LN("%s: URB failed (status=%i)", name, status);
+	return USBD_CLASS_RETRY;
+	}
+}
+
+#endif
@@ -0,0 +1,826 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/dfu.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * Requests run in usbd_poll() context, the worker (usbd_dfu_poll()) in
+ *  main loop: the worker only touch the block queue with interrupts
+ *  masked, and never while the flash operation is running.
+ * The block at head is owned by the worker while dfu->working is set.
+ */
+
+#define KIB 1024
+
+/* Frame number is 11 bits (operations longer than 2 s are not tracked) */
+#define FRAME_NUMBER_MASK 0x7FF
+
+/* Maximum bwPollTimeout (24 bits, milliseconds) */
+#define POLL_TIMEOUT_MAX 0xFFFFFF
+
+enum job_kind {
+	JOB_PROGRAM,
+	JOB_ERASE
+};
+
+enum worker_op {
+	OP_NONE,
+	OP_ERASE,
+	OP_PROGRAM
+};
+
+static const uint8_t dfuse_commands[] = {
+	DFUSE_CMD_GET_COMMANDS,
+	DFUSE_CMD_SET_ADDRESS,
+	DFUSE_CMD_ERASE
+};
+
+static inline uint32_t us_for(uint32_t bytes, uint32_t us_per_kb)
+{
+	return ((uint64_t) bytes * us_per_kb + KIB - 1) / KIB;
+}
+
+static inline bool downloading(usbd_dfu *dfu)
+{
+	return dfu->state == STATE_DFU_DNLOAD_SYNC ||
+		dfu->state == STATE_DFU_DNBUSY ||
+		dfu->state == STATE_DFU_DNLOAD_IDLE ||
+		dfu->state == STATE_DFU_MANIFEST_SYNC;
+}
+
+static inline bool in_region(usbd_dfu *dfu, uint32_t address, uint32_t len)
+{
+	return address >= dfu->config.base &&
+		address - dfu->config.base <= dfu->config.size &&
+		len <= dfu->config.size - (address - dfu->config.base);
+}
+
+/**
+ * Estimate the erase time of a sector
+ * Measured time of a sector of the same size. Otherwise, the time of the
+ *  largest smaller sector measured (erase time is not linear with size,
+ *  better poll again than leave the flash idle), else throughput.
+ * @param[in] dfu DFU
+ * @param[in] size Sector size
+ * @return microseconds
+ */
+static uint32_t erase_estimate(usbd_dfu *dfu, uint32_t size)
+{
+	uint32_t smaller = 0, us = 0;
+	unsigned i;
+
+	for (i = 0; i < USBD_DFU_SECTOR_SIZES; i++) {
+		if (dfu->erase_time[i].size == size) {
+			return dfu->erase_time[i].us;
+		}
+
+		if (dfu->erase_time[i].size < size &&
+				dfu->erase_time[i].size > smaller) {
+			smaller = dfu->erase_time[i].size;
+			us = dfu->erase_time[i].us;
+		}
+	}
+
+	return smaller ? us : us_for(size, dfu->stats.erase_us_per_kb);
+}
+
+/**
+ * Estimate the remaining time of the running flash operation
+ * @param[in] dfu DFU
+ * @return microseconds
+ */
+static uint32_t running_us(usbd_dfu *dfu)
+{
+	uint16_t frames = usbd_frame_number(dfu->dev) - dfu->op.frame;
+	uint32_t elapsed = (frames & FRAME_NUMBER_MASK) * 1000;
+	uint32_t floor = dfu->op.estimate / 16;
+
+	/* Longer than estimated: poll again soon */
+	return (elapsed + floor < dfu->op.estimate) ?
+			dfu->op.estimate - elapsed : floor;
+}
+
+/**
+ * Estimate the time needed by the worker for the oldest blocks
+ * @param[in] dfu DFU
+ * @param[in] blocks Number of blocks (from head)
+ * @return microseconds
+ */
+static uint32_t estimate_us(usbd_dfu *dfu, unsigned blocks)
+{
+	uint32_t erased_start = dfu->erased_start, erased_end = dfu->erased_end;
+	uint32_t start, size, addr, end, next;
+	uint32_t total = 0, head_done = 0;
+	bool head_erasing = false;
+	unsigned i;
+
+	/* Operation in progress, state as if it was done */
+	if (dfu->op.running) {
+		total += running_us(dfu);
+
+		if (dfu->op.kind == OP_PROGRAM) {
+			head_done = dfu->op.bytes;
+		} else if (erased_end != erased_start &&
+				dfu->op.address == erased_end) {
+			erased_end += dfu->op.bytes;
+			head_erasing = dfu->working;
+		} else {
+			erased_start = dfu->op.address;
+			erased_end = dfu->op.address + dfu->op.bytes;
+			head_erasing = dfu->working;
+		}
+	}
+
+	for (i = 0; i < blocks && i < dfu->count; i++) {
+		const struct usbd_dfu_block *block = &dfu->block[(dfu->head + i) % 2];
+
+		if (block->kind == JOB_ERASE) {
+			if (!(i == 0 && head_erasing) &&
+					dfu->config.sector(dfu, block->address, &start, &size)) {
+				total += erase_estimate(dfu, size);
+			}
+			continue;
+		}
+
+		addr = block->address + block->done + (i ? 0 : head_done);
+		end = block->address + block->len;
+		total += us_for(end - addr, dfu->stats.program_us_per_kb);
+
+		/* Sectors the worker will erase first */
+		next = (addr >= erased_start && addr < erased_end) ? erased_end : addr;
+		while (next < end && dfu->config.sector(dfu, next, &start, &size)) {
+			total += erase_estimate(dfu, size);
+			next = start + size;
+		}
+
+		erased_end = MAX(erased_end, next);
+	}
+
+	return total;
+}
+
+/**
+ * Update the erase time of a sector size
+ * @param[in] dfu DFU
+ * @param[in] size Sector size
+ * @param[in] us Measured time
+ */
+static void measure_erase(usbd_dfu *dfu, uint32_t size, uint32_t us)
+{
+	unsigned i;
+
+	for (i = 0; i < USBD_DFU_SECTOR_SIZES - 1; i++) {
+		if (dfu->erase_time[i].size == size || !dfu->erase_time[i].size) {
+			break;
+		}
+	}
+
+	/* Table full: last entry is reused */
+	if (dfu->erase_time[i].size != size) {
+		dfu->erase_time[i].size = size;
+		dfu->erase_time[i].us = us;
+	} else {
+		dfu->erase_time[i].us = (dfu->erase_time[i].us * 3 + us) / 4;
+	}
+}
+
+/**
+ * Update the throughput estimate with the last operation of the worker
+ * @param[in] dfu DFU
+ * @param[in] us Duration of the operation
+ */
+static void measure(usbd_dfu *dfu, uint32_t us)
+{
+	uint32_t *estimate, sample;
+
+	switch (dfu->op.kind) {
+	case OP_ERASE:
+		estimate = &dfu->stats.erase_us_per_kb;
+		measure_erase(dfu, dfu->op.bytes, us);
+	break;
+	case OP_PROGRAM:
+		estimate = &dfu->stats.program_us_per_kb;
+	break;
+	default:
+	return;
+	}
+
+	dfu->op.kind = OP_NONE;
+	sample = ((uint64_t) us * KIB) / dfu->op.bytes;
+	*estimate = *estimate ? (*estimate * 3 + sample) / 4 : sample;
+}
+
+/**
+ * Start a flash operation (GETSTATUS estimate it while it run)
+ * @param[in] dfu DFU
+ * @param[in] kind OP_*
+ * @param[in] address Sector start or program address
+ * @param[in] bytes Sector size or program length
+ * @param[in] estimate Expected duration
+ */
+static void op_begin(usbd_dfu *dfu, uint8_t kind, uint32_t address,
+			uint32_t bytes, uint32_t estimate)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	dfu->op.kind = kind;
+	dfu->op.address = address;
+	dfu->op.bytes = bytes;
+	dfu->op.estimate = estimate;
+	dfu->op.frame = usbd_frame_number(dfu->dev);
+	dfu->op.running = true;
+}
+
+/**
+ * Record an erased sector
+ * Contiguous with the previous erased sectors: extend the range.
+ * @param[in] dfu DFU
+ * @param[in] start Sector start
+ * @param[in] size Sector size
+ */
+static void mark_erased(usbd_dfu *dfu, uint32_t start, uint32_t size)
+{
+	if (dfu->erased_end != dfu->erased_start && start == dfu->erased_end) {
+		dfu->erased_end += size;
+		return;
+	}
+
+	dfu->erased_start = start;
+	dfu->erased_end = start + size;
+	dfu->clean = start;
+}
+
+/**
+ * Erase the sector containing an address
+ * @param[in] dfu DFU
+ * @param[in] address Address
+ * @param[in] skip_clean Skip if the sector is already erased and not
+ *  programmed since
+ * @return DFU_STATUS_*
+ */
+static uint8_t erase_sector(usbd_dfu *dfu, uint32_t address, bool skip_clean)
+{
+	uint32_t start, size;
+	bool ok;
+
+	if (!dfu->config.sector(dfu, address, &start, &size)) {
+		return DFU_STATUS_ERR_ADDRESS;
+	}
+
+	if (skip_clean && start >= dfu->clean && start >= dfu->erased_start &&
+			start + size <= dfu->erased_end) {
+		dfu->stats.erase_skipped++;
+		return DFU_STATUS_OK;
+	}
+
+	op_begin(dfu, OP_ERASE, start, size, erase_estimate(dfu, size));
+	ok = dfu->config.erase(dfu, start);
+
+	USBD_ATOMIC_CONTEXT();
+
+	dfu->op.running = false;
+
+	if (!ok) {
+		LOGF_LN("dfu: erase of sector 0x%08"PRIx32" failed", start);
+		dfu->op.kind = OP_NONE;
+		return DFU_STATUS_ERR_ERASE;
+	}
+
+	dfu->stats.erased++;
+	mark_erased(dfu, start, size);
+	return DFU_STATUS_OK;
+}
+
+/**
+ * Program a chunk of the head block
+ * @param[in] dfu DFU
+ * @param[in] address Address
+ * @param[in] data Data
+ * @param[in] len Length
+ * @return DFU_STATUS_*
+ */
+static uint8_t program_chunk(usbd_dfu *dfu, uint32_t address,
+				const uint8_t *data, uint32_t len)
+{
+	bool ok;
+
+	op_begin(dfu, OP_PROGRAM, address, len,
+		us_for(len, dfu->stats.program_us_per_kb));
+	ok = dfu->config.program(dfu, address, data, len);
+
+	USBD_ATOMIC_CONTEXT();
+
+	dfu->op.running = false;
+
+	if (!ok) {
+		LOGF_LN("dfu: program at 0x%08"PRIx32" failed", address);
+		dfu->op.kind = OP_NONE;
+		return DFU_STATUS_ERR_PROG;
+	}
+
+	dfu->stats.programmed += len;
+	dfu->clean = MAX(dfu->clean, address + len);
+	return DFU_STATUS_OK;
+}
+
+/**
+ * Erase the next sector after the last block, if the worker is idle
+ * Blocks received meanwhile wait for the erase.
+ * @param[in] dfu DFU
+ * @return true if a sector was erased
+ */
+static bool erase_ahead(usbd_dfu *dfu)
+{
+	uint32_t next = dfu->erased_end;
+
+	if (!dfu->config.erase_ahead || dfu->config.dfuse || !downloading(dfu) ||
+			dfu->state == STATE_DFU_MANIFEST_SYNC ||
+			dfu->erased_start == dfu->erased_end ||
+			dfu->write_end < dfu->erased_start || next < dfu->write_end ||
+			next - dfu->write_end >= dfu->config.erase_ahead ||
+			!in_region(dfu, next, 1)) {
+		return false;
+	}
+
+	return erase_sector(dfu, next, false) == DFU_STATUS_OK;
+}
+
+bool usbd_dfu_poll(usbd_dfu *dfu, uint32_t us)
+{
+	uint8_t kind, status;
+	uint32_t addr = 0, len = 0, progress = 0;
+	const uint8_t *data = NULL;
+
+	measure(dfu, us);
+
+	{
+		USBD_ATOMIC_CONTEXT();
+
+		if (!dfu->count || dfu->error) {
+			dfu->working = false;
+			kind = 0xFF;
+		} else {
+			kind = dfu->block[dfu->head].kind;
+			addr = dfu->block[dfu->head].address + dfu->block[dfu->head].done;
+			len = dfu->block[dfu->head].len - dfu->block[dfu->head].done;
+			data = (const uint8_t *) dfu->block[dfu->head].data +
+						dfu->block[dfu->head].done;
+			dfu->working = true;
+		}
+	}
+
+	if (kind == 0xFF) {
+		return erase_ahead(dfu);
+	}
+
+	if (kind == JOB_ERASE) {
+		status = erase_sector(dfu, addr, true);
+	} else if (addr < dfu->erased_start || addr >= dfu->erased_end) {
+		/* Sector under the block not erased yet */
+		status = erase_sector(dfu, addr, false);
+	} else {
+		len = MIN(len, USBD_DFU_PROGRAM_CHUNK);
+		len = MIN(len, dfu->erased_end - addr);
+
+		status = program_chunk(dfu, addr, data, len);
+		progress = (status == DFU_STATUS_OK) ? len : 0;
+	}
+
+	USBD_ATOMIC_CONTEXT();
+
+	dfu->working = false;
+
+	if (dfu->discard) {
+		/* Aborted while the operation was running */
+		dfu->discard = false;
+		dfu->head ^= 1;
+		dfu->count--;
+		return true;
+	}
+
+	if (status != DFU_STATUS_OK) {
+		dfu->error = status;
+		dfu->count = 0;
+		return true;
+	}
+
+	dfu->block[dfu->head].done += progress;
+	if (kind == JOB_ERASE ||
+			dfu->block[dfu->head].done >= dfu->block[dfu->head].len) {
+		dfu->head ^= 1;
+		dfu->count--;
+	}
+
+	return true;
+}
+
+static void request_error(usbd_dfu *dfu)
+{
+	dfu->state = STATE_DFU_ERROR;
+	dfu->status = DFU_STATUS_ERR_STALLEDPKT;
+	usbd_ep0_stall(dfu->dev);
+}
+
+static void set_error(usbd_dfu *dfu, uint8_t status)
+{
+	dfu->state = STATE_DFU_ERROR;
+	dfu->status = status;
+}
+
+/**
+ * DfuSe command (block 0) received
+ * @param[in] dfu DFU
+ * @param[in] index Block buffer
+ * @param[in] len Command length
+ */
+static void dfuse_command(usbd_dfu *dfu, unsigned index, size_t len)
+{
+	const uint8_t *cmd = (const uint8_t *) dfu->block[index].data;
+	uint32_t address;
+
+	if (len != 5 || (cmd[0] != DFUSE_CMD_SET_ADDRESS &&
+			cmd[0] != DFUSE_CMD_ERASE)) {
+		/* Mass erase, read unprotect: not supported */
+		set_error(dfu, DFU_STATUS_ERR_TARGET);
+		return;
+	}
+
+	address = cmd[1] | (cmd[2] << 8) | (cmd[3] << 16) |
+			((uint32_t) cmd[4] << 24);
+
+	if (!in_region(dfu, address, 1)) {
+		set_error(dfu, DFU_STATUS_ERR_ADDRESS);
+		return;
+	}
+
+	if (cmd[0] == DFUSE_CMD_SET_ADDRESS) {
+		dfu->pointer = address;
+	} else {
+		dfu->block[index].kind = JOB_ERASE;
+		dfu->block[index].address = address;
+		dfu->block[index].len = 0;
+		dfu->block[index].done = 0;
+		dfu->count++;
+	}
+
+	dfu->command = true;
+	dfu->state = STATE_DFU_DNLOAD_SYNC;
+}
+
+/**
+ * DNLOAD data stage received in block buffer @a index
+ * @param[in] dfu DFU
+ * @param[in] index Block buffer
+ * @param[in] len Length received
+ */
+static void dnload_received(usbd_dfu *dfu, unsigned index, size_t len)
+{
+	uint32_t address;
+
+	dfu->stats.blocks++;
+
+	if (dfu->config.dfuse && dfu->block_num == 0) {
+		dfuse_command(dfu, index, len);
+		return;
+	}
+
+	if (dfu->config.dfuse) {
+		if (dfu->block_num < 2) {
+			set_error(dfu, DFU_STATUS_ERR_TARGET);
+			return;
+		}
+
+		address = dfu->pointer +
+			(uint32_t) (dfu->block_num - 2) * dfu->config.transfer_size;
+	} else {
+		address = dfu->config.base + dfu->offset;
+	}
+
+	if (!in_region(dfu, address, len)) {
+		set_error(dfu, DFU_STATUS_ERR_ADDRESS);
+		return;
+	}
+
+	dfu->offset += len;
+	dfu->write_end = address + len;
+
+	dfu->block[index].kind = JOB_PROGRAM;
+	dfu->block[index].address = address;
+	dfu->block[index].len = len;
+	dfu->block[index].done = 0;
+	dfu->count++;
+
+	dfu->state = STATE_DFU_DNLOAD_SYNC;
+}
+
+static usbd_control_transfer_feedback dnload_callback0(usbd_device *dev,
+				const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_dfu *dfu;
+
+	(void) dev;
+
+	dfu = (usbd_dfu *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_dfu, block[0].data));
+	dnload_received(dfu, 0, arg->length);
+
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+static usbd_control_transfer_feedback dnload_callback1(usbd_device *dev,
+				const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_dfu *dfu;
+
+	(void) dev;
+
+	dfu = (usbd_dfu *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_dfu, block[1].data));
+	dnload_received(dfu, 1, arg->length);
+
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+static void dnload(usbd_dfu *dfu, const struct usb_setup_data *setup_data)
+{
+	unsigned index;
+
+	if (dfu->state != STATE_DFU_IDLE && dfu->state != STATE_DFU_DNLOAD_IDLE) {
+		request_error(dfu);
+		return;
+	}
+
+	if (!setup_data->wLength) {
+		/* End of image */
+		if (dfu->state == STATE_DFU_IDLE) {
+			request_error(dfu);
+			return;
+		}
+
+		dfu->state = STATE_DFU_MANIFEST_SYNC;
+		usbd_ep0_transfer(dfu->dev, setup_data, NULL, 0, NULL);
+		return;
+	}
+
+	/* Both buffers full: host did not wait for dfuDNLOAD-IDLE */
+	if (setup_data->wLength > dfu->config.transfer_size ||
+			dfu->count >= 2) {
+		request_error(dfu);
+		return;
+	}
+
+	if (dfu->state == STATE_DFU_IDLE) {
+		/* New image: previous erased sectors may be programmed */
+		dfu->offset = 0;
+		dfu->erased_start = dfu->erased_end = dfu->clean = 0;
+	}
+
+	index = (dfu->head + dfu->count) % 2;
+	dfu->block_num = setup_data->wValue;
+
+	usbd_ep0_transfer(dfu->dev, setup_data, dfu->block[index].data,
+		setup_data->wLength, index ? dnload_callback1 : dnload_callback0);
+}
+
+static void upload(usbd_dfu *dfu, const struct usb_setup_data *setup_data)
+{
+	uint32_t address;
+	uint8_t *buf;
+	size_t len;
+
+	if (dfu->config.read == NULL || dfu->count >= 2 ||
+			setup_data->wLength > dfu->config.transfer_size ||
+			(dfu->state != STATE_DFU_IDLE &&
+			dfu->state != STATE_DFU_UPLOAD_IDLE)) {
+		request_error(dfu);
+		return;
+	}
+
+	if (dfu->state == STATE_DFU_IDLE) {
+		dfu->offset = 0;
+	}
+
+	buf = (uint8_t *) dfu->block[(dfu->head + dfu->count) % 2].data;
+
+	if (dfu->config.dfuse && setup_data->wValue == 0) {
+		len = MIN(sizeof(dfuse_commands), setup_data->wLength);
+		memcpy(buf, dfuse_commands, len);
+		dfu->state = STATE_DFU_UPLOAD_IDLE;
+		usbd_ep0_transfer(dfu->dev, setup_data, buf, len, NULL);
+		return;
+	}
+
+	if (dfu->config.dfuse) {
+		if (setup_data->wValue < 2) {
+			request_error(dfu);
+			return;
+		}
+
+		address = dfu->pointer +
+			(uint32_t) (setup_data->wValue - 2) * dfu->config.transfer_size;
+	} else {
+		address = dfu->config.base + dfu->offset;
+	}
+
+	len = dfu->config.read(dfu, address, buf, setup_data->wLength);
+	dfu->offset += len;
+
+	/* Short frame: end of upload */
+	dfu->state = (len < setup_data->wLength) ?
+			STATE_DFU_IDLE : STATE_DFU_UPLOAD_IDLE;
+
+	usbd_ep0_transfer(dfu->dev, setup_data, buf, len, NULL);
+}
+
+static void get_status(usbd_dfu *dfu, const struct usb_setup_data *setup_data)
+{
+	uint32_t timeout_us = 0, timeout_ms;
+	uint8_t state;
+
+	if (dfu->error && downloading(dfu)) {
+		set_error(dfu, dfu->error);
+		dfu->error = 0;
+	}
+
+	switch (dfu->state) {
+	case STATE_DFU_DNLOAD_SYNC:
+	case STATE_DFU_DNBUSY:
+		if (dfu->count >= 2) {
+			/* Host wait for the oldest block */
+			dfu->state = STATE_DFU_DNBUSY;
+			dfu->stats.busy++;
+			timeout_us = estimate_us(dfu, 1);
+		} else if (dfu->command) {
+			/* DfuSe: command is executed in dfuDNBUSY */
+			dfu->command = false;
+			dfu->state = STATE_DFU_DNBUSY;
+			timeout_us = estimate_us(dfu, dfu->count);
+		} else {
+			dfu->state = STATE_DFU_DNLOAD_IDLE;
+		}
+
+		state = dfu->state;
+	break;
+	case STATE_DFU_MANIFEST_SYNC:
+		if (dfu->count) {
+			/* Programming the last blocks */
+			state = STATE_DFU_MANIFEST;
+			timeout_us = estimate_us(dfu, dfu->count);
+			break;
+		}
+
+		if (dfu->config.manifest != NULL && !dfu->config.manifest(dfu)) {
+			set_error(dfu, DFU_STATUS_ERR_FIRMWARE);
+		} else if (dfu->config.manifest_tolerant) {
+			dfu->state = STATE_DFU_IDLE;
+		} else {
+			dfu->state = STATE_DFU_MANIFEST_WAIT_RESET;
+		}
+
+		state = dfu->state;
+	break;
+	default:
+		state = dfu->state;
+	break;
+	}
+
+	timeout_ms = MIN((timeout_us + 999) / 1000, POLL_TIMEOUT_MAX);
+	dfu->stats.poll_timeout_ms += timeout_ms;
+
+	dfu->response[0] = dfu->status;
+	dfu->response[1] = timeout_ms;
+	dfu->response[2] = timeout_ms >> 8;
+	dfu->response[3] = timeout_ms >> 16;
+	dfu->response[4] = state;
+	dfu->response[5] = 0;
+
+	usbd_ep0_transfer(dfu->dev, setup_data, dfu->response,
+		MIN(DFU_GETSTATUS_SIZE, setup_data->wLength), NULL);
+}
+
+static void abort_request(usbd_dfu *dfu)
+{
+	switch (dfu->state) {
+	case STATE_DFU_IDLE:
+	case STATE_DFU_DNLOAD_SYNC:
+	case STATE_DFU_DNLOAD_IDLE:
+	case STATE_DFU_MANIFEST_SYNC:
+	case STATE_DFU_UPLOAD_IDLE:
+	break;
+	default:
+		request_error(dfu);
+	return;
+	}
+
+	/* Drop the queue, except the block the worker is programming */
+	dfu->discard = dfu->working && dfu->count;
+	dfu->count = dfu->discard ? 1 : 0;
+	dfu->error = 0;
+	dfu->command = false;
+	dfu->state = STATE_DFU_IDLE;
+}
+
+void usbd_dfu_init(usbd_dfu *dfu, usbd_device *dev,
+				const usbd_dfu_config *config)
+{
+	memset(dfu, 0, sizeof(*dfu));
+	dfu->dev = dev;
+	dfu->config = *config;
+	dfu->state = STATE_DFU_IDLE;
+	dfu->status = DFU_STATUS_OK;
+	dfu->stats.erase_us_per_kb = config->erase_us_per_kb;
+	dfu->stats.program_us_per_kb = config->program_us_per_kb;
+
+	if (!dfu->config.transfer_size ||
+			dfu->config.transfer_size > USBD_DFU_TRANSFER_SIZE) {
+		LOGF_LN("dfu: transfer size %"PRIu16" limited to %u",
+			config->transfer_size, USBD_DFU_TRANSFER_SIZE);
+		dfu->config.transfer_size = USBD_DFU_TRANSFER_SIZE;
+	}
+}
+
+bool usbd_dfu_setup_ep0(usbd_dfu *dfu,
+				const struct usb_setup_data *setup_data)
+{
+	usbd_device *dev = dfu->dev;
+
+	const uint8_t mask = USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT;
+	const uint8_t class = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
+
+	if ((setup_data->bmRequestType & mask) != class ||
+			setup_data->wIndex != dfu->config.interface) {
+		return false;
+	}
+
+	switch (setup_data->bRequest) {
+	case DFU_DNLOAD:
+		dnload(dfu, setup_data);
+	return true;
+	case DFU_UPLOAD:
+		upload(dfu, setup_data);
+	return true;
+	case DFU_GETSTATUS:
+		get_status(dfu, setup_data);
+	return true;
+	case DFU_CLRSTATUS:
+		if (dfu->state != STATE_DFU_ERROR) {
+			request_error(dfu);
+			return true;
+		}
+
+		dfu->state = STATE_DFU_IDLE;
+		dfu->status = DFU_STATUS_OK;
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	case DFU_GETSTATE:
+		dfu->response[0] = dfu->state;
+		usbd_ep0_transfer(dev, setup_data, dfu->response,
+			MIN(1, setup_data->wLength), NULL);
+	return true;
+	case DFU_ABORT:
+		abort_request(dfu);
+		if (dfu->state == STATE_DFU_IDLE) {
+			usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+		}
+	return true;
+	case DFU_DETACH:
+		if (dfu->config.detach != NULL) {
+			dfu->config.detach(dfu, setup_data->wValue);
+		}
+
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	}
+
+	return false;
+}
+
+uint8_t usbd_dfu_get_state(usbd_dfu *dfu)
+{
+	return dfu->state;
+}
+
+void usbd_dfu_get_stats(usbd_dfu *dfu, usbd_dfu_stats *stats)
+{
+	*stats = dfu->stats;
+}
@@ -0,0 +1,488 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/hid.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * Buffer layout (ep_size bytes per slot):
+ *   [0, report_count) last report of each ID
+ *   report_count      report in flight (copy, the slot can be replaced)
+ *   report_count + 1  OUT report
+ *
+ * Queue and slots are shared with usbd_hid_send() (main loop or
+ *  interrupt), so they are only touched with interrupts masked.
+ */
+
+/* SET_IDLE duration unit */
+#define IDLE_UNIT_US 4000
+
+static void in_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+static void out_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static inline uint8_t *slot_buffer(usbd_hid *hid, unsigned index)
+{
+	return (uint8_t *) hid->config.buffer + (index * hid->config.ep_size);
+}
+
+static inline bool use_ids(usbd_hid *hid)
+{
+	return hid->config.reports[0].id != 0;
+}
+
+/**
+ * Find the slot of a report
+ * @param[in] hid HID
+ * @param[in] id Report ID
+ * @return index, -1 if not found
+ */
+static int find_report(usbd_hid *hid, uint8_t id)
+{
+	unsigned i;
+
+	for (i = 0; i < hid->config.report_count; i++) {
+		if (hid->config.reports[i].id == id) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void submit(usbd_hid *hid, uint8_t ep_addr, void *buf, size_t len,
+			usbd_transfer_flags flags, usbd_transfer_callback callback)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_INTERRUPT,
+		.ep_addr = ep_addr,
+		.ep_size = hid->config.ep_size,
+		.ep_interval = hid->config.interval,
+		.buffer = buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback,
+		.user_data = hid
+	};
+
+	usbd_transfer_submit(hid->dev, &transfer);
+}
+
+static void queue_push(usbd_hid *hid, unsigned index)
+{
+	hid->queue.index[hid->queue.tail % USBD_HID_REPORTS_MAX] = index;
+	hid->queue.tail++;
+	hid->report[index].queued = true;
+}
+
+/**
+ * Send the next queued report if the endpoint is idle
+ * Interrupts should be masked.
+ * @param[in] hid HID
+ */
+static void in_kick(usbd_hid *hid)
+{
+	uint8_t *buf = slot_buffer(hid, hid->config.report_count);
+	unsigned index;
+
+	if (!hid->running || hid->busy || hid->queue.head == hid->queue.tail) {
+		return;
+	}
+
+	index = hid->queue.index[hid->queue.head % USBD_HID_REPORTS_MAX];
+	hid->queue.head++;
+	hid->report[index].queued = false;
+	hid->report[index].idle_us = 0;
+
+	/* Copy: a newer report can be queued while this one is sent */
+	memcpy(buf, slot_buffer(hid, index), hid->report[index].len);
+
+	hid->busy = true;
+	submit(hid, hid->config.ep_in, buf, hid->report[index].len,
+		USBD_FLAG_NONE, in_callback);
+}
+
+static void out_arm(usbd_hid *hid)
+{
+	if (hid->running && hid->config.ep_out) {
+		submit(hid, hid->config.ep_out,
+			slot_buffer(hid, hid->config.report_count + 1),
+			hid->config.ep_size, USBD_FLAG_SHORT_PACKET, out_callback);
+	}
+}
+
+/**
+ * Account transfer completion
+ * @param[in] hid HID
+ * @param[in] status Status
+ * @return false if the transfer should be ignored (stopped)
+ */
+static bool complete(usbd_hid *hid, usbd_transfer_status status)
+{
+	if (!hid->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("hid", status)) {
+	case USBD_CLASS_SUCCESS:
+	return true;
+	case USBD_CLASS_STOP:
+		hid->running = false;
+		hid->busy = false;
+	return false;
+	default:
+		hid->stats.errors++;
+	return true;
+	}
+}
+
+static void in_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_hid *hid = transfer->user_data;
+
+	(void) dev;
+	(void) urb_id;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!complete(hid, status)) {
+		return;
+	}
+
+	if (status == USBD_SUCCESS) {
+		hid->stats.sent++;
+	}
+
+	hid->busy = false;
+	in_kick(hid);
+}
+
+static void out_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_hid *hid = transfer->user_data;
+	const uint8_t *data = transfer->buffer;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(hid, status)) {
+		return;
+	}
+
+	if (status == USBD_SUCCESS && transfer->transferred &&
+			hid->config.set_report != NULL) {
+		hid->config.set_report(hid, USB_REQ_HID_REPORT_TYPE_OUTPUT,
+			use_ids(hid) ? data[0] : 0, data, transfer->transferred);
+	}
+
+	out_arm(hid);
+}
+
+void usbd_hid_init(usbd_hid *hid, usbd_device *dev,
+				const usbd_hid_config *config)
+{
+	memset(hid, 0, sizeof(*hid));
+	hid->dev = dev;
+	hid->config = *config;
+	hid->protocol = USB_REQ_HID_PROTOCOL_REPORT;
+
+	if (hid->config.report_count > USBD_HID_REPORTS_MAX) {
+		LOGF_LN("hid: %"PRIu8" reports limited to %u",
+			config->report_count, USBD_HID_REPORTS_MAX);
+		hid->config.report_count = USBD_HID_REPORTS_MAX;
+	}
+}
+
+static usbd_control_transfer_feedback set_report_callback(usbd_device *dev,
+				const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_hid *hid;
+
+	(void) dev;
+
+	/* Data stage was received in usbd_hid::control */
+	hid = (usbd_hid *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_hid, control));
+
+	if (hid->config.set_report != NULL) {
+		hid->config.set_report(hid, hid->control_value >> 8,
+			hid->control_value & 0xFF, arg->buffer, arg->length);
+	}
+
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+/**
+ * Answer GET_REPORT
+ * Input report: last report queued, if any. Otherwise application.
+ * @param[in] hid HID
+ * @param[in] setup_data Setup data
+ */
+static void get_report(usbd_hid *hid, const struct usb_setup_data *setup_data)
+{
+	uint8_t type = setup_data->wValue >> 8;
+	uint8_t id = setup_data->wValue & 0xFF;
+	int index = find_report(hid, id);
+	size_t len = 0;
+
+	if (type == USB_REQ_HID_REPORT_TYPE_INPUT && index >= 0) {
+		USBD_ATOMIC_CONTEXT();
+
+		len = MIN(hid->report[index].len, sizeof(hid->control));
+		memcpy(hid->control, slot_buffer(hid, index), len);
+	}
+
+	if (!len && hid->config.get_report != NULL) {
+		len = hid->config.get_report(hid, type, id, hid->control,
+				sizeof(hid->control));
+	}
+
+	if (!len) {
+		usbd_ep0_stall(hid->dev);
+		return;
+	}
+
+	usbd_ep0_transfer(hid->dev, setup_data, hid->control,
+		MIN(len, setup_data->wLength), NULL);
+}
+
+/**
+ * Apply SET_IDLE
+ * @param[in] hid HID
+ * @param[in] setup_data Setup data
+ * @return false if the report ID is unknown
+ */
+static bool set_idle(usbd_hid *hid, const struct usb_setup_data *setup_data)
+{
+	uint8_t duration = setup_data->wValue >> 8;
+	uint8_t id = setup_data->wValue & 0xFF;
+	int index = find_report(hid, id);
+	unsigned i;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (id == 0) {
+		hid->idle = duration;
+	}
+
+	for (i = 0; i < hid->config.report_count; i++) {
+		/* ID 0 apply to all reports */
+		if (id == 0 || (int) i == index) {
+			hid->report[i].idle_set = true;
+			hid->report[i].idle = duration;
+			hid->report[i].idle_us = 0;
+		}
+	}
+
+	return id == 0 || index >= 0;
+}
+
+/**
+ * Answer the standard GET_DESCRIPTOR for the HID descriptors
+ * @param[in] hid HID
+ * @param[in] setup_data Setup data
+ * @return true if handled
+ */
+static bool get_descriptor(usbd_hid *hid,
+				const struct usb_setup_data *setup_data)
+{
+	const void *desc;
+	size_t len;
+
+	switch (setup_data->wValue >> 8) {
+	case USB_DT_HID:
+		desc = hid->config.hid_descriptor;
+		len = (desc != NULL) ? hid->config.hid_descriptor->bLength : 0;
+	break;
+	case USB_DT_REPORT:
+		desc = hid->config.report_descriptor;
+		len = hid->config.report_descriptor_len;
+	break;
+	default:
+	return false;
+	}
+
+	if (desc == NULL) {
+		return false;
+	}
+
+	usbd_ep0_transfer(hid->dev, setup_data, (void *) desc,
+		MIN(len, setup_data->wLength), NULL);
+	return true;
+}
+
+bool usbd_hid_setup_ep0(usbd_hid *hid,
+				const struct usb_setup_data *setup_data)
+{
+	usbd_device *dev = hid->dev;
+	int index;
+
+	const uint8_t mask = USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT;
+	const uint8_t std = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_INTERFACE;
+	const uint8_t class = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
+
+	if (setup_data->wIndex != hid->config.interface) {
+		return false;
+	}
+
+	if ((setup_data->bmRequestType & mask) == std) {
+		return setup_data->bRequest == USB_REQ_GET_DESCRIPTOR &&
+			get_descriptor(hid, setup_data);
+	}
+
+	if ((setup_data->bmRequestType & mask) != class) {
+		return false;
+	}
+
+	switch (setup_data->bRequest) {
+	case USB_REQ_HID_GET_REPORT:
+		get_report(hid, setup_data);
+	return true;
+	case USB_REQ_HID_SET_REPORT:
+		if (setup_data->wLength > sizeof(hid->control)) {
+			usbd_ep0_stall(dev);
+			return true;
+		}
+
+		hid->control_value = setup_data->wValue;
+		usbd_ep0_transfer(dev, setup_data, hid->control,
+			setup_data->wLength, set_report_callback);
+	return true;
+	case USB_REQ_HID_GET_IDLE:
+		index = find_report(hid, setup_data->wValue & 0xFF);
+		if (index >= 0) {
+			hid->control[0] = hid->report[index].idle;
+		} else if ((setup_data->wValue & 0xFF) == 0) {
+			/* ID 0 (with report IDs in use): the rate for all reports */
+			hid->control[0] = hid->idle;
+		} else {
+			usbd_ep0_stall(dev);
+			return true;
+		}
+
+		usbd_ep0_transfer(dev, setup_data, hid->control,
+			MIN(1, setup_data->wLength), NULL);
+	return true;
+	case USB_REQ_HID_SET_IDLE:
+		if (!set_idle(hid, setup_data)) {
+			usbd_ep0_stall(dev);
+			return true;
+		}
+
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	case USB_REQ_HID_GET_PROTOCOL:
+		hid->control[0] = hid->protocol;
+		usbd_ep0_transfer(dev, setup_data, hid->control,
+			MIN(1, setup_data->wLength), NULL);
+	return true;
+	case USB_REQ_HID_SET_PROTOCOL:
+		hid->protocol = setup_data->wValue;
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	}
+
+	return false;
+}
+
+void usbd_hid_start(usbd_hid *hid)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	hid->busy = false;
+	hid->running = true;
+
+	out_arm(hid);
+	in_kick(hid);
+}
+
+bool usbd_hid_send(usbd_hid *hid, const void *report, size_t len)
+{
+	const uint8_t *data = report;
+	uint8_t *slot;
+	int index;
+
+	if (!len) {
+		return false;
+	}
+
+	index = find_report(hid, use_ids(hid) ? data[0] : 0);
+	if (index < 0 || len > hid->config.ep_size) {
+		return false;
+	}
+
+	slot = slot_buffer(hid, index);
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (hid->report[index].queued) {
+		/* Host has not read the previous one yet: replace it */
+		hid->stats.merged++;
+	} else if (hid->report[index].idle_set &&
+			len == hid->report[index].len && !memcmp(slot, data, len)) {
+		hid->stats.unchanged++;
+		return true;
+	} else {
+		queue_push(hid, index);
+	}
+
+	memcpy(slot, data, len);
+	hid->report[index].len = len;
+
+	in_kick(hid);
+	return true;
+}
+
+void usbd_hid_poll(usbd_hid *hid, uint32_t us)
+{
+	unsigned i;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!hid->running) {
+		return;
+	}
+
+	for (i = 0; i < hid->config.report_count; i++) {
+		if (!hid->report[i].idle_set || !hid->report[i].idle ||
+				!hid->report[i].len || hid->report[i].queued) {
+			continue;
+		}
+
+		hid->report[i].idle_us += us;
+		if (hid->report[i].idle_us >= hid->report[i].idle * IDLE_UNIT_US) {
+			hid->stats.repeated++;
+			queue_push(hid, i);
+		}
+	}
+
+	in_kick(hid);
+}
+
+void usbd_hid_get_stats(usbd_hid *hid, usbd_hid_stats *stats)
+{
+	*stats = hid->stats;
+}
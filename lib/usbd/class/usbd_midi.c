@@ -0,0 +1,537 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/midi.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * TX: application write events [head], usbd_poll() context submit [sent]
+ *     and complete [tail]. tail <= sent <= head (bytes, multiple of 4).
+ *     Event packets never span a bulk packet: whole packets are sent as
+ *     they fill, the host read every packet without needing a short
+ *     packet (or ZLP) to end its transfer.
+ * RX: slots are submitted [armed], received [head] and unpacked [tail]
+ *     from usbd_poll() context. Only the cable rings are shared with
+ *     the application: [head] written by unpack, [tail] by usbd_midi_read().
+ *
+ * An index is only written by its owner, the other side load it with
+ *  acquire (and the owner store it with release).
+ */
+
+/* URB queued per direction */
+#define URBS_MAX 2
+
+/* Size of an event packet */
+#define EVENT_SIZE 4
+
+/* Number of MIDI bytes in an event, indexed by Code Index Number (0: reserved) */
+static const uint8_t cin_length[16] = {
+	0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1
+};
+
+static void tx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+static void rx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static inline uint8_t *rx_slot(usbd_midi *midi, uint32_t index)
+{
+	index &= midi->config.rx_slots - 1;
+	return (uint8_t *) midi->config.rx_buffer + (index * midi->config.ep_size);
+}
+
+static inline uint8_t *rx_ring(usbd_midi *midi, uint8_t cable)
+{
+	return (uint8_t *) midi->config.rx_ring + (cable * midi->config.rx_ring_size);
+}
+
+/**
+ * Submit a bulk transfer
+ * @param[in] midi MIDI
+ * @param[in] ep_addr Endpoint address
+ * @param[in] buf Buffer
+ * @param[in] len Length
+ * @param[in] flags Transfer flags
+ * @param[in] callback Callback
+ */
+static void submit(usbd_midi *midi, uint8_t ep_addr, void *buf,
+			size_t len, usbd_transfer_flags flags,
+			usbd_transfer_callback callback)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = midi->config.ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback,
+		.user_data = midi
+	};
+
+	usbd_transfer_submit(midi->dev, &transfer);
+}
+
+/**
+ * Stop after a non recoverable transfer failure.
+ * Events not yet sent are dropped, events received are kept.
+ * @param[in] midi MIDI
+ */
+static void stop(usbd_midi *midi)
+{
+	STORE_RELEASE(&midi->running, false);
+
+	midi->tx.sent = LOAD_ACQUIRE(&midi->tx.head);
+	STORE_RELEASE(&midi->tx.tail, midi->tx.sent);
+	midi->tx.urbs = 0;
+	midi->tx.frames = 0;
+
+	midi->rx.armed = midi->rx.head;
+}
+
+/**
+ * Submit as many IN URB as allowed
+ * Whole packets are sent right away, the partial packet only when due
+ *  (waited latency_frames SOF or flush requested).
+ * @param[in] midi MIDI
+ */
+static void tx_kick(usbd_midi *midi)
+{
+	const size_t ep_size = midi->config.ep_size;
+	const size_t size = midi->config.tx_size;
+	const size_t chunk = MAX(size / 2, ep_size);
+	uint8_t *ring = midi->config.tx_buffer;
+
+	while (midi->running && midi->tx.urbs < URBS_MAX) {
+		uint32_t sent = midi->tx.sent;
+		size_t avail = LOAD_ACQUIRE(&midi->tx.head) - sent;
+		size_t len;
+
+		if (!avail) {
+			break;
+		}
+
+		len = MIN(avail, size - (sent & (size - 1)));
+		len = MIN(len, chunk);
+
+		if (len == avail && (len % ep_size)) {
+			if (LOAD_ACQUIRE(&midi->tx.flush) ||
+					midi->tx.frames >= midi->config.latency_frames) {
+				midi->stats.tx_flushes++;
+				STORE_RELEASE(&midi->tx.flush, false);
+			} else {
+				/* Partial packet wait to be filled by the next events */
+				len -= len % ep_size;
+				if (!len) {
+					break;
+				}
+			}
+		}
+
+		midi->tx.sent = sent + len;
+		midi->tx.urbs++;
+		midi->tx.frames = 0;
+		submit(midi, midi->config.ep_in, ring + (sent & (size - 1)), len,
+			USBD_FLAG_NONE, tx_callback);
+	}
+}
+
+/**
+ * Arm the free RX slots (upto URBS_MAX in flight)
+ * @param[in] midi MIDI
+ */
+static void rx_kick(usbd_midi *midi)
+{
+	while (midi->running && midi->rx.armed - midi->rx.head < URBS_MAX) {
+		uint32_t armed = midi->rx.armed;
+
+		if (armed - midi->rx.tail >= midi->config.rx_slots) {
+			/* All slots wait to be unpacked (host get NAK) */
+			break;
+		}
+
+		/* A packet is a whole number of events: one packet per slot. */
+		midi->rx.armed = armed + 1;
+		submit(midi, midi->config.ep_out, rx_slot(midi, armed),
+			midi->config.ep_size, USBD_FLAG_SHORT_PACKET, rx_callback);
+	}
+}
+
+/**
+ * Unpack the received events into the cable rings
+ * Stop at the first event that do not fit (continued when the
+ *  application has read from the cable).
+ * @param[in] midi MIDI
+ * @return true if bytes were added to a cable ring
+ */
+static bool rx_unpack(usbd_midi *midi)
+{
+	const size_t size = midi->config.rx_ring_size;
+	bool added = false;
+
+	while (midi->rx.tail != midi->rx.head) {
+		uint32_t tail = midi->rx.tail;
+		uint16_t len = midi->rx.len[tail & (midi->config.rx_slots - 1)];
+		const uint8_t *ev = rx_slot(midi, tail) + midi->rx.pos;
+
+		/* Trailing bytes of an incomplete event are ignored */
+		for (; midi->rx.pos + EVENT_SIZE <= len; ev += EVENT_SIZE) {
+			uint8_t cable = ev[0] >> 4;
+			uint8_t n = cin_length[ev[0] & 0xF];
+			uint32_t head;
+			uint8_t *ring;
+			uint8_t i;
+
+			if (!n || cable >= midi->config.cables) {
+				midi->stats.rx_invalid++;
+				midi->rx.pos += EVENT_SIZE;
+				continue;
+			}
+
+			ring = rx_ring(midi, cable);
+			head = midi->rx.ring[cable].head;
+			if (size - (head - LOAD_ACQUIRE(&midi->rx.ring[cable].tail)) < n) {
+				if (!midi->rx.waiting) {
+					midi->stats.rx_waits++;
+					midi->rx.waiting = true;
+				}
+				return added;
+			}
+
+			for (i = 0; i < n; i++) {
+				ring[(head + i) & (size - 1)] = ev[1 + i];
+			}
+
+			STORE_RELEASE(&midi->rx.ring[cable].head, head + n);
+			midi->stats.rx_events++;
+			midi->rx.pos += EVENT_SIZE;
+			midi->rx.waiting = false;
+			added = true;
+		}
+
+		midi->rx.pos = 0;
+		midi->rx.tail = tail + 1;
+	}
+
+	return added;
+}
+
+/**
+ * Account transfer completion
+ * @param[in] midi MIDI
+ * @param[in] status Status
+ * @return false if the transfer should be ignored (stopped)
+ */
+static bool complete(usbd_midi *midi, usbd_transfer_status status)
+{
+	if (!midi->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("midi", status)) {
+	case USBD_CLASS_SUCCESS:
+	return true;
+	case USBD_CLASS_STOP:
+		stop(midi);
+	return false;
+	default:
+		midi->stats.errors++;
+	return true;
+	}
+}
+
+static void tx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_midi *midi = transfer->user_data;
+	const size_t ep_size = midi->config.ep_size;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(midi, status)) {
+		return;
+	}
+
+	/* URB complete in order: sent (or dropped on error) */
+	if (status == USBD_SUCCESS) {
+		midi->stats.tx_packets += (transfer->length + ep_size - 1) / ep_size;
+	}
+
+	midi->tx.urbs--;
+	STORE_RELEASE(&midi->tx.tail, midi->tx.tail + transfer->length);
+
+	tx_kick(midi);
+
+	if (midi->config.callback != NULL) {
+		midi->config.callback(midi);
+	}
+}
+
+static void rx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_midi *midi = transfer->user_data;
+	uint32_t head = midi->rx.head;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(midi, status)) {
+		return;
+	}
+
+	/* Partial data (in case of error) is kept, so events stay in order */
+	midi->rx.len[head & (midi->config.rx_slots - 1)] = transfer->transferred;
+	midi->rx.head = head + 1;
+
+	rx_unpack(midi);
+	rx_kick(midi);
+
+	if (midi->config.callback != NULL) {
+		midi->config.callback(midi);
+	}
+}
+
+void usbd_midi_init(usbd_midi *midi, usbd_device *dev,
+				const usbd_midi_config *config)
+{
+	memset(midi, 0, sizeof(*midi));
+	midi->dev = dev;
+	midi->config = *config;
+
+	if (!midi->config.latency_frames) {
+		midi->config.latency_frames = 1;
+	}
+
+	if (!midi->config.cables) {
+		midi->config.cables = 1;
+	} else if (midi->config.cables > USBD_MIDI_CABLES_MAX) {
+		LOGF_LN("midi: %"PRIu8" cables limited to %u",
+			config->cables, USBD_MIDI_CABLES_MAX);
+		midi->config.cables = USBD_MIDI_CABLES_MAX;
+	}
+
+	if (midi->config.rx_slots > USBD_MIDI_RX_SLOTS_MAX) {
+		LOGF_LN("midi: %"PRIu8" RX slots limited to %u",
+			config->rx_slots, USBD_MIDI_RX_SLOTS_MAX);
+		midi->config.rx_slots = USBD_MIDI_RX_SLOTS_MAX;
+	}
+}
+
+void usbd_midi_start(usbd_midi *midi)
+{
+	midi->tx.sent = LOAD_ACQUIRE(&midi->tx.tail);
+	midi->tx.urbs = 0;
+	midi->tx.frames = 0;
+	midi->rx.armed = midi->rx.head;
+
+	STORE_RELEASE(&midi->running, true);
+
+	rx_kick(midi);
+	tx_kick(midi);
+}
+
+void usbd_midi_sof(usbd_midi *midi)
+{
+	bool added;
+
+	if (!midi->running) {
+		return;
+	}
+
+	/* Space freed by usbd_midi_read() */
+	added = midi->rx.waiting && rx_unpack(midi);
+	rx_kick(midi);
+
+	/* Latency counted while events wait to be submitted,
+	 *  restarted on every submission */
+	if (LOAD_ACQUIRE(&midi->tx.head) != midi->tx.sent) {
+		if (midi->tx.frames < UINT8_MAX) {
+			midi->tx.frames++;
+		}
+	} else {
+		midi->tx.frames = 0;
+	}
+
+	tx_kick(midi);
+
+	if (added && midi->config.callback != NULL) {
+		midi->config.callback(midi);
+	}
+}
+
+/**
+ * Append an event to the TX ring (application)
+ * @param[in] midi MIDI
+ * @param[in] event Event packet
+ * @return false if the TX ring is full (or not started)
+ */
+static bool tx_put(usbd_midi *midi, const uint8_t event[4])
+{
+	const size_t size = midi->config.tx_size;
+	uint8_t *ring = midi->config.tx_buffer;
+	uint32_t head = midi->tx.head;
+
+	if (!LOAD_ACQUIRE(&midi->running)) {
+		return false;
+	}
+
+	if (size - (head - LOAD_ACQUIRE(&midi->tx.tail)) < EVENT_SIZE) {
+		midi->stats.tx_dropped++;
+		return false;
+	}
+
+	/* Ring size is a multiple of 4: an event never wrap */
+	memcpy(ring + (head & (size - 1)), event, EVENT_SIZE);
+	STORE_RELEASE(&midi->tx.head, head + EVENT_SIZE);
+	midi->stats.tx_events++;
+	return true;
+}
+
+bool usbd_midi_send_event(usbd_midi *midi, const uint8_t event[4])
+{
+	return tx_put(midi, event);
+}
+
+bool usbd_midi_send(usbd_midi *midi, uint8_t cable, const uint8_t *msg,
+				size_t len)
+{
+	uint8_t event[EVENT_SIZE] = {0, 0, 0, 0};
+	uint8_t status;
+	uint8_t cin;
+
+	if (cable >= midi->config.cables || !len) {
+		return false;
+	}
+
+	status = msg[0];
+
+	if (status < 0xF0) {
+		/* Channel voice, running status is not supported */
+		if (status < 0x80) {
+			return false;
+		}
+		cin = status >> 4;
+	} else if (status == 0xF1 || status == 0xF3) {
+		cin = 0x2;
+	} else if (status == 0xF2) {
+		cin = 0x3;
+	} else if (status == 0xF6) {
+		cin = 0x5;
+	} else if (status >= 0xF8) {
+		cin = 0xF;
+	} else {
+		/* SysEx (usbd_midi_send_sysex()), undefined */
+		return false;
+	}
+
+	if (len != cin_length[cin]) {
+		return false;
+	}
+
+	event[0] = (cable << 4) | cin;
+	memcpy(&event[1], msg, len);
+	return tx_put(midi, event);
+}
+
+size_t usbd_midi_send_sysex(usbd_midi *midi, uint8_t cable,
+				const uint8_t *data, size_t len)
+{
+	size_t i;
+
+	if (cable >= midi->config.cables) {
+		return 0;
+	}
+
+	for (i = 0; i < len; i++) {
+		uint8_t event[EVENT_SIZE] = {0, 0, 0, 0};
+		uint8_t *pending = midi->tx.sysex[cable].data;
+		uint8_t n = midi->tx.sysex[cable].len;
+
+		if (data[i] == 0xF0) {
+			/* Start of message: drop the rest of an unterminated one */
+			n = 0;
+		}
+
+		pending[n++] = data[i];
+
+		if (data[i] == 0xF7) {
+			/* End with 1, 2 or 3 bytes */
+			event[0] = (cable << 4) | (0x4 + n);
+		} else if (n == 3) {
+			/* Start or continue */
+			event[0] = (cable << 4) | 0x4;
+		} else {
+			midi->tx.sysex[cable].len = n;
+			continue;
+		}
+
+		memcpy(&event[1], pending, n);
+		if (!tx_put(midi, event)) {
+			/* Byte refused, the pending bytes are kept */
+			break;
+		}
+
+		midi->tx.sysex[cable].len = 0;
+	}
+
+	return i;
+}
+
+void usbd_midi_flush(usbd_midi *midi)
+{
+	STORE_RELEASE(&midi->tx.flush, true);
+}
+
+size_t usbd_midi_read(usbd_midi *midi, uint8_t cable, void *data, size_t len)
+{
+	const size_t size = midi->config.rx_ring_size;
+	const uint8_t *ring;
+	uint8_t *dest = data;
+	uint32_t head, tail;
+	size_t n, i;
+
+	if (cable >= midi->config.cables) {
+		return 0;
+	}
+
+	ring = rx_ring(midi, cable);
+	head = LOAD_ACQUIRE(&midi->rx.ring[cable].head);
+	tail = midi->rx.ring[cable].tail;
+	n = MIN(len, head - tail);
+
+	for (i = 0; i < n; i++) {
+		dest[i] = ring[(tail + i) & (size - 1)];
+	}
+
+	/* Unpack continue at next usbd_midi_sof() */
+	STORE_RELEASE(&midi->rx.ring[cable].tail, tail + n);
+	return n;
+}
+
+void usbd_midi_get_stats(usbd_midi *midi, usbd_midi_stats *stats)
+{
+	*stats = midi->stats;
+}
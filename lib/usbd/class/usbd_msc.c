@@ -26,437 +26,61 @@
 #include <unicore-mx/usbd/usbd.h>
 #include <unicore-mx/usbd/class/msc.h>
 #include "../usbd_private.h"
+#include "usbd_class.h"
+#include "usbd_scsi.h"
+
+#define BLOCK_SIZE 512
 
 /*
  * TODO:
  * - Removable media support
- * - Other design too (Bulk only atm)
- */
-
-/* Definitions of Mass Storage Class from:
- *
- * (A) "Universal Serial Bus Mass Storage Class Bulk-Only Transport
- *      Revision 1.0"
- *
- * (B) "Universal Serial Bus Mass Storage Class Specification Overview
- *      Revision 1.0"
+ * - Other design too (Bulk only atm, see usbd_uas.c for UAS)
  */
 
-/* The sense codes */
-enum sbc_sense_key {
-	SBC_SENSE_KEY_NO_SENSE			= 0x00,
-	SBC_SENSE_KEY_RECOVERED_ERROR		= 0x01,
-	SBC_SENSE_KEY_NOT_READY			= 0x02,
-	SBC_SENSE_KEY_MEDIUM_ERROR		= 0x03,
-	SBC_SENSE_KEY_HARDWARE_ERROR		= 0x04,
-	SBC_SENSE_KEY_ILLEGAL_REQUEST		= 0x05,
-	SBC_SENSE_KEY_UNIT_ATTENTION		= 0x06,
-	SBC_SENSE_KEY_DATA_PROTECT		= 0x07,
-	SBC_SENSE_KEY_BLANK_CHECK		= 0x08,
-	SBC_SENSE_KEY_VENDOR_SPECIFIC		= 0x09,
-	SBC_SENSE_KEY_COPY_ABORTED		= 0x0A,
-	SBC_SENSE_KEY_ABORTED_COMMAND		= 0x0B,
-	SBC_SENSE_KEY_VOLUME_OVERFLOW		= 0x0D,
-	SBC_SENSE_KEY_MISCOMPARE		= 0x0E
-};
-
-enum sbc_asc {
-	SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION	= 0x00,
-	SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT	= 0x03,
-	SBC_ASC_LOGICAL_UNIT_NOT_READY		= 0x04,
-	SBC_ASC_UNRECOVERED_READ_ERROR		= 0x11,
-	SBC_ASC_INVALID_COMMAND_OPERATION_CODE	= 0x20,
-	SBC_ASC_LBA_OUT_OF_RANGE		= 0x21,
-	SBC_ASC_INVALID_FIELD_IN_CDB		= 0x24,
-	SBC_ASC_WRITE_PROTECTED			= 0x27,
-	SBC_ASC_NOT_READY_TO_READY_CHANGE	= 0x28,
-	SBC_ASC_FORMAT_ERROR			= 0x31,
-	SBC_ASC_MEDIUM_NOT_PRESENT		= 0x3A
-};
-
-enum sbc_ascq {
-	SBC_ASCQ_NA				= 0x00,
-	SBC_ASCQ_FORMAT_COMMAND_FAILED		= 0x01,
-	SBC_ASCQ_INITIALIZING_COMMAND_REQUIRED	= 0x02,
-	SBC_ASCQ_OPERATION_IN_PROGRESS		= 0x07
-};
-
-enum trans_event {
-	EVENT_CBW_VALID,
-	EVENT_NEED_STATUS
-};
-
-struct sbc_sense_info {
-	uint8_t key;
-	uint8_t asc;
-	uint8_t ascq;
-};
-
-struct usb_msc_trans {
-	struct usb_msc_cbw cbw;
-
-	uint32_t bytes_to_recv;
-	uint32_t bytes_to_send;
-	uint32_t byte_count;		/* Either read until equal to bytes_to_recv or
-					   write until equal to bytes_to_send. */
-	uint32_t lba_start;
-	uint32_t block_count;
-	uint32_t current_block;
-
-	uint8_t msd_buf[512];
-
-	struct usb_msc_csw csw;
-};
-
 struct usbd_msc {
 	usbd_device *dev;
 	uint8_t ep_in;
 	uint8_t ep_in_size;
 	uint8_t ep_out;
 	uint8_t ep_out_size;
-	const usbd_msc_backend *backend;
+	struct usbd_msc_lun lun;
 	struct usb_msc_trans trans;
-	struct sbc_sense_info sense;
-};
-
-static usbd_msc _mass_storage;
 
-/*-- SCSI Base Responses -----------------------------------------------------*/
-
-static const uint8_t _spc3_inquiry_response[36] = {
-	0x00,	/* Byte 0: Peripheral Qualifier = 0, Peripheral Device Type = 0 */
-	0x80,	/* Byte 1: RMB = 1, Reserved = 0 */
-	0x04,	/* Byte 2: Version = 0 */
-	0x02,	/* Byte 3: Obsolete = 0, NormACA = 0, HiSup = 0, Response Data Format = 2 */
-	0x20,	/* Byte 4: Additional Length (n-4) = 31 + 4 */
-	0x00,	/* Byte 5: SCCS = 0, ACC = 0, TPGS = 0, 3PC = 0, Reserved = 0, Protect = 0 */
-	0x00,	/* Byte 6: BQue = 0, EncServ = 0, VS = 0, MultiP = 0, MChngr = 0, Obsolete = 0, Addr16 = 0 */
-	0x00,	/* Byte 7: Obsolete = 0, Wbus16 = 0, Sync = 0, Linked = 0, CmdQue = 0, VS = 0 */
-		/* Byte 8 - Byte 15: Vendor Identification */
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-		/* Byte 16 - Byte 31: Product Identification */
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
-		/* Byte 32 - Byte 35: Product Revision Level */
-	0x20, 0x20, 0x20, 0x20
+	/* Block buffers: count buffers of blocks each (default: msd_buf) */
+	struct {
+		uint8_t *mem;
+		uint8_t count;
+		uint16_t blocks;
+	} buffers;
+
+	/*
+	 * Block data stage, in chunks of buffers.blocks
+	 *  (chunk k use buffer k % buffers.count)
+	 */
+	struct {
+		uint32_t chunks; /**< Chunks of the command (0: no block stage) */
+		uint32_t media_next; /**< Chunks given to backend */
+		uint32_t media_done; /**< Chunks read or written by backend */
+		uint32_t usb_next; /**< Chunks submitted on bus */
+		uint32_t usb_done; /**< Chunks moved on bus */
+		bool media_busy; /**< Backend access in flight */
+		bool aborted; /**< Stopped, waiting for the backend access */
+		bool cbw_pending; /**< CBW received while aborted */
+		bool out_of_range; /**< Data stage without backend access */
+		bool completed; /**< Backend access finished (any context) */
+		int result; /**< Result of backend access */
+		bool busy, again; /**< kick() running, one more pass needed */
+	} io;
 };
 
-static const uint8_t _spc3_request_sense[18] = {
-	0x70,	/* Byte 0: VALID = 0, Response Code = 112 */
-	0x00,	/* Byte 1: Obsolete = 0 */
-	0x00,	/* Byte 2: Filemark = 0, EOM = 0, ILI = 0, Reserved = 0, Sense Key = 0 */
-		/* Byte 3 - Byte 6: Information = 0 */
-	0, 0, 0, 0,
-	0x0a,	/* Byte 7: Additional Sense Length = 10 */
-		/* Byte 8 - Byte 11: Command Specific Info = 0 */
-	0, 0, 0, 0,
-	0x00,	/* Byte 12: Additional Sense Code (ASC) = 0 */
-	0x00,	/* Byte 13: Additional Sense Code Qualifier (ASCQ) = 0 */
-	0x00,	/* Byte 14: Field Replaceable Unit Code (FRUC) = 0 */
-	0x00,	/* Byte 15: SKSV = 0, SenseKeySpecific[0] = 0 */
-	0x00,	/* Byte 16: SenseKeySpecific[0] = 0 */
-	0x00	/* Byte 17: SenseKeySpecific[0] = 0 */
-};
-
-/*-- SCSI Layer --------------------------------------------------------------*/
-
-static void set_sbc_status(usbd_msc *ms,
-				enum sbc_sense_key key,
-				enum sbc_asc asc,
-				enum sbc_ascq ascq)
-{
-	ms->sense.key = (uint8_t) key;
-	ms->sense.asc = (uint8_t) asc;
-	ms->sense.ascq = (uint8_t) ascq;
-}
-
-static void set_sbc_status_good(usbd_msc *ms)
-{
-	set_sbc_status(ms,
-				SBC_SENSE_KEY_NO_SENSE,
-				SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION,
-				SBC_ASCQ_NA);
-}
-
-static void scsi_read_6(usbd_msc *ms,
-			struct usb_msc_trans *trans,
-			enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		uint8_t *buf = trans->cbw.CBWCB;
-
-		trans->lba_start = (buf[2] << 8) | buf[3];
-		trans->block_count = buf[4];
-		trans->current_block = 0;
-
-		/* TODO: Check the lba & block_count for range. */
-
-		/* both are in terms of 512 byte blocks, so shift by 9 */
-		trans->bytes_to_send = trans->block_count << 9;
-
-		set_sbc_status_good(ms);
-	}
-}
-
-static void scsi_write_6(usbd_msc *ms,
-			 struct usb_msc_trans *trans,
-			 enum trans_event event)
-{
-	(void) ms;
-
-	if (EVENT_CBW_VALID == event) {
-		uint8_t *buf = trans->cbw.CBWCB;
-
-		trans->lba_start = ((0x1f & buf[1]) << 16) | (buf[2] << 8) | buf[3];
-		trans->block_count = buf[4];
-		trans->current_block = 0;
-
-		trans->bytes_to_recv = trans->block_count << 9;
-	}
-}
-
-static void scsi_write_10(usbd_msc *ms,
-			  struct usb_msc_trans *trans,
-			  enum trans_event event)
-{
-	(void) ms;
-
-	if (EVENT_CBW_VALID == event) {
-		uint8_t *buf = trans->cbw.CBWCB;
-
-		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) |
-					(buf[4] << 8) | buf[5];
-		trans->block_count = (buf[7] << 8) | buf[8];
-		trans->current_block = 0;
-
-		trans->bytes_to_recv = trans->block_count << 9;
-	}
-}
-
-static void scsi_read_10(usbd_msc *ms,
-			 struct usb_msc_trans *trans,
-			 enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		uint8_t *buf = trans->cbw.CBWCB;
-
-		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
-		trans->block_count = (buf[7] << 8) | buf[8];
-
-		/* TODO: Check the lba & block_count for range. */
-
-		/* both are in terms of 512 byte blocks, so shift by 9 */
-		trans->bytes_to_send = trans->block_count << 9;
-
-		set_sbc_status_good(ms);
-	}
-}
-
-static void scsi_read_capacity(usbd_msc *ms,
-					struct usb_msc_trans *trans,
-					enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		uint32_t last_logical_addr = ms->backend->block_count - 1;
-		trans->msd_buf[0] = last_logical_addr >> 24;
-		trans->msd_buf[1] = 0xff & (last_logical_addr >> 16);
-		trans->msd_buf[2] = 0xff & (last_logical_addr >> 8);
-		trans->msd_buf[3] = 0xff & last_logical_addr;
-
-		/* Block size: 512 */
-		trans->msd_buf[4] = 0;
-		trans->msd_buf[5] = 0;
-		trans->msd_buf[6] = 2;
-		trans->msd_buf[7] = 0;
-		trans->bytes_to_send = 8;
-		set_sbc_status_good(ms);
-	}
-}
-
-static void fallback_format_unit(usbd_msc *ms, struct usb_msc_trans *trans)
-{
-	uint32_t i;
-
-	memset(trans->msd_buf, 0, sizeof(trans->msd_buf));
-
-	for (i = 0; i < ms->backend->block_count; i++) {
-		if (ms->backend->write_block(ms->backend, i, trans->msd_buf) != 0) {
-			/* Error */
-		}
-	}
-}
-
-static void scsi_format_unit(usbd_msc *ms,
-					struct usb_msc_trans *trans,
-					enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		if (ms->backend->format_unit != NULL) {
-			if (ms->backend->format_unit(ms->backend) != 0) {
-				/* Error */
-			}
-		} else {
-			fallback_format_unit(ms, trans);
-		}
-
-		set_sbc_status_good(ms);
-	}
-}
-
-static void scsi_request_sense(usbd_msc *ms,
-					struct usb_msc_trans *trans,
-					enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		uint8_t *buf = trans->cbw.CBWCB;
-
-		trans->bytes_to_send = buf[4];	/* allocation length */
-		memcpy(trans->msd_buf, _spc3_request_sense,
-			sizeof(_spc3_request_sense));
-
-		trans->msd_buf[2] = ms->sense.key;
-		trans->msd_buf[12] = ms->sense.asc;
-		trans->msd_buf[13] = ms->sense.ascq;
-	}
-}
-
-static void scsi_mode_sense_6(usbd_msc *ms,
-					struct usb_msc_trans *trans,
-					enum trans_event event)
-{
-	(void) ms;
-
-	if (EVENT_CBW_VALID == event) {
-#if 0
-		uint8_t *buf = trans->cbw.CBWCB;
-		uint8_t page_code = buf[2];
-		uint8_t allocation_length = buf[4];
-
-		if (0x1C == page_code) {	/* Informational Exceptions */
-#endif
-			trans->bytes_to_send = 4;
-
-			trans->msd_buf[0] = 3;	/* Num bytes that follow */
-			trans->msd_buf[1] = 0;	/* Medium Type */
-			trans->msd_buf[2] = 0;	/* Device specific param */
-			trans->csw.dCSWDataResidue = 4;
-#if 0
-		} else if (0x01 == page_code) {	/* Error recovery */
-		} else if (0x3F == page_code) {	/* All */
-		} else {
-			/* Error */
-			trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
-			set_sbc_status(ms,
-						SBC_SENSE_KEY_ILLEGAL_REQUEST,
-						SBC_ASC_INVALID_FIELD_IN_CDB,
-						SBC_ASCQ_NA);
-		}
-#endif
-	}
-}
-
-static void scsi_inquiry(usbd_msc *ms,
-			 struct usb_msc_trans *trans,
-			 enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		uint8_t *buf = trans->cbw.CBWCB;
-		uint8_t evpd = 1 & buf[1];
-
-		if (0 == evpd) {
-			size_t len;
-			trans->bytes_to_send = sizeof(_spc3_inquiry_response);
-			memcpy(trans->msd_buf, _spc3_inquiry_response, sizeof(_spc3_inquiry_response));
-
-			len = strlen(ms->backend->vendor_id);
-			len = MIN(len, 8);
-			memcpy(&trans->msd_buf[8], ms->backend->vendor_id, len);
-
-			len = strlen(ms->backend->product_id);
-			len = MIN(len, 16);
-			memcpy(&trans->msd_buf[16], ms->backend->product_id, len);
-
-			len = strlen(ms->backend->product_rev);
-			len = MIN(len, 4);
-			memcpy(&trans->msd_buf[32], ms->backend->product_rev, len);
-
-			trans->csw.dCSWDataResidue = sizeof(_spc3_inquiry_response);
-
-			set_sbc_status_good(ms);
-		} else {
-			/* TODO: Add VPD 0x83 support */
-			/* TODO: Add VPD 0x00 support */
-		}
-	}
-}
-
-static void scsi_command(usbd_msc *ms,
-			 struct usb_msc_trans *trans,
-			 enum trans_event event)
-{
-	if (EVENT_CBW_VALID == event) {
-		/* Setup the default success */
-		trans->csw.dCSWSignature = USB_MSC_CSW_SIGNATURE;
-		trans->csw.dCSWTag = trans->cbw.dCBWTag;
-		trans->csw.dCSWDataResidue = 0;
-		trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_SUCCESS;
-
-		trans->bytes_to_send = 0;
-		trans->bytes_to_recv = 0;
-		trans->byte_count = 0;
-	}
-
-	switch (trans->cbw.CBWCB[0]) {
-	case USB_MSC_SCSI_TEST_UNIT_READY:
-	case USB_MSC_SCSI_SEND_DIAGNOSTIC:
-		/* Do nothing, just send the success. */
-		set_sbc_status_good(ms);
-		break;
-	case USB_MSC_SCSI_FORMAT_UNIT:
-		scsi_format_unit(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_REQUEST_SENSE:
-		scsi_request_sense(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_MODE_SENSE_6:
-		scsi_mode_sense_6(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_READ_6:
-		scsi_read_6(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_INQUIRY:
-		scsi_inquiry(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_READ_CAPACITY:
-		scsi_read_capacity(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_READ_10:
-		scsi_read_10(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_WRITE_6:
-		scsi_write_6(ms, trans, event);
-		break;
-	case USB_MSC_SCSI_WRITE_10:
-		scsi_write_10(ms, trans, event);
-		break;
-	default:
-		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
-					SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
-					SBC_ASCQ_NA);
-
-		trans->bytes_to_send = 0;
-		trans->bytes_to_recv = 0;
-		trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
-		break;
-	}
-}
+static usbd_msc _mass_storage;
 
 /*-- USB Mass Storage Layer --------------------------------------------------*/
 
 static inline void lock(usbd_msc *ms)
 {
-	if (ms->backend->lock != NULL) {
-		if (ms->backend->lock() != 0) {
+	if (ms->lun.backend->lock != NULL) {
+		if (ms->lun.backend->lock() != 0) {
 			/* Error */
 		}
 	}
@@ -464,8 +88,8 @@ static inline void lock(usbd_msc *ms)
 
 static inline void unlock(usbd_msc *ms)
 {
-	if (ms->backend->unlock != NULL) {
-		if (ms->backend->unlock() != 0) {
+	if (ms->lun.backend->unlock != NULL) {
+		if (ms->lun.backend->unlock() != 0) {
 			/* Error */
 		}
 	}
@@ -498,6 +122,24 @@ static inline void unlock(usbd_msc *ms)
  *          |-> csw_send_to_host()
  *
  * csw_send_to_host_callback() -> cbw_recv_from_host()
+ *
+ * Block data stage (READ/WRITE):
+ *
+ * cbw_recv_from_host_callback() -> block_start() -> kick()
+ *
+ * kick(): backend access and block transfers of the chunks that can
+ *  proceed, csw_send_to_host() when all the chunks are done.
+ *  Read: read-ahead, upto buffers.count chunks read before being sent.
+ *  Write: write-behind, upto buffers.count chunks received before being
+ *  written. A single backend access is in flight, bus transfers of the
+ *  other buffers overlap it.
+ *
+ * block_send_callback(), block_recv_callback(), usbd_msc_poll()
+ *  (asynchronous backend completion) -> kick()
+ *
+ * Stopped (bus reset, configuration change) during the block data stage:
+ *  the backend access in flight is waited (its buffer and callback), then
+ *  the lock is released. A CBW received meanwhile is processed after.
  */
 
 /**
@@ -571,7 +213,7 @@ static void csw_send_to_host_callback(usbd_device *dev,
 static void csw_send_to_host(usbd_msc *ms,
 								struct usb_msc_trans *trans)
 {
-	scsi_command(ms, trans, EVENT_NEED_STATUS);
+	usbd_scsi_command(&ms->lun, trans, EVENT_NEED_STATUS);
 
 	const usbd_transfer transfer = {
 		.ep_type = USBD_EP_BULK,
@@ -606,14 +248,6 @@ static void buf_recv_from_host_callback(usbd_device *dev,
 	usbd_msc *ms = transfer->user_data;
 	struct usb_msc_trans *trans = &ms->trans;
 
-	if (trans->block_count) {
-		uint32_t lba = trans->lba_start + trans->current_block;
-		if (ms->backend->write_block(ms->backend, lba, trans->msd_buf) != 0) {
-			/* Error */
-		}
-		trans->current_block++;
-	}
-
 	trans->byte_count += transfer->transferred;
 
 	if (trans->byte_count < trans->bytes_to_recv) {
@@ -621,14 +255,6 @@ static void buf_recv_from_host_callback(usbd_device *dev,
 		return;
 	}
 
-	if (trans->block_count) {
-		if (trans->current_block == trans->block_count) {
-			trans->current_block = 0;
-		}
-
-		unlock(ms);
-	}
-
 	csw_send_to_host(ms, trans);
 }
 
@@ -680,12 +306,6 @@ static void buf_send_to_host_callback(usbd_device *dev,
 		return;
 	}
 
-	if (trans->block_count) {
-		if (trans->current_block == trans->block_count) {
-			trans->current_block = 0;
-		}
-	}
-
 	csw_send_to_host(ms, trans);
 }
 
@@ -695,14 +315,6 @@ static void buf_send_to_host_callback(usbd_device *dev,
 static void buf_send_to_host(usbd_msc *ms,
 							struct usb_msc_trans *trans)
 {
-	if (trans->block_count) {
-		uint32_t lba = trans->lba_start + trans->current_block;
-		if (ms->backend->read_block(ms->backend, lba, trans->msd_buf) != 0) {
-			/* Error */
-		}
-		trans->current_block++;
-	}
-
 	uint32_t rem = trans->bytes_to_send - trans->byte_count;
 
 	const usbd_transfer transfer = {
@@ -721,31 +333,275 @@ static void buf_send_to_host(usbd_msc *ms,
 	usbd_transfer_submit(ms->dev, &transfer);
 }
 
+/*-- Block data stage --------------------------------------------------------*/
+
+static void kick(usbd_msc *ms);
+static void cbw_process(usbd_msc *ms);
+
+static inline bool block_is_write(usbd_msc *ms)
+{
+	return ms->trans.bytes_to_recv != 0;
+}
+
+static inline uint32_t chunk_blocks(usbd_msc *ms, uint32_t chunk)
+{
+	return MIN(ms->buffers.blocks,
+		ms->trans.block_count - chunk * ms->buffers.blocks);
+}
+
+static inline uint8_t *chunk_buffer(usbd_msc *ms, uint32_t chunk)
+{
+	return ms->buffers.mem +
+		(chunk % ms->buffers.count) * ms->buffers.blocks * BLOCK_SIZE;
+}
+
 /**
- * CBW read from host callback
- * @sa cbw_recv_from_host()
+ * Fail the command (CSW), the data stage still complete
+ * @param[in] ms Mass Storage
+ * @param[in] key Sense key
+ * @param[in] asc Additional sense code
  */
-static void cbw_recv_from_host_callback(usbd_device *dev,
+static void block_fail(usbd_msc *ms, enum sbc_sense_key key,
+				enum sbc_asc asc)
+{
+	usbd_scsi_set_sense(&ms->lun, key, asc, SBC_ASCQ_NA);
+	ms->trans.csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
+}
+
+static void media_callback(void *ctx, int result)
+{
+	usbd_msc *ms = ctx;
+
+	ms->io.result = result;
+	STORE_RELEASE(&ms->io.completed, true);
+}
+
+/**
+ * Read or write @a chunk with the backend
+ * @param[in] ms Mass Storage
+ * @param[in] chunk Chunk
+ */
+static void media_start(usbd_msc *ms, uint32_t chunk)
+{
+	ms->io.media_busy = true;
+	ms->io.completed = false;
+
+	/* Completion can be performed before returning */
+	ms->io.again = true;
+
+	if (ms->io.out_of_range) {
+		/* Host still get (or give) the data, command failed already */
+		media_callback(ms, 0);
+		return;
+	}
+
+	usbd_scsi_media_access(&ms->lun, block_is_write(ms),
+		ms->trans.lba_start + chunk * ms->buffers.blocks,
+		chunk_blocks(ms, chunk), chunk_buffer(ms, chunk),
+		media_callback, ms);
+}
+
+static void block_callback(usbd_device *dev,
 		const usbd_transfer *transfer, usbd_transfer_status status,
 		usbd_urb_id urb_id)
 {
+	usbd_msc *ms = transfer->user_data;
+
+	(void) dev;
 	(void) urb_id;
 
-	if (status != USBD_SUCCESS) {
-		try_resubmit(dev, transfer, status);
+	switch (usbd_class_status("msc", status)) {
+	case USBD_CLASS_SUCCESS:
+	break;
+	case USBD_CLASS_STOP:
+		ms->io.aborted = true;
+		kick(ms);
+	return;
+	default:
+		/* Resubmitting would reorder the chunks */
+		block_fail(ms, SBC_SENSE_KEY_ABORTED_COMMAND,
+				SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION);
+	break;
+	}
+
+	ms->io.usb_done++;
+	kick(ms);
+}
+
+/**
+ * Submit the bus transfer of @a chunk
+ * @param[in] ms Mass Storage
+ * @param[in] chunk Chunk
+ */
+static void block_submit(usbd_msc *ms, uint32_t chunk)
+{
+	bool write = block_is_write(ms);
+
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = write ? ms->ep_out : ms->ep_in,
+		.ep_size = write ? ms->ep_out_size : ms->ep_in_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = chunk_buffer(ms, chunk),
+		.length = chunk_blocks(ms, chunk) * BLOCK_SIZE,
+		.flags = USBD_FLAG_NONE,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = block_callback,
+		.user_data = ms
+	};
+
+	usbd_transfer_submit(ms->dev, &transfer);
+}
+
+/**
+ * End the block data stage of a stopped command, once the backend access in
+ *  flight is done (usbd_msc_poll() kick again on completion)
+ * @param[in] ms Mass Storage
+ */
+static void block_abort(usbd_msc *ms)
+{
+	if (ms->io.media_busy && !LOAD_ACQUIRE(&ms->io.completed)) {
 		return;
 	}
 
-	usbd_msc *ms = transfer->user_data;
+	ms->io.chunks = 0;
+	ms->io.media_busy = false;
+	unlock(ms);
+
+	if (ms->io.cbw_pending) {
+		ms->io.cbw_pending = false;
+		cbw_process(ms);
+	}
+}
+
+/**
+ * Move the chunks that can proceed
+ * @param[in] ms Mass Storage
+ */
+static void block_process(usbd_msc *ms)
+{
+	const uint32_t count = ms->buffers.count;
+
+	if (ms->io.aborted) {
+		block_abort(ms);
+		return;
+	}
+
+	if (ms->io.media_busy && LOAD_ACQUIRE(&ms->io.completed)) {
+		ms->io.media_busy = false;
+		ms->io.media_done++;
+
+		if (ms->io.result) {
+			LOGF_LN("msc: backend failed (status=%i)", ms->io.result);
+			if (block_is_write(ms)) {
+				block_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+					SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT);
+			} else {
+				block_fail(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+					SBC_ASC_UNRECOVERED_READ_ERROR);
+			}
+		}
+	}
+
+	if (block_is_write(ms)) {
+		/* Receive while earlier chunks are written */
+		while (ms->io.usb_next < ms->io.chunks &&
+				ms->io.usb_next - ms->io.media_done < count) {
+			block_submit(ms, ms->io.usb_next++);
+		}
+
+		if (!ms->io.media_busy && ms->io.media_next < ms->io.usb_done) {
+			media_start(ms, ms->io.media_next++);
+		}
+
+		if (ms->io.media_done < ms->io.chunks) {
+			return;
+		}
+	} else {
+		/* Read ahead while earlier chunks are sent */
+		if (!ms->io.media_busy && ms->io.media_next < ms->io.chunks &&
+				ms->io.media_next - ms->io.usb_done < count) {
+			media_start(ms, ms->io.media_next++);
+		}
+
+		while (ms->io.usb_next < ms->io.media_done) {
+			block_submit(ms, ms->io.usb_next++);
+		}
+
+		if (ms->io.usb_done < ms->io.chunks) {
+			return;
+		}
+	}
+
+	ms->io.chunks = 0;
+	unlock(ms);
+	csw_send_to_host(ms, &ms->trans);
+}
+
+static void kick(usbd_msc *ms)
+{
+	if (ms->io.busy) {
+		ms->io.again = true;
+		return;
+	}
+
+	ms->io.busy = true;
+
+	do {
+		ms->io.again = false;
+		if (ms->io.chunks) {
+			block_process(ms);
+		}
+	} while (ms->io.again);
+
+	ms->io.busy = false;
+}
+
+/**
+ * Start the data stage of a READ or WRITE command
+ * @param[in] ms Mass Storage
+ */
+static void block_start(usbd_msc *ms)
+{
 	struct usb_msc_trans *trans = &ms->trans;
+	uint32_t block_count = ms->lun.backend->block_count;
 
-	scsi_command(ms, trans, EVENT_CBW_VALID);
+	ms->io.out_of_range = trans->lba_start >= block_count ||
+			trans->block_count > block_count - trans->lba_start;
 
-	if (trans->block_count) {
-		lock(ms);
+	if (ms->io.out_of_range) {
+		/* Data stage still performed, without backend access */
+		block_fail(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+				SBC_ASC_LBA_OUT_OF_RANGE);
 	}
 
-	if (trans->bytes_to_recv) {
+	lock(ms);
+
+	ms->io.chunks = (trans->block_count + ms->buffers.blocks - 1) /
+						ms->buffers.blocks;
+	ms->io.media_next = 0;
+	ms->io.media_done = 0;
+	ms->io.usb_next = 0;
+	ms->io.usb_done = 0;
+	ms->io.media_busy = false;
+	ms->io.aborted = false;
+
+	kick(ms);
+}
+
+/**
+ * Execute the CBW received
+ * @param[in] ms Mass Storage
+ */
+static void cbw_process(usbd_msc *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+
+	usbd_scsi_command(&ms->lun, trans, EVENT_CBW_VALID);
+
+	if (trans->block_count && (trans->bytes_to_recv || trans->bytes_to_send)) {
+		block_start(ms);
+	} else if (trans->bytes_to_recv) {
 		buf_recv_from_host(ms, trans);
 	} else if (trans->bytes_to_send) {
 		buf_send_to_host(ms, trans);
@@ -754,6 +610,32 @@ static void cbw_recv_from_host_callback(usbd_device *dev,
 	}
 }
 
+/**
+ * CBW read from host callback
+ * @sa cbw_recv_from_host()
+ */
+static void cbw_recv_from_host_callback(usbd_device *dev,
+		const usbd_transfer *transfer, usbd_transfer_status status,
+		usbd_urb_id urb_id)
+{
+	(void) urb_id;
+
+	if (status != USBD_SUCCESS) {
+		try_resubmit(dev, transfer, status);
+		return;
+	}
+
+	usbd_msc *ms = transfer->user_data;
+
+	if (ms->io.chunks) {
+		/* Block data stage of the stopped command not ended yet */
+		ms->io.cbw_pending = true;
+		return;
+	}
+
+	cbw_process(ms);
+}
+
 /**
  * CBW read from host
  * @sa cbw_recv_from_host_callback()
@@ -793,7 +675,9 @@ bool usbd_msc_setup_ep0(usbd_msc *ms,
 	if ((setup_data->bmRequestType & mask) == value) {
 		switch (setup_data->bRequest) {
 		case USB_MSC_REQ_BULK_ONLY_RESET:
-			/* Do any special reset code here. */
+			if (usbd_scsi_flush(&ms->lun) != 0) {
+				LOG_LN("msc: flush on reset failed");
+			}
 			usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
 		return true;
 		case USB_MSC_REQ_GET_MAX_LUN: {
@@ -815,9 +699,35 @@ bool usbd_msc_setup_ep0(usbd_msc *ms,
  */
 void usbd_msc_start(usbd_msc *ms)
 {
+	if (ms->io.chunks) {
+		/* Block data stage in progress when the host reset */
+		ms->io.aborted = true;
+		kick(ms);
+	}
+
 	cbw_recv_from_host(ms, &ms->trans);
 }
 
+void usbd_msc_set_buffers(usbd_msc *ms, void *buffer, uint8_t count,
+				uint16_t blocks)
+{
+	if (buffer == NULL || !count || !blocks) {
+		LOG_LN("msc: invalid buffers, previous buffers kept");
+		return;
+	}
+
+	ms->buffers.mem = buffer;
+	ms->buffers.count = count;
+	ms->buffers.blocks = blocks;
+}
+
+void usbd_msc_poll(usbd_msc *ms)
+{
+	if (ms->io.media_busy && LOAD_ACQUIRE(&ms->io.completed)) {
+		kick(ms);
+	}
+}
+
 /** @addtogroup usb_msc */
 /** @{ */
 
@@ -847,11 +757,16 @@ usbd_msc *usbd_msc_init(usbd_device *dev,
 	ms->ep_in_size = ep_in_size;
 	ms->ep_out = ep_out;
 	ms->ep_out_size = ep_out_size;
-	ms->backend = backend;
+	ms->lun.backend = backend;
 
 	reset_trans(&ms->trans);
 
-	set_sbc_status_good(ms);
+	usbd_msc_set_buffers(ms, ms->trans.msd_buf, 1, 1);
+	ms->io.chunks = 0;
+	ms->io.media_busy = false;
+
+	usbd_scsi_set_sense(&ms->lun, SBC_SENSE_KEY_NO_SENSE,
+				SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION, SBC_ASCQ_NA);
 
 	return ms;
 }
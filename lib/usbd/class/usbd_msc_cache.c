@@ -0,0 +1,360 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/msc_cache.h>
+#include "../usbd_private.h"
+
+/*
+ * Lines: cache->line[i] describe the block at cache->data + i * 512.
+ *  Lookup is a linear search (a few tens of lines fit the RAM of the
+ *  targets, each miss cost a medium access anyway).
+ *
+ * RAM layout: [sector buffer] [line data] [line state]
+ */
+
+#define BLOCK_SIZE 512
+
+typedef struct usbd_msc_cache_line cache_line;
+
+static inline usbd_msc_cache *cache_of(const usbd_msc_backend *backend)
+{
+	/* backend is the first member */
+	return (usbd_msc_cache *) backend;
+}
+
+static inline const usbd_msc_backend *medium(usbd_msc_cache *cache)
+{
+	return cache->config.backend;
+}
+
+static inline uint8_t *line_data(usbd_msc_cache *cache, cache_line *line)
+{
+	return cache->data + (line - cache->line) * BLOCK_SIZE;
+}
+
+static inline bool pinned(usbd_msc_cache *cache, cache_line *line)
+{
+	return line->lba < cache->config.pin_blocks;
+}
+
+static inline void touch(usbd_msc_cache *cache, cache_line *line)
+{
+	line->used = cache->clock++;
+}
+
+static cache_line *lookup(usbd_msc_cache *cache, uint32_t lba)
+{
+	uint32_t i;
+
+	for (i = 0; i < cache->lines; i++) {
+		if (cache->line[i].valid && cache->line[i].lba == lba) {
+			return &cache->line[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Find the line to replace: a free line, else the least recently used
+ *  (pinned blocks only if every line hold one)
+ * @param[in] cache Cache
+ * @return line
+ */
+static cache_line *victim(usbd_msc_cache *cache)
+{
+	cache_line *lru = NULL, *lru_pinned = NULL;
+	uint32_t age = 0, age_pinned = 0;
+	uint32_t i;
+
+	for (i = 0; i < cache->lines; i++) {
+		cache_line *line = &cache->line[i];
+		uint32_t line_age = cache->clock - line->used;
+
+		if (!line->valid) {
+			return line;
+		}
+
+		if (pinned(cache, line)) {
+			if (lru_pinned == NULL || line_age > age_pinned) {
+				lru_pinned = line;
+				age_pinned = line_age;
+			}
+		} else if (lru == NULL || line_age > age) {
+			lru = line;
+			age = line_age;
+		}
+	}
+
+	return (lru != NULL) ? lru : lru_pinned;
+}
+
+/**
+ * Write the dirty blocks of the erase sector of @a line to the medium
+ * @param[in] cache Cache
+ * @param[in] line Dirty line
+ * @return 0 on success
+ */
+static int sector_write(usbd_msc_cache *cache, cache_line *line)
+{
+	const usbd_msc_backend *backend = medium(cache);
+	uint32_t sector_blocks = cache->config.sector_blocks;
+	uint32_t start = line->lba - (line->lba % sector_blocks);
+	uint32_t end = MIN(start + sector_blocks, backend->block_count);
+	uint32_t first = end, last = start;
+	uint32_t lba, i;
+
+	for (i = 0; i < cache->lines; i++) {
+		cache_line *l = &cache->line[i];
+
+		if (l->valid && l->dirty && l->lba >= start && l->lba < end) {
+			first = MIN(first, l->lba);
+			last = MAX(last, l->lba);
+		}
+	}
+
+	cache->stats.sector_writes++;
+
+	if (cache->sector == NULL) {
+		/* Dirty blocks, in order */
+		for (lba = first; lba <= last; lba++) {
+			cache_line *l = lookup(cache, lba);
+
+			if (l == NULL || !l->dirty) {
+				continue;
+			}
+
+			if (backend->write_block(backend, lba, line_data(cache, l))) {
+				cache->stats.errors++;
+				return -1;
+			}
+
+			l->dirty = false;
+			cache->stats.blocks_written++;
+		}
+
+		return 0;
+	}
+
+	/* first to last dirty block at once, holes from cache or medium */
+	for (lba = first; lba <= last; lba++) {
+		cache_line *l = lookup(cache, lba);
+		uint8_t *buf = cache->sector + (lba - first) * BLOCK_SIZE;
+
+		if (l != NULL) {
+			memcpy(buf, line_data(cache, l), BLOCK_SIZE);
+		} else if (backend->read_block(backend, lba, buf)) {
+			cache->stats.errors++;
+			return -1;
+		}
+	}
+
+	if (backend->write_blocks(backend, first, last - first + 1,
+					cache->sector)) {
+		cache->stats.errors++;
+		return -1;
+	}
+
+	for (lba = first; lba <= last; lba++) {
+		cache_line *l = lookup(cache, lba);
+
+		if (l != NULL) {
+			l->dirty = false;
+		}
+	}
+
+	cache->stats.blocks_written += last - first + 1;
+	return 0;
+}
+
+/**
+ * Get a line for @a lba (not in cache), replacing a block if needed
+ * @param[in] cache Cache
+ * @param[in] lba Block
+ * @return line, NULL if the dirty block replaced could not be written
+ */
+static cache_line *allocate(usbd_msc_cache *cache, uint32_t lba)
+{
+	cache_line *line = victim(cache);
+
+	if (line->valid) {
+		if (line->dirty && sector_write(cache, line)) {
+			return NULL;
+		}
+
+		cache->stats.evictions++;
+	}
+
+	line->lba = lba;
+	line->valid = true;
+	line->dirty = false;
+	return line;
+}
+
+static int cache_read_block(const usbd_msc_backend *backend, uint32_t lba,
+				void *copy_to)
+{
+	usbd_msc_cache *cache = cache_of(backend);
+	cache_line *line = lookup(cache, lba);
+
+	if (line != NULL) {
+		cache->stats.read_hits++;
+	} else {
+		cache->stats.read_misses++;
+
+		line = allocate(cache, lba);
+		if (line == NULL) {
+			return -1;
+		}
+
+		if (medium(cache)->read_block(medium(cache), lba,
+						line_data(cache, line))) {
+			line->valid = false;
+			cache->stats.errors++;
+			return -1;
+		}
+	}
+
+	touch(cache, line);
+	memcpy(copy_to, line_data(cache, line), BLOCK_SIZE);
+	return 0;
+}
+
+static int cache_write_block(const usbd_msc_backend *backend, uint32_t lba,
+				const void *copy_from)
+{
+	usbd_msc_cache *cache = cache_of(backend);
+	cache_line *line = lookup(cache, lba);
+
+	if (line != NULL) {
+		cache->stats.write_hits++;
+	} else {
+		cache->stats.write_misses++;
+
+		line = allocate(cache, lba);
+		if (line == NULL) {
+			return -1;
+		}
+	}
+
+	touch(cache, line);
+	memcpy(line_data(cache, line), copy_from, BLOCK_SIZE);
+	line->dirty = true;
+	return 0;
+}
+
+static int cache_format_unit(const usbd_msc_backend *backend)
+{
+	usbd_msc_cache *cache = cache_of(backend);
+	uint32_t i;
+
+	/* Content is going away */
+	for (i = 0; i < cache->lines; i++) {
+		cache->line[i].valid = false;
+		cache->line[i].dirty = false;
+	}
+
+	return medium(cache)->format_unit(medium(cache));
+}
+
+static int cache_flush(const usbd_msc_backend *backend)
+{
+	return usbd_msc_cache_flush(cache_of(backend));
+}
+
+const usbd_msc_backend *usbd_msc_cache_init(usbd_msc_cache *cache,
+				const usbd_msc_cache_config *config)
+{
+	const usbd_msc_backend *backend = config->backend;
+	uint8_t *mem = config->buffer;
+	uint32_t size = config->size;
+	uint32_t sector_size;
+
+	cache->config = *config;
+	cache->config.sector_blocks = MAX(config->sector_blocks, 1);
+
+	cache->sector = NULL;
+	sector_size = cache->config.sector_blocks * BLOCK_SIZE;
+	if (backend->write_blocks != NULL && cache->config.sector_blocks > 1 &&
+			size >= sector_size) {
+		cache->sector = mem;
+		mem += sector_size;
+		size -= sector_size;
+	}
+
+	cache->lines = size / (BLOCK_SIZE + sizeof(cache_line));
+	if (!cache->lines) {
+		LOGF_LN("msc-cache: %"PRIu32" bytes too small for a line",
+			config->size);
+		return NULL;
+	}
+
+	cache->data = mem;
+	cache->line = (cache_line *) (mem + cache->lines * BLOCK_SIZE);
+	memset(cache->line, 0, cache->lines * sizeof(cache_line));
+	cache->clock = 0;
+	memset(&cache->stats, 0, sizeof(cache->stats));
+
+	memset(&cache->backend, 0, sizeof(cache->backend));
+	cache->backend.vendor_id = backend->vendor_id;
+	cache->backend.product_id = backend->product_id;
+	cache->backend.product_rev = backend->product_rev;
+	cache->backend.block_count = backend->block_count;
+	cache->backend.read_block = cache_read_block;
+	cache->backend.write_block = cache_write_block;
+	cache->backend.lock = backend->lock;
+	cache->backend.unlock = backend->unlock;
+	cache->backend.flush = cache_flush;
+
+	if (backend->format_unit != NULL) {
+		cache->backend.format_unit = cache_format_unit;
+	}
+
+	return &cache->backend;
+}
+
+int usbd_msc_cache_flush(usbd_msc_cache *cache)
+{
+	const usbd_msc_backend *backend = medium(cache);
+	uint32_t i;
+
+	cache->stats.flushes++;
+
+	for (i = 0; i < cache->lines; i++) {
+		cache_line *line = &cache->line[i];
+
+		if (line->valid && line->dirty && sector_write(cache, line)) {
+			return -1;
+		}
+	}
+
+	if (backend->flush != NULL) {
+		return backend->flush(backend);
+	}
+
+	return 0;
+}
+
+void usbd_msc_cache_get_stats(usbd_msc_cache *cache,
+				usbd_msc_cache_stats *stats)
+{
+	*stats = cache->stats;
+}
@@ -0,0 +1,887 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/ncm.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * TX NTB are used in turn (ring of USBD_NCM_TX_NTBS):
+ *   [head, head + urbs)            submitted, complete in order
+ *   [head + urbs, head + closed)   closed, wait for a free URB
+ *   head + closed                  open, filled by usbd_ncm_send()
+ *
+ * Layout of a NTB sent (offsets are known when a datagram is added,
+ *  the NDP size only when the NTB is closed):
+ *   NTH | pad | datagram 0 | pad | datagram 1 ... | pad | NDP
+ * Datagrams and NDP are aligned on 4 bytes (wNdpInDivisor, wNdpInAlignment).
+ *
+ * NTB and RX slots are shared with usbd_ncm_send() and usbd_ncm_poll()
+ *  (main loop or interrupt), so they are only touched with interrupts masked.
+ */
+
+/* Datagram and NDP alignment (both directions) */
+#define NTB_ALIGN 4
+
+/* NTB16 block length and pointers are 16 bits */
+#define NTB16_IN_SIZE_MAX (UINT16_MAX & ~(uint32_t) (NTB_ALIGN - 1))
+
+/* Notifications */
+#define NOTIFY_SPEED (1 << 0)
+#define NOTIFY_CONNECTION (1 << 1)
+
+/* Padding of the datagrams sent (only read by the backend) */
+static uint8_t pad_zero[NTB_ALIGN];
+
+static void tx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+static void rx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+static void notify_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static inline uint32_t align(uint32_t value)
+{
+	return (value + NTB_ALIGN - 1) & ~(uint32_t) (NTB_ALIGN - 1);
+}
+
+static inline uint8_t *rx_slot(usbd_ncm *ncm, uint32_t index)
+{
+	index &= ncm->config.rx_slots - 1;
+	return (uint8_t *) ncm->config.rx_buffer + (index * ncm->config.ntb_out_size);
+}
+
+static inline struct usbd_ncm_ntb *tx_ntb(usbd_ncm *ncm, unsigned offset)
+{
+	return &ncm->tx.ntb[(ncm->tx.head + offset) % USBD_NCM_TX_NTBS];
+}
+
+static inline uint32_t nth_size(usbd_ncm *ncm)
+{
+	return ncm->format == USB_CDC_NCM_NTB32_FORMAT ?
+		sizeof(struct usb_cdc_ncm_nth32) : sizeof(struct usb_cdc_ncm_nth16);
+}
+
+/**
+ * Largest NTB input size of the active format
+ * @param[in] ncm NCM
+ * @return size in bytes
+ */
+static inline uint32_t ntb_in_max(usbd_ncm *ncm)
+{
+	if (ncm->format == USB_CDC_NCM_NTB32_FORMAT) {
+		return ncm->config.ntb_in_size;
+	}
+
+	return MIN(ncm->config.ntb_in_size, NTB16_IN_SIZE_MAX);
+}
+
+/**
+ * Size of a NDP
+ * @param[in] ncm NCM
+ * @param[in] count Number of datagrams (terminator not included)
+ * @return size in bytes
+ */
+static inline uint32_t ndp_size(usbd_ncm *ncm, uint32_t count)
+{
+	if (ncm->format == USB_CDC_NCM_NTB32_FORMAT) {
+		return sizeof(struct usb_cdc_ncm_ndp32) + ((count + 1) * 8);
+	}
+
+	return sizeof(struct usb_cdc_ncm_ndp16) + ((count + 1) * 4);
+}
+
+/**
+ * Submit a transfer
+ * @param[in] ncm NCM
+ * @param[in] ep_type Endpoint type
+ * @param[in] ep_addr Endpoint address
+ * @param[in] ep_size Endpoint size
+ * @param[in] buf Buffer (or segments)
+ * @param[in] len Length
+ * @param[in] seg_count Number of segments (USBD_FLAG_SEGMENTED)
+ * @param[in] flags Transfer flags
+ * @param[in] callback Callback
+ */
+static void submit(usbd_ncm *ncm, usbd_ep_type ep_type, uint8_t ep_addr,
+			uint16_t ep_size, void *buf, size_t len, size_t seg_count,
+			usbd_transfer_flags flags, usbd_transfer_callback callback)
+{
+	const usbd_transfer transfer = {
+		.ep_type = ep_type,
+		.ep_addr = ep_addr,
+		.ep_size = ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.seg_count = seg_count,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback,
+		.user_data = ncm
+	};
+
+	usbd_transfer_submit(ncm->dev, &transfer);
+}
+
+/**
+ * Give back the datagrams of a NTB and make it empty
+ * @param[in] ncm NCM
+ * @param[in] ntb NTB
+ */
+static void tx_release(usbd_ncm *ncm, struct usbd_ncm_ntb *ntb)
+{
+	unsigned i;
+
+	for (i = 0; i < ntb->count; i++) {
+		if (ncm->config.tx_done != NULL) {
+			ncm->config.tx_done(ncm, ntb->cookie[i]);
+		}
+	}
+
+	ntb->count = 0;
+	ntb->len = 0;
+}
+
+/**
+ * Number of segments of a closed NTB:
+ *  NTH, (pad, datagram) for each datagram, pad, NDP
+ * @param[in] count Number of datagrams
+ * @return number of segments
+ */
+static inline size_t ntb_seg_count(uint32_t count)
+{
+	return 3 + (2 * count);
+}
+
+/**
+ * Close the open NTB: write NTH and NDP
+ * @param[in] ncm NCM
+ */
+static void tx_close(usbd_ncm *ncm)
+{
+	struct usbd_ncm_ntb *ntb = tx_ntb(ncm, ncm->tx.closed);
+	bool ntb32 = ncm->format == USB_CDC_NCM_NTB32_FORMAT;
+	uint32_t ndp_index = align(ntb->len);
+	uint32_t block_len = ndp_index + ndp_size(ncm, ntb->count);
+	uint32_t offset = 0;
+	unsigned i, seg = 0;
+
+	if (ntb32) {
+		struct usb_cdc_ncm_nth32 *nth = (void *) ntb->nth;
+		struct usb_cdc_ncm_ndp32 *ndp = (void *) ntb->ndp;
+		uint32_t *pointer = &ntb->ndp[sizeof(*ndp) / 4];
+
+		nth->dwSignature = USB_CDC_NCM_NTH32_SIGNATURE;
+		nth->wHeaderLength = sizeof(*nth);
+		nth->wSequence = ncm->tx.sequence++;
+		nth->dwBlockLength = block_len;
+		nth->dwNdpIndex = ndp_index;
+
+		ndp->dwSignature = USB_CDC_NCM_NDP32_NOCRC_SIGNATURE;
+		ndp->wLength = ndp_size(ncm, ntb->count);
+		ndp->wReserved6 = 0;
+		ndp->dwNextNdpIndex = 0;
+		ndp->dwReserved12 = 0;
+
+		for (i = 0; i < ntb->count; i++) {
+			/* Skip previous segment, pad */
+			offset += ntb->seg[seg].len + ntb->seg[seg + 1].len;
+			seg += 2;
+			*pointer++ = offset;
+			*pointer++ = ntb->seg[seg].len;
+		}
+		*pointer++ = 0;
+		*pointer = 0;
+	} else {
+		struct usb_cdc_ncm_nth16 *nth = (void *) ntb->nth;
+		struct usb_cdc_ncm_ndp16 *ndp = (void *) ntb->ndp;
+		uint16_t *pointer = (uint16_t *) &ntb->ndp[sizeof(*ndp) / 4];
+
+		nth->dwSignature = USB_CDC_NCM_NTH16_SIGNATURE;
+		nth->wHeaderLength = sizeof(*nth);
+		nth->wSequence = ncm->tx.sequence++;
+		nth->wBlockLength = block_len;
+		nth->wNdpIndex = ndp_index;
+
+		ndp->dwSignature = USB_CDC_NCM_NDP16_NOCRC_SIGNATURE;
+		ndp->wLength = ndp_size(ncm, ntb->count);
+		ndp->wNextNdpIndex = 0;
+
+		for (i = 0; i < ntb->count; i++) {
+			offset += ntb->seg[seg].len + ntb->seg[seg + 1].len;
+			seg += 2;
+			*pointer++ = offset;
+			*pointer++ = ntb->seg[seg].len;
+		}
+		*pointer++ = 0;
+		*pointer = 0;
+	}
+
+	/* Pad, NDP */
+	seg = 1 + (2 * ntb->count);
+	ntb->seg[seg].ptr = pad_zero;
+	ntb->seg[seg].len = ndp_index - ntb->len;
+	ntb->seg[seg + 1].ptr = ntb->ndp;
+	ntb->seg[seg + 1].len = ndp_size(ncm, ntb->count);
+	ntb->len = block_len;
+
+	ncm->tx.closed++;
+	ncm->tx.wait_us = 0;
+}
+
+/**
+ * Submit the closed NTB
+ * @param[in] ncm NCM
+ */
+static void tx_kick(usbd_ncm *ncm)
+{
+	while (ncm->running && ncm->tx.urbs < ncm->tx.closed) {
+		struct usbd_ncm_ntb *ntb = tx_ntb(ncm, ncm->tx.urbs);
+		usbd_transfer_flags flags = USBD_FLAG_SEGMENTED;
+
+		/* Short packet (or ZLP) end a NTB smaller than dwNtbInMaxSize */
+		if (ntb->len < ncm->ntb_in_size) {
+			flags |= USBD_FLAG_SHORT_PACKET;
+		}
+
+		ncm->tx.urbs++;
+		submit(ncm, USBD_EP_BULK, ncm->config.ep_in, ncm->config.ep_size,
+			ntb->seg, ntb->len, ntb_seg_count(ntb->count), flags,
+			tx_callback);
+	}
+}
+
+/**
+ * Parse a received NTB (from the datagram where the last parse stopped)
+ * @param[in] ncm NCM
+ * @param[in] buf NTB
+ * @param[in] len Bytes received
+ * @return false if the rx callback refused a datagram
+ */
+static bool rx_parse(usbd_ncm *ncm, const uint8_t *buf, uint32_t len)
+{
+	bool ntb32 = ncm->format == USB_CDC_NCM_NTB32_FORMAT;
+	uint32_t hdr = ntb32 ? sizeof(struct usb_cdc_ncm_ndp32) :
+				sizeof(struct usb_cdc_ncm_ndp16);
+	uint32_t entry_size = ntb32 ? 8 : 4;
+	uint32_t block_len, ndps = 0;
+
+	if (ntb32) {
+		const struct usb_cdc_ncm_nth32 *nth = (const void *) buf;
+
+		if (len < sizeof(*nth) ||
+				nth->dwSignature != USB_CDC_NCM_NTH32_SIGNATURE ||
+				nth->wHeaderLength != sizeof(*nth) ||
+				nth->dwBlockLength > len) {
+			goto invalid;
+		}
+
+		block_len = nth->dwBlockLength ? nth->dwBlockLength : len;
+		if (!ncm->rx.ndp) {
+			ncm->rx.ndp = nth->dwNdpIndex;
+		}
+	} else {
+		const struct usb_cdc_ncm_nth16 *nth = (const void *) buf;
+
+		if (len < sizeof(*nth) ||
+				nth->dwSignature != USB_CDC_NCM_NTH16_SIGNATURE ||
+				nth->wHeaderLength != sizeof(*nth) ||
+				nth->wBlockLength > len) {
+			goto invalid;
+		}
+
+		block_len = nth->wBlockLength ? nth->wBlockLength : len;
+		if (!ncm->rx.ndp) {
+			ncm->rx.ndp = nth->wNdpIndex;
+		}
+	}
+
+	/* NDP chain, bounded (a NDP take atleast hdr bytes) */
+	while (ncm->rx.ndp) {
+		uint32_t ndp = ncm->rx.ndp;
+		const struct usb_cdc_ncm_ndp16 *ndp16 = (const void *) (buf + ndp);
+		const struct usb_cdc_ncm_ndp32 *ndp32 = (const void *) (buf + ndp);
+		const uint8_t *pointers = buf + ndp + hdr;
+		uint32_t count, next;
+
+		if ((ndp % NTB_ALIGN) || ndp < nth_size(ncm) ||
+				ndp + hdr > block_len || ++ndps > block_len / hdr) {
+			goto invalid;
+		}
+
+		/* Same layout upto wLength */
+		if (ndp16->dwSignature != (ntb32 ? USB_CDC_NCM_NDP32_NOCRC_SIGNATURE :
+					USB_CDC_NCM_NDP16_NOCRC_SIGNATURE) ||
+				ndp16->wLength < hdr + entry_size ||
+				ndp + ndp16->wLength > block_len) {
+			goto invalid;
+		}
+
+		count = (ndp16->wLength - hdr) / entry_size;
+		next = ntb32 ? ndp32->dwNextNdpIndex : ndp16->wNextNdpIndex;
+
+		for (; ncm->rx.entry < count; ncm->rx.entry++) {
+			uint32_t index, size;
+
+			if (ntb32) {
+				const uint32_t *p = (const uint32_t *) pointers;
+				index = p[ncm->rx.entry * 2];
+				size = p[(ncm->rx.entry * 2) + 1];
+			} else {
+				const uint16_t *p = (const uint16_t *) pointers;
+				index = p[ncm->rx.entry * 2];
+				size = p[(ncm->rx.entry * 2) + 1];
+			}
+
+			/* Null index or length end the table */
+			if (!index || !size) {
+				break;
+			}
+
+			if (index > block_len || size > block_len - index) {
+				goto invalid;
+			}
+
+			if (!ncm->config.rx(ncm, buf + index, size)) {
+				if (!ncm->rx.waiting) {
+					ncm->stats.rx_waits++;
+					ncm->rx.waiting = true;
+				}
+				return false;
+			}
+
+			ncm->rx.waiting = false;
+			ncm->stats.rx_datagrams++;
+		}
+
+		ncm->rx.ndp = next;
+		ncm->rx.entry = 0;
+	}
+
+	return true;
+
+	invalid:
+	LOGF_LN("ncm: invalid NTB (ndp=%"PRIu32", entry=%"PRIu32")",
+		ncm->rx.ndp, ncm->rx.entry);
+	ncm->stats.rx_invalid++;
+	ncm->rx.ndp = 0;
+	ncm->rx.entry = 0;
+	return true;
+}
+
+/**
+ * Parse the received NTB, in order
+ * @param[in] ncm NCM
+ */
+static void rx_process(usbd_ncm *ncm)
+{
+	while (ncm->rx.tail != ncm->rx.head) {
+		uint32_t tail = ncm->rx.tail;
+
+		if (!rx_parse(ncm, rx_slot(ncm, tail),
+				ncm->rx.len[tail & (ncm->config.rx_slots - 1)])) {
+			return;
+		}
+
+		ncm->rx.ndp = 0;
+		ncm->rx.entry = 0;
+		ncm->rx.tail = tail + 1;
+	}
+}
+
+/**
+ * Arm the free RX slots
+ * @param[in] ncm NCM
+ */
+static void rx_kick(usbd_ncm *ncm)
+{
+	while (ncm->running &&
+			ncm->rx.armed - ncm->rx.tail < ncm->config.rx_slots) {
+		uint32_t armed = ncm->rx.armed;
+
+		/* Short packet end the NTB. */
+		ncm->rx.armed = armed + 1;
+		submit(ncm, USBD_EP_BULK, ncm->config.ep_out, ncm->config.ep_size,
+			rx_slot(ncm, armed), ncm->config.ntb_out_size, 0,
+			USBD_FLAG_SHORT_PACKET, rx_callback);
+	}
+}
+
+/**
+ * Send the next pending notification
+ * @param[in] ncm NCM
+ */
+static void notify_kick(usbd_ncm *ncm)
+{
+	struct usb_cdc_notification *notif = (void *) ncm->notify.buf;
+	size_t len = sizeof(*notif);
+
+	if (!ncm->running || ncm->notify.busy || !ncm->notify.pending ||
+			!ncm->config.ep_notify) {
+		return;
+	}
+
+	notif->bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS |
+				USB_REQ_TYPE_INTERFACE;
+	notif->wIndex = ncm->config.interface;
+
+	/* Speed first: host bring the link up with the right speed */
+	if (ncm->notify.pending & NOTIFY_SPEED) {
+		struct usb_cdc_connection_speed *speed = (void *) (notif + 1);
+
+		ncm->notify.pending &= ~NOTIFY_SPEED;
+		notif->bNotification = USB_CDC_NOTIFY_CONNECTION_SPEED_CHANGE;
+		notif->wValue = 0;
+		notif->wLength = sizeof(*speed);
+		speed->DLBitRate = ncm->notify.bitrate;
+		speed->ULBitRate = ncm->notify.bitrate;
+		len += sizeof(*speed);
+	} else {
+		ncm->notify.pending &= ~NOTIFY_CONNECTION;
+		notif->bNotification = USB_CDC_NOTIFY_NETWORK_CONNECTION;
+		notif->wValue = ncm->notify.connected;
+		notif->wLength = 0;
+	}
+
+	ncm->notify.busy = true;
+	submit(ncm, USBD_EP_INTERRUPT, ncm->config.ep_notify,
+		sizeof(ncm->notify.buf), ncm->notify.buf, len, 0, USBD_FLAG_NONE,
+		notify_callback);
+}
+
+/**
+ * Stop the transfers, give back the datagrams not sent
+ * @param[in] ncm NCM
+ */
+static void halt(usbd_ncm *ncm)
+{
+	unsigned i;
+
+	ncm->running = false;
+
+	for (i = 0; i < USBD_NCM_TX_NTBS; i++) {
+		tx_release(ncm, &ncm->tx.ntb[i]);
+	}
+
+	ncm->tx.head = 0;
+	ncm->tx.closed = 0;
+	ncm->tx.urbs = 0;
+	ncm->tx.wait_us = 0;
+
+	/* Data received is dropped (format can change before restart) */
+	ncm->rx.head = ncm->rx.tail = ncm->rx.armed = 0;
+	ncm->rx.ndp = 0;
+	ncm->rx.entry = 0;
+	ncm->rx.waiting = false;
+
+	ncm->notify.busy = false;
+}
+
+/**
+ * Account transfer completion
+ * @param[in] ncm NCM
+ * @param[in] status Status
+ * @return false if the transfer should be ignored (stopped)
+ */
+static bool complete(usbd_ncm *ncm, usbd_transfer_status status)
+{
+	if (!ncm->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("ncm", status)) {
+	case USBD_CLASS_SUCCESS:
+	return true;
+	case USBD_CLASS_STOP:
+		halt(ncm);
+	return false;
+	default:
+		ncm->stats.errors++;
+	return true;
+	}
+}
+
+static void tx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_ncm *ncm = transfer->user_data;
+	struct usbd_ncm_ntb *ntb;
+
+	(void) dev;
+	(void) urb_id;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!complete(ncm, status)) {
+		return;
+	}
+
+	/* URB complete in order: sent (or dropped on error) */
+	ntb = tx_ntb(ncm, 0);
+	if (status == USBD_SUCCESS) {
+		ncm->stats.tx_ntbs++;
+		ncm->stats.tx_datagrams += ntb->count;
+	}
+
+	tx_release(ncm, ntb);
+	ncm->tx.head = (ncm->tx.head + 1) % USBD_NCM_TX_NTBS;
+	ncm->tx.closed--;
+	ncm->tx.urbs--;
+
+	tx_kick(ncm);
+}
+
+static void rx_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_ncm *ncm = transfer->user_data;
+	uint32_t head;
+
+	(void) dev;
+	(void) urb_id;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!complete(ncm, status)) {
+		return;
+	}
+
+	head = ncm->rx.head;
+	ncm->rx.len[head & (ncm->config.rx_slots - 1)] =
+		status == USBD_SUCCESS ? transfer->transferred : 0;
+	ncm->rx.head = head + 1;
+	ncm->stats.rx_ntbs++;
+
+	rx_process(ncm);
+	rx_kick(ncm);
+}
+
+static void notify_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_ncm *ncm = transfer->user_data;
+
+	(void) dev;
+	(void) urb_id;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!complete(ncm, status)) {
+		return;
+	}
+
+	ncm->notify.busy = false;
+	notify_kick(ncm);
+}
+
+/**
+ * Reset the NTB format and input size (NCM 1.0, 7.2)
+ * @param[in] ncm NCM
+ */
+static void reset_ntb(usbd_ncm *ncm)
+{
+	ncm->format = USB_CDC_NCM_NTB16_FORMAT;
+	ncm->ntb_in_size = ntb_in_max(ncm);
+}
+
+void usbd_ncm_init(usbd_ncm *ncm, usbd_device *dev,
+				const usbd_ncm_config *config)
+{
+	memset(ncm, 0, sizeof(*ncm));
+	ncm->dev = dev;
+	ncm->config = *config;
+
+	if (ncm->config.rx_slots > USBD_NCM_RX_SLOTS_MAX) {
+		LOGF_LN("ncm: %"PRIu8" RX slots limited to %u",
+			config->rx_slots, USBD_NCM_RX_SLOTS_MAX);
+		ncm->config.rx_slots = USBD_NCM_RX_SLOTS_MAX;
+	}
+
+	if (!ncm->config.ntb32 && ncm->config.ntb_in_size > NTB16_IN_SIZE_MAX) {
+		ncm->config.ntb_in_size = NTB16_IN_SIZE_MAX;
+	}
+
+	reset_ntb(ncm);
+}
+
+static usbd_control_transfer_feedback ntb_input_size_callback(
+		usbd_device *dev, const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_ncm *ncm;
+	uint32_t size;
+
+	(void) dev;
+
+	/* Data stage was received in usbd_ncm::control */
+	ncm = (usbd_ncm *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_ncm, control));
+	size = ncm->control.ntb_in_size;
+
+	if (arg->length < 4 || size < USBD_NCM_NTB_IN_SIZE_MIN ||
+			size > ntb_in_max(ncm)) {
+		return USBD_CONTROL_TRANSFER_STALL;
+	}
+
+	USBD_ATOMIC_CONTEXT();
+
+	/* Applied to the next NTB (open NTB already fit) */
+	ncm->ntb_in_size = size;
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+/**
+ * Answer GET_NTB_PARAMETERS
+ * @param[in] ncm NCM
+ * @param[in] setup_data Setup data
+ */
+static void get_ntb_parameters(usbd_ncm *ncm,
+				const struct usb_setup_data *setup_data)
+{
+	struct usb_cdc_ncm_ntb_parameters *params = &ncm->control.params;
+
+	memset(params, 0, sizeof(*params));
+	params->wLength = sizeof(*params);
+	params->bmNtbFormatsSupported = USB_CDC_NCM_NTB16_SUPPORTED |
+		(ncm->config.ntb32 ? USB_CDC_NCM_NTB32_SUPPORTED : 0);
+	params->dwNtbInMaxSize = ncm->config.ntb_in_size;
+	params->wNdpInDivisor = NTB_ALIGN;
+	params->wNdpInPayloadRemainder = 0;
+	params->wNdpInAlignment = NTB_ALIGN;
+	params->dwNtbOutMaxSize = ncm->config.ntb_out_size;
+	params->wNdpOutDivisor = NTB_ALIGN;
+	params->wNdpOutPayloadRemainder = 0;
+	params->wNdpOutAlignment = NTB_ALIGN;
+	params->wNtbOutMaxDatagrams = 0;
+
+	usbd_ep0_transfer(ncm->dev, setup_data, params,
+		MIN(sizeof(*params), setup_data->wLength), NULL);
+}
+
+bool usbd_ncm_setup_ep0(usbd_ncm *ncm,
+				const struct usb_setup_data *setup_data)
+{
+	usbd_device *dev = ncm->dev;
+
+	const uint8_t mask = USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT;
+	const uint8_t value = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
+
+	if ((setup_data->bmRequestType & mask) != value ||
+			setup_data->wIndex != ncm->config.interface) {
+		return false;
+	}
+
+	switch (setup_data->bRequest) {
+	case USB_CDC_REQ_GET_NTB_PARAMETERS:
+		get_ntb_parameters(ncm, setup_data);
+	return true;
+	case USB_CDC_REQ_GET_NTB_FORMAT:
+		ncm->control.value = ncm->format;
+		usbd_ep0_transfer(dev, setup_data, &ncm->control.value,
+			MIN(2, setup_data->wLength), NULL);
+	return true;
+	case USB_CDC_REQ_SET_NTB_FORMAT:
+		/* Only while the data interface is in alternate setting 0 */
+		if (ncm->running || setup_data->wValue > USB_CDC_NCM_NTB32_FORMAT ||
+				(setup_data->wValue == USB_CDC_NCM_NTB32_FORMAT &&
+				!ncm->config.ntb32)) {
+			usbd_ep0_stall(dev);
+			return true;
+		}
+		ncm->format = setup_data->wValue;
+		ncm->ntb_in_size = MIN(ncm->ntb_in_size, ntb_in_max(ncm));
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	case USB_CDC_REQ_GET_NTB_INPUT_SIZE:
+		ncm->control.ntb_in_size = ncm->ntb_in_size;
+		usbd_ep0_transfer(dev, setup_data, &ncm->control.ntb_in_size,
+			MIN(4, setup_data->wLength), NULL);
+	return true;
+	case USB_CDC_REQ_SET_NTB_INPUT_SIZE:
+		/* dwNtbInMaxSize only (wNtbInMaxDatagrams not supported) */
+		if (setup_data->wLength != 4) {
+			usbd_ep0_stall(dev);
+			return true;
+		}
+		usbd_ep0_transfer(dev, setup_data, &ncm->control.ntb_in_size, 4,
+			ntb_input_size_callback);
+	return true;
+	case USB_CDC_REQ_GET_MAX_DATAGRAM_SIZE:
+		ncm->control.value = ncm->config.max_datagram;
+		usbd_ep0_transfer(dev, setup_data, &ncm->control.value,
+			MIN(2, setup_data->wLength), NULL);
+	return true;
+	case USB_CDC_REQ_SET_ETHERNET_PACKET_FILTER:
+		ncm->packet_filter = setup_data->wValue;
+		usbd_ep0_transfer(dev, setup_data, NULL, 0, NULL);
+	return true;
+	}
+
+	return false;
+}
+
+/**
+ * Stop the transfers and cancel the URB in flight
+ * @param[in] ncm NCM
+ */
+static void cancel(usbd_ncm *ncm)
+{
+	if (!ncm->running) {
+		return;
+	}
+
+	halt(ncm);
+
+	usbd_transfer_cancel_ep(ncm->dev, ncm->config.ep_in);
+	usbd_transfer_cancel_ep(ncm->dev, ncm->config.ep_out);
+	if (ncm->config.ep_notify) {
+		usbd_transfer_cancel_ep(ncm->dev, ncm->config.ep_notify);
+	}
+}
+
+void usbd_ncm_start(usbd_ncm *ncm)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	cancel(ncm);
+	ncm->running = true;
+	ncm->notify.pending = NOTIFY_SPEED | NOTIFY_CONNECTION;
+
+	rx_kick(ncm);
+	notify_kick(ncm);
+}
+
+void usbd_ncm_stop(usbd_ncm *ncm)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	cancel(ncm);
+	reset_ntb(ncm);
+}
+
+void usbd_ncm_set_link(usbd_ncm *ncm, bool connected, uint32_t bitrate)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	if (bitrate != ncm->notify.bitrate) {
+		ncm->notify.pending |= NOTIFY_SPEED;
+	}
+
+	if (connected != ncm->notify.connected) {
+		ncm->notify.pending |= NOTIFY_CONNECTION;
+	}
+
+	ncm->notify.connected = connected;
+	ncm->notify.bitrate = bitrate;
+	notify_kick(ncm);
+}
+
+bool usbd_ncm_send(usbd_ncm *ncm, const void *datagram, size_t len,
+				void *cookie)
+{
+	struct usbd_ncm_ntb *ntb;
+	uint32_t offset;
+	unsigned seg;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!ncm->running || !len || len > ncm->config.max_datagram) {
+		ncm->stats.tx_dropped++;
+		return false;
+	}
+
+	for (;;) {
+		if (ncm->tx.closed == USBD_NCM_TX_NTBS) {
+			/* All NTB on the bus */
+			ncm->stats.tx_dropped++;
+			return false;
+		}
+
+		ntb = tx_ntb(ncm, ncm->tx.closed);
+		if (!ntb->count) {
+			ntb->seg[0].ptr = ntb->nth;
+			ntb->seg[0].len = nth_size(ncm);
+			ntb->len = ntb->seg[0].len;
+		}
+
+		offset = align(ntb->len);
+		if (align(offset + len) + ndp_size(ncm, ntb->count + 1) <=
+				ncm->ntb_in_size) {
+			break;
+		}
+
+		if (!ntb->count) {
+			/* Never fit */
+			ncm->stats.tx_dropped++;
+			return false;
+		}
+
+		/* Send this one, continue in the next */
+		tx_close(ncm);
+		tx_kick(ncm);
+	}
+
+	seg = 1 + (2 * ntb->count);
+	ntb->seg[seg].ptr = pad_zero;
+	ntb->seg[seg].len = offset - ntb->len;
+	ntb->seg[seg + 1].ptr = (void *) datagram;
+	ntb->seg[seg + 1].len = len;
+	ntb->cookie[ntb->count++] = cookie;
+	ntb->len = offset + len;
+
+	if (ntb->count == USBD_NCM_TX_DATAGRAMS) {
+		tx_close(ncm);
+		tx_kick(ncm);
+	}
+
+	return true;
+}
+
+void usbd_ncm_poll(usbd_ncm *ncm, uint32_t us)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	if (!ncm->running) {
+		return;
+	}
+
+	if (ncm->rx.waiting) {
+		rx_process(ncm);
+		rx_kick(ncm);
+	}
+
+	/* Timer run while the open NTB hold datagrams */
+	if (ncm->tx.closed < USBD_NCM_TX_NTBS &&
+			tx_ntb(ncm, ncm->tx.closed)->count) {
+		ncm->tx.wait_us += us;
+		if (ncm->tx.wait_us >= ncm->config.timeout_us) {
+			ncm->stats.tx_timeouts++;
+			tx_close(ncm);
+		}
+	}
+
+	tx_kick(ncm);
+}
+
+void usbd_ncm_get_stats(usbd_ncm *ncm, usbd_ncm_stats *stats)
+{
+	*stats = ncm->stats;
+}
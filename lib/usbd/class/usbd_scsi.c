@@ -0,0 +1,447 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * Copyright (C) 2013 Weston Schmidt <weston_schmidt@alumni.purdue.edu>
+ * Copyright (C) 2013 Pavol Rusnak <stick@gk2.sk>
+ * Copyright (C) 2016 Kuldeep Singh Dhaka <kuldeepdhaka9@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/msc.h>
+#include "../usbd_private.h"
+#include "usbd_scsi.h"
+
+#define BLOCK_SIZE 512
+
+/*-- SCSI Base Responses -----------------------------------------------------*/
+
+static const uint8_t _spc3_inquiry_response[36] = {
+	0x00,	/* Byte 0: Peripheral Qualifier = 0, Peripheral Device Type = 0 */
+	0x80,	/* Byte 1: RMB = 1, Reserved = 0 */
+	0x04,	/* Byte 2: Version = 0 */
+	0x02,	/* Byte 3: Obsolete = 0, NormACA = 0, HiSup = 0, Response Data Format = 2 */
+	0x20,	/* Byte 4: Additional Length (n-4) = 31 + 4 */
+	0x00,	/* Byte 5: SCCS = 0, ACC = 0, TPGS = 0, 3PC = 0, Reserved = 0, Protect = 0 */
+	0x00,	/* Byte 6: BQue = 0, EncServ = 0, VS = 0, MultiP = 0, MChngr = 0, Obsolete = 0, Addr16 = 0 */
+	0x00,	/* Byte 7: Obsolete = 0, Wbus16 = 0, Sync = 0, Linked = 0, CmdQue = 0, VS = 0 */
+		/* Byte 8 - Byte 15: Vendor Identification */
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+		/* Byte 16 - Byte 31: Product Identification */
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+	0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+		/* Byte 32 - Byte 35: Product Revision Level */
+	0x20, 0x20, 0x20, 0x20
+};
+
+static const uint8_t _spc3_request_sense[18] = {
+	0x70,	/* Byte 0: VALID = 0, Response Code = 112 */
+	0x00,	/* Byte 1: Obsolete = 0 */
+	0x00,	/* Byte 2: Filemark = 0, EOM = 0, ILI = 0, Reserved = 0, Sense Key = 0 */
+		/* Byte 3 - Byte 6: Information = 0 */
+	0, 0, 0, 0,
+	0x0a,	/* Byte 7: Additional Sense Length = 10 */
+		/* Byte 8 - Byte 11: Command Specific Info = 0 */
+	0, 0, 0, 0,
+	0x00,	/* Byte 12: Additional Sense Code (ASC) = 0 */
+	0x00,	/* Byte 13: Additional Sense Code Qualifier (ASCQ) = 0 */
+	0x00,	/* Byte 14: Field Replaceable Unit Code (FRUC) = 0 */
+	0x00,	/* Byte 15: SKSV = 0, SenseKeySpecific[0] = 0 */
+	0x00,	/* Byte 16: SenseKeySpecific[0] = 0 */
+	0x00	/* Byte 17: SenseKeySpecific[0] = 0 */
+};
+
+/*-- SCSI Layer --------------------------------------------------------------*/
+
+void usbd_scsi_set_sense(struct usbd_msc_lun *lun,
+				enum sbc_sense_key key,
+				enum sbc_asc asc,
+				enum sbc_ascq ascq)
+{
+	lun->sense.key = (uint8_t) key;
+	lun->sense.asc = (uint8_t) asc;
+	lun->sense.ascq = (uint8_t) ascq;
+}
+
+static void set_sbc_status_good(struct usbd_msc_lun *lun)
+{
+	usbd_scsi_set_sense(lun,
+				SBC_SENSE_KEY_NO_SENSE,
+				SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION,
+				SBC_ASCQ_NA);
+}
+
+static void scsi_read_6(struct usbd_msc_lun *lun,
+			struct usb_msc_trans *trans,
+			enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+
+		trans->lba_start = (buf[2] << 8) | buf[3];
+		trans->block_count = buf[4];
+		trans->current_block = 0;
+
+		/* TODO: Check the lba & block_count for range. */
+
+		/* both are in terms of 512 byte blocks, so shift by 9 */
+		trans->bytes_to_send = trans->block_count << 9;
+
+		set_sbc_status_good(lun);
+	}
+}
+
+static void scsi_write_6(struct usbd_msc_lun *lun,
+			 struct usb_msc_trans *trans,
+			 enum trans_event event)
+{
+	(void) lun;
+
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+
+		trans->lba_start = ((0x1f & buf[1]) << 16) | (buf[2] << 8) | buf[3];
+		trans->block_count = buf[4];
+		trans->current_block = 0;
+
+		trans->bytes_to_recv = trans->block_count << 9;
+	}
+}
+
+static void scsi_write_10(struct usbd_msc_lun *lun,
+			  struct usb_msc_trans *trans,
+			  enum trans_event event)
+{
+	(void) lun;
+
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+
+		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) |
+					(buf[4] << 8) | buf[5];
+		trans->block_count = (buf[7] << 8) | buf[8];
+		trans->current_block = 0;
+
+		trans->bytes_to_recv = trans->block_count << 9;
+	}
+}
+
+static void scsi_read_10(struct usbd_msc_lun *lun,
+			 struct usb_msc_trans *trans,
+			 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+
+		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) | (buf[4] << 8) | buf[5];
+		trans->block_count = (buf[7] << 8) | buf[8];
+
+		/* TODO: Check the lba & block_count for range. */
+
+		/* both are in terms of 512 byte blocks, so shift by 9 */
+		trans->bytes_to_send = trans->block_count << 9;
+
+		set_sbc_status_good(lun);
+	}
+}
+
+static void scsi_read_capacity(struct usbd_msc_lun *lun,
+					struct usb_msc_trans *trans,
+					enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint32_t last_logical_addr = lun->backend->block_count - 1;
+		trans->msd_buf[0] = last_logical_addr >> 24;
+		trans->msd_buf[1] = 0xff & (last_logical_addr >> 16);
+		trans->msd_buf[2] = 0xff & (last_logical_addr >> 8);
+		trans->msd_buf[3] = 0xff & last_logical_addr;
+
+		/* Block size: 512 */
+		trans->msd_buf[4] = 0;
+		trans->msd_buf[5] = 0;
+		trans->msd_buf[6] = 2;
+		trans->msd_buf[7] = 0;
+		trans->bytes_to_send = 8;
+		set_sbc_status_good(lun);
+	}
+}
+
+static void fallback_format_unit(struct usbd_msc_lun *lun,
+					struct usb_msc_trans *trans)
+{
+	uint32_t i;
+
+	memset(trans->msd_buf, 0, sizeof(trans->msd_buf));
+
+	for (i = 0; i < lun->backend->block_count; i++) {
+		if (lun->backend->write_block(lun->backend, i, trans->msd_buf) != 0) {
+			/* Error */
+		}
+	}
+}
+
+static void scsi_format_unit(struct usbd_msc_lun *lun,
+					struct usb_msc_trans *trans,
+					enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		if (lun->backend->format_unit != NULL) {
+			if (lun->backend->format_unit(lun->backend) != 0) {
+				/* Error */
+			}
+		} else {
+			fallback_format_unit(lun, trans);
+		}
+
+		set_sbc_status_good(lun);
+	}
+}
+
+static void scsi_request_sense(struct usbd_msc_lun *lun,
+					struct usb_msc_trans *trans,
+					enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+
+		trans->bytes_to_send = buf[4];	/* allocation length */
+		memcpy(trans->msd_buf, _spc3_request_sense,
+			sizeof(_spc3_request_sense));
+
+		trans->msd_buf[2] = lun->sense.key;
+		trans->msd_buf[12] = lun->sense.asc;
+		trans->msd_buf[13] = lun->sense.ascq;
+	}
+}
+
+static void scsi_mode_sense_6(struct usbd_msc_lun *lun,
+					struct usb_msc_trans *trans,
+					enum trans_event event)
+{
+	(void) lun;
+
+	if (EVENT_CBW_VALID == event) {
+#if 0
+		uint8_t *buf = trans->cbw.CBWCB;
+		uint8_t page_code = buf[2];
+		uint8_t allocation_length = buf[4];
+
+		if (0x1C == page_code) {	/* Informational Exceptions */
+#endif
+			trans->bytes_to_send = 4;
+
+			trans->msd_buf[0] = 3;	/* Num bytes that follow */
+			trans->msd_buf[1] = 0;	/* Medium Type */
+			trans->msd_buf[2] = 0;	/* Device specific param */
+			trans->csw.dCSWDataResidue = 4;
+#if 0
+		} else if (0x01 == page_code) {	/* Error recovery */
+		} else if (0x3F == page_code) {	/* All */
+		} else {
+			/* Error */
+			trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
+			usbd_scsi_set_sense(lun,
+						SBC_SENSE_KEY_ILLEGAL_REQUEST,
+						SBC_ASC_INVALID_FIELD_IN_CDB,
+						SBC_ASCQ_NA);
+		}
+#endif
+	}
+}
+
+static void scsi_inquiry(struct usbd_msc_lun *lun,
+			 struct usb_msc_trans *trans,
+			 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+		uint8_t evpd = 1 & buf[1];
+
+		if (0 == evpd) {
+			size_t len;
+			trans->bytes_to_send = sizeof(_spc3_inquiry_response);
+			memcpy(trans->msd_buf, _spc3_inquiry_response, sizeof(_spc3_inquiry_response));
+
+			len = strlen(lun->backend->vendor_id);
+			len = MIN(len, 8);
+			memcpy(&trans->msd_buf[8], lun->backend->vendor_id, len);
+
+			len = strlen(lun->backend->product_id);
+			len = MIN(len, 16);
+			memcpy(&trans->msd_buf[16], lun->backend->product_id, len);
+
+			len = strlen(lun->backend->product_rev);
+			len = MIN(len, 4);
+			memcpy(&trans->msd_buf[32], lun->backend->product_rev, len);
+
+			trans->csw.dCSWDataResidue = sizeof(_spc3_inquiry_response);
+
+			set_sbc_status_good(lun);
+		} else {
+			/* TODO: Add VPD 0x83 support */
+			/* TODO: Add VPD 0x00 support */
+		}
+	}
+}
+
+void usbd_scsi_media_access(struct usbd_msc_lun *lun, bool write,
+			uint32_t lba, uint32_t count, uint8_t *buf,
+			usbd_msc_backend_callback callback, void *ctx)
+{
+	const usbd_msc_backend *backend = lun->backend;
+	int result = 0;
+	uint32_t i;
+
+	if (write) {
+		if (backend->write_start != NULL &&
+				!backend->write_start(backend, lba, count, buf,
+						callback, ctx)) {
+			return;
+		}
+
+		if (backend->write_blocks != NULL) {
+			result = backend->write_blocks(backend, lba, count, buf);
+		} else {
+			for (i = 0; i < count && !result; i++) {
+				result = backend->write_block(backend, lba + i,
+							buf + i * BLOCK_SIZE);
+			}
+		}
+	} else {
+		if (backend->read_start != NULL &&
+				!backend->read_start(backend, lba, count, buf,
+						callback, ctx)) {
+			return;
+		}
+
+		for (i = 0; i < count && !result; i++) {
+			result = backend->read_block(backend, lba + i,
+						buf + i * BLOCK_SIZE);
+		}
+	}
+
+	callback(ctx, result);
+}
+
+int usbd_scsi_flush(struct usbd_msc_lun *lun)
+{
+	if (lun->backend->flush == NULL) {
+		return 0;
+	}
+
+	return lun->backend->flush(lun->backend);
+}
+
+static void scsi_flush(struct usbd_msc_lun *lun,
+			struct usb_msc_trans *trans,
+			enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		if (usbd_scsi_flush(lun) != 0) {
+			usbd_scsi_set_sense(lun, SBC_SENSE_KEY_MEDIUM_ERROR,
+						SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+						SBC_ASCQ_NA);
+			trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
+			return;
+		}
+
+		set_sbc_status_good(lun);
+	}
+}
+
+static void scsi_start_stop_unit(struct usbd_msc_lun *lun,
+			struct usb_msc_trans *trans,
+			enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf = trans->cbw.CBWCB;
+
+		/* START = 0: stop (or eject) */
+		if (!(buf[4] & 0x01)) {
+			scsi_flush(lun, trans, event);
+			return;
+		}
+
+		set_sbc_status_good(lun);
+	}
+}
+
+void usbd_scsi_command(struct usbd_msc_lun *lun,
+			struct usb_msc_trans *trans,
+			enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		/* Setup the default success */
+		trans->csw.dCSWSignature = USB_MSC_CSW_SIGNATURE;
+		trans->csw.dCSWTag = trans->cbw.dCBWTag;
+		trans->csw.dCSWDataResidue = 0;
+		trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_SUCCESS;
+
+		trans->bytes_to_send = 0;
+		trans->bytes_to_recv = 0;
+		trans->byte_count = 0;
+	}
+
+	switch (trans->cbw.CBWCB[0]) {
+	case USB_MSC_SCSI_TEST_UNIT_READY:
+	case USB_MSC_SCSI_SEND_DIAGNOSTIC:
+		/* Do nothing, just send the success. */
+		set_sbc_status_good(lun);
+		break;
+	case USB_MSC_SCSI_FORMAT_UNIT:
+		scsi_format_unit(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_REQUEST_SENSE:
+		scsi_request_sense(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_MODE_SENSE_6:
+		scsi_mode_sense_6(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_READ_6:
+		scsi_read_6(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_INQUIRY:
+		scsi_inquiry(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_READ_CAPACITY:
+		scsi_read_capacity(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_READ_10:
+		scsi_read_10(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_WRITE_6:
+		scsi_write_6(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_WRITE_10:
+		scsi_write_10(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_SYNCHRONIZE_CACHE:
+		scsi_flush(lun, trans, event);
+		break;
+	case USB_MSC_SCSI_START_STOP_UNIT:
+		scsi_start_stop_unit(lun, trans, event);
+		break;
+	default:
+		usbd_scsi_set_sense(lun, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+					SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
+					SBC_ASCQ_NA);
+
+		trans->bytes_to_send = 0;
+		trans->bytes_to_recv = 0;
+		trans->csw.bCSWStatus = USB_MSC_CSW_STATUS_FAILED;
+		break;
+	}
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * Copyright (C) 2013 Weston Schmidt <weston_schmidt@alumni.purdue.edu>
+ * Copyright (C) 2013 Pavol Rusnak <stick@gk2.sk>
+ * Copyright (C) 2016 Kuldeep Singh Dhaka <kuldeepdhaka9@gmail.com>
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNICOREMX_USBD_SCSI_H
+#define UNICOREMX_USBD_SCSI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usbd/class/msc.h>
+
+/*
+ * SCSI command set (SBC/SPC subset) shared by the Bulk-Only (usbd_msc.c)
+ *  and the USB Attached SCSI (usbd_uas.c) transports. Nothing in here
+ *  access the bus: the transport place the command block in
+ *  usb_msc_trans::cbw, call usbd_scsi_command() and move the data
+ *  described by the result.
+ *
+ * Commands with data not from the medium (INQUIRY, REQUEST SENSE, ...)
+ *  have their data in usb_msc_trans::msd_buf. Block commands give
+ *  lba_start and block_count, the transport access the backend with
+ *  usbd_scsi_media_access() in chunks of its buffers.
+ */
+
+/* The sense codes */
+enum sbc_sense_key {
+	SBC_SENSE_KEY_NO_SENSE			= 0x00,
+	SBC_SENSE_KEY_RECOVERED_ERROR		= 0x01,
+	SBC_SENSE_KEY_NOT_READY			= 0x02,
+	SBC_SENSE_KEY_MEDIUM_ERROR		= 0x03,
+	SBC_SENSE_KEY_HARDWARE_ERROR		= 0x04,
+	SBC_SENSE_KEY_ILLEGAL_REQUEST		= 0x05,
+	SBC_SENSE_KEY_UNIT_ATTENTION		= 0x06,
+	SBC_SENSE_KEY_DATA_PROTECT		= 0x07,
+	SBC_SENSE_KEY_BLANK_CHECK		= 0x08,
+	SBC_SENSE_KEY_VENDOR_SPECIFIC		= 0x09,
+	SBC_SENSE_KEY_COPY_ABORTED		= 0x0A,
+	SBC_SENSE_KEY_ABORTED_COMMAND		= 0x0B,
+	SBC_SENSE_KEY_VOLUME_OVERFLOW		= 0x0D,
+	SBC_SENSE_KEY_MISCOMPARE		= 0x0E
+};
+
+enum sbc_asc {
+	SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION	= 0x00,
+	SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT	= 0x03,
+	SBC_ASC_LOGICAL_UNIT_NOT_READY		= 0x04,
+	SBC_ASC_UNRECOVERED_READ_ERROR		= 0x11,
+	SBC_ASC_INVALID_COMMAND_OPERATION_CODE	= 0x20,
+	SBC_ASC_LBA_OUT_OF_RANGE		= 0x21,
+	SBC_ASC_INVALID_FIELD_IN_CDB		= 0x24,
+	SBC_ASC_WRITE_PROTECTED			= 0x27,
+	SBC_ASC_NOT_READY_TO_READY_CHANGE	= 0x28,
+	SBC_ASC_FORMAT_ERROR			= 0x31,
+	SBC_ASC_MEDIUM_NOT_PRESENT		= 0x3A
+};
+
+enum sbc_ascq {
+	SBC_ASCQ_NA				= 0x00,
+	SBC_ASCQ_FORMAT_COMMAND_FAILED		= 0x01,
+	SBC_ASCQ_INITIALIZING_COMMAND_REQUIRED	= 0x02,
+	SBC_ASCQ_OPERATION_IN_PROGRESS		= 0x07
+};
+
+enum trans_event {
+	EVENT_CBW_VALID,
+	EVENT_NEED_STATUS
+};
+
+struct usb_msc_trans {
+	struct usb_msc_cbw cbw;
+
+	uint32_t bytes_to_recv;
+	uint32_t bytes_to_send;
+	uint32_t byte_count;		/* Either read until equal to bytes_to_recv or
+					   write until equal to bytes_to_send. */
+	uint32_t lba_start;
+	uint32_t block_count;
+	uint32_t current_block;
+
+	uint8_t msd_buf[512];
+
+	struct usb_msc_csw csw;
+};
+
+/**
+ * Set the sense data reported by the next REQUEST SENSE
+ * @param[in] lun Logical unit
+ * @param[in] key Sense key
+ * @param[in] asc Additional sense code
+ * @param[in] ascq Additional sense code qualifier
+ */
+void usbd_scsi_set_sense(struct usbd_msc_lun *lun,
+				enum sbc_sense_key key,
+				enum sbc_asc asc,
+				enum sbc_ascq ascq);
+
+/**
+ * Process the command in @a trans cbw
+ * EVENT_CBW_VALID decode the command (fill @a trans), EVENT_NEED_STATUS
+ *  is given before the status is sent to host.
+ * @param[in] lun Logical unit
+ * @param[in] trans Transaction
+ * @param[in] event Event
+ */
+void usbd_scsi_command(struct usbd_msc_lun *lun,
+			struct usb_msc_trans *trans,
+			enum trans_event event);
+
+/**
+ * Read or write blocks with the backend
+ * read_start/write_start are used when available, else the blocks are
+ *  accessed before returning.
+ * @param[in] lun Logical unit
+ * @param[in] write Write (else read)
+ * @param[in] lba First block
+ * @param[in] count Number of blocks
+ * @param[in] buf Data (@a count * 512 bytes)
+ * @param[in] callback Called with the result when done (can be performed
+ *  before returning, or from the backend context)
+ * @param[in] ctx Context of @a callback
+ */
+void usbd_scsi_media_access(struct usbd_msc_lun *lun, bool write,
+			uint32_t lba, uint32_t count, uint8_t *buf,
+			usbd_msc_backend_callback callback, void *ctx);
+
+/**
+ * Write the data cached by the backend to the medium
+ * @param[in] lun Logical unit
+ * @return 0 on success (or backend without cache)
+ */
+int usbd_scsi_flush(struct usbd_msc_lun *lun);
+
+#endif
@@ -0,0 +1,1031 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/uas.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+#include "usbd_scsi.h"
+
+/*
+ * Task states:
+ *
+ *   FREE -> MEDIA     read: first chunk read from backend
+ *        -> READY     write (or non block data-in): wait for the data pipe
+ *        -> STATUS    no data (or error)
+ *
+ *   MEDIA -> READY    read chunk ready, data pipe not owned yet
+ *         -> DATA     read chunk ready (data pipe owned),
+ *                     write chunk written, more to receive
+ *         -> STATUS   last chunk written, or access failed
+ *
+ *   READY -> DATA     data pipe given (earliest ready first), READ READY
+ *                     or WRITE READY IU queued
+ *
+ *   DATA -> MEDIA     chunk sent (more to read) or received
+ *        -> STATUS    last chunk sent
+ *
+ *   STATUS -> FREE    SENSE IU sent
+ *
+ * A data pipe is owned from its READY IU till the last chunk is moved,
+ *  so chunks of a command are never interleaved with an other command.
+ *
+ * Backend completion (any context) only set task::media_done, the task is
+ *  moved by kick() (usbd_poll() context). kick() is reentrant safe: a
+ *  callback performed on submit ask for one more pass.
+ */
+
+#define BLOCK_SIZE 512
+
+#define NO_TASK 0xFF
+
+#define STATUS_FIFO_LEN (2 * USBD_UAS_QUEUE_DEPTH)
+
+enum task_state {
+	TASK_FREE,
+	TASK_MEDIA,
+	TASK_READY,
+	TASK_DATA,
+	TASK_STATUS
+};
+
+/* SENSE IU followed by fixed format sense data */
+struct sense_iu {
+	struct usb_msc_uas_sense_iu iu;
+	uint8_t data[18];
+} __attribute__((packed));
+
+/* Command decoded by the SCSI layer (usbd_poll() context only) */
+static struct usb_msc_trans scratch;
+
+static void kick(usbd_uas *uas);
+
+static inline uint16_t to_be16(uint16_t value)
+{
+	const uint8_t bytes[2] = {value >> 8, value};
+	uint16_t res;
+
+	memcpy(&res, bytes, sizeof(res));
+	return res;
+}
+
+static inline unsigned task_index(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	return task - uas->task;
+}
+
+static inline unsigned depth(usbd_uas *uas)
+{
+	return uas->config.queue_depth;
+}
+
+static inline struct usbd_uas_pipe *task_pipe(usbd_uas *uas,
+					struct usbd_uas_task *task)
+{
+	return task->write ? &uas->data_out : &uas->data_in;
+}
+
+/*-- Backend -----------------------------------------------------------------*/
+
+static void media_callback(void *ctx, int result)
+{
+	struct usbd_uas_task *task = ctx;
+
+	task->media_result = result;
+	STORE_RELEASE(&task->media_done, true);
+}
+
+static void media_get(usbd_uas *uas)
+{
+	const usbd_msc_backend *backend = uas->lun.backend;
+
+	if (!uas->media_users++ && backend->lock != NULL) {
+		backend->lock();
+	}
+}
+
+static void media_put(usbd_uas *uas)
+{
+	const usbd_msc_backend *backend = uas->lun.backend;
+
+	if (!--uas->media_users && backend->unlock != NULL) {
+		backend->unlock();
+	}
+}
+
+/**
+ * Read or write the next chunk of @a task
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void media_start(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	if (!task->write) {
+		task->chunk = MIN(task->blocks - task->done,
+					uas->config.task_blocks);
+	}
+
+	task->state = TASK_MEDIA;
+	task->media_done = false;
+
+	/* Completion can be performed before returning */
+	uas->kick.again = true;
+
+	usbd_scsi_media_access(&uas->lun, task->write, task->lba + task->done,
+		task->chunk, task->buf, media_callback, task);
+}
+
+/*-- Status pipe -------------------------------------------------------------*/
+
+static void status_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+/**
+ * Queue an IU of @a task on the status pipe
+ * @param[in] uas UAS
+ * @param[in] task Task
+ * @param[in] iu_id USB_MSC_UAS_IU_SENSE, _READ_READY or _WRITE_READY
+ */
+static void status_queue(usbd_uas *uas, struct usbd_uas_task *task,
+				uint8_t iu_id)
+{
+	unsigned index = (uas->status.head + uas->status.count) %
+							STATUS_FIFO_LEN;
+
+	uas->status.fifo[index].task = task_index(uas, task);
+	uas->status.fifo[index].iu_id = iu_id;
+	uas->status.count++;
+}
+
+/**
+ * Remove the IU of @a task not sent yet
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void status_purge(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	unsigned i, keep = 0;
+
+	for (i = 0; i < uas->status.count; i++) {
+		unsigned from = (uas->status.head + i) % STATUS_FIFO_LEN;
+		unsigned to = (uas->status.head + keep) % STATUS_FIFO_LEN;
+
+		if (uas->status.fifo[from].task != task_index(uas, task)) {
+			uas->status.fifo[to] = uas->status.fifo[from];
+			keep++;
+		}
+	}
+
+	uas->status.count = keep;
+}
+
+/**
+ * Finish @a task: queue its status (SENSE IU)
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void task_status(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	unsigned i;
+
+	task->state = TASK_STATUS;
+
+	for (i = 0; i < depth(uas); i++) {
+		struct usbd_uas_task *other = &uas->task[i];
+
+		if (other->state != TASK_FREE && other->state != TASK_STATUS &&
+				(int32_t) (other->arrival - task->arrival) < 0) {
+			uas->stats.reordered++;
+			break;
+		}
+	}
+
+	status_queue(uas, task, USB_MSC_UAS_IU_SENSE);
+}
+
+/**
+ * Finish @a task with CHECK CONDITION
+ * @param[in] uas UAS
+ * @param[in] task Task
+ * @param[in] key Sense key
+ * @param[in] asc Additional sense code
+ */
+static void task_fail(usbd_uas *uas, struct usbd_uas_task *task,
+			enum sbc_sense_key key, enum sbc_asc asc)
+{
+	usbd_scsi_set_sense(&uas->lun, key, asc, SBC_ASCQ_NA);
+	task->status = USB_MSC_SCSI_STATUS_CHECK_CONDITION;
+	task->sense = uas->lun.sense;
+	task_status(uas, task);
+}
+
+static void task_free(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	if (task->blocks) {
+		media_put(uas);
+	}
+
+	task->state = TASK_FREE;
+	task->aborted = false;
+}
+
+/**
+ * Build the IU and submit it
+ * @param[in] uas UAS
+ */
+static void status_submit(usbd_uas *uas)
+{
+	size_t len;
+
+	if (!uas->running || uas->status.busy) {
+		return;
+	}
+
+	if (uas->status.response) {
+		struct usb_msc_uas_response_iu *iu = (void *) uas->status.buf;
+
+		memset(iu, 0, sizeof(*iu));
+		iu->bIUID = USB_MSC_UAS_IU_RESPONSE;
+		iu->wTag = uas->status.response_tag;
+		iu->bResponseCode = uas->status.response_code;
+		len = sizeof(*iu);
+
+		uas->status.response = false;
+		uas->status.task = NO_TASK;
+		uas->status.iu_id = USB_MSC_UAS_IU_RESPONSE;
+	} else if (uas->status.count) {
+		struct usbd_uas_task *task;
+
+		uas->status.task = uas->status.fifo[uas->status.head].task;
+		uas->status.iu_id = uas->status.fifo[uas->status.head].iu_id;
+		uas->status.head = (uas->status.head + 1) % STATUS_FIFO_LEN;
+		uas->status.count--;
+
+		task = &uas->task[uas->status.task];
+
+		if (uas->status.iu_id == USB_MSC_UAS_IU_SENSE) {
+			struct sense_iu *iu = (void *) uas->status.buf;
+
+			memset(iu, 0, sizeof(*iu));
+			iu->iu.bIUID = USB_MSC_UAS_IU_SENSE;
+			iu->iu.wTag = task->tag;
+			iu->iu.bStatus = task->status;
+			len = sizeof(iu->iu);
+
+			if (task->status != USB_MSC_SCSI_STATUS_GOOD) {
+				iu->iu.wLength = to_be16(sizeof(iu->data));
+				iu->data[0] = 0x70; /* Current, fixed format */
+				iu->data[2] = task->sense.key;
+				iu->data[7] = sizeof(iu->data) - 8;
+				iu->data[12] = task->sense.asc;
+				iu->data[13] = task->sense.ascq;
+				len = sizeof(*iu);
+			}
+		} else {
+			struct usb_msc_uas_ready_iu *iu = (void *) uas->status.buf;
+
+			memset(iu, 0, sizeof(*iu));
+			iu->bIUID = uas->status.iu_id;
+			iu->wTag = task->tag;
+			len = sizeof(*iu);
+		}
+	} else {
+		return;
+	}
+
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = uas->config.ep_status,
+		.ep_size = uas->config.ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = uas->status.buf,
+		.length = len,
+		.flags = USBD_FLAG_SHORT_PACKET,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = status_callback,
+		.user_data = uas
+	};
+
+	uas->status.busy = true;
+	usbd_transfer_submit(uas->dev, &transfer);
+}
+
+/*-- Data pipes --------------------------------------------------------------*/
+
+static void data_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+/**
+ * Submit the data (chunk) of @a task on the pipe it own
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void data_submit(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	struct usbd_uas_pipe *pipe = task_pipe(uas, task);
+	usbd_transfer_flags flags = USBD_FLAG_NONE;
+	size_t len;
+
+	if (task->blocks) {
+		if (task->write) {
+			task->chunk = MIN(task->blocks - task->done,
+						uas->config.task_blocks);
+		}
+
+		len = task->chunk * BLOCK_SIZE;
+	} else {
+		len = task->length;
+		if (len < task->expected) {
+			flags = USBD_FLAG_SHORT_PACKET;
+		}
+	}
+
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = pipe->ep_addr,
+		.ep_size = uas->config.ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = task->buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = data_callback,
+		.user_data = uas
+	};
+
+	task->state = TASK_DATA;
+	usbd_transfer_submit(uas->dev, &transfer);
+}
+
+/**
+ * Give a free data pipe to the task whose data is ready first
+ * @param[in] uas UAS
+ * @param[in] pipe Data pipe
+ */
+static void data_schedule(usbd_uas *uas, struct usbd_uas_pipe *pipe)
+{
+	struct usbd_uas_task *best = NULL;
+	unsigned i;
+
+	if (!uas->running || pipe->owner != NULL) {
+		return;
+	}
+
+	for (i = 0; i < depth(uas); i++) {
+		struct usbd_uas_task *task = &uas->task[i];
+
+		if (task->state != TASK_READY || task_pipe(uas, task) != pipe) {
+			continue;
+		}
+
+		if (best == NULL || (int32_t) (task->ready - best->ready) < 0) {
+			best = task;
+		}
+	}
+
+	if (best == NULL) {
+		return;
+	}
+
+	pipe->owner = best;
+	status_queue(uas, best, best->write ? USB_MSC_UAS_IU_WRITE_READY :
+						USB_MSC_UAS_IU_READ_READY);
+	data_submit(uas, best);
+}
+
+/**
+ * Wait for the data pipe
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void task_ready(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	task->state = TASK_READY;
+	task->ready = uas->ready++;
+}
+
+/*-- Task --------------------------------------------------------------------*/
+
+/**
+ * Backend access of @a task finished
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void media_complete(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	struct usbd_uas_pipe *pipe = task_pipe(uas, task);
+	bool owner = pipe->owner == task;
+
+	if (task->aborted) {
+		if (owner) {
+			pipe->owner = NULL;
+		}
+
+		task_free(uas, task);
+		return;
+	}
+
+	if (task->media_result) {
+		LOGF_LN("uas: backend failed (lba=%"PRIu32")",
+					task->lba + task->done);
+		uas->stats.media_errors++;
+
+		if (owner) {
+			pipe->owner = NULL;
+		}
+
+		if (task->write) {
+			task_fail(uas, task, SBC_SENSE_KEY_MEDIUM_ERROR,
+					SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT);
+		} else {
+			task_fail(uas, task, SBC_SENSE_KEY_MEDIUM_ERROR,
+					SBC_ASC_UNRECOVERED_READ_ERROR);
+		}
+		return;
+	}
+
+	if (!task->write) {
+		if (owner) {
+			data_submit(uas, task);
+		} else {
+			task_ready(uas, task);
+		}
+		return;
+	}
+
+	task->done += task->chunk;
+
+	if (task->done < task->blocks) {
+		/* Pipe kept by the task */
+		data_submit(uas, task);
+	} else {
+		task_status(uas, task);
+	}
+}
+
+/**
+ * Pick up the backend accesses finished
+ * @param[in] uas UAS
+ */
+static void media_poll(usbd_uas *uas)
+{
+	unsigned i;
+
+	for (i = 0; i < depth(uas); i++) {
+		struct usbd_uas_task *task = &uas->task[i];
+
+		if (task->state == TASK_MEDIA && LOAD_ACQUIRE(&task->media_done)) {
+			task->media_done = false;
+			media_complete(uas, task);
+		}
+	}
+}
+
+/**
+ * Abort @a task
+ * @param[in] uas UAS
+ * @param[in] task Task
+ */
+static void task_abort(usbd_uas *uas, struct usbd_uas_task *task)
+{
+	struct usbd_uas_pipe *pipe = task_pipe(uas, task);
+
+	if (task->state == TASK_FREE || task->aborted) {
+		return;
+	}
+
+	uas->stats.aborted++;
+	status_purge(uas, task);
+
+	switch (task->state) {
+	case TASK_MEDIA:
+		/* Buffer in use by the backend */
+		task->aborted = true;
+	break;
+	case TASK_DATA:
+		task->aborted = true;
+		usbd_transfer_cancel_ep(uas->dev, pipe->ep_addr);
+	break;
+	case TASK_STATUS:
+		if (uas->status.busy && uas->status.task == task_index(uas, task)) {
+			/* SENSE IU on the bus, freed when sent */
+			task->aborted = true;
+			break;
+		}
+		task_free(uas, task);
+	break;
+	default:
+		task_free(uas, task);
+	break;
+	}
+}
+
+/**
+ * Allocation length of the command without data from the medium
+ * @param[in] cdb Command
+ * @return bytes host accept
+ */
+static uint32_t allocation_length(const uint8_t *cdb)
+{
+	switch (cdb[0]) {
+	case USB_MSC_SCSI_INQUIRY:
+	return (cdb[3] << 8) | cdb[4];
+	case USB_MSC_SCSI_REQUEST_SENSE:
+	case USB_MSC_SCSI_MODE_SENSE_6:
+	return cdb[4];
+	default:
+	return UINT32_MAX;
+	}
+}
+
+/**
+ * Decode the command and start @a task
+ * @param[in] uas UAS
+ * @param[in] task Task
+ * @param[in] iu COMMAND IU
+ */
+static void task_start(usbd_uas *uas, struct usbd_uas_task *task,
+				const struct usb_msc_uas_command_iu *iu)
+{
+	struct usb_msc_trans *trans = &scratch;
+	uint32_t block_count = uas->lun.backend->block_count;
+	unsigned i, active = 0;
+
+	task->tag = iu->wTag;
+	task->arrival = uas->arrival++;
+	task->aborted = false;
+	task->done = 0;
+	task->length = 0;
+	task->buf = (uint8_t *) uas->config.buffer +
+		task_index(uas, task) * uas->config.task_blocks * BLOCK_SIZE;
+
+	for (i = 0; i < depth(uas); i++) {
+		active += uas->task[i].state != TASK_FREE;
+	}
+	uas->stats.queue_max = MAX(uas->stats.queue_max, active + 1);
+
+	memset(&trans->cbw, 0, sizeof(trans->cbw));
+	trans->cbw.dCBWTag = iu->wTag;
+	trans->cbw.bCBWCBLength = sizeof(iu->CDB);
+	memcpy(trans->cbw.CBWCB, iu->CDB, sizeof(iu->CDB));
+	trans->lba_start = 0;
+	trans->block_count = 0;
+
+	usbd_scsi_command(&uas->lun, trans, EVENT_CBW_VALID);
+
+	task->write = trans->bytes_to_recv != 0;
+	task->lba = trans->lba_start;
+	task->blocks = (trans->bytes_to_send || trans->bytes_to_recv) ?
+						trans->block_count : 0;
+
+	if (trans->csw.bCSWStatus != USB_MSC_CSW_STATUS_SUCCESS) {
+		task->blocks = 0;
+		task->status = USB_MSC_SCSI_STATUS_CHECK_CONDITION;
+		task->sense = uas->lun.sense;
+		task_status(uas, task);
+		return;
+	}
+
+	task->status = USB_MSC_SCSI_STATUS_GOOD;
+
+	if (task->blocks) {
+		if (task->lba >= block_count ||
+				task->blocks > block_count - task->lba) {
+			task->blocks = 0;
+			task_fail(uas, task, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+					SBC_ASC_LBA_OUT_OF_RANGE);
+			return;
+		}
+
+		media_get(uas);
+
+		if (task->write) {
+			task_ready(uas, task);
+		} else {
+			media_start(uas, task);
+		}
+		return;
+	}
+
+	if (trans->bytes_to_send) {
+		/* Data from the SCSI layer (INQUIRY, MODE SENSE ...) */
+		task->write = false;
+		task->expected = allocation_length(iu->CDB);
+		task->length = MIN(trans->bytes_to_send, sizeof(trans->msd_buf));
+		task->length = MIN(task->length, task->expected);
+		memcpy(task->buf, trans->msd_buf, task->length);
+	}
+
+	if (task->length) {
+		task_ready(uas, task);
+	} else {
+		task_status(uas, task);
+	}
+}
+
+/**
+ * Abort all tasks and forget the URB in flight
+ * Tasks with a backend access in flight stay reserved till it finish.
+ * @param[in] uas UAS
+ */
+static void halt(usbd_uas *uas)
+{
+	unsigned i;
+
+	uas->running = false;
+
+	for (i = 0; i < depth(uas); i++) {
+		struct usbd_uas_task *task = &uas->task[i];
+
+		if (task->state == TASK_FREE) {
+			continue;
+		}
+
+		if (!task->aborted) {
+			uas->stats.aborted++;
+		}
+
+		if (task->state == TASK_MEDIA) {
+			task->aborted = true;
+		} else {
+			task_free(uas, task);
+		}
+	}
+
+	uas->data_in.owner = NULL;
+	uas->data_out.owner = NULL;
+	uas->command.busy = false;
+	uas->status.head = 0;
+	uas->status.count = 0;
+	uas->status.response = false;
+	uas->status.busy = false;
+}
+
+/**
+ * Account transfer completion
+ * @param[in] uas UAS
+ * @param[in] status Status
+ * @return false if the transfer should be ignored (stopped)
+ */
+static bool complete(usbd_uas *uas, usbd_transfer_status status)
+{
+	if (!uas->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("uas", status)) {
+	case USBD_CLASS_SUCCESS:
+	return true;
+	case USBD_CLASS_STOP:
+		halt(uas);
+	return false;
+	default:
+		uas->stats.errors++;
+	return true;
+	}
+}
+
+/*-- Command pipe ------------------------------------------------------------*/
+
+static void command_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static struct usbd_uas_task *task_alloc(usbd_uas *uas)
+{
+	unsigned i;
+
+	for (i = 0; i < depth(uas); i++) {
+		if (uas->task[i].state == TASK_FREE) {
+			return &uas->task[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Accept the next IU if a task is free (host get NAK otherwise)
+ * @param[in] uas UAS
+ */
+static void command_submit(usbd_uas *uas)
+{
+	if (!uas->running || uas->command.busy || uas->status.response ||
+			task_alloc(uas) == NULL) {
+		return;
+	}
+
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = uas->config.ep_command,
+		.ep_size = uas->config.ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = uas->command.buf,
+		.length = sizeof(uas->command.buf),
+		.flags = USBD_FLAG_SHORT_PACKET,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = command_callback,
+		.user_data = uas
+	};
+
+	uas->command.busy = true;
+	usbd_transfer_submit(uas->dev, &transfer);
+}
+
+static void response_queue(usbd_uas *uas, uint16_t tag, uint8_t code)
+{
+	uas->status.response = true;
+	uas->status.response_tag = tag;
+	uas->status.response_code = code;
+}
+
+static struct usbd_uas_task *task_find(usbd_uas *uas, uint16_t tag)
+{
+	unsigned i;
+
+	for (i = 0; i < depth(uas); i++) {
+		struct usbd_uas_task *task = &uas->task[i];
+
+		if (task->state != TASK_FREE && !task->aborted && task->tag == tag) {
+			return task;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Perform a task management function
+ * @param[in] uas UAS
+ * @param[in] iu TASK MANAGEMENT IU
+ */
+static void task_management(usbd_uas *uas,
+				const struct usb_msc_uas_task_management_iu *iu)
+{
+	struct usbd_uas_task *task = task_find(uas, iu->wTagOfManagedTask);
+	uint8_t code = USB_MSC_UAS_RC_TMF_COMPLETE;
+	unsigned i;
+
+	uas->stats.task_management++;
+
+	switch (iu->bFunction) {
+	case USB_MSC_UAS_TMF_ABORT_TASK:
+		if (task != NULL) {
+			task_abort(uas, task);
+		}
+	break;
+	case USB_MSC_UAS_TMF_LOGICAL_UNIT_RESET:
+	case USB_MSC_UAS_TMF_I_T_NEXUS_RESET:
+		if (usbd_scsi_flush(&uas->lun) != 0) {
+			code = USB_MSC_UAS_RC_TMF_FAILED;
+		}
+	/* Fall through */
+	case USB_MSC_UAS_TMF_ABORT_TASK_SET:
+	case USB_MSC_UAS_TMF_CLEAR_TASK_SET:
+		for (i = 0; i < depth(uas); i++) {
+			task_abort(uas, &uas->task[i]);
+		}
+	break;
+	case USB_MSC_UAS_TMF_QUERY_TASK:
+		if (task != NULL) {
+			code = USB_MSC_UAS_RC_TMF_SUCCEEDED;
+		}
+	break;
+	default:
+		code = USB_MSC_UAS_RC_TMF_NOT_SUPPORTED;
+	break;
+	}
+
+	response_queue(uas, iu->wTag, code);
+}
+
+static void command_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_uas *uas = transfer->user_data;
+	const uint8_t *buf = uas->command.buf;
+	uint16_t tag;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(uas, status)) {
+		return;
+	}
+
+	uas->command.busy = false;
+
+	if (status != USBD_SUCCESS || transfer->transferred < 4) {
+		kick(uas);
+		return;
+	}
+
+	memcpy(&tag, &buf[2], sizeof(tag));
+
+	switch (buf[0]) {
+	case USB_MSC_UAS_IU_COMMAND:
+		uas->stats.commands++;
+
+		if (transfer->transferred < sizeof(struct usb_msc_uas_command_iu)) {
+			response_queue(uas, tag, USB_MSC_UAS_RC_INVALID_IU);
+		} else if (task_find(uas, tag) != NULL) {
+			response_queue(uas, tag, USB_MSC_UAS_RC_OVERLAPPED_TAG);
+		} else {
+			/* command_submit() made sure a task is free */
+			task_start(uas, task_alloc(uas), (const void *) buf);
+		}
+	break;
+	case USB_MSC_UAS_IU_TASK_MANAGEMENT:
+		if (transfer->transferred <
+				sizeof(struct usb_msc_uas_task_management_iu)) {
+			response_queue(uas, tag, USB_MSC_UAS_RC_INVALID_IU);
+		} else {
+			task_management(uas, (const void *) buf);
+		}
+	break;
+	default:
+		response_queue(uas, tag, USB_MSC_UAS_RC_INVALID_IU);
+	break;
+	}
+
+	kick(uas);
+}
+
+static void status_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_uas *uas = transfer->user_data;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!complete(uas, status)) {
+		return;
+	}
+
+	uas->status.busy = false;
+
+	if (uas->status.iu_id == USB_MSC_UAS_IU_SENSE) {
+		task_free(uas, &uas->task[uas->status.task]);
+	}
+
+	kick(uas);
+}
+
+static void data_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_uas *uas = transfer->user_data;
+	struct usbd_uas_pipe *pipe;
+	struct usbd_uas_task *task;
+
+	(void) dev;
+	(void) urb_id;
+
+	if (!uas->running) {
+		return;
+	}
+
+	pipe = (transfer->ep_addr == uas->data_in.ep_addr) ?
+					&uas->data_in : &uas->data_out;
+	task = pipe->owner;
+
+	if (task == NULL) {
+		/* Pipe released (task failed or aborted) */
+		return;
+	}
+
+	if (task->aborted) {
+		/* Cancelled by task management */
+		pipe->owner = NULL;
+		task_free(uas, task);
+		kick(uas);
+		return;
+	}
+
+	if (!complete(uas, status)) {
+		return;
+	}
+
+	if (status != USBD_SUCCESS) {
+		pipe->owner = NULL;
+		task_fail(uas, task, SBC_SENSE_KEY_ABORTED_COMMAND,
+				SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION);
+	} else if (!task->blocks) {
+		pipe->owner = NULL;
+		task_status(uas, task);
+	} else if (task->write) {
+		if (task->done + task->chunk == task->blocks) {
+			/* Last chunk received */
+			pipe->owner = NULL;
+		}
+		media_start(uas, task);
+	} else {
+		task->done += task->chunk;
+		if (task->done < task->blocks) {
+			/* Pipe kept by the task */
+			media_start(uas, task);
+		} else {
+			pipe->owner = NULL;
+			task_status(uas, task);
+		}
+	}
+
+	kick(uas);
+}
+
+static void kick(usbd_uas *uas)
+{
+	if (uas->kick.busy) {
+		uas->kick.again = true;
+		return;
+	}
+
+	uas->kick.busy = true;
+
+	do {
+		uas->kick.again = false;
+		media_poll(uas);
+		data_schedule(uas, &uas->data_in);
+		data_schedule(uas, &uas->data_out);
+		status_submit(uas);
+		command_submit(uas);
+	} while (uas->kick.again);
+
+	uas->kick.busy = false;
+}
+
+void usbd_uas_init(usbd_uas *uas, usbd_device *dev,
+				const usbd_uas_config *config)
+{
+	memset(uas, 0, sizeof(*uas));
+	uas->dev = dev;
+	uas->config = *config;
+
+	if (!uas->config.queue_depth ||
+			uas->config.queue_depth > USBD_UAS_QUEUE_DEPTH) {
+		uas->config.queue_depth = USBD_UAS_QUEUE_DEPTH;
+	}
+
+	uas->config.task_blocks = MAX(uas->config.task_blocks, 1);
+
+	uas->lun.backend = config->backend;
+	usbd_scsi_set_sense(&uas->lun, SBC_SENSE_KEY_NO_SENSE,
+				SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION, SBC_ASCQ_NA);
+
+	uas->data_in.ep_addr = config->ep_data_in;
+	uas->data_out.ep_addr = config->ep_data_out;
+}
+
+/**
+ * Stop and cancel the URB of all pipes
+ * The URB still in flight after a halt() on error are cancelled too (their
+ *  callback is ignored).
+ * @param[in] uas UAS
+ */
+static void cancel_all(usbd_uas *uas)
+{
+	halt(uas);
+	usbd_transfer_cancel_ep(uas->dev, uas->config.ep_command);
+	usbd_transfer_cancel_ep(uas->dev, uas->config.ep_status);
+	usbd_transfer_cancel_ep(uas->dev, uas->config.ep_data_in);
+	usbd_transfer_cancel_ep(uas->dev, uas->config.ep_data_out);
+}
+
+void usbd_uas_start(usbd_uas *uas)
+{
+	cancel_all(uas);
+	uas->running = true;
+	kick(uas);
+}
+
+void usbd_uas_stop(usbd_uas *uas)
+{
+	cancel_all(uas);
+}
+
+void usbd_uas_poll(usbd_uas *uas)
+{
+	kick(uas);
+}
+
+void usbd_uas_get_stats(usbd_uas *uas, usbd_uas_stats *stats)
+{
+	*stats = uas->stats;
+}
@@ -0,0 +1,610 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/class/uvc.h>
+#include "../usbd_private.h"
+#include "usbd_class.h"
+
+/*
+ * Frame queue (ring of USBD_UVC_FRAMES, index from head):
+ *   [0, send)          all payloads submitted, wait for the last one
+ *   send               packetized upto offset
+ *   (send, count)      waiting
+ *
+ * Payloads complete in order, so a payload with frame data always belong
+ *  to the frame at head. The frame is given back when its EOF payload
+ *  complete.
+ *
+ * The frame queue is shared with usbd_uvc_queue_frame() (main loop or
+ *  interrupt), so it is only touched with interrupts masked.
+ */
+
+#define HEADER_SIZE sizeof(struct usb_video_payload_header)
+
+/* Smallest probe and commit accepted (UVC 1.0) */
+#define CONTROL_SIZE_MIN USB_VIDEO_PROBE_COMMIT_SIZE_10
+
+/* Isochronous packets per (micro)frame */
+static const usbd_transfer_flags packet_per_frame[] = {
+	USBD_FLAG_PACKET_PER_FRAME_1,
+	USBD_FLAG_PACKET_PER_FRAME_2,
+	USBD_FLAG_PACKET_PER_FRAME_3
+};
+
+static void payload_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static inline struct usbd_uvc_frame *frame_slot(usbd_uvc *uvc, unsigned offset)
+{
+	return &uvc->frame.slot[(uvc->frame.head + offset) % USBD_UVC_FRAMES];
+}
+
+static inline bool is_iso(usbd_uvc *uvc)
+{
+	return uvc->config.ep_type == USBD_EP_ISOCHRONOUS;
+}
+
+/**
+ * Bytes per payload (header included)
+ * @param[in] uvc UVC
+ * @param[in] info Frame
+ * @return dwMaxPayloadTransferSize
+ */
+static uint32_t payload_size(usbd_uvc *uvc, const usbd_uvc_frame_info *info)
+{
+	if (is_iso(uvc)) {
+		return uvc->config.ep_size * uvc->config.packets;
+	}
+
+	if (uvc->config.payload_size) {
+		return uvc->config.payload_size;
+	}
+
+	return info->max_frame_size + HEADER_SIZE;
+}
+
+/**
+ * Submit a payload
+ * @param[in] uvc UVC
+ * @param[in] buf Segments (NULL for an empty payload)
+ * @param[in] len Length
+ * @param[in] flags Transfer flags
+ */
+static void submit(usbd_uvc *uvc, void *buf, size_t len,
+			usbd_transfer_flags flags)
+{
+	const usbd_transfer transfer = {
+		.ep_type = uvc->config.ep_type,
+		.ep_addr = uvc->config.ep_addr,
+		.ep_size = uvc->config.ep_size,
+		.ep_interval = is_iso(uvc) ? 1 : USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.seg_count = 2, /* header, slice */
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = payload_callback,
+		.user_data = uvc
+	};
+
+	usbd_transfer_submit(uvc->dev, &transfer);
+}
+
+/**
+ * Give back a frame
+ * @param[in] uvc UVC
+ * @param[in] frame Frame
+ * @param[in] sent All payloads sent
+ */
+static void frame_release(usbd_uvc *uvc, struct usbd_uvc_frame *frame,
+				bool sent)
+{
+	if (uvc->config.frame_done != NULL) {
+		uvc->config.frame_done(uvc, frame->cookie, sent);
+	}
+}
+
+/**
+ * Submit the next payloads
+ * Bulk: only when a frame is queued. Isochronous: every (micro)frame,
+ *  empty when no frame is queued.
+ * @param[in] uvc UVC
+ */
+static void kick(usbd_uvc *uvc)
+{
+	while (uvc->running && uvc->urb.count < USBD_UVC_URBS) {
+		unsigned index = (uvc->urb.head + uvc->urb.count) % USBD_UVC_URBS;
+		struct usbd_uvc_payload *payload = &uvc->urb.payload[index];
+		usbd_transfer_flags flags = USBD_FLAG_NONE;
+		void *buffer = NULL;
+		size_t len = 0;
+
+		payload->data = uvc->frame.send < uvc->frame.count;
+		payload->eof = false;
+
+		if (payload->data) {
+			struct usbd_uvc_frame *frame = frame_slot(uvc, uvc->frame.send);
+			size_t slice = MIN(frame->len - uvc->frame.offset,
+						uvc->payload_size - HEADER_SIZE);
+
+			payload->header.bHeaderLength = HEADER_SIZE;
+			payload->header.bmHeaderInfo = USB_VIDEO_PAYLOAD_EOH |
+				(uvc->frame.fid ? USB_VIDEO_PAYLOAD_FID : 0);
+			payload->seg[0].ptr = &payload->header;
+			payload->seg[0].len = HEADER_SIZE;
+			payload->seg[1].ptr = (uint8_t *) frame->data + uvc->frame.offset;
+			payload->seg[1].len = slice;
+
+			uvc->frame.offset += slice;
+			if (uvc->frame.offset == frame->len) {
+				payload->header.bmHeaderInfo |= USB_VIDEO_PAYLOAD_EOF;
+				payload->eof = true;
+				uvc->frame.fid = !uvc->frame.fid;
+				uvc->frame.offset = 0;
+				uvc->frame.send++;
+			}
+
+			buffer = payload->seg;
+			len = HEADER_SIZE + slice;
+			flags = USBD_FLAG_SEGMENTED;
+		} else if (!is_iso(uvc)) {
+			return;
+		}
+
+		if (is_iso(uvc)) {
+			/* Packets of this (micro)frame (DATA2/DATA1/DATA0 PID) */
+			unsigned packets = (len + uvc->config.ep_size - 1) /
+						uvc->config.ep_size;
+			flags |= packet_per_frame[packets ? packets - 1 : 0];
+		} else if (len < uvc->payload_size) {
+			/* Short packet (or ZLP) end a payload */
+			flags |= USBD_FLAG_SHORT_PACKET;
+		}
+
+		uvc->urb.count++;
+		submit(uvc, buffer, len, flags);
+	}
+}
+
+/**
+ * Stop the stream, give back the frames queued
+ * @param[in] uvc UVC
+ */
+static void halt(usbd_uvc *uvc)
+{
+	unsigned i;
+
+	uvc->running = false;
+
+	for (i = 0; i < uvc->frame.count; i++) {
+		bool started = i < uvc->frame.send ||
+			(i == uvc->frame.send && uvc->frame.offset);
+
+		if (started) {
+			uvc->stats.frames_incomplete++;
+		} else {
+			uvc->stats.frames_dropped++;
+		}
+
+		frame_release(uvc, frame_slot(uvc, i), false);
+	}
+
+	uvc->frame.head = 0;
+	uvc->frame.count = 0;
+	uvc->frame.send = 0;
+	uvc->frame.offset = 0;
+	uvc->frame.error = false;
+
+	uvc->urb.head = 0;
+	uvc->urb.count = 0;
+}
+
+/**
+ * Account transfer completion
+ * @param[in] uvc UVC
+ * @param[in] status Status
+ * @return false if the transfer should be ignored (stopped)
+ */
+static bool complete(usbd_uvc *uvc, usbd_transfer_status status)
+{
+	if (!uvc->running) {
+		return false;
+	}
+
+	switch (usbd_class_status("uvc", status)) {
+	case USBD_CLASS_SUCCESS:
+	return true;
+	case USBD_CLASS_STOP:
+		halt(uvc);
+	return false;
+	default:
+		uvc->stats.errors++;
+	return true;
+	}
+}
+
+static void payload_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	usbd_uvc *uvc = transfer->user_data;
+	struct usbd_uvc_payload *payload;
+
+	(void) dev;
+	(void) urb_id;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!complete(uvc, status)) {
+		return;
+	}
+
+	payload = &uvc->urb.payload[uvc->urb.head];
+	uvc->urb.head = (uvc->urb.head + 1) % USBD_UVC_URBS;
+	uvc->urb.count--;
+
+	if (!payload->data) {
+		uvc->stats.idle_payloads++;
+	} else if (status == USBD_SUCCESS) {
+		uvc->stats.payloads++;
+	} else {
+		/* Host see a broken frame */
+		uvc->frame.error = true;
+	}
+
+	if (payload->eof) {
+		if (uvc->frame.error) {
+			uvc->stats.frames_incomplete++;
+		} else {
+			uvc->stats.frames++;
+		}
+
+		frame_release(uvc, frame_slot(uvc, 0), !uvc->frame.error);
+		uvc->frame.head = (uvc->frame.head + 1) % USBD_UVC_FRAMES;
+		uvc->frame.count--;
+		uvc->frame.send--;
+		uvc->frame.error = false;
+	}
+
+	kick(uvc);
+}
+
+/**
+ * Find a frame described to host
+ * @param[in] uvc UVC
+ * @param[in] format_index bFormatIndex
+ * @param[in] frame_index bFrameIndex (0: first frame of the format)
+ * @return frame, NULL if not found
+ */
+static const usbd_uvc_frame_info *find_frame(usbd_uvc *uvc,
+				uint8_t format_index, uint8_t frame_index)
+{
+	unsigned i;
+
+	for (i = 0; i < uvc->config.frame_count; i++) {
+		const usbd_uvc_frame_info *info = &uvc->config.frames[i];
+
+		if (info->format_index == format_index &&
+				(!frame_index || info->frame_index == frame_index)) {
+			return info;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Fill the fields of a probe or commit the device is responsible for
+ * @param[in] uvc UVC
+ * @param[out] ctl Probe or commit
+ * @param[in] info Frame
+ * @param[in] interval Frame interval
+ */
+static void fill(usbd_uvc *uvc, struct usb_video_probe_commit_control *ctl,
+			const usbd_uvc_frame_info *info, uint32_t interval)
+{
+	ctl->bFormatIndex = info->format_index;
+	ctl->bFrameIndex = info->frame_index;
+	ctl->dwFrameInterval = interval;
+	ctl->wDelay = 0;
+	ctl->dwMaxVideoFrameSize = info->max_frame_size;
+	ctl->dwMaxPayloadTransferSize = payload_size(uvc, info);
+	ctl->bmFramingInfo = USB_VIDEO_FRAMING_FID | USB_VIDEO_FRAMING_EOF;
+}
+
+/**
+ * Adjust a probe or commit to the frames described to host
+ * @param[in] uvc UVC
+ * @param[in,out] ctl Probe or commit
+ * @param[in] exact Format and frame must exist (commit)
+ * @return frame, NULL if not found (@a exact)
+ */
+static const usbd_uvc_frame_info *negotiate(usbd_uvc *uvc,
+			struct usb_video_probe_commit_control *ctl, bool exact)
+{
+	const usbd_uvc_frame_info *info;
+	uint32_t interval = ctl->dwFrameInterval;
+
+	info = find_frame(uvc, ctl->bFormatIndex, ctl->bFrameIndex);
+	if (info == NULL || !ctl->bFrameIndex) {
+		if (exact) {
+			return NULL;
+		}
+
+		/* Nearest: first frame of the format, or the default */
+		if (info == NULL) {
+			info = find_frame(uvc, ctl->bFormatIndex, 0);
+		}
+		if (info == NULL) {
+			info = &uvc->config.frames[0];
+		}
+	}
+
+	if (!interval) {
+		interval = info->interval_default;
+	}
+
+	interval = MAX(interval, info->interval_min);
+	interval = MIN(interval, info->interval_max);
+
+	fill(uvc, ctl, info, interval);
+	return info;
+}
+
+/**
+ * Stop the stream and cancel the URB in flight
+ * @param[in] uvc UVC
+ */
+static void cancel(usbd_uvc *uvc)
+{
+	if (!uvc->running) {
+		return;
+	}
+
+	halt(uvc);
+	usbd_transfer_cancel_ep(uvc->dev, uvc->config.ep_addr);
+}
+
+void usbd_uvc_init(usbd_uvc *uvc, usbd_device *dev,
+				const usbd_uvc_config *config)
+{
+	const usbd_uvc_frame_info *info = &config->frames[0];
+
+	memset(uvc, 0, sizeof(*uvc));
+	uvc->dev = dev;
+	uvc->config = *config;
+
+	if (is_iso(uvc) && (!uvc->config.packets || uvc->config.packets > 3)) {
+		LOGF_LN("uvc: %"PRIu8" packets per frame not supported, using 1",
+			config->packets);
+		uvc->config.packets = 1;
+	}
+
+	fill(uvc, &uvc->probe, info, info->interval_default);
+	uvc->commit = uvc->probe;
+	uvc->committed = info;
+	uvc->payload_size = payload_size(uvc, info);
+}
+
+static usbd_control_transfer_feedback set_cur_callback(
+		usbd_device *dev, const usbd_control_transfer_callback_arg *arg)
+{
+	usbd_uvc *uvc;
+	const usbd_uvc_frame_info *info;
+	struct usb_video_probe_commit_control *ctl;
+
+	(void) dev;
+
+	/* Data stage was received in usbd_uvc::control */
+	uvc = (usbd_uvc *) ((uint8_t *) arg->buffer -
+				offsetof(usbd_uvc, control));
+	ctl = &uvc->control.ctl;
+
+	if (arg->length < CONTROL_SIZE_MIN) {
+		return USBD_CONTROL_TRANSFER_STALL;
+	}
+
+	if (uvc->selector == USB_VIDEO_VS_PROBE_CONTROL) {
+		negotiate(uvc, ctl, false);
+		uvc->probe = *ctl;
+		return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+	}
+
+	info = negotiate(uvc, ctl, true);
+	if (info == NULL) {
+		return USBD_CONTROL_TRANSFER_STALL;
+	}
+
+	USBD_ATOMIC_CONTEXT();
+
+	/* Frames queued were made for the previous commit */
+	cancel(uvc);
+	uvc->commit = *ctl;
+	uvc->committed = info;
+	uvc->payload_size = ctl->dwMaxPayloadTransferSize;
+
+	if (uvc->config.commit != NULL) {
+		uvc->config.commit(uvc, info, ctl->dwFrameInterval);
+	}
+
+	/* Bulk: no alternate setting, stream start now */
+	if (!is_iso(uvc)) {
+		uvc->running = true;
+	}
+
+	return USBD_CONTROL_TRANSFER_NO_STATUS_CALLBACK;
+}
+
+/**
+ * Answer GET_* of the probe and commit
+ * @param[in] uvc UVC
+ * @param[in] setup_data Setup data
+ * @return false if the request is not supported (stall)
+ */
+static bool get_control(usbd_uvc *uvc, const struct usb_setup_data *setup_data)
+{
+	struct usb_video_probe_commit_control *ctl = &uvc->control.ctl;
+	bool probe = uvc->selector == USB_VIDEO_VS_PROBE_CONTROL;
+	const usbd_uvc_frame_info *info;
+	void *buf = ctl;
+	size_t len = sizeof(*ctl);
+
+	switch (setup_data->bRequest) {
+	case USB_VIDEO_REQ_GET_CUR:
+		*ctl = probe ? uvc->probe : uvc->commit;
+	break;
+	case USB_VIDEO_REQ_GET_MIN:
+	case USB_VIDEO_REQ_GET_MAX:
+		if (!probe) {
+			return false;
+		}
+		*ctl = uvc->probe;
+		info = negotiate(uvc, ctl, false);
+		fill(uvc, ctl, info, setup_data->bRequest == USB_VIDEO_REQ_GET_MIN ?
+			info->interval_min : info->interval_max);
+	break;
+	case USB_VIDEO_REQ_GET_DEF:
+		if (!probe) {
+			return false;
+		}
+		info = &uvc->config.frames[0];
+		*ctl = uvc->probe;
+		fill(uvc, ctl, info, info->interval_default);
+	break;
+	case USB_VIDEO_REQ_GET_LEN:
+		uvc->control.len = sizeof(*ctl);
+		buf = &uvc->control.len;
+		len = sizeof(uvc->control.len);
+	break;
+	case USB_VIDEO_REQ_GET_INFO:
+		uvc->control.info = USB_VIDEO_INFO_SUPPORTS_GET |
+					USB_VIDEO_INFO_SUPPORTS_SET;
+		buf = &uvc->control.info;
+		len = sizeof(uvc->control.info);
+	break;
+	default:
+	return false;
+	}
+
+	usbd_ep0_transfer(uvc->dev, setup_data, buf,
+		MIN(len, setup_data->wLength), NULL);
+	return true;
+}
+
+bool usbd_uvc_setup_ep0(usbd_uvc *uvc,
+				const struct usb_setup_data *setup_data)
+{
+	usbd_device *dev = uvc->dev;
+
+	const uint8_t mask = USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT;
+	const uint8_t value = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE;
+
+	/* wIndex: entity (0 for the interface) | interface */
+	if ((setup_data->bmRequestType & mask) != value ||
+			setup_data->wIndex != uvc->config.interface) {
+		return false;
+	}
+
+	uvc->selector = setup_data->wValue >> 8;
+	if (uvc->selector != USB_VIDEO_VS_PROBE_CONTROL &&
+			uvc->selector != USB_VIDEO_VS_COMMIT_CONTROL) {
+		usbd_ep0_stall(dev);
+		return true;
+	}
+
+	if (setup_data->bRequest != USB_VIDEO_REQ_SET_CUR) {
+		if (!get_control(uvc, setup_data)) {
+			usbd_ep0_stall(dev);
+		}
+		return true;
+	}
+
+	if (setup_data->wLength < CONTROL_SIZE_MIN ||
+			setup_data->wLength > sizeof(uvc->control.ctl)) {
+		usbd_ep0_stall(dev);
+		return true;
+	}
+
+	/* Fields not sent (older revision) keep the current value */
+	uvc->control.ctl = uvc->selector == USB_VIDEO_VS_PROBE_CONTROL ?
+				uvc->probe : uvc->commit;
+	usbd_ep0_transfer(dev, setup_data, &uvc->control.ctl,
+		setup_data->wLength, set_cur_callback);
+	return true;
+}
+
+void usbd_uvc_start(usbd_uvc *uvc)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	cancel(uvc);
+	uvc->running = true;
+	kick(uvc);
+}
+
+void usbd_uvc_stop(usbd_uvc *uvc)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	cancel(uvc);
+}
+
+bool usbd_uvc_queue_frame(usbd_uvc *uvc, const void *data, size_t len,
+				void *cookie)
+{
+	struct usbd_uvc_frame *frame;
+	unsigned last;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!uvc->running || !len || len > uvc->committed->max_frame_size) {
+		uvc->stats.frames_dropped++;
+		return false;
+	}
+
+	if (uvc->frame.count == USBD_UVC_FRAMES) {
+		last = USBD_UVC_FRAMES - 1;
+
+		/* Only a frame not started can be replaced */
+		if (!uvc->config.keep_latest || last < uvc->frame.send ||
+				(last == uvc->frame.send && uvc->frame.offset)) {
+			uvc->stats.frames_dropped++;
+			return false;
+		}
+
+		frame = frame_slot(uvc, last);
+		uvc->stats.frames_dropped++;
+		frame_release(uvc, frame, false);
+	} else {
+		frame = frame_slot(uvc, uvc->frame.count++);
+	}
+
+	frame->data = data;
+	frame->len = len;
+	frame->cookie = cookie;
+
+	kick(uvc);
+	return true;
+}
+
+void usbd_uvc_get_stats(usbd_uvc *uvc, usbd_uvc_stats *stats)
+{
+	*stats = uvc->stats;
+}
@@ -59,19 +59,18 @@ usbd_device* usbd_init(const usbd_backend *backend,
 	dev->callback.set_config = NULL;
 	dev->callback.set_interface = NULL;
 	dev->callback.setup = NULL;
-
-	dev->urbs.next_id = 1;
+	dev->callback.poll_request = NULL;
+	dev->callback.dispatch_request = NULL;
 
 	dev->urbs.force_all_new_urb_to_waiting = false;
 
 	/* all are free */
 	dev->urbs.ep_free = ~0;
 
-	dev->urbs.active.head = NULL;
-	dev->urbs.active.tail = NULL;
-
-	dev->urbs.waiting.head = NULL;
-	dev->urbs.waiting.tail = NULL;
+	/* nothing active or waiting */
+	dev->urbs.ep_waiting = 0;
+	memset(dev->urbs.active, 0, sizeof(dev->urbs.active));
+	memset(dev->urbs.waiting, 0, sizeof(dev->urbs.waiting));
 
 	usbd_put_all_urb_into_unused(dev);
 
@@ -130,15 +129,38 @@ void usbd_poll(usbd_device *dev, uint32_t us)
 #if !defined(USBD_ENABLE_TIMEOUT)
 	(void) us;
 #endif
+#if defined(USBD_ENABLE_DEFERRED)
+	usbd_urb_accept_submitted(dev);
+#endif
+
 	dev->backend->poll(dev);
 
 #if defined(USBD_ENABLE_TIMEOUT)
 	uint64_t now = dev->last_poll + us;
-	usbd_timeout_checkup(dev, now);
+	/* URB submitted from timeout callback count from now
+	 *  (otherwise they could expire in the same checkup) */
 	dev->last_poll = now;
+	usbd_timeout_checkup(dev, now);
+#endif
+
+#if defined(USBD_ENABLE_DEFERRED)
+	/* Transfer submitted from callback performed in backend poll */
+	usbd_urb_accept_submitted(dev);
 #endif
 }
 
+void usbd_register_poll_request_callback(usbd_device *dev,
+				usbd_generic_callback callback)
+{
+	dev->callback.poll_request = callback;
+}
+
+void usbd_register_dispatch_request_callback(usbd_device *dev,
+				usbd_generic_callback callback)
+{
+	dev->callback.dispatch_request = callback;
+}
+
 void usbd_disconnect(usbd_device *dev, bool disconnect)
 {
 	if (dev->backend->disconnect) {
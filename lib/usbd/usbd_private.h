@@ -46,7 +46,9 @@
 /**
  * Compile time configuration: \n
  * USBD_URB_COUNT: Number of URB Object to allocate (default: 20) \n
- * USBD_ENABLE_TIMEOUT: Define to enable timeout functionality (default: undefined)
+ * USBD_ENABLE_TIMEOUT: Define to enable timeout functionality (default: undefined) \n
+ * USBD_ENABLE_DEFERRED: Define to allow non-control transfer submission from
+ *   any context (default: undefined). See usbd_dispatch().
  */
 
 #if defined(USBD_URB_COUNT) && (USBD_URB_COUNT < 1)
@@ -54,10 +56,24 @@
 	"USBD_URB_COUNT less than 1 is meaningless in our universe."
 #endif
 
+#if defined(USBD_URB_COUNT) && (USBD_URB_COUNT > 0xFFFF)
+# error "USBD_URB_COUNT do not fit in the index part of URB ID (16bit)."
+#endif
+
 #if !defined(USBD_URB_COUNT)
 # define USBD_URB_COUNT 20
 #endif
 
+/**
+ * State shared by usbd_poll() and the application (stream, class) that is
+ *  not lock-free is only touched in this context, default: interrupts
+ *  masked. Can be defined empty if both run in the same context.
+ */
+#if !defined(USBD_ATOMIC_CONTEXT)
+# include <unicore-mx/cm3/cortex.h>
+# define USBD_ATOMIC_CONTEXT() CM_ATOMIC_CONTEXT()
+#endif
+
 #if defined(USBD_INTEFACE_MAX) && (USBD_INTEFACE_MAX < 0)
 # error "Sanity check failed!!! go get sleep."				\
 	"USBD_INTEFACE_MAX less than 0 is meaningless in our universe."
@@ -80,6 +96,12 @@
 
 #if defined(__DOXYGEN__)
 # define USBD_ENABLE_TIMEOUT
+# define USBD_ENABLE_DEFERRED
+#endif
+
+#if defined(USBD_ENABLE_DEFERRED) && defined(__arm__) && \
+	!defined(__ARM_ARCH_7M__) && !defined(__ARM_ARCH_7EM__)
+# error "USBD_ENABLE_DEFERRED require LDREX/STREX (ARMv7-M)"
 #endif
 
 /* define macro "USBD_ENABLE_TIMEOUT" to enable timeout functionality.
@@ -89,13 +111,69 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+/**
+ * URB ID layout:
+ *  bit 0-15: Index of the URB in usbd_device::urbs::arr
+ *  bit 16-63: Sequence number of the URB object
+ *             (incremented on every use, starts from 1,
+ *              so ID is never USBD_INVALID_URB_ID)
+ *
+ * This allow to reach the URB from the ID without searching.
+ * Sequence number make sure that a stale ID do not match a reused URB.
+ */
+#define USBD_URB_ID_INDEX_BITS 16
+#define USBD_URB_ID_INDEX_MASK ((1 << USBD_URB_ID_INDEX_BITS) - 1)
+#define USBD_URB_ID(seq, index) \
+	(((usbd_urb_id) (seq) << USBD_URB_ID_INDEX_BITS) | (index))
+#define USBD_URB_ID_INDEX(id) ((id) & USBD_URB_ID_INDEX_MASK)
+#define USBD_URB_ID_SEQ(id) ((id) >> USBD_URB_ID_INDEX_BITS)
+
+/**
+ * Number of endpoint slots.
+ * Slot n (where n = 0-15) - Endpoint OUT n
+ * Slot n+16 (where n = 0-15) - Endpoint IN n
+ */
+#define USBD_EP_SLOT_COUNT 32
+
+/** usbd_urb::timeout_index of URB that is not in the timeout heap */
+#define USBD_TIMEOUT_NOT_QUEUED 0xFFFF
+
+enum usbd_urb_state {
+	USBD_URB_UNUSED = 0, /**< In unused list */
+	USBD_URB_WAITING, /**< In endpoint waiting queue */
+	USBD_URB_ACTIVE, /**< Endpoint active URB (submitted to backend) */
+#if defined(USBD_ENABLE_DEFERRED)
+	USBD_URB_QUEUED, /**< In submitted list (not seen by usbd_poll() yet) */
+	USBD_URB_DONE /**< In done list (callback pending) */
+#endif
+};
+
 struct usbd_urb {
-	uint64_t id;
+	usbd_urb_id id;
 	usbd_transfer transfer;
 #if defined(USBD_ENABLE_TIMEOUT)
 	uint64_t timeout_on;
+
+	/** Position in usbd_device::urbs::timeout::heap
+	 *  (USBD_TIMEOUT_NOT_QUEUED if not present) */
+	uint16_t timeout_index;
+#endif
+	enum usbd_urb_state state;
+	struct usbd_urb *next, *prev;
+
+#if defined(USBD_ENABLE_DEFERRED)
+	/** Status to provide to callback (in done list) */
+	usbd_transfer_status status;
 #endif
-	struct usbd_urb *next;
+
+	/**
+	 * Position of transfer::transferred in segment list
+	 *  (only for USBD_FLAG_SEGMENTED transfer)
+	 */
+	struct {
+		const usbd_segment *seg;
+		size_t offset;
+	} cursor;
 };
 
 typedef struct usbd_urb usbd_urb;
@@ -141,6 +219,12 @@ struct usbd_device {
 
 		/** invoked on SET_INTERFACE */
 		usbd_set_interface_callback set_interface;
+
+		/** invoked when transfer is queued (USBD_ENABLE_DEFERRED) */
+		usbd_generic_callback poll_request;
+
+		/** invoked when callback is queued (USBD_ENABLE_DEFERRED) */
+		usbd_generic_callback dispatch_request;
 	} callback;
 
 	/** Backend */
@@ -154,18 +238,22 @@ struct usbd_device {
 #endif
 
 	/**
-	 * @a active - URB that are being processed
-	 * @a waiting - URB that are waiting to be added to @a active once
-	 *                  the endpoint become free.
+	 * URB are tracked per endpoint (see USBD_EP_SLOT_COUNT for slot layout).
+	 * @a active - URB that is being processed by the endpoint
+	 * @a waiting - URB that are waiting for the endpoint to become free.
+	 *                  (in the order they were submitted)
 	 */
 	struct {
+		/** Active URB of the endpoint (NULL if no URB active) */
+		usbd_urb *active[USBD_EP_SLOT_COUNT];
+
 		/**
 		 * @a head - Head of the Queue
 		 * @a tail - Tail of the Queue
 		 */
 		struct usbd_urb_queue {
 			usbd_urb *head, *tail;
-		} active, waiting;
+		} waiting[USBD_EP_SLOT_COUNT];
 
 		/**
 		 * 1 Means the endpoint is free to be used.
@@ -179,13 +267,41 @@ struct usbd_device {
 		 */
 		uint32_t ep_free;
 
+		/**
+		 * 1 Means the endpoint waiting queue is not empty.
+		 * (same layout as @a ep_free)
+		 */
+		uint32_t ep_waiting;
+
 		/** List of unused objects (invalid) and empty shell for transfer */
-		usbd_urb *unused;
+		usbd_urb *volatile unused;
+
+#if defined(USBD_ENABLE_DEFERRED)
+		/**
+		 * Lock-free lists (LIFO, linked with usbd_urb::next).
+		 * @a submitted - URB submitted from any context,
+		 *    moved to endpoint slots in usbd_poll().
+		 * @a done - URB completed in usbd_poll(),
+		 *    callback is performed in usbd_dispatch().
+		 * @a unused is also lock-free in this mode.
+		 */
+		usbd_urb *volatile submitted, *volatile done;
+#endif
 
 		/** Array of URB allocated at compile time */
 		usbd_urb arr[USBD_URB_COUNT];
 
-		uint64_t next_id;
+#if defined(USBD_ENABLE_TIMEOUT)
+		/**
+		 * URB (with timeout) ordered by usbd_urb::timeout_on (binary min-heap).
+		 * heap[0] is the URB that will timeout first, so usbd_poll()
+		 *  only need to look at it when nothing has expired.
+		 */
+		struct {
+			usbd_urb *heap[USBD_URB_COUNT];
+			unsigned count;
+		} timeout;
+#endif
 
 		/** Only allow EP0 transfer.
 		 *  main use case is, ep_prepare_start and ep_prepare_end block */
@@ -277,19 +393,23 @@ extern void usbd_log_printf(const char *fmt, ...)
 void usbd_urb_complete(usbd_device *dev, usbd_urb *urb,
 						usbd_transfer_status status);
 
-void usbd_urb_detach_from_active(usbd_device *dev, usbd_urb *urb);
-
 void usbd_urb_schedule(usbd_device *dev);
 
 usbd_urb *usbd_find_active_urb(usbd_device *dev, uint8_t ep);
 
 void *usbd_urb_get_buffer_pointer(usbd_device *dev, usbd_urb *urb, size_t len);
+const usbd_segment *usbd_urb_get_segment(usbd_device *dev, usbd_urb *urb,
+					size_t len, size_t *offset);
 void usbd_urb_inc_data_pointer(usbd_device *dev, usbd_urb *urb, size_t len);
 
 #if defined(USBD_ENABLE_TIMEOUT)
 void usbd_timeout_checkup(usbd_device *dev, uint64_t now);
 #endif
 
+#if defined(USBD_ENABLE_DEFERRED)
+void usbd_urb_accept_submitted(usbd_device *dev);
+#endif
+
 void usbd_purge_all_transfer(usbd_device *dev, usbd_transfer_status status);
 
 void usbd_put_all_urb_into_unused(usbd_device *dev);
@@ -297,6 +417,7 @@ void usbd_put_all_urb_into_unused(usbd_device *dev);
 void usbd_purge_all_non_ep0_transfer(usbd_device *dev,
 			usbd_transfer_status status);
 
+static inline unsigned ep_slot_index(uint8_t ep_addr);
 static inline uint32_t ep_free_mask(uint8_t ep_addr);
 static inline void usbd_handle_suspend(usbd_device *dev);
 static inline void usbd_handle_resume(usbd_device *dev);
@@ -308,19 +429,29 @@ static inline bool is_ep_free(usbd_device *dev, uint8_t ep_addr);
 static inline void mark_ep_as_free(usbd_device *dev, uint8_t ep_addr, bool yes);
 
 /**
- * Get the DTOG bit mask for @a ep_addr
+ * Get the endpoint slot index for @a ep_addr
  * @param[in] ep_addr Endpoint address (including direction)
- * @return mask
+ * @return slot index (see USBD_EP_SLOT_COUNT)
  */
-static inline uint32_t ep_free_mask(uint8_t ep_addr)
+static inline unsigned ep_slot_index(uint8_t ep_addr)
 {
-	uint32_t num = ENDPOINT_NUMBER(ep_addr);
+	unsigned num = ep_addr & 0x0F;
 
 	if (IS_IN_ENDPOINT(ep_addr)) {
 		num += 16;
 	}
 
-	return 1 << num;
+	return num;
+}
+
+/**
+ * Get the ep_free bit mask for @a ep_addr
+ * @param[in] ep_addr Endpoint address (including direction)
+ * @return mask
+ */
+static inline uint32_t ep_free_mask(uint8_t ep_addr)
+{
+	return ((uint32_t) 1) << ep_slot_index(ep_addr);
 }
 
 /**
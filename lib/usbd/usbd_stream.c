@@ -0,0 +1,447 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unicore-mx/usbd/usbd.h>
+#include <unicore-mx/usbd/stream.h>
+#include "usbd_private.h"
+
+/*
+ * Slot life cycle:
+ *
+ * IN:  FREE -> FILL (write) -> ARMED (full, flush or endpoint idle) -> FREE
+ * OUT: FREE -> ARMED (start or read) -> DATA (complete) -> ARMED (consumed)
+ *
+ * Slots are armed in ring order, so URB complete in ring order
+ *  and stream::app (fill or consume slot) just follow them.
+ */
+
+#define IS_IN_STREAM(stream) IS_IN_ENDPOINT((stream)->config.ep_addr)
+
+static void transfer_callback(usbd_device *dev,
+		const usbd_transfer *transfer, usbd_transfer_status status,
+		usbd_urb_id urb_id);
+
+static inline uint8_t *slot_buffer(usbd_stream *stream, unsigned index)
+{
+	return (uint8_t *) stream->config.buffer + (index * stream->config.chunk);
+}
+
+static inline uint8_t next_slot(usbd_stream *stream, uint8_t index)
+{
+	return (++index == stream->config.depth) ? 0 : index;
+}
+
+/**
+ * Submit URB for slot @a index
+ * @param[in] stream Stream
+ * @param[in] index Slot index
+ * @param[in] flags Extra transfer flags
+ */
+static void slot_arm(usbd_stream *stream, uint8_t index,
+						usbd_transfer_flags flags)
+{
+	bool in = IS_IN_STREAM(stream);
+
+	if (in) {
+		/* Without short packet flag, a multiple of ep_size is not ended */
+		stream->unterminated = !(flags & USBD_FLAG_SHORT_PACKET) &&
+			!(stream->slot[index].len % stream->config.ep_size);
+	} else {
+		stream->slot[index].len = 0;
+		stream->slot[index].pos = 0;
+	}
+
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = stream->config.ep_addr,
+		.ep_size = stream->config.ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = slot_buffer(stream, index),
+		.length = in ? stream->slot[index].len : stream->config.chunk,
+		.flags = flags | (in ? USBD_FLAG_NONE : USBD_FLAG_SHORT_PACKET),
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = transfer_callback,
+		.user_data = stream
+	};
+
+	stream->slot[index].state = USBD_STREAM_SLOT_ARMED;
+	stream->slot[index].urb_id = USBD_INVALID_URB_ID;
+	stream->armed++;
+
+	usbd_urb_id urb_id = usbd_transfer_submit(stream->dev, &transfer);
+
+	/* URB could have completed (and slot re-armed) on submit */
+	if (stream->slot[index].state == USBD_STREAM_SLOT_ARMED &&
+		stream->slot[index].urb_id == USBD_INVALID_URB_ID) {
+		stream->slot[index].urb_id = urb_id;
+	}
+}
+
+/**
+ * Arm the IN slot being filled (if it has any data)
+ * @param[in] stream Stream
+ * @param[in] flags Extra transfer flags
+ */
+static void in_arm_fill(usbd_stream *stream, usbd_transfer_flags flags)
+{
+	uint8_t index = stream->app;
+
+	if (!stream->running ||
+		stream->slot[index].state != USBD_STREAM_SLOT_FILL ||
+		!stream->slot[index].len) {
+		return;
+	}
+
+	/* Move to next slot before submit, callback can be performed on submit */
+	stream->app = next_slot(stream, index);
+	slot_arm(stream, index, flags);
+}
+
+/**
+ * End the host read: arm the IN slot being filled with short packet flag,
+ *  or a ZLP if the data already armed end with a full packet
+ * @param[in] stream Stream
+ * @return false if all slots are armed (ZLP need to wait)
+ */
+static bool in_arm_end(usbd_stream *stream)
+{
+	uint8_t index = stream->app;
+
+	if (!stream->running) {
+		return true;
+	}
+
+	if (stream->slot[index].state == USBD_STREAM_SLOT_FILL &&
+		stream->slot[index].len) {
+		in_arm_fill(stream, USBD_FLAG_SHORT_PACKET);
+		return true;
+	}
+
+	if (!stream->unterminated) {
+		return true;
+	}
+
+	if (stream->slot[index].state == USBD_STREAM_SLOT_ARMED) {
+		return false;
+	}
+
+	stream->slot[index].len = 0;
+	stream->app = next_slot(stream, index);
+	slot_arm(stream, index, USBD_FLAG_SHORT_PACKET);
+	return true;
+}
+
+/**
+ * Handle completion of slot URB
+ * @param[in] stream Stream
+ * @param[in] transfer Transfer
+ * @param[in] status Status
+ * @param[in] urb_id URB ID
+ * @return true if application need to be notified
+ */
+static bool slot_complete(usbd_stream *stream, const usbd_transfer *transfer,
+				usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	uint8_t index = ((uint8_t *) transfer->buffer -
+		slot_buffer(stream, 0)) / stream->config.chunk;
+	bool in = IS_IN_STREAM(stream);
+
+	/* Callback of URB from before stop (possible with USBD_ENABLE_DEFERRED).
+	 *  ID is not known yet if completed on submit. */
+	if (stream->slot[index].state != USBD_STREAM_SLOT_ARMED ||
+		(stream->slot[index].urb_id != urb_id &&
+		stream->slot[index].urb_id != USBD_INVALID_URB_ID)) {
+		return false;
+	}
+
+	stream->slot[index].urb_id = USBD_INVALID_URB_ID;
+	stream->armed--;
+
+	switch (status) {
+	case USBD_SUCCESS:
+		stream->stats.urbs++;
+		stream->stats.bytes += transfer->transferred;
+	break;
+	case USBD_ERR_CANCEL:
+	case USBD_ERR_CONFIG_CHANGE:
+	case USBD_ERR_CONN:
+	case USBD_ERR_RES_UNAVAIL:
+	case USBD_ERR_INVALID:
+		/* Not recoverable, remaining URB (if any) are cancelled by
+		 *  the stack or left to complete */
+		LOGF_LN("stream 0x%"PRIx8": stopped (status=%i)",
+			stream->config.ep_addr, status);
+		stream->running = false;
+		stream->slot[index].state = USBD_STREAM_SLOT_FREE;
+	return false;
+	default:
+		LOGF_LN("stream 0x%"PRIx8": URB failed (status=%i)",
+			stream->config.ep_addr, status);
+		stream->stats.errors++;
+	break;
+	}
+
+	if (in) {
+		/* Data was sent (or dropped), slot can be filled again */
+		stream->slot[index].state = USBD_STREAM_SLOT_FREE;
+		stream->slot[index].len = 0;
+
+		if (stream->zlp_pending) {
+			/* A slot is free now */
+			stream->zlp_pending = !in_arm_end(stream);
+		} else if (!stream->armed) {
+			if (stream->slot[stream->app].state == USBD_STREAM_SLOT_FILL) {
+				/* Keep the endpoint busy with whatever is available */
+				in_arm_fill(stream, USBD_FLAG_NONE);
+			} else {
+				stream->stats.underrun++;
+			}
+		}
+	} else {
+		/* Partial data (in case of error) is kept, so data stay in order */
+		stream->slot[index].state = stream->running ?
+			USBD_STREAM_SLOT_DATA : USBD_STREAM_SLOT_FREE;
+		stream->slot[index].len = transfer->transferred;
+		stream->slot[index].pos = 0;
+
+		if (!stream->armed) {
+			/* All slot full, host will get NAK till application read */
+			stream->stats.overrun++;
+		}
+	}
+
+	return stream->running;
+}
+
+static void transfer_callback(usbd_device *dev,
+		const usbd_transfer *transfer, usbd_transfer_status status,
+		usbd_urb_id urb_id)
+{
+	(void) dev;
+
+	usbd_stream *stream = transfer->user_data;
+
+	if (slot_complete(stream, transfer, status, urb_id) &&
+		stream->config.callback != NULL) {
+		stream->config.callback(stream);
+	}
+}
+
+void usbd_stream_init(usbd_stream *stream, usbd_device *dev,
+					const usbd_stream_config *config)
+{
+	memset(stream, 0, sizeof(*stream));
+	stream->dev = dev;
+	stream->config = *config;
+
+	if (!stream->config.depth) {
+		stream->config.depth = 1;
+	} else if (stream->config.depth > USBD_STREAM_DEPTH_MAX) {
+		LOGF_LN("stream 0x%"PRIx8": depth %"PRIu8" limited to %u",
+			config->ep_addr, config->depth, USBD_STREAM_DEPTH_MAX);
+		stream->config.depth = USBD_STREAM_DEPTH_MAX;
+	}
+}
+
+void usbd_stream_start(usbd_stream *stream)
+{
+	uint8_t i;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (stream->running) {
+		return;
+	}
+
+	for (i = 0; i < stream->config.depth; i++) {
+		stream->slot[i].state = USBD_STREAM_SLOT_FREE;
+		stream->slot[i].len = 0;
+		stream->slot[i].pos = 0;
+		stream->slot[i].urb_id = USBD_INVALID_URB_ID;
+	}
+
+	stream->app = 0;
+	stream->armed = 0;
+	stream->unterminated = false;
+	stream->zlp_pending = false;
+	stream->running = true;
+
+	if (!IS_IN_STREAM(stream)) {
+		for (i = 0; i < stream->config.depth && stream->running; i++) {
+			slot_arm(stream, i, USBD_FLAG_NONE);
+		}
+	}
+}
+
+void usbd_stream_stop(usbd_stream *stream)
+{
+	uint8_t i;
+
+	USBD_ATOMIC_CONTEXT();
+
+	stream->running = false;
+
+	for (i = 0; i < stream->config.depth; i++) {
+		usbd_urb_id urb_id = stream->slot[i].urb_id;
+		if (stream->slot[i].state == USBD_STREAM_SLOT_ARMED &&
+			urb_id != USBD_INVALID_URB_ID) {
+			usbd_transfer_cancel(stream->dev, urb_id);
+		}
+	}
+
+	for (i = 0; i < stream->config.depth; i++) {
+		stream->slot[i].state = USBD_STREAM_SLOT_FREE;
+		stream->slot[i].len = 0;
+		stream->slot[i].pos = 0;
+	}
+
+	/* Cancel callback can be deferred */
+	stream->app = 0;
+	stream->armed = 0;
+	stream->unterminated = false;
+	stream->zlp_pending = false;
+}
+
+size_t usbd_stream_write(usbd_stream *stream, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+	size_t done = 0;
+
+	USBD_ATOMIC_CONTEXT();
+
+	if (!stream->running) {
+		return 0;
+	}
+
+	while (done < len) {
+		uint8_t index = stream->app;
+
+		if (stream->slot[index].state == USBD_STREAM_SLOT_FREE) {
+			stream->slot[index].state = USBD_STREAM_SLOT_FILL;
+			stream->slot[index].len = 0;
+		} else if (stream->slot[index].state != USBD_STREAM_SLOT_FILL) {
+			/* All slots are in flight */
+			stream->stats.overrun++;
+			break;
+		}
+
+		size_t space = stream->config.chunk - stream->slot[index].len;
+		size_t n = MIN(space, len - done);
+
+		memcpy(slot_buffer(stream, index) + stream->slot[index].len,
+			src + done, n);
+		stream->slot[index].len += n;
+		done += n;
+
+		if (stream->slot[index].len == stream->config.chunk) {
+			in_arm_fill(stream, USBD_FLAG_NONE);
+			if (!stream->running) {
+				break;
+			}
+		}
+	}
+
+	if (!stream->armed) {
+		/* Endpoint is idle, do not wait for the slot to fill up */
+		in_arm_fill(stream, USBD_FLAG_NONE);
+	}
+
+	return done;
+}
+
+void usbd_stream_flush(usbd_stream *stream)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	/* End with short packet (or ZLP), so that host read complete */
+	stream->zlp_pending = !in_arm_end(stream);
+}
+
+size_t usbd_stream_read(usbd_stream *stream, void *data, size_t len)
+{
+	uint8_t *dest = data;
+	size_t done = 0;
+
+	USBD_ATOMIC_CONTEXT();
+
+	while (done < len) {
+		uint8_t index = stream->app;
+
+		if (stream->slot[index].state != USBD_STREAM_SLOT_DATA) {
+			break;
+		}
+
+		size_t avail = stream->slot[index].len - stream->slot[index].pos;
+		size_t n = MIN(avail, len - done);
+
+		memcpy(dest + done, slot_buffer(stream, index) +
+			stream->slot[index].pos, n);
+		stream->slot[index].pos += n;
+		done += n;
+
+		if (stream->slot[index].pos == stream->slot[index].len) {
+			/* Slot consumed, give it back to host */
+			stream->app = next_slot(stream, index);
+			if (stream->running) {
+				slot_arm(stream, index, USBD_FLAG_NONE);
+			} else {
+				stream->slot[index].state = USBD_STREAM_SLOT_FREE;
+			}
+		}
+	}
+
+	if (len && !done) {
+		stream->stats.underrun++;
+	}
+
+	return done;
+}
+
+size_t usbd_stream_space(usbd_stream *stream)
+{
+	size_t result = 0;
+	uint8_t i;
+
+	USBD_ATOMIC_CONTEXT();
+
+	for (i = 0; i < stream->config.depth; i++) {
+		if (IS_IN_STREAM(stream)) {
+			if (!stream->running) {
+				break;
+			} else if (stream->slot[i].state == USBD_STREAM_SLOT_FREE) {
+				result += stream->config.chunk;
+			} else if (stream->slot[i].state == USBD_STREAM_SLOT_FILL) {
+				result += stream->config.chunk - stream->slot[i].len;
+			}
+		} else if (stream->slot[i].state == USBD_STREAM_SLOT_DATA) {
+			result += stream->slot[i].len - stream->slot[i].pos;
+		}
+	}
+
+	return result;
+}
+
+void usbd_stream_get_stats(usbd_stream *stream, usbd_stream_stats *stats)
+{
+	USBD_ATOMIC_CONTEXT();
+
+	*stats = stream->stats;
+}
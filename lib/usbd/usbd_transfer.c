@@ -21,16 +21,20 @@
 #include <unicore-mx/usbd/usbd.h>
 #include "usbd_private.h"
 
+#if defined(USBD_ENABLE_DEFERRED) && defined(__arm__)
+# include <unicore-mx/cm3/sync.h>
+#endif
+
 /*
  * The Transfer design is such that application code submit transfer.
  * Transfer is encapsulated in to an URB.
  * Based on the availibility of the endpoint, the URB is submitted to backend.
- *   If endpoint available:
+ *   If endpoint available (and no URB waiting for it):
  *     - endpoint is marked as not-available (anymore)
- *     - append to active list
+ *     - URB become the endpoint active URB
  *     - submit to backend
  *   if endpoint not available:
- *      - append to waiting list
+ *      - append to endpoint waiting queue
  *
  * Later, when the endpoint is freed
  *    (transfer succesfully finished, cancellled, timeout etc..)
@@ -45,7 +49,7 @@
  * In the design, while the endpoint is being prepared (in SET_CONFIGURATION)
  *   All transfer transfer are force to be added to Waiting list.
  *  and right after endpoint preperation has completed,
- *    scheduling is done in the order they were added.
+ *    scheduling is done in the order they were added (per endpoint).
  *
  *
  * endpoint preperation is a method in which the backend is told about the
@@ -53,7 +57,25 @@
  *  based on the description, it allocate resource specific to the periph.
  * endpoint preperation is just an hint for the stack, they can be ignored!
  *
- * There are 3 queue [active, waiting, unused].
+ * Every endpoint (direction included) has a slot [active, waiting]
+ *  and there is one global "unused" list.
+ * ep_waiting bitmap tell which slot has waiting URB, so that scheduling
+ *  only touch the endpoint that can actually make progress.
+ * URB ID contain the URB index, so finding the URB from ID do not require
+ *  any search. (see USBD_URB_ID())
+ * All the operation (submit, complete, cancel, schedule) are independent of
+ *  USBD_URB_COUNT.
+ *
+ * With USBD_ENABLE_TIMEOUT, URB that can timeout are also kept in a min-heap
+ *  ordered by deadline (timeout_on). Timeout checkup only look at the top
+ *  of the heap, so it is O(1) when nothing has expired.
+ *
+ * With USBD_ENABLE_DEFERRED, non-control URB do not touch the endpoint slots
+ *  from the submitting context: they are pushed to the lock-free "submitted"
+ *  list and accepted (moved to slot) in usbd_poll().
+ *  When done, they are pushed to the lock-free "done" list and
+ *  the callback is performed from usbd_dispatch().
+ *  "unused" list is also lock-free, so a URB can be taken from any context.
  *
  * When a URB is done (or at init or reset), the object is moved to "unused".
  * When a new transfer is submitted, a "unused" URB object is poped and
@@ -88,6 +110,215 @@ static const char *stringify_transfer_status(usbd_transfer_status status) {
 }
 #endif
 
+#if defined(USBD_ENABLE_TIMEOUT)
+/**
+ * Store the URB at @a index in the timeout heap
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] index Heap index
+ */
+static inline void timeout_place(usbd_device *dev, usbd_urb *urb,
+						unsigned index)
+{
+	dev->urbs.timeout.heap[index] = urb;
+	urb->timeout_index = index;
+}
+
+/**
+ * Move the URB at @a index towards the top till its parent expire before it
+ * @param[in] dev USB Device
+ * @param[in] index Heap index
+ */
+static void timeout_sift_up(usbd_device *dev, unsigned index)
+{
+	usbd_urb **heap = dev->urbs.timeout.heap;
+	usbd_urb *urb = heap[index];
+
+	while (index > 0) {
+		unsigned parent = (index - 1) / 2;
+
+		if (heap[parent]->timeout_on <= urb->timeout_on) {
+			break;
+		}
+
+		timeout_place(dev, heap[parent], index);
+		index = parent;
+	}
+
+	timeout_place(dev, urb, index);
+}
+
+/**
+ * Move the URB at @a index towards the bottom till its childs expire after it
+ * @param[in] dev USB Device
+ * @param[in] index Heap index
+ */
+static void timeout_sift_down(usbd_device *dev, unsigned index)
+{
+	usbd_urb **heap = dev->urbs.timeout.heap;
+	unsigned count = dev->urbs.timeout.count;
+	usbd_urb *urb = heap[index];
+
+	for (;;) {
+		unsigned child = (index * 2) + 1;
+
+		if (child >= count) {
+			break;
+		}
+
+		if ((child + 1) < count &&
+			heap[child + 1]->timeout_on < heap[child]->timeout_on) {
+			child++;
+		}
+
+		if (urb->timeout_on <= heap[child]->timeout_on) {
+			break;
+		}
+
+		timeout_place(dev, heap[child], index);
+		index = child;
+	}
+
+	timeout_place(dev, urb, index);
+}
+
+/**
+ * Add the URB to the timeout heap
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block (with timeout)
+ */
+static void timeout_insert(usbd_device *dev, usbd_urb *urb)
+{
+	unsigned index = dev->urbs.timeout.count++;
+
+	timeout_place(dev, urb, index);
+	timeout_sift_up(dev, index);
+}
+
+/**
+ * Remove the URB from the timeout heap
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block (should be in timeout heap)
+ */
+static void timeout_remove(usbd_device *dev, usbd_urb *urb)
+{
+	unsigned index = urb->timeout_index;
+	usbd_urb *last = dev->urbs.timeout.heap[--dev->urbs.timeout.count];
+
+	urb->timeout_index = USBD_TIMEOUT_NOT_QUEUED;
+
+	if (last == urb) {
+		return;
+	}
+
+	/* Fill the hole with the last URB, and restore the heap order */
+	timeout_place(dev, last, index);
+
+	if (index > 0 &&
+		dev->urbs.timeout.heap[(index - 1) / 2]->timeout_on > last->timeout_on) {
+		timeout_sift_up(dev, index);
+	} else {
+		timeout_sift_down(dev, index);
+	}
+}
+#endif
+
+#if defined(USBD_ENABLE_DEFERRED)
+/*
+ * Lock-free URB list (LIFO) operations.
+ * On ARMv7-M, the exclusive monitor is cleared on exception entry and return,
+ *  so a context preempted between LDREX and STREX retry
+ *  (the list cannot change under it without being noticed).
+ * Host build (test) use compiler atomic builtins.
+ */
+
+/**
+ * Push URB to list
+ * @param[in] head List head
+ * @param[in] urb USB Request Block
+ */
+static void lf_push(usbd_urb *volatile *head, usbd_urb *urb)
+{
+#if defined(__arm__)
+	/* URB content should be visible before it is published */
+	__dmb();
+
+	do {
+		urb->next = (usbd_urb *) __ldrex((volatile uint32_t *) head);
+	} while (__strex((uint32_t) urb, (volatile uint32_t *) head));
+#else
+	usbd_urb *next = *head;
+
+	do {
+		urb->next = next;
+	} while (!__atomic_compare_exchange_n(head, &next, urb, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+#endif
+}
+
+/**
+ * Pop URB from list
+ * @param[in] head List head
+ * @return URB (NULL if list is empty)
+ */
+static usbd_urb *lf_pop(usbd_urb *volatile *head)
+{
+	usbd_urb *urb;
+
+#if defined(__arm__)
+	do {
+		urb = (usbd_urb *) __ldrex((volatile uint32_t *) head);
+		if (urb == NULL) {
+			return NULL;
+		}
+	} while (__strex((uint32_t) urb->next, (volatile uint32_t *) head));
+
+	__dmb();
+#else
+	urb = *head;
+
+	do {
+		if (urb == NULL) {
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(head, &urb, urb->next, true,
+				__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+#endif
+
+	return urb;
+}
+
+/**
+ * Take all URB from list (list become empty)
+ * @param[in] head List head
+ * @return URB in the order they were pushed (NULL if list was empty)
+ */
+static usbd_urb *lf_take_all(usbd_urb *volatile *head)
+{
+	usbd_urb *list, *fifo = NULL;
+
+#if defined(__arm__)
+	do {
+		list = (usbd_urb *) __ldrex((volatile uint32_t *) head);
+	} while (__strex(0, (volatile uint32_t *) head));
+
+	__dmb();
+#else
+	list = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+#endif
+
+	/* LIFO to FIFO */
+	while (list != NULL) {
+		usbd_urb *urb = list;
+		list = urb->next;
+		urb->next = fifo;
+		fifo = urb;
+	}
+
+	return fifo;
+}
+#endif
+
 /**
  * Get for a free URB
  * @param[in] dev USB Device
@@ -96,6 +327,13 @@ static const char *stringify_transfer_status(usbd_transfer_status status) {
  */
 static inline usbd_urb *unused_pop(usbd_device *dev)
 {
+#if defined(USBD_ENABLE_DEFERRED)
+	usbd_urb *tmp = lf_pop(&dev->urbs.unused);
+	if (tmp == NULL) {
+		LOG_LN("WARN: all urb in use");
+	}
+	return tmp;
+#else
 	if (dev->urbs.unused == NULL) {
 		LOG_LN("WARN: all urb in use");
 		return NULL;
@@ -104,6 +342,7 @@ static inline usbd_urb *unused_pop(usbd_device *dev)
 	usbd_urb *tmp = dev->urbs.unused;
 	dev->urbs.unused = tmp->next;
 	return tmp;
+#endif
 }
 
 /**
@@ -113,8 +352,47 @@ static inline usbd_urb *unused_pop(usbd_device *dev)
  */
 static inline void unused_push(usbd_device *dev, usbd_urb *urb)
 {
+	urb->state = USBD_URB_UNUSED;
+#if defined(USBD_ENABLE_DEFERRED)
+	lf_push(&dev->urbs.unused, urb);
+#else
 	urb->next = dev->urbs.unused;
 	dev->urbs.unused = urb;
+#endif
+}
+
+/**
+ * The URB is done, perform callback and move it to unused list.
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block (detached from endpoint slot)
+ * @param[in] status Transfer status
+ * @note With USBD_ENABLE_DEFERRED, callback of non-control URB
+ *   is queued for usbd_dispatch()
+ */
+static void urb_done(usbd_device *dev, usbd_urb *urb,
+			usbd_transfer_status status)
+{
+#if defined(USBD_ENABLE_TIMEOUT)
+	if (urb->timeout_index != USBD_TIMEOUT_NOT_QUEUED) {
+		timeout_remove(dev, urb);
+	}
+#endif
+
+#if defined(USBD_ENABLE_DEFERRED)
+	if (urb->transfer.ep_type != USBD_EP_CONTROL) {
+		urb->status = status;
+		urb->state = USBD_URB_DONE;
+		lf_push(&dev->urbs.done, urb);
+
+		if (dev->callback.dispatch_request != NULL) {
+			dev->callback.dispatch_request(dev);
+		}
+		return;
+	}
+#endif
+
+	urb_callback(dev, urb, status);
+	unused_push(dev, urb);
 }
 
 /**
@@ -134,55 +412,130 @@ static void free_ep_from_urb(usbd_device *dev, usbd_urb *urb)
 }
 
 /**
- * Detach the item from the Queue
- * @param[in] queue Queue
- * @param[in] prev Previous item to @a item
- * @param[in] item Item to be detached
- * @return the next item in the queue (NULL if not available)
+ * Append the URB to the tail of its endpoint waiting queue
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
  */
-static usbd_urb *queue_item_detach(struct usbd_urb_queue *queue,
-				usbd_urb *prev, usbd_urb *item)
+static void waiting_append(usbd_device *dev, usbd_urb *urb)
 {
-	if (queue->head == queue->tail) {
-		/* two case:
-		 *  - the queue is fully empty (not possible)
-		 *  - single item (possible)
-		 */
-		queue->head = queue->tail = NULL;
-		return NULL;
+	unsigned slot = ep_slot_index(urb->transfer.ep_addr);
+	struct usbd_urb_queue *queue = &dev->urbs.waiting[slot];
+
+	urb->state = USBD_URB_WAITING;
+	urb->next = NULL;
+	urb->prev = queue->tail;
+
+	if (queue->tail == NULL) {
+		queue->head = urb;
+	} else {
+		queue->tail->next = urb;
+	}
+
+	queue->tail = urb;
+	dev->urbs.ep_waiting |= ((uint32_t) 1) << slot;
+}
+
+/**
+ * Detach the URB from its endpoint waiting queue
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block (should be in waiting queue)
+ */
+static void waiting_detach(usbd_device *dev, usbd_urb *urb)
+{
+	unsigned slot = ep_slot_index(urb->transfer.ep_addr);
+	struct usbd_urb_queue *queue = &dev->urbs.waiting[slot];
+
+	if (urb->prev == NULL) {
+		queue->head = urb->next;
+	} else {
+		urb->prev->next = urb->next;
 	}
 
-	/* Item at head? */
-	if (queue->head == item) {
-		queue->head = item->next;
-		return queue->head;
+	if (urb->next == NULL) {
+		queue->tail = urb->prev;
+	} else {
+		urb->next->prev = urb->prev;
 	}
 
-	/* Item at tail? */
-	if (queue->tail == item) {
-		queue->tail = prev;
-		prev->next = NULL;
-		return NULL;
+	if (queue->head == NULL) {
+		dev->urbs.ep_waiting &= ~(((uint32_t) 1) << slot);
 	}
+}
+
+/**
+ * Detach all URB from the endpoint waiting queue
+ * @param[in] dev USB Device
+ * @param[in] slot Endpoint slot
+ * @return list of URB (linked using usbd_urb::next, NULL if empty)
+ */
+static usbd_urb *waiting_detach_all(usbd_device *dev, unsigned slot)
+{
+	struct usbd_urb_queue *queue = &dev->urbs.waiting[slot];
+	usbd_urb *head = queue->head;
+
+	queue->head = queue->tail = NULL;
+	dev->urbs.ep_waiting &= ~(((uint32_t) 1) << slot);
 
-	prev->next = item->next;
-	return prev->next;
+	return head;
 }
 
-static void queue_item_append(struct usbd_urb_queue *queue, usbd_urb *urb)
+/**
+ * Make the URB active for the endpoint and submit it to backend.
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @note the endpoint should be free
+ */
+static void activate(usbd_device *dev, usbd_urb *urb)
 {
-	urb->next = NULL;
+	uint8_t addr = urb->transfer.ep_addr;
 
-	if (queue->head == NULL && queue->tail == NULL) {
-		queue->head = queue->tail = urb;
-	} else if (queue->head != NULL && queue->tail != NULL) {
-		queue->tail->next = urb;
-		queue->tail = urb;
-	} else {
-		/* Problem! */
-		LOGF_LN("URB Queue %p corrupt", queue);
-		queue->head = queue->tail = urb;
+	mark_ep_as_free(dev, addr, false);
+	dev->urbs.active[ep_slot_index(addr)] = urb;
+	urb->state = USBD_URB_ACTIVE;
+
+	dev->backend->urb_submit(dev, urb);
+}
+
+/**
+ * Remove the URB from the endpoint active slot and free the endpoint
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block (should be active)
+ */
+static void deactivate(usbd_device *dev, usbd_urb *urb)
+{
+	dev->urbs.active[ep_slot_index(urb->transfer.ep_addr)] = NULL;
+	free_ep_from_urb(dev, urb);
+}
+
+/**
+ * Find the URB using the URB ID
+ * @param[in] dev USB Device
+ * @param[in] urb_id URB ID
+ * @return URB (NULL if not found)
+ */
+static usbd_urb *urb_from_id(usbd_device *dev, usbd_urb_id urb_id)
+{
+	size_t index = USBD_URB_ID_INDEX(urb_id);
+
+	if (index >= USBD_URB_COUNT) {
+		return NULL;
+	}
+
+	usbd_urb *urb = &dev->urbs.arr[index];
+
+	/* ID will not match if URB has been reused */
+	if (urb->state == USBD_URB_UNUSED || urb->id != urb_id) {
+		return NULL;
+	}
+
+#if defined(USBD_ENABLE_DEFERRED)
+	/* Already completed (only callback is pending) */
+	if (urb->state == USBD_URB_DONE) {
+		return NULL;
 	}
+#endif
+
+	return urb;
 }
 
 #if defined(USBD_ENABLE_TIMEOUT)
@@ -206,51 +559,36 @@ static inline bool is_urb_timed_out(usbd_urb *urb, uint64_t now)
 	return true;
 }
 
-/**
- * Check for timeout of URB in @a queue.
- * @param dev USB Device
- * @param now Current time reference
- * @param queue Queue
- * @return true if any URB timeout
- * @return false if no URB timeout
- */
-static bool queue_timeout_check(usbd_device *dev, uint64_t now,
-					struct usbd_urb_queue *queue)
-{
-	bool any_urb_timedout = false;
-	usbd_urb *urb = queue->head, *prev = NULL, *tmp;
-
-	while (urb != NULL) {
-		if (!is_urb_timed_out(urb, now)) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
-
-		tmp = urb;
-		urb = queue_item_detach(queue, prev, tmp);
-		free_ep_from_urb(dev, tmp);
-		urb_callback(dev, tmp, USBD_ERR_TIMEOUT);
-		unused_push(dev, tmp);
-		any_urb_timedout = true;
-	}
-
-	return any_urb_timedout;
-}
-
 /**
  * Check if any URB has timeout out, it yes remove then with
  *  status = USBD_ERR_TIMEOUT
  * @param[in] dev USB Device
  * @param[in] now Current time reference
+ * @note URB are expired in order of their deadline.
  */
 void usbd_timeout_checkup(usbd_device *dev, uint64_t now)
 {
-	/* Check the Waiting Queue */
-	queue_timeout_check(dev, now, &dev->urbs.waiting);
+	bool any_active_urb_timedout = false;
+
+	while (dev->urbs.timeout.count) {
+		usbd_urb *urb = dev->urbs.timeout.heap[0];
+
+		/* Rest of the URB expire after this one */
+		if (!is_urb_timed_out(urb, now)) {
+			break;
+		}
 
-	/* Check the Active Queue */
-	if (queue_timeout_check(dev, now, &dev->urbs.active)) {
+		if (urb->state == USBD_URB_ACTIVE) {
+			deactivate(dev, urb);
+			any_active_urb_timedout = true;
+		} else {
+			waiting_detach(dev, urb);
+		}
+
+		urb_done(dev, urb, USBD_ERR_TIMEOUT);
+	}
+
+	if (any_active_urb_timedout) {
 		usbd_urb_schedule(dev);
 	}
 }
@@ -276,22 +614,34 @@ static inline bool ctrl_ep0_size_acceptable(uint16_t size)
 }
 
 /**
- * Try to assign allocate the endpoint for the URB
+ * Place the URB in its endpoint slot (active or waiting)
  * @param[in] dev USB Device
- * @param[in] urb USB Request Block
- * @return true if the endpoint has been assigned to @a urb
- * @return false if the endpoint cannot be assigned to @a urb
+ * @param[in] urb USB Request Block (filled with transfer)
  */
-static bool try_alloc_ep_for_urb(usbd_device *dev, usbd_urb *urb)
+static void urb_enqueue(usbd_device *dev, usbd_urb *urb)
 {
+#if defined(USBD_ENABLE_TIMEOUT)
+	urb->timeout_on = urb->transfer.timeout ?
+		(dev->last_poll + MS2US(urb->transfer.timeout)) : 0;
+	if (urb->transfer.timeout != USBD_TIMEOUT_NEVER) {
+		timeout_insert(dev, urb);
+	}
+#endif
+
+	/* URB already waiting for the endpoint go first */
 	uint8_t addr = urb->transfer.ep_addr;
+	bool to_active = !dev->urbs.force_all_new_urb_to_waiting &&
+						is_ep_free(dev, addr) &&
+						!(dev->urbs.ep_waiting & ep_free_mask(addr));
 
-	if (is_ep_free(dev, addr)) {
-		mark_ep_as_free(dev, addr, false);
-		return true;
-	}
+	LOGF_LN("[new] URB id=%"PRIu64" is %s", urb->id,
+					to_active ? "active" : "waiting");
 
-	return false;
+	if (to_active) {
+		activate(dev, urb);
+	} else {
+		waiting_append(dev, urb);
+	}
 }
 
 usbd_urb_id usbd_transfer_submit(usbd_device *dev,
@@ -308,6 +658,23 @@ usbd_urb_id usbd_transfer_submit(usbd_device *dev,
 		}
 	}
 
+	if (transfer->flags & USBD_FLAG_SEGMENTED) {
+		const usbd_segment *seg = transfer->buffer;
+		size_t i, sum = 0;
+
+		for (i = 0; i < transfer->seg_count; i++) {
+			sum += seg[i].len;
+		}
+
+		/* Cursor would walk past the segment array */
+		if (sum != transfer->length) {
+			LOGF_LN("Segment length sum %u do not match transfer length %u",
+					(unsigned) sum, (unsigned) transfer->length);
+			TRANSFER_CALLBACK(dev, transfer, USBD_ERR_INVALID, USBD_INVALID_URB_ID)
+			return USBD_INVALID_URB_ID;
+		}
+	}
+
 	/* check if got any URB free */
 	usbd_urb *urb = unused_pop(dev);
 	if (urb == NULL) {
@@ -316,14 +683,11 @@ usbd_urb_id usbd_transfer_submit(usbd_device *dev,
 	}
 
 	/* store the information in URB */
-	urb->id = dev->urbs.next_id++;
+	urb->id = USBD_URB_ID(USBD_URB_ID_SEQ(urb->id) + 1, urb - dev->urbs.arr);
 	urb->transfer = *transfer;
 	urb->transfer.transferred = 0;
-#if defined(USBD_ENABLE_TIMEOUT)
-	urb->timeout_on = transfer->timeout ?
-		(dev->last_poll + MS2US(transfer->timeout)) : 0;
-#endif
-
+	urb->cursor.seg = transfer->buffer;
+	urb->cursor.offset = 0;
 
 #if defined(USBD_DEBUG)
 	const char *ep_type_map_str[] = {
@@ -340,21 +704,57 @@ usbd_urb_id usbd_transfer_submit(usbd_device *dev,
 				urb->transfer.buffer, urb->transfer.length);
 #endif
 
-	bool to_active = !dev->urbs.force_all_new_urb_to_waiting &&
-						try_alloc_ep_for_urb(dev, urb);
+	/* Keep a copy, URB could be completed (and reused) on submit */
+	usbd_urb_id urb_id = urb->id;
 
-	LOGF_LN("[new] URB id=%"PRIu64" is %s", urb->id,
-					to_active ? "active" : "waiting");
+#if defined(USBD_ENABLE_DEFERRED)
+	if (transfer->ep_type != USBD_EP_CONTROL) {
+		/* Endpoint slots are only touched from usbd_poll() */
+		urb->state = USBD_URB_QUEUED;
+		lf_push(&dev->urbs.submitted, urb);
 
-	if (to_active) {
-		mark_ep_as_free(dev, urb->transfer.ep_addr, false);
-		queue_item_append(&dev->urbs.active, urb);
-		dev->backend->urb_submit(dev, urb);
-	} else {
-		queue_item_append(&dev->urbs.waiting, urb);
+		if (dev->callback.poll_request != NULL) {
+			dev->callback.poll_request(dev);
+		}
+
+		return urb_id;
+	}
+#endif
+
+	urb_enqueue(dev, urb);
+
+	return urb_id;
+}
+
+#if defined(USBD_ENABLE_DEFERRED)
+/**
+ * Move the URB submitted (from any context) to endpoint slots
+ * @param[in] dev USB Device
+ */
+void usbd_urb_accept_submitted(usbd_device *dev)
+{
+	usbd_urb *urb = lf_take_all(&dev->urbs.submitted), *next;
+
+	for (; urb != NULL; urb = next) {
+		next = urb->next;
+		urb_enqueue(dev, urb);
 	}
+}
+#endif
 
-	return urb->id;
+void usbd_dispatch(usbd_device *dev)
+{
+#if defined(USBD_ENABLE_DEFERRED)
+	usbd_urb *urb = lf_take_all(&dev->urbs.done), *next;
+
+	for (; urb != NULL; urb = next) {
+		next = urb->next;
+		urb_callback(dev, urb, urb->status);
+		unused_push(dev, urb);
+	}
+#else
+	(void) dev;
+#endif
 }
 
 /**
@@ -388,80 +788,66 @@ static void urb_callback(usbd_device *dev, usbd_urb *urb,
 
 bool usbd_transfer_cancel(usbd_device *dev, usbd_urb_id urb_id)
 {
-	usbd_urb *urb, *prev;
-
 	if (urb_id == USBD_INVALID_URB_ID) {
 		LOG_LN("invalid urb id passed to transfer_cancel");
 		return false;
 	}
 
-	/* Check the Active Queue */
-	for (prev = NULL, urb = dev->urbs.active.head; urb != NULL; ) {
-		if (urb->id != urb_id) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
+#if defined(USBD_ENABLE_DEFERRED)
+	/* URB could be still in submitted list */
+	usbd_urb_accept_submitted(dev);
+#endif
 
-		queue_item_detach(&dev->urbs.active, prev, urb);
-		free_ep_from_urb(dev, urb);
-		urb_callback(dev, urb, USBD_ERR_CANCEL);
-		unused_push(dev, urb);
-		return true;
+	usbd_urb *urb = urb_from_id(dev, urb_id);
+	if (urb == NULL) {
+		LOGF_LN("WARN: urb with id = %"PRIu64" not found", urb_id);
+		return false;
 	}
 
-	/* Check the Waiting Queue */
-	for (prev = NULL, urb = dev->urbs.waiting.head; urb != NULL; ) {
-		if (urb->id != urb_id) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
+	bool was_active = (urb->state == USBD_URB_ACTIVE);
 
-		queue_item_detach(&dev->urbs.waiting, prev, urb);
-		urb_callback(dev, urb, USBD_ERR_CANCEL);
-		unused_push(dev, urb);
-		return true;
+	if (was_active) {
+		deactivate(dev, urb);
+	} else {
+		waiting_detach(dev, urb);
 	}
 
-	LOGF_LN("WARN: urb with id = %"PRIu64" not found", urb_id);
-	return false;
+	urb_done(dev, urb, USBD_ERR_CANCEL);
+
+	if (was_active) {
+		/* Endpoint is free, give it to next waiting URB */
+		usbd_urb_schedule(dev);
+	}
+
+	return true;
 }
 
 unsigned usbd_transfer_cancel_ep(usbd_device *dev, uint8_t ep_addr)
 {
 	unsigned result = 0;
-	usbd_urb *urb, *prev;
-
-	/* Check the Active Queue */
-	if (!is_ep_free(dev, ep_addr)) {
-		for (prev = NULL, urb = dev->urbs.active.head; urb != NULL; ) {
-			if (urb->transfer.ep_addr != ep_addr) {
-				prev = urb;
-				urb = urb->next;
-				continue;
-			}
+	unsigned slot = ep_slot_index(ep_addr);
+	usbd_urb *urb, *next;
 
-			queue_item_detach(&dev->urbs.active, prev, urb);
-			free_ep_from_urb(dev, urb);
-			urb_callback(dev, urb, USBD_ERR_CANCEL);
-			unused_push(dev, urb);
-			result++;
-			break;
-		}
+#if defined(USBD_ENABLE_DEFERRED)
+	usbd_urb_accept_submitted(dev);
+#endif
+
+	/* Taken out before any callback, so that URB submitted from
+	 *  callback do not get cancelled */
+	usbd_urb *waiting = waiting_detach_all(dev, slot);
+
+	/* Check the Active URB */
+	urb = dev->urbs.active[slot];
+	if (urb != NULL) {
+		deactivate(dev, urb);
+		urb_done(dev, urb, USBD_ERR_CANCEL);
+		result++;
 	}
 
 	/* Check the Waiting Queue */
-	for (prev = NULL, urb = dev->urbs.waiting.head; urb != NULL; ) {
-		if (urb->transfer.ep_addr != ep_addr) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
-
-		queue_item_detach(&dev->urbs.waiting, prev, urb);
-		urb_callback(dev, urb, USBD_ERR_CANCEL);
-		unused_push(dev, urb);
+	for (urb = waiting; urb != NULL; urb = next) {
+		next = urb->next;
+		urb_done(dev, urb, USBD_ERR_CANCEL);
 		result++;
 	}
 
@@ -471,6 +857,7 @@ unsigned usbd_transfer_cancel_ep(usbd_device *dev, uint8_t ep_addr)
 /**
  * Schedule new URB from WAITING to ACTIVE if the endpoint is free
  * @param[in] dev USB Device
+ * @note only endpoint that are free and have waiting URB are visited.
  */
 void usbd_urb_schedule(usbd_device *dev)
 {
@@ -479,48 +866,37 @@ void usbd_urb_schedule(usbd_device *dev)
 		return;
 	}
 
-	usbd_urb *urb = dev->urbs.waiting.head, *prev = NULL, *tmp;
+	uint32_t ready;
 
-	while (urb != NULL) {
-		if (!try_alloc_ep_for_urb(dev, urb)) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
+	/* Re-read every time, backend could have completed a URB on submit */
+	while ((ready = dev->urbs.ep_waiting & dev->urbs.ep_free)) {
+		unsigned slot = __builtin_ctz(ready);
+		usbd_urb *urb = dev->urbs.waiting[slot].head;
 
-		tmp = urb;
-		urb = queue_item_detach(&dev->urbs.waiting, prev, tmp);
-		queue_item_append(&dev->urbs.active, tmp);
+		waiting_detach(dev, urb);
 
-		LOGF_LN("[waiting] URB id=%"PRIu64" is now active", tmp->id);
-		dev->backend->urb_submit(dev, tmp);
+		LOGF_LN("[waiting] URB id=%"PRIu64" is now active", urb->id);
+		activate(dev, urb);
 	}
 }
 
 /**
- * Detach the URB from active list
- * Usage: backend to remove a URB from active list.
+ * Detach the URB from active slot
+ * Usage: backend to remove a URB from active slot.
  * @param[in] dev USB Device
- * @param[in] item Item to detach
+ * @param[in] urb Item to detach
  */
-static void detach_from_active(usbd_device *dev, usbd_urb *item)
+static void detach_from_active(usbd_device *dev, usbd_urb *urb)
 {
-	usbd_urb *urb = dev->urbs.active.head, *prev = NULL;
-
-	while (urb != NULL) {
-		if (urb != item) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
+	unsigned slot = ep_slot_index(urb->transfer.ep_addr);
 
-		queue_item_detach(&dev->urbs.active, prev, urb);
-		free_ep_from_urb(dev, urb);
+	if (dev->urbs.active[slot] != urb) {
+		LOGF_LN("WARNING: Found not find URB %"PRIu64" in active list to "
+			"detach it", urb->id);
 		return;
 	}
 
-	LOGF_LN("WARNING: Found not find URB %"PRIu64" in active list to detach it",
-		urb->id);
+	deactivate(dev, urb);
 }
 
 /**
@@ -534,8 +910,7 @@ void usbd_urb_complete(usbd_device *dev, usbd_urb *urb,
 			usbd_transfer_status status)
 {
 	detach_from_active(dev, urb);
-	urb_callback(dev, urb, status);
-	unused_push(dev, urb);
+	urb_done(dev, urb, status);
 	usbd_urb_schedule(dev);
 }
 
@@ -548,59 +923,92 @@ void usbd_urb_complete(usbd_device *dev, usbd_urb *urb,
  */
 usbd_urb *usbd_find_active_urb(usbd_device *dev, uint8_t ep_addr)
 {
-	usbd_urb *urb = NULL;
+	usbd_urb *urb = dev->urbs.active[ep_slot_index(ep_addr)];
 
-	LOGF_LN("Searching for URB which is active and has "
-		"ep_addr=0x%"PRIx8, ep_addr);
-
-	for (urb = dev->urbs.active.head; urb != NULL; urb = urb->next) {
-		if (urb->transfer.ep_addr == ep_addr) {
-			return urb;
-		}
+	if (urb == NULL) {
+		LOGF_LN("Unable to find the current processing URB for "
+			"endpoint 0x%"PRIx8, ep_addr);
 	}
 
-	LOGF_LN("Unable to find the current processing URB for "
-		"endpoint 0x%"PRIx8, ep_addr);
-	return NULL;
+	return urb;
 }
 
 /**
- * Clear up the whole queue
+ * Intalize @a dev->urbs->unused.
+ * All arr entries are set to unused.
  * @param[in] dev USB Device
- * @param[in] queue Queue to clear up
- * @param[in] status Status transfer to end with
  */
-static void flush_queue(usbd_device *dev, struct usbd_urb_queue *queue,
-		usbd_transfer_status status)
+void usbd_put_all_urb_into_unused(usbd_device *dev)
 {
-	usbd_urb *urb;
+	unsigned i;
 
-	for (urb = queue->head; urb != NULL; urb = urb->next) {
-		urb_callback(dev, urb, status);
-	}
+	dev->urbs.unused = NULL;
+#if defined(USBD_ENABLE_TIMEOUT)
+	dev->urbs.timeout.count = 0;
+#endif
+#if defined(USBD_ENABLE_DEFERRED)
+	dev->urbs.submitted = NULL;
+	dev->urbs.done = NULL;
+#endif
 
-	queue->head = queue->tail = NULL;
+	for (i = USBD_URB_COUNT; i > 0; i--) {
+		usbd_urb *urb = &dev->urbs.arr[i - 1];
+		urb->id = USBD_INVALID_URB_ID;
+#if defined(USBD_ENABLE_TIMEOUT)
+		urb->timeout_index = USBD_TIMEOUT_NOT_QUEUED;
+#endif
+		unused_push(dev, urb);
+	}
 }
 
 /**
- * Intalize @a dev->urbs->unused.
- * All arr entries are set to unused.
+ * Remove all the transfer of endpoint @a slots with @a status
  * @param[in] dev USB Device
+ * @param[in] slots Endpoint slots (same layout as ep_free)
+ * @param[in] status Transfer status
+ * @note backend is not told about the active URB removal.
+ * @note URB submitted from callback are not removed.
  */
-void usbd_put_all_urb_into_unused(usbd_device *dev)
+static void purge_slots(usbd_device *dev, uint32_t slots,
+			usbd_transfer_status status)
 {
-	unsigned i;
-	usbd_urb *prev;
+	usbd_urb *list = NULL, **list_tail = &list, *urb;
+	unsigned slot;
+
+#if defined(USBD_ENABLE_DEFERRED)
+	/* URB submitted before the event are removed too */
+	usbd_urb_accept_submitted(dev);
+#endif
+
+	/* Detach everything first */
+	for (slot = 0; slot < USBD_EP_SLOT_COUNT; slot++) {
+		if (!(slots & (((uint32_t) 1) << slot))) {
+			continue;
+		}
 
-	dev->urbs.unused = prev = &dev->urbs.arr[0];
+		urb = dev->urbs.active[slot];
+		if (urb != NULL) {
+			dev->urbs.active[slot] = NULL;
+			*list_tail = urb;
+			list_tail = &urb->next;
+		}
 
-	for (i = 1; i < USBD_URB_COUNT; i++) {
-		usbd_urb *urb = &dev->urbs.arr[i];
-		prev->next = urb;
-		prev = urb;
+		struct usbd_urb_queue *queue = &dev->urbs.waiting[slot];
+		if (queue->head != NULL) {
+			*list_tail = queue->head;
+			list_tail = &queue->tail->next;
+			waiting_detach_all(dev, slot);
+		}
 	}
 
-	prev->next = NULL;
+	*list_tail = NULL;
+	dev->urbs.ep_free |= slots;
+
+	while (list != NULL) {
+		urb = list;
+		list = urb->next;
+		urb_done(dev, urb, status);
+	}
 }
 
 /**
@@ -610,35 +1018,7 @@ void usbd_put_all_urb_into_unused(usbd_device *dev)
  */
 void usbd_purge_all_transfer(usbd_device *dev, usbd_transfer_status status)
 {
-	flush_queue(dev, &dev->urbs.active, status);
-	flush_queue(dev, &dev->urbs.waiting, status);
-	usbd_put_all_urb_into_unused(dev);
-	dev->urbs.ep_free = ~0;
-}
-
-/**
- * Purge any non zero endpoint transfer with @a status
- * @param dev USB Device
- * @param queue Queue
- * @param status Callback status
- */
-static void purge_non_ep0_tranfer_from_queue(usbd_device *dev,
-			struct usbd_urb_queue *queue, usbd_transfer_status status)
-{
-	usbd_urb *urb = queue->head, *prev = NULL, *tmp;
-
-	while (urb != NULL) {
-		if (!ENDPOINT_NUMBER(urb->transfer.ep_addr)) {
-			prev = urb;
-			urb = urb->next;
-			continue;
-		}
-
-		tmp = urb;
-		urb = queue_item_detach(queue, prev, tmp);
-		urb_callback(dev, tmp, status);
-		unused_push(dev, tmp);
-	}
+	purge_slots(dev, ~((uint32_t) 0), status);
 }
 
 /**
@@ -651,11 +1031,8 @@ static void purge_non_ep0_tranfer_from_queue(usbd_device *dev,
 void usbd_purge_all_non_ep0_transfer(usbd_device *dev,
 				usbd_transfer_status status)
 {
-	purge_non_ep0_tranfer_from_queue(dev, &dev->urbs.active, status);
-	purge_non_ep0_tranfer_from_queue(dev, &dev->urbs.waiting, status);
-
 	/* Mark all endpoint as free (except EP0) */
-	dev->urbs.ep_free |= ~0x00010001;
+	purge_slots(dev, ~((uint32_t) 0x00010001), status);
 }
 
 /**
@@ -865,13 +1242,12 @@ void usbd_ep0_stall(usbd_device *dev)
 }
 
 /**
- * Called by backend to get a pointer to receive/transmit 1 packet
+ * Common part of usbd_urb_get_buffer_pointer() and usbd_urb_get_segment()
  * @param[in] dev USB Device
  * @param[in] urb USB Request Block
  * @param len The number of bytes it should be able to hold/provide
- * @return pointer to data
  */
-void *usbd_urb_get_buffer_pointer(usbd_device *dev, usbd_urb *urb, size_t len)
+static void urb_buffer_prepare(usbd_device *dev, usbd_urb *urb, size_t len)
 {
 	usbd_transfer *transfer = &urb->transfer;
 	bool out = IS_OUT_ENDPOINT(transfer->ep_addr);
@@ -894,6 +1270,39 @@ void *usbd_urb_get_buffer_pointer(usbd_device *dev, usbd_urb *urb, size_t len)
 			TRANSFER_CALLBACK(dev, &urb->transfer, USBD_ONE_PACKET_DATA, urb->id)
 		}
 	}
+}
+
+/**
+ * Called by backend to get a pointer to receive/transmit 1 packet
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param len The number of bytes it should be able to hold/provide
+ * @return pointer to data
+ * @note For USBD_FLAG_SEGMENTED transfer, the pointer is only valid till
+ *   the end of current segment. use usbd_urb_get_segment() instead.
+ */
+void *usbd_urb_get_buffer_pointer(usbd_device *dev, usbd_urb *urb, size_t len)
+{
+	usbd_transfer *transfer = &urb->transfer;
+
+	if (transfer->flags & USBD_FLAG_SEGMENTED) {
+		size_t offset;
+		const usbd_segment *seg = usbd_urb_get_segment(dev, urb, len, &offset);
+
+		if (!len) {
+			/* Nothing to transfer, cursor could be past the last segment */
+			return NULL;
+		}
+
+		if ((seg->len - offset) < len) {
+			LOGF_LN("URB %"PRIu64" packet straddle segments, backend should "
+				"use usbd_urb_get_segment()", urb->id);
+		}
+
+		return seg->ptr + offset;
+	}
+
+	urb_buffer_prepare(dev, urb, len);
 
 	if (transfer->flags & USBD_FLAG_NO_MEMORY_INCREMENT) {
 		/* User said to reuse same buffer location everytime. */
@@ -903,6 +1312,36 @@ void *usbd_urb_get_buffer_pointer(usbd_device *dev, usbd_urb *urb, size_t len)
 	return transfer->buffer + transfer->transferred;
 }
 
+/**
+ * Called by backend to get the segment list position to receive/transmit
+ *  1 packet of a USBD_FLAG_SEGMENTED transfer.
+ * The packet data start at @a offset in the returned segment and
+ *  continue in the following segments (array element).
+ * @param[in] dev USB Device
+ * @param[in] urb USB Request Block
+ * @param[in] len The number of bytes it should be able to hold/provide
+ * @param[out] offset Offset in the returned segment
+ * @return segment
+ */
+const usbd_segment *usbd_urb_get_segment(usbd_device *dev, usbd_urb *urb,
+					size_t len, size_t *offset)
+{
+	usbd_transfer *transfer = &urb->transfer;
+
+	urb_buffer_prepare(dev, urb, len);
+
+	/* Skip exhausted (and zero length) segments */
+	if (transfer->transferred < transfer->length) {
+		while (urb->cursor.offset >= urb->cursor.seg->len) {
+			urb->cursor.seg++;
+			urb->cursor.offset = 0;
+		}
+	}
+
+	*offset = urb->cursor.offset;
+	return urb->cursor.seg;
+}
+
 /**
  * Called by backend when it get data
  * @param[in] dev USB Device
@@ -926,6 +1365,21 @@ void usbd_urb_inc_data_pointer(usbd_device *dev, usbd_urb *urb, size_t len)
 
 	transfer->transferred += len;
 
+	if (transfer->flags & USBD_FLAG_SEGMENTED) {
+		/* Move the cursor forward */
+		while (len) {
+			size_t seg_rem = urb->cursor.seg->len - urb->cursor.offset;
+			if (len < seg_rem) {
+				urb->cursor.offset += len;
+				break;
+			}
+
+			len -= seg_rem;
+			urb->cursor.seg++;
+			urb->cursor.offset = 0;
+		}
+	}
+
 	if (transfer->flags & USBD_FLAG_PER_PACKET_CALLBACK) {
 		if (out) {
 			/* OUT endpoint, give data to user */
@@ -21,6 +21,7 @@
 #define UNICOREMX_USBH_BACKEND_DWC_OTG_H
 
 #include <unicore-mx/usbh/usbh.h>
+#include "dwc_otg_periodic.h"
 
 typedef struct usbh_urb usbh_urb;
 
@@ -65,21 +66,35 @@ struct usbh_dwc_otg_chan {
 	usbh_urb *urb; /* prevent lookup */
 	usbh_dwc_otg_chan_state state;
 
-	/* the channel is on hold.
-	 *  the channel need to be enabled
-	 *  so that IO can be performed in "submit_frame".
-	 *  Only used for periodic endpoint (isochronous and interrupt) */
-	bool need_scheduling;
-
-	/* The frame in which the frame is submitted OR has to be submitted.
-	 *  Only used for periodic endpoint (isochronous and interrupt) */
-	uint16_t submit_frame;
+	/* Internal DMA mode (GAHBCFG.DMAEN).
+	 * dma_len: bytes programmed in HCxTSIZ/HCxDMA
+	 * dma: bounce buffer (SETUP and one packet of control data stage,
+	 *  IN packet that cannot be written in place)
+	 * bounce: bulk/periodic IN packet programmed in the bounce buffer */
+	uint16_t dma_len;
+	bool bounce;
+	uint32_t dma[16];
 };
 
 typedef struct usbh_dwc_otg_chan usbh_dwc_otg_chan;
 
+/**
+ * Interrupt/isochronous URB in the periodic schedule (see dwc_otg_periodic.h)
+ * The URB hold a channel only for the transaction of its frame.
+ */
+struct usbh_dwc_otg_periodic {
+	usbh_urb *urb; /* NULL if slot unused */
+
+	/* channel of the transaction in progress
+	 *  (INVALID_BACKEND_TAG if waiting for its frame) */
+	uint8_t chan;
+};
+
 #define USBH_HOST_EXTRA									\
-	uint64_t wait_till;
+	uint64_t wait_till;									\
+	bool dma;											\
+	struct dwc_otg_periodic sched;						\
+	struct usbh_dwc_otg_periodic periodic[DWC_OTG_PERIODIC_SLOTS];
 
 #define USBH_BACKEND_EXTRA								\
 	uint32_t base_address;								\
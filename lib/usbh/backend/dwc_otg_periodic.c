@@ -0,0 +1,242 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dwc_otg_periodic.h"
+
+#include <string.h>
+
+#define FRAME_INDEX(f) ((f) & (DWC_OTG_PERIODIC_FRAMES - 1))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/* Periodic transfers budget (USB 2.0 5.6.4 and 5.7.4) */
+#define BUDGET_FRAME_NS 900000 /* 90% of 1ms */
+#define BUDGET_MICROFRAME_NS 100000 /* 80% of 125us */
+
+void dwc_otg_periodic_init(struct dwc_otg_periodic *sched, bool high_speed)
+{
+	memset(sched, 0, sizeof(*sched));
+	sched->budget = high_speed ? BUDGET_MICROFRAME_NS : BUDGET_FRAME_NS;
+}
+
+uint32_t dwc_otg_periodic_cost(usbh_speed speed, usbh_ep_type type, bool in,
+					uint16_t size)
+{
+	bool iso = (type == USBH_EP_ISOCHRONOUS);
+
+	/* Floor(3.167 + BitStuffTime(size)), BitStuffTime(n) = 7 * 8 * n / 6 */
+	uint32_t bits = (19 + 56 * (uint32_t) size) / 6;
+
+	switch (speed) {
+	case USBH_SPEED_HIGH:
+		/* 2.083 ns per bit, token + handshake + packet overhead */
+	return ((iso ? 38 : 55) * 8 * 2083 + 2083 * bits) / 1000;
+	case USBH_SPEED_LOW:
+		/* 676.67 ns per bit (Hub_LS_Setup not counted) */
+	return (in ? 64060 : 64107) + (67667 * bits) / 100;
+	default:
+		/* 83.54 ns per bit */
+		if (iso) {
+			return (in ? 7268 : 6265) + (8354 * bits) / 100;
+		}
+	return 9107 + (8354 * bits) / 100;
+	}
+}
+
+/**
+ * Channels needed at SOF of frame @a f: transactions of @a f (channels
+ *  being released) and of the next frame (being armed)
+ * @param[in] sched Schedule
+ * @param[in] f Frame (index in list)
+ * @return channel count
+ */
+static unsigned channels_at(struct dwc_otg_periodic *sched, unsigned f)
+{
+	return __builtin_popcount(sched->due[FRAME_INDEX(f)]) +
+		__builtin_popcount(sched->due[FRAME_INDEX(f + 1)]);
+}
+
+/**
+ * Largest load and channel count of the frames of a period/phase
+ * @param[in] sched Schedule
+ * @param[in] period Period
+ * @param[in] phase Phase
+ * @param[out] channels Channels needed (see channels_at())
+ * @return nanoseconds
+ */
+static uint32_t worst_load(struct dwc_otg_periodic *sched, uint16_t period,
+					uint16_t phase, unsigned *channels)
+{
+	uint32_t worst = 0;
+	unsigned f;
+
+	*channels = 0;
+
+	for (f = phase; f < DWC_OTG_PERIODIC_FRAMES; f += period) {
+		worst = MAX(worst, sched->load[f]);
+		*channels = MAX(*channels, channels_at(sched, f - 1));
+		*channels = MAX(*channels, channels_at(sched, f));
+	}
+
+	return worst;
+}
+
+/**
+ * Update dwc_otg_periodic::channels
+ * @param[in] sched Schedule
+ */
+static void update_channels(struct dwc_otg_periodic *sched)
+{
+	unsigned f;
+
+	sched->channels = 0;
+
+	for (f = 0; f < DWC_OTG_PERIODIC_FRAMES; f++) {
+		sched->channels = MAX(sched->channels, channels_at(sched, f));
+	}
+}
+
+int dwc_otg_periodic_add(struct dwc_otg_periodic *sched, uint16_t interval,
+					uint32_t cost, bool exact)
+{
+	uint16_t period = 1, phase, best_phase = 0;
+	uint32_t best = UINT32_MAX;
+	unsigned f, n, best_channels = UINT32_MAX;
+
+	while ((period << 1) <= interval &&
+			(period << 1) <= DWC_OTG_PERIODIC_FRAMES) {
+		period <<= 1;
+	}
+
+	if (exact && period != interval) {
+		return DWC_OTG_PERIODIC_INVALID;
+	}
+
+	for (n = 0; n < DWC_OTG_PERIODIC_SLOTS; n++) {
+		if (!(sched->used & (1UL << n))) {
+			break;
+		}
+	}
+
+	if (n == DWC_OTG_PERIODIC_SLOTS) {
+		return DWC_OTG_PERIODIC_FULL;
+	}
+
+	/* Phase that need the least channels, then the least loaded,
+	 *  among the one that fit in budget */
+	for (phase = 0; phase < period; phase++) {
+		unsigned channels;
+		uint32_t worst = worst_load(sched, period, phase, &channels);
+
+		if (worst + cost > sched->budget) {
+			continue;
+		}
+
+		if (channels < best_channels ||
+				(channels == best_channels && worst < best)) {
+			best = worst;
+			best_channels = channels;
+			best_phase = phase;
+		}
+	}
+
+	if (best == UINT32_MAX) {
+		return DWC_OTG_PERIODIC_FULL;
+	}
+
+	sched->slot[n].cost = cost;
+	sched->slot[n].period = period;
+	sched->slot[n].phase = best_phase;
+	sched->used |= 1UL << n;
+
+	for (f = best_phase; f < DWC_OTG_PERIODIC_FRAMES; f += period) {
+		sched->load[f] += cost;
+		sched->due[f] |= 1UL << n;
+	}
+
+	update_channels(sched);
+	return n;
+}
+
+void dwc_otg_periodic_remove(struct dwc_otg_periodic *sched, uint8_t slot)
+{
+	struct dwc_otg_periodic_slot *s = &sched->slot[slot];
+	unsigned f;
+
+	if (!(sched->used & (1UL << slot))) {
+		return;
+	}
+
+	for (f = s->phase; f < DWC_OTG_PERIODIC_FRAMES; f += s->period) {
+		sched->load[f] -= s->cost;
+		sched->due[f] &= ~(1UL << slot);
+	}
+
+	sched->used &= ~(1UL << slot);
+	sched->late &= ~(1UL << slot);
+	sched->overdue &= ~(1UL << slot);
+	update_channels(sched);
+}
+
+void dwc_otg_periodic_advance(struct dwc_otg_periodic *sched, uint16_t frame)
+{
+	uint16_t count, i;
+
+	frame &= DWC_OTG_PERIODIC_FRNUM_MASK;
+
+	if (!sched->running) {
+		sched->running = true;
+		sched->next_frame = frame;
+	}
+
+	count = (frame - sched->next_frame) & DWC_OTG_PERIODIC_FRNUM_MASK;
+	if (count > (DWC_OTG_PERIODIC_FRNUM_MASK >> 1)) {
+		/* already processed */
+		return;
+	}
+
+	/* slots of frames missed (poll too late) are overdue too */
+	if (count >= DWC_OTG_PERIODIC_FRAMES) {
+		count = DWC_OTG_PERIODIC_FRAMES - 1;
+	}
+
+	sched->overdue = sched->late;
+	for (i = 1; i <= count; i++) {
+		sched->overdue |= sched->due[FRAME_INDEX(frame - i)];
+	}
+
+	sched->late = sched->overdue | sched->due[FRAME_INDEX(frame)];
+	sched->next_frame = (frame + 1) & DWC_OTG_PERIODIC_FRNUM_MASK;
+}
+
+int dwc_otg_periodic_next(struct dwc_otg_periodic *sched, uint32_t skip)
+{
+	uint32_t candidates = sched->late & ~skip;
+	unsigned start = (sched->last + 1) & 0x1F;
+	uint64_t rotated;
+
+	if (!candidates) {
+		return -1;
+	}
+
+	if (candidates & sched->overdue) {
+		candidates &= sched->overdue;
+	}
+
+	/* first candidate from "start", wrapping */
+	rotated = (((uint64_t) candidates << 32) | candidates) >> start;
+	return (start + __builtin_ctzll(rotated)) & 0x1F;
+}
@@ -0,0 +1,180 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG host periodic schedule.
+ *
+ * Interrupt and isochronous URB get a slot in the schedule when they are
+ *  submitted. The slot is placed in a frame list of DWC_OTG_PERIODIC_FRAMES
+ *  (micro)frames: an endpoint of period P (interval rounded down to a power
+ *  of 2, at most DWC_OTG_PERIODIC_FRAMES) at phase p is due in every frame f
+ *  where (f % P) == p. Like the interrupt tree of OHCI, endpoints of same
+ *  period spread over the frames.
+ *
+ * Each (micro)frame has a budget: 90% of a frame (full/low speed) or 80% of
+ *  a microframe (high speed), as for the periodic transfers of the spec.
+ *  A transaction cost the time given by USB 2.0 5.11.3 for its maximum
+ *  packet size (Host_Delay not counted). An URB that do not fit is refused.
+ *  The schedule is per URB: one URB in flight per endpoint (like the class
+ *  drivers do), its packets go one per frame of the endpoint.
+ *
+ * Channels are not owned by the slots: at every SOF, the backend move the
+ *  schedule to the next frame (dwc_otg_periodic_advance()) and give a channel
+ *  to each slot due (dwc_otg_periodic_next()) for one transaction. A slot
+ *  that did not get a channel (or still hold the channel of its previous
+ *  frame) stay "late" till it get one. Slots late since a previous frame
+ *  (overdue) come first, in turn, so a short channel pool delay every slot
+ *  instead of starving the last ones.
+ *  dwc_otg_periodic::channels is the number of channels that two consecutive
+ *  frames need (channels of one frame being released, next one being armed),
+ *  the backend keep them away from control/bulk transfers. The phase of a
+ *  new endpoint is chosen to keep this number low, then to balance the load.
+ *
+ * This file has no register access, so it can be tested on host.
+ */
+
+#ifndef UNICOREMX_USBH_DWC_OTG_PERIODIC_H
+#define UNICOREMX_USBH_DWC_OTG_PERIODIC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usbh/usbh.h>
+
+/* Length of the frame list (power of 2, largest period) */
+#if !defined(DWC_OTG_PERIODIC_FRAMES)
+# define DWC_OTG_PERIODIC_FRAMES 32
+#endif
+
+#if DWC_OTG_PERIODIC_FRAMES & (DWC_OTG_PERIODIC_FRAMES - 1)
+# error "DWC_OTG_PERIODIC_FRAMES should be a power of 2"
+#endif
+
+/* Number of slots (interrupt and isochronous URB submitted at the same time) */
+#if !defined(DWC_OTG_PERIODIC_SLOTS)
+# define DWC_OTG_PERIODIC_SLOTS 16
+#elif DWC_OTG_PERIODIC_SLOTS > 32
+# error "DWC_OTG_PERIODIC_SLOTS should be less than or equal to 32"
+#endif
+
+/* Frame number range (HFNUM.FRNUM) */
+#define DWC_OTG_PERIODIC_FRNUM_MASK 0x3FFF
+
+/* Error returned by dwc_otg_periodic_add() */
+#define DWC_OTG_PERIODIC_FULL -1 /**< No slot or not enough bandwidth */
+#define DWC_OTG_PERIODIC_INVALID -2 /**< Interval not possible */
+
+/** Slot */
+struct dwc_otg_periodic_slot {
+	uint32_t cost; /**< Transaction time (nanoseconds) */
+	uint16_t period; /**< Frames between two transactions */
+	uint16_t phase; /**< First frame in the list */
+};
+
+/** Periodic schedule */
+struct dwc_otg_periodic {
+	uint32_t budget; /**< Time per (micro)frame (nanoseconds) */
+	uint32_t load[DWC_OTG_PERIODIC_FRAMES]; /**< Time used per frame */
+	uint32_t due[DWC_OTG_PERIODIC_FRAMES]; /**< Slots (bit) due per frame */
+	uint32_t used; /**< Slots in use (bit) */
+	uint32_t late; /**< Slots due, without channel yet (bit) */
+	uint32_t overdue; /**< Late slots due in a previous frame (bit) */
+	uint8_t last; /**< Last slot served */
+	uint8_t channels; /**< Channels needed by two consecutive frames */
+	bool running; /**< next_frame valid */
+	uint16_t next_frame; /**< Next frame to process */
+	struct dwc_otg_periodic_slot slot[DWC_OTG_PERIODIC_SLOTS];
+};
+
+/**
+ * Empty the schedule
+ * @param[out] sched Schedule
+ * @param[in] high_speed Microframe budget (else frame)
+ */
+void dwc_otg_periodic_init(struct dwc_otg_periodic *sched, bool high_speed);
+
+/**
+ * Time of a transaction on the bus
+ * @param[in] speed Device speed
+ * @param[in] type Endpoint type (interrupt or isochronous)
+ * @param[in] in IN endpoint
+ * @param[in] size Packet size
+ * @return nanoseconds
+ */
+uint32_t dwc_otg_periodic_cost(usbh_speed speed, usbh_ep_type type, bool in,
+					uint16_t size);
+
+/**
+ * Place an endpoint in the schedule
+ * @param[in] sched Schedule
+ * @param[in] interval Interval (in frames or microframes)
+ * @param[in] cost Transaction time (see dwc_otg_periodic_cost())
+ * @param[in] exact Interval cannot be shortened (isochronous)
+ * @return slot (>= 0) on success
+ * @return DWC_OTG_PERIODIC_FULL or DWC_OTG_PERIODIC_INVALID on failure
+ */
+int dwc_otg_periodic_add(struct dwc_otg_periodic *sched, uint16_t interval,
+					uint32_t cost, bool exact);
+
+/**
+ * Remove the slot from the schedule
+ * @param[in] sched Schedule
+ * @param[in] slot Slot
+ */
+void dwc_otg_periodic_remove(struct dwc_otg_periodic *sched, uint8_t slot);
+
+/**
+ * Move to @a frame
+ * Slots due in the frames from the last call to @a frame (not more than
+ *  the list) are added to the late slots.
+ * @param[in] sched Schedule
+ * @param[in] frame Frame number (HFNUM.FRNUM) the transactions are for
+ */
+void dwc_otg_periodic_advance(struct dwc_otg_periodic *sched, uint16_t frame);
+
+/**
+ * Next late slot to serve: overdue first, in turn after the last served
+ * @param[in] sched Schedule
+ * @param[in] skip Slots (bit) not to return (cannot be served now)
+ * @return slot, -1 if none
+ */
+int dwc_otg_periodic_next(struct dwc_otg_periodic *sched, uint32_t skip);
+
+/**
+ * The slot got a channel
+ * @param[in] sched Schedule
+ * @param[in] slot Slot
+ */
+static inline void dwc_otg_periodic_served(struct dwc_otg_periodic *sched,
+					uint8_t slot)
+{
+	sched->late &= ~(1UL << slot);
+	sched->overdue &= ~(1UL << slot);
+	sched->last = slot;
+}
+
+/**
+ * Frame numbering restart (port reset, disconnect)
+ * @param[in] sched Schedule
+ */
+static inline void dwc_otg_periodic_restart(struct dwc_otg_periodic *sched)
+{
+	sched->running = false;
+	sched->late = 0;
+	sched->overdue = 0;
+}
+
+#endif
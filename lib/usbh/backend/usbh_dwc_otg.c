@@ -90,12 +90,54 @@
  */
 #define CALC_XFRSIZ(out, pktcnt, transfer_len, ep_size)	(transfer_len)
 
+/* Internal DMA mode (USBH_DMA feature)
+ * ====================================
+ * GAHBCFG.DMAEN is set, the core move the data between memory and FIFO.
+ * The FIFO are not accessed by CPU (RXFLVL is not used).
+ * The core halt the channel at the end of the transfer, on error and on
+ *  NAK of interrupt/isochronous transaction (NAK of control/bulk are retried
+ *  by the core). Only CHH is unmasked: the channel is handled once, when
+ *  it halt, from the other bits of HCxINT. The data toggle is taken back
+ *  from HCxTSIZ.DPID.
+ *
+ * Bulk, interrupt and isochronous:
+ *  Programmed (HCxTSIZ, HCxDMA) directly from the URB buffer, the whole
+ *  transfer for bulk, one packet per frame for periodic.
+ *  The buffer should be 32bit aligned. Periodic OUT URB of more than one
+ *  packet need an endpoint size multiple of 4 (next packet address stay
+ *  aligned).
+ *  The core write IN packets rounded to word: a packet that would be
+ *  written past the end of the URB buffer (last partial packet), or to an
+ *  unaligned address (endpoint size not a multiple of 4), is received in
+ *  the channel bounce buffer and copied (see dma_in_place()). A bulk IN
+ *  is then programmed in two parts: the whole packets, then the last one.
+ *  URB not fulfilling these conditions fail with USBH_ERR_INVALID.
+ *
+ * Control:
+ *  SETUP and data stage are copied packet by packet through the channel
+ *  bounce buffer (usbh_dwc_otg_chan::dma), request data is usually
+ *  unaligned.
+ *
+ * Note: on Cortex-M7 with D-Cache enabled, buffers should be placed in
+ *  non-cacheable memory.
+ */
+
+/* Address as seen by the core AHB master */
+#define DMA_ADDR(ptr)	((uint32_t) (uintptr_t) (ptr))
+
+/* Backend tag of interrupt/isochronous URB: slot in the periodic schedule
+ *  (channel of control/bulk URB are below) */
+#define PERIODIC_TAG(slot)		(0x80 | (slot))
+#define IS_PERIODIC_TAG(tag)	(((tag) & 0xE0) == 0x80)
+#define PERIODIC_SLOT(tag)		((tag) & 0x1F)
+
 static void handle_rxflvl_interrupt(usbh_host *host);
 static void process_channel_interrupt(usbh_host *host, uint8_t i);
-static int get_any_free_channel(usbh_host *host);
+static int get_any_free_channel(usbh_host *host, bool periodic);
+static void periodic_arm(usbh_host *host);
 
 static void control_setup_stage(usbh_host *host, uint8_t i);
-static void control_data_stage(usbh_host *host, uint8_t i);
+static void control_data_stage(usbh_host *host, uint8_t i, uint32_t dpid);
 static void control_status_stage(usbh_host *host, uint8_t i);
 
 static void fifo_to_memory(volatile uint32_t *fifo, void *mem,
@@ -142,6 +184,12 @@ static inline uint16_t get_fifo_depth(usbh_host *host)
 		value = DWC_OTG_GHWCFG3_DFIFODEPTH_GET(REBASE(DWC_OTG_GHWCFG3));
 	}
 
+	if (host->dma) {
+		/* Top of the FIFO RAM hold the HCxDMA registers
+		 *  (one word per channel of the core, GHWCFG2 is channels - 1) */
+		value -= DWC_OTG_GHWCFG2_NUMHSTCHNL_GET(REBASE(DWC_OTG_GHWCFG2)) + 1;
+	}
+
 	return value;
 }
 
@@ -179,6 +227,12 @@ void usbh_dwc_otg_init(usbh_host *host)
 	REBASE(DWC_OTG_GINTSTS) = 0xFFFFFFFF;
 	REBASE(DWC_OTG_HPRT) |= DWC_OTG_HPRT_PPWR;
 
+	if (host->dma) {
+		/* Data is moved by core, channel complete on CHH (not RXFLVL) */
+		REBASE(DWC_OTG_GAHBCFG) |= DWC_OTG_GAHBCFG_DMAEN |
+						DWC_OTG_GAHBCFG_HBSTLEN_INCR4;
+	}
+
 	LOG_LN("DWC_OTG init complete");
 
 	if (host->config->chan_count > host->backend->channels_count) {
@@ -193,6 +247,9 @@ void usbh_dwc_otg_init(usbh_host *host)
 	LOGF_LN("Transmit Non Periodic FIFO size: %"PRIu16, TX_NP_FIFO_SIZE);
 	LOGF_LN("Transmit Periodic FIFO size: %"PRIu16, TX_P_FIFO_SIZE);
 	LOGF_LN("Channel count: %"PRIu8, get_chan_count(host));
+
+	dwc_otg_periodic_init(&host->sched,
+		host->config->speed == USBH_SPEED_HIGH);
 }
 
 /**
@@ -209,7 +266,14 @@ static void reset_channels(usbh_host *host)
 		ch->state = USBH_DWC_OTG_CHAN_STATE_CANCELLED;
 
 		if (ch->urb != NULL) {
-			ch->urb->backend_tag = INVALID_BACKEND_TAG;
+			if (IS_PERIODIC_TAG(ch->urb->backend_tag)) {
+				/* stay in the schedule, armed again on its frame */
+				host->periodic[PERIODIC_SLOT(ch->urb->backend_tag)].chan =
+					INVALID_BACKEND_TAG;
+			} else {
+				/* submitted again from usbh_poll() */
+				usbh_urb_requeue(host, ch->urb);
+			}
 			ch->urb = NULL;
 		}
 
@@ -219,6 +283,9 @@ static void reset_channels(usbh_host *host)
 		REBASE(DWC_OTG_HCxCHAR, i) = DWC_OTG_HCCHAR_CHENA |
 									DWC_OTG_HCCHAR_CHDIS;
 	}
+
+	/* frame number restart with the port */
+	dwc_otg_periodic_restart(&host->sched);
 }
 
 /**
@@ -241,87 +308,6 @@ static void prepare_fifo(usbh_host *host)
 				(DWC_OTG_GRSTCTL_RXFFLSH | DWC_OTG_GRSTCTL_TXFFLSH));
 }
 
-/**
- * Perform channel scheduling.
- * All channel that are marked as "need_scheduling" are scheduled when they
- *  reach the appropriate frame.
- * On reaching the appropriate frame, just enable the channel.
- *  (it assumes that data is already there in FIFO)
- *
- * periodic transfer (interrup and isochronous) can be enabled in frame before
- *  "submit_frame" because ODD/EVEN bit will make sure that the transmission
- *   is done "submit_frame" frame.
- *
- * transfer (periodic and non-periodic) are always enabled in frame
- *  which are equal or greater than "submit_frame".
- *
- * On downside of this design is that, if interval (only used for isochronous
- *  and interrupt endpoint) is too large, it can increase the frame 14bit
- *  value make it think that the frame has not reached.
- *
- * for the design to work, interval should be less than 0x1FFF.
- *  (most of the time large interval are not a problem)
- *
- * interval >= 0x3E8 [0x3E8 = 1000, 1 second for FS] should never be required
- * interval >= 0x1F40 [0x1F40 = 1000, 1 second for HS] should never be required
- */
-static void schedule_channels(usbh_host *host)
-{
-	unsigned i;
-	for (i = 0; i < get_chan_count(host); i++) {
-		usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
-
-		if (!ch->need_scheduling) {
-			continue;
-		}
-
-		/* we are using range because in case the poll is performed after the
-		 *  the submit frame (example: proper polling not done),
-		 *  it can gracefully handle and enable the channel.
-		 *  0x1FFF is chosen because it is half of 0x3FFF.
-		 *
-		 * This method will fail if large interval value is used for
-		 *  isochronous or interrupt endpoint. */
-		uint16_t low = ch->submit_frame;
-		uint16_t upper = (ch->submit_frame + 0x1FFF) & 0x3FFF;
-
-		usbh_transfer *transfer = &ch->urb->transfer;
-		if (transfer->ep_type == USBH_EP_INTERRUPT ||
-			transfer->ep_type == USBH_EP_ISOCHRONOUS) {
-			/* we can enable the endpoint even before the submit_frame
-			 *  because ODD/EVEN bit will do trick of sending it in right frame
-			 */
-			low = low ? (low - 1) : 0x3FFF;
-		}
-
-		uint16_t current_frame = REBASE(DWC_OTG_HFNUM) &
-									DWC_OTG_HFNUM_FRNUM_MASK;
-		bool perform_enable = false;
-
-		/* check if the current frame falls in the range of low and upper */
-
-		if (low < upper) {
-			/* upper has not overflow'd due to addition of 0x1FFF */
-			if (current_frame >= low && current_frame <= upper) {
-				perform_enable = true;
-			}
-		} else {
-			/* upper has overflow'd due to addition of 0x1FFF */
-			if (current_frame >= low || current_frame <= upper) {
-				perform_enable = true;
-			}
-		}
-
-		if (perform_enable) {
-			PREFIX_FRAME_NUM
-			LOGF_LN("re-enabling channel %"PRIu8 " in frame %"PRIu16, i,
-				current_frame);
-			ch->need_scheduling = false;
-			REBASE(DWC_OTG_HCxCHAR, i) |= DWC_OTG_HCCHAR_CHENA;
-		}
-	}
-}
-
 /** @copydoc usbh_backend::poll() */
 void usbh_dwc_otg_poll(usbh_host *host, uint64_t now)
 {
@@ -468,10 +454,6 @@ void usbh_dwc_otg_poll(usbh_host *host, uint64_t now)
 		usbh_root_device_disconnected(host);
 	}
 
-	/* re-enabled channels.
-	 *  These channels are either disabled due to NAK or next interval.  */
-	schedule_channels(host);
-
 	/* process channel rx data */
 	while (REBASE(DWC_OTG_GINTSTS) & DWC_OTG_GINTSTS_RXFLVL) {
 		handle_rxflvl_interrupt(host);
@@ -487,6 +469,15 @@ void usbh_dwc_otg_poll(usbh_host *host, uint64_t now)
 		}
 	}
 
+	/* arm the interrupt/isochronous transactions of the next frame
+	 *  (channels released above are available) */
+	if (REBASE(DWC_OTG_GINTSTS) & DWC_OTG_GINTSTS_SOF) {
+		REBASE(DWC_OTG_GINTSTS) = DWC_OTG_GINTSTS_SOF;
+		periodic_arm(host);
+	} else if (host->sched.late) {
+		periodic_arm(host);
+	}
+
 #if defined(USBH_DEBUG)
 	if (REBASE(DWC_OTG_GINTSTS) & DWC_OTG_GINTSTS_IPXFR) {
 		REBASE(DWC_OTG_GINTSTS) = DWC_OTG_GINTSTS_IPXFR;
@@ -520,39 +511,91 @@ void usbh_dwc_otg_reset(usbh_host *host)
 
 /**
  * Get the first channel that is disabled.
+ * Control/bulk transfers leave the channels the periodic schedule need
+ *  (dwc_otg_periodic::channels, at least one channel for control/bulk).
  * @param host USB Host
+ * @param periodic Channel for an interrupt/isochronous transaction
  * @return index (>= 0) on success
  * @return -1 on failure
  */
-static int get_any_free_channel(usbh_host *host)
+static int get_any_free_channel(usbh_host *host, bool periodic)
 {
 	LOG_CALL
 
-	unsigned i;
-	for (i = 0; i < get_chan_count(host); i++) {
+	int first = -1;
+	unsigned i, free = 0, busy = 0, keep;
+	unsigned count = get_chan_count(host);
+
+	for (i = 0; i < count; i++) {
 		usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
 		if (ch->state == USBH_DWC_OTG_CHAN_STATE_FREE) {
-			LOGF_LN("channel %"PRIu8" is free for use", i);
-			return i;
+			if (periodic) {
+				LOGF_LN("channel %"PRIu8" is free for use", i);
+				return i;
+			}
+
+			if (first < 0) {
+				first = i;
+			}
+			free++;
+		} else if (ch->urb != NULL && IS_PERIODIC_TAG(ch->urb->backend_tag)) {
+			busy++;
 		}
 	}
 
-	LOG_LN("no free channel found");
-	return -1;
+	if (periodic || first < 0) {
+		LOG_LN("no free channel found");
+		return -1;
+	}
+
+	/* channels kept for the periodic schedule, not in use */
+	keep = MIN(host->sched.channels, count - 1);
+	keep = (keep > busy) ? (keep - busy) : 0;
+
+	if (free <= keep) {
+		LOG_LN("free channels kept for periodic schedule");
+		return -1;
+	}
+
+	LOGF_LN("channel %"PRIu8" is free for use", first);
+	return first;
+}
+
+/**
+ * Clear the channel interrupts before it is enabled.
+ * In DMA mode, only CHH is unmasked and the DMA address is programmed.
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ * @param mem Data (DMA mode)
+ * @param len Number of bytes programmed in HCxTSIZ (DMA mode)
+ */
+static void channel_prepare(usbh_host *host, uint8_t i, void *mem,
+				uint16_t len)
+{
+	REBASE(DWC_OTG_HCxINT, i) = 0xFFF;
+
+	if (!host->dma) {
+		REBASE(DWC_OTG_HCxINTMSK, i) = 0xFFF;
+		return;
+	}
+
+	REBASE(DWC_OTG_HCxINTMSK, i) = DWC_OTG_HCINTMSK_CHHM;
+	REBASE(DWC_OTG_HCxDMA, i) = DMA_ADDR(mem);
+	CHANNELS_ITEM(i)->dma_len = len;
 }
 
 /**
  * Write more data from URB to FIFO.
- * @param ch DWC OTG Channel data
+ * @param host USB Host
+ * @param i DWC OTG channel number
  *
  * @warning This function should only be called for
  *  transfer that have data to send to device.
  */
-static void push_packet_to_fifo(usbh_dwc_otg_chan *ch)
+static void push_packet_to_fifo(usbh_host *host, uint8_t i)
 {
-	usbh_urb *urb = ch->urb;
+	usbh_urb *urb = CHANNELS_ITEM(i)->urb;
 	usbh_transfer *transfer = &urb->transfer;
-	usbh_host *host = transfer->device->host;
 
 	uint16_t len = transfer->length - transfer->transferred;
 	len = MIN(len, transfer->ep_size);
@@ -563,7 +606,7 @@ static void push_packet_to_fifo(usbh_dwc_otg_chan *ch)
 	}
 
 	void *data = usbh_urb_get_data_pointer(urb, len);
-	volatile uint32_t *fifo = &REBASE(DWC_OTG_FIFO, urb->backend_tag);
+	volatile uint32_t *fifo = &REBASE(DWC_OTG_FIFO, i);
 
 	fifo += RX_FIFO_SIZE;
 
@@ -593,11 +636,12 @@ static void control_setup_stage(usbh_host *host, uint8_t i)
 	struct usb_setup_data *setup = &transfer->setup;
 
 	ch->state = USBH_DWC_OTG_CHAN_STATE_CTRL_SETUP;
-	ch->need_scheduling = false;
-	ch->submit_frame = REBASE(DWC_OTG_HFNUM) & DWC_OTG_HFNUM_FRNUM_MASK;
 
-	REBASE(DWC_OTG_HCxINT, i) = 0xFFF;
-	REBASE(DWC_OTG_HCxINTMSK, i) = 0xFFF;
+	if (host->dma) {
+		memcpy(ch->dma, setup, 8);
+	}
+
+	channel_prepare(host, i, ch->dma, 8);
 	REBASE(DWC_OTG_HCxTSIZ, i) = DWC_OTG_HCTSIZ_DPID_MDATA | (1 << 19) | 8;
 	REBASE(DWC_OTG_HCxCHAR, i) =
 		DWC_OTG_HCCHAR_CHENA |
@@ -609,37 +653,56 @@ static void control_setup_stage(usbh_host *host, uint8_t i)
 		(DWC_OTG_HCCHAR_EPNUM_MASK & (transfer->ep_addr << 11)) |
 		(DWC_OTG_HCCHAR_MPSIZ_MASK & transfer->ep_size);
 
-	volatile uint32_t *fifo = &REBASE(DWC_OTG_FIFO, i);
-	fifo += RX_FIFO_SIZE;
-	memory_to_fifo(setup, fifo, 8);
+	if (!host->dma) {
+		volatile uint32_t *fifo = &REBASE(DWC_OTG_FIFO, i);
+		fifo += RX_FIFO_SIZE;
+		memory_to_fifo(setup, fifo, 8);
+	}
 }
 
 /**
  * Perform DATA_IN/DATA_OUT for control transfer.
  * After this, will proceed to control STATUS_OUT/STATUS_IN (respectively)
+ * In DMA mode, only the next packet is performed
+ *  (see control_data_dma_done()).
  * @param host USB Host
  * @param i DWC OTG channel number
+ * @param dpid Data PID (HCxTSIZ.DPID) of the first packet
  */
-static void control_data_stage(usbh_host *host, uint8_t i)
+static void control_data_stage(usbh_host *host, uint8_t i, uint32_t dpid)
 {
 	LOG_CALL
 
 	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
-	usbh_transfer *transfer = &ch->urb->transfer;
+	usbh_urb *urb = ch->urb;
+	usbh_transfer *transfer = &urb->transfer;
 	usbh_device *dev = transfer->device;
 
 	bool host2dev = !(transfer->setup.bmRequestType & USB_REQ_TYPE_DIRECTION);
 	ch->state = host2dev ?
 		USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_OUT :
 		USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_IN;
-	ch->need_scheduling = false;
-	ch->submit_frame = REBASE(DWC_OTG_HFNUM) & DWC_OTG_HFNUM_FRNUM_MASK;
 
 	uint16_t pktcnt = CALC_PKTCNT(transfer->length, transfer->ep_size);
 	uint32_t xfrsiz = CALC_XFRSIZ(out, pktcnt, transfer->length, transfer->ep_size);
 
+	if (host->dma) {
+		/* One packet through the bounce buffer */
+		pktcnt = 1;
+		xfrsiz = MIN(transfer->length - transfer->transferred,
+						transfer->ep_size);
+
+		if (host2dev) {
+			memcpy(ch->dma, usbh_urb_get_data_pointer(urb, xfrsiz), xfrsiz);
+		} else {
+			/* Core can write upto a whole packet */
+			xfrsiz = transfer->ep_size;
+		}
+	}
+
+	channel_prepare(host, i, ch->dma, xfrsiz);
 	REBASE(DWC_OTG_HCxTSIZ, i) =
-		DWC_OTG_HCTSIZ_DPID_DATA1 |
+		dpid |
 		(DWC_OTG_HCTSIZ_PKTCNT_MASK & (pktcnt << 19)) |
 		(DWC_OTG_HCTSIZ_XFRSIZ_MASK & xfrsiz);
 
@@ -653,8 +716,8 @@ static void control_data_stage(usbh_host *host, uint8_t i)
 		(DWC_OTG_HCCHAR_EPNUM_MASK & (transfer->ep_addr << 11)) |
 		(DWC_OTG_HCCHAR_MPSIZ_MASK & transfer->ep_size);
 
-	if (host2dev) {
-		push_packet_to_fifo(ch);
+	if (host2dev && !host->dma) {
+		push_packet_to_fifo(host, i);
 	}
 }
 
@@ -676,9 +739,8 @@ static void control_status_stage(usbh_host *host, uint8_t i)
 	ch->state = host2dev ?
 		USBH_DWC_OTG_CHAN_STATE_CTRL_STATUS_IN :
 		USBH_DWC_OTG_CHAN_STATE_CTRL_STATUS_OUT;
-	ch->submit_frame = REBASE(DWC_OTG_HFNUM) & DWC_OTG_HFNUM_FRNUM_MASK;
-	ch->need_scheduling = false;
 
+	channel_prepare(host, i, ch->dma, 0);
 	REBASE(DWC_OTG_HCxTSIZ, i) = DWC_OTG_HCTSIZ_DPID_DATA1 | 1 << 19 | 0;
 
 	REBASE(DWC_OTG_HCxCHAR, i) =
@@ -692,6 +754,45 @@ static void control_status_stage(usbh_host *host, uint8_t i)
 		(DWC_OTG_HCCHAR_MPSIZ_MASK & transfer->ep_size);
 }
 
+/**
+ * Place the next IN packets of the @a i channel URB (DMA mode)
+ * Whole packets are written in place. A packet that the core would write
+ *  past the end of the URB buffer or to an unaligned address is received
+ *  alone in the bounce buffer (usbh_dwc_otg_chan::dma).
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ * @param[in,out] pktcnt Maximum packets, packets programmed
+ * @param[out] xfrsiz Bytes programmed
+ * @return DMA address
+ */
+static void *dma_in_place(usbh_host *host, uint8_t i, uint16_t *pktcnt,
+				uint32_t *xfrsiz)
+{
+	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
+	usbh_urb *urb = ch->urb;
+	usbh_transfer *transfer = &urb->transfer;
+	uint32_t left = transfer->length - transfer->transferred;
+	uint16_t full = MIN(left / transfer->ep_size, *pktcnt);
+	void *data = usbh_urb_get_data_pointer(urb, MIN(left, transfer->ep_size));
+
+	ch->bounce = false;
+
+	if (DMA_ADDR(data) & 0x3 || (transfer->ep_size & 0x3)) {
+		ch->bounce = true;
+	} else if (full) {
+		*pktcnt = full;
+		*xfrsiz = full * transfer->ep_size;
+		return data;
+	} else if (left & 0x3) {
+		ch->bounce = true;
+	}
+
+	/* One packet, at most what is left */
+	*pktcnt = 1;
+	*xfrsiz = MIN(left, transfer->ep_size);
+	return ch->bounce ? (void *) ch->dma : data;
+}
+
 /**
  * Perform bulk transfer on the @a i channel
  * @param host USB Host
@@ -708,10 +809,9 @@ static void bulk_transfer(usbh_host *host, uint8_t i)
 	bool dtog = !!(dev->dtog & ep_dtog_mask(transfer->ep_addr));
 	uint16_t pktcnt = CALC_PKTCNT(transfer->length, transfer->ep_size);
 	uint32_t xfrsiz = CALC_XFRSIZ(out, pktcnt, transfer->length, transfer->ep_size);
+	void *mem = transfer->data;
 
 	ch->state = USBH_DWC_OTG_CHAN_STATE_CALLBACK;
-	ch->need_scheduling = false;
-	ch->submit_frame = REBASE(DWC_OTG_HFNUM) & DWC_OTG_HFNUM_FRNUM_MASK;
 
 	/* Check if we need to transmit a ZLP (Zero Length Packet) */
 	if (out && transfer->length) {
@@ -723,8 +823,12 @@ static void bulk_transfer(usbh_host *host, uint8_t i)
 		}
 	}
 
-	REBASE(DWC_OTG_HCxINT, i) = 0xFFF;
-	REBASE(DWC_OTG_HCxINTMSK, i) = 0xFFF;
+	/* DMA: the whole transfer (IN: last partial packet apart) */
+	if (host->dma && !out) {
+		mem = dma_in_place(host, i, &pktcnt, &xfrsiz);
+	}
+
+	channel_prepare(host, i, mem, xfrsiz);
 	REBASE(DWC_OTG_HCxTSIZ, i) =
 		(dtog ? DWC_OTG_HCTSIZ_DPID_DATA1 : DWC_OTG_HCTSIZ_DPID_DATA0) |
 		(DWC_OTG_HCTSIZ_PKTCNT_MASK & (pktcnt << 19)) |
@@ -740,60 +844,280 @@ static void bulk_transfer(usbh_host *host, uint8_t i)
 		(DWC_OTG_HCCHAR_EPNUM_MASK & (transfer->ep_addr << 11)) |
 		(DWC_OTG_HCCHAR_MPSIZ_MASK & transfer->ep_size);
 
-	if (out) {
-		push_packet_to_fifo(ch);
+	if (out && !host->dma) {
+		push_packet_to_fifo(host, i);
 	}
 }
 
 /**
- * Perform interrupt transfer on the @a i channel
+ * Perform one interrupt/isochronous transaction on the @a i channel
  * @param host USB Host
  * @param i DWC OTG channel number
+ * @param frame Frame number of the transaction
  */
-static void interrupt_transfer(usbh_host *host, uint8_t i)
+static void periodic_transfer(usbh_host *host, uint8_t i, uint16_t frame)
 {
-	/* FIXME: function not tested! */
 	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
-	usbh_transfer *transfer = &ch->urb->transfer;
+	usbh_urb *urb = ch->urb;
+	usbh_transfer *transfer = &urb->transfer;
 	usbh_device *dev = transfer->device;
 
 	bool out = IS_OUT_ENDPOINT(transfer->ep_addr);
-	bool dtog = !!(dev->dtog & ep_dtog_mask(transfer->ep_addr));
-	uint16_t pktcnt = CALC_PKTCNT(transfer->length, transfer->ep_size);
-	uint32_t xfrsiz = CALC_XFRSIZ(out, pktcnt, transfer->length, transfer->ep_size);
+	bool iso = (transfer->ep_type == USBH_EP_ISOCHRONOUS);
+	bool dtog = !iso && (dev->dtog & ep_dtog_mask(transfer->ep_addr));
+
+	/* one packet per frame of the endpoint */
+	uint32_t xfrsiz = MIN(transfer->length - transfer->transferred,
+							transfer->ep_size);
+	uint16_t pktcnt = 1;
+	void *mem = NULL;
 
 	ch->state = USBH_DWC_OTG_CHAN_STATE_CALLBACK;
-	ch->need_scheduling = false;
-	ch->submit_frame = REBASE(DWC_OTG_HFNUM) & DWC_OTG_HFNUM_FRNUM_MASK;
-	ch->submit_frame += 1; /* transferred in next frame for first time */
-	ch->submit_frame &= 0x3FFF;
 
-	REBASE(DWC_OTG_HCxINT, i) = 0xFFF;
-	REBASE(DWC_OTG_HCxINTMSK, i) = 0xFFF;
+	/* DMA: straight to the packet place in URB buffer */
+	if (host->dma) {
+		mem = out ? usbh_urb_get_data_pointer(urb, xfrsiz) :
+			dma_in_place(host, i, &pktcnt, &xfrsiz);
+	}
+
+	channel_prepare(host, i, mem, xfrsiz);
 	REBASE(DWC_OTG_HCxTSIZ, i) =
 		(dtog ? DWC_OTG_HCTSIZ_DPID_DATA1 : DWC_OTG_HCTSIZ_DPID_DATA0) |
-		(DWC_OTG_HCTSIZ_PKTCNT_MASK & (pktcnt << 19)) |
+		(DWC_OTG_HCTSIZ_PKTCNT_MASK & (1 << 19)) |
 		(DWC_OTG_HCTSIZ_XFRSIZ_MASK & xfrsiz);
 
+	/* ODD/EVEN bit make sure that the transaction is done in @a frame */
 	REBASE(DWC_OTG_HCxCHAR, i) =
 		DWC_OTG_HCCHAR_CHENA |
 		(DWC_OTG_HCCHAR_DAD_MASK & (dev->address << 22)) |
 		DWC_OTG_HCCHAR_MCNT_1 |
-		((ch->submit_frame & 0x1) ? DWC_OTG_HCCHAR_ODDFRM : 0x00) |
-		DWC_OTG_HCCHAR_EPTYP_INTERRUPT |
+		((frame & 0x1) ? DWC_OTG_HCCHAR_ODDFRM : 0x00) |
+		(iso ? DWC_OTG_HCCHAR_EPTYP_ISOCHRONOUS :
+			DWC_OTG_HCCHAR_EPTYP_INTERRUPT) |
 		(dev->speed == USBH_SPEED_LOW ? DWC_OTG_HCCHAR_LSDEV : 0x00) |
 		(out ? DWC_OTG_HCCHAR_EPDIR_OUT : DWC_OTG_HCCHAR_EPDIR_IN) |
 		(DWC_OTG_HCCHAR_EPNUM_MASK & (transfer->ep_addr << 11)) |
 		(DWC_OTG_HCCHAR_MPSIZ_MASK & transfer->ep_size);
 
-	if (out) {
-		push_packet_to_fifo(ch);
+	if (out && !host->dma) {
+		push_packet_to_fifo(host, i);
+	}
+}
+
+/**
+ * Disable the channel, it will be free on CHH
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ */
+static void halt_channel(usbh_host *host, uint8_t i)
+{
+	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
+	ch->urb = NULL;
+	ch->state = USBH_DWC_OTG_CHAN_STATE_CANCELLED;
+
+	REBASE(DWC_OTG_HCxINTMSK, i) = DWC_OTG_HCINTMSK_CHHM;
+	REBASE(DWC_OTG_HCxINT, i) = 0xFFF;
+	REBASE(DWC_OTG_HCxTSIZ, i) = 0;
+	REBASE(DWC_OTG_HCxCHAR, i) = DWC_OTG_HCCHAR_CHENA | DWC_OTG_HCCHAR_CHDIS;
+}
+
+/**
+ * Channel halted with its URB: the channel is free and no more
+ *  assigned to the URB.
+ * Interrupt/isochronous URB stay in the periodic schedule
+ *  (slot removed by transfer_cancel() if the URB is freed).
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ * @return URB that was assigned to the channel
+ */
+static usbh_urb *channel_detach(usbh_host *host, uint8_t i)
+{
+	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
+	usbh_urb *urb = ch->urb;
+
+	ch->state = USBH_DWC_OTG_CHAN_STATE_FREE;
+	ch->urb = NULL;
+
+	if (IS_PERIODIC_TAG(urb->backend_tag)) {
+		host->periodic[PERIODIC_SLOT(urb->backend_tag)].chan =
+			INVALID_BACKEND_TAG;
+	} else {
+		urb->backend_tag = INVALID_BACKEND_TAG;
+	}
+
+	return urb;
+}
+
+/**
+ * Interrupt/isochronous transaction of the @a i channel is over
+ *  but not the URB. The channel is given back and the URB wait
+ *  for the next frame of its endpoint.
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ */
+static void periodic_release(usbh_host *host, uint8_t i)
+{
+	usbh_urb *urb = CHANNELS_ITEM(i)->urb;
+
+	if (host->dma) {
+		/* Channel already halted by the core, data accounted on CHH */
+		channel_detach(host, i);
+		return;
+	}
+
+	if (IS_OUT_ENDPOINT(urb->transfer.ep_addr)) {
+		/* data not sent (NAK, FRMOR) is pushed again in next frame */
+		urb->transfer.transferred -=
+			REBASE(DWC_OTG_HCxTSIZ, i) & DWC_OTG_HCTSIZ_XFRSIZ_MASK;
+	}
+
+	host->periodic[PERIODIC_SLOT(urb->backend_tag)].chan = INVALID_BACKEND_TAG;
+	halt_channel(host, i);
+}
+
+/**
+ * Interrupt/isochronous URB transferred all its data
+ *  (or received a short packet)
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ * @return true if complete
+ */
+static bool periodic_complete(usbh_host *host, uint8_t i)
+{
+	usbh_transfer *transfer = &CHANNELS_ITEM(i)->urb->transfer;
+
+	if (transfer->transferred >= transfer->length) {
+		return true;
 	}
+
+	/* IN: XFRSIZ left over if the packet was short */
+	return !IS_OUT_ENDPOINT(transfer->ep_addr) &&
+		(REBASE(DWC_OTG_HCxTSIZ, i) & DWC_OTG_HCTSIZ_XFRSIZ_MASK);
+}
+
+/**
+ * Give a channel to the periodic slots due in the next frame.
+ * Called on SOF, and on following polls while some slot wait for a channel
+ *  (all busy, or its channel of previous frame not released yet).
+ * @param host USB Host
+ */
+static void periodic_arm(usbh_host *host)
+{
+	uint16_t frame = ((REBASE(DWC_OTG_HFNUM) & DWC_OTG_HFNUM_FRNUM_MASK) + 1) &
+						DWC_OTG_PERIODIC_FRNUM_MASK;
+	uint32_t skip = 0;
+	int slot;
+
+	dwc_otg_periodic_advance(&host->sched, frame);
+
+	while ((slot = dwc_otg_periodic_next(&host->sched, skip)) >= 0) {
+		struct usbh_dwc_otg_periodic *p = &host->periodic[slot];
+
+		if (p->chan != INVALID_BACKEND_TAG) {
+			/* transaction of previous frame not over */
+			skip |= 1UL << slot;
+			continue;
+		}
+
+		int i = get_any_free_channel(host, true);
+		if (i == -1) {
+			PREFIX_FRAME_NUM
+			LOGF_LN("no channel for periodic slot %d", slot);
+			return;
+		}
+
+		p->chan = i;
+		CHANNELS_ITEM(i)->urb = p->urb;
+		periodic_transfer(host, i, frame);
+		dwc_otg_periodic_served(&host->sched, slot);
+	}
+}
+
+/**
+ * Place the interrupt/isochronous URB in the periodic schedule.
+ * The URB is completed with USBH_ERR_RES_UNAVAIL if the bandwidth is not
+ *  available, USBH_ERR_INVALID if the interval cannot be scheduled.
+ * @param host USB Host
+ * @param urb USB Request Block
+ */
+static void periodic_submit(usbh_host *host, usbh_urb *urb)
+{
+	usbh_transfer *transfer = &urb->transfer;
+	bool iso = (transfer->ep_type == USBH_EP_ISOCHRONOUS);
+	int slot;
+
+	if (!host->sched.used) {
+		/* Frame or microframe budget follow the root port speed */
+		dwc_otg_periodic_init(&host->sched,
+			usbh_dwc_otg_speed(host) == USBH_SPEED_HIGH);
+	}
+
+	slot = dwc_otg_periodic_add(&host->sched, transfer->interval,
+		dwc_otg_periodic_cost(transfer->device->speed, transfer->ep_type,
+			!IS_OUT_ENDPOINT(transfer->ep_addr), transfer->ep_size), iso);
+
+	if (slot < 0) {
+		LOGF_LN("URB %"PRIu64" refused by the periodic schedule", urb->id);
+		usbh_urb_free(urb, (slot == DWC_OTG_PERIODIC_INVALID) ?
+			USBH_ERR_INVALID : USBH_ERR_RES_UNAVAIL);
+		return;
+	}
+
+	host->periodic[slot].urb = urb;
+	host->periodic[slot].chan = INVALID_BACKEND_TAG;
+	urb->backend_tag = PERIODIC_TAG(slot);
+
+	LOGF_LN("periodic slot %d assigned to URB %"PRIu64, slot, urb->id);
+}
+
+/**
+ * Check if the URB can be transferred by DMA (see DMA mode above)
+ * @param urb USB Request Block
+ * @return true if possible
+ */
+static bool urb_dma_capable(usbh_urb *urb)
+{
+	usbh_transfer *transfer = &urb->transfer;
+	bool in = !IS_OUT_ENDPOINT(transfer->ep_addr);
+	uint16_t bounce = 0;
+
+	if (transfer->ep_type == USBH_EP_CONTROL) {
+		/* Packet by packet through the channel bounce buffer */
+		return transfer->ep_size <= sizeof(((usbh_dwc_otg_chan *) NULL)->dma);
+	}
+
+	if (transfer->flags & (USBH_FLAG_PER_PACKET_CALLBACK |
+				USBH_FLAG_NO_MEMORY_INCREMENT)) {
+		return false;
+	}
+
+	/* DMA address need to be word aligned */
+	if (DMA_ADDR(transfer->data) & 0x3) {
+		return false;
+	}
+
+	if (!in) {
+		/* Periodic: next packet address would be unaligned */
+		return !(transfer->ep_size & 0x3) ||
+			transfer->ep_type == USBH_EP_BULK ||
+			transfer->length <= transfer->ep_size;
+	}
+
+	/* Largest packet received in the bounce buffer (see dma_in_place()) */
+	if (transfer->ep_size & 0x3) {
+		bounce = MIN(transfer->length, transfer->ep_size);
+	} else if ((transfer->length % transfer->ep_size) & 0x3) {
+		bounce = transfer->length % transfer->ep_size;
+	}
+
+	return (size_t) NEXT_MULT_OF_4(bounce) <=
+		sizeof(((usbh_dwc_otg_chan *) NULL)->dma);
 }
 
 /**
  * Process the URB and prepare some channel for transfer
  * If no channel are currently free, ignore the call.
+ * Interrupt/isochronous URB are placed in the periodic schedule instead.
  * @param host USB Host
  * @param urb USB Request Block
  */
@@ -801,7 +1125,19 @@ void usbh_dwc_otg_transfer_submit(usbh_host *host, usbh_urb *urb)
 {
 	LOG_CALL
 
-	int i = get_any_free_channel(host);
+	if (host->dma && !urb_dma_capable(urb)) {
+		LOGF_LN("URB %"PRIu64" cannot be transferred by DMA", urb->id);
+		usbh_urb_free(urb, USBH_ERR_INVALID);
+		return;
+	}
+
+	if (urb->transfer.ep_type == USBH_EP_INTERRUPT ||
+			urb->transfer.ep_type == USBH_EP_ISOCHRONOUS) {
+		periodic_submit(host, urb);
+		return;
+	}
+
+	int i = get_any_free_channel(host, false);
 	if (i == -1) {
 		return;
 	}
@@ -819,11 +1155,7 @@ void usbh_dwc_otg_transfer_submit(usbh_host *host, usbh_urb *urb)
 	case USBH_EP_BULK:
 		bulk_transfer(host, i);
 	break;
-	case USBH_EP_INTERRUPT:
-		interrupt_transfer(host, i);
-	break;
-	case USBH_EP_ISOCHRONOUS:
-		/* TODO */
+	default:
 	break;
 	}
 }
@@ -845,18 +1177,268 @@ void usbh_dwc_otg_transfer_cancel(usbh_host *host, usbh_urb *urb)
 	uint8_t i = urb->backend_tag;
 	urb->backend_tag = INVALID_BACKEND_TAG;
 
+	if (IS_PERIODIC_TAG(i)) {
+		struct usbh_dwc_otg_periodic *p = &host->periodic[PERIODIC_SLOT(i)];
+
+		dwc_otg_periodic_remove(&host->sched, PERIODIC_SLOT(i));
+		p->urb = NULL;
+		i = p->chan;
+		p->chan = INVALID_BACKEND_TAG;
+
+		if (i == INVALID_BACKEND_TAG) {
+			/* waiting for its frame, no channel */
+			return;
+		}
+	}
+
 	LOGF_LN("channel %"PRIu8" cancelled with state = %s", i,
 		chan_state[CHANNELS_ITEM(i)->state]);
 
+	halt_channel(host, i);
+}
+
+static const struct {
+	uint32_t bit_mask;
+	usbh_transfer_status status;
+	const char *name;
+} error_cond[] = {
+	{DWC_OTG_HCINT_STALL, USBH_ERR_STALL, "STALL"},
+	{DWC_OTG_HCINT_DTERR, USBH_ERR_DTOG, "DTERR"},
+	{DWC_OTG_HCINT_BBERR, USBH_ERR_BABBLE, "BBERR"},
+	{DWC_OTG_HCINT_FRMOR, USBH_ERR_IO, "FRMOR"},
+	{DWC_OTG_HCINT_TXERR, USBH_ERR_IO, "TXERR"},
+	{DWC_OTG_HCINT_AHBERR, USBH_ERR_IO, "AHBERR"},
+	{0}
+};
+
+/**
+ * Transfer of the current stage is complete, move the channel to next state
+ * For Control, it will go setup->data->status->callback
+ * For bulk/isochronous/interrupt will go data->callback
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ */
+static void channel_next_state(usbh_host *host, uint8_t i)
+{
 	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
-	ch->urb = NULL;
-	ch->state = USBH_DWC_OTG_CHAN_STATE_CANCELLED;
-	ch->need_scheduling = false;
 
-	REBASE(DWC_OTG_HCxINTMSK, i) = DWC_OTG_HCINTMSK_CHHM;
-	REBASE(DWC_OTG_HCxINT, i) = 0xFFF;
-	REBASE(DWC_OTG_HCxTSIZ, i) = 0;
-	REBASE(DWC_OTG_HCxCHAR, i) = DWC_OTG_HCCHAR_CHENA | DWC_OTG_HCCHAR_CHDIS;
+	switch (ch->state) {
+	case USBH_DWC_OTG_CHAN_STATE_CTRL_SETUP:
+		if (ch->urb->transfer.setup.wLength) {
+			/* place request for data */
+			LOGF_LN("moving channel %"PRIu8" from setup to data stage", i);
+			control_data_stage(host, i, DWC_OTG_HCTSIZ_DPID_DATA1);
+			break;
+		}
+		/* fall through */
+	case USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_IN:
+	case USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_OUT:
+		/* place request to read 0 byte packet */
+		LOGF_LN("moving channel %"PRIu8" from state %s to status stage",
+			i, (ch->state == USBH_DWC_OTG_CHAN_STATE_CTRL_SETUP) ?
+				"setup" : "data");
+		control_status_stage(host, i);
+	break;
+	case USBH_DWC_OTG_CHAN_STATE_CTRL_STATUS_IN:
+	case USBH_DWC_OTG_CHAN_STATE_CTRL_STATUS_OUT:
+	case USBH_DWC_OTG_CHAN_STATE_CALLBACK: {
+		if (IS_PERIODIC_TAG(ch->urb->backend_tag) &&
+				!periodic_complete(host, i)) {
+			LOGF_LN("channel %"PRIu8" transaction done, "
+				"URB continue in next frame of the endpoint", i);
+			periodic_release(host, i);
+			break;
+		}
+
+		usbh_urb *urb = ch->urb;
+		LOGF_LN("backend marked urb %"PRIu64" as success (channel %"PRIu8")",
+			urb->id, i);
+
+		if (host->dma) {
+			/* Channel already halted by the core */
+			channel_detach(host, i);
+		}
+
+		usbh_urb_free(urb, USBH_SUCCESS);
+	} break;
+	case USBH_DWC_OTG_CHAN_STATE_FREE:
+		LOG_LN("WARN: channel is in free state");
+	break;
+	case USBH_DWC_OTG_CHAN_STATE_CANCELLED:
+		LOG_LN("WARN: channel is in cancelled state");
+	break;
+	}
+}
+
+/**
+ * Number of bytes moved by the core for the programmed transfer (DMA mode)
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ * @param in IN transfer
+ * @param complete Transfer complete (XFRC)
+ * @return number of bytes
+ */
+static uint16_t dma_transferred(usbh_host *host, uint8_t i, bool in,
+				bool complete)
+{
+	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
+	uint32_t hctsiz = REBASE(DWC_OTG_HCxTSIZ, i);
+	uint16_t ep_size = ch->urb->transfer.ep_size;
+
+	if (in) {
+		return ch->dma_len - (hctsiz & DWC_OTG_HCTSIZ_XFRSIZ_MASK);
+	}
+
+	if (complete) {
+		return ch->dma_len;
+	}
+
+	/* Halted before the end: XFRSIZ count the data fetched by the DMA,
+	 *  PKTCNT the packets that made it to the device */
+	uint16_t pktcnt = CALC_PKTCNT(ch->dma_len, ep_size);
+	uint16_t left = (hctsiz & DWC_OTG_HCTSIZ_PKTCNT_MASK) >> 19;
+	return MIN(ch->dma_len, (pktcnt - MIN(pktcnt, left)) * ep_size);
+}
+
+/**
+ * Take back the data toggle of the endpoint from HCxTSIZ.DPID (DMA mode)
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ */
+static void dma_dtog(usbh_host *host, uint8_t i)
+{
+	usbh_transfer *transfer = &CHANNELS_ITEM(i)->urb->transfer;
+	uint32_t mask = ep_dtog_mask(transfer->ep_addr);
+
+	if ((REBASE(DWC_OTG_HCxTSIZ, i) & DWC_OTG_HCTSIZ_DPID_MASK) ==
+			DWC_OTG_HCTSIZ_DPID_DATA1) {
+		transfer->device->dtog |= mask;
+	} else {
+		transfer->device->dtog &= ~mask;
+	}
+}
+
+/**
+ * Packet of control data stage done (DMA mode).
+ * The data is copied from the bounce buffer, and the next packet is
+ *  performed if the stage is not over.
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ * @return true if the next packet has been programmed
+ */
+static bool control_data_dma_done(usbh_host *host, uint8_t i)
+{
+	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
+	usbh_urb *urb = ch->urb;
+	usbh_transfer *transfer = &urb->transfer;
+	bool in = (ch->state == USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_IN);
+	uint16_t len = dma_transferred(host, i, in, true);
+
+	if (in) {
+		bool short_packet = (len < transfer->ep_size);
+
+		len = MIN(len, transfer->length - transfer->transferred);
+		memcpy(usbh_urb_get_data_pointer(urb, len), ch->dma, len);
+		usbh_urb_inc_data_pointer(urb, len);
+
+		if (short_packet) {
+			return false;
+		}
+	} else {
+		usbh_urb_inc_data_pointer(urb, len);
+	}
+
+	if (transfer->transferred >= transfer->length) {
+		return false;
+	}
+
+	control_data_stage(host, i,
+		REBASE(DWC_OTG_HCxTSIZ, i) & DWC_OTG_HCTSIZ_DPID_MASK);
+	return true;
+}
+
+/**
+ * Channel halted by the core (DMA mode): transfer complete, error or
+ *  interrupt/isochronous transaction not done in its frame.
+ * @param host USB Host
+ * @param i DWC OTG channel number
+ */
+static void dma_channel_halted(usbh_host *host, uint8_t i)
+{
+	usbh_dwc_otg_chan *ch = CHANNELS_ITEM(i);
+	usbh_urb *urb = ch->urb;
+	usbh_transfer *transfer = &urb->transfer;
+	uint32_t hcint = REBASE(DWC_OTG_HCxINT, i);
+	bool complete = !!(hcint & DWC_OTG_HCINT_XFRC);
+	unsigned j;
+
+	REBASE(DWC_OTG_HCxINT, i) = hcint;
+
+	PREFIX_FRAME_NUM
+	LOGF_LN("channel %"PRIu8" halted in %s state", i, chan_state[ch->state]);
+
+	if (ch->state == USBH_DWC_OTG_CHAN_STATE_CALLBACK) {
+		uint16_t len = dma_transferred(host, i,
+			!IS_OUT_ENDPOINT(transfer->ep_addr), complete);
+
+		if (ch->bounce) {
+			len = MIN(len, transfer->length - transfer->transferred);
+			memcpy(usbh_urb_get_data_pointer(urb, len), ch->dma, len);
+		}
+
+		usbh_urb_inc_data_pointer(urb, len);
+
+		if (transfer->ep_type != USBH_EP_ISOCHRONOUS) {
+			dma_dtog(host, i);
+		}
+	}
+
+	if (complete) {
+		if ((ch->state == USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_IN ||
+				ch->state == USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_OUT) &&
+				control_data_dma_done(host, i)) {
+			return;
+		}
+
+		if (ch->state == USBH_DWC_OTG_CHAN_STATE_CALLBACK &&
+				transfer->ep_type == USBH_EP_BULK &&
+				!IS_OUT_ENDPOINT(transfer->ep_addr) &&
+				transfer->transferred < transfer->length &&
+				!(REBASE(DWC_OTG_HCxTSIZ, i) & DWC_OTG_HCTSIZ_XFRSIZ_MASK)) {
+			/* Whole packets received, now the last partial one */
+			bulk_transfer(host, i);
+			return;
+		}
+
+		if (transfer->ep_type == USBH_EP_BULK &&
+				(transfer->flags & USBH_FLAG_NO_SHORT_PACKET) &&
+				transfer->transferred < transfer->length) {
+			/* Short packet received when it flagged
+			 *  that short packet will cause transfer failure */
+			usbh_urb_free(channel_detach(host, i), USBH_ERR_SHORT_PACKET);
+			return;
+		}
+
+		channel_next_state(host, i);
+		return;
+	}
+
+	if (IS_PERIODIC_TAG(urb->backend_tag) &&
+			(hcint & (DWC_OTG_HCINT_NAK | DWC_OTG_HCINT_FRMOR))) {
+		/* retried in the next frame of the endpoint */
+		periodic_release(host, i);
+		return;
+	}
+
+	for (j = 0; error_cond[j].bit_mask; j++) {
+		if (hcint & error_cond[j].bit_mask) {
+			LOGF_LN("got %s for channel %"PRIu8, error_cond[j].name, i);
+			usbh_urb_free(channel_detach(host, i), error_cond[j].status);
+			return;
+		}
+	}
+
+	usbh_urb_free(channel_detach(host, i), USBH_ERR_IO);
 }
 
 /**
@@ -889,7 +1471,13 @@ static void process_channel_interrupt(usbh_host *host, uint8_t i)
 			LOGF_LN("channel %"PRIu8" marked as free", i);
 			ch->state = USBH_DWC_OTG_CHAN_STATE_FREE;
 		break;
-		default: {
+		default:
+			if (host->dma) {
+				/* Normal end of the channel in DMA mode */
+				dma_channel_halted(host, i);
+				break;
+			}
+
 			/* Exceptional case: CHH received for an active channel.
 			 * We cannot go through the usual path of first transfer_cancel()
 			 * transfer_cancel() does CHH when a channel is assigned to it.
@@ -897,17 +1485,8 @@ static void process_channel_interrupt(usbh_host *host, uint8_t i)
 			PREFIX_FRAME_NUM
 			LOGF_LN("Got CHH for active [state = %s] channel %"PRIu8
 				" (marking channel as free)", chan_state[ch->state], i);
-			ch->state = USBH_DWC_OTG_CHAN_STATE_FREE;
-			ch->need_scheduling = false;
-
-			usbh_urb *urb = ch->urb;
-			ch->urb = NULL;
-
-			/* Channel no more assigned to URB */
-			urb->backend_tag = INVALID_BACKEND_TAG;
-
-			usbh_urb_free(urb, USBH_ERR_IO);
-		} break;
+			usbh_urb_free(channel_detach(host, i), USBH_ERR_IO);
+		break;
 		}
 
 		return;
@@ -936,31 +1515,12 @@ static void process_channel_interrupt(usbh_host *host, uint8_t i)
 		break;
 		case USBH_EP_INTERRUPT:
 		case USBH_EP_ISOCHRONOUS:
-			ch->submit_frame += transfer->interval;
-			ch->submit_frame &= 0x3FFF;
-
-			if (ch->submit_frame & 0x1) {
-				REBASE(DWC_OTG_HCxCHAR, i) |= DWC_OTG_HCCHAR_ODDFRM;
-			} else {
-				REBASE(DWC_OTG_HCxCHAR, i) &= ~DWC_OTG_HCCHAR_ODDFRM;
-			}
-
-			if (transfer->interval > 1) {
-				/* Channel will be enabled on next applicable frame.
-				 *  till then the channel is not enabled.
-				 *  and is marked for scheduling */
-				PREFIX_FRAME_NUM
-				LOGF_LN("channel %"PRIu8" got NAK, retry after "
-					"interval = %"PRIu16" and at frame = %"PRIu16, i,
-					transfer->interval, ch->submit_frame);
-				ch->need_scheduling = true;
-			} else {
-				/* Enabling the channel right here because packet will
-				 *  be transferred on next frame.
-				 * ODD/EVEN frame bit will make sure that the transfer is done
-				 *  in next frame. */
-				REBASE(DWC_OTG_HCxCHAR, i) |= DWC_OTG_HCCHAR_CHENA;
-			}
+			/* retried in the next frame of the endpoint,
+			 *  the channel is free for others till then */
+			PREFIX_FRAME_NUM
+			LOGF_LN("channel %"PRIu8" got NAK, retry after "
+				"interval = %"PRIu16, i, transfer->interval);
+			periodic_release(host, i);
 		break;
 		}
 
@@ -992,39 +1552,11 @@ static void process_channel_interrupt(usbh_host *host, uint8_t i)
 		break;
 		case USBH_EP_INTERRUPT:
 		case USBH_EP_ISOCHRONOUS:
-			/* next packet will be transmitted in next applicable frame. */
-			/* ch->need_scheduling = true; */
-			ch->submit_frame += transfer->interval;
-			ch->submit_frame &= 0x3FFF;
-			if (ch->submit_frame & 0x1) {
-				REBASE(DWC_OTG_HCxCHAR, i) |= DWC_OTG_HCCHAR_ODDFRM;
-			} else {
-				REBASE(DWC_OTG_HCxCHAR, i) &= ~DWC_OTG_HCCHAR_ODDFRM;
-			}
-
-			if (transfer->interval > 1 &&
-					/* we have more packets to send? */
-					REBASE(DWC_OTG_HCxTSIZ, i) & DWC_OTG_HCTSIZ_PKTCNT_MASK) {
-				/* we need to wait for the appropriate frame to come.
-				 *  till then, the channel is disabled and is marked for
-				 *  scheduling. */
-				ch->need_scheduling = true;
-				PREFIX_FRAME_NUM
-				LOGF_LN("channel %"PRIu8" got ACK, resume transfer after "
-					"interval = %"PRIu16" and at frame = %"PRIu16, i,
-					transfer->interval, ch->submit_frame);
-				REBASE(DWC_OTG_HCxCHAR, i) |= DWC_OTG_HCCHAR_CHENA |
-												DWC_OTG_HCCHAR_CHDIS;
-			}
-
-			/* We are submitting data here so that on the next applicable frame
-			 *   channel can just directly enable to transmit data. */
-			if (IS_OUT_ENDPOINT(transfer->ep_addr)) {
-				goto send_more;
-			}
+			/* one packet per frame, next one in next frame of the endpoint
+			 *  (see XFRC) */
 		break;
 		send_more:
-			push_packet_to_fifo(ch);
+			push_packet_to_fifo(host, i);
 		break;
 		}
 
@@ -1033,18 +1565,14 @@ static void process_channel_interrupt(usbh_host *host, uint8_t i)
 		return;
 	}
 
-	static const struct {
-		uint32_t bit_mask;
-		usbh_transfer_status status;
-		const char *name;
-	} error_cond[] = {
-		{DWC_OTG_HCINT_STALL, USBH_ERR_STALL, "STALL"},
-		{DWC_OTG_HCINT_DTERR, USBH_ERR_DTOG, "DTERR"},
-		{DWC_OTG_HCINT_BBERR, USBH_ERR_BABBLE, "BBERR"},
-		{DWC_OTG_HCINT_FRMOR, USBH_ERR_IO, "FRMOR"},
-		{DWC_OTG_HCINT_TXERR, USBH_ERR_IO, "TXERR"},
-		{0}
-	};
+	if ((REBASE(DWC_OTG_HCxINT, i) & DWC_OTG_HCINT_FRMOR) &&
+			IS_PERIODIC_TAG(ch->urb->backend_tag)) {
+		/* transaction armed too late for its frame, retry next frame */
+		LOGF_LN("got FRMOR for periodic channel %"PRIu8, i);
+		REBASE(DWC_OTG_HCxINT, i) = DWC_OTG_HCINT_FRMOR;
+		periodic_release(host, i);
+		return;
+	}
 
 	/* handle multiple error bits with same code */
 	unsigned j;
@@ -1063,37 +1591,7 @@ static void process_channel_interrupt(usbh_host *host, uint8_t i)
 		"now we will move to next state", i, chan_state[ch->state]);
 	REBASE(DWC_OTG_HCxINT, i) = DWC_OTG_HCINT_XFRC;
 
-	/* lets move the channel to next state! */
-	switch (ch->state) {
-	case USBH_DWC_OTG_CHAN_STATE_CTRL_SETUP:
-		if (ch->urb->transfer.setup.wLength) {
-			/* place request for data */
-			LOGF_LN("moving channel %"PRIu8" from setup to data stage", i);
-			control_data_stage(host, i);
-			break;
-		}
-	case USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_IN:
-	case USBH_DWC_OTG_CHAN_STATE_CTRL_DATA_OUT:
-		/* place request to read 0 byte packet */
-		LOGF_LN("moving channel %"PRIu8" from state %s to status stage",
-			i, (ch->state == USBH_DWC_OTG_CHAN_STATE_CTRL_SETUP) ?
-				"setup" : "data");
-		control_status_stage(host, i);
-	break;
-	case USBH_DWC_OTG_CHAN_STATE_CTRL_STATUS_IN:
-	case USBH_DWC_OTG_CHAN_STATE_CTRL_STATUS_OUT:
-	case USBH_DWC_OTG_CHAN_STATE_CALLBACK: {
-		LOGF_LN("backend marked urb %"PRIu64" as success (channel %"PRIu8")",
-			ch->urb->id, i);
-		usbh_urb_free(ch->urb, USBH_SUCCESS);
-	} break;
-	case USBH_DWC_OTG_CHAN_STATE_FREE:
-		LOG_LN("WARN: channel is in free state");
-	break;
-	case USBH_DWC_OTG_CHAN_STATE_CANCELLED:
-		LOG_LN("WARN: channel is in cancelled state");
-	break;
-	}
+	channel_next_state(host, i);
 }
 
 /**
@@ -58,6 +58,7 @@ static usbh_host *init(const usbh_backend_config *config)
 
 	host.backend = &usbh_stm32_otg_hs;
 	host.config = config;
+	host.dma = !!(config->feature & USBH_DMA);
 
 	if (config->feature & USBH_PHY_EXT) {
 		/* Deactivate internal PHY */
@@ -55,7 +55,9 @@
  * Note
  * ====
  * Also, the stack manage external device connect/disconnect (on hub).
- * so, you can see the code as (usb-stack + hub-driver)  [WIP, not implemented]
+ * so, you can see the code as (usb-stack + hub-driver)
+ * Hubs are configured by the stack (usbh_hub.c) and not reported to
+ *  application, devices connected to them are.
  *
  * Note
  * ====
@@ -65,7 +67,7 @@
 /*
  * TODO
  * ====
- * - HUB code NOT written. current code only handles root device connect/disconnect.
+ * - Split transactions (full/low speed device behind high speed hub)
  * - Write helper/ functions to convert UTF-16 to UTF-8 (and possibly for ASCII too)
  * - Add more Standard request in helper/stdreq.{c, h}  (backend independent!)
  * - Bulk (IN, OUT) transfer need testing
@@ -75,6 +77,58 @@
  */
 
 #include <unicore-mx/usbh/usbh.h>
+#include <unicore-mx/usb/class/hub.h>
+
+/**
+ * Compile time configuration: \n
+ * USBH_URB_COUNT: Number of URB object to allocate (default: 12) \n
+ * USBH_DEVICE_COUNT: Number of device object to allocate, root device
+ *   and hubs included (default: 8, max: 127) \n
+ * USBH_HUB_COUNT: Number of hub object to allocate (default: 5)
+ */
+
+#if defined(USBH_URB_COUNT) && (USBH_URB_COUNT < 1)
+# error "USBH_URB_COUNT less than 1 is meaningless."
+#endif
+
+#if defined(USBH_URB_COUNT) && (USBH_URB_COUNT > 0xFFFF)
+# error "USBH_URB_COUNT do not fit in the index part of URB ID (16bit)."
+#endif
+
+#if !defined(USBH_URB_COUNT)
+# define USBH_URB_COUNT 12
+#endif
+
+#if defined(USBH_DEVICE_COUNT) && \
+	((USBH_DEVICE_COUNT < 1) || (USBH_DEVICE_COUNT > 127))
+# error "USBH_DEVICE_COUNT should be 1 to 127 (bus address space)."
+#endif
+
+#if !defined(USBH_DEVICE_COUNT)
+# define USBH_DEVICE_COUNT 8
+#endif
+
+/* 5 to reach the tier limit */
+#if !defined(USBH_HUB_COUNT)
+# define USBH_HUB_COUNT 5
+#endif
+
+/**
+ * URB ID layout:
+ *  bit 0-15: Index of the URB in usbh_host::urbs::arr
+ *  bit 16-63: Sequence number of the URB object
+ *             (incremented on every use, starts from 1,
+ *              so ID is never USBH_INVALID_URB_ID)
+ */
+#define USBH_URB_ID_INDEX_BITS 16
+#define USBH_URB_ID_INDEX_MASK ((1 << USBH_URB_ID_INDEX_BITS) - 1)
+#define USBH_URB_ID(seq, index) \
+	(((usbh_urb_id) (seq) << USBH_URB_ID_INDEX_BITS) | (index))
+#define USBH_URB_ID_INDEX(id) ((id) & USBH_URB_ID_INDEX_MASK)
+#define USBH_URB_ID_SEQ(id) ((id) >> USBH_URB_ID_INDEX_BITS)
+
+/** usbh_urb::timeout_index of URB that is not in the timeout heap */
+#define USBH_TIMEOUT_NOT_QUEUED 0xFFFF
 
 /**
  * USB Device
@@ -90,7 +144,8 @@
  * @param hub_ports Number of port of the hub.
  *    If the device is not an hub, should be 0.
  * @param buffer a static buffer to fetch some descriptor internally
- *     Used at
+ *     Used at enumeration (partial device descriptor)
+ * @param urbs URB of the device (linked with usbh_urb::dev_next)
  */
 struct usbh_device {
 	usbh_host *host;
@@ -108,15 +163,35 @@ struct usbh_device {
 	uint32_t dtog;
 	usbh_disconnected_callback disconnected;
 	uint8_t hub_ports;
+	uint8_t buffer[8];
+	struct usbh_urb *urbs;
+};
+
+enum usbh_urb_state {
+	USBH_URB_UNUSED = 0, /**< In unused list */
+	USBH_URB_PENDING, /**< In pending list (waiting for backend resource) */
+	USBH_URB_SUBMITTED /**< Accepted by backend */
 };
 
 /**
  * USB Request Block
  */
 struct usbh_urb {
-	/** URB (USB Request Block) ID (0 is invalid) */
+	/** URB (USB Request Block) ID (see USBH_URB_ID()) */
 	usbh_urb_id id;
 
+	enum usbh_urb_state state;
+
+	/** unused or pending list */
+	struct usbh_urb *next, *prev;
+
+	/** usbh_device::urbs list */
+	struct usbh_urb *dev_next, *dev_prev;
+
+	/** Position in usbh_host::urbs::timeout::heap
+	 *  (USBH_TIMEOUT_NOT_QUEUED if not present) */
+	uint16_t timeout_index;
+
 	/** A copy of Transfer object provided by application */
 	usbh_transfer transfer;
 
@@ -172,10 +247,70 @@ struct usbh_backend {
 #endif
 };
 
-#define URB_ARRAY_LENGTH 12
+/** Ports handled per hub (others are left unpowered) */
+#define HUB_MAX_PORTS 7
+
+/** Hub port (private) */
+struct usbh_hub_port {
+	/** Port state (see usbh_hub.c) */
+	uint8_t state;
 
-/** The maximum number of devices the host can hold. */
-#define DEVICE_ARRAY_LENGTH 8
+	/** Speed of the device (reset done) */
+	uint8_t speed;
+
+	/** Change bits (wPortChange) left to clear */
+	uint8_t clear;
+
+	/** End of debounce, reset or recovery */
+	uint64_t deadline;
+};
+
+/**
+ * Hub
+ * @param dev USB Device (if NULL, marker of object as unused)
+ * @param state Hub state (see usbh_hub.c)
+ * @param ports Number of ports handled
+ * @param config_value Configuration to set
+ * @param ep_addr Status change endpoint
+ * @param ep_size Status change endpoint size
+ * @param interval Status change endpoint interval
+ * @param power_delay Power on to power good (in 2ms)
+ * @param port_next Next port to power
+ * @param busy Control request in flight
+ * @param polling Status change transfer in flight
+ * @param pending Status to read (bit 0 = hub, bit x = port x)
+ * @param deadline End of power on wait
+ * @param change Status change data
+ * @param status Hub or port status (GET_STATUS)
+ * @param buffer Configuration and hub descriptor
+ * @param port Ports (index 0 for hub change bits)
+ */
+struct usbh_hub {
+	usbh_device *dev;
+	uint8_t state;
+	uint8_t ports;
+	uint8_t config_value;
+	uint8_t ep_addr;
+	uint16_t ep_size;
+	uint16_t interval;
+	uint8_t power_delay;
+	uint8_t port_next;
+	bool busy;
+	bool polling;
+	uint16_t pending;
+	uint64_t deadline;
+	uint8_t change[4];
+	struct usb_hub_status status;
+	uint8_t buffer[32];
+	struct usbh_hub_port port[HUB_MAX_PORTS + 1];
+
+	struct {
+		bool busy;
+		bool again;
+	} kick;
+};
+
+typedef struct usbh_hub usbh_hub;
 
 /**
  * USB Host
@@ -186,19 +321,41 @@ struct usbh_backend {
  * @param devices Static array of devices to store information
  *    If the list become full, new devices will be dropped if item on available.
  *    The list will also INCLUDE ROOT HUB.
- * @param next_urb_id Next URB ID (start from 1)
- * @param buffer Buffer to fetch device descriptor for device at enumeration.
- *    Used for one device at a time.
+ * @param by_address Device at address (index), address 0 not stored
+ * @param urbs URB objects, see usbh_urb.c
+ * @param hubs Hubs attached
+ * @param address0_busy A device is at address 0 (hub port reset to SET_ADDRESS)
  */
 struct usbh_host {
 	const usbh_backend *backend;
 	uint64_t last_poll;
 	usbh_connected_callback connected;
 	uint8_t next_device_address;
-	usbh_device devices[DEVICE_ARRAY_LENGTH];
-	usbh_urb_id next_urb_id;
-	usbh_urb urbs[URB_ARRAY_LENGTH];
-	uint8_t buffer[8];
+	usbh_device devices[USBH_DEVICE_COUNT];
+	usbh_device *by_address[128];
+
+	struct {
+		/** Array of URB allocated at compile time */
+		usbh_urb arr[USBH_URB_COUNT];
+
+		/** Free URB (linked with usbh_urb::next) */
+		usbh_urb *unused;
+
+		/** URB waiting for backend resource, in submit order */
+		usbh_urb *pending, *pending_last;
+
+		/**
+		 * URB (with timeout) ordered by usbh_urb::timeout_on (binary
+		 *  min-heap), heap[0] is the URB that will timeout first.
+		 */
+		struct {
+			usbh_urb *heap[USBH_URB_COUNT];
+			unsigned count;
+		} timeout;
+	} urbs;
+
+	usbh_hub hubs[USBH_HUB_COUNT];
+	bool address0_busy;
 
 	/** Backend configuration */
 	const struct usbh_backend_config *config;
@@ -275,8 +432,10 @@ extern void usbh_log_printf(const char *fmt, ...)
 
 #define MIN(a, b) (((a) > (b)) ? (b) : (a))
 
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
 #define IS_URB_ID_INVALID(urb_id) ((urb_id) == USBH_INVALID_URB_ID)
-#define IS_URB_INVALID(urb) IS_URB_ID_INVALID((urb)->id)
+#define IS_URB_INVALID(urb) ((urb)->state == USBH_URB_UNUSED)
 
 #define IS_DEVICE_INVALID(dev) ((dev)->host == NULL)
 #define IS_DEVICE_VALID(dev) (!IS_DEVICE_INVALID(dev))
@@ -306,8 +465,17 @@ void usbh_root_device_connected(usbh_host *host, usbh_speed speed);
 void *usbh_urb_get_data_pointer(usbh_urb *urb, uint16_t len);
 void usbh_urb_inc_data_pointer(usbh_urb *urb, uint16_t len);
 void usbh_urb_free(usbh_urb *urb, usbh_transfer_status status);
-void usbh_urb_invalidate(usbh_urb *urb);
+void usbh_urb_init(usbh_host *host);
+usbh_urb *usbh_urb_alloc(usbh_host *host);
+void usbh_urb_submit(usbh_host *host, usbh_urb *urb);
+usbh_urb *usbh_urb_from_id(usbh_host *host, usbh_urb_id urb_id);
+void usbh_urb_requeue(usbh_host *host, usbh_urb *urb);
+void usbh_urb_poll(usbh_host *host, uint64_t now);
 
 void usbh_hub_reset_port(usbh_device *dev, uint8_t port);
+bool usbh_hub_start(usbh_device *dev);
+void usbh_hub_disconnected(usbh_device *dev);
+void usbh_hub_init(usbh_host *host);
+void usbh_hub_poll(usbh_host *host);
 
 #endif
@@ -38,9 +38,16 @@ static void enum_failed(usbh_device *dev)
 static void enum_success(usbh_device *dev)
 {
 	usbh_host *host = dev->host;
+	struct usb_device_descriptor *desc =
+		(struct usb_device_descriptor *) dev->buffer;
 
 	LOG_LN("successfully enumerated device");
 
+	if (desc->bDeviceClass == USB_CLASS_HUB && usbh_hub_start(dev)) {
+		/* Hub is managed by the stack, its devices are reported */
+		return;
+	}
+
 	if (host->connected != NULL) {
 		host->connected(dev);
 	}
@@ -92,6 +99,10 @@ static void address_assigned(const usbh_transfer *transfer,
 	(void) urb_id;
 
 	usbh_device *dev = transfer->device;
+
+	/* Device left address 0 (or failed), next one can be reset */
+	dev->host->address0_busy = false;
+
 	if (status != USBH_SUCCESS) {
 		LOG_LN("failed to set address to device");
 		enum_failed(dev);
@@ -100,9 +111,10 @@ static void address_assigned(const usbh_transfer *transfer,
 
 	LOG_LN("succeeded in set address to device");
 	dev->address = transfer->setup.wValue;
+	dev->host->by_address[dev->address] = dev;
 
 	LOG_LN("trying to read partial device descriptor from device");
-	usbh_ctrlreq_read_dev_desc(dev, dev->host->buffer, 8, got_partial_dev_desc);
+	usbh_ctrlreq_read_dev_desc(dev, dev->buffer, 8, got_partial_dev_desc);
 }
 
 /**
@@ -113,7 +125,7 @@ static void address_assigned(const usbh_transfer *transfer,
  */
 static uint8_t alloc_device_address(usbh_host *host)
 {
-	unsigned i, j;
+	unsigned i;
 	for (i = 0; i < 127; i++) {
 		/* fail after 127 attempts! (address space is full) */
 
@@ -121,16 +133,7 @@ static uint8_t alloc_device_address(usbh_host *host)
 		addr = (!addr) ? 1 : addr;
 		host->next_device_address = (addr == 0x7F) ? 1 : (addr + 1);
 
-		for (j = 0; j < DEVICE_ARRAY_LENGTH; j++) {
-			usbh_device *dev = &host->devices[j];
-			if (IS_DEVICE_VALID(dev) && dev->address == addr) {
-				/* address is being used! */
-				addr = 0;
-				break;
-			}
-		}
-
-		if (addr) {
+		if (host->by_address[addr] == NULL) {
 			/* tada! we found a unused address */
 			LOGF_LN("address 0x%"PRIx8" is free for use", addr);
 			return addr;
@@ -150,6 +153,7 @@ static void set_address(usbh_device *dev)
 	uint8_t addr = alloc_device_address(dev->host);
 	if (!addr) {
 		LOG_LN("no device address to assign for SET_ADDRESS");
+		dev->host->address0_busy = false;
 		enum_failed(dev);
 		return;
 	}
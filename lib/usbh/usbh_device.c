@@ -25,6 +25,11 @@
  */
 void usbh_device_invalidate(usbh_device *dev)
 {
+	if (dev->host != NULL && dev->address &&
+			dev->host->by_address[dev->address] == dev) {
+		dev->host->by_address[dev->address] = NULL;
+	}
+
 	dev->host = NULL;
 	dev->parent = NULL;
 	dev->port = 0;
@@ -34,6 +39,7 @@ void usbh_device_invalidate(usbh_device *dev)
 	dev->dtog = 0;
 	dev->disconnected = NULL;
 	dev->hub_ports = 0;
+	dev->urbs = NULL;
 }
 
 /**
@@ -50,7 +56,7 @@ void usbh_device_connected(usbh_host *host, usbh_device *parent,
 	usbh_device *dev = NULL;
 	unsigned i;
 
-	for (i = 0; i < DEVICE_ARRAY_LENGTH; i++) {
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
 		usbh_device *tmp = &host->devices[i];
 		if (IS_DEVICE_INVALID(tmp)) {
 			dev = tmp;
@@ -60,6 +66,7 @@ void usbh_device_connected(usbh_host *host, usbh_device *parent,
 
 	if (dev == NULL) {
 		LOG_LN("no empty device object left to store newly connected device");
+		host->address0_busy = false;
 		return;
 	}
 
@@ -83,26 +90,27 @@ void usbh_device_connected(usbh_host *host, usbh_device *parent,
 void usbh_device_disconnected(usbh_device *dev)
 {
 	usbh_host *host = dev->host;
+	usbh_urb *urb;
 	unsigned i;
 
 	/* remove all URB */
-	for (i = 0; i < URB_ARRAY_LENGTH; i++) {
-		usbh_urb *urb = &host->urbs[i];
-		if (urb->id != USBH_INVALID_URB_ID && urb->transfer.device == dev) {
-			LOGF_LN("urb %"PRIu64" got removed because device disconnected.",
-				urb->id);
-			usbh_urb_free(urb, USBH_ERR_NO_DEVICE);
-		}
+	while ((urb = dev->urbs) != NULL) {
+		LOGF_LN("urb %"PRIu64" got removed because device disconnected.",
+			urb->id);
+		usbh_urb_free(urb, USBH_ERR_NO_DEVICE);
 	}
 
 	/* remove all child devices */
-	for (i = 0; i < DEVICE_ARRAY_LENGTH; i++) {
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
 		usbh_device *child = &host->devices[i];
 		if (child->parent == dev) {
 			usbh_device_disconnected(child);
 		}
 	}
 
+	/* stop the hub driver (if a hub) */
+	usbh_hub_disconnected(dev);
+
 	if (dev->disconnected != NULL) {
 		dev->disconnected(dev);
 	}
@@ -114,7 +122,7 @@ void usbh_device_disconnected(usbh_device *dev)
 usbh_device *get_root_device(usbh_host *host)
 {
 	unsigned i;
-	for (i = 0; i < DEVICE_ARRAY_LENGTH; i++) {
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
 		usbh_device *dev = host->devices[i];
 		if (IS_DEVICE_VALID(dev) && IS_ROOT_HUB(dev)) {
 			return dev;
@@ -127,12 +135,22 @@ usbh_device *get_root_device(usbh_host *host)
 
 void usbh_root_device_connected(usbh_host *host, usbh_speed speed)
 {
+	/* Device just reset by backend, at address 0 */
+	host->address0_busy = true;
 	usbh_device_connected(host, NULL, 0, speed);
 }
 
 void usbh_root_device_disconnected(usbh_host *host)
 {
-	usbh_device_disconnected(host->devices);
+	unsigned i;
+
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
+		usbh_device *dev = &host->devices[i];
+		if (IS_DEVICE_VALID(dev) && IS_ROOT_HUB(dev)) {
+			usbh_device_disconnected(dev);
+			return;
+		}
+	}
 }
 
 usbh_host *usbh_device_host(usbh_device *dev)
@@ -190,13 +208,15 @@ void usbh_device_ep_dtog_reset_all(usbh_device *dev)
 void usbh_device_reset(usbh_device *dev)
 {
 	usbh_host *host = dev->host;
+	usbh_device *parent = dev->parent;
+	uint8_t port = dev->port;
 
 	usbh_device_disconnected(dev); /* clear everything off */
 
-	if (IS_ROOT_HUB(dev)) {
+	if (parent == NULL) {
 		host->backend->reset(host); /* reset the periph */
 	} else {
-		usbh_hub_reset_port(dev->parent, dev->port);
+		usbh_hub_reset_port(parent, port);
 	}
 }
 
@@ -212,7 +232,7 @@ unsigned usbh_search_devices_by_parent(usbh_host *host, usbh_device *parent,
 	unsigned len = 0;
 	unsigned i;
 
-	for (i = 0; i < DEVICE_ARRAY_LENGTH; i++) {
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
 		usbh_device *dev = &host->devices[i];
 		if (IS_DEVICE_VALID(dev) && dev->parent == parent) {
 			list[len++] = dev;
@@ -227,13 +247,9 @@ unsigned usbh_search_devices_by_parent(usbh_host *host, usbh_device *parent,
 
 usbh_device *usb_device_by_address(usbh_host *host, uint8_t address)
 {
-	unsigned i;
-	for (i = 0; i < DEVICE_ARRAY_LENGTH; i++) {
-		usbh_device *dev = &host->devices[i];
-		if (IS_DEVICE_VALID(dev) && dev->address == address) {
-			return dev;
-		}
+	if (address > 127) {
+		return NULL;
 	}
 
-	return NULL;
+	return host->by_address[address];
 }
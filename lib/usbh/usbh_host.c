@@ -29,52 +29,29 @@ usbh_host *usbh_init(const usbh_backend *backend,
 	host->connected = NULL;
 	host->last_poll = 0;
 	host->next_device_address = 1;
-	host->next_urb_id = 1;
 
-	for (i = 0; i < DEVICE_ARRAY_LENGTH; i++) {
-		usbh_device_invalidate(&host->devices[i]);
+	for (i = 0; i < 128; i++) {
+		host->by_address[i] = NULL;
 	}
 
-	for (i = 0; i < URB_ARRAY_LENGTH; i++) {
-		usbh_urb_invalidate(&host->urbs[i]);
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
+		usbh_device_invalidate(&host->devices[i]);
 	}
 
-	return host;
-}
-
-static void poll_urb(usbh_host *host, uint64_t now)
-{
-	unsigned i;
-	for (i = 0; i < URB_ARRAY_LENGTH; i++) {
-		usbh_urb *urb = &host->urbs[i];
-
-		/* check if the URB is even valid */
-		if (IS_URB_INVALID(urb)) {
-			continue;
-		}
+	usbh_urb_init(host);
 
-		/* check if the transfer has time'd out */
-		if (urb->timeout_on && now >= urb->timeout_on) {
-			LOGF_LN("urb %"PRIu64" time'd out", urb->id);
-			usbh_urb_free(urb, USBH_ERR_TIMEOUT);
-			continue;
-		}
+	usbh_hub_init(host);
 
-		/* get a channel from the backend for the URB */
-		if (urb->backend_tag == INVALID_BACKEND_TAG) {
-			LOGF_LN("try to submit urb %"PRIu64" to backend", urb->id);
-			host->backend->transfer_submit(host, urb);
-			continue;
-		}
-	}
+	return host;
 }
 
 void usbh_poll(usbh_host *host, uint32_t us)
 {
 	uint64_t now = host->last_poll + us;
 	host->backend->poll(host, now);
-	poll_urb(host, now);
+	usbh_urb_poll(host, now);
 	host->last_poll = now;
+	usbh_hub_poll(host);
 }
 
 void usbh_register_connected_callback(usbh_host *host,
@@ -18,11 +18,772 @@
  */
 
 #include "usbh-private.h"
+#include <unicore-mx/usbh/helper/ctrlreq.h>
+#include <string.h>
+
+/*
+ * Hub driver
+ *
+ * Start (one control request at a time):
+ *   CONFIG_DESC: read configuration descriptor (status change endpoint)
+ *   SET_CONFIG: configure the hub
+ *   HUB_DESC: read hub descriptor (number of ports, power on delay)
+ *   POWER: power every port
+ *   POWER_WAIT: wait power good, then read status of all ports
+ *   RUNNING: status change endpoint polled, ports serviced
+ *
+ * Port:
+ *   IDLE: nothing connected
+ *   DEBOUNCE: connected, wait 100ms (restarted on connection change)
+ *   RESET_WAIT: wait for the device at address 0 to be addressed
+ *   RESETTING: port reset (device will be at address 0)
+ *   RECOVERY: reset done, wait 10ms
+ *   ENUM: device given to usbh_device_connected()
+ *   DISABLED: reset failed, port disabled or over current
+ *
+ * Only one device on the bus can be at address 0 (host::address0_busy),
+ *  it is released as soon as SET_ADDRESS complete (usbh_dev_enum.c).
+ *  So, port B is reset while device of port A is still in enumeration.
+ */
+
+#define HUB_STATE_CONFIG_DESC	0
+#define HUB_STATE_SET_CONFIG	1
+#define HUB_STATE_HUB_DESC	2
+#define HUB_STATE_POWER		3
+#define HUB_STATE_POWER_WAIT	4
+#define HUB_STATE_RUNNING	5
+#define HUB_STATE_FAILED	6
+
+#define PORT_STATE_IDLE		0
+#define PORT_STATE_DEBOUNCE	1
+#define PORT_STATE_RESET_WAIT	2
+#define PORT_STATE_RESETTING	3
+#define PORT_STATE_RECOVERY	4
+#define PORT_STATE_ENUM		5
+#define PORT_STATE_DISABLED	6
+
+/* USB 2.0: 7.1.7.3 (debounce), 7.1.7.5 (reset recovery) */
+#define DEBOUNCE_MS		100
+#define RESET_TIMEOUT_MS	500
+#define RECOVERY_MS		10
+
+/* Tier limit: five hubs between host and a device */
+#define MAX_HUB_DEPTH		5
+
+#define REQ_HUB_OUT (USB_REQ_TYPE_OUT | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_DEVICE)
+#define REQ_HUB_IN (USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_DEVICE)
+#define REQ_PORT_OUT (USB_REQ_TYPE_OUT | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_OTHER)
+#define REQ_PORT_IN (USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_OTHER)
+
+static void kick(usbh_hub *hub);
+
+static inline uint64_t now_of(usbh_hub *hub)
+{
+	return hub->dev->host->last_poll;
+}
+
+static usbh_hub *hub_find(usbh_device *dev)
+{
+	usbh_host *host = dev->host;
+	unsigned i;
+
+	if (host == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < USBH_HUB_COUNT; i++) {
+		if (host->hubs[i].dev == dev) {
+			return &host->hubs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static usbh_device *port_device(usbh_hub *hub, uint8_t port)
+{
+	usbh_host *host = hub->dev->host;
+	unsigned i;
+
+	for (i = 0; i < USBH_DEVICE_COUNT; i++) {
+		usbh_device *dev = &host->devices[i];
+		if (IS_DEVICE_VALID(dev) && dev->parent == hub->dev &&
+				dev->port == port) {
+			return dev;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Release address 0 if the port hold it (device reset, not addressed)
+ * @param[in] hub Hub
+ * @param[in] port Port
+ */
+static void port_release(usbh_hub *hub, uint8_t port)
+{
+	uint8_t state = hub->port[port].state;
+
+	if (state == PORT_STATE_RESETTING || state == PORT_STATE_RECOVERY) {
+		hub->dev->host->address0_busy = false;
+	}
+}
+
+/**
+ * Device on port gone (or going to be reset)
+ * @param[in] hub Hub
+ * @param[in] port Port
+ */
+static void port_detach(usbh_hub *hub, uint8_t port)
+{
+	usbh_device *child = port_device(hub, port);
+
+	port_release(hub, port);
+
+	if (child != NULL) {
+		LOGF_LN("hub %"PRIu8": device on port %"PRIu8" disconnected",
+			hub->dev->address, port);
+		usbh_device_disconnected(child);
+	}
+}
+
+/**
+ * Common part of request callback
+ * @param[in] transfer Transfer
+ * @param[in] status Status
+ * @return hub to continue with, NULL if nothing to do
+ */
+static usbh_hub *request_done(const usbh_transfer *transfer,
+		usbh_transfer_status status)
+{
+	usbh_hub *hub = hub_find(transfer->device);
+
+	if (hub == NULL) {
+		return NULL;
+	}
+
+	hub->busy = false;
+
+	switch (status) {
+	case USBH_ERR_NO_DEVICE:
+	case USBH_ERR_CANCEL:
+		/* Hub going away */
+		return NULL;
+	case USBH_ERR_RES_UNAVAIL:
+		/* No URB left, retry at next poll */
+		return NULL;
+	default:
+		return hub;
+	}
+}
+
+static void start_failed(usbh_hub *hub, const char *what)
+{
+	LOGF_LN("hub %"PRIu8": %s failed", hub->dev->address, what);
+	(void) what;
+	hub->state = HUB_STATE_FAILED;
+}
+
+/**
+ * Find the first interrupt IN endpoint of the hub interface
+ * @param[in] hub Hub
+ * @param[in] len Configuration descriptor length
+ * @return true if found
+ */
+static bool parse_config(usbh_hub *hub, uint16_t len)
+{
+	const struct usb_config_descriptor *cfg =
+		(const struct usb_config_descriptor *) hub->buffer;
+	uint16_t i;
+
+	if (len < USB_DT_CONFIGURATION_SIZE ||
+			cfg->bDescriptorType != USB_DT_CONFIGURATION) {
+		return false;
+	}
+
+	hub->config_value = cfg->bConfigurationValue;
+
+	for (i = cfg->bLength; (i + 2) <= len; i += hub->buffer[i]) {
+		const struct usb_endpoint_descriptor *ep =
+			(const struct usb_endpoint_descriptor *) &hub->buffer[i];
+
+		if (!hub->buffer[i]) {
+			break;
+		}
+
+		if (ep->bDescriptorType != USB_DT_ENDPOINT ||
+				(i + USB_DT_ENDPOINT_SIZE) > len) {
+			continue;
+		}
+
+		if ((ep->bmAttributes & USB_ENDPOINT_ATTR_TYPE) ==
+				USB_ENDPOINT_ATTR_INTERRUPT &&
+				(ep->bEndpointAddress & 0x80)) {
+			hub->ep_addr = ep->bEndpointAddress;
+			hub->ep_size = ep->wMaxPacketSize & 0x7FF;
+
+			/* frames (full/low speed), microframes (high speed) */
+			if (hub->dev->speed >= USBH_SPEED_HIGH) {
+				hub->interval = 1 << (MIN(MAX(ep->bInterval, 1), 16) - 1);
+			} else {
+				hub->interval = MAX(ep->bInterval, 1);
+			}
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void config_desc_read(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	if (status != USBH_SUCCESS ||
+			!parse_config(hub, transfer->transferred)) {
+		start_failed(hub, "configuration descriptor");
+	} else {
+		hub->state = HUB_STATE_SET_CONFIG;
+	}
+
+	kick(hub);
+}
+
+static void config_set(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	if (status != USBH_SUCCESS) {
+		start_failed(hub, "set configuration");
+	} else {
+		usbh_device_ep_dtog_reset_all(hub->dev);
+		hub->state = HUB_STATE_HUB_DESC;
+	}
+
+	kick(hub);
+}
+
+static void hub_desc_read(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	const struct usb_hub_descriptor *desc;
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	desc = (const struct usb_hub_descriptor *) hub->buffer;
+	if (status != USBH_SUCCESS || transfer->transferred < USB_DT_HUB_SIZE ||
+			desc->bDescriptorType != USB_DT_HUB || !desc->bNbrPorts) {
+		start_failed(hub, "hub descriptor");
+	} else {
+		LOGF_LN("hub %"PRIu8": %"PRIu8" ports", hub->dev->address,
+			desc->bNbrPorts);
+		hub->ports = MIN(desc->bNbrPorts, HUB_MAX_PORTS);
+		hub->power_delay = desc->bPwrOn2PwrGood;
+		hub->dev->hub_ports = hub->ports;
+		hub->port_next = 1;
+		hub->state = HUB_STATE_POWER;
+	}
+
+	kick(hub);
+}
+
+static void port_powered(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	if (status != USBH_SUCCESS) {
+		start_failed(hub, "port power");
+	} else if (++hub->port_next > hub->ports) {
+		hub->state = HUB_STATE_POWER_WAIT;
+		hub->deadline = now_of(hub) + MS2US(hub->power_delay * 2);
+	}
+
+	kick(hub);
+}
+
+static void status_changed(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = hub_find(transfer->device);
+	uint16_t i;
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	hub->polling = false;
+
+	if (status != USBH_SUCCESS) {
+		/* resubmitted at next poll (if hub still there) */
+		return;
+	}
+
+	for (i = 0; i < (transfer->transferred * 8u) && i <= hub->ports; i++) {
+		if (hub->change[i / 8] & (1 << (i % 8))) {
+			hub->pending |= 1 << i;
+		}
+	}
+
+	kick(hub);
+}
+
+static void feature_cleared(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	uint8_t port = transfer->setup.wIndex;
+	uint8_t bit = transfer->setup.wValue;
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	if (port) {
+		bit -= USB_HUB_FEAT_C_PORT_CONNECTION;
+	}
+
+	/* on failure, hub report the change again */
+	hub->port[port].clear &= ~(1 << bit);
+	kick(hub);
+}
+
+/**
+ * Port status read, act on it
+ * @param[in] hub Hub
+ * @param[in] port Port
+ */
+static void port_update(usbh_hub *hub, uint8_t port)
+{
+	struct usbh_hub_port *p = &hub->port[port];
+	uint16_t status = hub->status.wStatus;
+	uint16_t change = hub->status.wChange;
+	uint64_t now = now_of(hub);
+
+	LOGF_LN("hub %"PRIu8": port %"PRIu8" status 0x%"PRIx16" change 0x%"PRIx16,
+		hub->dev->address, port, status, change);
+
+	if (change & USB_HUB_PORT_CHANGE_CONNECTION) {
+		port_detach(hub, port);
+
+		if (status & USB_HUB_PORT_STATUS_CONNECTION) {
+			p->state = PORT_STATE_DEBOUNCE;
+			p->deadline = now + MS2US(DEBOUNCE_MS);
+		} else {
+			p->state = PORT_STATE_IDLE;
+		}
+		return;
+	}
+
+	if (!(status & USB_HUB_PORT_STATUS_CONNECTION)) {
+		port_detach(hub, port);
+		p->state = PORT_STATE_IDLE;
+		return;
+	}
+
+	if (change & USB_HUB_PORT_CHANGE_OVER_CURRENT) {
+		LOGF_LN("hub %"PRIu8": port %"PRIu8" over current",
+			hub->dev->address, port);
+		port_detach(hub, port);
+		p->state = PORT_STATE_DISABLED;
+		return;
+	}
+
+	if (p->state == PORT_STATE_RESETTING &&
+			(change & USB_HUB_PORT_CHANGE_RESET) &&
+			!(status & USB_HUB_PORT_STATUS_RESET)) {
+		if (!(status & USB_HUB_PORT_STATUS_ENABLE)) {
+			LOGF_LN("hub %"PRIu8": port %"PRIu8" not enabled after reset",
+				hub->dev->address, port);
+			port_release(hub, port);
+			p->state = PORT_STATE_DISABLED;
+			return;
+		}
+
+		if (status & USB_HUB_PORT_STATUS_LOW_SPEED) {
+			p->speed = USBH_SPEED_LOW;
+		} else if (status & USB_HUB_PORT_STATUS_HIGH_SPEED) {
+			p->speed = USBH_SPEED_HIGH;
+		} else {
+			p->speed = USBH_SPEED_FULL;
+		}
+
+		p->state = PORT_STATE_RECOVERY;
+		p->deadline = now + MS2US(RECOVERY_MS);
+		return;
+	}
+
+	if ((change & USB_HUB_PORT_CHANGE_ENABLE) &&
+			!(status & USB_HUB_PORT_STATUS_ENABLE) &&
+			p->state == PORT_STATE_ENUM) {
+		/* Port disabled by hub (babble, ...) */
+		port_detach(hub, port);
+		p->state = PORT_STATE_DISABLED;
+	}
+}
+
+static void status_read(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	uint8_t port = transfer->setup.wIndex;
+	(void) urb_id;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	hub->pending &= ~(1 << port);
+
+	if (status != USBH_SUCCESS ||
+			transfer->transferred < sizeof(hub->status)) {
+		/* Change not cleared, hub will report it again */
+		LOGF_LN("hub %"PRIu8": status of %"PRIu8" not read",
+			hub->dev->address, port);
+	} else {
+		hub->port[port].clear = hub->status.wChange & 0x1F;
+
+		if (port) {
+			port_update(hub, port);
+		} else {
+			LOGF_LN("hub %"PRIu8": hub status 0x%"PRIx16" change 0x%"PRIx16,
+				hub->dev->address, hub->status.wStatus,
+				hub->status.wChange);
+		}
+	}
+
+	kick(hub);
+}
+
+static void reset_started(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	usbh_hub *hub = request_done(transfer, status);
+	uint8_t port = transfer->setup.wIndex;
+	(void) urb_id;
+
+	if (hub == NULL) {
+		hub = hub_find(transfer->device);
+		if (hub != NULL && status == USBH_ERR_RES_UNAVAIL) {
+			/* No URB left, reset again at next poll */
+			port_release(hub, port);
+			hub->port[port].state = PORT_STATE_RESET_WAIT;
+		}
+		return;
+	}
+
+	if (status != USBH_SUCCESS) {
+		port_release(hub, port);
+		hub->port[port].state = PORT_STATE_DISABLED;
+	}
+
+	kick(hub);
+}
+
+static usbh_urb_id port_request(usbh_hub *hub, uint8_t bmRequestType,
+		uint8_t bRequest, uint16_t wValue, uint8_t port, void *data,
+		uint16_t wLength, usbh_transfer_callback callback)
+{
+	hub->busy = true;
+	return usbh_ctrlreq_ep0(hub->dev, bmRequestType, bRequest, wValue, port,
+		data, wLength, callback);
+}
+
+static void poll_status(usbh_hub *hub)
+{
+	usbh_transfer transfer = {
+		.device = hub->dev,
+		.ep_type = USBH_EP_INTERRUPT,
+		.ep_addr = hub->ep_addr,
+		.ep_size = hub->ep_size,
+		.data = hub->change,
+		.length = MIN(hub->ep_size, sizeof(hub->change)),
+		.flags = USBH_FLAG_NONE,
+		.interval = hub->interval,
+		.timeout = USBH_TIMEOUT_NEVER,
+		.callback = status_changed
+	};
+
+	hub->polling = true;
+	usbh_transfer_submit(&transfer);
+}
+
+/**
+ * Service the ports: clear change bits, read status, timers, reset
+ * @param[in] hub Hub
+ */
+static void ports_step(usbh_hub *hub)
+{
+	usbh_host *host = hub->dev->host;
+	uint64_t now = now_of(hub);
+	uint8_t i, bit;
+
+	for (i = 0; i <= hub->ports; i++) {
+		uint8_t clear = hub->port[i].clear;
+
+		if (!clear) {
+			continue;
+		}
+
+		bit = __builtin_ctz(clear);
+
+		if (i) {
+			port_request(hub, REQ_PORT_OUT, USB_HUB_REQ_CLEAR_FEATURE,
+				USB_HUB_FEAT_C_PORT_CONNECTION + bit, i, NULL, 0,
+				feature_cleared);
+		} else {
+			port_request(hub, REQ_HUB_OUT, USB_HUB_REQ_CLEAR_FEATURE,
+				USB_HUB_FEAT_C_HUB_LOCAL_POWER + bit, 0, NULL, 0,
+				feature_cleared);
+		}
+		return;
+	}
+
+	for (i = 0; i <= hub->ports; i++) {
+		if (hub->pending & (1 << i)) {
+			port_request(hub, i ? REQ_PORT_IN : REQ_HUB_IN,
+				USB_HUB_REQ_GET_STATUS, 0, i, &hub->status,
+				sizeof(hub->status), status_read);
+			return;
+		}
+	}
+
+	for (i = 1; i <= hub->ports; i++) {
+		struct usbh_hub_port *p = &hub->port[i];
+
+		switch (p->state) {
+		case PORT_STATE_DEBOUNCE:
+			if (now >= p->deadline) {
+				p->state = PORT_STATE_RESET_WAIT;
+			}
+		break;
+		case PORT_STATE_RESETTING:
+			if (now >= p->deadline) {
+				LOGF_LN("hub %"PRIu8": port %"PRIu8" reset timeout",
+					hub->dev->address, i);
+				port_release(hub, i);
+				p->state = PORT_STATE_DISABLED;
+			}
+		break;
+		case PORT_STATE_RECOVERY:
+			if (now >= p->deadline) {
+				/* address 0 now belong to enumeration */
+				p->state = PORT_STATE_ENUM;
+				usbh_device_connected(host, hub->dev, i, p->speed);
+
+				if (port_device(hub, i) == NULL) {
+					LOGF_LN("hub %"PRIu8": port %"PRIu8" device not"
+						" enumerated", hub->dev->address, i);
+					p->state = PORT_STATE_DISABLED;
+				}
+			}
+		break;
+		}
+	}
+
+	for (i = 1; i <= hub->ports; i++) {
+		struct usbh_hub_port *p = &hub->port[i];
+
+		if (p->state == PORT_STATE_RESET_WAIT && !host->address0_busy) {
+			host->address0_busy = true;
+			p->state = PORT_STATE_RESETTING;
+			p->deadline = now + MS2US(RESET_TIMEOUT_MS);
+			port_request(hub, REQ_PORT_OUT, USB_HUB_REQ_SET_FEATURE,
+				USB_HUB_FEAT_PORT_RESET, i, NULL, 0, reset_started);
+			return;
+		}
+	}
+}
+
+static void step(usbh_hub *hub)
+{
+	usbh_device *dev = hub->dev;
+
+	if (hub->state == HUB_STATE_RUNNING && !hub->polling) {
+		poll_status(hub);
+	}
+
+	if (hub->busy) {
+		return;
+	}
+
+	switch (hub->state) {
+	case HUB_STATE_CONFIG_DESC:
+		hub->busy = true;
+		usbh_ctrlreq_read_config_desc(dev, 0, hub->buffer,
+			sizeof(hub->buffer), config_desc_read);
+	break;
+	case HUB_STATE_SET_CONFIG:
+		hub->busy = true;
+		usbh_ctrlreq_set_config(dev, hub->config_value, config_set);
+	break;
+	case HUB_STATE_HUB_DESC:
+		port_request(hub, REQ_HUB_IN, USB_HUB_REQ_GET_DESCRIPTOR,
+			USB_DT_HUB << 8, 0, hub->buffer, USB_DT_HUB_SIZE,
+			hub_desc_read);
+	break;
+	case HUB_STATE_POWER:
+		port_request(hub, REQ_PORT_OUT, USB_HUB_REQ_SET_FEATURE,
+			USB_HUB_FEAT_PORT_POWER, hub->port_next, NULL, 0,
+			port_powered);
+	break;
+	case HUB_STATE_POWER_WAIT:
+		if (now_of(hub) < hub->deadline) {
+			break;
+		}
+
+		/* Read all port status (device connected before power on) */
+		hub->state = HUB_STATE_RUNNING;
+		hub->pending = (1 << (hub->ports + 1)) - 2;
+		poll_status(hub);
+		ports_step(hub);
+	break;
+	case HUB_STATE_RUNNING:
+		ports_step(hub);
+	break;
+	}
+}
+
+static void kick(usbh_hub *hub)
+{
+	if (hub->kick.busy) {
+		hub->kick.again = true;
+		return;
+	}
+
+	hub->kick.busy = true;
+
+	do {
+		hub->kick.again = false;
+
+		if (hub->dev == NULL) {
+			/* disconnected in a callback */
+			break;
+		}
+
+		step(hub);
+	} while (hub->kick.again);
+
+	hub->kick.busy = false;
+}
+
+static unsigned hub_depth(usbh_device *dev)
+{
+	unsigned depth = 0;
+
+	for (; dev != NULL; dev = dev->parent) {
+		depth++;
+	}
+
+	return depth;
+}
+
+bool usbh_hub_start(usbh_device *dev)
+{
+	usbh_host *host = dev->host;
+	usbh_hub *hub = NULL;
+	unsigned i;
+
+	if (hub_depth(dev) > MAX_HUB_DEPTH) {
+		LOGF_LN("hub %"PRIu8": beyond the tier limit", dev->address);
+		return false;
+	}
+
+	for (i = 0; i < USBH_HUB_COUNT; i++) {
+		if (host->hubs[i].dev == NULL) {
+			hub = &host->hubs[i];
+			break;
+		}
+	}
+
+	if (hub == NULL) {
+		LOG_LN("no empty hub object left to store hub");
+		return false;
+	}
+
+	memset(hub, 0, sizeof(*hub));
+	hub->dev = dev;
+	hub->state = HUB_STATE_CONFIG_DESC;
+
+	kick(hub);
+	return true;
+}
+
+void usbh_hub_disconnected(usbh_device *dev)
+{
+	usbh_hub *hub = hub_find(dev);
+	uint8_t i;
+
+	if (hub == NULL) {
+		return;
+	}
+
+	for (i = 1; i <= hub->ports; i++) {
+		port_release(hub, i);
+	}
+
+	hub->dev = NULL;
+}
+
+void usbh_hub_init(usbh_host *host)
+{
+	unsigned i;
+
+	host->address0_busy = false;
+
+	for (i = 0; i < USBH_HUB_COUNT; i++) {
+		host->hubs[i].dev = NULL;
+	}
+}
+
+void usbh_hub_poll(usbh_host *host)
+{
+	unsigned i;
+
+	for (i = 0; i < USBH_HUB_COUNT; i++) {
+		if (host->hubs[i].dev != NULL) {
+			kick(&host->hubs[i]);
+		}
+	}
+}
 
 void usbh_hub_reset_port(usbh_device *dev, uint8_t port)
 {
-	(void) dev;
-	(void) port;
+	usbh_hub *hub = hub_find(dev);
+	struct usbh_hub_port *p;
+
+	if (hub == NULL || !port || port > hub->ports) {
+		return;
+	}
 
-	/* TODO */
+	p = &hub->port[port];
+	if (p->state == PORT_STATE_ENUM || p->state == PORT_STATE_DISABLED) {
+		p->state = PORT_STATE_RESET_WAIT;
+		kick(hub);
+	}
 }
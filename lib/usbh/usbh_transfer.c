@@ -69,19 +69,8 @@ usbh_urb_id usbh_transfer_submit(const usbh_transfer *transfer)
 		}
 	}
 
-	/* Search for a free URB */
-	usbh_urb *urb = NULL;
-	unsigned i;
-	for (i = 0; i < URB_ARRAY_LENGTH; i++) {
-		usbh_urb *tmp = &host->urbs[i];
-		if (IS_URB_INVALID(tmp)) {
-			LOGF_LN("urb at offset %"PRIu8" is currently unused", i);
-			urb = tmp;
-			break;
-		}
-	}
-
-	/* check if got any URB free */
+	/* Get a free URB */
+	usbh_urb *urb = usbh_urb_alloc(host);
 	if (urb == NULL) {
 		LOG_LN("WARN: all urb in use");
 		TRANSFER_NO_RES(transfer);
@@ -89,36 +78,32 @@ usbh_urb_id usbh_transfer_submit(const usbh_transfer *transfer)
 	}
 
 	/* store the information in URB */
-	urb->id = host->next_urb_id++;
+	usbh_urb_id urb_id = urb->id;
 	urb->transfer = *transfer;
 	urb->transfer.transferred = 0;
 	urb->timeout_on = transfer->timeout ?
 		(host->last_poll + MS2US(transfer->timeout)) : 0;
-	urb->backend_tag = INVALID_BACKEND_TAG;
 
-	LOGF_LN("Create URB with id = %"PRIu64, urb->id);
+	LOGF_LN("Create URB with id = %"PRIu64, urb_id);
 
-	host->backend->transfer_submit(host, urb);
+	usbh_urb_submit(host, urb);
 
-	return urb->id;
+	return urb_id;
 }
 
 void usbh_transfer_cancel(usbh_host *host, usbh_urb_id urb_id)
 {
-	unsigned i;
 	if (IS_URB_ID_INVALID(urb_id)) {
 		LOG_LN("invalid urb id passed to transfer_cancel");
 		return;
 	}
 
-	for (i = 0; i < URB_ARRAY_LENGTH; i++) {
-		usbh_urb *urb = &host->urbs[i];
-		if (urb->id == urb_id) {
-			LOGF_LN("urb %"PRIu64" cancelled", urb->id);
-			usbh_urb_free(urb, USBH_ERR_CANCEL);
-			return;
-		}
+	usbh_urb *urb = usbh_urb_from_id(host, urb_id);
+	if (urb == NULL) {
+		LOGF_LN("WARN: urb with id = %"PRIu64" not found", urb_id);
+		return;
 	}
 
-	LOGF_LN("WARN: urb with id = %"PRIu64" not found", urb_id);
+	LOGF_LN("urb %"PRIu64" cancelled", urb->id);
+	usbh_urb_free(urb, USBH_ERR_CANCEL);
 }
@@ -40,14 +40,318 @@ static const char *stringify_transfer_status(usbh_transfer_status status) {
 }
 #endif
 
+/*
+ * URB objects are in one of:
+ *  - "unused" list (free)
+ *  - "pending" list: submitted, waiting for a backend resource (channel),
+ *     retried in submit order by usbh_poll() till the backend accept one.
+ *  - submitted to backend (usbh_urb::backend_tag valid)
+ * In use URB are also linked to the device (usbh_device::urbs), so
+ *  device disconnect only touch its URB.
+ * URB with timeout are kept in a min-heap ordered by deadline, usbh_poll()
+ *  only look at the top of the heap.
+ * URB ID contain the URB index (see USBH_URB_ID()), no search to find it.
+ * None of the operation depend on USBH_URB_COUNT.
+ */
+
 /**
- * Invalidate the URB.
- * It will mark this as free for other use
+ * Store the URB at @a index in the timeout heap
+ * @param[in] host USB Host
+ * @param[in] urb USB Request Block
+ * @param[in] index Heap index
+ */
+static inline void timeout_place(usbh_host *host, usbh_urb *urb,
+						unsigned index)
+{
+	host->urbs.timeout.heap[index] = urb;
+	urb->timeout_index = index;
+}
+
+/**
+ * Move the URB at @a index towards the top till its parent expire before it
+ * @param[in] host USB Host
+ * @param[in] index Heap index
+ */
+static void timeout_sift_up(usbh_host *host, unsigned index)
+{
+	usbh_urb **heap = host->urbs.timeout.heap;
+	usbh_urb *urb = heap[index];
+
+	while (index > 0) {
+		unsigned parent = (index - 1) / 2;
+
+		if (heap[parent]->timeout_on <= urb->timeout_on) {
+			break;
+		}
+
+		timeout_place(host, heap[parent], index);
+		index = parent;
+	}
+
+	timeout_place(host, urb, index);
+}
+
+/**
+ * Move the URB at @a index towards the bottom till its childs expire after it
+ * @param[in] host USB Host
+ * @param[in] index Heap index
+ */
+static void timeout_sift_down(usbh_host *host, unsigned index)
+{
+	usbh_urb **heap = host->urbs.timeout.heap;
+	unsigned count = host->urbs.timeout.count;
+	usbh_urb *urb = heap[index];
+
+	for (;;) {
+		unsigned child = (index * 2) + 1;
+
+		if (child >= count) {
+			break;
+		}
+
+		if ((child + 1) < count &&
+			heap[child + 1]->timeout_on < heap[child]->timeout_on) {
+			child++;
+		}
+
+		if (urb->timeout_on <= heap[child]->timeout_on) {
+			break;
+		}
+
+		timeout_place(host, heap[child], index);
+		index = child;
+	}
+
+	timeout_place(host, urb, index);
+}
+
+static void timeout_insert(usbh_host *host, usbh_urb *urb)
+{
+	unsigned index = host->urbs.timeout.count++;
+
+	timeout_place(host, urb, index);
+	timeout_sift_up(host, index);
+}
+
+static void timeout_remove(usbh_host *host, usbh_urb *urb)
+{
+	unsigned index = urb->timeout_index;
+	usbh_urb *last = host->urbs.timeout.heap[--host->urbs.timeout.count];
+
+	urb->timeout_index = USBH_TIMEOUT_NOT_QUEUED;
+
+	if (last == urb) {
+		return;
+	}
+
+	/* Fill the hole with the last URB, and restore the heap order */
+	timeout_place(host, last, index);
+
+	if (index > 0 &&
+		host->urbs.timeout.heap[(index - 1) / 2]->timeout_on > last->timeout_on) {
+		timeout_sift_up(host, index);
+	} else {
+		timeout_sift_down(host, index);
+	}
+}
+
+static void pending_append(usbh_host *host, usbh_urb *urb)
+{
+	urb->state = USBH_URB_PENDING;
+	urb->next = NULL;
+	urb->prev = host->urbs.pending_last;
+
+	if (host->urbs.pending_last != NULL) {
+		host->urbs.pending_last->next = urb;
+	} else {
+		host->urbs.pending = urb;
+	}
+
+	host->urbs.pending_last = urb;
+}
+
+static void pending_remove(usbh_host *host, usbh_urb *urb)
+{
+	if (urb->prev != NULL) {
+		urb->prev->next = urb->next;
+	} else {
+		host->urbs.pending = urb->next;
+	}
+
+	if (urb->next != NULL) {
+		urb->next->prev = urb->prev;
+	} else {
+		host->urbs.pending_last = urb->prev;
+	}
+}
+
+static void device_remove(usbh_urb *urb)
+{
+	usbh_device *dev = urb->transfer.device;
+
+	if (urb->dev_prev != NULL) {
+		urb->dev_prev->dev_next = urb->dev_next;
+	} else {
+		dev->urbs = urb->dev_next;
+	}
+
+	if (urb->dev_next != NULL) {
+		urb->dev_next->dev_prev = urb->dev_prev;
+	}
+}
+
+/**
+ * Put all URB in unused list
+ * @param host USB Host
+ */
+void usbh_urb_init(usbh_host *host)
+{
+	unsigned i;
+
+	host->urbs.unused = NULL;
+	host->urbs.pending = NULL;
+	host->urbs.pending_last = NULL;
+	host->urbs.timeout.count = 0;
+
+	for (i = USBH_URB_COUNT; i-- > 0; ) {
+		usbh_urb *urb = &host->urbs.arr[i];
+		urb->id = USBH_URB_ID(0, i);
+		urb->state = USBH_URB_UNUSED;
+		urb->timeout_index = USBH_TIMEOUT_NOT_QUEUED;
+		urb->next = host->urbs.unused;
+		host->urbs.unused = urb;
+	}
+}
+
+/**
+ * Take a URB from unused list, with a new ID
+ * @param host USB Host
+ * @return URB (not linked anywhere), NULL if none left
+ */
+usbh_urb *usbh_urb_alloc(usbh_host *host)
+{
+	usbh_urb *urb = host->urbs.unused;
+
+	if (urb == NULL) {
+		return NULL;
+	}
+
+	host->urbs.unused = urb->next;
+	urb->id = USBH_URB_ID(USBH_URB_ID_SEQ(urb->id) + 1,
+		urb - host->urbs.arr);
+	return urb;
+}
+
+/**
+ * Link the URB (transfer and timeout_on filled) and try to submit to backend.
+ * If backend has no resource, it is retried from usbh_poll().
+ * @param host USB Host
+ * @param urb USB Request Block
+ */
+void usbh_urb_submit(usbh_host *host, usbh_urb *urb)
+{
+	usbh_device *dev = urb->transfer.device;
+
+	urb->dev_prev = NULL;
+	urb->dev_next = dev->urbs;
+	if (dev->urbs != NULL) {
+		dev->urbs->dev_prev = urb;
+	}
+	dev->urbs = urb;
+
+	if (urb->timeout_on) {
+		timeout_insert(host, urb);
+	}
+
+	urb->backend_tag = INVALID_BACKEND_TAG;
+	pending_append(host, urb);
+
+	host->backend->transfer_submit(host, urb);
+
+	if (urb->state == USBH_URB_PENDING &&
+			urb->backend_tag != INVALID_BACKEND_TAG) {
+		pending_remove(host, urb);
+		urb->state = USBH_URB_SUBMITTED;
+	}
+}
+
+/**
+ * Find the URB from its ID
+ * @param host USB Host
+ * @param urb_id URB ID
+ * @return URB, NULL if the URB is not in use (anymore)
+ */
+usbh_urb *usbh_urb_from_id(usbh_host *host, usbh_urb_id urb_id)
+{
+	size_t index = USBH_URB_ID_INDEX(urb_id);
+	usbh_urb *urb;
+
+	if (index >= USBH_URB_COUNT) {
+		return NULL;
+	}
+
+	urb = &host->urbs.arr[index];
+
+	/* ID will not match if URB has been reused */
+	if (IS_URB_INVALID(urb) || urb->id != urb_id) {
+		return NULL;
+	}
+
+	return urb;
+}
+
+/**
+ * Backend released the resource of @a urb without completing it
+ *  (example: channels reset), submit it again later.
+ * @param host USB Host
  * @param urb USB Request Block
  */
-void usbh_urb_invalidate(usbh_urb *urb)
+void usbh_urb_requeue(usbh_host *host, usbh_urb *urb)
 {
-	urb->id = USBH_INVALID_URB_ID;
+	urb->backend_tag = INVALID_BACKEND_TAG;
+
+	if (urb->state == USBH_URB_SUBMITTED) {
+		pending_append(host, urb);
+	}
+}
+
+/**
+ * Expire URB (deadline order) and submit pending URB (submit order)
+ * @param host USB Host
+ * @param now Current time
+ */
+void usbh_urb_poll(usbh_host *host, uint64_t now)
+{
+	usbh_urb *urb;
+
+	while (host->urbs.timeout.count) {
+		urb = host->urbs.timeout.heap[0];
+
+		if (now < urb->timeout_on) {
+			break;
+		}
+
+		LOGF_LN("urb %"PRIu64" time'd out", urb->id);
+		usbh_urb_free(urb, USBH_ERR_TIMEOUT);
+	}
+
+	/* Backend resource are shared, stop at the first refused */
+	while ((urb = host->urbs.pending) != NULL) {
+		LOGF_LN("try to submit urb %"PRIu64" to backend", urb->id);
+		host->backend->transfer_submit(host, urb);
+
+		if (urb->state != USBH_URB_PENDING) {
+			/* completed while submitting */
+			continue;
+		}
+
+		if (urb->backend_tag == INVALID_BACKEND_TAG) {
+			break;
+		}
+
+		pending_remove(host, urb);
+		urb->state = USBH_URB_SUBMITTED;
+	}
 }
 
 /**
@@ -60,10 +364,23 @@ void usbh_urb_free(usbh_urb *urb, usbh_transfer_status status)
 	LOG_CALL
 
 	usbh_urb_id cached_urb_id = urb->id;
-	urb->id = USBH_INVALID_URB_ID;
+	usbh_host *host = urb->transfer.device->host;
+
+	if (urb->state == USBH_URB_PENDING) {
+		pending_remove(host, urb);
+	}
+
+	if (urb->timeout_index != USBH_TIMEOUT_NOT_QUEUED) {
+		timeout_remove(host, urb);
+	}
+
+	device_remove(urb);
+
+	urb->state = USBH_URB_UNUSED;
+	urb->next = host->urbs.unused;
+	host->urbs.unused = urb;
 
 	if (urb->backend_tag != INVALID_BACKEND_TAG) {
-		usbh_host *host = urb->transfer.device->host;
 		host->backend->transfer_cancel(host, urb);
 	}
 
@@ -0,0 +1,540 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_audio test using loopback backend.
+ *
+ * A host and a codec are simulated around the class, one usbd_poll() per
+ *  (micro)frame. The codec clock is off nominal (crystal tolerance):
+ *
+ * - Playback 48 kHz stereo (full speed, clock from DMA blocks) and
+ *   96 kHz 8 channels (high speed, clock callback): the host follow the
+ *   feedback endpoint, after settling the DAC never get silence, the ring
+ *   stay near target and every sample is played once in order.
+ *   Same run with a host that ignore feedback show the underruns.
+ * - Capture 48 kHz stereo: packets carry nominal +/- 1 sample, every
+ *   sample reach the host once in order.
+ * - Sampling frequency control (SET_CUR/GET_CUR)
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/audio.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_OUT 0x01
+#define EP_FEEDBACK 0x81
+#define EP_IN 0x82
+
+/* Codec clock in micro samples per (micro)frame */
+#define MICRO 1000000
+
+/* Frames (or microframes) simulated, settling time */
+#define RUN_SOF 120000
+#define SETTLE_SOF 4000
+
+/* Host poll the feedback endpoint every 8 SOF periods */
+#define FEEDBACK_INTERVAL 8
+
+#define RING_SIZE 8192
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x000a,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 2,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static const struct usbd_backend_config hs_config = {
+	.ep_count = 16,
+	.speed = USBD_SPEED_HIGH
+};
+
+struct scenario {
+	const char *name;
+	bool high_speed;
+	uint8_t ep_addr;
+	uint32_t rate;
+	uint8_t frame_bytes;
+
+	/** Codec clock, micro samples per SOF period */
+	uint32_t codec_rate;
+
+	/** DMA block in samples */
+	uint32_t block;
+
+	/** Clock callback (false: DMA blocks) */
+	bool use_clock;
+
+	/** Host follow feedback */
+	bool feedback;
+};
+
+struct result {
+	uint32_t silence; /**< DMA blocks with silence after settling */
+	int32_t fill_min, fill_max; /**< Ring fill after settling (samples) */
+	double host_rate; /**< Samples per SOF sent by host after settling */
+	uint32_t samples; /**< Samples played or captured */
+	uint32_t packet_min, packet_max; /**< Capture packet (samples) */
+};
+
+static uint32_t ring[RING_SIZE / 4];
+static uint32_t packets[2 * 13 * 32 / 4];
+static uint8_t block_buf[96 * 32];
+
+static usbd_audio audio;
+static const struct scenario *current;
+static uint32_t codec_samples;
+
+static uint32_t codec_clock(usbd_audio *_audio)
+{
+	(void) _audio;
+	return codec_samples;
+}
+
+static unsigned rate_changes;
+
+static void rate_changed(usbd_audio *_audio)
+{
+	(void) _audio;
+	rate_changes++;
+}
+
+static uint16_t ep_size(const struct scenario *s)
+{
+	uint32_t sof_rate = s->high_speed ? 8000 : 1000;
+	return (s->rate / sof_rate + 1) * s->frame_bytes;
+}
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	/* Normally on SET_INTERFACE (streaming alternate setting) */
+	usbd_ep_prepare(dev, current->ep_addr, USBD_EP_ISOCHRONOUS,
+		ep_size(current), 1, USBD_EP_PERIODIC);
+	if (current->ep_addr == EP_OUT) {
+		usbd_ep_prepare(dev, EP_FEEDBACK, USBD_EP_ISOCHRONOUS, 4, 1,
+			USBD_EP_PERIODIC);
+	}
+
+	usbd_audio_start(&audio);
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_audio_setup_ep0(&audio, setup_data)) {
+		usbd_ep0_setup(dev, setup_data);
+	}
+}
+
+static void sof_callback(usbd_device *dev)
+{
+	(void) dev;
+	usbd_audio_sof(&audio);
+}
+
+/**
+ * Setup device for scenario, configure
+ * @param[in] s Scenario
+ * @return USB Device
+ */
+static usbd_device *setup(const struct scenario *s)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	const usbd_audio_config config = {
+		.ep_addr = s->ep_addr,
+		.ep_size = ep_size(s),
+		.ep_feedback = (s->ep_addr == EP_OUT) ? EP_FEEDBACK : 0,
+		.rate = s->rate,
+		.frame_bytes = s->frame_bytes,
+		.buffer = ring,
+		.size = RING_SIZE,
+		.packet_buffer = packets,
+		.clock = s->use_clock ? codec_clock : NULL,
+		.rate_callback = rate_changed
+	};
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK,
+				s->high_speed ? &hs_config : NULL, &info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+	usbd_register_sof_callback(dev, sof_callback);
+
+	current = s;
+	codec_samples = 0;
+	usbd_audio_init(&audio, dev, &config);
+
+	if (usbd_loopback_control(dev, &set_configuration, NULL, NULL) !=
+			USBD_LOOPBACK_ACK) {
+		return NULL;
+	}
+
+	return dev;
+}
+
+static int32_t ring_fill(const struct scenario *s)
+{
+	return (audio.ring.head - audio.ring.tail) / s->frame_bytes;
+}
+
+/**
+ * Host send samples (counter in the first word of each frame), codec
+ *  play them through usbd_audio_dma_fill()
+ * @param[in] s Scenario
+ * @param[out] res Result
+ * @return 0 on success
+ */
+static int run_playback(const struct scenario *s, struct result *res)
+{
+	const uint32_t shift = s->high_speed ? 16 : 14;
+	const uint32_t nominal = ((uint64_t) s->rate << shift) /
+				(s->high_speed ? 8000 : 1000);
+	uint32_t host_fb = nominal, host_acc = 0, sent = 1, played = 1;
+	uint32_t settled = 0;
+	uint64_t codec_acc = 0;
+	uint8_t packet[13 * 32];
+	usbd_audio_stats stats;
+	unsigned sof, i;
+
+	usbd_device *dev = setup(s);
+	CHECK(dev != NULL);
+
+	memset(res, 0, sizeof(*res));
+	res->fill_min = INT32_MAX;
+	res->fill_max = INT32_MIN;
+
+	for (sof = 0; sof < RUN_SOF; sof++) {
+		uint16_t len;
+		uint32_t n;
+
+		if (sof == SETTLE_SOF) {
+			settled = sent;
+		}
+
+		/* Host: feedback */
+		if (!(sof % FEEDBACK_INTERVAL)) {
+			uint8_t fb[4] = {0};
+			if (usbd_loopback_in(dev, EP_FEEDBACK, fb, 4, &len) ==
+					USBD_LOOPBACK_ACK && s->feedback) {
+				host_fb = fb[0] | (fb[1] << 8) | (fb[2] << 16) |
+						((uint32_t) fb[3] << 24);
+			}
+		}
+
+		/* Host: samples for this (micro)frame */
+		host_acc += host_fb;
+		n = host_acc >> shift;
+		host_acc -= n << shift;
+
+		memset(packet, 0, sizeof(packet));
+		for (i = 0; i < n; i++) {
+			memcpy(packet + (i * s->frame_bytes), &sent, 4);
+			sent++;
+		}
+
+		CHECK(usbd_loopback_out(dev, EP_OUT, packet, n * s->frame_bytes) ==
+				USBD_LOOPBACK_ACK);
+
+		/* Codec: DMA block complete */
+		codec_acc += s->codec_rate;
+		while (codec_acc >= (uint64_t) s->block * MICRO) {
+			size_t got;
+
+			codec_acc -= (uint64_t) s->block * MICRO;
+			got = usbd_audio_dma_fill(&audio, block_buf,
+						s->block * s->frame_bytes);
+
+			for (i = 0; i < got / s->frame_bytes; i++) {
+				uint32_t sample;
+				memcpy(&sample, block_buf + (i * s->frame_bytes), 4);
+				CHECK(sample == played);
+				played++;
+			}
+
+			if (got < s->block * s->frame_bytes && sof >= SETTLE_SOF) {
+				res->silence++;
+			}
+		}
+		codec_samples = (uint64_t) (sof + 1) * s->codec_rate / MICRO;
+
+		usbd_poll(dev, s->high_speed ? 125 : 1000);
+
+		if (sof >= SETTLE_SOF) {
+			int32_t fill = ring_fill(s);
+			res->fill_min = (fill < res->fill_min) ? fill : res->fill_min;
+			res->fill_max = (fill > res->fill_max) ? fill : res->fill_max;
+		}
+	}
+
+	usbd_audio_get_stats(&audio, &stats);
+	CHECK(stats.dropped == 0 && stats.errors == 0);
+	CHECK(stats.packets == RUN_SOF);
+
+	res->host_rate = (double) (sent - settled) / (RUN_SOF - SETTLE_SOF);
+	res->samples = played - 1;
+
+	printf("audio-test: %s: host %.4f (codec %.4f) samples/SOF, "
+		"fill %"PRIi32"..%"PRIi32" (target %u), %"PRIu32" underruns\n",
+		s->name, res->host_rate,
+		(double) s->codec_rate / MICRO, res->fill_min, res->fill_max,
+		RING_SIZE / 2 / s->frame_bytes, res->silence);
+
+	return 0;
+}
+
+/**
+ * Codec record samples (counter in the first word of each frame),
+ *  host read the IN packets
+ * @param[in] s Scenario
+ * @param[out] res Result
+ * @return 0 on success
+ */
+static int run_capture(const struct scenario *s, struct result *res)
+{
+	uint32_t recorded = 1, received = 1;
+	uint64_t codec_acc = 0;
+	uint8_t packet[13 * 32];
+	usbd_audio_stats stats;
+	unsigned sof, i;
+
+	usbd_device *dev = setup(s);
+	CHECK(dev != NULL);
+
+	memset(res, 0, sizeof(*res));
+	res->packet_min = UINT32_MAX;
+
+	for (sof = 0; sof < RUN_SOF; sof++) {
+		uint16_t len;
+
+		/* Codec: DMA block complete */
+		codec_acc += s->codec_rate;
+		while (codec_acc >= (uint64_t) s->block * MICRO) {
+			codec_acc -= (uint64_t) s->block * MICRO;
+
+			memset(block_buf, 0, sizeof(block_buf));
+			for (i = 0; i < s->block; i++) {
+				memcpy(block_buf + (i * s->frame_bytes), &recorded, 4);
+				recorded++;
+			}
+
+			CHECK(usbd_audio_dma_drain(&audio, block_buf,
+					s->block * s->frame_bytes) == s->block * s->frame_bytes);
+		}
+
+		/* Host */
+		CHECK(usbd_loopback_in(dev, EP_IN, packet, sizeof(packet), &len) ==
+				USBD_LOOPBACK_ACK);
+
+		for (i = 0; i < len / s->frame_bytes; i++) {
+			uint32_t sample;
+			memcpy(&sample, packet + (i * s->frame_bytes), 4);
+			CHECK(sample == received);
+			received++;
+		}
+
+		if (sof >= SETTLE_SOF) {
+			uint32_t n = len / s->frame_bytes;
+			res->packet_min = (n < res->packet_min) ? n : res->packet_min;
+			res->packet_max = (n > res->packet_max) ? n : res->packet_max;
+		}
+
+		usbd_poll(dev, s->high_speed ? 125 : 1000);
+	}
+
+	usbd_audio_get_stats(&audio, &stats);
+	CHECK(stats.dropped == 0 && stats.errors == 0);
+
+	res->samples = received - 1;
+
+	printf("audio-test: %s: packets %"PRIu32"..%"PRIu32" samples, "
+		"%"PRIu32" of %"PRIu32" samples received\n", s->name,
+		res->packet_min, res->packet_max, res->samples, recorded - 1);
+
+	return 0;
+}
+
+static int test_playback(void)
+{
+	/* 48 kHz stereo 16 bits, DAC +200 ppm, DMA block 1 ms */
+	struct scenario fs = {
+		.name = "48 kHz FS playback",
+		.ep_addr = EP_OUT,
+		.rate = 48000,
+		.frame_bytes = 4,
+		.codec_rate = 48009600,
+		.block = 48,
+		.feedback = true
+	};
+
+	/* 96 kHz 8 channels 32 bits, DAC -200 ppm, DMA block 0.5 ms */
+	const struct scenario hs = {
+		.name = "96 kHz 8ch HS playback",
+		.high_speed = true,
+		.ep_addr = EP_OUT,
+		.rate = 96000,
+		.frame_bytes = 32,
+		.codec_rate = 11997600,
+		.block = 48,
+		.use_clock = true,
+		.feedback = true
+	};
+
+	struct result res;
+
+	CHECK(!run_playback(&fs, &res));
+	CHECK(res.silence == 0);
+	CHECK(res.fill_min > 0 && res.fill_max < RING_SIZE / fs.frame_bytes);
+	CHECK(res.host_rate > 48.0086 && res.host_rate < 48.0106);
+
+	CHECK(!run_playback(&hs, &res));
+	CHECK(res.silence == 0);
+	CHECK(res.fill_min > 0 && res.fill_max < RING_SIZE / hs.frame_bytes);
+	CHECK(res.host_rate > 11.9966 && res.host_rate < 11.9986);
+
+	/* Host ignoring feedback: ring drain, DAC get silence */
+	fs.name = "48 kHz FS playback, feedback ignored";
+	fs.feedback = false;
+	CHECK(!run_playback(&fs, &res));
+	CHECK(res.silence > 0);
+
+	return 0;
+}
+
+static int test_capture(void)
+{
+	/* 48 kHz stereo 16 bits, ADC -100 ppm, DMA block 1 ms */
+	const struct scenario fs = {
+		.name = "48 kHz FS capture",
+		.ep_addr = EP_IN,
+		.rate = 48000,
+		.frame_bytes = 4,
+		.codec_rate = 47995200,
+		.block = 48
+	};
+
+	struct result res;
+
+	CHECK(!run_capture(&fs, &res));
+	CHECK(res.packet_min >= 47 && res.packet_max <= 49);
+
+	/* Samples in flight: ring (around target) and one queued packet */
+	CHECK(res.samples + (RING_SIZE / fs.frame_bytes) >
+			(uint64_t) RUN_SOF * fs.codec_rate / MICRO);
+
+	return 0;
+}
+
+static int test_sampling_freq(void)
+{
+	const struct scenario fs = {
+		.name = "sampling frequency",
+		.ep_addr = EP_OUT,
+		.rate = 48000,
+		.frame_bytes = 4,
+		.codec_rate = 48000000,
+		.block = 48
+	};
+
+	const struct usb_setup_data set_cur = {
+		.bmRequestType = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_ENDPOINT,
+		.bRequest = USB_AUDIO_REQ_SET_CUR,
+		.wValue = USB_AUDIO_EP_CONTROL_SAMPLING_FREQ << 8,
+		.wIndex = EP_OUT,
+		.wLength = 3
+	};
+
+	const struct usb_setup_data get_cur = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS |
+				USB_REQ_TYPE_ENDPOINT,
+		.bRequest = USB_AUDIO_REQ_GET_CUR,
+		.wValue = USB_AUDIO_EP_CONTROL_SAMPLING_FREQ << 8,
+		.wIndex = EP_OUT,
+		.wLength = 3
+	};
+
+	uint8_t freq[3] = {0x00, 0x77, 0x01}; /* 96000 */
+	uint16_t len;
+
+	usbd_device *dev = setup(&fs);
+	CHECK(dev != NULL);
+
+	rate_changes = 0;
+	CHECK(usbd_loopback_control(dev, &set_cur, freq, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(rate_changes == 1 && audio.rate == 96000);
+	CHECK(usbd_audio_get_feedback(&audio) == (96u << 14));
+
+	memset(freq, 0, sizeof(freq));
+	CHECK(usbd_loopback_control(dev, &get_cur, freq, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 3 && freq[0] == 0x00 && freq[1] == 0x77 && freq[2] == 0x01);
+
+	/* Zero bandwidth setting */
+	usbd_audio_stop(&audio);
+	CHECK(usbd_loopback_out(dev, EP_OUT, freq, 3) == USBD_LOOPBACK_NAK);
+
+	return 0;
+}
+
+int main(void)
+{
+	if (test_playback() || test_capture() || test_sampling_freq()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("audio-test: OK\n");
+	return EXIT_SUCCESS;
+}
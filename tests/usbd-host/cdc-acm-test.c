@@ -0,0 +1,509 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_cdc_acm test using loopback backend.
+ *
+ * - Class requests (line coding, control line state)
+ * - TX coalescing: small writes leave as whole packets, the last packet
+ *   wait for the flush timer (or usbd_cdc_acm_flush()), ZLP after a
+ *   whole last packet
+ * - Data order across partial packets and ring wrap
+ * - RX: host get NAK only when all slots are full
+ * - Stop on bus reset
+ * - Stack + class cost per MB (host CPU) for 64 and 512 bytes packets
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unicore-mx/usbd/class/cdc_acm.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_NOTIFY 0x82
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define COMM_INTERFACE 0
+
+#define TX_SIZE 4096
+#define RX_CHUNK 1024
+#define RX_SLOTS 4
+#define FLUSH_US 2000
+#define POLL_US 100
+
+#define TOTAL_LEN 20000
+#define BENCH_LEN (16 * 1024 * 1024)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = USB_CLASS_CDC,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x0009,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 2,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static uint32_t tx_ring[TX_SIZE / 4];
+static uint32_t rx_slots[RX_SLOTS * RX_CHUNK / 4];
+static uint8_t reference[TOTAL_LEN];
+
+static usbd_cdc_acm acm;
+static uint16_t ep_size;
+static unsigned line_changes;
+
+static void line_changed(usbd_cdc_acm *_acm)
+{
+	(void) _acm;
+	line_changes++;
+}
+
+static void acm_setup(usbd_device *dev, uint16_t packet_size)
+{
+	const usbd_cdc_acm_config config = {
+		.ep_in = EP_IN,
+		.ep_out = EP_OUT,
+		.ep_size = packet_size,
+		.interface = COMM_INTERFACE,
+		.tx_buffer = tx_ring,
+		.tx_size = TX_SIZE,
+		.rx_buffer = rx_slots,
+		.rx_chunk = RX_CHUNK,
+		.rx_slots = RX_SLOTS,
+		.flush_us = FLUSH_US,
+		.line_callback = line_changed
+	};
+
+	ep_size = packet_size;
+	usbd_cdc_acm_init(&acm, dev, &config);
+}
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_NOTIFY, USBD_EP_INTERRUPT, 16, 16, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, ep_size, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, ep_size, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+
+	usbd_cdc_acm_start(&acm);
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_cdc_acm_setup_ep0(&acm, setup_data)) {
+		usbd_ep0_setup(dev, setup_data);
+	}
+}
+
+/* Same as usbd_poll() + usbd_cdc_acm_poll() in application main loop */
+static void poll(usbd_device *dev, unsigned count)
+{
+	while (count--) {
+		usbd_poll(dev, POLL_US);
+		usbd_cdc_acm_poll(&acm, POLL_US);
+	}
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(acm.running);
+	return 0;
+}
+
+static int test_requests(usbd_device *dev)
+{
+	const struct usb_setup_data set_line_coding = {
+		.bmRequestType = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = USB_CDC_REQ_SET_LINE_CODING,
+		.wIndex = COMM_INTERFACE,
+		.wLength = sizeof(struct usb_cdc_line_coding)
+	};
+
+	const struct usb_setup_data get_line_coding = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_CLASS |
+				USB_REQ_TYPE_INTERFACE,
+		.bRequest = USB_CDC_REQ_GET_LINE_CODING,
+		.wIndex = COMM_INTERFACE,
+		.wLength = sizeof(struct usb_cdc_line_coding)
+	};
+
+	const struct usb_setup_data set_control_line_state = {
+		.bmRequestType = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = USB_CDC_REQ_SET_CONTROL_LINE_STATE,
+		.wValue = USB_CDC_CONTROL_LINE_DTR | USB_CDC_CONTROL_LINE_RTS,
+		.wIndex = COMM_INTERFACE
+	};
+
+	struct usb_cdc_line_coding coding = {
+		.dwDTERate = 921600,
+		.bCharFormat = USB_CDC_1_STOP_BITS,
+		.bParityType = USB_CDC_EVEN_PARITY,
+		.bDataBits = 8
+	};
+
+	struct usb_cdc_line_coding readback;
+	uint16_t len;
+
+	CHECK(acm.line_coding.dwDTERate == 115200);
+
+	CHECK(usbd_loopback_control(dev, &set_line_coding, &coding, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(line_changes == 1);
+	CHECK(!memcmp(&acm.line_coding, &coding, sizeof(coding)));
+
+	CHECK(usbd_loopback_control(dev, &get_line_coding, &readback, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == sizeof(readback) && !memcmp(&readback, &coding, len));
+
+	CHECK(usbd_loopback_control(dev, &set_control_line_state, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(line_changes == 2);
+	CHECK(acm.line_state == (USB_CDC_CONTROL_LINE_DTR |
+				USB_CDC_CONTROL_LINE_RTS));
+
+	return 0;
+}
+
+/**
+ * Read IN packets till NAK
+ * @param[in] dev USB Device
+ * @param[out] buf Buffer
+ * @param[out] packets Number of packets (including ZLP)
+ * @return number of bytes received
+ */
+static size_t host_read(usbd_device *dev, uint8_t *buf, unsigned *packets)
+{
+	size_t pos = 0;
+	uint16_t len;
+
+	*packets = 0;
+	while (usbd_loopback_in(dev, EP_IN, buf + pos, ep_size, &len) ==
+			USBD_LOOPBACK_ACK) {
+		pos += len;
+		(*packets)++;
+	}
+
+	return pos;
+}
+
+static int test_coalescing(usbd_device *dev)
+{
+	static uint8_t received[TOTAL_LEN];
+	usbd_cdc_acm_stats stats;
+	unsigned packets, i;
+	size_t pos = 0, in;
+
+	/* Small writes: nothing on bus till a packet is complete */
+	for (i = 0; i < 10; i++) {
+		CHECK(usbd_cdc_acm_write(&acm, reference + pos, 6) == 6);
+		pos += 6;
+		poll(dev, 1);
+		CHECK(host_read(dev, received, &packets) == 0);
+	}
+
+	/* 60 + 10 bytes: one whole packet, 6 bytes wait */
+	CHECK(usbd_cdc_acm_write(&acm, reference + pos, 10) == 10);
+	pos += 10;
+	poll(dev, 1);
+	CHECK(host_read(dev, received, &packets) == 64 && packets == 1);
+
+	/* Flush timer send the short packet */
+	poll(dev, FLUSH_US / POLL_US - 2);
+	CHECK(host_read(dev, received + 64, &packets) == 0);
+	poll(dev, 2);
+	CHECK(host_read(dev, received + 64, &packets) == 6 && packets == 1);
+	CHECK(!memcmp(received, reference, pos));
+
+	/* Whole last packet: sent on flush, followed by ZLP.
+	 *  Next data start off word boundary. */
+	CHECK(usbd_cdc_acm_write(&acm, reference + pos, 64) == 64);
+	usbd_cdc_acm_flush(&acm);
+	poll(dev, 1);
+	CHECK(host_read(dev, received + pos, &packets) == 64 && packets == 2);
+	pos += 64;
+	in = pos;
+
+	/* Producer and consumer at different pace, ring wrap */
+	while (pos < TOTAL_LEN) {
+		size_t n = MIN((size_t) 37 + (pos % 100), TOTAL_LEN - pos);
+		size_t done = 0;
+
+		while (done < n) {
+			done += usbd_cdc_acm_write(&acm, reference + pos + done,
+							n - done);
+			poll(dev, 1);
+			in += host_read(dev, received + in, &packets);
+		}
+
+		pos += n;
+	}
+
+	usbd_cdc_acm_flush(&acm);
+	poll(dev, 1);
+	in += host_read(dev, received + in, &packets);
+
+	usbd_cdc_acm_get_stats(&acm, &stats);
+	CHECK(in == TOTAL_LEN && stats.tx_bytes == TOTAL_LEN);
+	CHECK(!memcmp(received, reference, TOTAL_LEN));
+	CHECK(stats.errors == 0);
+
+	printf("cdc-acm-test: %u bytes in %u URB, %u partial flushes\n",
+		(unsigned) stats.tx_bytes, (unsigned) stats.urbs,
+		(unsigned) stats.tx_flushes);
+
+	return 0;
+}
+
+static int test_rx(usbd_device *dev)
+{
+	static uint8_t received[TOTAL_LEN];
+	usbd_cdc_acm_stats stats;
+	size_t sent = 0, pos = 0;
+	unsigned i;
+
+	/* Nothing received */
+	CHECK(usbd_cdc_acm_read(&acm, received, 10) == 0);
+
+	/* Short packets complete a slot each, NAK when all full */
+	for (i = 0; i < RX_SLOTS; i++) {
+		CHECK(usbd_loopback_out(dev, EP_OUT, reference + sent, 7) ==
+				USBD_LOOPBACK_ACK);
+		sent += 7;
+	}
+
+	CHECK(usbd_loopback_out(dev, EP_OUT, reference + sent, 7) ==
+			USBD_LOOPBACK_NAK);
+
+	/* Slot consumed: re-armed on poll */
+	CHECK(usbd_cdc_acm_read(&acm, received, 7) == 7);
+	poll(dev, 1);
+	CHECK(usbd_loopback_out(dev, EP_OUT, reference + sent, 7) ==
+			USBD_LOOPBACK_ACK);
+	sent += 7;
+	pos = 7;
+
+	/* Mixed packet sizes, odd sized reads */
+	while (pos < TOTAL_LEN) {
+		if (sent < TOTAL_LEN) {
+			uint16_t len = MIN((sent % 5) ? ep_size : 23, TOTAL_LEN - sent);
+			if (usbd_loopback_out(dev, EP_OUT, reference + sent, len) ==
+					USBD_LOOPBACK_ACK) {
+				sent += len;
+			}
+		}
+
+		pos += usbd_cdc_acm_read(&acm, received + pos,
+					MIN((size_t) 300, TOTAL_LEN - pos));
+		poll(dev, 1);
+	}
+
+	CHECK(!memcmp(received, reference, TOTAL_LEN));
+
+	usbd_cdc_acm_get_stats(&acm, &stats);
+	CHECK(stats.rx_bytes == TOTAL_LEN);
+	CHECK(stats.rx_overrun > 0);
+
+	return 0;
+}
+
+static int test_reset(usbd_device *dev)
+{
+	uint16_t len;
+
+	CHECK(usbd_cdc_acm_write(&acm, reference, 100) == 100);
+	usbd_loopback_reset(dev);
+	poll(dev, FLUSH_US / POLL_US);
+
+	CHECK(!acm.running);
+	CHECK(usbd_cdc_acm_write(&acm, reference, 1) == 0);
+	CHECK(usbd_loopback_in(dev, EP_IN, reference, ep_size, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	return 0;
+}
+
+/* Ring sizes are rounded down to a power of 2 */
+static int test_config(usbd_device *dev)
+{
+	usbd_cdc_acm_config config = {
+		.ep_in = EP_IN,
+		.ep_out = EP_OUT,
+		.ep_size = 64,
+		.tx_buffer = tx_ring,
+		.tx_size = 1000,
+		.rx_buffer = rx_slots,
+		.rx_chunk = RX_CHUNK,
+		.rx_slots = 3
+	};
+	usbd_cdc_acm test;
+
+	usbd_cdc_acm_init(&test, dev, &config);
+	CHECK(test.config.tx_size == 512 && test.config.rx_slots == 2);
+	CHECK(test.config.tx_chunk == 256);
+
+	config.rx_slots = USBD_CDC_ACM_RX_SLOTS_MAX + 1;
+	usbd_cdc_acm_init(&test, dev, &config);
+	CHECK(test.config.rx_slots == USBD_CDC_ACM_RX_SLOTS_MAX);
+
+	return 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Stream BENCH_LEN bytes each way, application write/read 1KB at a time
+ * @param[in] dev USB Device
+ * @return 0 on success
+ */
+static int bench(usbd_device *dev)
+{
+	static uint8_t buf[1024], packet[512];
+	size_t written = 0, read = 0, in = 0, out = 0;
+	double start, tx_ns, rx_ns;
+	uint16_t len;
+
+	memset(buf, 0x55, sizeof(buf));
+
+	start = now_ns();
+	while (in < BENCH_LEN) {
+		if (written < BENCH_LEN) {
+			written += usbd_cdc_acm_write(&acm, buf, MIN(sizeof(buf),
+							BENCH_LEN - written));
+		}
+
+		usbd_cdc_acm_poll(&acm, 0);
+
+		while (usbd_loopback_in(dev, EP_IN, packet, ep_size, &len) ==
+				USBD_LOOPBACK_ACK && len) {
+			in += len;
+		}
+
+		if (written == BENCH_LEN) {
+			usbd_cdc_acm_flush(&acm);
+		}
+	}
+	tx_ns = now_ns() - start;
+
+	start = now_ns();
+	while (read < BENCH_LEN) {
+		while (out < BENCH_LEN && usbd_loopback_out(dev, EP_OUT, packet,
+				ep_size) == USBD_LOOPBACK_ACK) {
+			out += ep_size;
+		}
+
+		read += usbd_cdc_acm_read(&acm, buf, sizeof(buf));
+		usbd_cdc_acm_poll(&acm, 0);
+	}
+	rx_ns = now_ns() - start;
+
+	CHECK(in == BENCH_LEN && read == BENCH_LEN);
+
+	printf("cdc-acm-test: %u bytes packets: TX %.0f us/MB, RX %.0f us/MB "
+		"(host CPU, stack + class)\n", ep_size,
+		tx_ns / 1e3 / (BENCH_LEN >> 20), rx_ns / 1e3 / (BENCH_LEN >> 20));
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned i;
+
+	for (i = 0; i < TOTAL_LEN; i++) {
+		reference[i] = i * 13 + (i >> 8);
+	}
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+
+	if (test_config(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	acm_setup(dev, 64);
+
+	if (configure(dev) || test_requests(dev) || test_coalescing(dev) ||
+			test_rx(dev) || test_reset(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	/* Full speed and high speed packet size */
+	acm_setup(dev, 64);
+	if (configure(dev) || bench(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	usbd_loopback_reset(dev);
+	acm_setup(dev, 512);
+	if (configure(dev) || bench(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("cdc-acm-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,210 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * USBD_ENABLE_DEFERRED test using loopback backend.
+ *
+ * - Submitted transfer only reach the endpoint in usbd_poll()
+ * - Callbacks are only performed in usbd_dispatch(), in completion order
+ * - Cancel of a queued transfer, and of a completed one (callback pending)
+ * - Control transfer (enumeration) still work from usbd_poll() context
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbd_loopback.h"
+#include "usbd_private.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 64
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.bNumConfigurations = 1
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	}
+};
+
+static unsigned poll_requests, dispatch_requests;
+static unsigned callback_count;
+static usbd_transfer_status statuses[8];
+static uintptr_t tags[8];
+
+static void poll_request(usbd_device *dev)
+{
+	(void) dev;
+	poll_requests++;
+}
+
+static void dispatch_request(usbd_device *dev)
+{
+	(void) dev;
+	dispatch_requests++;
+}
+
+static void callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	(void) dev;
+	(void) urb_id;
+
+	if (callback_count < 8) {
+		statuses[callback_count] = status;
+		tags[callback_count] = (uintptr_t) transfer->user_data;
+	}
+
+	callback_count++;
+}
+
+static usbd_urb_id submit(usbd_device *dev, uint8_t ep_addr, void *buf,
+						size_t len, uintptr_t tag)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = EP_SIZE,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.flags = USBD_FLAG_NONE,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback,
+		.user_data = (void *) tag
+	};
+
+	return usbd_transfer_submit(dev, &transfer);
+}
+
+static unsigned count_unused(usbd_device *dev)
+{
+	unsigned count = 0;
+	usbd_urb *urb;
+
+	for (urb = dev->urbs.unused; urb != NULL; urb = urb->next) {
+		count++;
+	}
+
+	return count;
+}
+
+static int test_deferred(usbd_device *dev)
+{
+	uint8_t data[EP_SIZE], out[3][EP_SIZE], packet[EP_SIZE];
+	uint16_t len;
+	unsigned i;
+
+	for (i = 0; i < EP_SIZE; i++) {
+		data[i] = i ^ 0x5A;
+	}
+
+	/* Not seen by endpoint till poll */
+	CHECK(submit(dev, EP_IN, data, EP_SIZE, 1) != USBD_INVALID_URB_ID);
+	CHECK(poll_requests == 1);
+	CHECK(usbd_loopback_in(dev, EP_IN, packet, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	usbd_poll(dev, 0);
+	CHECK(usbd_loopback_in(dev, EP_IN, packet, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == EP_SIZE && !memcmp(packet, data, EP_SIZE));
+
+	/* Callback only from dispatch */
+	CHECK(callback_count == 0 && dispatch_requests == 1);
+	usbd_dispatch(dev);
+	CHECK(callback_count == 1 && statuses[0] == USBD_SUCCESS && tags[0] == 1);
+
+	/* Callbacks in completion order */
+	callback_count = 0;
+	for (i = 0; i < 3; i++) {
+		submit(dev, EP_OUT, out[i], EP_SIZE, 10 + i);
+	}
+	usbd_poll(dev, 0);
+
+	for (i = 0; i < 3; i++) {
+		CHECK(usbd_loopback_out(dev, EP_OUT, data, EP_SIZE) ==
+				USBD_LOOPBACK_ACK);
+	}
+
+	CHECK(callback_count == 0);
+	usbd_dispatch(dev);
+	CHECK(callback_count == 3);
+	for (i = 0; i < 3; i++) {
+		CHECK(statuses[i] == USBD_SUCCESS && tags[i] == 10 + i);
+		CHECK(!memcmp(out[i], data, EP_SIZE));
+	}
+
+	/* Cancel before poll */
+	callback_count = 0;
+	usbd_urb_id id = submit(dev, EP_IN, data, EP_SIZE, 20);
+	CHECK(usbd_transfer_cancel(dev, id));
+	usbd_dispatch(dev);
+	CHECK(callback_count == 1 && statuses[0] == USBD_ERR_CANCEL);
+
+	/* Completed (callback pending) cannot be cancelled */
+	callback_count = 0;
+	id = submit(dev, EP_IN, data, 1, 21);
+	usbd_poll(dev, 0);
+	CHECK(usbd_loopback_in(dev, EP_IN, packet, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(!usbd_transfer_cancel(dev, id));
+	usbd_dispatch(dev);
+	CHECK(callback_count == 1 && statuses[0] == USBD_SUCCESS);
+
+	/* Every URB back in unused list */
+	CHECK(count_unused(dev) == USBD_URB_COUNT);
+
+	return 0;
+}
+
+int main(void)
+{
+	static const struct usb_setup_data set_address = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_ADDRESS,
+		.wValue = 5
+	};
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_poll_request_callback(dev, poll_request);
+	usbd_register_dispatch_request_callback(dev, dispatch_request);
+
+	/* Control transfer are not deferred */
+	if (usbd_loopback_control(dev, &set_address, NULL, NULL) !=
+			USBD_LOOPBACK_ACK) {
+		fprintf(stderr, "SET_ADDRESS failed\n");
+		return EXIT_FAILURE;
+	}
+
+	if (poll_requests || dispatch_requests || test_deferred(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("deferred-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,539 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_dfu test using loopback backend.
+ *
+ * Simulated time: a dfu-util like host (DNLOAD, GETSTATUS, wait
+ *  bwPollTimeout) and a flash worker running concurrently on a 1 MB flash
+ *  with the STM32F4 sector layout and typical timings (x32).
+ * The worker run in its own context: a flash operation block the worker
+ *  (not the host) for its duration, as usbd_poll() in interrupt preempt
+ *  the main loop on target.
+ *
+ * - 1 MB image (DFU): content, total time against the time the flash
+ *   is busy (lower bound) and against a non overlapped download
+ * - DfuSe: ERASE and SET_ADDRESS commands, download, UPLOAD read back
+ * - Program error reported by GETSTATUS, CLRSTATUS, ABORT
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unicore-mx/usbd/class/dfu.h>
+#include "usbd_private.h"
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define INTERFACE 0
+#define TRANSFER_SIZE 2048
+
+#define FLASH_BASE 0x08000000
+#define FLASH_SIZE (1024 * 1024)
+
+/* STM32F4 typical (x32): 16 us per word, sector erase 250/550/1000 ms */
+#define PROGRAM_US_PER_BYTE 4
+#define ERASE_16K_US 250000
+#define ERASE_64K_US 550000
+#define ERASE_128K_US 1000000
+
+/* Host side duration of requests (full speed) */
+#define DNLOAD_US 3000
+#define GETSTATUS_US 1000
+
+/* Worker is polled every ... when idle */
+#define WORKER_TICK_US 50
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x000d,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static usbd_device *dev;
+static usbd_dfu dfu;
+
+static uint8_t flash[FLASH_SIZE];
+static uint8_t image[FLASH_SIZE];
+
+/* Simulated time */
+static struct {
+	uint64_t now;
+	uint64_t worker_until; /* Worker blocked till */
+	uint64_t last_poll;
+	uint64_t flash_busy; /* Total time the flash was busy */
+	uint32_t fail_program_at; /* Inject program error (0: none) */
+	ucontext_t host_ctx, worker_ctx;
+	uint8_t worker_stack[64 * 1024];
+} sim;
+
+/**
+ * Block the worker (flash operation or idle main loop)
+ * @param[in] us Duration
+ */
+static void worker_wait(uint32_t us)
+{
+	sim.worker_until = sim.now + us;
+	swapcontext(&sim.worker_ctx, &sim.host_ctx);
+}
+
+static void worker_main(void)
+{
+	uint32_t us;
+
+	for (;;) {
+		us = sim.now - sim.last_poll;
+		sim.last_poll = sim.now;
+
+		if (!usbd_dfu_poll(&dfu, us)) {
+			worker_wait(WORKER_TICK_US);
+		}
+	}
+}
+
+/**
+ * Let the simulated time run (host is busy or sleeping), the worker
+ *  run when it is not blocked, a frame start every millisecond.
+ * @param[in] us Duration
+ */
+static void advance(uint32_t us)
+{
+	uint64_t end = sim.now + us, sof;
+
+	for (;;) {
+		sof = (sim.now / 1000 + 1) * 1000;
+
+		if (sim.worker_until <= MIN(end, sof)) {
+			sim.now = sim.worker_until;
+			swapcontext(&sim.host_ctx, &sim.worker_ctx);
+		} else if (sof <= end) {
+			sim.now = sof;
+			usbd_poll(dev, 1000);
+		} else {
+			break;
+		}
+	}
+
+	sim.now = end;
+}
+
+static bool sector(usbd_dfu *_dfu, uint32_t address, uint32_t *start,
+				uint32_t *size)
+{
+	uint32_t offset = address - FLASH_BASE;
+
+	(void) _dfu;
+
+	if (address < FLASH_BASE || offset >= FLASH_SIZE) {
+		return false;
+	}
+
+	if (offset < 0x10000) {
+		*size = 0x4000;
+	} else if (offset < 0x20000) {
+		*size = 0x10000;
+	} else {
+		*size = 0x20000;
+	}
+
+	*start = FLASH_BASE + offset - (offset % *size);
+	return true;
+}
+
+static bool erase(usbd_dfu *_dfu, uint32_t start)
+{
+	uint32_t s, size, us;
+
+	if (!sector(_dfu, start, &s, &size) || s != start) {
+		return false;
+	}
+
+	us = (size == 0x4000) ? ERASE_16K_US :
+			(size == 0x10000) ? ERASE_64K_US : ERASE_128K_US;
+	sim.flash_busy += us;
+	worker_wait(us);
+
+	memset(flash + (start - FLASH_BASE), 0xFF, size);
+	return true;
+}
+
+static bool program(usbd_dfu *_dfu, uint32_t address, const void *data,
+				size_t len)
+{
+	uint8_t *dst = flash + (address - FLASH_BASE);
+	size_t i;
+
+	(void) _dfu;
+
+	if (sim.fail_program_at && address <= sim.fail_program_at &&
+			sim.fail_program_at < address + len) {
+		return false;
+	}
+
+	/* Programming a non erased byte is an error */
+	for (i = 0; i < len; i++) {
+		if (dst[i] != 0xFF) {
+			return false;
+		}
+	}
+
+	sim.flash_busy += len * PROGRAM_US_PER_BYTE;
+	worker_wait(len * PROGRAM_US_PER_BYTE);
+
+	memcpy(dst, data, len);
+	return true;
+}
+
+static size_t read_flash(usbd_dfu *_dfu, uint32_t address, void *buf,
+				size_t len)
+{
+	uint32_t offset = address - FLASH_BASE;
+
+	(void) _dfu;
+
+	len = MIN(len, FLASH_SIZE - offset);
+	memcpy(buf, flash + offset, len);
+	return len;
+}
+
+static enum usbd_loopback_handshake request(uint8_t dir, uint8_t req,
+		uint16_t value, void *buf, uint16_t length, uint16_t *len)
+{
+	const struct usb_setup_data setup_data = {
+		.bmRequestType = dir | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = req,
+		.wValue = value,
+		.wIndex = INTERFACE,
+		.wLength = length
+	};
+
+	return usbd_loopback_control(dev, &setup_data, buf, len);
+}
+
+struct status {
+	uint8_t status, state;
+	uint32_t poll_timeout;
+};
+
+static int get_status(struct status *st)
+{
+	uint8_t buf[DFU_GETSTATUS_SIZE];
+	uint16_t len;
+
+	advance(GETSTATUS_US);
+	CHECK(request(USB_REQ_TYPE_IN, DFU_GETSTATUS, 0, buf, sizeof(buf),
+			&len) == USBD_LOOPBACK_ACK);
+	CHECK(len == DFU_GETSTATUS_SIZE);
+
+	st->status = buf[0];
+	st->poll_timeout = buf[1] | (buf[2] << 8) | (buf[3] << 16);
+	st->state = buf[4];
+	return 0;
+}
+
+/* Host statistics */
+static struct {
+	uint32_t polls, busy, early;
+} host;
+
+/**
+ * DNLOAD then GETSTATUS till dfuDNLOAD-IDLE (dfu-util)
+ * @param[in] block wBlockNum
+ * @param[in] data Data
+ * @param[in] len Length
+ * @param[out] st Last status
+ */
+static int dnload(uint16_t block, const void *data, uint16_t len,
+			struct status *st)
+{
+	bool waited = false;
+
+	advance(len ? DNLOAD_US : GETSTATUS_US);
+	if (request(0, DFU_DNLOAD, block, (void *) data, len, NULL) !=
+			USBD_LOOPBACK_ACK) {
+		return -1;
+	}
+
+	for (;;) {
+		CHECK(get_status(st) == 0);
+		host.polls++;
+
+		if (st->state == STATE_DFU_DNBUSY || st->state == STATE_DFU_MANIFEST) {
+			host.busy++;
+			/* Device asked for more time after the host waited */
+			if (waited && st->poll_timeout) {
+				host.early++;
+			}
+		}
+
+		if (st->state != STATE_DFU_DNBUSY &&
+				st->state != STATE_DFU_MANIFEST &&
+				st->state != STATE_DFU_MANIFEST_SYNC &&
+				st->state != STATE_DFU_DNLOAD_SYNC) {
+			return 0;
+		}
+
+		advance(st->poll_timeout * 1000);
+		waited = st->poll_timeout != 0;
+	}
+}
+
+static int test_download(void)
+{
+	struct status st;
+	usbd_dfu_stats stats;
+	uint64_t start, total, usb_us;
+	uint32_t i, blocks = FLASH_SIZE / TRANSFER_SIZE;
+
+	for (i = 0; i < FLASH_SIZE; i++) {
+		image[i] = (i * 7) ^ (i >> 11);
+	}
+
+	memset(flash, 0x00, sizeof(flash));
+	memset(&host, 0, sizeof(host));
+	start = sim.now;
+	sim.flash_busy = 0;
+
+	for (i = 0; i < blocks; i++) {
+		CHECK(dnload(i, image + i * TRANSFER_SIZE, TRANSFER_SIZE, &st) == 0);
+		CHECK(st.status == DFU_STATUS_OK && st.state == STATE_DFU_DNLOAD_IDLE);
+	}
+
+	CHECK(dnload(i, NULL, 0, &st) == 0);
+	CHECK(st.status == DFU_STATUS_OK && st.state == STATE_DFU_IDLE);
+	total = sim.now - start;
+
+	CHECK(!memcmp(flash, image, FLASH_SIZE));
+
+	usbd_dfu_get_stats(&dfu, &stats);
+	CHECK(stats.programmed == FLASH_SIZE);
+	CHECK(stats.erased == 12);
+
+	/* Bound by the flash: < 1% over the time the flash is busy */
+	CHECK(total < sim.flash_busy * 101 / 100);
+
+	/* Transfer time without the wait, each block, without overlap */
+	usb_us = (uint64_t) blocks * (DNLOAD_US + GETSTATUS_US);
+
+	printf("dfu-test: 1 MB image in %"PRIu64" ms, flash busy %"PRIu64
+		" ms (%"PRIu64" ms without overlap), %"PRIu32" GETSTATUS "
+		"(%"PRIu32" busy, %"PRIu32" early), estimates erase %"PRIu32
+		" program %"PRIu32" us/KiB\n",
+		total / 1000, sim.flash_busy / 1000,
+		(sim.flash_busy + usb_us) / 1000, host.polls, host.busy,
+		host.early, stats.erase_us_per_kb, stats.program_us_per_kb);
+
+	return 0;
+}
+
+static int dfuse_command(uint8_t cmd, uint32_t address, struct status *st)
+{
+	uint8_t buf[5] = {cmd, address, address >> 8, address >> 16,
+				address >> 24};
+
+	return dnload(0, buf, sizeof(buf), st);
+}
+
+static int test_dfuse(void)
+{
+	uint8_t buf[TRANSFER_SIZE];
+	usbd_dfu_stats before, stats;
+	struct status st;
+	uint32_t address = FLASH_BASE + 0x8000, size = 0xC000, i;
+	uint16_t len;
+
+	dfu.config.dfuse = true;
+	usbd_dfu_get_stats(&dfu, &before);
+
+	for (i = 0; i < size; i++) {
+		image[i] = i * 13;
+	}
+
+	/* Supported commands */
+	CHECK(request(USB_REQ_TYPE_IN, DFU_UPLOAD, 0, buf, sizeof(buf), &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 3 && buf[1] == DFUSE_CMD_SET_ADDRESS &&
+			buf[2] == DFUSE_CMD_ERASE);
+	CHECK(request(0, DFU_ABORT, 0, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+
+	/* Erase command: host told to wait for the erase */
+	buf[0] = DFUSE_CMD_ERASE;
+	memcpy(buf + 1, &address, sizeof(address));
+	CHECK(request(0, DFU_DNLOAD, 0, buf, 5, NULL) == USBD_LOOPBACK_ACK);
+	CHECK(get_status(&st) == 0);
+	CHECK(st.state == STATE_DFU_DNBUSY && st.poll_timeout != 0);
+	advance(st.poll_timeout * 1000);
+	CHECK(get_status(&st) == 0);
+	CHECK(st.state == STATE_DFU_DNLOAD_IDLE);
+
+	/* dfu-util: erase the pages, then address and data of each chunk */
+	for (i = 0x4000; i < size; i += 0x4000) {
+		CHECK(dfuse_command(DFUSE_CMD_ERASE, address + i, &st) == 0);
+		CHECK(st.state == STATE_DFU_DNLOAD_IDLE);
+	}
+
+	for (i = 0; i < size; i += TRANSFER_SIZE) {
+		CHECK(dfuse_command(DFUSE_CMD_SET_ADDRESS, address + i, &st) == 0);
+		CHECK(st.state == STATE_DFU_DNLOAD_IDLE);
+		CHECK(dnload(2, image + i, TRANSFER_SIZE, &st) == 0);
+		CHECK(st.state == STATE_DFU_DNLOAD_IDLE);
+	}
+
+	CHECK(dnload(0, NULL, 0, &st) == 0);
+	CHECK(st.status == DFU_STATUS_OK && st.state == STATE_DFU_IDLE);
+	CHECK(!memcmp(flash + (address - FLASH_BASE), image, size));
+
+	/* Sectors erased by the commands are not erased again for the data */
+	usbd_dfu_get_stats(&dfu, &stats);
+	CHECK(stats.erased - before.erased == 3);
+
+	/* Read back */
+	CHECK(dfuse_command(DFUSE_CMD_SET_ADDRESS, address, &st) == 0);
+	CHECK(request(0, DFU_ABORT, 0, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+	for (i = 0; i < size / TRANSFER_SIZE; i++) {
+		CHECK(request(USB_REQ_TYPE_IN, DFU_UPLOAD, i + 2, buf, sizeof(buf),
+				&len) == USBD_LOOPBACK_ACK);
+		CHECK(len == TRANSFER_SIZE &&
+				!memcmp(buf, image + i * TRANSFER_SIZE, len));
+	}
+
+	CHECK(request(0, DFU_ABORT, 0, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+
+	/* Outside of the region */
+	CHECK(dfuse_command(DFUSE_CMD_SET_ADDRESS, 0x20000000, &st) == 0);
+	CHECK(st.state == STATE_DFU_ERROR && st.status == DFU_STATUS_ERR_ADDRESS);
+	CHECK(request(0, DFU_CLRSTATUS, 0, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+
+	dfu.config.dfuse = false;
+	return 0;
+}
+
+static int test_errors(void)
+{
+	struct status st;
+	uint32_t i;
+
+	/* Program error on the 3rd block: reported by a later GETSTATUS */
+	sim.fail_program_at = FLASH_BASE + 2 * TRANSFER_SIZE + 100;
+
+	for (i = 0; i < 8; i++) {
+		CHECK(dnload(i, image, TRANSFER_SIZE, &st) == 0);
+		if (st.state == STATE_DFU_ERROR) {
+			break;
+		}
+	}
+
+	CHECK(st.state == STATE_DFU_ERROR && st.status == DFU_STATUS_ERR_PROG);
+	CHECK(i >= 2 && i < 8);
+
+	/* DNLOAD refused in dfuERROR */
+	advance(DNLOAD_US);
+	CHECK(request(0, DFU_DNLOAD, 0, image, TRANSFER_SIZE, NULL) ==
+			USBD_LOOPBACK_STALL);
+	CHECK(request(0, DFU_CLRSTATUS, 0, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+	CHECK(get_status(&st) == 0);
+	CHECK(st.state == STATE_DFU_IDLE && st.status == DFU_STATUS_OK);
+
+	sim.fail_program_at = 0;
+
+	/* ABORT while blocks are queued */
+	advance(100 * 1000);
+	CHECK(request(0, DFU_DNLOAD, 0, image, TRANSFER_SIZE, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(get_status(&st) == 0);
+	CHECK(request(0, DFU_DNLOAD, 1, image, TRANSFER_SIZE, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(request(0, DFU_ABORT, 0, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+	CHECK(get_status(&st) == 0);
+	CHECK(st.state == STATE_DFU_IDLE && st.status == DFU_STATUS_OK);
+	advance(2000 * 1000);
+	CHECK(dfu.count == 0 && !dfu.working);
+
+	return 0;
+}
+
+static void setup_callback(usbd_device *_dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_dfu_setup_ep0(&dfu, setup_data)) {
+		usbd_ep0_setup(_dev, setup_data);
+	}
+}
+
+int main(void)
+{
+	const usbd_dfu_config config = {
+		.interface = INTERFACE,
+		.manifest_tolerant = true,
+		.transfer_size = TRANSFER_SIZE,
+		.base = FLASH_BASE,
+		.size = FLASH_SIZE,
+		.erase_ahead = 0x20000,
+		.erase_us_per_kb = ERASE_128K_US / 128,
+		.program_us_per_kb = PROGRAM_US_PER_BYTE * 1024,
+		.sector = sector,
+		.erase = erase,
+		.program = program,
+		.read = read_flash
+	};
+
+	getcontext(&sim.worker_ctx);
+	sim.worker_ctx.uc_stack.ss_sp = sim.worker_stack;
+	sim.worker_ctx.uc_stack.ss_size = sizeof(sim.worker_stack);
+	sim.worker_ctx.uc_link = NULL;
+	makecontext(&sim.worker_ctx, worker_main, 0);
+
+	dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_dfu_init(&dfu, dev, &config);
+
+	if (test_download() || test_dfuse() || test_errors()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("dfu-test: OK\n");
+	return EXIT_SUCCESS;
+}
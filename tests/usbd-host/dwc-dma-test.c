@@ -0,0 +1,488 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG backend in internal DMA mode (USBD_DMA), run against the
+ *  register model (dwc_otg_model.h).
+ *
+ * - Enumeration (control IN, control OUT with data, status stages)
+ * - Bulk IN / OUT programmed with one DMA transfer (one interrupt)
+ * - Short packet termination, USBD_FLAG_NO_SHORT_PACKET
+ * - URB that cannot be handled by DMA are rejected (USBD_ERR_INVALID)
+ * - Cancel of an armed OUT transfer disable the endpoint
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../lib/usbd/backend/dwc_otg_private.h"
+#include "usbd_private.h"
+#include "dwc_otg_model.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 512
+
+#define BULK_LEN (EP_SIZE * 40 + 100)
+#define VENDOR_LEN 100
+
+#define OFF(REG, ...) ((uint32_t) (uintptr_t) &REG(0, ##__VA_ARGS__))
+
+static usbd_device *init(const usbd_backend_config *config);
+
+static struct usbd_device _usbd_dev;
+static struct dwc_otg_ep0_dma ep0_dma;
+
+static const struct usbd_backend dwc_otg_model_backend = {
+	.init = init,
+	.set_address = dwc_otg_set_address,
+	.get_address = dwc_otg_get_address,
+	.ep_prepare_start = dwc_otg_ep_prepare_start,
+	.ep_prepare = dwc_otg_ep_prepare,
+	.ep_prepare_end = dwc_otg_ep_prepare_end,
+	.set_ep_dtog = dwc_otg_set_ep_dtog,
+	.get_ep_dtog = dwc_otg_get_ep_dtog,
+	.set_ep_stall = dwc_otg_set_ep_stall,
+	.get_ep_stall = dwc_otg_get_ep_stall,
+	.urb_submit = dwc_otg_urb_submit,
+	.urb_cancel = dwc_otg_urb_cancel,
+	.poll = dwc_otg_poll,
+	.enable_sof = dwc_otg_enable_sof,
+	.disconnect = dwc_otg_disconnect,
+	.frame_number  = dwc_otg_frame_number,
+	.get_speed = dwc_otg_get_speed,
+	.set_address_before_status = true,
+	.base_address = DWC_OTG_MODEL_BASE
+};
+
+static const usbd_backend_config backend_config = {
+	.ep_count = 6,
+	.priv_mem = 4096,
+	.speed = USBD_SPEED_HIGH,
+	.feature = USBD_DMA
+};
+
+static usbd_device *init(const usbd_backend_config *config)
+{
+	_usbd_dev.backend = &dwc_otg_model_backend;
+	_usbd_dev.config = config;
+	_usbd_dev.private_data.ep0_dma =
+		(config->feature & USBD_DMA) ? &ep0_dma : NULL;
+
+	dwc_otg_init(&_usbd_dev);
+
+	return &_usbd_dev;
+}
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xCAFE,
+	.idProduct = 0x0007,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 0,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+/* DMA address are 32bit, buffers are static (-no-pie) */
+static uint32_t in_buf[BULK_LEN / 4 + 1];
+static uint32_t out_buf[BULK_LEN / 4 + 1];
+static uint8_t host_buf[BULK_LEN + EP_SIZE];
+static uint8_t vendor_buf[VENDOR_LEN];
+
+static unsigned callback_count;
+static usbd_transfer_status last_status;
+static size_t last_length;
+
+static void callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	(void) dev;
+	(void) urb_id;
+
+	callback_count++;
+	last_status = status;
+	last_length = transfer->transferred;
+}
+
+static void set_config(usbd_device *dev,
+				const struct usb_config_descriptor *cfg)
+{
+	(void) cfg;
+
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if ((setup_data->bmRequestType & USB_REQ_TYPE_TYPE) ==
+			USB_REQ_TYPE_VENDOR) {
+		usbd_ep0_transfer(dev, setup_data, vendor_buf,
+			setup_data->wLength, NULL);
+		return;
+	}
+
+	usbd_ep0_setup(dev, setup_data);
+}
+
+static usbd_urb_id submit(usbd_device *dev, uint8_t ep_addr, void *buf,
+						size_t len, usbd_transfer_flags flags)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = EP_SIZE,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback
+	};
+
+	callback_count = 0;
+	return usbd_transfer_submit(dev, &transfer);
+}
+
+/**
+ * Perform a control transfer (SETUP, DATA, STATUS)
+ * @param[in] dev USB Device
+ * @param[in] setup_data Setup data
+ * @param[inout] data DATA stage buffer
+ * @return number of bytes of DATA stage, -1 on failure
+ */
+static int control(usbd_device *dev, const struct usb_setup_data *setup_data,
+					uint8_t *data)
+{
+	bool in = !!(setup_data->bmRequestType & USB_REQ_TYPE_IN);
+	uint16_t pos = 0, len;
+
+	CHECK(dwc_otg_model_setup(dev, setup_data) == DWC_OTG_MODEL_ACK);
+
+	while (pos < setup_data->wLength) {
+		if (in) {
+			CHECK(dwc_otg_model_in(dev, 0, data + pos, 64, &len) ==
+					DWC_OTG_MODEL_ACK);
+		} else {
+			len = MIN(setup_data->wLength - pos, 64);
+			CHECK(dwc_otg_model_out(dev, 0, data + pos, len) ==
+					DWC_OTG_MODEL_ACK);
+		}
+
+		pos += len;
+		if (len < 64) {
+			break;
+		}
+	}
+
+	/* Status stage */
+	if (in) {
+		CHECK(dwc_otg_model_out(dev, 0, NULL, 0) == DWC_OTG_MODEL_ACK);
+	} else {
+		CHECK(dwc_otg_model_in(dev, 0, NULL, 0, &len) == DWC_OTG_MODEL_ACK);
+		CHECK(len == 0);
+	}
+
+	CHECK_MODEL(dwc_otg_model_error());
+	return pos;
+}
+
+static int test_enumeration(usbd_device *dev)
+{
+	static const struct usb_setup_data get_descriptor = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = USB_DT_DEVICE << 8,
+		.wLength = 64
+	};
+
+	static const struct usb_setup_data set_address = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_ADDRESS,
+		.wValue = 7
+	};
+
+	static const struct usb_setup_data vendor_out = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_VENDOR |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = 1,
+		.wLength = VENDOR_LEN
+	};
+
+	static const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	static uint8_t data[VENDOR_LEN];
+	unsigned i;
+
+	/* DMA mode programmed, no RX FIFO level interrupt */
+	CHECK(dwc_otg_model_peek(OFF(DWC_OTG_GAHBCFG)) & DWC_OTG_GAHBCFG_DMAEN);
+	CHECK(!(dwc_otg_model_peek(OFF(DWC_OTG_GINTMSK)) &
+			DWC_OTG_GINTMSK_RXFLVLM));
+
+	/* SETUP can be received after reset */
+	dwc_otg_model_reset(dev);
+	CHECK(dwc_otg_model_peek(OFF(DWC_OTG_DOEPxCTL, 0)) &
+			DWC_OTG_DOEPCTL_EPENA);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	CHECK(control(dev, &get_descriptor, data) == USB_DT_DEVICE_SIZE);
+	CHECK(!memcmp(data, &dev_desc, USB_DT_DEVICE_SIZE));
+
+	CHECK(control(dev, &set_address, NULL) == 0);
+	CHECK(dwc_otg_get_address(dev) == 7);
+
+	for (i = 0; i < VENDOR_LEN; i++) {
+		data[i] = i * 3;
+	}
+
+	CHECK(control(dev, &vendor_out, data) == VENDOR_LEN);
+	CHECK(!memcmp(vendor_buf, data, VENDOR_LEN));
+
+	CHECK(control(dev, &set_configuration, NULL) == 0);
+	CHECK(dev->current_config == &config_desc);
+
+	return 0;
+}
+
+static int test_bulk_in(usbd_device *dev)
+{
+	const struct dwc_otg_model_stats *stats;
+	uint8_t *data = (uint8_t *) in_buf;
+	uint64_t reads, writes, irqs;
+	size_t pos = 0;
+	uint16_t len;
+	unsigned i;
+
+	for (i = 0; i < BULK_LEN; i++) {
+		data[i] = i ^ (i >> 8);
+	}
+
+	stats = dwc_otg_model_stats();
+	reads = stats->reads;
+	writes = stats->writes;
+	irqs = stats->irqs;
+
+	CHECK(submit(dev, EP_IN, data, BULK_LEN, USBD_FLAG_SHORT_PACKET) !=
+			USBD_INVALID_URB_ID);
+
+	do {
+		CHECK(dwc_otg_model_in(dev, EP_IN, host_buf + pos, EP_SIZE, &len) ==
+				DWC_OTG_MODEL_ACK);
+		pos += len;
+	} while (len == EP_SIZE);
+
+	CHECK(pos == BULK_LEN && !memcmp(host_buf, data, BULK_LEN));
+	CHECK(callback_count == 1 && last_status == USBD_SUCCESS);
+	CHECK(last_length == BULK_LEN);
+	CHECK(dwc_otg_model_in(dev, EP_IN, host_buf, EP_SIZE, &len) ==
+			DWC_OTG_MODEL_NAK);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	/* Whole transfer programmed once: one interrupt (completion) */
+	stats = dwc_otg_model_stats();
+	CHECK(stats->irqs - irqs == 1);
+
+	printf("dwc-dma-test: bulk IN %u bytes: %u register reads, "
+		"%u writes, %u interrupts\n", BULK_LEN,
+		(unsigned) (stats->reads - reads),
+		(unsigned) (stats->writes - writes),
+		(unsigned) (stats->irqs - irqs));
+
+	return 0;
+}
+
+static int test_bulk_out(usbd_device *dev)
+{
+	uint8_t *data = (uint8_t *) out_buf;
+	size_t pos;
+	unsigned i;
+
+	for (i = 0; i < BULK_LEN; i++) {
+		host_buf[i] = i * 7;
+	}
+
+	/* Complete on last packet */
+	memset(data, 0, BULK_LEN);
+	CHECK(submit(dev, EP_OUT, data, EP_SIZE * 8, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+
+	for (pos = 0; pos < EP_SIZE * 8; pos += EP_SIZE) {
+		CHECK(callback_count == 0);
+		CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf + pos, EP_SIZE) ==
+				DWC_OTG_MODEL_ACK);
+	}
+
+	CHECK(callback_count == 1 && last_status == USBD_SUCCESS);
+	CHECK(last_length == EP_SIZE * 8 && !memcmp(data, host_buf, EP_SIZE * 8));
+
+	/* No transfer armed */
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, EP_SIZE) ==
+			DWC_OTG_MODEL_NAK);
+
+	/* Complete on short packet */
+	CHECK(submit(dev, EP_OUT, data, EP_SIZE * 8, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, EP_SIZE) ==
+			DWC_OTG_MODEL_ACK);
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf + EP_SIZE, 10) ==
+			DWC_OTG_MODEL_ACK);
+	CHECK(callback_count == 1 && last_status == USBD_SUCCESS);
+	CHECK(last_length == EP_SIZE + 10);
+	CHECK(!memcmp(data, host_buf, EP_SIZE + 10));
+
+	/* Short packet not expected */
+	CHECK(submit(dev, EP_OUT, data, EP_SIZE * 2, USBD_FLAG_NO_SHORT_PACKET) !=
+			USBD_INVALID_URB_ID);
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, 20) == DWC_OTG_MODEL_ACK);
+	CHECK(callback_count == 1 && last_status == USBD_ERR_SHORT_PACKET);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	return 0;
+}
+
+static int test_rejected(usbd_device *dev)
+{
+	/* Unaligned buffer */
+	submit(dev, EP_IN, (uint8_t *) in_buf + 1, 100, USBD_FLAG_NONE);
+	CHECK(callback_count == 1 && last_status == USBD_ERR_INVALID);
+
+	/* OUT length not multiple of endpoint size */
+	submit(dev, EP_OUT, out_buf, 100, USBD_FLAG_NONE);
+	CHECK(callback_count == 1 && last_status == USBD_ERR_INVALID);
+
+	/* Endpoint still usable */
+	CHECK(submit(dev, EP_OUT, out_buf, EP_SIZE, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, 1) == DWC_OTG_MODEL_ACK);
+	CHECK(callback_count == 1 && last_status == USBD_SUCCESS);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	return 0;
+}
+
+static int test_cancel(usbd_device *dev)
+{
+	usbd_urb_id id;
+	uint16_t len;
+
+	/* Armed OUT */
+	id = submit(dev, EP_OUT, out_buf, EP_SIZE * 4, USBD_FLAG_NONE);
+	CHECK(id != USBD_INVALID_URB_ID);
+	CHECK(usbd_transfer_cancel(dev, id));
+	CHECK(callback_count == 1 && last_status == USBD_ERR_CANCEL);
+	CHECK(!(dwc_otg_model_peek(OFF(DWC_OTG_DOEPxCTL, 1)) &
+			DWC_OTG_DOEPCTL_EPENA));
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, EP_SIZE) ==
+			DWC_OTG_MODEL_NAK);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	/* Armed IN */
+	id = submit(dev, EP_IN, in_buf, EP_SIZE * 4, USBD_FLAG_NONE);
+	CHECK(id != USBD_INVALID_URB_ID);
+	CHECK(usbd_transfer_cancel(dev, id));
+	CHECK(callback_count == 1 && last_status == USBD_ERR_CANCEL);
+	CHECK(dwc_otg_model_in(dev, EP_IN, host_buf, EP_SIZE, &len) ==
+			DWC_OTG_MODEL_NAK);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	/* Endpoint usable after cancel */
+	CHECK(submit(dev, EP_OUT, out_buf, EP_SIZE, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+	CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, EP_SIZE) ==
+			DWC_OTG_MODEL_ACK);
+	CHECK(callback_count == 1 && last_status == USBD_SUCCESS);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	return 0;
+}
+
+/* Cancel return even if the core never disable the endpoint */
+static int test_cancel_wedged(usbd_device *dev)
+{
+	usbd_urb_id id;
+
+	id = submit(dev, EP_OUT, out_buf, EP_SIZE * 4, USBD_FLAG_NONE);
+	CHECK(id != USBD_INVALID_URB_ID);
+	dwc_otg_model_wedge(true);
+	CHECK(usbd_transfer_cancel(dev, id));
+	CHECK(callback_count == 1 && last_status == USBD_ERR_CANCEL);
+
+	id = submit(dev, EP_IN, in_buf, EP_SIZE * 4, USBD_FLAG_NONE);
+	CHECK(id != USBD_INVALID_URB_ID);
+	CHECK(usbd_transfer_cancel(dev, id));
+	CHECK(callback_count == 1 && last_status == USBD_ERR_CANCEL);
+	dwc_otg_model_wedge(false);
+
+	return 0;
+}
+
+int main(void)
+{
+	if (!dwc_otg_model_init()) {
+		fprintf(stderr, "Unable to map register window\n");
+		return EXIT_FAILURE;
+	}
+
+	usbd_device *dev = usbd_init(&dwc_otg_model_backend, &backend_config,
+					&info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+
+	if (test_enumeration(dev) || test_bulk_in(dev) || test_bulk_out(dev) ||
+			test_rejected(dev) || test_cancel(dev) ||
+			test_cancel_wedged(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("dwc-dma-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,488 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG backend in slave mode (CPU access the FIFO), run against the
+ *  register model (dwc_otg_model.h).
+ *
+ * - Enumeration (control IN, control OUT with data, status stages)
+ * - 128KB streamed over bulk IN and bulk OUT, data checked
+ * - Interrupts per MB are printed, without and with interrupt latency:
+ *   the TX FIFO is filled with as many packets as it can hold and every
+ *   RX FIFO entry is popped in one interrupt.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../lib/usbd/backend/dwc_otg_private.h"
+#include "usbd_private.h"
+#include "dwc_otg_model.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 512
+
+/* Streamed as CHUNK_LEN transfers (PKTCNT is limited), every FIFO word
+ *  is trapped so the stream is kept short */
+#define STREAM_LEN (128 * 1024)
+#define CHUNK_LEN (32 * 1024)
+#define PER_MB ((1024 * 1024) / STREAM_LEN)
+#define VENDOR_LEN 64
+
+/* Tokens NAKed before giving up */
+#define NAK_LIMIT 1000
+
+#define OFF(REG, ...) ((uint32_t) (uintptr_t) &REG(0, ##__VA_ARGS__))
+
+static usbd_device *init(const usbd_backend_config *config);
+
+static struct usbd_device _usbd_dev;
+
+static const struct usbd_backend dwc_otg_model_backend = {
+	.init = init,
+	.set_address = dwc_otg_set_address,
+	.get_address = dwc_otg_get_address,
+	.ep_prepare_start = dwc_otg_ep_prepare_start,
+	.ep_prepare = dwc_otg_ep_prepare,
+	.ep_prepare_end = dwc_otg_ep_prepare_end,
+	.set_ep_dtog = dwc_otg_set_ep_dtog,
+	.get_ep_dtog = dwc_otg_get_ep_dtog,
+	.set_ep_stall = dwc_otg_set_ep_stall,
+	.get_ep_stall = dwc_otg_get_ep_stall,
+	.urb_submit = dwc_otg_urb_submit,
+	.urb_cancel = dwc_otg_urb_cancel,
+	.poll = dwc_otg_poll,
+	.enable_sof = dwc_otg_enable_sof,
+	.disconnect = dwc_otg_disconnect,
+	.frame_number  = dwc_otg_frame_number,
+	.get_speed = dwc_otg_get_speed,
+	.set_address_before_status = true,
+	.base_address = DWC_OTG_MODEL_BASE
+};
+
+static const usbd_backend_config backend_config = {
+	.ep_count = 6,
+	.priv_mem = 4096,
+	.speed = USBD_SPEED_HIGH,
+	.feature = USBD_FEATURE_NONE
+};
+
+static usbd_device *init(const usbd_backend_config *config)
+{
+	_usbd_dev.backend = &dwc_otg_model_backend;
+	_usbd_dev.config = config;
+
+	dwc_otg_init(&_usbd_dev);
+
+	return &_usbd_dev;
+}
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xCAFE,
+	.idProduct = 0x0008,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 0,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static uint8_t dev_buf[CHUNK_LEN];
+static uint8_t host_buf[EP_SIZE];
+static uint8_t vendor_buf[VENDOR_LEN];
+
+/* Stream state, next chunk is submitted from the callback */
+static struct {
+	uint8_t ep_addr;
+	unsigned chunks; /**< Chunks completed */
+	bool failed;
+} stream;
+
+/**
+ * Byte @a offset of the stream
+ * @param[in] offset Offset in stream
+ * @return data
+ */
+static uint8_t pattern(size_t offset)
+{
+	return (offset * 7) ^ (offset >> 9);
+}
+
+static void stream_submit(usbd_device *dev);
+
+static void stream_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	size_t base = stream.chunks * CHUNK_LEN;
+	size_t i;
+
+	(void) urb_id;
+
+	if (status != USBD_SUCCESS || transfer->transferred != CHUNK_LEN) {
+		stream.failed = true;
+		return;
+	}
+
+	if (!(stream.ep_addr & 0x80)) {
+		for (i = 0; i < CHUNK_LEN; i++) {
+			if (dev_buf[i] != pattern(base + i)) {
+				stream.failed = true;
+				return;
+			}
+		}
+	}
+
+	if (++stream.chunks < STREAM_LEN / CHUNK_LEN) {
+		stream_submit(dev);
+	}
+}
+
+static void stream_submit(usbd_device *dev)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = stream.ep_addr,
+		.ep_size = EP_SIZE,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = dev_buf,
+		.length = CHUNK_LEN,
+		.flags = USBD_FLAG_NONE,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = stream_callback
+	};
+	size_t base = stream.chunks * CHUNK_LEN;
+	size_t i;
+
+	if (stream.ep_addr & 0x80) {
+		for (i = 0; i < CHUNK_LEN; i++) {
+			dev_buf[i] = pattern(base + i);
+		}
+	}
+
+	if (usbd_transfer_submit(dev, &transfer) == USBD_INVALID_URB_ID) {
+		stream.failed = true;
+	}
+}
+
+static void set_config(usbd_device *dev,
+				const struct usb_config_descriptor *cfg)
+{
+	(void) cfg;
+
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if ((setup_data->bmRequestType & USB_REQ_TYPE_TYPE) ==
+			USB_REQ_TYPE_VENDOR) {
+		usbd_ep0_transfer(dev, setup_data, vendor_buf,
+			setup_data->wLength, NULL);
+		return;
+	}
+
+	usbd_ep0_setup(dev, setup_data);
+}
+
+/**
+ * Perform a control transfer (SETUP, DATA, STATUS)
+ * @param[in] dev USB Device
+ * @param[in] setup_data Setup data
+ * @param[inout] data DATA stage buffer
+ * @return number of bytes of DATA stage, -1 on failure
+ */
+static int control(usbd_device *dev, const struct usb_setup_data *setup_data,
+					uint8_t *data)
+{
+	bool in = !!(setup_data->bmRequestType & USB_REQ_TYPE_IN);
+	uint16_t pos = 0, len;
+
+	CHECK(dwc_otg_model_setup(dev, setup_data) == DWC_OTG_MODEL_ACK);
+
+	while (pos < setup_data->wLength) {
+		if (in) {
+			CHECK(dwc_otg_model_in(dev, 0, data + pos, 64, &len) ==
+					DWC_OTG_MODEL_ACK);
+		} else {
+			len = MIN(setup_data->wLength - pos, 64);
+			CHECK(dwc_otg_model_out(dev, 0, data + pos, len) ==
+					DWC_OTG_MODEL_ACK);
+		}
+
+		pos += len;
+		if (len < 64) {
+			break;
+		}
+	}
+
+	/* Status stage */
+	if (in) {
+		CHECK(dwc_otg_model_out(dev, 0, NULL, 0) == DWC_OTG_MODEL_ACK);
+	} else {
+		CHECK(dwc_otg_model_in(dev, 0, NULL, 0, &len) == DWC_OTG_MODEL_ACK);
+		CHECK(len == 0);
+	}
+
+	CHECK_MODEL(dwc_otg_model_error());
+	return pos;
+}
+
+static int test_enumeration(usbd_device *dev)
+{
+	static const struct usb_setup_data get_descriptor = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = USB_DT_DEVICE << 8,
+		.wLength = 64
+	};
+
+	static const struct usb_setup_data set_address = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_ADDRESS,
+		.wValue = 7
+	};
+
+	static const struct usb_setup_data vendor_out = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_VENDOR |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = 1,
+		.wLength = VENDOR_LEN
+	};
+
+	static const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	static uint8_t data[64];
+	unsigned i;
+
+	/* Slave mode: RX FIFO read by CPU */
+	CHECK(!(dwc_otg_model_peek(OFF(DWC_OTG_GAHBCFG)) &
+			DWC_OTG_GAHBCFG_DMAEN));
+	CHECK(dwc_otg_model_peek(OFF(DWC_OTG_GINTMSK)) & DWC_OTG_GINTMSK_RXFLVLM);
+
+	dwc_otg_model_reset(dev);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	CHECK(control(dev, &get_descriptor, data) == USB_DT_DEVICE_SIZE);
+	CHECK(!memcmp(data, &dev_desc, USB_DT_DEVICE_SIZE));
+
+	CHECK(control(dev, &set_address, NULL) == 0);
+	CHECK(dwc_otg_get_address(dev) == 7);
+
+	for (i = 0; i < VENDOR_LEN; i++) {
+		data[i] = i * 3;
+	}
+
+	CHECK(control(dev, &vendor_out, data) == VENDOR_LEN);
+	CHECK(!memcmp(vendor_buf, data, VENDOR_LEN));
+
+	CHECK(control(dev, &set_configuration, NULL) == 0);
+	CHECK(dev->current_config == &config_desc);
+
+	return 0;
+}
+
+/**
+ * Stream STREAM_LEN bytes over bulk IN
+ * @param[in] dev USB Device
+ * @param[in] latency Interrupt latency (in tokens)
+ * @param[out] irqs Number of interrupts
+ * @return 0 on success
+ */
+static int stream_in(usbd_device *dev, unsigned latency, uint64_t *irqs)
+{
+	uint64_t start = dwc_otg_model_stats()->irqs;
+	size_t pos = 0;
+	unsigned naks = 0;
+	uint16_t len;
+
+	dwc_otg_model_latency(latency);
+	memset(&stream, 0, sizeof(stream));
+	stream.ep_addr = EP_IN;
+	stream_submit(dev);
+
+	while (pos < STREAM_LEN) {
+		CHECK(!stream.failed && naks < NAK_LIMIT);
+
+		switch (dwc_otg_model_in(dev, EP_IN, host_buf, EP_SIZE, &len)) {
+		case DWC_OTG_MODEL_ACK:
+			CHECK(len == EP_SIZE);
+			while (len--) {
+				CHECK(host_buf[len] == pattern(pos + len));
+			}
+			pos += EP_SIZE;
+			naks = 0;
+		break;
+		case DWC_OTG_MODEL_NAK:
+			naks++;
+		break;
+		default:
+			CHECK(false);
+		}
+	}
+
+	/* Last completion can still be pending */
+	while (stream.chunks < STREAM_LEN / CHUNK_LEN) {
+		CHECK(!stream.failed && naks++ < NAK_LIMIT);
+		CHECK(dwc_otg_model_in(dev, EP_IN, host_buf, EP_SIZE, &len) ==
+				DWC_OTG_MODEL_NAK);
+	}
+
+	CHECK(!stream.failed);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	dwc_otg_model_latency(0);
+	*irqs = dwc_otg_model_stats()->irqs - start;
+	return 0;
+}
+
+/**
+ * Stream STREAM_LEN bytes over bulk OUT
+ * @param[in] dev USB Device
+ * @param[in] latency Interrupt latency (in tokens)
+ * @param[out] irqs Number of interrupts
+ * @return 0 on success
+ */
+static int stream_out(usbd_device *dev, unsigned latency, uint64_t *irqs)
+{
+	uint64_t start = dwc_otg_model_stats()->irqs;
+	size_t pos = 0;
+	unsigned naks = 0;
+	unsigned i;
+
+	dwc_otg_model_latency(latency);
+	memset(&stream, 0, sizeof(stream));
+	stream.ep_addr = EP_OUT;
+	stream_submit(dev);
+
+	while (pos < STREAM_LEN) {
+		CHECK(!stream.failed && naks < NAK_LIMIT);
+
+		for (i = 0; i < EP_SIZE; i++) {
+			host_buf[i] = pattern(pos + i);
+		}
+
+		switch (dwc_otg_model_out(dev, EP_OUT, host_buf, EP_SIZE)) {
+		case DWC_OTG_MODEL_ACK:
+			pos += EP_SIZE;
+			naks = 0;
+		break;
+		case DWC_OTG_MODEL_NAK:
+			naks++;
+		break;
+		default:
+			CHECK(false);
+		}
+	}
+
+	/* Flush the last entries: endpoint not armed anymore */
+	while (stream.chunks < STREAM_LEN / CHUNK_LEN) {
+		CHECK(!stream.failed && naks++ < NAK_LIMIT);
+		CHECK(dwc_otg_model_out(dev, EP_OUT, host_buf, EP_SIZE) ==
+				DWC_OTG_MODEL_NAK);
+	}
+
+	CHECK(!stream.failed);
+	CHECK_MODEL(dwc_otg_model_error());
+
+	dwc_otg_model_latency(0);
+	*irqs = dwc_otg_model_stats()->irqs - start;
+	return 0;
+}
+
+static int test_stream(usbd_device *dev)
+{
+	static const unsigned latencies[] = {0, 3};
+	const unsigned packets = STREAM_LEN / EP_SIZE;
+	uint64_t in_irqs, out_irqs;
+	unsigned i;
+
+	for (i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++) {
+		if (stream_in(dev, latencies[i], &in_irqs) ||
+				stream_out(dev, latencies[i], &out_irqs)) {
+			return -1;
+		}
+
+		printf("dwc-fifo-test: latency %u token: %u interrupts/MB IN, "
+			"%u interrupts/MB OUT (%u packets/MB)\n", latencies[i],
+			(unsigned) in_irqs * PER_MB, (unsigned) out_irqs * PER_MB,
+			packets * PER_MB);
+
+		/* More than one packet moved per interrupt */
+		CHECK(in_irqs < packets);
+		if (latencies[i]) {
+			CHECK(out_irqs < packets);
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	if (!dwc_otg_model_init()) {
+		fprintf(stderr, "Unable to map register window\n");
+		return EXIT_FAILURE;
+	}
+
+	usbd_device *dev = usbd_init(&dwc_otg_model_backend, &backend_config,
+					&info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+
+	if (test_enumeration(dev) || test_stream(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("dwc-fifo-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,868 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unicore-mx/common/dwc_otg.h>
+#include "dwc_otg_model.h"
+#include "mmio_trap.h"
+
+/* Control and status registers, followed by the FIFO windows */
+#define CSR_SIZE 0x1000
+#define WINDOW_SIZE 0x20000
+
+#define EP_COUNT 6
+#define FIFO_RAM_WORDS 1024
+
+/* Interrupt still asserted after so many usbd_poll() is a bug */
+#define ISR_LOOP_MAX 16
+
+#define ROUND4(v) (((v) + 3) & ~3)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Offset of register (REG is a unicore-mx/common/dwc_otg.h accessor) */
+#define OFF(REG, ...) ((uint32_t) (uintptr_t) &REG(0, ##__VA_ARGS__))
+#define HW(REG, ...) model.reg[OFF(REG, ##__VA_ARGS__) / 4]
+
+/* DIEPxCTL and DOEPxCTL have same layout for these bits */
+#define CTL_EPENA DWC_OTG_DIEPCTL_EPENA
+#define CTL_EPDIS DWC_OTG_DIEPCTL_EPDIS
+#define CTL_SNAK DWC_OTG_DIEPCTL_SNAK
+#define CTL_CNAK DWC_OTG_DIEPCTL_CNAK
+#define CTL_STALL DWC_OTG_DIEPCTL_STALL
+#define CTL_NAKSTS DWC_OTG_DIEPCTL_NAKSTS
+
+/* FIFO (slave mode), in words */
+struct fifo {
+	uint32_t data[FIFO_RAM_WORDS];
+	unsigned head, count;
+};
+
+static struct {
+	uint32_t reg[CSR_SIZE / 4];
+
+	/* Global OUT NAK effective */
+	bool gonak;
+
+	/* Slave mode: one TX FIFO per IN endpoint, shared RX FIFO.
+	 * RX FIFO hold status entries followed by their data words. */
+	struct fifo tx[EP_COUNT];
+	struct fifo rx;
+	unsigned rx_status; /* Status entries in RX FIFO */
+	unsigned rx_data; /* Data words of the last popped entry not read yet */
+
+	/* Tokens issued before the ISR is run (interrupt latency) */
+	unsigned latency;
+	unsigned irq_wait;
+
+	/* Core do not answer NAK and disable requests */
+	bool wedged;
+
+	struct dwc_otg_model_stats stats;
+	char error[160];
+} model;
+
+static void model_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void model_error(const char *fmt, ...)
+{
+	va_list args;
+
+	if (model.error[0]) {
+		/* Only the first one */
+		return;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(model.error, sizeof(model.error), fmt, args);
+	va_end(args);
+}
+
+/**
+ * Decode the endpoint number of a per endpoint register
+ * @param[in] offset Register offset
+ * @param[in] reg0 Offset of the register for endpoint 0
+ * @param[out] num Endpoint number
+ * @return true if @a offset is the register of endpoint @a num
+ */
+static bool ep_reg(uint32_t offset, uint32_t reg0, unsigned *num)
+{
+	const uint32_t stride = OFF(DWC_OTG_DIEPxCTL, 1) - OFF(DWC_OTG_DIEPxCTL, 0);
+
+	if (offset < reg0 || ((offset - reg0) % stride)) {
+		return false;
+	}
+
+	*num = (offset - reg0) / stride;
+	return *num < 16;
+}
+
+static bool dma_enabled(void)
+{
+	return !!(HW(DWC_OTG_GAHBCFG) & DWC_OTG_GAHBCFG_DMAEN);
+}
+
+static void fifo_push(struct fifo *f, uint32_t word)
+{
+	f->data[(f->head + f->count++) % FIFO_RAM_WORDS] = word;
+}
+
+static uint32_t fifo_pop(struct fifo *f)
+{
+	uint32_t word = f->data[f->head];
+
+	f->head = (f->head + 1) % FIFO_RAM_WORDS;
+	f->count--;
+	return word;
+}
+
+static void fifo_flush(struct fifo *f)
+{
+	f->head = f->count = 0;
+}
+
+static uint32_t tx_depth(unsigned num)
+{
+	if (!num) {
+		return DWC_OTG_DIEP0TXF_TX0FD_GET(HW(DWC_OTG_DIEP0TXF));
+	}
+
+	return DWC_OTG_DIEPTXF_INEPTXFD_GET(HW(DWC_OTG_DIEPxTXF, num));
+}
+
+static uint32_t rx_depth(void)
+{
+	return HW(DWC_OTG_GRXFSIZ) & 0xFFFF;
+}
+
+/**
+ * TX FIFO empty status of IN endpoint @a num
+ * Half empty, or completely empty if GAHBCFG.TXFELVL
+ * @param[in] num Endpoint number
+ * @return true if the TX FIFO is empty
+ */
+static bool txfe(unsigned num)
+{
+	if (HW(DWC_OTG_GAHBCFG) & DWC_OTG_GAHBCFG_TXFELVL) {
+		return !model.tx[num].count;
+	}
+
+	return model.tx[num].count <= tx_depth(num) / 2;
+}
+
+static uint32_t read_diepint(unsigned num)
+{
+	uint32_t diepint = HW(DWC_OTG_DIEPxINT, num);
+
+	if (!dma_enabled() && txfe(num)) {
+		diepint |= DWC_OTG_DIEPINT_TXFE;
+	}
+
+	return diepint;
+}
+
+static uint32_t read_daint(void)
+{
+	uint32_t daint = 0;
+	unsigned i;
+
+	for (i = 0; i < EP_COUNT; i++) {
+		if (HW(DWC_OTG_DIEPxINT, i) & HW(DWC_OTG_DIEPMSK)) {
+			daint |= DWC_OTG_DAINT_IEPINT(i);
+		}
+
+		/* TXFE is masked by DIEPEMPMSK */
+		if ((read_diepint(i) & DWC_OTG_DIEPINT_TXFE) &&
+				(HW(DWC_OTG_DIEPEMPMSK) & DWC_OTG_DIEPEMPMSK_INEPTXFEM(i))) {
+			daint |= DWC_OTG_DAINT_IEPINT(i);
+		}
+
+		if (HW(DWC_OTG_DOEPxINT, i) & HW(DWC_OTG_DOEPMSK)) {
+			daint |= DWC_OTG_DAINT_OEPINT(i);
+		}
+	}
+
+	return daint;
+}
+
+static uint32_t read_gintsts(void)
+{
+	uint32_t gintsts = HW(DWC_OTG_GINTSTS);
+	uint32_t daint = read_daint() & HW(DWC_OTG_DAINTMSK);
+
+	if (daint & 0xFFFF) {
+		gintsts |= DWC_OTG_GINTSTS_IEPINT;
+	}
+
+	if (daint >> 16) {
+		gintsts |= DWC_OTG_GINTSTS_OEPINT;
+	}
+
+	if (model.gonak && !model.wedged) {
+		gintsts |= DWC_OTG_GINTSTS_GONAKEFF;
+	}
+
+	if (model.rx_status) {
+		gintsts |= DWC_OTG_GINTSTS_RXFLVL;
+	}
+
+	return gintsts;
+}
+
+static uint32_t read_reg(uint32_t offset)
+{
+	unsigned num;
+
+	if (offset >= CSR_SIZE) {
+		return 0;
+	}
+
+	if (offset == OFF(DWC_OTG_GINTSTS)) {
+		return read_gintsts();
+	}
+
+	if (offset == OFF(DWC_OTG_DAINT)) {
+		return read_daint();
+	}
+
+	if (offset == OFF(DWC_OTG_GRXSTSR) || offset == OFF(DWC_OTG_GRXSTSP)) {
+		return model.rx_status ? model.rx.data[model.rx.head] : 0;
+	}
+
+	if (ep_reg(offset, OFF(DWC_OTG_DIEPxINT, 0), &num) && num < EP_COUNT) {
+		return read_diepint(num);
+	}
+
+	if (ep_reg(offset, OFF(DWC_OTG_DIEPxTXFSTS, 0), &num) && num < EP_COUNT) {
+		return DWC_OTG_DIEPTXFSTS_INEPTFSAV(tx_depth(num) -
+							model.tx[num].count);
+	}
+
+	return model.reg[offset / 4];
+}
+
+/**
+ * Pop a RX FIFO status entry (GRXSTSP read)
+ * Transfer complete and SETUP done interrupt are raised when their
+ *  entry is popped.
+ * @return status entry
+ */
+static uint32_t pop_rx_status(void)
+{
+	uint32_t status, num;
+
+	if (model.rx_data) {
+		model_error("GRXSTSP popped with %u data words not read",
+			model.rx_data);
+		return 0;
+	}
+
+	if (!model.rx_status) {
+		model_error("GRXSTSP popped with RX FIFO empty");
+		return 0;
+	}
+
+	status = fifo_pop(&model.rx);
+	model.rx_status--;
+	model.rx_data = ROUND4(DWC_OTG_GRXSTSP_BCNT_GET(status)) / 4;
+	num = DWC_OTG_GRXSTSP_EPNUM_GET(status);
+
+	switch (status & DWC_OTG_GRXSTSP_PKTSTS_MASK) {
+	case DWC_OTG_GRXSTSP_PKTSTS_OUT_COMP:
+		HW(DWC_OTG_DOEPxINT, num) |= DWC_OTG_DOEPINT_XFRC;
+	break;
+	case DWC_OTG_GRXSTSP_PKTSTS_SETUP_COMP:
+		HW(DWC_OTG_DOEPxINT, num) |= DWC_OTG_DOEPINT_STUP;
+	break;
+	}
+
+	return status;
+}
+
+/**
+ * CPU read of the FIFO window (RX FIFO data)
+ * @return data word
+ */
+static uint32_t pop_rx_data(void)
+{
+	if (!model.rx_data) {
+		model_error("RX FIFO read without packet data");
+		return 0;
+	}
+
+	model.rx_data--;
+	return fifo_pop(&model.rx);
+}
+
+/**
+ * CPU write of the FIFO window of IN endpoint @a num
+ * @param[in] num Endpoint number
+ * @param[in] value Data word
+ */
+static void push_tx_data(unsigned num, uint32_t value)
+{
+	if (num >= EP_COUNT) {
+		model_error("Write to FIFO %u", num);
+		return;
+	}
+
+	if (model.tx[num].count >= tx_depth(num)) {
+		model_error("TX FIFO %u overflow (depth %u)", num, tx_depth(num));
+		return;
+	}
+
+	fifo_push(&model.tx[num], value);
+}
+
+/**
+ * Check that the TX FIFO do not overlap the DMA registers at top of FIFO RAM
+ * @param[in] num TX FIFO number
+ * @param[in] start Start address (words)
+ * @param[in] depth Depth (words)
+ */
+static void check_txfifo(unsigned num, uint32_t start, uint32_t depth)
+{
+	uint32_t avail = FIFO_RAM_WORDS;
+
+	if (dma_enabled()) {
+		avail -= EP_COUNT * 2;
+	}
+
+	if (start + depth > avail) {
+		model_error("TX FIFO %u (start %u, depth %u) beyond %u words",
+			num, start, depth, avail);
+	}
+
+	if (start < rx_depth()) {
+		model_error("TX FIFO %u (start %u) overlap RX FIFO (%u words)",
+			num, start, rx_depth());
+	}
+}
+
+static void write_ctl(bool in, unsigned num, uint32_t value)
+{
+	uint32_t *ctl = in ? &HW(DWC_OTG_DIEPxCTL, num) : &HW(DWC_OTG_DOEPxCTL, num);
+	uint32_t *intr = in ? &HW(DWC_OTG_DIEPxINT, num) : &HW(DWC_OTG_DOEPxINT, num);
+	uint32_t dma = in ? HW(DWC_OTG_DIEPxDMA, num) : HW(DWC_OTG_DOEPxDMA, num);
+	uint32_t old = *ctl;
+
+	/* EPENA can only be cleared by core, NAKSTS is read only */
+	uint32_t v = (value & ~(CTL_SNAK | CTL_CNAK | CTL_EPDIS | CTL_NAKSTS)) |
+				(old & (CTL_EPENA | CTL_NAKSTS));
+
+	if ((value & CTL_SNAK) && !model.wedged) {
+		v |= CTL_NAKSTS;
+		if (in) {
+			*intr |= DWC_OTG_DIEPINT_INEPNE;
+		}
+	}
+
+	if (value & CTL_CNAK) {
+		v &= ~CTL_NAKSTS;
+	}
+
+	if ((value & CTL_EPDIS) && (old & CTL_EPENA) && !model.wedged) {
+		if (in && !(v & CTL_NAKSTS)) {
+			model_error("IN endpoint %u disabled without NAK", num);
+		}
+
+		if (!in && !model.gonak) {
+			model_error("OUT endpoint %u disabled without global OUT NAK", num);
+		}
+
+		v &= ~CTL_EPENA;
+		*intr |= DWC_OTG_DIEPINT_EPDISD;
+	}
+
+	if ((value & CTL_EPENA) && !(old & CTL_EPENA) && dma_enabled()) {
+		if (dma & 0x3) {
+			model_error("%s endpoint %u enabled with unaligned DMA address "
+				"0x%08x", in ? "IN" : "OUT", num, dma);
+		}
+	}
+
+	*ctl = v;
+}
+
+static void write_reg(uint32_t offset, uint32_t value)
+{
+	unsigned num;
+
+	if (offset >= CSR_SIZE) {
+		push_tx_data((offset - CSR_SIZE) >> 12, value);
+		return;
+	}
+
+	if (offset == OFF(DWC_OTG_GRSTCTL)) {
+		if (value & DWC_OTG_GRSTCTL_CSRST) {
+			uint32_t ghwcfg2 = HW(DWC_OTG_GHWCFG2);
+			uint32_t ghwcfg3 = HW(DWC_OTG_GHWCFG3);
+			memset(model.reg, 0, sizeof(model.reg));
+			HW(DWC_OTG_GHWCFG2) = ghwcfg2;
+			HW(DWC_OTG_GHWCFG3) = ghwcfg3;
+			model.gonak = false;
+			value |= DWC_OTG_GRSTCTL_RXFFLSH | DWC_OTG_GRSTCTL_TXFFLSH |
+						DWC_OTG_GRSTCTL_TXFNUM_ALL;
+		}
+
+		if (value & DWC_OTG_GRSTCTL_TXFFLSH) {
+			unsigned txfnum = DWC_OTG_GRSTCTL_TXFNUM_GET(value);
+			for (num = 0; num < EP_COUNT; num++) {
+				if (txfnum == 0x10 || txfnum == num) {
+					fifo_flush(&model.tx[num]);
+				}
+			}
+		}
+
+		if (value & DWC_OTG_GRSTCTL_RXFFLSH) {
+			fifo_flush(&model.rx);
+			model.rx_status = model.rx_data = 0;
+		}
+
+		/* Reset and flush complete immediately */
+		HW(DWC_OTG_GRSTCTL) = DWC_OTG_GRSTCTL_AHBIDL;
+	} else if (offset == OFF(DWC_OTG_GINTSTS)) {
+		HW(DWC_OTG_GINTSTS) &= ~value;
+	} else if (offset == OFF(DWC_OTG_DCTL)) {
+		if (value & DWC_OTG_DCTL_SGONAK) {
+			model.gonak = true;
+		}
+
+		if (value & DWC_OTG_DCTL_CGONAK) {
+			model.gonak = false;
+		}
+
+		HW(DWC_OTG_DCTL) = value & ~(DWC_OTG_DCTL_SGONAK | DWC_OTG_DCTL_CGONAK);
+	} else if (offset == OFF(DWC_OTG_DAINT) ||
+				offset == OFF(DWC_OTG_GHWCFG2) ||
+				offset == OFF(DWC_OTG_GHWCFG3)) {
+		/* Read only */
+	} else if (offset == OFF(DWC_OTG_DIEP0TXF)) {
+		check_txfifo(0, DWC_OTG_DIEP0TXF_TX0FSA_GET(value),
+				DWC_OTG_DIEP0TXF_TX0FD_GET(value));
+		model.reg[offset / 4] = value;
+	} else if (offset >= OFF(DWC_OTG_DIEPxTXF, 1) &&
+				offset < OFF(DWC_OTG_DIEPxTXF, EP_COUNT)) {
+		check_txfifo((offset - OFF(DWC_OTG_DIEPxTXF, 1)) / 4 + 1,
+				DWC_OTG_DIEPTXF_INEPTXSA_GET(value),
+				DWC_OTG_DIEPTXF_INEPTXFD_GET(value));
+		model.reg[offset / 4] = value;
+	} else if (ep_reg(offset, OFF(DWC_OTG_DIEPxINT, 0), &num) ||
+				ep_reg(offset, OFF(DWC_OTG_DOEPxINT, 0), &num)) {
+		model.reg[offset / 4] &= ~value;
+	} else if (ep_reg(offset, OFF(DWC_OTG_DIEPxCTL, 0), &num)) {
+		write_ctl(true, num, value);
+	} else if (ep_reg(offset, OFF(DWC_OTG_DOEPxCTL, 0), &num)) {
+		write_ctl(false, num, value);
+	} else {
+		model.reg[offset / 4] = value;
+	}
+}
+
+/**
+ * Check access that are not part of DMA mode programming model
+ * @param[in] offset Register offset
+ */
+static void check_access(uint32_t offset)
+{
+	if (!dma_enabled()) {
+		return;
+	}
+
+	if (offset >= CSR_SIZE) {
+		model_error("CPU access to FIFO 0x%x in DMA mode", offset);
+	} else if (offset == OFF(DWC_OTG_GRXSTSP) ||
+				offset == OFF(DWC_OTG_GRXSTSR)) {
+		model_error("CPU access to RX status in DMA mode");
+	}
+}
+
+static uint32_t trap_read(uint32_t offset)
+{
+	check_access(offset);
+
+	/* FIFO window is write only for TX, written by push_tx_data() */
+	if (offset >= CSR_SIZE) {
+		return mmio_trap_is_write() ? 0 : pop_rx_data();
+	}
+
+	if (offset == OFF(DWC_OTG_GRXSTSP)) {
+		return pop_rx_status();
+	}
+
+	return read_reg(offset);
+}
+
+bool dwc_otg_model_init(void)
+{
+	memset(&model, 0, sizeof(model));
+	HW(DWC_OTG_GRSTCTL) = DWC_OTG_GRSTCTL_AHBIDL;
+	HW(DWC_OTG_GHWCFG2) = DWC_OTG_GHWCFG2_NUMDEVEPS(EP_COUNT - 1);
+	HW(DWC_OTG_GHWCFG3) = DWC_OTG_GHWCFG3_DFIFODEPTH(FIFO_RAM_WORDS);
+
+	return mmio_trap_init(DWC_OTG_MODEL_BASE, WINDOW_SIZE, trap_read,
+				write_reg);
+}
+
+static bool irq_pending(void)
+{
+	return (HW(DWC_OTG_GAHBCFG) & DWC_OTG_GAHBCFG_GINT) &&
+			(read_gintsts() & HW(DWC_OTG_GINTMSK));
+}
+
+/**
+ * Call usbd_poll() while the interrupt line is asserted
+ * @param[in] dev USB Device
+ */
+static void isr(usbd_device *dev)
+{
+	unsigned i;
+
+	for (i = 0; irq_pending(); i++) {
+		if (i == ISR_LOOP_MAX) {
+			model_error("Interrupt stuck (GINTSTS = 0x%08x)", read_gintsts());
+			return;
+		}
+
+		model.stats.irqs++;
+		usbd_poll(dev, 0);
+	}
+}
+
+static void dma_write(uint32_t addr, const void *data, uint16_t len)
+{
+	if (addr & 0x3) {
+		model_error("DMA write to unaligned address 0x%08x", addr);
+		return;
+	}
+
+	/* Core write whole words */
+	uint8_t *mem = (uint8_t *) (uintptr_t) addr;
+	memcpy(mem, data, len);
+	memset(mem + len, 0, ROUND4(len) - len);
+	model.stats.dma_bytes += len;
+}
+
+static void dma_read(uint32_t addr, void *data, uint16_t len)
+{
+	if (addr & 0x3) {
+		model_error("DMA read from unaligned address 0x%08x", addr);
+		return;
+	}
+
+	memcpy(data, (const void *) (uintptr_t) addr, len);
+	model.stats.dma_bytes += len;
+}
+
+static uint16_t ep_mps(unsigned num, uint32_t ctl)
+{
+	static const uint16_t ep0_mps[] = {64, 32, 16, 8};
+
+	if (!num) {
+		return ep0_mps[DWC_OTG_DIEP0CTL_MPSIZ_GET(ctl)];
+	}
+
+	return DWC_OTG_DIEPCTL_MPSIZ_GET(ctl);
+}
+
+void dwc_otg_model_reset(usbd_device *dev)
+{
+	unsigned i;
+
+	for (i = 0; i < EP_COUNT; i++) {
+		HW(DWC_OTG_DIEPxCTL, i) = CTL_NAKSTS;
+		HW(DWC_OTG_DOEPxCTL, i) = CTL_NAKSTS;
+	}
+
+	HW(DWC_OTG_DCFG) &= ~DWC_OTG_DCFG_DAD_MASK;
+	HW(DWC_OTG_DSTS) = DWC_OTG_DSTS_ENUMSPD_HS_PHY_30MHZ_OR_60MHZ;
+	HW(DWC_OTG_GINTSTS) |= DWC_OTG_GINTSTS_ENUMDNE;
+	isr(dev);
+}
+
+/**
+ * Run the ISR once @a model.latency tokens have been issued
+ *  while the interrupt line is asserted
+ * @param[in] dev USB Device
+ */
+static void token_done(usbd_device *dev)
+{
+	if (!irq_pending()) {
+		model.irq_wait = 0;
+		return;
+	}
+
+	if (model.irq_wait++ < model.latency) {
+		return;
+	}
+
+	model.irq_wait = 0;
+	isr(dev);
+}
+
+enum dwc_otg_model_handshake dwc_otg_model_setup(usbd_device *dev,
+		const struct usb_setup_data *setup_data)
+{
+	uint32_t *ctl = &HW(DWC_OTG_DOEPxCTL, 0);
+	uint32_t *tsiz = &HW(DWC_OTG_DOEPxTSIZ, 0);
+	uint32_t *dma = &HW(DWC_OTG_DOEPxDMA, 0);
+	uint32_t stupcnt = DWC_OTG_DOEPTSIZ_STUPCNT_GET(*tsiz);
+
+	if (dma_enabled()) {
+		if (!(*ctl & CTL_EPENA)) {
+			model_error("SETUP lost, EP0 OUT not enabled");
+			return DWC_OTG_MODEL_NAK;
+		}
+
+		if (!stupcnt) {
+			model_error("SETUP lost, STUPCNT is 0");
+			return DWC_OTG_MODEL_NAK;
+		}
+
+		dma_write(*dma, setup_data, 8);
+		*dma += 8;
+		HW(DWC_OTG_DOEPxINT, 0) |= DWC_OTG_DOEPINT_STUP;
+	} else {
+		uint32_t words[2];
+
+		/* SETUP entry, data, then SETUP done entry */
+		if (rx_depth() - model.rx.count < 4) {
+			model_error("SETUP lost, RX FIFO full");
+			return DWC_OTG_MODEL_NAK;
+		}
+
+		memcpy(words, setup_data, 8);
+		fifo_push(&model.rx, DWC_OTG_GRXSTSP_PKTSTS_SETUP |
+				DWC_OTG_GRXSTSP_BCNT(8) | DWC_OTG_GRXSTSP_EPNUM(0));
+		fifo_push(&model.rx, words[0]);
+		fifo_push(&model.rx, words[1]);
+		fifo_push(&model.rx, DWC_OTG_GRXSTSP_PKTSTS_SETUP_COMP |
+				DWC_OTG_GRXSTSP_EPNUM(0));
+		model.rx_status += 2;
+	}
+
+	if (stupcnt) {
+		*tsiz = (*tsiz & ~DWC_OTG_DOEPTSIZ_STUPCNT_MASK) |
+				DWC_OTG_DOEPTSIZ_STUPCNT(stupcnt - 1);
+	}
+
+	/* SETUP clear STALL and NAK the DATA stage till application is ready */
+	*ctl = (*ctl & ~(CTL_EPENA | CTL_STALL)) | CTL_NAKSTS;
+	HW(DWC_OTG_DIEPxCTL, 0) = (HW(DWC_OTG_DIEPxCTL, 0) & ~CTL_STALL) |
+			CTL_NAKSTS;
+
+	isr(dev);
+
+	return DWC_OTG_MODEL_ACK;
+}
+
+static enum dwc_otg_model_handshake in_token(unsigned num, uint8_t *buf,
+		uint16_t max_len, uint16_t *len)
+{
+	uint32_t *ctl = &HW(DWC_OTG_DIEPxCTL, num);
+	uint32_t *tsiz = &HW(DWC_OTG_DIEPxTSIZ, num);
+	uint32_t *dma = &HW(DWC_OTG_DIEPxDMA, num);
+
+	if (*ctl & CTL_STALL) {
+		return DWC_OTG_MODEL_STALL;
+	}
+
+	if (!(*ctl & CTL_EPENA) || (*ctl & CTL_NAKSTS)) {
+		return DWC_OTG_MODEL_NAK;
+	}
+
+	uint32_t xfrsiz = DWC_OTG_DIEPTSIZ_XFRSIZ_GET(*tsiz);
+	uint32_t pktcnt = DWC_OTG_DIEPTSIZ_PKTCNT_GET(*tsiz);
+	uint16_t pkt_len = MIN(ep_mps(num, *ctl), xfrsiz);
+
+	if (!pktcnt) {
+		model_error("IN endpoint %u enabled with PKTCNT = 0", num);
+		return DWC_OTG_MODEL_NAK;
+	}
+
+	if (pkt_len > max_len) {
+		model_error("IN endpoint %u packet of %u bytes (host accept %u)",
+			num, pkt_len, max_len);
+		return DWC_OTG_MODEL_NAK;
+	}
+
+	if (dma_enabled()) {
+		dma_read(*dma, buf, pkt_len);
+		*dma += ROUND4(pkt_len);
+	} else {
+		unsigned i, words = ROUND4(pkt_len) / 4;
+
+		/* Packet not (completely) written yet */
+		if (model.tx[num].count < words) {
+			return DWC_OTG_MODEL_NAK;
+		}
+
+		for (i = 0; i < words; i++) {
+			uint32_t word = fifo_pop(&model.tx[num]);
+			memcpy(buf + i * 4, &word, MIN(4, pkt_len - i * 4));
+		}
+	}
+
+	xfrsiz -= pkt_len;
+	pktcnt--;
+	*tsiz = (*tsiz & ~(DWC_OTG_DIEPTSIZ_XFRSIZ_MASK |
+				DWC_OTG_DIEPTSIZ_PKTCNT_MASK)) |
+			DWC_OTG_DIEPTSIZ_XFRSIZ(xfrsiz) | DWC_OTG_DIEPTSIZ_PKTCNT(pktcnt);
+
+	if (!pktcnt) {
+		if (xfrsiz) {
+			model_error("IN endpoint %u PKTCNT exhausted with %u bytes left",
+				num, xfrsiz);
+		}
+
+		*ctl &= ~CTL_EPENA;
+		HW(DWC_OTG_DIEPxINT, num) |= DWC_OTG_DIEPINT_XFRC;
+	}
+
+	*len = pkt_len;
+
+	return DWC_OTG_MODEL_ACK;
+}
+
+enum dwc_otg_model_handshake dwc_otg_model_in(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len)
+{
+	enum dwc_otg_model_handshake handshake;
+
+	handshake = in_token(ep_addr & 0x0F, buf, max_len, len);
+	token_done(dev);
+
+	return handshake;
+}
+
+static enum dwc_otg_model_handshake out_token(unsigned num,
+		const uint8_t *buf, uint16_t len)
+{
+	uint32_t *ctl = &HW(DWC_OTG_DOEPxCTL, num);
+	uint32_t *tsiz = &HW(DWC_OTG_DOEPxTSIZ, num);
+	uint32_t *dma = &HW(DWC_OTG_DOEPxDMA, num);
+
+	if (*ctl & CTL_STALL) {
+		return DWC_OTG_MODEL_STALL;
+	}
+
+	if (!(*ctl & CTL_EPENA) || (*ctl & CTL_NAKSTS) || model.gonak) {
+		return DWC_OTG_MODEL_NAK;
+	}
+
+	uint16_t mps = ep_mps(num, *ctl);
+	uint32_t xfrsiz = DWC_OTG_DOEPTSIZ_XFRSIZ_GET(*tsiz);
+	uint32_t pktcnt = DWC_OTG_DOEPTSIZ_PKTCNT_GET(*tsiz);
+
+	if (len > mps) {
+		model_error("OUT endpoint %u packet of %u bytes (MPS %u)",
+			num, len, mps);
+		return DWC_OTG_MODEL_NAK;
+	}
+
+	if (!pktcnt || len > xfrsiz) {
+		model_error("OUT endpoint %u packet of %u bytes (XFRSIZ %u, "
+			"PKTCNT %u)", num, len, xfrsiz, pktcnt);
+		return DWC_OTG_MODEL_NAK;
+	}
+
+	/* Short packet or last packet complete the transfer */
+	bool last = len < mps || pktcnt == 1;
+
+	if (dma_enabled()) {
+		dma_write(*dma, buf, len);
+		*dma += ROUND4(len);
+	} else {
+		unsigned i, words = ROUND4(len) / 4;
+
+		/* Status entry, data (and transfer complete entry) */
+		if (rx_depth() - model.rx.count < words + 1 + last) {
+			return DWC_OTG_MODEL_NAK;
+		}
+
+		fifo_push(&model.rx, DWC_OTG_GRXSTSP_PKTSTS_OUT |
+				DWC_OTG_GRXSTSP_BCNT(len) | DWC_OTG_GRXSTSP_EPNUM(num));
+		for (i = 0; i < words; i++) {
+			uint32_t word = 0;
+			memcpy(&word, buf + i * 4, MIN(4, len - i * 4));
+			fifo_push(&model.rx, word);
+		}
+		model.rx_status++;
+	}
+
+	xfrsiz -= len;
+	pktcnt--;
+	*tsiz = (*tsiz & ~(DWC_OTG_DOEPTSIZ_XFRSIZ_MASK |
+				DWC_OTG_DOEPTSIZ_PKTCNT_MASK)) |
+			DWC_OTG_DOEPTSIZ_XFRSIZ(xfrsiz) | DWC_OTG_DOEPTSIZ_PKTCNT(pktcnt);
+
+	if (last) {
+		*ctl = (*ctl & ~CTL_EPENA) | CTL_NAKSTS;
+
+		if (dma_enabled()) {
+			HW(DWC_OTG_DOEPxINT, num) |= DWC_OTG_DOEPINT_XFRC;
+		} else {
+			/* XFRC is raised when the entry is popped */
+			fifo_push(&model.rx, DWC_OTG_GRXSTSP_PKTSTS_OUT_COMP |
+					DWC_OTG_GRXSTSP_EPNUM(num));
+			model.rx_status++;
+		}
+	}
+
+	return DWC_OTG_MODEL_ACK;
+}
+
+enum dwc_otg_model_handshake dwc_otg_model_out(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len)
+{
+	enum dwc_otg_model_handshake handshake;
+
+	handshake = out_token(ep_addr & 0x0F, buf, len);
+	token_done(dev);
+
+	return handshake;
+}
+
+void dwc_otg_model_latency(unsigned tokens)
+{
+	model.latency = tokens;
+	model.irq_wait = 0;
+}
+
+void dwc_otg_model_wedge(bool wedged)
+{
+	model.wedged = wedged;
+}
+
+uint32_t dwc_otg_model_peek(uint32_t offset)
+{
+	return read_reg(offset);
+}
+
+const struct dwc_otg_model_stats *dwc_otg_model_stats(void)
+{
+	model.stats.reads = mmio_trap_stats()->reads;
+	model.stats.writes = mmio_trap_stats()->writes;
+	return &model.stats;
+}
+
+const char *dwc_otg_model_error(void)
+{
+	return model.error[0] ? model.error : NULL;
+}
@@ -0,0 +1,157 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Register level model of the DWC OTG core (device mode, internal DMA
+ *  or slave mode).
+ *
+ * The unmodified backend (lib/usbd/backend/usbd_dwc_otg.c) is run against
+ *  a register window mapped at DWC_OTG_MODEL_BASE.
+ * Every register access of the backend is trapped (mmio_trap.h) and
+ *  executed by the model, so the register semantic (write 1 to clear,
+ *  self clearing bits, NAK/enable state, DMA) is the one of the core.
+ *
+ * The model check that the backend follow the programming model of DMA mode
+ *  (no FIFO access from CPU, aligned DMA address, global OUT NAK before
+ *  disabling an OUT endpoint, FIFO RAM not overlapping the DMA registers).
+ *
+ * In slave mode, the TX FIFO (one per IN endpoint, depth from DIEPxTXF) and
+ *  the RX FIFO (GRXFSIZ, status entries followed by data) are modelled:
+ *  DIEPxTXFSTS, TXFE (half empty, or empty with GAHBCFG.TXFELVL, masked by
+ *  DIEPEMPMSK), RXFLVL and GRXSTSP. A packet is NAKed if it is not
+ *  completely in the TX FIFO, or if the RX FIFO has no room for it.
+ *  Transfer complete (OUT) and SETUP done are raised when their RX FIFO
+ *  entry is popped.
+ * The first violation is recorded, see dwc_otg_model_error().
+ *
+ * Model assumption: EP0 OUT is disabled by the core at the end of SETUP phase.
+ *
+ * The "virtual host" API below issue tokens to the core. After each token,
+ *  usbd_poll() is called while the interrupt line is asserted (ie as ISR).
+ *  dwc_otg_model_latency() delay the ISR by a number of tokens.
+ *
+ * Linux x86-64 only (page fault error code and trap flag are used),
+ *  the program should be linked with -no-pie (DMA address are 32bit).
+ */
+
+#ifndef DWC_OTG_MODEL_H
+#define DWC_OTG_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usb/usbstd.h>
+#include <unicore-mx/usbd/usbd.h>
+
+/** Register window (same as OTG_HS on STM32F4) */
+#define DWC_OTG_MODEL_BASE 0x40040000
+
+/** Handshake of the core for a token */
+enum dwc_otg_model_handshake {
+	DWC_OTG_MODEL_ACK = 0,
+	DWC_OTG_MODEL_NAK = 1,
+	DWC_OTG_MODEL_STALL = 2
+};
+
+struct dwc_otg_model_stats {
+	uint64_t reads; /**< Register read by CPU */
+	uint64_t writes; /**< Register write (or read-modify-write) by CPU */
+	uint64_t irqs; /**< Number of usbd_poll() (ISR) performed */
+	uint64_t dma_bytes; /**< Bytes moved by core DMA */
+};
+
+/**
+ * Map the register window and install the fault handlers.
+ * The core is in reset state (GHWCFG2/GHWCFG3 as OTG_HS: 6 endpoints,
+ *  4KB FIFO RAM)
+ * @return false if the window could not be mapped
+ */
+bool dwc_otg_model_init(void);
+
+/**
+ * Signal bus RESET and enumeration done (high speed)
+ * @param[in] dev USB Device
+ */
+void dwc_otg_model_reset(usbd_device *dev);
+
+/**
+ * Send a SETUP packet to endpoint 0
+ * @param[in] dev USB Device
+ * @param[in] setup_data Setup data
+ * @return DWC_OTG_MODEL_ACK, or NAK if the core could not receive it
+ */
+enum dwc_otg_model_handshake dwc_otg_model_setup(usbd_device *dev,
+		const struct usb_setup_data *setup_data);
+
+/**
+ * Send a IN token to endpoint @a ep_addr
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint address (bit 7 is ignored)
+ * @param[out] buf Buffer to store the data packet
+ * @param[in] max_len Size of @a buf
+ * @param[out] len Number of bytes received (valid on DWC_OTG_MODEL_ACK)
+ * @return handshake
+ */
+enum dwc_otg_model_handshake dwc_otg_model_in(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len);
+
+/**
+ * Send a OUT token (with data packet) to endpoint @a ep_addr
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint address (bit 7 is ignored)
+ * @param[in] buf Data
+ * @param[in] len Length of data (packet size)
+ * @return handshake
+ */
+enum dwc_otg_model_handshake dwc_otg_model_out(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len);
+
+/**
+ * Set the interrupt latency (in tokens)
+ * Once the interrupt line is asserted, the ISR is run after @a tokens
+ *  more tokens (ACK or NAK), as a CPU busy with something else would.
+ * @param[in] tokens Token count, 0 (default) run the ISR after every token
+ * @note SETUP and bus reset always run the ISR immediately
+ */
+void dwc_otg_model_latency(unsigned tokens);
+
+/**
+ * Wedge the core: SNAK, global OUT NAK and endpoint disable are never
+ *  effective (as a core without clock after disconnect).
+ * @param[in] wedged true to wedge, false to return to normal
+ */
+void dwc_otg_model_wedge(bool wedged);
+
+/**
+ * Read a register without being accounted (and without side effect)
+ * @param[in] offset Register offset
+ * @return register value
+ */
+uint32_t dwc_otg_model_peek(uint32_t offset);
+
+/**
+ * Get the statistics (snapshot, call again to refresh)
+ * @return statistics
+ */
+const struct dwc_otg_model_stats *dwc_otg_model_stats(void);
+
+/**
+ * Get the first programming model violation
+ * @return description, NULL if none
+ */
+const char *dwc_otg_model_error(void);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG FIFO planner (backend/dwc_otg_fifo.h).
+ *
+ * Endpoint sets of composite devices are planned for the FS (320 words)
+ *  and HS (1024 words) core of STM32F4. Every layout is checked
+ *  (RX at bottom, TX FIFO not overlapping, whole FIFO RAM used, minimum
+ *  of every endpoint) and printed, then the priorities are checked:
+ *  periodic endpoints reach their goal before bulk endpoints grow.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend/dwc_otg_fifo.h"
+
+#define FS_DEPTH 320
+#define HS_DEPTH 1024
+#define EP_COUNT_FS 4
+#define EP_COUNT_HS 6
+
+#define WORDS(bytes) (((bytes) + 3) / 4)
+
+static void req_init(struct dwc_otg_fifo_req *req, uint16_t depth,
+					uint8_t ep_count, uint16_t ep0_size)
+{
+	memset(req, 0, sizeof(*req));
+	req->depth = depth;
+	req->ep_count = ep_count;
+	req->ep0_size = ep0_size;
+}
+
+static void req_ep(struct dwc_otg_fifo_req *req, uint8_t addr,
+		usbd_ep_type type, uint16_t max_size, uint8_t interval,
+		usbd_ep_flags flags)
+{
+	struct dwc_otg_fifo_ep *ep = (addr & 0x80) ? &req->in[addr & 0xF] :
+							&req->out[addr & 0xF];
+
+	ep->max_size = max_size;
+	ep->type = type;
+	ep->interval = interval;
+	ep->flags = flags;
+}
+
+/**
+ * Check the layout invariants and print it
+ * @param[in] name Name of the endpoint set
+ * @param[in] req Endpoint set
+ * @param[in] plan Partition
+ * @return 0 on success
+ */
+static int check_layout(const char *name, const struct dwc_otg_fifo_req *req,
+					const struct dwc_otg_fifo_plan *plan)
+{
+	uint32_t end = plan->rx;
+	unsigned i;
+
+	printf("fifo-plan-test: %s: RX %"PRIu16" (%"PRIu8" pkt)", name,
+		plan->rx, plan->rx_packets);
+
+	for (i = 0; i < req->ep_count; i++) {
+		uint16_t size = i ? req->in[i].max_size : req->ep0_size;
+
+		if (!size) {
+			if (plan->tx[i]) {
+				fprintf(stderr, "\n%s: TX%u allocated but not used\n", name, i);
+				return -1;
+			}
+			continue;
+		}
+
+		printf(", TX%u %"PRIu16"@%"PRIu16" (%"PRIu8" pkt)", i, plan->tx[i],
+			plan->tx_start[i], plan->tx_packets[i]);
+
+		/* Contiguous: TX FIFO follow each other above RX */
+		if (plan->tx_start[i] != end) {
+			fprintf(stderr, "\n%s: TX%u start %"PRIu16", expected %"PRIu32"\n",
+				name, i, plan->tx_start[i], end);
+			return -1;
+		}
+
+		if (plan->tx[i] < 16 || plan->tx[i] < WORDS(size)) {
+			fprintf(stderr, "\n%s: TX%u below minimum\n", name, i);
+			return -1;
+		}
+
+		end += plan->tx[i];
+	}
+
+	printf("\n");
+
+	if (end != req->depth) {
+		fprintf(stderr, "%s: %"PRIu32" words used of %"PRIu16"\n", name, end,
+			req->depth);
+		return -1;
+	}
+
+	if (plan->rx_packets < 1) {
+		fprintf(stderr, "%s: RX cannot hold a packet\n", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* CDC-ACM + audio streaming on FS core */
+static int test_composite_fs(void)
+{
+	struct dwc_otg_fifo_req req;
+	struct dwc_otg_fifo_plan plan;
+
+	req_init(&req, FS_DEPTH, EP_COUNT_FS, 64);
+	req_ep(&req, 0x81, USBD_EP_BULK, 64, 0, USBD_EP_NONE);
+	req_ep(&req, 0x01, USBD_EP_BULK, 64, 0, USBD_EP_NONE);
+	req_ep(&req, 0x82, USBD_EP_INTERRUPT, 8, 16, USBD_EP_NONE);
+	req_ep(&req, 0x83, USBD_EP_ISOCHRONOUS, 196, 1, USBD_EP_NONE);
+
+	if (!dwc_otg_fifo_plan(&req, &plan) ||
+			check_layout("CDC + audio (FS)", &req, &plan)) {
+		return -1;
+	}
+
+	/* Audio: next frame buffered */
+	if (plan.tx_packets[3] < 2) {
+		fprintf(stderr, "isochronous IN got %"PRIu8" frames\n",
+			plan.tx_packets[3]);
+		return -1;
+	}
+
+	/* Bulk IN: more than one packet */
+	if (plan.tx_packets[1] < 2) {
+		fprintf(stderr, "bulk IN got %"PRIu8" packets\n", plan.tx_packets[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Not enough room for every goal: isochronous reach its goal,
+ *  bulk endpoints share what is left (round robin).
+ */
+static int test_priority(void)
+{
+	struct dwc_otg_fifo_req req;
+	struct dwc_otg_fifo_plan plan;
+
+	req_init(&req, FS_DEPTH, EP_COUNT_FS, 64);
+	req_ep(&req, 0x81, USBD_EP_BULK, 64, 0, USBD_EP_NONE);
+	req_ep(&req, 0x82, USBD_EP_BULK, 64, 0, USBD_EP_NONE);
+	req_ep(&req, 0x83, USBD_EP_ISOCHRONOUS, 384, 1, USBD_EP_NONE);
+
+	if (!dwc_otg_fifo_plan(&req, &plan) ||
+			check_layout("2 bulk + isochronous (FS)", &req, &plan)) {
+		return -1;
+	}
+
+	if (plan.tx_packets[3] != 2) {
+		fprintf(stderr, "isochronous IN got %"PRIu8" frames\n",
+			plan.tx_packets[3]);
+		return -1;
+	}
+
+	/* Endpoint number do not decide who get the room */
+	if (abs(plan.tx_packets[1] - plan.tx_packets[2]) > 1) {
+		fprintf(stderr, "bulk IN unfair: %"PRIu8" vs %"PRIu8" packets\n",
+			plan.tx_packets[1], plan.tx_packets[2]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * High bandwidth isochronous (2 x 1024 bytes) on HS core: a second
+ *  microframe do not fit, bulk endpoints use the room.
+ */
+static int test_high_bandwidth(void)
+{
+	struct dwc_otg_fifo_req req;
+	struct dwc_otg_fifo_plan plan;
+
+	req_init(&req, HS_DEPTH, EP_COUNT_HS, 64);
+	req_ep(&req, 0x81, USBD_EP_ISOCHRONOUS, 1024, 1,
+		USBD_EP_PACKET_PER_FRAME_2);
+	req_ep(&req, 0x82, USBD_EP_BULK, 512, 0, USBD_EP_DOUBLE_BUFFER);
+	req_ep(&req, 0x02, USBD_EP_BULK, 512, 0, USBD_EP_DOUBLE_BUFFER);
+
+	if (!dwc_otg_fifo_plan(&req, &plan) ||
+			check_layout("high bandwidth isochronous (HS)", &req, &plan)) {
+		return -1;
+	}
+
+	/* One microframe (2 packets) is the minimum */
+	if (plan.tx[1] != 2 * WORDS(1024) || plan.tx_packets[2] != 2) {
+		fprintf(stderr, "isochronous IN got %"PRIu16" words\n", plan.tx[1]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Double buffered OUT: RX hold 2 packets of the endpoint */
+static int test_double_buffer_out(void)
+{
+	struct dwc_otg_fifo_req req;
+	struct dwc_otg_fifo_plan plan;
+
+	req_init(&req, HS_DEPTH, EP_COUNT_HS, 64);
+	req_ep(&req, 0x01, USBD_EP_BULK, 512, 0, USBD_EP_DOUBLE_BUFFER);
+	req_ep(&req, 0x81, USBD_EP_BULK, 512, 0, USBD_EP_NONE);
+
+	if (!dwc_otg_fifo_plan(&req, &plan) ||
+			check_layout("double buffered bulk (HS)", &req, &plan)) {
+		return -1;
+	}
+
+	if (plan.rx_packets < 2) {
+		fprintf(stderr, "RX hold %"PRIu8" packets\n", plan.rx_packets);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Minimum requirement beyond FIFO RAM */
+static int test_overflow(void)
+{
+	struct dwc_otg_fifo_req req;
+	struct dwc_otg_fifo_plan plan;
+
+	req_init(&req, FS_DEPTH, EP_COUNT_FS, 64);
+	req_ep(&req, 0x81, USBD_EP_ISOCHRONOUS, 1023, 1, USBD_EP_NONE);
+	req_ep(&req, 0x01, USBD_EP_ISOCHRONOUS, 1023, 1, USBD_EP_NONE);
+
+	if (dwc_otg_fifo_plan(&req, &plan)) {
+		fprintf(stderr, "overflow not reported\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	if (test_composite_fs() || test_priority() || test_high_bandwidth() ||
+			test_double_buffer_out() || test_overflow()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("fifo-plan-test: OK\n");
+	return EXIT_SUCCESS;
+}
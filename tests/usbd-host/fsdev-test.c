@@ -0,0 +1,526 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * STM32 FSDEV backend (usbd_stm32_fsdev.c), run against the register
+ *  model (fsdev_model.h).
+ *
+ * - Enumeration (control IN over multiple packets, status stages)
+ * - Bulk IN / OUT, single buffered and double buffered
+ *   (USBD_EP_DOUBLE_BUFFER), short packet and zero length packet
+ * - NAK window after each packet: double buffered endpoint hand over
+ *   the next buffer before copying data
+ * - All endpoints active at once (no PMA buffer overlap)
+ * - Isochronous IN (always double buffered)
+ * - Cancel of double buffered transfer with packets still in PMA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/stm32/rcc.h>
+#include "usbd_private.h"
+#include "fsdev_model.h"
+#include "test_check.h"
+
+#define EP0_SIZE 16
+#define EP_SIZE 64
+#define ISO_SIZE 16
+
+/* Double buffered */
+#define EP_DBL_IN 0x81
+#define EP_DBL_OUT 0x02
+
+/* Single buffered */
+#define EP_IN 0x83
+#define EP_OUT 0x04
+
+#define EP_ISO_IN 0x85
+
+#define BULK_LEN (EP_SIZE * 6)
+
+#if defined(STM32F0)
+# define PROG "fsdev-test-f0"
+#else
+# define PROG "fsdev-test-f1"
+#endif
+
+/* Backend need the clock */
+void rcc_periph_clock_enable(enum rcc_periph_clken clken)
+{
+	(void) clken;
+}
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = EP0_SIZE,
+	.idVendor = 0xCAFE,
+	.idProduct = 0x0008,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 0,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static uint8_t host_buf[BULK_LEN + EP_SIZE];
+
+struct result {
+	unsigned count;
+	usbd_transfer_status status;
+	size_t length;
+};
+
+/* Indexed by endpoint number */
+static struct result results[8];
+
+static void callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	struct result *result = &results[transfer->ep_addr & 0x0F];
+
+	(void) dev;
+	(void) urb_id;
+
+	result->count++;
+	result->status = status;
+	result->length = transfer->transferred;
+}
+
+static void set_config(usbd_device *dev,
+				const struct usb_config_descriptor *cfg)
+{
+	(void) cfg;
+
+	usbd_ep_prepare(dev, EP_DBL_IN, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_DOUBLE_BUFFER);
+	usbd_ep_prepare(dev, EP_DBL_OUT, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_DOUBLE_BUFFER);
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_ISO_IN, USBD_EP_ISOCHRONOUS, ISO_SIZE, 1,
+		USBD_EP_NONE);
+}
+
+static usbd_urb_id submit(usbd_device *dev, uint8_t ep_addr, void *buf,
+						size_t len, usbd_transfer_flags flags)
+{
+	bool iso = (ep_addr == EP_ISO_IN);
+	const usbd_transfer transfer = {
+		.ep_type = iso ? USBD_EP_ISOCHRONOUS : USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = iso ? ISO_SIZE : EP_SIZE,
+		.ep_interval = iso ? 1 : USBD_INTERVAL_NA,
+		.buffer = buf,
+		.length = len,
+		.flags = flags,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback
+	};
+
+	memset(&results[ep_addr & 0x0F], 0, sizeof(struct result));
+	return usbd_transfer_submit(dev, &transfer);
+}
+
+#define CHECK_RESULT(ep, status_, length_) do { \
+	const struct result *r_ = &results[(ep) & 0x0F]; \
+	CHECK(r_->count == 1 && r_->status == (status_)); \
+	CHECK(r_->length == (length_)); \
+} while (0)
+
+/**
+ * Perform a control transfer (SETUP, DATA, STATUS)
+ * @param[in] dev USB Device
+ * @param[in] setup_data Setup data
+ * @param[inout] data DATA stage buffer
+ * @return number of bytes of DATA stage, -1 on failure
+ */
+static int control(usbd_device *dev, const struct usb_setup_data *setup_data,
+					uint8_t *data)
+{
+	bool in = !!(setup_data->bmRequestType & USB_REQ_TYPE_IN);
+	uint16_t pos = 0, len;
+
+	CHECK(fsdev_model_setup(dev, setup_data) == FSDEV_MODEL_ACK);
+
+	while (pos < setup_data->wLength) {
+		if (in) {
+			CHECK(fsdev_model_in(dev, 0, data + pos, EP0_SIZE, &len) ==
+					FSDEV_MODEL_ACK);
+		} else {
+			len = MIN(setup_data->wLength - pos, EP0_SIZE);
+			CHECK(fsdev_model_out(dev, 0, data + pos, len) ==
+					FSDEV_MODEL_ACK);
+		}
+
+		pos += len;
+		if (len < EP0_SIZE) {
+			break;
+		}
+	}
+
+	/* Status stage */
+	if (in) {
+		CHECK(fsdev_model_out(dev, 0, NULL, 0) == FSDEV_MODEL_ACK);
+	} else {
+		CHECK(fsdev_model_in(dev, 0, NULL, 0, &len) == FSDEV_MODEL_ACK);
+		CHECK(len == 0);
+	}
+
+	CHECK_MODEL(fsdev_model_error());
+	return pos;
+}
+
+static int test_enumeration(usbd_device *dev)
+{
+	static const struct usb_setup_data get_descriptor = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = USB_DT_DEVICE << 8,
+		.wLength = 64
+	};
+
+	static const struct usb_setup_data set_address = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_ADDRESS,
+		.wValue = 9
+	};
+
+	static const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_OUT | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	static uint8_t data[64];
+
+	fsdev_model_reset(dev);
+	CHECK_MODEL(fsdev_model_error());
+
+	CHECK(control(dev, &get_descriptor, data) == USB_DT_DEVICE_SIZE);
+	CHECK(!memcmp(data, &dev_desc, USB_DT_DEVICE_SIZE));
+
+	CHECK(control(dev, &set_address, NULL) == 0);
+	CHECK(dev->backend->get_address(dev) == 9);
+
+	CHECK(control(dev, &set_configuration, NULL) == 0);
+	CHECK(dev->current_config == &config_desc);
+
+	return 0;
+}
+
+/**
+ * Bulk IN transfer of BULK_LEN bytes (short packet flag: ends with ZLP)
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint
+ * @param[out] latency Sum of NAK window (CPU access) between packets
+ * @return 0 on success
+ */
+static int bulk_in(usbd_device *dev, uint8_t ep_addr, int *latency)
+{
+	static uint8_t data[BULK_LEN];
+	size_t pos = 0;
+	uint16_t len;
+	unsigned i;
+
+	for (i = 0; i < BULK_LEN; i++) {
+		data[i] = (i * 5) ^ ep_addr;
+	}
+
+	*latency = 0;
+	CHECK(submit(dev, ep_addr, data, BULK_LEN, USBD_FLAG_SHORT_PACKET) !=
+			USBD_INVALID_URB_ID);
+
+	do {
+		CHECK(fsdev_model_in(dev, ep_addr, host_buf + pos, EP_SIZE, &len) ==
+				FSDEV_MODEL_ACK);
+		pos += len;
+
+		if (len == EP_SIZE) {
+			/* Next packet (or ZLP) ready */
+			CHECK(fsdev_model_latency(ep_addr) >= 0);
+			*latency += fsdev_model_latency(ep_addr);
+		}
+	} while (len == EP_SIZE);
+
+	CHECK(pos == BULK_LEN && !memcmp(host_buf, data, BULK_LEN));
+	CHECK_RESULT(ep_addr, USBD_SUCCESS, BULK_LEN);
+	CHECK(fsdev_model_in(dev, ep_addr, host_buf, EP_SIZE, &len) ==
+			FSDEV_MODEL_NAK);
+	CHECK_MODEL(fsdev_model_error());
+
+	return 0;
+}
+
+static int test_bulk_in(usbd_device *dev)
+{
+	int single, dbl;
+
+	/* Twice: buffer state must be consistent after a transfer */
+	CHECK(!bulk_in(dev, EP_IN, &single) && !bulk_in(dev, EP_IN, &single));
+	CHECK(!bulk_in(dev, EP_DBL_IN, &dbl) && !bulk_in(dev, EP_DBL_IN, &dbl));
+
+	printf(PROG ": bulk IN NAK window per packet: single buffer %u, "
+		"double buffer %u CPU access\n", single / (BULK_LEN / EP_SIZE),
+		dbl / (BULK_LEN / EP_SIZE));
+
+	/* Next packet handed over before the copy */
+	CHECK(dbl < single);
+
+	return 0;
+}
+
+/**
+ * Bulk OUT transfer, complete on short packet
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint
+ * @param[out] latency Sum of NAK window (CPU access) between packets
+ * @return 0 on success
+ */
+static int bulk_out(usbd_device *dev, uint8_t ep_addr, int *latency)
+{
+	static uint8_t data[BULK_LEN + EP_SIZE];
+	size_t pos;
+	unsigned i;
+
+	for (i = 0; i < BULK_LEN; i++) {
+		host_buf[i] = (i * 7) ^ ep_addr;
+	}
+
+	*latency = 0;
+	memset(data, 0, sizeof(data));
+	CHECK(submit(dev, ep_addr, data, sizeof(data),
+			USBD_FLAG_SHORT_PACKET) != USBD_INVALID_URB_ID);
+
+	for (pos = 0; pos < BULK_LEN - EP_SIZE; pos += EP_SIZE) {
+		CHECK(fsdev_model_out(dev, ep_addr, host_buf + pos, EP_SIZE) ==
+				FSDEV_MODEL_ACK);
+		CHECK(fsdev_model_latency(ep_addr) >= 0);
+		*latency += fsdev_model_latency(ep_addr);
+	}
+
+	CHECK(fsdev_model_out(dev, ep_addr, host_buf + pos, 10) ==
+			FSDEV_MODEL_ACK);
+	pos += 10;
+
+	CHECK_RESULT(ep_addr, USBD_SUCCESS, pos);
+	CHECK(!memcmp(data, host_buf, pos));
+
+	/* No transfer armed */
+	CHECK(fsdev_model_out(dev, ep_addr, host_buf, EP_SIZE) == FSDEV_MODEL_NAK);
+
+	/* Complete on last packet (buffer released early must not be used) */
+	CHECK(submit(dev, ep_addr, data, EP_SIZE * 2, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+	CHECK(fsdev_model_out(dev, ep_addr, host_buf, EP_SIZE) == FSDEV_MODEL_ACK);
+	CHECK(fsdev_model_out(dev, ep_addr, host_buf + EP_SIZE, EP_SIZE) ==
+			FSDEV_MODEL_ACK);
+	CHECK_RESULT(ep_addr, USBD_SUCCESS, EP_SIZE * 2);
+	CHECK(!memcmp(data, host_buf, EP_SIZE * 2));
+	CHECK(fsdev_model_out(dev, ep_addr, host_buf, EP_SIZE) == FSDEV_MODEL_NAK);
+	CHECK_MODEL(fsdev_model_error());
+
+	return 0;
+}
+
+static int test_bulk_out(usbd_device *dev)
+{
+	int single, dbl;
+
+	CHECK(!bulk_out(dev, EP_OUT, &single) && !bulk_out(dev, EP_OUT, &single));
+	CHECK(!bulk_out(dev, EP_DBL_OUT, &dbl) &&
+			!bulk_out(dev, EP_DBL_OUT, &dbl));
+
+	printf(PROG ": bulk OUT NAK window per packet: single buffer %u, "
+		"double buffer %u CPU access\n", single / (BULK_LEN / EP_SIZE - 1),
+		dbl / (BULK_LEN / EP_SIZE - 1));
+
+	/* Other buffer given back before the copy */
+	CHECK(dbl < single);
+
+	return 0;
+}
+
+static int test_all_endpoints(usbd_device *dev)
+{
+	static const uint8_t in_eps[] = {EP_DBL_IN, EP_IN};
+	static const uint8_t out_eps[] = {EP_DBL_OUT, EP_OUT};
+	static uint8_t in_data[2][EP_SIZE * 3];
+	static uint8_t out_data[2][EP_SIZE * 3];
+	static uint8_t host_in[2][EP_SIZE * 3];
+	uint16_t len;
+	unsigned i, pkt;
+
+	for (i = 0; i < 2; i++) {
+		memset(in_data[i], 0x10 + i, sizeof(in_data[i]));
+		memset(out_data[i], 0, sizeof(out_data[i]));
+
+		CHECK(submit(dev, in_eps[i], in_data[i], sizeof(in_data[i]),
+				USBD_FLAG_NONE) != USBD_INVALID_URB_ID);
+		CHECK(submit(dev, out_eps[i], out_data[i], sizeof(out_data[i]),
+				USBD_FLAG_NONE) != USBD_INVALID_URB_ID);
+	}
+
+	/* Interleaved: a buffer shared by two endpoints would be corrupted */
+	for (pkt = 0; pkt < 3; pkt++) {
+		for (i = 0; i < 2; i++) {
+			memset(host_buf, 0x20 + i, EP_SIZE);
+			CHECK(fsdev_model_out(dev, out_eps[i], host_buf, EP_SIZE) ==
+					FSDEV_MODEL_ACK);
+			CHECK(fsdev_model_in(dev, in_eps[i],
+					host_in[i] + (pkt * EP_SIZE), EP_SIZE, &len) ==
+					FSDEV_MODEL_ACK);
+			CHECK(len == EP_SIZE);
+		}
+	}
+
+	for (i = 0; i < 2; i++) {
+		CHECK_RESULT(in_eps[i], USBD_SUCCESS, EP_SIZE * 3);
+		CHECK_RESULT(out_eps[i], USBD_SUCCESS, EP_SIZE * 3);
+		CHECK(!memcmp(host_in[i], in_data[i], EP_SIZE * 3));
+
+		memset(host_buf, 0x20 + i, EP_SIZE * 3);
+		CHECK(!memcmp(out_data[i], host_buf, EP_SIZE * 3));
+	}
+
+	CHECK_MODEL(fsdev_model_error());
+	return 0;
+}
+
+static int test_iso_in(usbd_device *dev)
+{
+	static uint8_t data[ISO_SIZE * 3];
+	uint16_t len;
+	unsigned i;
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i + 100;
+	}
+
+	CHECK(submit(dev, EP_ISO_IN, data, sizeof(data), USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+
+	for (i = 0; i < 3; i++) {
+		CHECK(fsdev_model_in(dev, EP_ISO_IN, host_buf + (i * ISO_SIZE),
+				ISO_SIZE, &len) == FSDEV_MODEL_ACK);
+		CHECK(len == ISO_SIZE);
+	}
+
+	CHECK_RESULT(EP_ISO_IN, USBD_SUCCESS, sizeof(data));
+	CHECK(!memcmp(host_buf, data, sizeof(data)));
+	CHECK_MODEL(fsdev_model_error());
+
+	return 0;
+}
+
+static int test_cancel(usbd_device *dev)
+{
+	static uint8_t data[EP_SIZE * 4];
+	usbd_urb_id id;
+	uint16_t len;
+	unsigned i;
+
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = i;
+	}
+
+	/* IN: next packets already copied in PMA */
+	id = submit(dev, EP_DBL_IN, data, sizeof(data), USBD_FLAG_NONE);
+	CHECK(id != USBD_INVALID_URB_ID);
+	CHECK(fsdev_model_in(dev, EP_DBL_IN, host_buf, EP_SIZE, &len) ==
+			FSDEV_MODEL_ACK);
+	CHECK(usbd_transfer_cancel(dev, id));
+
+	/* Only the transmitted packet is accounted */
+	CHECK_RESULT(EP_DBL_IN, USBD_ERR_CANCEL, EP_SIZE);
+	CHECK(fsdev_model_in(dev, EP_DBL_IN, host_buf, EP_SIZE, &len) ==
+			FSDEV_MODEL_NAK);
+
+	/* Stale packet not transmitted */
+	CHECK(submit(dev, EP_DBL_IN, data + 100, 10, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+	CHECK(fsdev_model_in(dev, EP_DBL_IN, host_buf, EP_SIZE, &len) ==
+			FSDEV_MODEL_ACK);
+	CHECK(len == 10 && !memcmp(host_buf, data + 100, 10));
+	CHECK_RESULT(EP_DBL_IN, USBD_SUCCESS, 10);
+	CHECK_MODEL(fsdev_model_error());
+
+	/* OUT: other buffer released to peripheral */
+	id = submit(dev, EP_DBL_OUT, data, sizeof(data), USBD_FLAG_NONE);
+	CHECK(id != USBD_INVALID_URB_ID);
+	CHECK(fsdev_model_out(dev, EP_DBL_OUT, host_buf, EP_SIZE) ==
+			FSDEV_MODEL_ACK);
+	CHECK(usbd_transfer_cancel(dev, id));
+	CHECK_RESULT(EP_DBL_OUT, USBD_ERR_CANCEL, EP_SIZE);
+	CHECK(fsdev_model_out(dev, EP_DBL_OUT, host_buf, EP_SIZE) ==
+			FSDEV_MODEL_NAK);
+
+	CHECK(submit(dev, EP_DBL_OUT, data, EP_SIZE, USBD_FLAG_NONE) !=
+			USBD_INVALID_URB_ID);
+	memset(host_buf, 0x55, EP_SIZE);
+	CHECK(fsdev_model_out(dev, EP_DBL_OUT, host_buf, EP_SIZE) ==
+			FSDEV_MODEL_ACK);
+	CHECK_RESULT(EP_DBL_OUT, USBD_SUCCESS, EP_SIZE);
+	CHECK(!memcmp(data, host_buf, EP_SIZE));
+	CHECK_MODEL(fsdev_model_error());
+
+	return 0;
+}
+
+int main(void)
+{
+	if (!fsdev_model_init()) {
+		fprintf(stderr, "Unable to map register window\n");
+		return EXIT_FAILURE;
+	}
+
+	usbd_device *dev = usbd_init(USBD_STM32_FSDEV, NULL, &info);
+	usbd_register_set_config_callback(dev, set_config);
+
+	if (test_enumeration(dev) || test_bulk_in(dev) || test_bulk_out(dev) ||
+			test_all_endpoints(dev) || test_iso_in(dev) ||
+			test_cancel(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf(PROG ": OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,610 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unicore-mx/stm32/st_usbfs.h>
+#include "fsdev_model.h"
+#include "mmio_trap.h"
+
+/* PMA_U16_STRIDE: 2 = 1x16 word, 1 = 2x16 word (same as backend) */
+#if defined(STM32F0)
+# define PMA_U16_STRIDE 1
+# define PMA_BYTES 1024
+#elif defined(STM32F1)
+# define PMA_U16_STRIDE 2
+# define PMA_BYTES 512
+#else
+# error "Model support STM32F0 and STM32F1"
+#endif
+
+/* Registers and packet memory, in one trapped window */
+#define WINDOW_BASE (USB_DEV_FS_BASE & ~0xFFF)
+#define WINDOW_SIZE 0x2000
+#define REG_START (USB_DEV_FS_BASE - WINDOW_BASE)
+#define REG_SIZE 0x60
+#define PMA_START (USB_PMA_BASE - WINDOW_BASE)
+#define PMA_SIZE (PMA_BYTES * PMA_U16_STRIDE)
+
+#define EP_COUNT 8
+
+/* Interrupt still asserted after so many usbd_poll() is a bug */
+#define ISR_LOOP_MAX 16
+
+/* BTABLE entry: ADDR_TX, COUNT_TX, ADDR_RX, COUNT_RX (16bit each) */
+#define BT_ADDR_TX 0
+#define BT_COUNT_TX 1
+#define BT_ADDR_RX 2
+#define BT_COUNT_RX 3
+
+#define COUNT_MASK 0x3FF
+
+/* Offset of register (REG is a unicore-mx/stm32/st_usbfs.h accessor) */
+#define OFF(REG) ((uint32_t) ((uintptr_t) &REG - USB_DEV_FS_BASE))
+#define HW(REG) model.reg[OFF(REG) / 4]
+#define EP(num) model.reg[num]
+
+/* EPnR bits */
+#define EP_CTR (USB_EP_CTR_RX | USB_EP_CTR_TX)
+#define EP_TOGGLE (USB_EP_DTOG_RX | USB_EP_DTOG_TX | \
+					USB_EP_STAT_RX_MASK | USB_EP_STAT_TX_MASK)
+#define EP_RW (USB_EP_TYPE_MASK | USB_EP_KIND | USB_EP_EA_MASK)
+
+/* ISTR bits derived from EPnR */
+#define ISTR_CTR_INFO (USB_ISTR_CTR | USB_ISTR_DIR | USB_ISTR_EP_ID_MASK)
+
+static struct {
+	uint16_t reg[REG_SIZE / 4];
+	uint32_t pma[PMA_SIZE / 4];
+
+	/* CPU access since last transaction, [num][0 = OUT, 1 = IN] */
+	struct {
+		bool pending;
+		int count;
+	} latency[EP_COUNT][2];
+
+	struct fsdev_model_stats stats;
+	char error[160];
+} model;
+
+static void model_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void model_error(const char *fmt, ...)
+{
+	va_list args;
+
+	if (model.error[0]) {
+		/* Only the first one */
+		return;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(model.error, sizeof(model.error), fmt, args);
+	va_end(args);
+}
+
+/**
+ * Read 16bit from PMA (in USB Local)
+ * @param[in] usb_local PMA Address (even)
+ * @return value
+ */
+static uint16_t pma_get16(uint16_t usb_local)
+{
+	uint32_t offset = usb_local * PMA_U16_STRIDE;
+	return model.pma[offset / 4] >> ((offset & 2) * 8);
+}
+
+/**
+ * Write 16bit to PMA (in USB Local)
+ * @param[in] usb_local PMA Address (even)
+ * @param[in] value Value
+ */
+static void pma_set16(uint16_t usb_local, uint16_t value)
+{
+	uint32_t offset = usb_local * PMA_U16_STRIDE;
+	unsigned shift = (offset & 2) * 8;
+	uint32_t *cell = &model.pma[offset / 4];
+
+	*cell = (*cell & ~(0xFFFFu << shift)) | ((uint32_t) value << shift);
+}
+
+static uint16_t btable_get(unsigned num, unsigned index)
+{
+	return pma_get16(HW(USB_BTABLE) + (num * 8) + (index * 2));
+}
+
+static void btable_set(unsigned num, unsigned index, uint16_t value)
+{
+	pma_set16(HW(USB_BTABLE) + (num * 8) + (index * 2), value);
+}
+
+/**
+ * Check that packet buffer is inside PMA and do not overlap BTABLE
+ * @param[in] num Endpoint number
+ * @param[in] usb_local PMA Address
+ * @param[in] len Size of buffer
+ * @return true if valid
+ */
+static bool pma_check(unsigned num, uint16_t usb_local, uint16_t len)
+{
+	uint16_t btable_end = HW(USB_BTABLE) + (EP_COUNT * 8);
+
+	if ((usb_local & 1) || (usb_local + len) > PMA_BYTES ||
+			(usb_local < btable_end && HW(USB_BTABLE) < usb_local + len)) {
+		model_error("Endpoint %u buffer 0x%x (%u bytes) invalid",
+			num, usb_local, len);
+		return false;
+	}
+
+	return true;
+}
+
+static void pma_write(uint16_t usb_local, const void *data, uint16_t len)
+{
+	const uint8_t *buf = data;
+	uint16_t i;
+
+	for (i = 0; i < len; i += 2) {
+		uint16_t value = buf[i];
+		if ((i + 1) < len) {
+			value |= buf[i + 1] << 8;
+		}
+
+		pma_set16(usb_local + i, value);
+	}
+}
+
+static void pma_read(void *data, uint16_t usb_local, uint16_t len)
+{
+	uint8_t *buf = data;
+	uint16_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = pma_get16(usb_local + (i & ~1)) >> ((i & 1) * 8);
+	}
+}
+
+/**
+ * Receive buffer size from COUNT_RX (BL_SIZE, NUM_BLOCK)
+ * @param[in] count_rx COUNT_RX value
+ * @return size in bytes
+ */
+static uint16_t rx_size(uint16_t count_rx)
+{
+	uint16_t blocks = USB_EP_COUNT_RX_NUM_BLOCK_GET(count_rx);
+
+	if (count_rx & USB_EP_COUNT_RX_BL_SIZE) {
+		return (blocks + 1) * 32;
+	}
+
+	return blocks * 2;
+}
+
+/**
+ * Test if endpoint use two packet buffers
+ * @param[in] ep EPnR value
+ */
+static bool ep_dbl_buf(uint16_t ep)
+{
+	switch (ep & USB_EP_TYPE_MASK) {
+	case USB_EP_TYPE_ISO:
+		return true;
+	case USB_EP_TYPE_BULK:
+		return !!(ep & USB_EP_DBL_BUF);
+	default:
+		return false;
+	}
+}
+
+/**
+ * Test if double buffered bulk endpoint buffer is owned by application
+ *  (DTOG == SW_BUF, both direction use the two DTOG bits)
+ * @param[in] ep EPnR value
+ */
+static bool ep_sw_buf_blocked(uint16_t ep)
+{
+	return ((ep & USB_EP_TYPE_MASK) == USB_EP_TYPE_BULK) &&
+		!(ep & USB_EP_DTOG_RX) == !(ep & USB_EP_DTOG_TX);
+}
+
+/**
+ * Test if endpoint can accept the next transaction
+ * @param[in] num Endpoint number
+ * @param[in] in true for IN, false for OUT
+ */
+static bool ep_ready(unsigned num, bool in)
+{
+	uint16_t ep = EP(num);
+	uint16_t stat = in ? USB_EP_STAT_TX_GET(ep) : USB_EP_STAT_RX_GET(ep);
+
+	if (stat != USB_EP_STAT_TX_GET(USB_EP_STAT_TX_VALID)) {
+		return false;
+	}
+
+	return !ep_dbl_buf(ep) || !ep_sw_buf_blocked(ep);
+}
+
+static void update_latency(void)
+{
+	unsigned num, in;
+
+	for (num = 0; num < EP_COUNT; num++) {
+		for (in = 0; in < 2; in++) {
+			if (model.latency[num][in].pending && ep_ready(num, in)) {
+				model.latency[num][in].pending = false;
+			}
+		}
+	}
+}
+
+static void start_latency(unsigned num, bool in)
+{
+	model.latency[num][in].pending = true;
+	model.latency[num][in].count = 0;
+	update_latency();
+}
+
+static uint16_t read_istr(void)
+{
+	uint16_t istr = HW(USB_ISTR) & ~ISTR_CTR_INFO;
+	unsigned num;
+
+	/* Lowest endpoint number has highest priority */
+	for (num = 0; num < EP_COUNT; num++) {
+		uint16_t ep = EP(num);
+
+		if (ep & EP_CTR) {
+			istr |= USB_ISTR_CTR | USB_ISTR_EP_ID(num);
+			if (ep & USB_EP_CTR_RX) {
+				istr |= USB_ISTR_DIR;
+			}
+			break;
+		}
+	}
+
+	return istr;
+}
+
+static void write_ep(unsigned num, uint16_t value)
+{
+	uint16_t old = EP(num);
+
+	EP(num) = (old & value & EP_CTR) | ((old ^ value) & EP_TOGGLE) |
+			(old & USB_EP_SETUP) | (value & EP_RW);
+}
+
+static uint32_t trap_read(uint32_t offset)
+{
+	unsigned num, in;
+
+	for (num = 0; num < EP_COUNT; num++) {
+		for (in = 0; in < 2; in++) {
+			if (model.latency[num][in].pending) {
+				model.latency[num][in].count++;
+			}
+		}
+	}
+
+	if (offset >= PMA_START && offset < PMA_START + PMA_SIZE) {
+		return model.pma[(offset - PMA_START) / 4];
+	}
+
+	if (offset < REG_START || offset >= REG_START + REG_SIZE) {
+		model_error("Access to 0x%x outside registers/PMA",
+			WINDOW_BASE + offset);
+		return 0;
+	}
+
+	offset -= REG_START;
+
+	if (offset == OFF(USB_ISTR)) {
+		return read_istr();
+	}
+
+	return model.reg[offset / 4];
+}
+
+static void trap_write(uint32_t offset, uint32_t value)
+{
+	if (offset >= PMA_START && offset < PMA_START + PMA_SIZE) {
+		model.pma[(offset - PMA_START) / 4] = value;
+		return;
+	}
+
+	if (offset < REG_START || offset >= REG_START + REG_SIZE) {
+		/* Error already recorded by read */
+		return;
+	}
+
+	offset -= REG_START;
+	value &= 0xFFFF;
+
+	if (offset < (EP_COUNT * 4)) {
+		write_ep(offset / 4, value);
+	} else if (offset == OFF(USB_ISTR)) {
+		/* Flags are write 0 to clear, the rest is read only */
+		HW(USB_ISTR) &= value | ~0xFF00;
+	} else {
+		model.reg[offset / 4] = value;
+	}
+
+	update_latency();
+}
+
+bool fsdev_model_init(void)
+{
+	memset(&model, 0, sizeof(model));
+	HW(USB_CNTR) = USB_CNTR_FRES | USB_CNTR_PDWN;
+
+	return mmio_trap_init(WINDOW_BASE, WINDOW_SIZE, trap_read, trap_write);
+}
+
+static bool irq_pending(void)
+{
+	/* Interrupt flags and their mask have the same bit position */
+	return !!(read_istr() & HW(USB_CNTR) & 0xFF00);
+}
+
+/**
+ * Call usbd_poll() while the interrupt line is asserted
+ * @param[in] dev USB Device
+ */
+static void isr(usbd_device *dev)
+{
+	unsigned i;
+
+	for (i = 0; irq_pending(); i++) {
+		if (i == ISR_LOOP_MAX) {
+			model_error("Interrupt stuck (ISTR = 0x%04x)", read_istr());
+			return;
+		}
+
+		model.stats.irqs++;
+		usbd_poll(dev, 0);
+	}
+}
+
+/**
+ * Endpoint register of @a ep_addr
+ * @param[in] ep_addr Endpoint address
+ * @param[out] num Endpoint number
+ * @return false if no endpoint register match the address
+ */
+static bool ep_lookup(uint8_t ep_addr, unsigned *num)
+{
+	*num = ep_addr & 0x0F;
+
+	if (*num >= EP_COUNT || USB_EP_EA_GET(EP(*num)) != *num) {
+		model_error("No endpoint register for address 0x%02x", ep_addr);
+		return false;
+	}
+
+	return true;
+}
+
+static enum fsdev_model_handshake nak(void)
+{
+	model.stats.naks++;
+	return FSDEV_MODEL_NAK;
+}
+
+void fsdev_model_reset(usbd_device *dev)
+{
+	unsigned num;
+
+	for (num = 0; num < EP_COUNT; num++) {
+		EP(num) = 0;
+	}
+
+	memset(model.latency, 0, sizeof(model.latency));
+	HW(USB_DADDR) = 0;
+	HW(USB_ISTR) |= USB_ISTR_RESET;
+	isr(dev);
+}
+
+enum fsdev_model_handshake fsdev_model_setup(usbd_device *dev,
+		const struct usb_setup_data *setup_data)
+{
+	uint16_t ep = EP(0);
+	uint16_t addr = btable_get(0, BT_ADDR_RX);
+	uint16_t count = btable_get(0, BT_COUNT_RX);
+
+	if ((ep & USB_EP_TYPE_MASK) != USB_EP_TYPE_CONTROL ||
+			(ep & USB_EP_STAT_RX_MASK) == USB_EP_STAT_RX_DISABLED) {
+		model_error("SETUP lost, endpoint 0 not enabled");
+		return FSDEV_MODEL_NAK;
+	}
+
+	if (rx_size(count) < 8 || !pma_check(0, addr, 8)) {
+		model_error("SETUP lost, endpoint 0 buffer invalid");
+		return FSDEV_MODEL_NAK;
+	}
+
+	pma_write(addr, setup_data, 8);
+	btable_set(0, BT_COUNT_RX, (count & ~COUNT_MASK) | 8);
+
+	/* SETUP is always accepted, DATA stage NAK till application is ready */
+	ep &= ~(EP_TOGGLE | USB_EP_CTR_TX);
+	EP(0) = ep | USB_EP_SETUP | USB_EP_CTR_RX | USB_EP_DTOG_RX |
+			USB_EP_DTOG_TX | USB_EP_STAT_RX_NAK | USB_EP_STAT_TX_NAK;
+
+	isr(dev);
+
+	return FSDEV_MODEL_ACK;
+}
+
+enum fsdev_model_handshake fsdev_model_in(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len)
+{
+	unsigned num, index = BT_ADDR_TX;
+
+	if (!ep_lookup(ep_addr, &num)) {
+		return FSDEV_MODEL_NAK;
+	}
+
+	uint16_t ep = EP(num);
+	bool dbl = ep_dbl_buf(ep);
+
+	switch (ep & USB_EP_STAT_TX_MASK) {
+	case USB_EP_STAT_TX_STALL:
+		return FSDEV_MODEL_STALL;
+	case USB_EP_STAT_TX_VALID:
+		break;
+	default:
+		return nak();
+	}
+
+	if (dbl) {
+		if (ep_sw_buf_blocked(ep)) {
+			return nak();
+		}
+
+		/* DTOG_TX select the buffer */
+		if (ep & USB_EP_DTOG_TX) {
+			index = BT_ADDR_RX;
+		}
+	}
+
+	uint16_t addr = btable_get(num, index);
+	uint16_t count = btable_get(num, index + 1) & COUNT_MASK;
+
+	if (count > max_len) {
+		model_error("IN endpoint %u packet of %u bytes (host accept %u)",
+			num, count, max_len);
+		return FSDEV_MODEL_NAK;
+	}
+
+	if (!pma_check(num, addr, count)) {
+		return FSDEV_MODEL_NAK;
+	}
+
+	pma_read(buf, addr, count);
+	*len = count;
+
+	ep = (ep | USB_EP_CTR_TX) ^ USB_EP_DTOG_TX;
+	if (!dbl) {
+		ep = (ep & ~USB_EP_STAT_TX_MASK) | USB_EP_STAT_TX_NAK;
+	}
+
+	EP(num) = ep;
+	start_latency(num, true);
+	isr(dev);
+
+	return FSDEV_MODEL_ACK;
+}
+
+enum fsdev_model_handshake fsdev_model_out(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len)
+{
+	unsigned num, index = BT_ADDR_RX;
+
+	if (!ep_lookup(ep_addr, &num)) {
+		return FSDEV_MODEL_NAK;
+	}
+
+	uint16_t ep = EP(num);
+	bool dbl = ep_dbl_buf(ep);
+
+	switch (ep & USB_EP_STAT_RX_MASK) {
+	case USB_EP_STAT_RX_STALL:
+		return FSDEV_MODEL_STALL;
+	case USB_EP_STAT_RX_VALID:
+		break;
+	default:
+		return nak();
+	}
+
+	if ((ep & USB_EP_TYPE_MASK) == USB_EP_TYPE_CONTROL &&
+			(ep & USB_EP_STATUS_OUT) && len) {
+		/* Only zero length status packet expected */
+		return FSDEV_MODEL_STALL;
+	}
+
+	if (dbl) {
+		if (ep_sw_buf_blocked(ep)) {
+			return nak();
+		}
+
+		/* DTOG_RX select the buffer */
+		if (!(ep & USB_EP_DTOG_RX)) {
+			index = BT_ADDR_TX;
+		}
+	}
+
+	uint16_t addr = btable_get(num, index);
+	uint16_t count = btable_get(num, index + 1);
+	uint16_t size = rx_size(count);
+
+	if (len > size) {
+		model_error("OUT endpoint %u packet of %u bytes (buffer %u)",
+			num, len, size);
+		return FSDEV_MODEL_NAK;
+	}
+
+	if (!pma_check(num, addr, size)) {
+		return FSDEV_MODEL_NAK;
+	}
+
+	pma_write(addr, buf, len);
+	btable_set(num, index + 1, (count & ~COUNT_MASK) | len);
+
+	ep = ((ep & ~USB_EP_SETUP) | USB_EP_CTR_RX) ^ USB_EP_DTOG_RX;
+	if (!dbl) {
+		ep = (ep & ~USB_EP_STAT_RX_MASK) | USB_EP_STAT_RX_NAK;
+	}
+
+	EP(num) = ep;
+	start_latency(num, false);
+	isr(dev);
+
+	return FSDEV_MODEL_ACK;
+}
+
+int fsdev_model_latency(uint8_t ep_addr)
+{
+	unsigned num = ep_addr & 0x0F;
+	bool in = !!(ep_addr & 0x80);
+
+	if (num >= EP_COUNT || model.latency[num][in].pending) {
+		return -1;
+	}
+
+	return model.latency[num][in].count;
+}
+
+uint16_t fsdev_model_peek(uint32_t offset)
+{
+	if (offset == OFF(USB_ISTR)) {
+		return read_istr();
+	}
+
+	return (offset < REG_SIZE) ? model.reg[offset / 4] : 0;
+}
+
+const struct fsdev_model_stats *fsdev_model_stats(void)
+{
+	model.stats.reads = mmio_trap_stats()->reads;
+	model.stats.writes = mmio_trap_stats()->writes;
+	return &model.stats;
+}
+
+const char *fsdev_model_error(void)
+{
+	return model.error[0] ? model.error : NULL;
+}
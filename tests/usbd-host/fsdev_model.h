@@ -0,0 +1,136 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Register level model of the STM32 USB FS device peripheral (FSDEV).
+ *
+ * The unmodified backend (lib/usbd/backend/usbd_stm32_fsdev.c) is run
+ *  against a window mapped at the peripheral address (registers and packet
+ *  memory). Every access of the backend is trapped (mmio_trap.h) and
+ *  executed by the model, so the EPnR semantic (write 0 to clear CTR,
+ *  toggle on write 1 for DTOG/STAT) and the BTABLE/PMA layout
+ *  (PMA_U16_STRIDE of the target) are the one of the peripheral.
+ * The model must be compiled with the same target define (STM32F0, STM32F1)
+ *  as the backend.
+ *
+ * Double buffered endpoints (bulk with EP_KIND, isochronous) use the buffer
+ *  selected by DTOG, bulk endpoint NAK when DTOG == SW_BUF.
+ *
+ * The "virtual host" API below issue tokens to the peripheral. After each
+ *  token, usbd_poll() is called while the interrupt line is asserted
+ *  (ie as ISR).
+ *
+ * Linux x86-64 only (see mmio_trap.h), the program should be linked
+ *  with -no-pie.
+ */
+
+#ifndef FSDEV_MODEL_H
+#define FSDEV_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usb/usbstd.h>
+#include <unicore-mx/usbd/usbd.h>
+
+/** Handshake of the peripheral for a token */
+enum fsdev_model_handshake {
+	FSDEV_MODEL_ACK = 0,
+	FSDEV_MODEL_NAK = 1,
+	FSDEV_MODEL_STALL = 2
+};
+
+struct fsdev_model_stats {
+	uint64_t reads; /**< Register/PMA read by CPU */
+	uint64_t writes; /**< Register/PMA write (or read-modify-write) by CPU */
+	uint64_t irqs; /**< Number of usbd_poll() (ISR) performed */
+	uint64_t naks; /**< Token answered with NAK */
+};
+
+/**
+ * Map the window and install the fault handlers.
+ * The peripheral is in reset state.
+ * @return false if the window could not be mapped
+ */
+bool fsdev_model_init(void);
+
+/**
+ * Signal bus RESET
+ * @param[in] dev USB Device
+ */
+void fsdev_model_reset(usbd_device *dev);
+
+/**
+ * Send a SETUP packet to endpoint 0
+ * @param[in] dev USB Device
+ * @param[in] setup_data Setup data
+ * @return FSDEV_MODEL_ACK, or NAK if the peripheral could not receive it
+ */
+enum fsdev_model_handshake fsdev_model_setup(usbd_device *dev,
+		const struct usb_setup_data *setup_data);
+
+/**
+ * Send a IN token to endpoint @a ep_addr
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint address (bit 7 is ignored)
+ * @param[out] buf Buffer to store the data packet
+ * @param[in] max_len Size of @a buf
+ * @param[out] len Number of bytes received (valid on FSDEV_MODEL_ACK)
+ * @return handshake
+ */
+enum fsdev_model_handshake fsdev_model_in(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len);
+
+/**
+ * Send a OUT token (with data packet) to endpoint @a ep_addr
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint address (bit 7 is ignored)
+ * @param[in] buf Data
+ * @param[in] len Length of data (packet size)
+ * @return handshake
+ */
+enum fsdev_model_handshake fsdev_model_out(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len);
+
+/**
+ * Number of CPU access (register and PMA) performed between the end of the
+ *  last transaction of @a ep_addr and the endpoint being able to accept
+ *  the next one (window where the peripheral answer NAK)
+ * @param[in] ep_addr Endpoint address (bit 7 give the direction)
+ * @return access count, -1 if the endpoint is still not ready
+ */
+int fsdev_model_latency(uint8_t ep_addr);
+
+/**
+ * Read a register without being accounted
+ * @param[in] offset Register offset (from USB_DEV_FS_BASE)
+ * @return register value
+ */
+uint16_t fsdev_model_peek(uint32_t offset);
+
+/**
+ * Get the statistics (snapshot, call again to refresh)
+ * @return statistics
+ */
+const struct fsdev_model_stats *fsdev_model_stats(void);
+
+/**
+ * Get the first error (invalid access, PMA overflow)
+ * @return description, NULL if none
+ */
+const char *fsdev_model_error(void);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_hid test using loopback backend.
+ *
+ * - Class requests (GET/SET_REPORT, GET/SET_IDLE, GET/SET_PROTOCOL) and
+ *   report descriptor
+ * - Two sensors producing at 8 kHz and a button at 100 Hz, host polling
+ *   every 1 ms: send never fail, every sensor report read is the latest
+ *   of its ID, no button event is lost, IDs are served in turn
+ * - After SET_IDLE: unchanged reports not sent, repeated every idle
+ *   duration
+ * - Output report on interrupt OUT
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/hid.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 64
+#define INTERFACE 0
+
+#define ID_SENSOR_A 1
+#define ID_BUTTON 2
+#define ID_SENSOR_B 3
+
+#define SENSOR_SIZE 9
+#define BUTTON_SIZE 2
+
+/* Simulated run, 8 sensor reports per ms */
+#define RUN_MS 10000
+#define SENSOR_PER_MS 8
+#define BUTTON_EVERY_MS 10
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x000b,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+/* Content do not matter to the class */
+static const uint8_t report_descriptor[] = {
+	0x06, 0x00, 0xFF, 0x09, 0x01, 0xA1, 0x01, 0x85, ID_SENSOR_A,
+	0x15, 0x00, 0x26, 0xFF, 0x00, 0x75, 0x08, 0x95, 0x08, 0x09, 0x01,
+	0x81, 0x02, 0x85, ID_BUTTON, 0x95, 0x01, 0x09, 0x02, 0x81, 0x02,
+	0x85, ID_SENSOR_B, 0x95, 0x08, 0x09, 0x03, 0x81, 0x02, 0xC0
+};
+
+static const usbd_hid_report reports[] = {
+	{.id = ID_SENSOR_A, .size = SENSOR_SIZE},
+	{.id = ID_BUTTON, .size = BUTTON_SIZE},
+	{.id = ID_SENSOR_B, .size = SENSOR_SIZE}
+};
+
+static uint32_t buffer[(3 + 2) * EP_SIZE / 4];
+static usbd_hid hid;
+
+static struct {
+	uint8_t type, id;
+	uint8_t data[16];
+	size_t len;
+	unsigned count;
+} last_set;
+
+static size_t get_report(usbd_hid *_hid, uint8_t type, uint8_t id,
+				void *buf, size_t len)
+{
+	(void) _hid;
+
+	if (type != USB_REQ_HID_REPORT_TYPE_FEATURE || len < 3) {
+		return 0;
+	}
+
+	((uint8_t *) buf)[0] = id;
+	((uint8_t *) buf)[1] = 0xAB;
+	((uint8_t *) buf)[2] = 0xCD;
+	return 3;
+}
+
+static void set_report(usbd_hid *_hid, uint8_t type, uint8_t id,
+				const void *data, size_t len)
+{
+	(void) _hid;
+
+	last_set.type = type;
+	last_set.id = id;
+	last_set.len = len;
+	memcpy(last_set.data, data, len);
+	last_set.count++;
+}
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_INTERRUPT, EP_SIZE, 1, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_INTERRUPT, EP_SIZE, 1, USBD_EP_NONE);
+	usbd_hid_start(&hid);
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_hid_setup_ep0(&hid, setup_data)) {
+		usbd_ep0_setup(dev, setup_data);
+	}
+}
+
+static enum usbd_loopback_handshake class_request(usbd_device *dev,
+		uint8_t dir, uint8_t request, uint16_t value, void *buf,
+		uint16_t length, uint16_t *len)
+{
+	const struct usb_setup_data setup_data = {
+		.bmRequestType = dir | USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = INTERFACE,
+		.wLength = length
+	};
+
+	return usbd_loopback_control(dev, &setup_data, buf, len);
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(hid.running);
+	return 0;
+}
+
+static int test_requests(usbd_device *dev)
+{
+	const struct usb_setup_data get_report_descriptor = {
+		.bmRequestType = USB_REQ_TYPE_IN | USB_REQ_TYPE_STANDARD |
+				USB_REQ_TYPE_INTERFACE,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = USB_DT_REPORT << 8,
+		.wIndex = INTERFACE,
+		.wLength = 255
+	};
+
+	uint8_t buf[64], button[BUTTON_SIZE] = {ID_BUTTON, 0x01};
+	uint16_t len;
+
+	CHECK(usbd_loopback_control(dev, &get_report_descriptor, buf, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == sizeof(report_descriptor) &&
+			!memcmp(buf, report_descriptor, len));
+
+	/* Protocol */
+	CHECK(class_request(dev, USB_REQ_TYPE_IN, USB_REQ_HID_GET_PROTOCOL, 0,
+			buf, 1, &len) == USBD_LOOPBACK_ACK);
+	CHECK(len == 1 && buf[0] == USB_REQ_HID_PROTOCOL_REPORT);
+	CHECK(class_request(dev, 0, USB_REQ_HID_SET_PROTOCOL,
+			USB_REQ_HID_PROTOCOL_BOOT, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+	CHECK(hid.protocol == USB_REQ_HID_PROTOCOL_BOOT);
+	CHECK(class_request(dev, 0, USB_REQ_HID_SET_PROTOCOL,
+			USB_REQ_HID_PROTOCOL_REPORT, NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+
+	/* Feature report: application */
+	CHECK(class_request(dev, USB_REQ_TYPE_IN, USB_REQ_HID_GET_REPORT,
+			(USB_REQ_HID_REPORT_TYPE_FEATURE << 8) | 4, buf, 8, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 3 && buf[0] == 4 && buf[1] == 0xAB && buf[2] == 0xCD);
+
+	buf[0] = 4;
+	buf[1] = 0x55;
+	CHECK(class_request(dev, 0, USB_REQ_HID_SET_REPORT,
+			(USB_REQ_HID_REPORT_TYPE_FEATURE << 8) | 4, buf, 2, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(last_set.count == 1 && last_set.type ==
+			USB_REQ_HID_REPORT_TYPE_FEATURE && last_set.id == 4 &&
+			last_set.len == 2 && last_set.data[1] == 0x55);
+
+	/* Input report: nothing sent yet, nothing to return */
+	CHECK(class_request(dev, USB_REQ_TYPE_IN, USB_REQ_HID_GET_REPORT,
+			(USB_REQ_HID_REPORT_TYPE_INPUT << 8) | ID_BUTTON, buf, 8, &len) ==
+			USBD_LOOPBACK_STALL);
+
+	/* Last queued one */
+	CHECK(usbd_hid_send(&hid, button, sizeof(button)));
+	CHECK(class_request(dev, USB_REQ_TYPE_IN, USB_REQ_HID_GET_REPORT,
+			(USB_REQ_HID_REPORT_TYPE_INPUT << 8) | ID_BUTTON, buf, 8, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == BUTTON_SIZE && !memcmp(buf, button, len));
+	CHECK(usbd_loopback_in(dev, EP_IN, buf, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == BUTTON_SIZE && !memcmp(buf, button, len));
+
+	/* Unknown ID */
+	buf[0] = 9;
+	CHECK(!usbd_hid_send(&hid, buf, 2));
+
+	/* Output report on interrupt OUT */
+	buf[0] = 5;
+	buf[1] = 0x77;
+	CHECK(usbd_loopback_out(dev, EP_OUT, buf, 2) == USBD_LOOPBACK_ACK);
+	CHECK(last_set.count == 2 && last_set.type ==
+			USB_REQ_HID_REPORT_TYPE_OUTPUT && last_set.id == 5 &&
+			last_set.len == 2);
+
+	return 0;
+}
+
+static void sensor_report(uint8_t *report, uint8_t id, uint32_t seq,
+				uint32_t time_us)
+{
+	report[0] = id;
+	memcpy(report + 1, &seq, 4);
+	memcpy(report + 5, &time_us, 4);
+}
+
+static int test_queue(usbd_device *dev)
+{
+	uint32_t seq[4] = {0}, received_seq[4] = {0}, received[4] = {0};
+	uint32_t buttons = 0, age_max = 0, polls = 0;
+	uint8_t report[SENSOR_SIZE], in[EP_SIZE];
+	usbd_hid_stats before, stats;
+	unsigned ms, i;
+	uint8_t last_id = 0;
+
+	usbd_hid_get_stats(&hid, &before);
+
+	for (ms = 0; ms < RUN_MS; ms++) {
+		uint32_t now_us = ms * 1000;
+		uint16_t len;
+
+		/* Sensors at 8 kHz, button at 100 Hz */
+		for (i = 0; i < SENSOR_PER_MS; i++) {
+			uint32_t t = now_us + i * (1000 / SENSOR_PER_MS);
+
+			sensor_report(report, ID_SENSOR_A, ++seq[ID_SENSOR_A], t);
+			CHECK(usbd_hid_send(&hid, report, SENSOR_SIZE));
+			sensor_report(report, ID_SENSOR_B, ++seq[ID_SENSOR_B], t);
+			CHECK(usbd_hid_send(&hid, report, SENSOR_SIZE));
+		}
+
+		if (!(ms % BUTTON_EVERY_MS)) {
+			report[0] = ID_BUTTON;
+			report[1] = ++seq[ID_BUTTON];
+			CHECK(usbd_hid_send(&hid, report, BUTTON_SIZE));
+		}
+
+		/* Host poll (1 ms interval) */
+		if (usbd_loopback_in(dev, EP_IN, in, EP_SIZE, &len) ==
+				USBD_LOOPBACK_ACK) {
+			uint8_t id = in[0];
+			polls++;
+
+			CHECK(id == ID_SENSOR_A || id == ID_BUTTON || id == ID_SENSOR_B);
+
+			if (id == ID_BUTTON) {
+				/* Every event */
+				CHECK(len == BUTTON_SIZE && in[1] == (uint8_t) (buttons + 1));
+				buttons++;
+			} else {
+				uint32_t s, t;
+
+				CHECK(len == SENSOR_SIZE);
+				memcpy(&s, in + 1, 4);
+				memcpy(&t, in + 5, 4);
+
+				/* Latest of the ID, never older than the previous */
+				CHECK(s > received_seq[id]);
+				received_seq[id] = s;
+				if (now_us + 1000 - t > age_max) {
+					age_max = now_us + 1000 - t;
+				}
+
+				/* Sensors served in turn */
+				CHECK(id != last_id);
+				last_id = id;
+			}
+
+			received[id]++;
+		}
+
+		usbd_poll(dev, 1000);
+		usbd_hid_poll(&hid, 1000);
+	}
+
+	usbd_hid_get_stats(&hid, &stats);
+	CHECK(stats.errors == 0);
+	CHECK(buttons == seq[ID_BUTTON]);
+	CHECK(stats.merged - before.merged > 0);
+	CHECK(polls == RUN_MS);
+
+	printf("hid-test: %u reports produced at 8 kHz x2 + 100 Hz, %"PRIu32
+		" sent (%"PRIu32" + %"PRIu32" sensor, %"PRIu32" button), "
+		"%"PRIu32" merged, oldest sensor report %"PRIu32" us\n",
+		(unsigned) (seq[ID_SENSOR_A] + seq[ID_SENSOR_B] + seq[ID_BUTTON]),
+		stats.sent - before.sent, received[ID_SENSOR_A],
+		received[ID_SENSOR_B], received[ID_BUTTON],
+		stats.merged - before.merged, age_max);
+
+	return 0;
+}
+
+static int test_idle(usbd_device *dev)
+{
+	uint8_t report[BUTTON_SIZE] = {ID_BUTTON, 0x42}, in[EP_SIZE];
+	usbd_hid_stats stats;
+	unsigned ms, last = 0, repeats = 0;
+	uint16_t len;
+
+	/* Drain */
+	while (usbd_loopback_in(dev, EP_IN, in, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+
+	/* Infinite idle for all: only changes are reported */
+	CHECK(class_request(dev, 0, USB_REQ_HID_SET_IDLE, 0, NULL, 0, NULL) ==
+			USBD_LOOPBACK_ACK);
+
+	CHECK(usbd_hid_send(&hid, report, sizeof(report)));
+	CHECK(usbd_loopback_in(dev, EP_IN, in, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(usbd_hid_send(&hid, report, sizeof(report)));
+	CHECK(usbd_loopback_in(dev, EP_IN, in, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	usbd_hid_get_stats(&hid, &stats);
+	CHECK(stats.unchanged == 1);
+
+	/* Button: 8 ms */
+	CHECK(class_request(dev, 0, USB_REQ_HID_SET_IDLE, (2 << 8) | ID_BUTTON,
+			NULL, 0, NULL) == USBD_LOOPBACK_ACK);
+	CHECK(class_request(dev, USB_REQ_TYPE_IN, USB_REQ_HID_GET_IDLE,
+			ID_BUTTON, in, 1, &len) == USBD_LOOPBACK_ACK);
+	CHECK(len == 1 && in[0] == 2);
+
+	/* ID 0: rate set for all reports */
+	CHECK(class_request(dev, USB_REQ_TYPE_IN, USB_REQ_HID_GET_IDLE,
+			0, in, 1, &len) == USBD_LOOPBACK_ACK);
+	CHECK(len == 1 && in[0] == 0);
+
+	for (ms = 0; ms < 80; ms++) {
+		if (usbd_loopback_in(dev, EP_IN, in, EP_SIZE, &len) ==
+				USBD_LOOPBACK_ACK) {
+			CHECK(len == BUTTON_SIZE && !memcmp(in, report, len));
+			CHECK(!repeats || ms - last == 8);
+			last = ms;
+			repeats++;
+		}
+
+		usbd_poll(dev, 1000);
+		usbd_hid_poll(&hid, 1000);
+	}
+
+	CHECK(repeats == 9);
+	return 0;
+}
+
+int main(void)
+{
+	const usbd_hid_config config = {
+		.ep_in = EP_IN,
+		.ep_out = EP_OUT,
+		.ep_size = EP_SIZE,
+		.interval = 1,
+		.interface = INTERFACE,
+		.reports = reports,
+		.report_count = 3,
+		.buffer = buffer,
+		.report_descriptor = report_descriptor,
+		.report_descriptor_len = sizeof(report_descriptor),
+		.get_report = get_report,
+		.set_report = set_report
+	};
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+
+	usbd_hid_init(&hid, dev, &config);
+
+	if (configure(dev) || test_requests(dev) || test_queue(dev) ||
+			test_idle(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("hid-test: OK\n");
+	return EXIT_SUCCESS;
+}
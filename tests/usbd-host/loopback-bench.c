@@ -0,0 +1,407 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Throughput benchmark of the usbd stack using the loopback backend.
+ *
+ * The device has a vendor interface with a bulk IN (0x81) and bulk OUT (0x01)
+ *  endpoint. Device keep @a depth transfers queued on each endpoint and
+ *  re-submit on completion. The virtual host enumerate the device and then
+ *  issue IN and OUT token alternatively till @a count transfers completed
+ *  on each endpoint.
+ *
+ * Reported: URB/s, bytes/s and submit->callback latency.
+ *
+ * Usage: loopback-bench [-s packet-size] [-l transfer-length]
+ *                       [-n nak-permille] [-c count] [-d depth]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "usbd_loopback.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define MAX_DEPTH 16
+#define MAX_LENGTH 65536
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static struct {
+	uint16_t packet_size;
+	size_t length;
+	unsigned nak_permille;
+	unsigned count;
+	unsigned depth;
+} opt = {
+	.packet_size = 64,
+	.length = 4096,
+	.nak_permille = 0,
+	.count = 100000,
+	.depth = 2
+};
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = USB_CLASS_VENDOR,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0xcafe,
+	.bcdDevice = 0x0001,
+	.iManufacturer = 0,
+	.iProduct = 0,
+	.iSerialNumber = 0,
+	.bNumConfigurations = 1
+};
+
+static struct {
+	struct usb_config_descriptor config;
+	struct usb_interface_descriptor iface;
+	struct usb_endpoint_descriptor ep[2];
+} __attribute__((packed)) config_desc = {
+	.config = {
+		.bLength = USB_DT_CONFIGURATION_SIZE,
+		.bDescriptorType = USB_DT_CONFIGURATION,
+		.wTotalLength = sizeof(config_desc),
+		.bNumInterfaces = 1,
+		.bConfigurationValue = 1,
+		.iConfiguration = 0,
+		.bmAttributes = 0x80,
+		.bMaxPower = 0x32
+	},
+	.iface = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = 0,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_CLASS_VENDOR,
+		.bInterfaceSubClass = 0,
+		.bInterfaceProtocol = 0,
+		.iInterface = 0
+	},
+	.ep = {{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = EP_IN,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = 64,
+		.bInterval = 0
+	}, {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = EP_OUT,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = 64,
+		.bInterval = 0
+	}}
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc.config,
+		.string = NULL
+	}}
+};
+
+/** Transfer in flight */
+struct slot {
+	double submit_ns;
+	uint8_t buffer[MAX_LENGTH];
+};
+
+static struct {
+	struct slot slot[MAX_DEPTH];
+	unsigned submitted;
+	unsigned completed;
+	unsigned failed;
+} ep_in, ep_out;
+
+static struct {
+	double sum_ns;
+	double min_ns;
+	double max_ns;
+	unsigned count;
+} latency = {
+	.min_ns = 1e30
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void transfer_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id);
+
+static void submit(usbd_device *dev, uint8_t ep_addr, struct slot *slot)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = opt.packet_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = slot->buffer,
+		.length = opt.length,
+		.flags = USBD_FLAG_SHORT_PACKET,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = transfer_callback,
+		.user_data = slot
+	};
+
+	if (ep_addr & 0x80) {
+		ep_in.submitted++;
+	} else {
+		ep_out.submitted++;
+	}
+
+	slot->submit_ns = now_ns();
+	usbd_transfer_submit(dev, &transfer);
+}
+
+static void transfer_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	(void) urb_id;
+
+	struct slot *slot = transfer->user_data;
+	bool in = !!(transfer->ep_addr & 0x80);
+	double lat = now_ns() - slot->submit_ns;
+
+	if (in) {
+		ep_in.completed++;
+	} else {
+		ep_out.completed++;
+	}
+
+	if (status != USBD_SUCCESS) {
+		if (in) {
+			ep_in.failed++;
+		} else {
+			ep_out.failed++;
+		}
+		return;
+	}
+
+	latency.sum_ns += lat;
+	latency.count++;
+	if (lat < latency.min_ns) {
+		latency.min_ns = lat;
+	}
+	if (lat > latency.max_ns) {
+		latency.max_ns = lat;
+	}
+
+	if ((in ? ep_in.submitted : ep_out.submitted) < opt.count) {
+		submit(dev, transfer->ep_addr, slot);
+	}
+}
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	unsigned i;
+
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, opt.packet_size,
+		USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, opt.packet_size,
+		USBD_INTERVAL_NA, USBD_EP_NONE);
+
+	for (i = 0; i < opt.depth && i < opt.count; i++) {
+		submit(dev, EP_IN, &ep_in.slot[i]);
+		submit(dev, EP_OUT, &ep_out.slot[i]);
+	}
+}
+
+static int enumerate(usbd_device *dev)
+{
+	const struct usb_setup_data set_address = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_ADDRESS,
+		.wValue = 5,
+		.wIndex = 0,
+		.wLength = 0
+	};
+
+	const struct usb_setup_data get_descriptor = {
+		.bmRequestType = 0x80 | USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_GET_DESCRIPTOR,
+		.wValue = USB_DT_CONFIGURATION << 8,
+		.wIndex = 0,
+		.wLength = sizeof(config_desc)
+	};
+
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1,
+		.wIndex = 0,
+		.wLength = 0
+	};
+
+	const struct usbd_loopback_step script[] = {
+		{.token = USBD_LOOPBACK_STEP_RESET},
+		{.token = USBD_LOOPBACK_STEP_POLL, .repeat = 10},
+		{.token = USBD_LOOPBACK_STEP_CONTROL, .data = (void *) &set_address},
+		{.token = USBD_LOOPBACK_STEP_CONTROL, .data = (void *) &get_descriptor},
+		{.token = USBD_LOOPBACK_STEP_CONTROL,
+			.data = (void *) &set_configuration}
+	};
+
+	unsigned count = sizeof(script) / sizeof(script[0]);
+	unsigned failed = usbd_loopback_run(dev, script, count);
+	if (failed != count) {
+		fprintf(stderr, "enumeration failed at step %u\n", failed);
+		return -1;
+	}
+
+	if (usbd_get_address(dev) != 5) {
+		fprintf(stderr, "SET_ADDRESS not applied\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s packet-size] [-l transfer-length] "
+		"[-n nak-permille] [-c count] [-d depth]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	static uint8_t packet[1024];
+	int c;
+
+	while ((c = getopt(argc, argv, "s:l:n:c:d:")) != -1) {
+		switch (c) {
+		case 's':
+			opt.packet_size = strtoul(optarg, NULL, 0);
+		break;
+		case 'l':
+			opt.length = strtoul(optarg, NULL, 0);
+		break;
+		case 'n':
+			opt.nak_permille = strtoul(optarg, NULL, 0);
+		break;
+		case 'c':
+			opt.count = strtoul(optarg, NULL, 0);
+		break;
+		case 'd':
+			opt.depth = strtoul(optarg, NULL, 0);
+		break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!opt.packet_size || opt.packet_size > sizeof(packet) ||
+		opt.length > MAX_LENGTH || !opt.depth || opt.depth > MAX_DEPTH ||
+		opt.nak_permille >= 1000) {
+		usage(argv[0]);
+	}
+
+	config_desc.ep[0].wMaxPacketSize = opt.packet_size;
+	config_desc.ep[1].wMaxPacketSize = opt.packet_size;
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_set_config_callback(dev, set_config);
+
+	if (enumerate(dev) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	/* Only data endpoint see NAK injection (enumeration is already done) */
+	usbd_loopback_nak_rate(dev, opt.nak_permille, 0x1234);
+	const struct usbd_loopback_stats *stats = usbd_loopback_stats(dev);
+	uint64_t bytes_start = stats->bytes_in + stats->bytes_out;
+	uint64_t nak_start = stats->nak;
+
+	/* Host side position of OUT transfer (to send the short packet) */
+	size_t out_pos = 0;
+	double start = now_ns();
+	unsigned frame_tokens = 0;
+
+	while (ep_in.completed < opt.count || ep_out.completed < opt.count) {
+		uint16_t len;
+
+		if (ep_in.completed < opt.count) {
+			usbd_loopback_in(dev, EP_IN, packet, opt.packet_size, &len);
+		}
+
+		if (ep_out.completed < opt.count) {
+			size_t rem = opt.length - out_pos;
+			len = MIN(rem, opt.packet_size);
+			if (usbd_loopback_out(dev, EP_OUT, packet, len) ==
+					USBD_LOOPBACK_ACK) {
+				out_pos += len;
+				if (len < opt.packet_size || out_pos >= opt.length) {
+					/* End of transfer */
+					out_pos = 0;
+				}
+			}
+		}
+
+		/* A full speed frame has room for ~19 bulk packet of 64 bytes */
+		if (++frame_tokens >= 16) {
+			frame_tokens = 0;
+			usbd_poll(dev, 0);
+		}
+	}
+
+	double elapsed_s = (now_ns() - start) / 1e9;
+	uint64_t bytes = stats->bytes_in + stats->bytes_out - bytes_start;
+	unsigned urbs = ep_in.completed + ep_out.completed;
+
+	if (ep_in.failed || ep_out.failed) {
+		fprintf(stderr, "%u IN and %u OUT transfer failed\n",
+			ep_in.failed, ep_out.failed);
+		return EXIT_FAILURE;
+	}
+
+	printf("packet=%-4u length=%-6zu nak=%4.1f%% depth=%-2u  "
+		"%9.0f URB/s %8.2f MB/s  latency avg %7.2f us "
+		"min %7.2f us max %8.2f us  (%llu NAK)\n",
+		opt.packet_size, opt.length, opt.nak_permille / 10.0, opt.depth,
+		urbs / elapsed_s, bytes / elapsed_s / 1e6,
+		latency.sum_ns / latency.count / 1e3,
+		latency.min_ns / 1e3, latency.max_ns / 1e3,
+		(unsigned long long) (stats->nak - nak_start));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,432 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_midi test using loopback backend.
+ *
+ * - Dense controller stream: events batched in whole packets, none wait
+ *   more than the latency cap (packets sent compared to one per event)
+ * - Sparse event: sent after latency_frames SOF, or at next SOF on flush
+ * - SysEx streamed through a TX ring smaller than the message
+ * - RX: events unpacked per cable, a full cable ring hold the unpack
+ *   and the host get NAK, nothing lost
+ * - Stop on bus reset
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/midi.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 64
+
+#define CABLES 2
+#define TX_SIZE 256
+#define RX_SLOTS 2
+#define RX_RING_SIZE 32
+#define LATENCY_FRAMES 2
+
+/* Dense stream: controller changes per millisecond */
+#define CC_PER_MS 20
+#define CC_MS 200
+
+#define SYSEX_LEN 1000
+#define RX_EVENTS 600
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x000d,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 2,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static uint32_t tx_ring[TX_SIZE / 4];
+static uint32_t rx_slots[RX_SLOTS * EP_SIZE / 4];
+static uint8_t rx_rings[CABLES * RX_RING_SIZE];
+
+static usbd_midi midi;
+
+/* Simulated millisecond */
+static unsigned frame;
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+
+	usbd_midi_start(&midi);
+}
+
+static void sof_callback(usbd_device *dev)
+{
+	(void) dev;
+
+	usbd_midi_sof(&midi);
+}
+
+static void poll(usbd_device *dev, unsigned count)
+{
+	while (count--) {
+		usbd_poll(dev, 1000);
+		frame++;
+	}
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(midi.running);
+	return 0;
+}
+
+/**
+ * Read IN packets till NAK
+ * @param[in] dev USB Device
+ * @param[out] buf Buffer
+ * @param[out] packets Number of packets
+ * @return number of bytes received
+ */
+static size_t host_read(usbd_device *dev, uint8_t *buf, unsigned *packets)
+{
+	size_t pos = 0;
+	uint16_t len;
+
+	*packets = 0;
+	while (usbd_loopback_in(dev, EP_IN, buf + pos, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK) {
+		pos += len;
+		(*packets)++;
+	}
+
+	return pos;
+}
+
+static int test_dense(usbd_device *dev)
+{
+	static uint8_t received[CC_PER_MS * 4 * 4];
+	unsigned events = 0, packets = 0, max_latency = 0, seq = 0;
+	usbd_midi_stats stats;
+	unsigned ms, i, n;
+	size_t len;
+
+	for (ms = 0; ms < CC_MS + LATENCY_FRAMES + 1; ms++) {
+		for (i = 0; ms < CC_MS && i < CC_PER_MS; i++) {
+			/* Controller number: sequence, value: frame of send */
+			const uint8_t cc[3] = {0xB0, seq++ & 0x7F, frame & 0x7F};
+			CHECK(usbd_midi_send(&midi, 0, cc, sizeof(cc)));
+		}
+
+		poll(dev, 1);
+		len = host_read(dev, received, &n);
+		packets += n;
+
+		for (i = 0; i < len; i += 4) {
+			unsigned latency = (frame - received[i + 3]) & 0x7F;
+			CHECK(received[i] == ((0 << 4) | 0xB));
+			CHECK(received[i + 2] == (events & 0x7F));
+			max_latency = latency > max_latency ? latency : max_latency;
+			events++;
+		}
+	}
+
+	usbd_midi_get_stats(&midi, &stats);
+	CHECK(events == CC_PER_MS * CC_MS && stats.tx_events == events);
+	CHECK(stats.tx_dropped == 0 && stats.tx_packets == packets);
+
+	/* Almost full packets, none waited more than the cap (+ 1 SOF) */
+	CHECK(packets * 15 < events);
+	CHECK(max_latency <= LATENCY_FRAMES + 1);
+
+	printf("midi-test: %u events in %u packets (%.1f events/packet, "
+		"%u partial), latency <= %u ms\n", events, packets,
+		(double) events / packets, (unsigned) stats.tx_flushes, max_latency);
+
+	return 0;
+}
+
+static int test_sparse(usbd_device *dev)
+{
+	const uint8_t note_on[3] = {0x91, 60, 100};
+	const uint8_t clock[1] = {0xF8};
+	uint8_t received[EP_SIZE];
+	unsigned packets;
+
+	/* Sent after LATENCY_FRAMES SOF */
+	CHECK(usbd_midi_send(&midi, 1, note_on, sizeof(note_on)));
+	poll(dev, LATENCY_FRAMES - 1);
+	CHECK(host_read(dev, received, &packets) == 0);
+	poll(dev, 1);
+	CHECK(host_read(dev, received, &packets) == 4 && packets == 1);
+	CHECK(received[0] == 0x19 && !memcmp(&received[1], note_on, 3));
+
+	/* Flush: next SOF */
+	CHECK(usbd_midi_send(&midi, 0, clock, sizeof(clock)));
+	usbd_midi_flush(&midi);
+	poll(dev, 1);
+	CHECK(host_read(dev, received, &packets) == 4 && packets == 1);
+	CHECK(received[0] == 0x0F && received[1] == 0xF8 &&
+			received[2] == 0 && received[3] == 0);
+
+	/* Invalid messages */
+	CHECK(!usbd_midi_send(&midi, 0, note_on, 2));
+	CHECK(!usbd_midi_send(&midi, 0, (const uint8_t *) "\xF0\x7E", 2));
+	CHECK(!usbd_midi_send(&midi, 0, (const uint8_t *) "\x3C\x40", 2));
+	CHECK(!usbd_midi_send(&midi, CABLES, clock, sizeof(clock)));
+	CHECK(!usbd_midi_send(&midi, 0, NULL, 0));
+
+	return 0;
+}
+
+static int test_sysex(usbd_device *dev)
+{
+	static uint8_t message[SYSEX_LEN], received[SYSEX_LEN];
+	uint8_t packet[TX_SIZE];
+	size_t pos = 0, out = 0, len, i;
+	unsigned packets, refused = 0;
+	bool end = false;
+
+	message[0] = 0xF0;
+	for (i = 1; i < SYSEX_LEN - 1; i++) {
+		message[i] = (i * 7) & 0x7F;
+	}
+	message[SYSEX_LEN - 1] = 0xF7;
+
+	/* Message is 5 times the TX ring: the rest is given again on
+	 *  every frame, accepted as the ring drain */
+	while (!end) {
+		if (pos < SYSEX_LEN) {
+			size_t n = usbd_midi_send_sysex(&midi, 1, message + pos,
+							SYSEX_LEN - pos);
+			CHECK(n < SYSEX_LEN - pos || pos + n == SYSEX_LEN);
+			pos += n;
+			refused += pos < SYSEX_LEN;
+		}
+
+		poll(dev, 1);
+		len = host_read(dev, packet, &packets);
+
+		for (i = 0; i < len; i += 4) {
+			uint8_t cin = packet[i] & 0xF;
+			uint8_t n = cin == 0x4 ? 3 : cin - 0x4;
+
+			CHECK((packet[i] >> 4) == 1);
+			CHECK(cin >= 0x4 && cin <= 0x7);
+			CHECK(out + n <= SYSEX_LEN);
+			memcpy(received + out, &packet[i + 1], n);
+			out += n;
+			end = cin != 0x4;
+		}
+	}
+
+	CHECK(out == SYSEX_LEN && !memcmp(received, message, SYSEX_LEN));
+	CHECK(midi.tx.sysex[1].len == 0 && refused > 0);
+
+	/* Short messages: 1, 2 and 3 bytes end events */
+	CHECK(usbd_midi_send_sysex(&midi, 0, (const uint8_t *) "\xF0\xF7", 2) == 2);
+	CHECK(usbd_midi_send_sysex(&midi, 0, (const uint8_t *) "\xF0\x01", 2) == 2);
+	CHECK(usbd_midi_send_sysex(&midi, 0, (const uint8_t *) "\xF7", 1) == 1);
+	CHECK(usbd_midi_send_sysex(&midi, 0,
+			(const uint8_t *) "\xF0\x01\x02\x03\xF7", 5) == 5);
+	usbd_midi_flush(&midi);
+	poll(dev, 1);
+	CHECK(host_read(dev, packet, &packets) == 16 && packets == 1);
+	CHECK(!memcmp(packet, "\x06\xF0\xF7\x00" "\x07\xF0\x01\xF7"
+			"\x04\xF0\x01\x02" "\x06\x03\xF7\x00", 16));
+
+	return 0;
+}
+
+static int test_rx(usbd_device *dev)
+{
+	static uint8_t expect[CABLES][RX_EVENTS * 3];
+	static uint8_t received[CABLES][RX_EVENTS * 3];
+	size_t expect_len[CABLES] = {0, 0}, pos[CABLES] = {0, 0};
+	uint8_t packet[EP_SIZE];
+	unsigned sent = 0, nak = 0, i;
+	usbd_midi_stats stats;
+
+	while (sent < RX_EVENTS || pos[0] < expect_len[0] ||
+			pos[1] < expect_len[1]) {
+		if (sent < RX_EVENTS) {
+			/* One packet: note on cable 0, controller on cable 1,
+			 *  a reserved CIN, active sensing on cable 1 */
+			size_t len = 0;
+			unsigned count = 0;
+
+			while (len < EP_SIZE && sent + count < RX_EVENTS) {
+				uint8_t *ev = packet + len;
+				unsigned n = sent + count;
+
+				switch (n % 4) {
+				case 0:
+					ev[0] = 0x09;
+					ev[1] = 0x90;
+					ev[2] = n & 0x7F;
+					ev[3] = 0x40;
+				break;
+				case 1:
+				case 2:
+					ev[0] = 0x1B;
+					ev[1] = 0xB2;
+					ev[2] = 7;
+					ev[3] = n & 0x7F;
+				break;
+				default:
+					ev[0] = (n / 4) & 1 ? 0x1F : 0x01;
+					ev[1] = 0xFE;
+					ev[2] = 0;
+					ev[3] = 0;
+				break;
+				}
+
+				len += 4;
+				count++;
+			}
+
+			if (usbd_loopback_out(dev, EP_OUT, packet, len) ==
+					USBD_LOOPBACK_ACK) {
+				for (i = 0; i < len; i += 4) {
+					uint8_t cable = packet[i] >> 4;
+					uint8_t n = (packet[i] & 0xF) == 0xF ? 1 : 3;
+
+					if ((packet[i] & 0xF) == 0x1) {
+						continue;
+					}
+					memcpy(&expect[cable][expect_len[cable]],
+						&packet[i + 1], n);
+					expect_len[cable] += n;
+				}
+				sent += count;
+			} else {
+				nak++;
+			}
+		}
+
+		/* Cable 0 read fast, cable 1 slowly */
+		pos[0] += usbd_midi_read(&midi, 0, received[0] + pos[0],
+						sizeof(received[0]) - pos[0]);
+		pos[1] += usbd_midi_read(&midi, 1, received[1] + pos[1], 5);
+		poll(dev, 1);
+	}
+
+	for (i = 0; i < CABLES; i++) {
+		CHECK(pos[i] == expect_len[i]);
+		CHECK(!memcmp(received[i], expect[i], pos[i]));
+	}
+
+	usbd_midi_get_stats(&midi, &stats);
+	CHECK(stats.rx_events == RX_EVENTS - RX_EVENTS / 8);
+	CHECK(stats.rx_invalid == RX_EVENTS / 8);
+	CHECK(stats.rx_waits > 0 && nak > 0);
+
+	printf("midi-test: %u events received, %u invalid, %u waits, %u NAK\n",
+		(unsigned) stats.rx_events, (unsigned) stats.rx_invalid,
+		(unsigned) stats.rx_waits, nak);
+
+	return 0;
+}
+
+static int test_reset(usbd_device *dev)
+{
+	const uint8_t note_off[3] = {0x80, 60, 0};
+	uint8_t received[EP_SIZE];
+	uint16_t len;
+
+	CHECK(usbd_midi_send(&midi, 0, note_off, sizeof(note_off)));
+	usbd_loopback_reset(dev);
+	poll(dev, LATENCY_FRAMES);
+
+	CHECK(!midi.running);
+	CHECK(!usbd_midi_send(&midi, 0, note_off, sizeof(note_off)));
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	return 0;
+}
+
+int main(void)
+{
+	const usbd_midi_config config = {
+		.ep_in = EP_IN,
+		.ep_out = EP_OUT,
+		.ep_size = EP_SIZE,
+		.cables = CABLES,
+		.tx_buffer = tx_ring,
+		.tx_size = TX_SIZE,
+		.latency_frames = LATENCY_FRAMES,
+		.rx_buffer = rx_slots,
+		.rx_slots = RX_SLOTS,
+		.rx_ring = rx_rings,
+		.rx_ring_size = RX_RING_SIZE
+	};
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_set_config_callback(dev, set_config);
+	usbd_register_sof_callback(dev, sof_callback);
+
+	usbd_midi_init(&midi, dev, &config);
+
+	if (configure(dev) || test_dense(dev) || test_sparse(dev) ||
+			test_sysex(dev) || test_rx(dev) || test_reset(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("midi-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include "mmio_trap.h"
+
+#if !defined(__x86_64__) || !defined(__linux__)
+# error "MMIO trap need Linux x86-64"
+#endif
+
+#define EFLAGS_TF (1 << 8)
+#define PF_ERR_WRITE (1 << 1)
+
+static struct {
+	volatile uint32_t *window;
+	uintptr_t base;
+	size_t size;
+	mmio_trap_read read;
+	mmio_trap_write write;
+
+	/* Access being single stepped */
+	uint32_t pending_offset;
+	bool pending_write;
+
+	struct mmio_trap_stats stats;
+} trap;
+
+static void on_segv(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	uintptr_t offset = (uintptr_t) info->si_addr - trap.base;
+
+	(void) sig;
+
+	if (offset >= trap.size) {
+		/* Real fault, crash on return */
+		signal(SIGSEGV, SIG_DFL);
+		return;
+	}
+
+	trap.pending_offset = offset & ~3;
+	trap.pending_write = !!(uc->uc_mcontext.gregs[REG_ERR] & PF_ERR_WRITE);
+
+	/* Let the instruction execute on the current value */
+	mprotect((void *) trap.window, trap.size, PROT_READ | PROT_WRITE);
+	trap.window[trap.pending_offset / 4] = trap.read(trap.pending_offset);
+	uc->uc_mcontext.gregs[REG_EFL] |= EFLAGS_TF;
+}
+
+static void on_trap(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+
+	(void) sig;
+	(void) info;
+
+	if (trap.pending_write) {
+		trap.stats.writes++;
+		trap.write(trap.pending_offset, trap.window[trap.pending_offset / 4]);
+	} else {
+		trap.stats.reads++;
+	}
+
+	mprotect((void *) trap.window, trap.size, PROT_NONE);
+	uc->uc_mcontext.gregs[REG_EFL] &= ~EFLAGS_TF;
+}
+
+bool mmio_trap_init(uintptr_t base, size_t size, mmio_trap_read read,
+					mmio_trap_write write)
+{
+	struct sigaction sa;
+	void *ptr;
+
+	ptr = mmap((void *) base, size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (ptr != (void *) base) {
+		return false;
+	}
+
+	memset(&trap, 0, sizeof(trap));
+	trap.window = ptr;
+	trap.base = base;
+	trap.size = size;
+	trap.read = read;
+	trap.write = write;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = on_segv;
+	sigaction(SIGSEGV, &sa, NULL);
+	sa.sa_sigaction = on_trap;
+	sigaction(SIGTRAP, &sa, NULL);
+
+	return true;
+}
+
+bool mmio_trap_is_write(void)
+{
+	return trap.pending_write;
+}
+
+const struct mmio_trap_stats *mmio_trap_stats(void)
+{
+	return &trap.stats;
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Trapped MMIO window, used by the register models to run unmodified
+ *  backends on host.
+ *
+ * The window is mapped at the peripheral address but not accessible.
+ * Every access of the program fault: the cell is loaded with the value
+ *  returned by the read handler, the instruction is single stepped,
+ *  and the written value (if any) is passed to the write handler.
+ * Handlers work on 32bit aligned cells (a 16bit register is the low half).
+ *
+ * Linux x86-64 only (page fault error code and trap flag are used),
+ *  the program should be linked with -no-pie if the backend truncate
+ *  pointers to 32bit.
+ */
+
+#ifndef MMIO_TRAP_H
+#define MMIO_TRAP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Read handler, called for every access (a write operate on the cell
+ *  loaded with the current value)
+ * @param[in] offset Offset in window (32bit aligned)
+ * @return Value of the cell
+ */
+typedef uint32_t (*mmio_trap_read)(uint32_t offset);
+
+/**
+ * Write handler, called after the instruction has written the cell
+ * @param[in] offset Offset in window (32bit aligned)
+ * @param[in] value Value of the cell
+ */
+typedef void (*mmio_trap_write)(uint32_t offset, uint32_t value);
+
+struct mmio_trap_stats {
+	uint64_t reads; /**< Read access */
+	uint64_t writes; /**< Write (or read-modify-write) access */
+};
+
+/**
+ * Map the window and install the fault handlers.
+ * Only one window can be used.
+ * @param[in] base Address of the window (page aligned)
+ * @param[in] size Size of the window (multiple of page size)
+ * @param[in] read Read handler
+ * @param[in] write Write handler
+ * @return false if the window could not be mapped
+ */
+bool mmio_trap_init(uintptr_t base, size_t size, mmio_trap_read read,
+					mmio_trap_write write);
+
+/**
+ * Kind of the access being trapped, for the read handler of a cell where
+ *  reading has side effect (FIFO pop)
+ * @return true if the instruction write the cell (or read-modify-write)
+ */
+bool mmio_trap_is_write(void);
+
+/**
+ * Get the access count
+ * @return statistics
+ */
+const struct mmio_trap_stats *mmio_trap_stats(void);
+
+#endif
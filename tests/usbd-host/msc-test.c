@@ -0,0 +1,784 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_msc (Bulk-Only) test using loopback backend (full speed).
+ *
+ * The host move a limited number of packets per poll and the backend
+ * take some polls per access (slow medium).
+ *
+ * - READ(10) and WRITE(10) with the default buffer (one block, serial)
+ *   and with several multi-block buffers (read-ahead, write-behind):
+ *   medium content and data read are checked, the pipelined run should
+ *   take fewer polls
+ * - Same with a synchronous backend (no read_start/write_start)
+ * - Errors: backend failure and LBA out of range (CSW failed, sense
+ *   data), lock/unlock balanced
+ * - Block cache (msc_cache.h) in front of a synchronous backend: pinned
+ *   low blocks survive a large read, single block writes reach the medium
+ *   as sector writes on SYNCHRONIZE CACHE, START STOP UNIT and Bulk-Only
+ *   reset
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/msc.h>
+#include <unicore-mx/usbd/class/msc_cache.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x02
+#define EP_SIZE 64
+
+#define BLOCKS 256
+#define BLOCK_SIZE 512
+#define BUFFERS 4
+#define BUFFER_BLOCKS 8
+
+/* Cache: lines, pinned blocks, erase sector */
+#define CACHE_LINES 24
+#define PIN_BLOCKS 4
+#define SECTOR_BLOCKS 8
+
+/* Bus packets per poll, backend latency (polls) */
+#define PACKETS_PER_POLL 8
+#define MEDIA_LATENCY 2
+#define MEDIA_POLLS_PER_BLOCK 1
+
+/* Give up a command after this many polls */
+#define TIMEOUT 100000
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x0011,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 250
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static const struct usbd_backend_config fs_config = {
+	.ep_count = 4,
+	.speed = USBD_SPEED_FULL
+};
+
+static usbd_msc *msc;
+static uint32_t block_buffer[BUFFERS * BUFFER_BLOCKS * BLOCK_SIZE / 4];
+
+/* Medium, and block which fail */
+static uint8_t disk[BLOCKS][BLOCK_SIZE];
+static uint32_t bad_lba = UINT32_MAX;
+static unsigned locked;
+
+/* Medium accesses */
+static struct {
+	unsigned reads, pinned_reads;
+	unsigned write_calls, blocks_written;
+} medium;
+
+static usbd_msc_cache cache;
+static uint32_t cache_buffer[(CACHE_LINES * (BLOCK_SIZE +
+		sizeof(struct usbd_msc_cache_line)) +
+		SECTOR_BLOCKS * BLOCK_SIZE) / 4];
+
+/* Backend access in flight: completed when its delay expire */
+static struct {
+	bool busy;
+	bool write;
+	uint32_t lba, count;
+	void *buf;
+	unsigned delay;
+	usbd_msc_backend_callback done;
+	void *ctx;
+} op;
+
+static int media_access(bool write, uint32_t lba, uint32_t count, void *buf)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (lba + i == bad_lba) {
+			return -1;
+		}
+
+		if (write) {
+			memcpy(disk[lba + i], (uint8_t *) buf + i * BLOCK_SIZE,
+				BLOCK_SIZE);
+		} else {
+			memcpy((uint8_t *) buf + i * BLOCK_SIZE, disk[lba + i],
+				BLOCK_SIZE);
+		}
+	}
+
+	return 0;
+}
+
+static int read_block(const usbd_msc_backend *backend, uint32_t lba,
+			void *copy_to)
+{
+	(void) backend;
+	medium.reads++;
+	medium.pinned_reads += lba < PIN_BLOCKS;
+	return media_access(false, lba, 1, copy_to);
+}
+
+static int write_block(const usbd_msc_backend *backend, uint32_t lba,
+			const void *copy_from)
+{
+	(void) backend;
+	medium.write_calls++;
+	medium.blocks_written++;
+	return media_access(true, lba, 1, (void *) copy_from);
+}
+
+static int write_blocks(const usbd_msc_backend *backend, uint32_t lba,
+			uint32_t count, const void *copy_from)
+{
+	(void) backend;
+	medium.write_calls++;
+	medium.blocks_written += count;
+	return media_access(true, lba, count, (void *) copy_from);
+}
+
+static int media_start(bool write, uint32_t lba, uint32_t count, void *buf,
+			usbd_msc_backend_callback done, void *ctx)
+{
+	if (op.busy) {
+		return -1;
+	}
+
+	op.busy = true;
+	op.write = write;
+	op.lba = lba;
+	op.count = count;
+	op.buf = buf;
+	op.delay = MEDIA_LATENCY + count * MEDIA_POLLS_PER_BLOCK;
+	op.done = done;
+	op.ctx = ctx;
+	return 0;
+}
+
+static int read_start(const usbd_msc_backend *backend, uint32_t lba,
+			uint32_t count, void *copy_to,
+			usbd_msc_backend_callback done, void *ctx)
+{
+	(void) backend;
+	return media_start(false, lba, count, copy_to, done, ctx);
+}
+
+static int write_start(const usbd_msc_backend *backend, uint32_t lba,
+			uint32_t count, const void *copy_from,
+			usbd_msc_backend_callback done, void *ctx)
+{
+	(void) backend;
+	return media_start(true, lba, count, (void *) copy_from, done, ctx);
+}
+
+static int lock(void)
+{
+	locked++;
+	return 0;
+}
+
+static int unlock(void)
+{
+	locked--;
+	return 0;
+}
+
+/* "Interrupt" of the medium */
+static void media_tick(void)
+{
+	if (!op.busy || --op.delay) {
+		return;
+	}
+
+	op.busy = false;
+	op.done(op.ctx, media_access(op.write, op.lba, op.count, op.buf));
+}
+
+static const usbd_msc_backend async_backend = {
+	.vendor_id = "ucmx",
+	.product_id = "msc-test",
+	.product_rev = "1.0",
+	.block_count = BLOCKS,
+	.read_block = read_block,
+	.write_block = write_block,
+	.lock = lock,
+	.unlock = unlock,
+	.read_start = read_start,
+	.write_start = write_start
+};
+
+static const usbd_msc_backend sync_backend = {
+	.vendor_id = "ucmx",
+	.product_id = "msc-test",
+	.product_rev = "1.0",
+	.block_count = BLOCKS,
+	.read_block = read_block,
+	.write_block = write_block,
+	.lock = lock,
+	.unlock = unlock
+};
+
+/* Medium behind the cache (erase sector at once) */
+static const usbd_msc_backend flash_backend = {
+	.vendor_id = "ucmx",
+	.product_id = "msc-test",
+	.product_rev = "1.0",
+	.block_count = BLOCKS,
+	.read_block = read_block,
+	.write_block = write_block,
+	.lock = lock,
+	.unlock = unlock,
+	.write_blocks = write_blocks
+};
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, EP_SIZE,
+				USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, EP_SIZE,
+				USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_msc_start(msc);
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_msc_setup_ep0(msc, setup_data)) {
+		usbd_ep0_setup(dev, setup_data);
+	}
+}
+
+static unsigned polls;
+
+static void device_poll(usbd_device *dev)
+{
+	usbd_poll(dev, 1000);
+	media_tick();
+	usbd_msc_poll(msc);
+	polls++;
+}
+
+/**
+ * Perform a Bulk-Only command
+ * @param[in] cdb Command block (10 bytes)
+ * @param[in] write Data-out (else data-in)
+ * @param[in,out] data Data stage
+ * @param[in] length Length of data stage
+ * @param[out] status CSW status
+ * @return 0 on success, -1 on error
+ */
+static int host_command(usbd_device *dev, const uint8_t *cdb, bool write,
+			uint8_t *data, uint32_t length, uint8_t *status)
+{
+	static uint32_t tag;
+	struct usb_msc_cbw cbw;
+	struct usb_msc_csw csw;
+	uint32_t pos = 0;
+	unsigned packets = 0, wait = 0;
+	uint16_t len;
+
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.dCBWSignature = USB_MSC_CBW_SIGNATURE;
+	cbw.dCBWTag = ++tag;
+	cbw.dCBWDataTransferLength = length;
+	cbw.bmCBWFlags = write ? 0x00 : 0x80;
+	cbw.bCBWCBLength = 10;
+	memcpy(cbw.CBWCB, cdb, 10);
+
+	while (usbd_loopback_out(dev, EP_OUT, &cbw, sizeof(cbw)) ==
+			USBD_LOOPBACK_NAK) {
+		CHECK(++wait < TIMEOUT);
+		device_poll(dev);
+	}
+
+	while (pos < length) {
+		enum usbd_loopback_handshake hs;
+
+		len = MIN(EP_SIZE, length - pos);
+
+		if (write) {
+			hs = usbd_loopback_out(dev, EP_OUT, data + pos, len);
+		} else {
+			hs = usbd_loopback_in(dev, EP_IN, data + pos, EP_SIZE, &len);
+		}
+
+		/* Bus time: a few packets per poll */
+		if (hs == USBD_LOOPBACK_NAK || ++packets == PACKETS_PER_POLL) {
+			packets = 0;
+			CHECK(++wait < TIMEOUT);
+			device_poll(dev);
+		}
+
+		if (hs == USBD_LOOPBACK_ACK) {
+			pos += len;
+		} else {
+			CHECK(hs == USBD_LOOPBACK_NAK);
+		}
+	}
+
+	while (usbd_loopback_in(dev, EP_IN, &csw, sizeof(csw), &len) ==
+			USBD_LOOPBACK_NAK) {
+		CHECK(++wait < TIMEOUT);
+		device_poll(dev);
+	}
+
+	CHECK(len == sizeof(csw));
+	CHECK(csw.dCSWSignature == USB_MSC_CSW_SIGNATURE);
+	CHECK(csw.dCSWTag == tag);
+	*status = csw.bCSWStatus;
+	return 0;
+}
+
+static void rw10(uint8_t *cdb, bool write, uint32_t lba, uint16_t blocks)
+{
+	memset(cdb, 0, 10);
+	cdb[0] = write ? USB_MSC_SCSI_WRITE_10 : USB_MSC_SCSI_READ_10;
+	cdb[2] = lba >> 24;
+	cdb[3] = lba >> 16;
+	cdb[4] = lba >> 8;
+	cdb[5] = lba;
+	cdb[7] = blocks >> 8;
+	cdb[8] = blocks;
+}
+
+static int host_rw(usbd_device *dev, bool write, uint32_t lba,
+			uint16_t blocks, uint8_t *data, uint8_t *status)
+{
+	uint8_t cdb[10];
+
+	rw10(cdb, write, lba, blocks);
+	return host_command(dev, cdb, write, data, blocks * BLOCK_SIZE, status);
+}
+
+/**
+ * REQUEST SENSE
+ * @param[out] key Sense key
+ * @param[out] asc Additional sense code
+ */
+static int host_sense(usbd_device *dev, uint8_t *key, uint8_t *asc)
+{
+	uint8_t cdb[10] = { USB_MSC_SCSI_REQUEST_SENSE, 0, 0, 0, 18 };
+	uint8_t sense[18], status;
+
+	CHECK(host_command(dev, cdb, false, sense, sizeof(sense), &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	*key = sense[2] & 0x0F;
+	*asc = sense[12];
+	return 0;
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	return 0;
+}
+
+static uint8_t pattern(uint32_t lba, uint32_t i, unsigned seed)
+{
+	return (lba * 31 + i * 7 + seed) & 0xFF;
+}
+
+/**
+ * Write then read back @a blocks blocks at @a lba
+ * @param[out] write_polls Polls taken by the write
+ * @param[out] read_polls Polls taken by the read
+ */
+static int test_transfer(usbd_device *dev, uint32_t lba, uint16_t blocks,
+			unsigned seed, unsigned *write_polls,
+			unsigned *read_polls)
+{
+	static uint8_t data[64 * BLOCK_SIZE];
+	uint8_t status;
+	uint32_t i, j;
+
+	CHECK(blocks * BLOCK_SIZE <= sizeof(data));
+
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			data[i * BLOCK_SIZE + j] = pattern(lba + i, j, seed);
+		}
+	}
+
+	polls = 0;
+	CHECK(host_rw(dev, true, lba, blocks, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	*write_polls = polls;
+
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			CHECK(disk[lba + i][j] == pattern(lba + i, j, seed));
+		}
+	}
+
+	memset(data, 0, sizeof(data));
+
+	polls = 0;
+	CHECK(host_rw(dev, false, lba, blocks, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	*read_polls = polls;
+
+	CHECK(memcmp(data, disk[lba], blocks * BLOCK_SIZE) == 0);
+	CHECK(locked == 0);
+	return 0;
+}
+
+static int test_errors(usbd_device *dev)
+{
+	static uint8_t data[16 * BLOCK_SIZE];
+	uint8_t status, key, asc;
+
+	/* Backend failure in the middle of the transfer */
+	bad_lba = 37;
+	CHECK(host_rw(dev, false, 30, 16, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_FAILED);
+	CHECK(host_sense(dev, &key, &asc) == 0);
+	CHECK(key == 0x03 && asc == 0x11);
+
+	CHECK(host_rw(dev, true, 30, 16, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_FAILED);
+	CHECK(host_sense(dev, &key, &asc) == 0);
+	CHECK(key == 0x03 && asc == 0x03);
+	bad_lba = UINT32_MAX;
+
+	/* Out of range: data stage still performed */
+	CHECK(host_rw(dev, false, BLOCKS - 4, 8, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_FAILED);
+	CHECK(host_sense(dev, &key, &asc) == 0);
+	CHECK(key == 0x05 && asc == 0x21);
+
+	CHECK(host_rw(dev, true, BLOCKS, 1, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_FAILED);
+
+	/* Recovered */
+	CHECK(host_rw(dev, false, 0, 16, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	CHECK(locked == 0);
+	return 0;
+}
+
+/**
+ * Bus reset while the backend reads
+ */
+static int test_reset(usbd_device *dev)
+{
+	static uint8_t data[16 * BLOCK_SIZE];
+	struct usb_msc_cbw cbw;
+	uint8_t status;
+	unsigned wait = 0;
+
+	memset(&cbw, 0, sizeof(cbw));
+	cbw.dCBWSignature = USB_MSC_CBW_SIGNATURE;
+	cbw.dCBWDataTransferLength = sizeof(data);
+	cbw.bmCBWFlags = 0x80;
+	cbw.bCBWCBLength = 10;
+	rw10(cbw.CBWCB, false, 16, 16);
+
+	CHECK(usbd_loopback_out(dev, EP_OUT, &cbw, sizeof(cbw)) ==
+			USBD_LOOPBACK_ACK);
+	while (!op.busy) {
+		CHECK(++wait < TIMEOUT);
+		device_poll(dev);
+	}
+
+	/* Lock kept till the access in flight finish */
+	usbd_loopback_reset(dev);
+	CHECK(configure(dev) == 0);
+	CHECK(locked == 1);
+
+	/* Command received meanwhile is performed after */
+	CHECK(host_rw(dev, false, 0, 16, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	CHECK(!memcmp(data, disk[0], sizeof(data)));
+	CHECK(locked == 0);
+	return 0;
+}
+
+/**
+ * Run the tests with @a backend
+ * @param[in] buffers Use the application buffers (else default)
+ * @param[out] total Polls taken by the transfers
+ */
+static int run(const usbd_msc_backend *backend, bool buffers,
+			unsigned *total)
+{
+	static const struct {
+		uint32_t lba;
+		uint16_t blocks;
+	} transfers[] = {
+		{0, 1}, {1, 7}, {8, 8}, {16, 9}, {40, 64}, {200, 33}, {104, 64}
+	};
+	unsigned i, write_polls, read_polls, writes = 0, reads = 0;
+	usbd_device *dev;
+
+	dev = usbd_init(USBD_LOOPBACK, &fs_config, &info);
+	CHECK(dev != NULL);
+	msc = usbd_msc_init(dev, EP_IN, EP_SIZE, EP_OUT, EP_SIZE, backend);
+	CHECK(msc != NULL);
+
+	if (buffers) {
+		usbd_msc_set_buffers(msc, block_buffer, BUFFERS, BUFFER_BLOCKS);
+	}
+
+	/* Invalid: ignored */
+	usbd_msc_set_buffers(msc, block_buffer, 0, BUFFER_BLOCKS);
+	usbd_msc_set_buffers(msc, block_buffer, BUFFERS, 0);
+
+	usbd_register_set_config_callback(dev, set_config);
+	usbd_loopback_reset(dev);
+	CHECK(configure(dev) == 0);
+
+	for (i = 0; i < sizeof(transfers) / sizeof(transfers[0]); i++) {
+		CHECK(test_transfer(dev, transfers[i].lba, transfers[i].blocks,
+					i + buffers, &write_polls,
+					&read_polls) == 0);
+		writes += write_polls;
+		reads += read_polls;
+	}
+
+	CHECK(test_errors(dev) == 0);
+
+	if (backend->read_start != NULL) {
+		CHECK(test_reset(dev) == 0);
+	}
+
+	printf("msc-test: %s backend, %s buffers: %u polls write, "
+		"%u polls read\n",
+		backend->read_start != NULL ? "async" : "sync",
+		buffers ? "multi-block" : "default", writes, reads);
+
+	*total = writes + reads;
+	return 0;
+}
+
+/**
+ * Command without data stage
+ * @param[in] opcode SCSI operation code
+ * @param[in] byte4 Byte 4 of the command block
+ */
+static int host_simple(usbd_device *dev, uint8_t opcode, uint8_t byte4)
+{
+	uint8_t cdb[10] = { opcode, 0, 0, 0, byte4 };
+	uint8_t status;
+
+	CHECK(host_command(dev, cdb, false, NULL, 0, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	return 0;
+}
+
+/**
+ * Write single blocks at @a lba, check they stay in cache
+ * @param[in] blocks Number of blocks
+ * @param[in] seed Pattern
+ */
+static int cache_write(usbd_device *dev, uint32_t lba, uint32_t blocks,
+			unsigned seed)
+{
+	uint8_t data[BLOCK_SIZE], status;
+	uint32_t i, j;
+
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			data[j] = pattern(lba + i, j, seed);
+		}
+
+		CHECK(host_rw(dev, true, lba + i, 1, data, &status) == 0);
+		CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	}
+
+	/* Write-back */
+	CHECK(medium.write_calls == 0);
+	CHECK(disk[lba][0] != pattern(lba, 0, seed));
+	return 0;
+}
+
+static int cache_check(uint32_t lba, uint32_t blocks, unsigned seed)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < blocks; i++) {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			CHECK(disk[lba + i][j] == pattern(lba + i, j, seed));
+		}
+	}
+
+	return 0;
+}
+
+static int run_cache(void)
+{
+	static uint8_t data[64 * BLOCK_SIZE];
+	const usbd_msc_cache_config config = {
+		.backend = &flash_backend,
+		.buffer = cache_buffer,
+		.size = sizeof(cache_buffer),
+		.pin_blocks = PIN_BLOCKS,
+		.sector_blocks = SECTOR_BLOCKS
+	};
+	const struct usb_setup_data bulk_only_reset = {
+		.bmRequestType = USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = USB_MSC_REQ_BULK_ONLY_RESET
+	};
+	const usbd_msc_backend *backend;
+	usbd_msc_cache_stats stats;
+	usbd_device *dev;
+	uint8_t status;
+	unsigned i;
+
+	backend = usbd_msc_cache_init(&cache, &config);
+	CHECK(backend != NULL);
+	CHECK(cache.lines == CACHE_LINES);
+
+	dev = usbd_init(USBD_LOOPBACK, &fs_config, &info);
+	CHECK(dev != NULL);
+	msc = usbd_msc_init(dev, EP_IN, EP_SIZE, EP_OUT, EP_SIZE, backend);
+	CHECK(msc != NULL);
+	usbd_msc_set_buffers(msc, block_buffer, BUFFERS, BUFFER_BLOCKS);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+	usbd_loopback_reset(dev);
+	CHECK(configure(dev) == 0);
+
+	/* FAT and directory read again and again, file read in between */
+	memset(&medium, 0, sizeof(medium));
+	for (i = 0; i < 10; i++) {
+		CHECK(host_rw(dev, false, 0, PIN_BLOCKS, data, &status) == 0);
+		CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+		CHECK(memcmp(data, disk[0], PIN_BLOCKS * BLOCK_SIZE) == 0);
+		CHECK(host_rw(dev, false, 100 + i * 8, 64, data, &status) == 0);
+		CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+		CHECK(memcmp(data, disk[100 + i * 8], 64 * BLOCK_SIZE) == 0);
+	}
+	CHECK(medium.pinned_reads == PIN_BLOCKS);
+
+	/* Two erase sectors written block by block */
+	memset(&medium, 0, sizeof(medium));
+	CHECK(cache_write(dev, 48, 2 * SECTOR_BLOCKS, 7) == 0);
+	CHECK(host_simple(dev, USB_MSC_SCSI_SYNCHRONIZE_CACHE, 0) == 0);
+	CHECK(medium.write_calls == 2);
+	CHECK(medium.blocks_written == 2 * SECTOR_BLOCKS);
+	CHECK(cache_check(48, 2 * SECTOR_BLOCKS, 7) == 0);
+
+	/* Nothing left to write */
+	CHECK(host_simple(dev, USB_MSC_SCSI_SYNCHRONIZE_CACHE, 0) == 0);
+	CHECK(medium.write_calls == 2);
+
+	/* Sparse blocks of a sector: one write, hole filled */
+	memset(&medium, 0, sizeof(medium));
+	CHECK(cache_write(dev, 65, 1, 8) == 0);
+	CHECK(cache_write(dev, 68, 1, 8) == 0);
+	CHECK(host_simple(dev, USB_MSC_SCSI_START_STOP_UNIT, 0x00) == 0);
+	CHECK(medium.write_calls == 1);
+	CHECK(medium.blocks_written == 4);
+	CHECK(cache_check(65, 1, 8) == 0 && cache_check(68, 1, 8) == 0);
+
+	/* Bulk-Only reset */
+	memset(&medium, 0, sizeof(medium));
+	CHECK(cache_write(dev, 200, 3, 9) == 0);
+	CHECK(usbd_loopback_control(dev, &bulk_only_reset, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(medium.write_calls == 1);
+	CHECK(cache_check(200, 3, 9) == 0);
+
+	/* More dirty blocks than lines: replaced blocks written by sector */
+	memset(&medium, 0, sizeof(medium));
+	for (i = 0; i < sizeof(data); i++) {
+		data[i] = pattern(128 + i / BLOCK_SIZE, i % BLOCK_SIZE, 10);
+	}
+	CHECK(host_rw(dev, true, 128, 64, data, &status) == 0);
+	CHECK(status == USB_MSC_CSW_STATUS_SUCCESS);
+	CHECK(host_simple(dev, USB_MSC_SCSI_SYNCHRONIZE_CACHE, 0) == 0);
+	CHECK(medium.blocks_written == 64);
+	CHECK(medium.write_calls == 64 / SECTOR_BLOCKS);
+	CHECK(cache_check(128, 64, 10) == 0);
+	CHECK(locked == 0);
+
+	usbd_msc_cache_get_stats(&cache, &stats);
+	CHECK(stats.errors == 0);
+	printf("msc-test: cache: %u read hits, %u read misses, "
+		"%u write hits, %u write misses, %u sector writes\n",
+		stats.read_hits, stats.read_misses, stats.write_hits,
+		stats.write_misses, stats.sector_writes);
+	return 0;
+}
+
+int main(void)
+{
+	unsigned serial, pipelined, sync;
+
+	if (run(&async_backend, false, &serial) ||
+			run(&async_backend, true, &pipelined) ||
+			run(&sync_backend, true, &sync)) {
+		return EXIT_FAILURE;
+	}
+
+	/* Backend access overlap bus transfers */
+	if (pipelined * 3 > serial * 2) {
+		fprintf(stderr, "msc-test: pipelining too slow (%u vs %u polls)\n",
+			pipelined, serial);
+		return EXIT_FAILURE;
+	}
+
+	if (run_cache()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("msc-test: OK\n");
+	return EXIT_SUCCESS;
+}
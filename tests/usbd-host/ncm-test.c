@@ -0,0 +1,650 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_ncm test using loopback backend (512 bytes bulk packets).
+ *
+ * - Class requests: NTB parameters, input size, format
+ * - Link notifications (speed, connection)
+ * - TX: burst of small datagrams aggregated in NTB (bus packets per
+ *   datagram compared to one transfer per datagram), timeout of a lone
+ *   datagram, datagrams given back, content and order
+ * - RX: NTB parsed in place, callback refusing datagrams (backpressure),
+ *   invalid NTB dropped, NTB32 format
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/ncm.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_NOTIFY 0x82
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 512
+#define COMM_INTERFACE 0
+
+#define NTB_IN_SIZE 16384
+#define NTB_OUT_SIZE 8192
+#define RX_SLOTS 2
+#define TIMEOUT_US 200
+#define POLL_US 50
+
+#define DATAGRAM_LEN 60
+#define DATAGRAMS 2000
+#define MAX_DATAGRAM 1514
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = USB_CLASS_CDC,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x000e,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 2,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 50
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static uint32_t rx_slots[RX_SLOTS * NTB_OUT_SIZE / 4];
+static usbd_ncm ncm;
+
+/* Datagrams sent: frame i is in frames[i % DATAGRAMS] */
+static uint8_t frames[DATAGRAMS][MAX_DATAGRAM];
+static unsigned tx_done_count;
+static bool tx_held[DATAGRAMS];
+
+/* Datagrams received */
+static uint8_t rx_data[128 * 1024];
+static size_t rx_data_len;
+static unsigned rx_count, rx_refuse;
+
+static void tx_done(usbd_ncm *_ncm, void *cookie)
+{
+	unsigned index = (uintptr_t) cookie;
+
+	(void) _ncm;
+
+	tx_held[index] = false;
+	tx_done_count++;
+}
+
+static bool rx(usbd_ncm *_ncm, const void *datagram, size_t len)
+{
+	(void) _ncm;
+
+	/* Refuse some datagrams once (every 3rd, upto rx_refuse / 2 times) */
+	if (rx_refuse && !(rx_count % 3)) {
+		rx_refuse--;
+		if (rx_refuse & 1) {
+			return false;
+		}
+	}
+
+	memcpy(rx_data + rx_data_len, datagram, len);
+	rx_data_len += len;
+	rx_count++;
+	return true;
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_ncm_setup_ep0(&ncm, setup_data)) {
+		usbd_ep0_setup(dev, setup_data);
+	}
+}
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_NOTIFY, USBD_EP_INTERRUPT, 16, 16, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_IN, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_OUT, USBD_EP_BULK, EP_SIZE, USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+}
+
+static void poll(usbd_device *dev, unsigned count)
+{
+	while (count--) {
+		usbd_poll(dev, POLL_US);
+		usbd_ncm_poll(&ncm, POLL_US);
+	}
+}
+
+static enum usbd_loopback_handshake request(usbd_device *dev, uint8_t req,
+		uint16_t value, void *buf, uint16_t len, bool in)
+{
+	const struct usb_setup_data setup = {
+		.bmRequestType = (in ? USB_REQ_TYPE_IN : 0) | USB_REQ_TYPE_CLASS |
+				USB_REQ_TYPE_INTERFACE,
+		.bRequest = req,
+		.wValue = value,
+		.wIndex = COMM_INTERFACE,
+		.wLength = len
+	};
+
+	return usbd_loopback_control(dev, &setup, buf, NULL);
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	return 0;
+}
+
+static int test_requests(usbd_device *dev)
+{
+	struct usb_cdc_ncm_ntb_parameters params;
+	uint32_t size;
+	uint16_t value;
+
+	CHECK(request(dev, USB_CDC_REQ_GET_NTB_PARAMETERS, 0, &params,
+			sizeof(params), true) == USBD_LOOPBACK_ACK);
+	CHECK(params.wLength == sizeof(params));
+	CHECK(params.bmNtbFormatsSupported == (USB_CDC_NCM_NTB16_SUPPORTED |
+				USB_CDC_NCM_NTB32_SUPPORTED));
+	CHECK(params.dwNtbInMaxSize == NTB_IN_SIZE);
+	CHECK(params.dwNtbOutMaxSize == NTB_OUT_SIZE);
+	CHECK(params.wNdpInDivisor == 4 && params.wNdpOutAlignment == 4);
+
+	/* Input size: below minimum and above maximum stall */
+	size = 1024;
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_INPUT_SIZE, 0, &size, 4, false) ==
+			USBD_LOOPBACK_STALL);
+	size = NTB_IN_SIZE * 2;
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_INPUT_SIZE, 0, &size, 4, false) ==
+			USBD_LOOPBACK_STALL);
+	size = 8192;
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_INPUT_SIZE, 0, &size, 4, false) ==
+			USBD_LOOPBACK_ACK);
+	size = 0;
+	CHECK(request(dev, USB_CDC_REQ_GET_NTB_INPUT_SIZE, 0, &size, 4, true) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(size == 8192);
+
+	CHECK(request(dev, USB_CDC_REQ_GET_MAX_DATAGRAM_SIZE, 0, &value, 2,
+			true) == USBD_LOOPBACK_ACK);
+	CHECK(value == MAX_DATAGRAM);
+
+	/* Format: NTB16 per default */
+	CHECK(request(dev, USB_CDC_REQ_GET_NTB_FORMAT, 0, &value, 2, true) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(value == USB_CDC_NCM_NTB16_FORMAT);
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_FORMAT, 2, NULL, 0, false) ==
+			USBD_LOOPBACK_STALL);
+
+	/* Alternate setting 0: reset to default */
+	usbd_ncm_stop(&ncm);
+	CHECK(ncm.ntb_in_size == NTB_IN_SIZE);
+
+	return 0;
+}
+
+/**
+ * NTB input size above 64 KiB: limited while the format is NTB16
+ * @param[in] dev USB device
+ * @param[in] config NCM configuration
+ */
+static int test_ntb16_limit(usbd_device *dev, const usbd_ncm_config *config)
+{
+	usbd_ncm_config large = *config;
+	uint32_t size;
+
+	usbd_ncm_stop(&ncm);
+	large.ntb_in_size = 0x20000;
+	usbd_ncm_init(&ncm, dev, &large);
+	CHECK(ncm.ntb_in_size == 0xFFFC);
+
+	size = 0x10000;
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_INPUT_SIZE, 0, &size, 4, false) ==
+			USBD_LOOPBACK_STALL);
+
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_FORMAT, USB_CDC_NCM_NTB32_FORMAT,
+			NULL, 0, false) == USBD_LOOPBACK_ACK);
+	size = 0x20000;
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_INPUT_SIZE, 0, &size, 4, false) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(ncm.ntb_in_size == 0x20000);
+
+	/* Back to NTB16 */
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_FORMAT, USB_CDC_NCM_NTB16_FORMAT,
+			NULL, 0, false) == USBD_LOOPBACK_ACK);
+	CHECK(ncm.ntb_in_size == 0xFFFC);
+
+	usbd_ncm_init(&ncm, dev, config);
+	return 0;
+}
+
+static int test_notify(usbd_device *dev)
+{
+	uint8_t buf[16];
+	struct usb_cdc_notification *notif = (void *) buf;
+	struct usb_cdc_connection_speed *speed = (void *) (notif + 1);
+	uint16_t len;
+
+	usbd_ncm_set_link(&ncm, true, 100000000);
+	usbd_ncm_start(&ncm);
+
+	/* Format cannot change while running */
+	CHECK(request(dev, USB_CDC_REQ_SET_NTB_FORMAT, USB_CDC_NCM_NTB32_FORMAT,
+			NULL, 0, false) == USBD_LOOPBACK_STALL);
+
+	CHECK(usbd_loopback_in(dev, EP_NOTIFY, buf, 16, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 16);
+	CHECK(notif->bNotification == USB_CDC_NOTIFY_CONNECTION_SPEED_CHANGE);
+	CHECK(notif->wIndex == COMM_INTERFACE && notif->wLength == 8);
+	CHECK(speed->DLBitRate == 100000000 && speed->ULBitRate == 100000000);
+
+	CHECK(usbd_loopback_in(dev, EP_NOTIFY, buf, 16, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 8);
+	CHECK(notif->bNotification == USB_CDC_NOTIFY_NETWORK_CONNECTION);
+	CHECK(notif->wValue == 1);
+
+	CHECK(usbd_loopback_in(dev, EP_NOTIFY, buf, 16, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	/* Only changes are notified */
+	usbd_ncm_set_link(&ncm, false, 100000000);
+	CHECK(usbd_loopback_in(dev, EP_NOTIFY, buf, 16, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(notif->bNotification == USB_CDC_NOTIFY_NETWORK_CONNECTION);
+	CHECK(notif->wValue == 0);
+	CHECK(usbd_loopback_in(dev, EP_NOTIFY, buf, 16, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	return 0;
+}
+
+/**
+ * Read a NTB (host)
+ * @param[in] dev USB Device
+ * @param[out] buf Buffer (NTB_IN_SIZE)
+ * @return length (0: NAK)
+ */
+static size_t host_read_ntb(usbd_device *dev, uint8_t *buf)
+{
+	size_t pos = 0;
+	uint16_t len;
+
+	while (pos < NTB_IN_SIZE && usbd_loopback_in(dev, EP_IN, buf + pos,
+			EP_SIZE, &len) == USBD_LOOPBACK_ACK) {
+		pos += len;
+		if (len < EP_SIZE) {
+			break;
+		}
+	}
+
+	return pos;
+}
+
+/**
+ * Check a NTB16 (host parser) and the datagrams it carry
+ * @param[in] buf NTB
+ * @param[in] len Length
+ * @param[in,out] next Index of the next expected datagram
+ * @return number of datagrams, -1 on error
+ */
+static int host_parse_ntb16(const uint8_t *buf, size_t len, unsigned *next)
+{
+	const struct usb_cdc_ncm_nth16 *nth = (const void *) buf;
+	const struct usb_cdc_ncm_ndp16 *ndp;
+	const uint16_t *pointer;
+	int count = 0;
+
+	CHECK(nth->dwSignature == USB_CDC_NCM_NTH16_SIGNATURE);
+	CHECK(nth->wHeaderLength == 12 && nth->wBlockLength == len);
+	CHECK(!(nth->wNdpIndex % 4) && nth->wNdpIndex < len);
+
+	ndp = (const void *) (buf + nth->wNdpIndex);
+	CHECK(ndp->dwSignature == USB_CDC_NCM_NDP16_NOCRC_SIGNATURE);
+	CHECK(nth->wNdpIndex + ndp->wLength == len && !ndp->wNextNdpIndex);
+
+	for (pointer = (const uint16_t *) (ndp + 1); pointer[0]; pointer += 2) {
+		unsigned index = *next % DATAGRAMS;
+
+		CHECK(!(pointer[0] % 4) && pointer[0] + pointer[1] <= nth->wNdpIndex);
+		CHECK(pointer[1] == DATAGRAM_LEN);
+		CHECK(!memcmp(buf + pointer[0], frames[index], DATAGRAM_LEN));
+		(*next)++;
+		count++;
+	}
+
+	return count;
+}
+
+static int test_tx(usbd_device *dev)
+{
+	static uint8_t ntb[NTB_IN_SIZE];
+	const struct usbd_loopback_stats *bus = usbd_loopback_stats(dev);
+	unsigned sent = 0, received = 0, ntbs = 0, i;
+	uint64_t tokens;
+	usbd_ncm_stats stats;
+	size_t len;
+	int n;
+
+	for (i = 0; i < DATAGRAMS; i++) {
+		memset(frames[i], i * 7, MAX_DATAGRAM);
+		frames[i][0] = i;
+		frames[i][1] = i >> 8;
+	}
+
+	/* Lone datagram: wait the timeout */
+	CHECK(usbd_ncm_send(&ncm, frames[0], DATAGRAM_LEN, (void *) 0));
+	tx_held[0] = true;
+	sent++;
+	poll(dev, TIMEOUT_US / POLL_US - 1);
+	CHECK(host_read_ntb(dev, ntb) == 0);
+	poll(dev, 1);
+	len = host_read_ntb(dev, ntb);
+	CHECK(len > 0);
+	n = host_parse_ntb16(ntb, len, &received);
+	CHECK(n == 1 && !tx_held[0] && tx_done_count == 1);
+
+	/* Burst: the host read while the application send (1 datagram per
+	 *  poll interval is slower than the bus, NTB fill and leave full) */
+	tokens = bus->tokens;
+	while (received < DATAGRAMS) {
+		for (i = 0; i < 8 && sent < DATAGRAMS; i++) {
+			unsigned index = sent % DATAGRAMS;
+
+			if (!usbd_ncm_send(&ncm, frames[index], DATAGRAM_LEN,
+					(void *) (uintptr_t) index)) {
+				break;
+			}
+			tx_held[index] = true;
+			sent++;
+		}
+
+		poll(dev, 1);
+
+		while ((len = host_read_ntb(dev, ntb)) > 0) {
+			n = host_parse_ntb16(ntb, len, &received);
+			CHECK(n > 0);
+			ntbs++;
+		}
+	}
+
+	for (i = 0; i < DATAGRAMS; i++) {
+		CHECK(!tx_held[i]);
+	}
+
+	usbd_ncm_get_stats(&ncm, &stats);
+	CHECK(tx_done_count == DATAGRAMS && stats.tx_datagrams == DATAGRAMS);
+	CHECK(stats.tx_dropped == 0);
+
+	/* Few transfers: atleast 8 datagrams per NTB */
+	CHECK(ntbs * 8 <= DATAGRAMS - 1);
+
+	printf("ncm-test: %u datagrams of %u bytes in %u NTB (%.1f per NTB, "
+		"%u timeouts), %.2f IN tokens per datagram\n",
+		DATAGRAMS - 1, DATAGRAM_LEN, ntbs, (double) (DATAGRAMS - 1) / ntbs,
+		(unsigned) stats.tx_timeouts,
+		(double) (bus->tokens - tokens) / (DATAGRAMS - 1));
+
+	/* Too large */
+	CHECK(!usbd_ncm_send(&ncm, frames[0], MAX_DATAGRAM + 1, NULL));
+
+	/* Not sent on stop: given back */
+	tx_done_count = 0;
+	CHECK(usbd_ncm_send(&ncm, frames[0], DATAGRAM_LEN, NULL));
+	CHECK(usbd_ncm_send(&ncm, frames[1], DATAGRAM_LEN, NULL));
+	usbd_ncm_stop(&ncm);
+	CHECK(tx_done_count == 2);
+	CHECK(!usbd_ncm_send(&ncm, frames[0], DATAGRAM_LEN, NULL));
+
+	return 0;
+}
+
+/**
+ * Build a NTB (host)
+ * @param[out] buf Buffer
+ * @param[in] ntb32 NTB32 format
+ * @param[in] first First datagram (frames[])
+ * @param[in] count Number of datagrams
+ * @param[in] dlen Datagram length
+ * @return NTB length
+ */
+static size_t host_build_ntb(uint8_t *buf, bool ntb32, unsigned first,
+				unsigned count, size_t dlen)
+{
+	size_t pos = ntb32 ? 16 : 12;
+	size_t ndp_index;
+	uint32_t index[64];
+	unsigned i;
+
+	/* Datagrams first (unaligned length), NDP at end */
+	for (i = 0; i < count; i++) {
+		pos = (pos + 3) & ~3;
+		index[i] = pos;
+		memcpy(buf + pos, frames[first + i], dlen);
+		pos += dlen;
+	}
+
+	ndp_index = (pos + 3) & ~3;
+	if (ntb32) {
+		struct usb_cdc_ncm_nth32 *nth = (void *) buf;
+		struct usb_cdc_ncm_ndp32 *ndp = (void *) (buf + ndp_index);
+		uint32_t *pointer = (uint32_t *) (ndp + 1);
+
+		nth->dwSignature = USB_CDC_NCM_NTH32_SIGNATURE;
+		nth->wHeaderLength = 16;
+		nth->dwNdpIndex = ndp_index;
+		ndp->dwSignature = USB_CDC_NCM_NDP32_NOCRC_SIGNATURE;
+		ndp->wLength = 16 + ((count + 1) * 8);
+		ndp->dwNextNdpIndex = 0;
+		for (i = 0; i < count; i++) {
+			*pointer++ = index[i];
+			*pointer++ = dlen;
+		}
+		*pointer++ = 0;
+		*pointer++ = 0;
+		pos = (uint8_t *) pointer - buf;
+		nth->dwBlockLength = pos;
+	} else {
+		struct usb_cdc_ncm_nth16 *nth = (void *) buf;
+		struct usb_cdc_ncm_ndp16 *ndp = (void *) (buf + ndp_index);
+		uint16_t *pointer = (uint16_t *) (ndp + 1);
+
+		nth->dwSignature = USB_CDC_NCM_NTH16_SIGNATURE;
+		nth->wHeaderLength = 12;
+		nth->wNdpIndex = ndp_index;
+		ndp->dwSignature = USB_CDC_NCM_NDP16_NOCRC_SIGNATURE;
+		ndp->wLength = 8 + ((count + 1) * 4);
+		ndp->wNextNdpIndex = 0;
+		for (i = 0; i < count; i++) {
+			*pointer++ = index[i];
+			*pointer++ = dlen;
+		}
+		*pointer++ = 0;
+		*pointer++ = 0;
+		pos = (uint8_t *) pointer - buf;
+		nth->wBlockLength = pos;
+	}
+
+	return pos;
+}
+
+/**
+ * Send a NTB (host), retry on NAK
+ * @param[in] dev USB Device
+ * @param[in] buf NTB
+ * @param[in] len Length
+ * @return number of NAK
+ */
+static unsigned host_write_ntb(usbd_device *dev, const uint8_t *buf,
+				size_t len)
+{
+	unsigned nak = 0;
+	size_t pos = 0;
+	uint16_t n;
+
+	do {
+		n = MIN(EP_SIZE, len - pos);
+		if (usbd_loopback_out(dev, EP_OUT, buf + pos, n) ==
+				USBD_LOOPBACK_ACK) {
+			pos += n;
+		} else {
+			nak++;
+			poll(dev, 1);
+		}
+	} while (n == EP_SIZE);
+
+	return nak;
+}
+
+static int test_rx(usbd_device *dev, bool ntb32)
+{
+	static uint8_t ntb[NTB_OUT_SIZE];
+	const size_t dlen[] = {60, 1514, 333, 1000};
+	usbd_ncm_stats before, stats;
+	size_t expect_len = 0, len;
+	unsigned first = 0, nak = 0, i, d;
+
+	usbd_ncm_get_stats(&ncm, &before);
+	rx_count = 0;
+	rx_data_len = 0;
+	rx_refuse = 12;
+
+	for (i = 0; i < 40; i++) {
+		d = dlen[i % 4];
+		len = host_build_ntb(ntb, ntb32, first, 4, d);
+		nak += host_write_ntb(dev, ntb, len);
+		first += 4;
+		expect_len += 4 * d;
+		poll(dev, 1);
+	}
+
+	/* Invalid NTB: dropped, next is received */
+	len = host_build_ntb(ntb, ntb32, 0, 2, 100);
+	ntb[0] ^= 0xFF;
+	host_write_ntb(dev, ntb, len);
+	len = host_build_ntb(ntb, ntb32, 0, 2, 100);
+	ntb[ntb32 ? ((uint32_t *) ntb)[3] : ((uint16_t *) ntb)[5]] ^= 0xFF;
+	host_write_ntb(dev, ntb, len);
+	poll(dev, 10);
+
+	CHECK(rx_count == 160 && rx_data_len == expect_len);
+
+	for (i = 0, len = 0; i < 160; i++) {
+		d = dlen[(i / 4) % 4];
+		CHECK(!memcmp(rx_data + len, frames[i], d));
+		len += d;
+	}
+
+	usbd_ncm_get_stats(&ncm, &stats);
+	CHECK(stats.rx_datagrams - before.rx_datagrams == 160);
+	CHECK(stats.rx_invalid - before.rx_invalid == 2);
+	CHECK(stats.rx_waits > before.rx_waits);
+
+	printf("ncm-test: NTB%u RX %u datagrams, %u waits, %u NAK\n",
+		ntb32 ? 32 : 16, rx_count,
+		(unsigned) (stats.rx_waits - before.rx_waits), nak);
+
+	return 0;
+}
+
+int main(void)
+{
+	const usbd_ncm_config config = {
+		.interface = COMM_INTERFACE,
+		.ep_in = EP_IN,
+		.ep_out = EP_OUT,
+		.ep_size = EP_SIZE,
+		.ep_notify = EP_NOTIFY,
+		.ntb32 = true,
+		.ntb_in_size = NTB_IN_SIZE,
+		.timeout_us = TIMEOUT_US,
+		.rx_buffer = rx_slots,
+		.ntb_out_size = NTB_OUT_SIZE,
+		.rx_slots = RX_SLOTS,
+		.max_datagram = MAX_DATAGRAM,
+		.tx_done = tx_done,
+		.rx = rx
+	};
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+
+	usbd_ncm_init(&ncm, dev, &config);
+
+	if (configure(dev) || test_requests(dev) || test_notify(dev) ||
+			test_tx(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	/* NTB16 */
+	usbd_ncm_start(&ncm);
+	if (test_rx(dev, false)) {
+		return EXIT_FAILURE;
+	}
+
+	/* NTB32 (alternate setting 0, SET_NTB_FORMAT, alternate setting 1) */
+	usbd_ncm_stop(&ncm);
+	if (request(dev, USB_CDC_REQ_SET_NTB_FORMAT, USB_CDC_NCM_NTB32_FORMAT,
+			NULL, 0, false) != USBD_LOOPBACK_ACK) {
+		return EXIT_FAILURE;
+	}
+	usbd_ncm_start(&ncm);
+	if (test_rx(dev, true) || test_ntb16_limit(dev, &config)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("ncm-test: OK\n");
+	return EXIT_SUCCESS;
+}
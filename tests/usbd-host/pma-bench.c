@@ -0,0 +1,288 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * STM32 FSDEV packet memory copy kernels (backend/stm32_fsdev_pma.h).
+ *
+ * The packet memory is modelled by a volatile array, for both layouts
+ *  (stride 2: 1x16 bits/word, stride 1: 2x16 bits/word).
+ * The kernels are checked byte exact against the previous implementation
+ *  (halfword loop with runtime stride, byte loop for odd buffer) for every
+ *  buffer alignment and length up to 2 packets.
+ * With -b, both are then timed on 64 bytes packets.
+ *
+ * Built twice: without and with __ARM_FEATURE_UNALIGNED (pma-bench-unaligned)
+ *  to cover both kernel variants.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "backend/stm32_fsdev_pma.h"
+
+#define PMA_BYTES 1024
+#define MAX_LEN 130
+#define PACKET 64
+#define ITERATIONS 400000
+#define REPEAT 5
+
+/* Packet memory, CPU address space (stride 2 use twice the halfwords) */
+static volatile uint16_t pma[PMA_BYTES];
+
+/* Runtime stride of previous implementation */
+static volatile unsigned ref_stride;
+
+static void ref_write(uint16_t usb_local, const void *vBuf, uint16_t len)
+{
+	unsigned stride = ref_stride;
+	volatile uint16_t *hPM = &pma[usb_local / 2 * stride];
+
+	len = (len + 1) / 2;
+
+#if !defined(__ARM_FEATURE_UNALIGNED)
+	if (((uintptr_t) vBuf) & 0x01) {
+		const uint8_t *uBuf = vBuf;
+
+		while (len--) {
+			*hPM = (uBuf[1] << 8) | uBuf[0];
+			hPM += stride;
+			uBuf += 2;
+		}
+
+		return;
+	}
+#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
+
+	const fsdev_ram16 *hBuf = vBuf;
+
+	while (len--) {
+		*hPM = *hBuf++;
+		hPM += stride;
+	}
+}
+
+static void ref_read(void *vBuf, uint16_t usb_local, uint16_t len)
+{
+	unsigned stride = ref_stride;
+	const volatile uint16_t *hPM = &pma[usb_local / 2 * stride];
+	int odd = len & 1;
+	len /= 2;
+
+#if !defined(__ARM_FEATURE_UNALIGNED)
+	if (((uintptr_t) vBuf) & 0x01) {
+		uint8_t *uBuf = vBuf;
+
+		while (len--) {
+			uint16_t value = *hPM;
+			hPM += stride;
+			*uBuf++ = value;
+			*uBuf++ = value >> 8;
+		}
+
+		if (odd) {
+			*uBuf = *hPM;
+		}
+
+		return;
+	}
+#endif /* !defined(__ARM_FEATURE_UNALIGNED) */
+
+	fsdev_ram16 *hBuf = vBuf;
+
+	while (len--) {
+		*hBuf++ = *hPM;
+		hPM += stride;
+	}
+
+	if (odd) {
+		*(uint8_t *) hBuf = *hPM;
+	}
+}
+
+/* Kernels with compile time stride (as selected by the backend) */
+static void new_write(unsigned stride, uint16_t usb_local, const void *buf,
+						uint16_t len)
+{
+	if (stride == 2) {
+		fsdev_pma_write(2, &pma[usb_local], buf, len);
+	} else {
+		fsdev_pma_write(1, &pma[usb_local / 2], buf, len);
+	}
+}
+
+static void new_read(unsigned stride, void *buf, uint16_t usb_local,
+						uint16_t len)
+{
+	if (stride == 2) {
+		fsdev_pma_read(2, buf, &pma[usb_local], len);
+	} else {
+		fsdev_pma_read(1, buf, &pma[usb_local / 2], len);
+	}
+}
+
+static void pma_fill(unsigned seed)
+{
+	unsigned i;
+
+	for (i = 0; i < PMA_BYTES; i++) {
+		pma[i] = (i * 0x9E37) ^ seed;
+	}
+}
+
+/**
+ * Compare PMA after write of @a len bytes
+ * If @a len is odd, the high byte of the last halfword is padding
+ *  (previous implementation copied the byte following the buffer)
+ */
+static int pma_compare(const uint16_t *expected, unsigned stride,
+						uint16_t usb_local, uint16_t len)
+{
+	unsigned pad = (len & 1) ? (usb_local + len - 1) / 2 * stride : ~0u;
+	unsigned i;
+
+	for (i = 0; i < PMA_BYTES; i++) {
+		uint16_t mask = (i == pad) ? 0x00FF : 0xFFFF;
+
+		if ((pma[i] ^ expected[i]) & mask) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int check(unsigned stride)
+{
+	static uint8_t src[MAX_LEN + 8], ref_dst[MAX_LEN + 8], new_dst[MAX_LEN + 8];
+	static uint16_t expected[PMA_BYTES];
+	unsigned align, len, i, k;
+
+	/* Buffer at start and at end of packet memory */
+	const uint16_t locals[2] = {0, ((PMA_BYTES / stride) - MAX_LEN - 1) & ~1};
+
+	ref_stride = stride;
+
+	for (i = 0; i < sizeof(src); i++) {
+		src[i] = i * 7 + 1;
+	}
+
+	for (align = 0; align < 4; align++) {
+		for (len = 0; len <= MAX_LEN; len++) {
+			for (k = 0; k < 2; k++) {
+				uint16_t usb_local = locals[k];
+
+				pma_fill(len);
+				ref_write(usb_local, src + align, len);
+				for (i = 0; i < PMA_BYTES; i++) {
+					expected[i] = pma[i];
+				}
+
+				pma_fill(len);
+				new_write(stride, usb_local, src + align, len);
+				if (pma_compare(expected, stride, usb_local, len)) {
+					fprintf(stderr, "write mismatch: stride %u, align %u, "
+						"len %u\n", stride, align, len);
+					return -1;
+				}
+
+				memset(ref_dst, 0xA5, sizeof(ref_dst));
+				memset(new_dst, 0xA5, sizeof(new_dst));
+				ref_read(ref_dst + align, usb_local, len);
+				new_read(stride, new_dst + align, usb_local, len);
+				if (memcmp(ref_dst, new_dst, sizeof(ref_dst))) {
+					fprintf(stderr, "read mismatch: stride %u, align %u, "
+						"len %u\n", stride, align, len);
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Best of REPEAT runs (host frequency scaling and noise) */
+#define BEST_NS(result, stmt) do { \
+	unsigned r_, i_; \
+	result = 1e30; \
+	for (r_ = 0; r_ < REPEAT; r_++) { \
+		double start_ = now_ns(); \
+		for (i_ = 0; i_ < ITERATIONS; i_++) { \
+			stmt; \
+		} \
+		double ns_ = (now_ns() - start_) / ITERATIONS; \
+		if (ns_ < result) { \
+			result = ns_; \
+		} \
+	} \
+} while (0)
+
+static void bench(unsigned stride, unsigned align)
+{
+	static uint8_t buf[PACKET + 8];
+	double ref_w, ref_r, new_w, new_r;
+
+	ref_stride = stride;
+
+	BEST_NS(ref_w, ref_write(64, buf + align, PACKET));
+	BEST_NS(new_w, new_write(stride, 64, buf + align, PACKET));
+	BEST_NS(ref_r, ref_read(buf + align, 64, PACKET));
+	BEST_NS(new_r, new_read(stride, buf + align, 64, PACKET));
+
+	printf("stride %u align %u: write %6.1f -> %6.1f ns  "
+		"read %6.1f -> %6.1f ns (%u bytes)\n", stride, align,
+		ref_w, new_w, ref_r, new_r, PACKET);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned stride, align;
+
+	for (stride = 1; stride <= 2; stride++) {
+		if (check(stride)) {
+			return EXIT_FAILURE;
+		}
+	}
+
+#if defined(__ARM_FEATURE_UNALIGNED)
+	printf("pma-bench (unaligned access): byte exact\n");
+#else
+	printf("pma-bench: byte exact\n");
+#endif
+
+	if (argc < 2 || strcmp(argv[1], "-b")) {
+		return EXIT_SUCCESS;
+	}
+
+	for (stride = 1; stride <= 2; stride++) {
+		for (align = 0; align < 4; align++) {
+			bench(stride, align);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scatter-gather (USBD_FLAG_SEGMENTED) transfer test using loopback backend.
+ *
+ * Bulk IN and OUT transfers are done with odd sized (and zero length)
+ *  segments, so that packets straddle segments. Data seen by the host
+ *  (IN) or stored in segments (OUT) is compared with the reference.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbd_loopback.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.bNumConfigurations = 1
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	}
+};
+
+/* Segment sizes (sum = 300) */
+static const size_t seg_len[] = {3, 0, 5, 64, 1, 1, 7, 0, 100, 2, 117};
+#define SEG_COUNT (sizeof(seg_len) / sizeof(seg_len[0]))
+#define TOTAL_LEN 300
+
+static uint8_t reference[TOTAL_LEN];
+static uint8_t storage[TOTAL_LEN];
+static usbd_segment segments[SEG_COUNT];
+
+static usbd_transfer_status last_status;
+static size_t last_transferred;
+static unsigned callback_count;
+
+static void callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	(void) dev;
+	(void) urb_id;
+
+	last_status = status;
+	last_transferred = transfer->transferred;
+	callback_count++;
+}
+
+/**
+ * Build the segment list over @a storage
+ */
+static void prepare_segments(void)
+{
+	size_t i, pos = 0;
+
+	for (i = 0; i < SEG_COUNT; i++) {
+		segments[i].ptr = storage + pos;
+		segments[i].len = seg_len[i];
+		pos += seg_len[i];
+	}
+}
+
+static void submit(usbd_device *dev, uint8_t ep_addr, uint16_t ep_size,
+			size_t seg_count)
+{
+	const usbd_transfer transfer = {
+		.ep_type = USBD_EP_BULK,
+		.ep_addr = ep_addr,
+		.ep_size = ep_size,
+		.ep_interval = USBD_INTERVAL_NA,
+		.buffer = segments,
+		.length = TOTAL_LEN,
+		.seg_count = seg_count,
+		.flags = USBD_FLAG_SEGMENTED,
+		.timeout = USBD_TIMEOUT_NEVER,
+		.callback = callback
+	};
+
+	callback_count = 0;
+	usbd_transfer_submit(dev, &transfer);
+}
+
+static int test_in(usbd_device *dev, uint16_t ep_size)
+{
+	uint8_t received[TOTAL_LEN + 1024];
+	size_t pos = 0;
+	uint16_t len;
+
+	memcpy(storage, reference, TOTAL_LEN);
+	prepare_segments();
+	submit(dev, EP_IN, ep_size, SEG_COUNT);
+
+	while (!callback_count && pos < TOTAL_LEN) {
+		if (usbd_loopback_in(dev, EP_IN, received + pos, ep_size, &len) !=
+				USBD_LOOPBACK_ACK) {
+			break;
+		}
+		pos += len;
+	}
+
+	if (callback_count != 1 || last_status != USBD_SUCCESS ||
+		pos != TOTAL_LEN || memcmp(received, reference, TOTAL_LEN)) {
+		fprintf(stderr, "IN (ep_size=%"PRIu16") failed\n", ep_size);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int test_out(usbd_device *dev, uint16_t ep_size)
+{
+	size_t pos = 0;
+
+	memset(storage, 0, TOTAL_LEN);
+	prepare_segments();
+	submit(dev, EP_OUT, ep_size, SEG_COUNT);
+
+	while (!callback_count && pos < TOTAL_LEN) {
+		uint16_t len = TOTAL_LEN - pos;
+		if (len > ep_size) {
+			len = ep_size;
+		}
+
+		if (usbd_loopback_out(dev, EP_OUT, reference + pos, len) !=
+				USBD_LOOPBACK_ACK) {
+			break;
+		}
+		pos += len;
+	}
+
+	if (callback_count != 1 || last_status != USBD_SUCCESS ||
+		last_transferred != TOTAL_LEN ||
+		memcmp(storage, reference, TOTAL_LEN)) {
+		fprintf(stderr, "OUT (ep_size=%"PRIu16") failed\n", ep_size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Segments that do not add up to the transfer length are refused */
+static int test_invalid(usbd_device *dev)
+{
+	prepare_segments();
+	submit(dev, EP_IN, 64, SEG_COUNT - 1);
+
+	if (callback_count != 1 || last_status != USBD_ERR_INVALID) {
+		fprintf(stderr, "Segment sum mismatch not refused\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	static const uint16_t ep_sizes[] = {8, 16, 64, 512};
+	unsigned i;
+
+	for (i = 0; i < TOTAL_LEN; i++) {
+		reference[i] = i * 7 + 3;
+	}
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+
+	for (i = 0; i < sizeof(ep_sizes) / sizeof(ep_sizes[0]); i++) {
+		if (test_in(dev, ep_sizes[i]) || test_out(dev, ep_sizes[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (test_invalid(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("sg-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,278 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_stream test using loopback backend.
+ *
+ * IN: application write odd sized pieces, host read packets.
+ *   Data must arrive in order, and a partial slot must be sent
+ *   as soon as the endpoint is idle.
+ * Flush: host read is ended by a ZLP when the data already armed end
+ *   with a full packet.
+ * OUT: host send full and short packets, application read odd sized
+ *   pieces. Host must get NAK only when all slots are full.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/stream.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_IN 0x81
+#define EP_OUT 0x01
+#define EP_SIZE 64
+#define CHUNK (EP_SIZE * 2)
+#define DEPTH 3
+#define TOTAL_LEN 5000
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.bNumConfigurations = 1
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	}
+};
+
+static uint8_t reference[TOTAL_LEN];
+static uint8_t ring[DEPTH * CHUNK];
+static unsigned notify_count;
+
+static void notify(usbd_stream *stream)
+{
+	(void) stream;
+	notify_count++;
+}
+
+static void stream_setup(usbd_stream *stream, usbd_device *dev,
+							uint8_t ep_addr)
+{
+	const usbd_stream_config config = {
+		.ep_addr = ep_addr,
+		.ep_size = EP_SIZE,
+		.buffer = ring,
+		.chunk = CHUNK,
+		.depth = DEPTH,
+		.callback = notify
+	};
+
+	notify_count = 0;
+	usbd_stream_init(stream, dev, &config);
+	usbd_stream_start(stream);
+}
+
+static int test_in(usbd_device *dev)
+{
+	static uint8_t received[TOTAL_LEN];
+	usbd_stream stream;
+	usbd_stream_stats stats;
+	size_t written = 0, pos = 0;
+	unsigned round = 0;
+	uint16_t len;
+
+	stream_setup(&stream, dev, EP_IN);
+	CHECK(usbd_stream_space(&stream) == DEPTH * CHUNK);
+
+	/* Nothing written, nothing to send */
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	/* Endpoint idle: partial data is sent immediately */
+	CHECK(usbd_stream_write(&stream, reference, 10) == 10);
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 10 && !memcmp(received, reference, 10));
+	written = pos = 10;
+
+	/* Producer and consumer at different pace */
+	while (pos < TOTAL_LEN) {
+		size_t n = MIN((size_t) 37, TOTAL_LEN - written);
+		written += usbd_stream_write(&stream, reference + written, n);
+
+		if (++round % 3) {
+			continue;
+		}
+
+		if (usbd_loopback_in(dev, EP_IN, received + pos, EP_SIZE, &len) ==
+				USBD_LOOPBACK_ACK) {
+			pos += len;
+		}
+	}
+
+	CHECK(written == TOTAL_LEN);
+	CHECK(!memcmp(received, reference, TOTAL_LEN));
+
+	/* Fill all slots: rest is dropped */
+	CHECK(usbd_stream_write(&stream, reference, TOTAL_LEN) == DEPTH * CHUNK);
+	CHECK(usbd_stream_space(&stream) == 0);
+
+	usbd_stream_get_stats(&stream, &stats);
+	CHECK(stats.overrun > 0);
+	CHECK(stats.errors == 0);
+	CHECK(stats.bytes == TOTAL_LEN);
+	CHECK(notify_count == stats.urbs);
+
+	usbd_stream_stop(&stream);
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+	CHECK(usbd_stream_write(&stream, reference, 1) == 0);
+
+	return 0;
+}
+
+static int test_flush(usbd_device *dev)
+{
+	uint8_t received[EP_SIZE];
+	usbd_stream stream;
+	unsigned i;
+	uint16_t len;
+
+	stream_setup(&stream, dev, EP_IN);
+
+	/* Full slot already armed when flushed: ZLP after it */
+	CHECK(usbd_stream_write(&stream, reference, CHUNK) == CHUNK);
+	usbd_stream_flush(&stream);
+	for (i = 0; i < CHUNK / EP_SIZE; i++) {
+		CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+				USBD_LOOPBACK_ACK);
+		CHECK(len == EP_SIZE);
+	}
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 0);
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	/* All slots armed when flushed: ZLP armed on completion */
+	CHECK(usbd_stream_write(&stream, reference, DEPTH * CHUNK) ==
+			DEPTH * CHUNK);
+	usbd_stream_flush(&stream);
+	CHECK(stream.zlp_pending);
+	for (i = 0; i < DEPTH * CHUNK / EP_SIZE; i++) {
+		CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+				USBD_LOOPBACK_ACK);
+		CHECK(len == EP_SIZE);
+	}
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 0);
+
+	/* Endpoint idle after a full slot: ZLP armed at once */
+	CHECK(usbd_stream_write(&stream, reference, CHUNK) == CHUNK);
+	for (i = 0; i < CHUNK / EP_SIZE; i++) {
+		CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+				USBD_LOOPBACK_ACK);
+	}
+	usbd_stream_flush(&stream);
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(len == 0);
+
+	/* Already ended by a short packet: nothing more */
+	CHECK(usbd_stream_write(&stream, reference, 10) == 10);
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_ACK);
+	usbd_stream_flush(&stream);
+	CHECK(usbd_loopback_in(dev, EP_IN, received, EP_SIZE, &len) ==
+			USBD_LOOPBACK_NAK);
+
+	usbd_stream_stop(&stream);
+	return 0;
+}
+
+static int test_out(usbd_device *dev)
+{
+	static uint8_t received[TOTAL_LEN];
+	usbd_stream stream;
+	usbd_stream_stats stats;
+	size_t sent = 0, pos = 0;
+	unsigned i;
+
+	stream_setup(&stream, dev, EP_OUT);
+
+	/* Nothing received yet */
+	CHECK(usbd_stream_read(&stream, received, 1) == 0);
+
+	/* Short packet complete the slot, all slots full after DEPTH packets */
+	for (i = 0; i < DEPTH; i++) {
+		CHECK(usbd_loopback_out(dev, EP_OUT, reference + sent, 5) ==
+			USBD_LOOPBACK_ACK);
+		sent += 5;
+	}
+
+	CHECK(usbd_loopback_out(dev, EP_OUT, reference + sent, 5) ==
+			USBD_LOOPBACK_NAK);
+	CHECK(usbd_stream_space(&stream) == sent);
+
+	/* Mixed packet sizes */
+	while (pos < TOTAL_LEN) {
+		if (sent < TOTAL_LEN) {
+			uint16_t len = MIN((sent % 3) ? EP_SIZE : 23, TOTAL_LEN - sent);
+			if (usbd_loopback_out(dev, EP_OUT, reference + sent, len) ==
+					USBD_LOOPBACK_ACK) {
+				sent += len;
+			}
+		}
+
+		pos += usbd_stream_read(&stream, received + pos,
+					MIN((size_t) 50, TOTAL_LEN - pos));
+	}
+
+	CHECK(!memcmp(received, reference, TOTAL_LEN));
+
+	usbd_stream_get_stats(&stream, &stats);
+	CHECK(stats.overrun > 0);
+	CHECK(stats.underrun > 0);
+	CHECK(stats.errors == 0);
+	CHECK(stats.bytes == TOTAL_LEN);
+	CHECK(notify_count == stats.urbs);
+
+	usbd_stream_stop(&stream);
+	CHECK(usbd_loopback_out(dev, EP_OUT, reference, 1) ==
+			USBD_LOOPBACK_NAK);
+
+	return 0;
+}
+
+int main(void)
+{
+	unsigned i;
+
+	for (i = 0; i < TOTAL_LEN; i++) {
+		reference[i] = i * 13 + (i >> 8);
+	}
+
+	usbd_device *dev = usbd_init(USBD_LOOPBACK, NULL, &info);
+
+	if (test_in(dev) || test_flush(dev) || test_out(dev)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("stream-test: OK\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks of the test programs.
+ * On failure, the location is printed and the calling function return -1.
+ */
+
+#ifndef TEST_CHECK_H
+#define TEST_CHECK_H
+
+#include <stdio.h>
+
+/**
+ * Check a condition
+ * @param cond Condition
+ */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%i: check failed: %s\n", \
+				__FILE__, __LINE__, #cond); \
+		return -1; \
+	} \
+} while (0)
+
+/**
+ * Check that a register model did not record a violation
+ * @param error Model error (NULL if none), ie dwc_otg_model_error()
+ */
+#define CHECK_MODEL(error) do { \
+	const char *error_ = (error); \
+	if (error_ != NULL) { \
+		fprintf(stderr, "%s:%i: model: %s\n", \
+				__FILE__, __LINE__, error_); \
+		return -1; \
+	} \
+} while (0)
+
+#endif
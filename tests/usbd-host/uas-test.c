@@ -0,0 +1,786 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_uas test using loopback backend (high speed).
+ *
+ * - INQUIRY, READ CAPACITY, TEST UNIT READY through the SCSI layer
+ * - A batch of reads and writes (some larger than a task buffer) queued
+ *   by the host, with a backend completing out of order: the queue fill
+ *   upto the depth (then NAK), data and status come back out of order,
+ *   medium content and data read are checked
+ * - Same batch with a synchronous backend (no read_start/write_start)
+ * - Errors: LBA out of range, unknown opcode, backend failure (CHECK
+ *   CONDITION with sense data), overlapped tag (RESPONSE IU)
+ * - Task management: QUERY TASK, ABORT TASK of a command waiting for the
+ *   backend (no status sent for it), unsupported function
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/uas.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_COMMAND 0x01
+#define EP_STATUS 0x82
+#define EP_DATA_IN 0x83
+#define EP_DATA_OUT 0x04
+#define EP_SIZE 512
+
+#define BLOCKS 256
+#define BLOCK_SIZE 512
+#define QUEUE_DEPTH 8
+#define TASK_BLOCKS 4
+
+/* Backend accesses in flight */
+#define MEDIA_OPS 16
+
+/* Give up a command after this many polls */
+#define TIMEOUT 100000
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x0010,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 250
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static const struct usbd_backend_config hs_config = {
+	.ep_count = 16,
+	.speed = USBD_SPEED_HIGH
+};
+
+static usbd_uas uas;
+static uint32_t task_buffer[QUEUE_DEPTH * TASK_BLOCKS * BLOCK_SIZE / 4];
+
+/* Medium, and block which fail */
+static uint8_t disk[BLOCKS][BLOCK_SIZE];
+static uint32_t bad_lba = UINT32_MAX;
+
+/* Backend accesses in flight: completed when their delay expire */
+static struct {
+	bool write;
+	uint32_t lba, count;
+	void *buf;
+	unsigned delay;
+	usbd_msc_backend_callback done;
+	void *ctx;
+} ops[MEDIA_OPS];
+static unsigned ops_count;
+static bool media_hold;
+
+static int media_access(bool write, uint32_t lba, uint32_t count, void *buf)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (lba + i == bad_lba) {
+			return -1;
+		}
+
+		if (write) {
+			memcpy(disk[lba + i], (uint8_t *) buf + i * BLOCK_SIZE,
+				BLOCK_SIZE);
+		} else {
+			memcpy((uint8_t *) buf + i * BLOCK_SIZE, disk[lba + i],
+				BLOCK_SIZE);
+		}
+	}
+
+	return 0;
+}
+
+static int read_block(const usbd_msc_backend *backend, uint32_t lba,
+			void *copy_to)
+{
+	(void) backend;
+	return media_access(false, lba, 1, copy_to);
+}
+
+static int write_block(const usbd_msc_backend *backend, uint32_t lba,
+			const void *copy_from)
+{
+	(void) backend;
+	return media_access(true, lba, 1, (void *) copy_from);
+}
+
+static int media_start(bool write, uint32_t lba, uint32_t count, void *buf,
+			usbd_msc_backend_callback done, void *ctx)
+{
+	if (ops_count == MEDIA_OPS) {
+		return -1;
+	}
+
+	/* Latency depend on the location: accesses finish out of order */
+	ops[ops_count].write = write;
+	ops[ops_count].lba = lba;
+	ops[ops_count].count = count;
+	ops[ops_count].buf = buf;
+	ops[ops_count].delay = 2 + ((lba * 7) % 13) * 3;
+	ops[ops_count].done = done;
+	ops[ops_count].ctx = ctx;
+	ops_count++;
+	return 0;
+}
+
+static int read_start(const usbd_msc_backend *backend, uint32_t lba,
+			uint32_t count, void *copy_to,
+			usbd_msc_backend_callback done, void *ctx)
+{
+	(void) backend;
+	return media_start(false, lba, count, copy_to, done, ctx);
+}
+
+static int write_start(const usbd_msc_backend *backend, uint32_t lba,
+			uint32_t count, const void *copy_from,
+			usbd_msc_backend_callback done, void *ctx)
+{
+	(void) backend;
+	return media_start(true, lba, count, (void *) copy_from, done, ctx);
+}
+
+/* "Interrupt" of the medium */
+static void media_tick(void)
+{
+	unsigned i = 0;
+
+	while (i < ops_count) {
+		if (media_hold || --ops[i].delay) {
+			i++;
+			continue;
+		}
+
+		ops[i].done(ops[i].ctx, media_access(ops[i].write, ops[i].lba,
+						ops[i].count, ops[i].buf));
+		ops[i] = ops[--ops_count];
+	}
+}
+
+static const usbd_msc_backend async_backend = {
+	.vendor_id = "ucmx",
+	.product_id = "uas-test",
+	.product_rev = "1.0",
+	.block_count = BLOCKS,
+	.read_block = read_block,
+	.write_block = write_block,
+	.read_start = read_start,
+	.write_start = write_start
+};
+
+static const usbd_msc_backend sync_backend = {
+	.vendor_id = "ucmx",
+	.product_id = "uas-test",
+	.product_rev = "1.0",
+	.block_count = BLOCKS,
+	.read_block = read_block,
+	.write_block = write_block
+};
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_COMMAND, USBD_EP_BULK, EP_SIZE,
+				USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_STATUS, USBD_EP_BULK, EP_SIZE,
+				USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_DATA_IN, USBD_EP_BULK, EP_SIZE,
+				USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_ep_prepare(dev, EP_DATA_OUT, USBD_EP_BULK, EP_SIZE,
+				USBD_INTERVAL_NA, USBD_EP_NONE);
+	usbd_uas_start(&uas);
+}
+
+static void device_poll(usbd_device *dev)
+{
+	usbd_poll(dev, 125);
+	media_tick();
+	usbd_uas_poll(&uas);
+}
+
+/* Host: command */
+struct command {
+	uint16_t tag;
+	uint8_t cdb[16];
+	uint8_t *data;
+	uint32_t length;
+	bool write;
+
+	/* Result */
+	bool done;
+	uint8_t status;
+	uint8_t sense[18];
+	unsigned order;
+};
+
+static unsigned completed;
+
+static uint16_t be16(const void *ptr)
+{
+	const uint8_t *bytes = ptr;
+
+	return (bytes[0] << 8) | bytes[1];
+}
+
+static void rw10(struct command *cmd, uint16_t tag, bool write, uint32_t lba,
+			uint16_t blocks, uint8_t *data)
+{
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->tag = tag;
+	cmd->cdb[0] = write ? USB_MSC_SCSI_WRITE_10 : USB_MSC_SCSI_READ_10;
+	cmd->cdb[2] = lba >> 24;
+	cmd->cdb[3] = lba >> 16;
+	cmd->cdb[4] = lba >> 8;
+	cmd->cdb[5] = lba;
+	cmd->cdb[7] = blocks >> 8;
+	cmd->cdb[8] = blocks;
+	cmd->data = data;
+	cmd->length = blocks * BLOCK_SIZE;
+	cmd->write = write;
+}
+
+/**
+ * Send a COMMAND IU
+ * @return handshake (NAK: queue full)
+ */
+static enum usbd_loopback_handshake host_command(usbd_device *dev,
+					const struct command *cmd)
+{
+	struct usb_msc_uas_command_iu iu;
+
+	memset(&iu, 0, sizeof(iu));
+	iu.bIUID = USB_MSC_UAS_IU_COMMAND;
+	iu.wTag = (cmd->tag >> 8) | (cmd->tag << 8);
+	memcpy(iu.CDB, cmd->cdb, sizeof(iu.CDB));
+	return usbd_loopback_out(dev, EP_COMMAND, &iu, sizeof(iu));
+}
+
+static enum usbd_loopback_handshake host_tm(usbd_device *dev, uint16_t tag,
+				uint8_t function, uint16_t managed)
+{
+	struct usb_msc_uas_task_management_iu iu;
+
+	memset(&iu, 0, sizeof(iu));
+	iu.bIUID = USB_MSC_UAS_IU_TASK_MANAGEMENT;
+	iu.wTag = (tag >> 8) | (tag << 8);
+	iu.bFunction = function;
+	iu.wTagOfManagedTask = (managed >> 8) | (managed << 8);
+	return usbd_loopback_out(dev, EP_COMMAND, &iu, sizeof(iu));
+}
+
+/**
+ * Move the data of @a cmd on its data pipe (after READ/WRITE READY)
+ * @return 0 on success, -1 on error
+ */
+static int host_data(usbd_device *dev, struct command *cmd, bool write)
+{
+	uint32_t pos = 0;
+	unsigned wait = 0;
+
+	CHECK(write == cmd->write);
+
+	while (pos < cmd->length) {
+		enum usbd_loopback_handshake hs;
+		uint16_t len = MIN(EP_SIZE, cmd->length - pos);
+
+		if (write) {
+			hs = usbd_loopback_out(dev, EP_DATA_OUT, cmd->data + pos, len);
+		} else {
+			hs = usbd_loopback_in(dev, EP_DATA_IN, cmd->data + pos,
+						EP_SIZE, &len);
+		}
+
+		if (hs == USBD_LOOPBACK_NAK) {
+			/* Next chunk not ready */
+			CHECK(++wait < TIMEOUT);
+			device_poll(dev);
+			continue;
+		}
+
+		CHECK(hs == USBD_LOOPBACK_ACK);
+		pos += len;
+
+		if (len < EP_SIZE) {
+			break;
+		}
+	}
+
+	/* Non block data can be shorter */
+	cmd->length = pos;
+	return 0;
+}
+
+/**
+ * Read one IU from the status pipe and handle it
+ * @param[in] cmds Commands in flight
+ * @param[in] count Number of @a cmds
+ * @param[out] response RESPONSE IU received (can be NULL)
+ * @return 1 if a IU was handled, 0 if none, -1 on error
+ */
+static int host_status(usbd_device *dev, struct command *cmds, unsigned count,
+			struct usb_msc_uas_response_iu *response)
+{
+	uint8_t buf[EP_SIZE];
+	uint16_t len, tag;
+	unsigned i;
+
+	if (usbd_loopback_in(dev, EP_STATUS, buf, sizeof(buf), &len) !=
+			USBD_LOOPBACK_ACK) {
+		return 0;
+	}
+
+	CHECK(len >= 4);
+	tag = be16(&buf[2]);
+
+	if (buf[0] == USB_MSC_UAS_IU_RESPONSE) {
+		CHECK(response != NULL && len == sizeof(*response));
+		memcpy(response, buf, sizeof(*response));
+		return 1;
+	}
+
+	for (i = 0; i < count && (cmds[i].tag != tag || cmds[i].done); i++);
+	CHECK(i < count);
+
+	switch (buf[0]) {
+	case USB_MSC_UAS_IU_READ_READY:
+		CHECK(len == sizeof(struct usb_msc_uas_ready_iu));
+		CHECK(host_data(dev, &cmds[i], false) == 0);
+	break;
+	case USB_MSC_UAS_IU_WRITE_READY:
+		CHECK(len == sizeof(struct usb_msc_uas_ready_iu));
+		CHECK(host_data(dev, &cmds[i], true) == 0);
+	break;
+	case USB_MSC_UAS_IU_SENSE: {
+		const struct usb_msc_uas_sense_iu *iu = (const void *) buf;
+		uint16_t sense_len = be16(&iu->wLength);
+
+		CHECK(len == sizeof(*iu) + sense_len);
+		cmds[i].done = true;
+		cmds[i].status = iu->bStatus;
+		cmds[i].order = completed++;
+		memcpy(cmds[i].sense, buf + sizeof(*iu),
+			MIN(sense_len, sizeof(cmds[i].sense)));
+	} break;
+	default:
+		CHECK(0);
+	}
+
+	return 1;
+}
+
+/**
+ * Queue @a cmds (as fast as the device accept them) and run them
+ * @return 0 on success, -1 on error
+ */
+static int host_run(usbd_device *dev, struct command *cmds, unsigned count)
+{
+	unsigned sent = 0, done, polls = 0;
+	unsigned i;
+
+	completed = 0;
+
+	do {
+		int res;
+
+		if (sent < count) {
+			enum usbd_loopback_handshake hs = host_command(dev, &cmds[sent]);
+
+			CHECK(hs != USBD_LOOPBACK_STALL);
+			sent += hs == USBD_LOOPBACK_ACK;
+		}
+
+		res = host_status(dev, cmds, sent, NULL);
+		CHECK(res >= 0);
+
+		device_poll(dev);
+		CHECK(++polls < TIMEOUT);
+
+		for (i = 0, done = 0; i < count; i++) {
+			done += cmds[i].done;
+		}
+	} while (done < count);
+
+	return 0;
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	CHECK(uas.running);
+	return 0;
+}
+
+static int test_info(usbd_device *dev)
+{
+	struct command cmds[3];
+	uint8_t inquiry[96], capacity[8];
+
+	memset(cmds, 0, sizeof(cmds));
+	cmds[0].tag = 1;
+	cmds[0].cdb[0] = USB_MSC_SCSI_INQUIRY;
+	cmds[0].cdb[4] = sizeof(inquiry);
+	cmds[0].data = inquiry;
+	cmds[0].length = sizeof(inquiry);
+
+	cmds[1].tag = 2;
+	cmds[1].cdb[0] = USB_MSC_SCSI_READ_CAPACITY;
+	cmds[1].data = capacity;
+	cmds[1].length = sizeof(capacity);
+
+	cmds[2].tag = 3;
+	cmds[2].cdb[0] = USB_MSC_SCSI_TEST_UNIT_READY;
+
+	CHECK(host_run(dev, cmds, 3) == 0);
+
+	CHECK(cmds[0].status == USB_MSC_SCSI_STATUS_GOOD);
+	CHECK(cmds[0].length == 36 && !memcmp(&inquiry[8], "ucmx", 4));
+	CHECK(!memcmp(&inquiry[16], "uas-test", 8));
+
+	CHECK(cmds[1].status == USB_MSC_SCSI_STATUS_GOOD);
+	CHECK(cmds[1].length == 8);
+	CHECK(be16(&capacity[2]) == BLOCKS - 1 && be16(&capacity[6]) == 512);
+
+	CHECK(cmds[2].status == USB_MSC_SCSI_STATUS_GOOD);
+	return 0;
+}
+
+#define BATCH 16
+
+static uint8_t host_buf[BATCH][16 * BLOCK_SIZE];
+
+static uint8_t pattern(uint32_t lba, unsigned i, unsigned round)
+{
+	return (lba * 13) + (i * 7) + (i >> 8) + round * 101;
+}
+
+/**
+ * Reads and writes of 1 - 9 blocks to disjoint ranges
+ * @param[in] round Round (content written)
+ * @return 0 on success, -1 on error
+ */
+static int test_batch(usbd_device *dev, unsigned round)
+{
+	struct command cmds[BATCH];
+	unsigned i, j, late = 0;
+
+	for (i = 0; i < BLOCKS; i++) {
+		for (j = 0; j < BLOCK_SIZE; j++) {
+			disk[i][j] = pattern(i, j, 0);
+		}
+	}
+
+	for (i = 0; i < BATCH; i++) {
+		uint32_t lba = i * 16;
+		uint16_t blocks = 1 + (i * 5) % 9;
+		bool write = i % 3 == 1;
+
+		rw10(&cmds[i], 0x100 + i, write, lba, blocks, host_buf[i]);
+
+		if (write) {
+			for (j = 0; j < blocks * BLOCK_SIZE; j++) {
+				host_buf[i][j] = pattern(lba + j / BLOCK_SIZE,
+						j % BLOCK_SIZE, round);
+			}
+		} else {
+			memset(host_buf[i], 0, sizeof(host_buf[i]));
+		}
+	}
+
+	CHECK(host_run(dev, cmds, BATCH) == 0);
+
+	for (i = 0; i < BATCH; i++) {
+		uint32_t lba = i * 16;
+
+		CHECK(cmds[i].status == USB_MSC_SCSI_STATUS_GOOD);
+		CHECK(cmds[i].length == (1 + (i * 5) % 9) * BLOCK_SIZE);
+
+		for (j = 0; j < cmds[i].length; j++) {
+			uint8_t expect = pattern(lba + j / BLOCK_SIZE, j % BLOCK_SIZE,
+						cmds[i].write ? round : 0);
+
+			if (cmds[i].write) {
+				CHECK(disk[lba + j / BLOCK_SIZE][j % BLOCK_SIZE] == expect);
+			} else {
+				CHECK(host_buf[i][j] == expect);
+			}
+		}
+
+		late += cmds[i].order != i;
+	}
+
+	printf("uas-test: round %u, %u of %u commands completed out of order\n",
+			round, late, BATCH);
+	return 0;
+}
+
+static int test_errors(usbd_device *dev)
+{
+	struct usb_msc_uas_response_iu response;
+	struct command cmds[3];
+	uint8_t buf[2 * BLOCK_SIZE];
+	usbd_uas_stats stats;
+	unsigned polls = 0;
+	int res;
+
+	/* Out of range, unknown opcode */
+	rw10(&cmds[0], 1, false, BLOCKS - 1, 2, buf);
+	memset(&cmds[1], 0, sizeof(cmds[1]));
+	cmds[1].tag = 2;
+	cmds[1].cdb[0] = 0xF0;
+	CHECK(host_run(dev, cmds, 2) == 0);
+
+	CHECK(cmds[0].status == USB_MSC_SCSI_STATUS_CHECK_CONDITION);
+	CHECK(cmds[0].sense[2] == 0x05 && cmds[0].sense[12] == 0x21);
+	CHECK(cmds[1].status == USB_MSC_SCSI_STATUS_CHECK_CONDITION);
+	CHECK(cmds[1].sense[2] == 0x05 && cmds[1].sense[12] == 0x20);
+
+	/* Backend failure */
+	bad_lba = 100 + 1;
+	rw10(&cmds[0], 3, false, 100, TASK_BLOCKS + 1, host_buf[0]);
+	CHECK(host_run(dev, cmds, 1) == 0);
+	CHECK(cmds[0].status == USB_MSC_SCSI_STATUS_CHECK_CONDITION);
+	CHECK(cmds[0].sense[2] == 0x03 && cmds[0].sense[12] == 0x11);
+	bad_lba = UINT32_MAX;
+
+	/* Overlapped tag: first command held by the backend */
+	media_hold = true;
+	rw10(&cmds[0], 4, false, 0, 1, buf);
+	CHECK(host_command(dev, &cmds[0]) == USBD_LOOPBACK_ACK);
+	device_poll(dev);
+	CHECK(host_command(dev, &cmds[0]) == USBD_LOOPBACK_ACK);
+
+	do {
+		device_poll(dev);
+		res = host_status(dev, cmds, 1, &response);
+		CHECK(res >= 0 && ++polls < TIMEOUT);
+	} while (!res);
+
+	CHECK(response.bIUID == USB_MSC_UAS_IU_RESPONSE);
+	CHECK(be16(&response.wTag) == 4);
+	CHECK(response.bResponseCode == USB_MSC_UAS_RC_OVERLAPPED_TAG);
+
+	media_hold = false;
+	while (!cmds[0].done) {
+		device_poll(dev);
+		CHECK(host_status(dev, cmds, 1, NULL) >= 0 && ++polls < TIMEOUT);
+	}
+	CHECK(cmds[0].status == USB_MSC_SCSI_STATUS_GOOD);
+
+	usbd_uas_get_stats(&uas, &stats);
+	CHECK(stats.media_errors == 1);
+	return 0;
+}
+
+/**
+ * Send a task management function and wait for its RESPONSE IU
+ * @return response code, -1 on error
+ */
+static int task_management(usbd_device *dev, uint16_t tag, uint8_t function,
+				uint16_t managed)
+{
+	struct usb_msc_uas_response_iu response;
+	unsigned polls = 0;
+	int res;
+
+	CHECK(host_tm(dev, tag, function, managed) == USBD_LOOPBACK_ACK);
+
+	do {
+		device_poll(dev);
+		res = host_status(dev, NULL, 0, &response);
+		CHECK(res >= 0 && ++polls < TIMEOUT);
+	} while (!res);
+
+	CHECK(be16(&response.wTag) == tag);
+	return response.bResponseCode;
+}
+
+static int test_task_management(usbd_device *dev)
+{
+	struct command cmds[2];
+	usbd_uas_stats before, after;
+	unsigned i;
+
+	usbd_uas_get_stats(&uas, &before);
+
+	/* Read held by the backend */
+	media_hold = true;
+	rw10(&cmds[0], 7, false, 20, 2, host_buf[0]);
+	CHECK(host_command(dev, &cmds[0]) == USBD_LOOPBACK_ACK);
+	device_poll(dev);
+
+	CHECK(task_management(dev, 8, USB_MSC_UAS_TMF_QUERY_TASK, 7) ==
+			USB_MSC_UAS_RC_TMF_SUCCEEDED);
+	CHECK(task_management(dev, 9, USB_MSC_UAS_TMF_QUERY_TASK, 70) ==
+			USB_MSC_UAS_RC_TMF_COMPLETE);
+	CHECK(task_management(dev, 10, USB_MSC_UAS_TMF_ABORT_TASK, 7) ==
+			USB_MSC_UAS_RC_TMF_COMPLETE);
+	CHECK(task_management(dev, 11, USB_MSC_UAS_TMF_QUERY_TASK, 7) ==
+			USB_MSC_UAS_RC_TMF_COMPLETE);
+	CHECK(task_management(dev, 12, USB_MSC_UAS_TMF_CLEAR_ACA, 0) ==
+			USB_MSC_UAS_RC_TMF_NOT_SUPPORTED);
+
+	/* Backend finish the aborted access: nothing sent */
+	media_hold = false;
+	for (i = 0; i < 200; i++) {
+		device_poll(dev);
+		CHECK(host_status(dev, cmds, 1, NULL) == 0);
+	}
+
+	/* Tag can be reused */
+	rw10(&cmds[0], 7, false, 20, 2, host_buf[0]);
+	rw10(&cmds[1], 13, true, 30, 1, host_buf[1]);
+	CHECK(host_run(dev, cmds, 2) == 0);
+	CHECK(cmds[0].status == USB_MSC_SCSI_STATUS_GOOD);
+	CHECK(cmds[1].status == USB_MSC_SCSI_STATUS_GOOD);
+
+	usbd_uas_get_stats(&uas, &after);
+	CHECK(after.aborted == before.aborted + 1);
+	CHECK(after.task_management == before.task_management + 5);
+	return 0;
+}
+
+static int test_restart(usbd_device *dev)
+{
+	struct command cmd;
+	uint8_t buf[EP_SIZE];
+	uint16_t len;
+	unsigned polls = 0;
+
+	/* Read with its data pipe in flight */
+	rw10(&cmd, 20, false, 40, 2, host_buf[0]);
+	CHECK(host_command(dev, &cmd) == USBD_LOOPBACK_ACK);
+	while (usbd_loopback_in(dev, EP_STATUS, buf, sizeof(buf), &len) !=
+			USBD_LOOPBACK_ACK) {
+		CHECK(++polls < TIMEOUT);
+		device_poll(dev);
+	}
+	CHECK(buf[0] == USB_MSC_UAS_IU_READ_READY);
+	device_poll(dev);
+
+	/* Started again (SET_CONFIGURATION): URB of the old task cancelled */
+	usbd_uas_start(&uas);
+	CHECK(usbd_loopback_in(dev, EP_DATA_IN, buf, sizeof(buf), &len) ==
+			USBD_LOOPBACK_NAK);
+
+	rw10(&cmd, 21, false, 40, 2, host_buf[0]);
+	CHECK(host_run(dev, &cmd, 1) == 0);
+	CHECK(cmd.status == USB_MSC_SCSI_STATUS_GOOD);
+	CHECK(cmd.length == 2 * BLOCK_SIZE);
+	return 0;
+}
+
+static int run(const usbd_msc_backend *backend)
+{
+	const usbd_uas_config config = {
+		.ep_command = EP_COMMAND,
+		.ep_status = EP_STATUS,
+		.ep_data_in = EP_DATA_IN,
+		.ep_data_out = EP_DATA_OUT,
+		.ep_size = EP_SIZE,
+		.backend = backend,
+		.queue_depth = QUEUE_DEPTH,
+		.task_blocks = TASK_BLOCKS,
+		.buffer = task_buffer
+	};
+	usbd_uas_stats stats;
+	usbd_device *dev;
+	unsigned round;
+
+	dev = usbd_init(USBD_LOOPBACK, &hs_config, &info);
+	CHECK(dev != NULL);
+	usbd_uas_init(&uas, dev, &config);
+	usbd_register_set_config_callback(dev, set_config);
+	usbd_loopback_reset(dev);
+
+	CHECK(configure(dev) == 0);
+	CHECK(test_info(dev) == 0);
+
+	for (round = 1; round <= 3; round++) {
+		CHECK(test_batch(dev, round) == 0);
+	}
+
+	usbd_uas_get_stats(&uas, &stats);
+	CHECK(stats.errors == 0);
+
+	if (backend->read_start != NULL) {
+		/* Queue filled while the backend work */
+		CHECK(stats.queue_max == QUEUE_DEPTH);
+		CHECK(stats.reordered > 0);
+		CHECK(test_errors(dev) == 0);
+		CHECK(test_task_management(dev) == 0);
+	}
+
+	CHECK(test_restart(dev) == 0);
+
+	usbd_uas_get_stats(&uas, &stats);
+	printf("uas-test: %s backend: %u commands, queue max %u, "
+		"%u reordered, %u aborted\n",
+		backend->read_start != NULL ? "async" : "sync",
+		stats.commands, stats.queue_max, stats.reordered, stats.aborted);
+
+	usbd_uas_stop(&uas);
+	CHECK(!uas.running);
+	return 0;
+}
+
+int main(void)
+{
+	if (run(&async_backend) || run(&sync_backend)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("uas-test: OK\n");
+	return EXIT_SUCCESS;
+}
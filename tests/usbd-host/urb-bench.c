@@ -0,0 +1,207 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Micro-benchmark of the usbd URB bookkeeping (usbd_transfer.c).
+ *
+ * The whole URB pool (USBD_URB_COUNT, set at compile time) is kept in use
+ *  by submitting bulk transfers to 4 endpoints and re-submitting from
+ *  callback. (one URB is kept spare because the completed URB is only
+ *  released after the callback return) A do-nothing backend is used, so only the core cost is measured:
+ *   - complete: usbd_find_active_urb() + usbd_urb_complete()
+ *               (includes callback, re-submit and scheduling of next URB)
+ *   - cancel: usbd_transfer_cancel() of the newest URB (tail of waiting queue)
+ *   - poll: usbd_poll() when no URB has expired (only with USBD_ENABLE_TIMEOUT,
+ *           every URB is submitted with a different timeout)
+ *
+ * Cost per operation should be flat for all USBD_URB_COUNT.
+ * With USBD_ENABLE_TIMEOUT, all URB are then expired and the order of
+ *  USBD_ERR_TIMEOUT callbacks is checked.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unicore-mx/usbd/usbd.h>
+#include "usbd_private.h"
+
+#define EP_COUNT 4
+#define ITERATIONS 2000000
+
+static struct usbd_device _usbd_dev;
+static const usbd_backend null_backend;
+
+static usbd_urb_id last_urb_id;
+static unsigned callback_count;
+static unsigned timeout_count;
+static uint32_t last_timeout;
+static bool timeout_order_ok = true;
+
+static usbd_device *null_init(const usbd_backend_config *config)
+{
+	(void) config;
+	_usbd_dev.backend = &null_backend;
+	_usbd_dev.config = config;
+	return &_usbd_dev;
+}
+
+static void null_urb(usbd_device *dev, usbd_urb *urb)
+{
+	(void) dev;
+	(void) urb;
+}
+
+static void null_poll(usbd_device *dev)
+{
+	(void) dev;
+}
+
+static const usbd_backend null_backend = {
+	.init = null_init,
+	.poll = null_poll,
+	.urb_submit = null_urb,
+	.urb_cancel = null_urb
+};
+
+static uint8_t buffer[64];
+
+static void resubmit_callback(usbd_device *dev, const usbd_transfer *transfer,
+		usbd_transfer_status status, usbd_urb_id urb_id)
+{
+	(void) urb_id;
+
+	if (status == USBD_ERR_TIMEOUT) {
+		/* Should expire in order of deadline */
+		if (transfer->timeout < last_timeout) {
+			timeout_order_ok = false;
+		}
+
+		last_timeout = transfer->timeout;
+		timeout_count++;
+		return;
+	}
+
+	if (status != USBD_SUCCESS && status != USBD_ERR_CANCEL) {
+		return;
+	}
+
+	callback_count++;
+	last_urb_id = usbd_transfer_submit(dev, transfer);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static unsigned count_unused(usbd_device *dev)
+{
+	unsigned count = 0;
+	usbd_urb *urb;
+
+	for (urb = dev->urbs.unused; urb != NULL; urb = urb->next) {
+		count++;
+	}
+
+	return count;
+}
+
+int main(void)
+{
+	static const struct usbd_info info;
+	unsigned i;
+
+	usbd_device *dev = usbd_init(&null_backend, NULL, &info);
+
+	/* Fill the complete pool (except the spare) */
+	for (i = 0; i < (USBD_URB_COUNT - 1); i++) {
+		const usbd_transfer transfer = {
+			.ep_type = USBD_EP_BULK,
+			.ep_addr = 0x81 + (i % EP_COUNT),
+			.ep_size = 64,
+			.ep_interval = USBD_INTERVAL_NA,
+			.buffer = buffer,
+			.length = sizeof(buffer),
+			.flags = USBD_FLAG_NONE,
+#if defined(USBD_ENABLE_TIMEOUT)
+			/* Deadline order different from submit order */
+			.timeout = 1000 + ((i * 7919) % USBD_URB_COUNT),
+#else
+			.timeout = USBD_TIMEOUT_NEVER,
+#endif
+			.callback = resubmit_callback,
+		};
+
+		last_urb_id = usbd_transfer_submit(dev, &transfer);
+		if (last_urb_id == USBD_INVALID_URB_ID) {
+			fprintf(stderr, "submit %u failed\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+
+	double start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		usbd_urb *urb = usbd_find_active_urb(dev, 0x81 + (i % EP_COUNT));
+		usbd_urb_complete(dev, urb, USBD_SUCCESS);
+	}
+	double complete_ns = (now_ns() - start) / ITERATIONS;
+
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		if (!usbd_transfer_cancel(dev, last_urb_id)) {
+			fprintf(stderr, "cancel %u failed\n", i);
+			return EXIT_FAILURE;
+		}
+	}
+	double cancel_ns = (now_ns() - start) / ITERATIONS;
+
+	/* Pool should still be completly in use (except the spare) */
+	if (count_unused(dev) != 1 || callback_count != 2 * ITERATIONS) {
+		fprintf(stderr, "URB accounting mismatch\n");
+		return EXIT_FAILURE;
+	}
+
+#if defined(USBD_ENABLE_TIMEOUT)
+	start = now_ns();
+	for (i = 0; i < ITERATIONS; i++) {
+		usbd_poll(dev, 0);
+	}
+	double poll_ns = (now_ns() - start) / ITERATIONS;
+
+	/* Expire all */
+	usbd_poll(dev, 2000 * 1000);
+
+	if (timeout_count != (USBD_URB_COUNT - 1) || !timeout_order_ok ||
+		count_unused(dev) != USBD_URB_COUNT) {
+		fprintf(stderr, "URB timeout mismatch\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("USBD_URB_COUNT=%-4u complete: %6.1f ns/op  cancel: %6.1f ns/op"
+		"  poll: %6.1f ns/op (timeout)\n",
+		USBD_URB_COUNT, complete_ns, cancel_ns, poll_ns);
+#else
+	printf("USBD_URB_COUNT=%-4u complete: %6.1f ns/op  cancel: %6.1f ns/op\n",
+		USBD_URB_COUNT, complete_ns, cancel_ns);
+#endif
+
+	return EXIT_SUCCESS;
+}
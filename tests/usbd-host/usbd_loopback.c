@@ -0,0 +1,606 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "usbd_loopback.h"
+
+struct usbd_loopback_private_data {
+	/** Endpoint state (index: [number][0 = OUT, 1 = IN]) */
+	struct {
+		bool stall;
+		bool dtog;
+	} ep[16][2];
+
+	uint8_t address;
+	uint16_t frame_number;
+	bool sof_enable;
+	bool disconnected;
+
+	/** NAK injection */
+	unsigned nak_permille;
+	uint32_t random;
+
+	struct usbd_loopback_stats stats;
+};
+
+#define USBD_DEVICE_EXTRA \
+	struct usbd_loopback_private_data private_data;
+
+#include "usbd_private.h"
+
+/** Number of retry on NAK (in usbd_loopback_control()) */
+#define CONTROL_NAK_RETRY 1000
+
+static struct usbd_device _usbd_dev;
+
+static const struct usbd_backend_config _config = {
+	.ep_count = 16,
+	.priv_mem = 0,
+	.speed = USBD_SPEED_FULL,
+	.feature = USBD_FEATURE_NONE
+};
+
+#define EP_STATE(dev, ep_addr) \
+	(dev)->private_data.ep[(ep_addr) & 0x0F][IS_IN_ENDPOINT(ep_addr)]
+
+static usbd_device *init(const usbd_backend_config *config)
+{
+	if (config == NULL) {
+		config = &_config;
+	}
+
+	memset(&_usbd_dev.private_data, 0, sizeof(_usbd_dev.private_data));
+	_usbd_dev.backend = &usbd_loopback;
+	_usbd_dev.config = config;
+
+	return &_usbd_dev;
+}
+
+static void set_address(usbd_device *dev, uint8_t addr)
+{
+	LOGF_LN("New device address  = %"PRIu8, addr);
+	dev->private_data.address = addr;
+}
+
+static uint8_t get_address(usbd_device *dev)
+{
+	return dev->private_data.address;
+}
+
+/**
+ * Reset state of all non 0 endpoint
+ * @param dev USB Device
+ */
+static void disable_non_ep0(usbd_device *dev)
+{
+	memset(&dev->private_data.ep[1], 0,
+		sizeof(dev->private_data.ep) - sizeof(dev->private_data.ep[0]));
+}
+
+static void ep_prepare_start(usbd_device *dev)
+{
+	disable_non_ep0(dev);
+}
+
+static void ep_prepare(usbd_device *dev, uint8_t addr, usbd_ep_type type,
+				uint16_t max_size, uint16_t interval, usbd_ep_flags flags)
+{
+	(void) type;
+	(void) max_size;
+	(void) interval;
+	(void) flags;
+
+	EP_STATE(dev, addr).stall = false;
+	EP_STATE(dev, addr).dtog = false;
+}
+
+static void set_ep_stall(usbd_device *dev, uint8_t addr, bool stall)
+{
+	EP_STATE(dev, addr).stall = stall;
+}
+
+static bool get_ep_stall(usbd_device *dev, uint8_t addr)
+{
+	return EP_STATE(dev, addr).stall;
+}
+
+static void set_ep_dtog(usbd_device *dev, uint8_t addr, bool dtog)
+{
+	EP_STATE(dev, addr).dtog = dtog;
+}
+
+static bool get_ep_dtog(usbd_device *dev, uint8_t addr)
+{
+	return EP_STATE(dev, addr).dtog;
+}
+
+static void poll(usbd_device *dev)
+{
+	dev->private_data.frame_number = (dev->private_data.frame_number + 1) & 0x7FF;
+
+	if (dev->private_data.sof_enable) {
+		usbd_handle_sof(dev);
+	}
+}
+
+static void disconnect(usbd_device *dev, bool disconnected)
+{
+	dev->private_data.disconnected = disconnected;
+}
+
+static void enable_sof(usbd_device *dev, bool enable)
+{
+	dev->private_data.sof_enable = enable;
+}
+
+static usbd_speed get_speed(usbd_device *dev)
+{
+	return dev->config->speed;
+}
+
+static void urb_submit(usbd_device *dev, usbd_urb *urb)
+{
+	/* Nothing to do, data is moved when the host issue token */
+	(void) dev;
+	(void) urb;
+}
+
+static void urb_cancel(usbd_device *dev, usbd_urb *urb)
+{
+	(void) dev;
+	(void) urb;
+}
+
+static uint16_t frame_number(usbd_device *dev)
+{
+	return dev->private_data.frame_number;
+}
+
+const struct usbd_backend usbd_loopback = {
+	.init = init,
+	.set_address = set_address,
+	.get_address = get_address,
+	.ep_prepare_start = ep_prepare_start,
+	.ep_prepare = ep_prepare,
+	.set_ep_dtog = set_ep_dtog,
+	.get_ep_dtog = get_ep_dtog,
+	.set_ep_stall = set_ep_stall,
+	.get_ep_stall = get_ep_stall,
+	.poll = poll,
+	.disconnect = disconnect,
+	.enable_sof = enable_sof,
+	.get_speed = get_speed,
+	.urb_submit = urb_submit,
+	.urb_cancel = urb_cancel,
+	.frame_number = frame_number
+};
+
+/**
+ * Copy next @a len bytes of @a urb to @a buf
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param buf Buffer
+ * @param len Number of bytes
+ */
+static void urb_to_memory(usbd_device *dev, usbd_urb *urb, void *buf,
+		size_t len)
+{
+	if (!(urb->transfer.flags & USBD_FLAG_SEGMENTED)) {
+		memcpy(buf, usbd_urb_get_buffer_pointer(dev, urb, len), len);
+		return;
+	}
+
+	size_t offset;
+	const usbd_segment *seg = usbd_urb_get_segment(dev, urb, len, &offset);
+	uint8_t *dest = buf;
+
+	for (; len; seg++, offset = 0) {
+		size_t chunk = MIN(seg->len - offset, len);
+		memcpy(dest, (uint8_t *) seg->ptr + offset, chunk);
+		dest += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * Copy @a len bytes from @a buf to @a urb (at current position)
+ * @param dev USB Device
+ * @param urb USB Request Block
+ * @param buf Buffer
+ * @param len Number of bytes
+ */
+static void memory_to_urb(usbd_device *dev, usbd_urb *urb, const void *buf,
+		size_t len)
+{
+	if (!(urb->transfer.flags & USBD_FLAG_SEGMENTED)) {
+		memcpy(usbd_urb_get_buffer_pointer(dev, urb, len), buf, len);
+		return;
+	}
+
+	size_t offset;
+	const usbd_segment *seg = usbd_urb_get_segment(dev, urb, len, &offset);
+	const uint8_t *src = buf;
+
+	for (; len; seg++, offset = 0) {
+		size_t chunk = MIN(seg->len - offset, len);
+		memcpy((uint8_t *) seg->ptr + offset, src, chunk);
+		src += chunk;
+		len -= chunk;
+	}
+}
+
+/* ------------------------------------------------------------------ */
+/* Virtual host */
+
+void usbd_loopback_nak_rate(usbd_device *dev, unsigned permille, uint32_t seed)
+{
+	dev->private_data.nak_permille = permille;
+
+	/* xorshift do not work with 0 */
+	dev->private_data.random = seed ? seed : 1;
+}
+
+/**
+ * Check for common condition (disconnect, stall, nak injection) of IN/OUT token
+ * @param dev USB Device
+ * @param ep_addr Endpoint address (including direction)
+ * @param[out] handshake Handshake (if true returned)
+ * @return true if the token has been handled
+ */
+static bool token_precheck(usbd_device *dev, uint8_t ep_addr,
+		enum usbd_loopback_handshake *handshake)
+{
+	struct usbd_loopback_private_data *priv = &dev->private_data;
+
+	priv->stats.tokens++;
+
+	if (priv->disconnected) {
+		/* Nobody is going to answer, host see it as NAK. */
+		*handshake = USBD_LOOPBACK_NAK;
+		priv->stats.nak++;
+		return true;
+	}
+
+	if (EP_STATE(dev, ep_addr).stall) {
+		*handshake = USBD_LOOPBACK_STALL;
+		priv->stats.stall++;
+		return true;
+	}
+
+	if (priv->nak_permille) {
+		/* xorshift32 */
+		uint32_t x = priv->random;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		priv->random = x;
+
+		if ((x % 1000) < priv->nak_permille) {
+			*handshake = USBD_LOOPBACK_NAK;
+			priv->stats.nak++;
+			priv->stats.nak_injected++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+enum usbd_loopback_handshake usbd_loopback_setup(usbd_device *dev,
+		uint8_t num, const struct usb_setup_data *setup_data)
+{
+	num &= 0x0F;
+
+	dev->private_data.stats.tokens++;
+	dev->private_data.stats.bytes_out += sizeof(*setup_data);
+
+	/* SETUP always clear the STALL on control endpoint */
+	dev->private_data.ep[num][0].stall = false;
+	dev->private_data.ep[num][1].stall = false;
+
+	/* A SETUP abort the on-going control transaction (if any) */
+	usbd_urb *urb = usbd_find_active_urb(dev, num);
+	if (urb != NULL && urb->transfer.ep_type == USBD_EP_CONTROL) {
+		usbd_urb_complete(dev, urb, USBD_ERR_CANCEL);
+	}
+
+	urb = usbd_find_active_urb(dev, num | 0x80);
+	if (urb != NULL && urb->transfer.ep_type == USBD_EP_CONTROL) {
+		usbd_urb_complete(dev, urb, USBD_ERR_CANCEL);
+	}
+
+	usbd_handle_setup(dev, num, setup_data);
+	return USBD_LOOPBACK_ACK;
+}
+
+enum usbd_loopback_handshake usbd_loopback_in(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len)
+{
+	enum usbd_loopback_handshake handshake;
+
+	ep_addr |= 0x80;
+
+	if (token_precheck(dev, ep_addr, &handshake)) {
+		return handshake;
+	}
+
+	usbd_urb *urb = usbd_find_active_urb(dev, ep_addr);
+	if (urb == NULL) {
+		dev->private_data.stats.nak++;
+		return USBD_LOOPBACK_NAK;
+	}
+
+	usbd_transfer *transfer = &urb->transfer;
+	size_t rem = transfer->length - transfer->transferred;
+	size_t pkt_len = MIN(rem, transfer->ep_size);
+
+	if (pkt_len) {
+		uint8_t data[pkt_len];
+		urb_to_memory(dev, urb, data, pkt_len);
+		memcpy(buf, data, MIN(pkt_len, max_len));
+		usbd_urb_inc_data_pointer(dev, urb, pkt_len);
+	}
+
+	*len = MIN(pkt_len, max_len);
+	dev->private_data.stats.bytes_in += *len;
+	EP_STATE(dev, ep_addr).dtog ^= true;
+
+	if (transfer->transferred < transfer->length) {
+		/* More data! */
+		return USBD_LOOPBACK_ACK;
+	}
+
+	/* Need a zero length packet to terminate the transfer if
+	 *  - control or bulk endpoint
+	 *  - short flag set
+	 *  - last packet sent was equal to endpoint size */
+	if (pkt_len == transfer->ep_size &&
+		(transfer->flags & USBD_FLAG_SHORT_PACKET) &&
+		(transfer->ep_type == USBD_EP_BULK ||
+		transfer->ep_type == USBD_EP_CONTROL)) {
+		return USBD_LOOPBACK_ACK;
+	}
+
+	usbd_urb_complete(dev, urb, USBD_SUCCESS);
+	return USBD_LOOPBACK_ACK;
+}
+
+enum usbd_loopback_handshake usbd_loopback_out(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len)
+{
+	enum usbd_loopback_handshake handshake;
+
+	ep_addr &= 0x7F;
+
+	if (token_precheck(dev, ep_addr, &handshake)) {
+		return handshake;
+	}
+
+	usbd_urb *urb = usbd_find_active_urb(dev, ep_addr);
+	if (urb == NULL) {
+		dev->private_data.stats.nak++;
+		return USBD_LOOPBACK_NAK;
+	}
+
+	dev->private_data.stats.bytes_out += len;
+	EP_STATE(dev, ep_addr).dtog ^= true;
+
+	usbd_transfer *transfer = &urb->transfer;
+
+	if (len > transfer->ep_size) {
+		/* Packet with data more than endpoint size */
+		usbd_urb_complete(dev, urb, USBD_ERR_BABBLE);
+		return USBD_LOOPBACK_ACK;
+	}
+
+	size_t space_avail = transfer->length - transfer->transferred;
+	size_t storable_len = MIN(len, space_avail);
+
+	if (storable_len) {
+		memory_to_urb(dev, urb, buf, storable_len);
+		usbd_urb_inc_data_pointer(dev, urb, storable_len);
+	}
+
+	if (len > space_avail) {
+		usbd_urb_complete(dev, urb, USBD_ERR_OVERFLOW);
+		return USBD_LOOPBACK_ACK;
+	}
+
+	if (len < transfer->ep_size && transfer->ep_type != USBD_EP_CONTROL) {
+		if (transfer->flags & USBD_FLAG_SHORT_PACKET) {
+			/* Short packet received (usually marker of end of transfer) */
+			usbd_urb_complete(dev, urb, USBD_SUCCESS);
+			return USBD_LOOPBACK_ACK;
+		} else if (transfer->flags & USBD_FLAG_NO_SHORT_PACKET) {
+			usbd_urb_complete(dev, urb, USBD_ERR_SHORT_PACKET);
+			return USBD_LOOPBACK_ACK;
+		}
+	}
+
+	if (transfer->transferred >= transfer->length) {
+		usbd_urb_complete(dev, urb, USBD_SUCCESS);
+	}
+
+	return USBD_LOOPBACK_ACK;
+}
+
+void usbd_loopback_reset(usbd_device *dev)
+{
+	dev->private_data.address = 0;
+	memset(dev->private_data.ep, 0, sizeof(dev->private_data.ep));
+	usbd_handle_reset(dev);
+}
+
+void usbd_loopback_suspend(usbd_device *dev, bool suspend)
+{
+	if (suspend) {
+		usbd_handle_suspend(dev);
+	} else {
+		usbd_handle_resume(dev);
+	}
+}
+
+const struct usbd_loopback_stats *usbd_loopback_stats(usbd_device *dev)
+{
+	return &dev->private_data.stats;
+}
+
+/**
+ * Issue IN token till device stop NAK'ing
+ * @param dev USB Device
+ * @param ep_addr Endpoint address
+ * @param buf Buffer
+ * @param max_len Maximum length
+ * @param len Length received
+ * @return handshake (NAK if retry exhausted)
+ */
+static enum usbd_loopback_handshake in_retry(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len)
+{
+	enum usbd_loopback_handshake handshake = USBD_LOOPBACK_NAK;
+	unsigned i;
+
+	for (i = 0; i < CONTROL_NAK_RETRY; i++) {
+		handshake = usbd_loopback_in(dev, ep_addr, buf, max_len, len);
+		if (handshake != USBD_LOOPBACK_NAK) {
+			break;
+		}
+		usbd_poll(dev, 1000);
+	}
+
+	return handshake;
+}
+
+/**
+ * Issue OUT token till device stop NAK'ing
+ * @param dev USB Device
+ * @param ep_addr Endpoint address
+ * @param buf Buffer
+ * @param len Length of data
+ * @return handshake (NAK if retry exhausted)
+ */
+static enum usbd_loopback_handshake out_retry(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len)
+{
+	enum usbd_loopback_handshake handshake = USBD_LOOPBACK_NAK;
+	unsigned i;
+
+	for (i = 0; i < CONTROL_NAK_RETRY; i++) {
+		handshake = usbd_loopback_out(dev, ep_addr, buf, len);
+		if (handshake != USBD_LOOPBACK_NAK) {
+			break;
+		}
+		usbd_poll(dev, 1000);
+	}
+
+	return handshake;
+}
+
+enum usbd_loopback_handshake usbd_loopback_control(usbd_device *dev,
+		const struct usb_setup_data *setup_data, void *buf, uint16_t *len)
+{
+	enum usbd_loopback_handshake handshake;
+	uint16_t ep_size = dev->info->device.desc->bMaxPacketSize0;
+	uint16_t done = 0, pkt_len;
+	uint8_t *data = buf;
+
+	usbd_loopback_setup(dev, 0, setup_data);
+
+	if (setup_data->wLength && (setup_data->bmRequestType & 0x80)) {
+		/* DATA IN stage */
+		do {
+			handshake = in_retry(dev, 0x80, data + done,
+				MIN(ep_size, setup_data->wLength - done), &pkt_len);
+			if (handshake != USBD_LOOPBACK_ACK) {
+				return handshake;
+			}
+			done += pkt_len;
+		} while (pkt_len == ep_size && done < setup_data->wLength);
+
+		/* STATUS OUT stage */
+		handshake = out_retry(dev, 0x00, NULL, 0);
+	} else {
+		/* DATA OUT stage */
+		while (done < setup_data->wLength) {
+			pkt_len = MIN(ep_size, setup_data->wLength - done);
+			handshake = out_retry(dev, 0x00, data + done, pkt_len);
+			if (handshake != USBD_LOOPBACK_ACK) {
+				return handshake;
+			}
+			done += pkt_len;
+		}
+
+		/* STATUS IN stage */
+		handshake = in_retry(dev, 0x80, NULL, 0, &pkt_len);
+	}
+
+	if (len != NULL) {
+		*len = done;
+	}
+
+	return handshake;
+}
+
+unsigned usbd_loopback_run(usbd_device *dev,
+		const struct usbd_loopback_step *steps, unsigned count)
+{
+	unsigned i, j;
+
+	for (i = 0; i < count; i++) {
+		const struct usbd_loopback_step *step = &steps[i];
+		unsigned repeat = step->repeat ? step->repeat : 1;
+		enum usbd_loopback_handshake handshake = USBD_LOOPBACK_ACK;
+		uint8_t discard[1024];
+		uint16_t len;
+
+		for (j = 0; j < repeat; j++) {
+			switch (step->token) {
+			case USBD_LOOPBACK_STEP_SETUP:
+				handshake = usbd_loopback_setup(dev, step->ep_addr, step->data);
+			break;
+			case USBD_LOOPBACK_STEP_IN:
+				handshake = usbd_loopback_in(dev, step->ep_addr,
+					step->data != NULL ? step->data : discard,
+					MIN(step->packet_size, sizeof(discard)), &len);
+			break;
+			case USBD_LOOPBACK_STEP_OUT:
+				handshake = usbd_loopback_out(dev, step->ep_addr, step->data,
+					step->packet_size);
+			break;
+			case USBD_LOOPBACK_STEP_CONTROL:
+				memset(discard, 0, sizeof(discard));
+				handshake = usbd_loopback_control(dev, step->data,
+					discard, NULL);
+			break;
+			case USBD_LOOPBACK_STEP_POLL:
+				usbd_poll(dev, 1000);
+			break;
+			case USBD_LOOPBACK_STEP_RESET:
+				usbd_loopback_reset(dev);
+			break;
+			}
+
+			if (handshake != step->expect) {
+				return i;
+			}
+		}
+	}
+
+	return count;
+}
@@ -0,0 +1,176 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Loopback backend: run the usbd stack in a Linux process.
+ *
+ * There is no hardware, the "virtual host" API below issue tokens directly
+ *  to the backend. The token is processed synchronously, ie all the
+ *  transfer callbacks caused by the token are done before returning.
+ *
+ * usbd_poll() advance the frame number by 1 (and do SOF callback if enabled),
+ *  so call it every (simulated) millisecond.
+ */
+
+#ifndef USBD_LOOPBACK_H
+#define USBD_LOOPBACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usb/usbstd.h>
+#include <unicore-mx/usbd/usbd.h>
+
+extern const usbd_backend usbd_loopback;
+
+#define USBD_LOOPBACK (&usbd_loopback)
+
+/** Handshake of the device for a token */
+enum usbd_loopback_handshake {
+	USBD_LOOPBACK_ACK = 0,
+	USBD_LOOPBACK_NAK = 1,
+	USBD_LOOPBACK_STALL = 2
+};
+
+/** Virtual host statistics (counted since usbd_init()) */
+struct usbd_loopback_stats {
+	uint64_t tokens; /**< Number of SETUP/IN/OUT tokens issued */
+	uint64_t nak; /**< Number of tokens answered with NAK */
+	uint64_t nak_injected; /**< NAK forced by the virtual host */
+	uint64_t stall; /**< Number of tokens answered with STALL */
+	uint64_t bytes_in; /**< Data bytes sent from device to host */
+	uint64_t bytes_out; /**< Data bytes sent from host to device */
+};
+
+/**
+ * Make the device answer NAK to IN/OUT token (even if a transfer is pending)
+ *  with probability @a permille / 1000.
+ * This simulate a slow device (ie latency of the peripheral)
+ * @param[in] dev USB Device
+ * @param[in] permille NAK rate (0 = never, 1000 = always)
+ * @param[in] seed Seed of the pseudo random generator (reproducible runs)
+ */
+void usbd_loopback_nak_rate(usbd_device *dev, unsigned permille, uint32_t seed);
+
+/**
+ * Send a SETUP packet to control endpoint @a num
+ * @param[in] dev USB Device
+ * @param[in] num Endpoint number
+ * @param[in] setup_data Setup data
+ * @return always USBD_LOOPBACK_ACK (device cannot refuse SETUP)
+ */
+enum usbd_loopback_handshake usbd_loopback_setup(usbd_device *dev,
+		uint8_t num, const struct usb_setup_data *setup_data);
+
+/**
+ * Send a IN token to endpoint @a ep_addr
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint address (bit 7 is ignored)
+ * @param[out] buf Buffer to store the data packet
+ * @param[in] max_len Size of @a buf (maximum packet size host accept)
+ * @param[out] len Number of bytes received (valid on USBD_LOOPBACK_ACK)
+ * @return handshake
+ * @note if the device send more data than @a max_len, the data is truncated
+ */
+enum usbd_loopback_handshake usbd_loopback_in(usbd_device *dev,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len);
+
+/**
+ * Send a OUT token (with data packet) to endpoint @a ep_addr
+ * @param[in] dev USB Device
+ * @param[in] ep_addr Endpoint address (bit 7 is ignored)
+ * @param[in] buf Data
+ * @param[in] len Length of data (packet size)
+ * @return handshake
+ */
+enum usbd_loopback_handshake usbd_loopback_out(usbd_device *dev,
+		uint8_t ep_addr, const void *buf, uint16_t len);
+
+/**
+ * Signal RESET on bus
+ * @param[in] dev USB Device
+ */
+void usbd_loopback_reset(usbd_device *dev);
+
+/**
+ * Signal SUSPEND (@a suspend = true) or RESUME (@a suspend = false) on bus
+ * @param[in] dev USB Device
+ * @param[in] suspend Suspend
+ */
+void usbd_loopback_suspend(usbd_device *dev, bool suspend);
+
+/**
+ * Get virtual host statistics
+ * @param[in] dev USB Device
+ * @return statistics
+ */
+const struct usbd_loopback_stats *usbd_loopback_stats(usbd_device *dev);
+
+/**
+ * Perform a complete control transfer (SETUP, DATA and STATUS stage)
+ *  on endpoint 0. NAK are retried (with usbd_poll() in between).
+ * @param[in] dev USB Device
+ * @param[in] setup_data Setup data
+ * @param[in,out] buf Data stage buffer (atleast wLength bytes)
+ * @param[out] len Number of bytes transferred in data stage (can be NULL)
+ * @return USBD_LOOPBACK_ACK on success,
+ *   USBD_LOOPBACK_STALL if request was stalled,
+ *   USBD_LOOPBACK_NAK if device did not respond in time
+ */
+enum usbd_loopback_handshake usbd_loopback_control(usbd_device *dev,
+		const struct usb_setup_data *setup_data, void *buf, uint16_t *len);
+
+/** Step of a virtual host script */
+struct usbd_loopback_step {
+	enum {
+		USBD_LOOPBACK_STEP_SETUP, /**< SETUP token (data: setup_data) */
+		USBD_LOOPBACK_STEP_IN, /**< IN token */
+		USBD_LOOPBACK_STEP_OUT, /**< OUT token (data: packet) */
+		/** Control transfer (data: setup_data, wLength <= 1024).
+		 *  Data received in DATA IN stage is discarded,
+		 *  DATA OUT stage send zero's. */
+		USBD_LOOPBACK_STEP_CONTROL,
+		USBD_LOOPBACK_STEP_POLL, /**< usbd_poll() (@a repeat times) */
+		USBD_LOOPBACK_STEP_RESET /**< Bus reset */
+	} token;
+
+	/** Endpoint address */
+	uint8_t ep_addr;
+
+	/** Packet size (IN: maximum packet accepted, OUT: packet to send) */
+	uint16_t packet_size;
+
+	/** Data of step (see @a token). For IN, place to store data (or NULL) */
+	void *data;
+
+	/** Number of time the step is repeated (0 is same as 1) */
+	unsigned repeat;
+
+	/** Expected handshake. Script stop if other handshake is received. */
+	enum usbd_loopback_handshake expect;
+};
+
+/**
+ * Run a virtual host script
+ * @param[in] dev USB Device
+ * @param[in] steps Steps
+ * @param[in] count Number of steps
+ * @return Index of the step which failed, @a count if all steps succeeded
+ */
+unsigned usbd_loopback_run(usbd_device *dev,
+		const struct usbd_loopback_step *steps, unsigned count);
+
+#endif
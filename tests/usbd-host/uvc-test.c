@@ -0,0 +1,623 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbd_uvc test using loopback backend (high speed).
+ *
+ * - Probe and commit: defaults, adjusted probe, invalid commit stall,
+ *   UVC 1.0 sized commit
+ * - Streaming with a host parsing the payload headers (FID, EOF) and
+ *   comparing the frames rebuilt, on bulk (8 KiB payloads) and high
+ *   bandwidth isochronous (3 x 1024 bytes per microframe)
+ * - Frame drop accounting: queue full (refused, or newest replaced with
+ *   keep_latest), stop in the middle of a frame
+ *
+ * The loopback backend has no PID: the host end an isochronous payload on
+ *  a short packet, so frame sizes are chosen to not end a payload on a
+ *  multiple of 1024 bytes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unicore-mx/usbd/class/uvc.h>
+#include "usbd_loopback.h"
+#include "test_check.h"
+
+#define EP_VIDEO 0x81
+#define VS_INTERFACE 1
+
+#define WIDTH 160
+#define HEIGHT 120
+#define FRAME_SIZE (WIDTH * HEIGHT * 2)
+#define FRAMES 6
+
+/* Bulk dwMaxPayloadTransferSize (largest payload) */
+#define BULK_PAYLOAD_SIZE 8192
+
+/* 30 fps, 60 fps, 10 fps (100ns) */
+#define INTERVAL_DEFAULT 333333
+#define INTERVAL_MIN 166666
+#define INTERVAL_MAX 1000000
+
+/* Microframe */
+#define POLL_US 125
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0xEF,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xcafe,
+	.idProduct = 0x000f,
+	.bNumConfigurations = 1
+};
+
+static const struct usb_config_descriptor config_desc = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = USB_DT_CONFIGURATION_SIZE,
+	.bNumInterfaces = 2,
+	.bConfigurationValue = 1,
+	.bmAttributes = 0x80,
+	.bMaxPower = 250
+};
+
+static const struct usbd_info info = {
+	.device = {
+		.desc = &dev_desc,
+		.string = NULL
+	},
+	.config = {{
+		.desc = &config_desc,
+		.string = NULL
+	}}
+};
+
+static const struct usbd_backend_config hs_config = {
+	.ep_count = 16,
+	.speed = USBD_SPEED_HIGH
+};
+
+/* YUY2 80x60 and 160x120 */
+static const usbd_uvc_frame_info frame_infos[] = {{
+	.format_index = 1,
+	.frame_index = 1,
+	.max_frame_size = FRAME_SIZE / 4,
+	.interval_default = INTERVAL_DEFAULT,
+	.interval_min = INTERVAL_MIN,
+	.interval_max = INTERVAL_MAX
+}, {
+	.format_index = 1,
+	.frame_index = 2,
+	.max_frame_size = FRAME_SIZE,
+	.interval_default = INTERVAL_DEFAULT,
+	.interval_min = INTERVAL_MIN,
+	.interval_max = INTERVAL_MAX
+}};
+
+struct scenario {
+	const char *name;
+	usbd_ep_type ep_type;
+	uint16_t ep_size;
+	uint8_t packets;
+	uint32_t payload_size;
+	bool keep_latest;
+};
+
+static const struct scenario *scenario;
+static usbd_uvc uvc;
+
+/* Frames: content and length of frame i */
+static uint8_t video[FRAMES][FRAME_SIZE];
+static size_t video_len[FRAMES];
+
+/* Frames given back */
+static unsigned done_count, done_sent;
+static bool held[FRAMES];
+
+/* Commit seen by application */
+static const usbd_uvc_frame_info *committed;
+static uint32_t committed_interval;
+
+/* Host: payload read */
+static uint8_t payload[BULK_PAYLOAD_SIZE];
+
+/* Host: frame being rebuilt, frames expected (in order) */
+static struct {
+	uint8_t frame[FRAME_SIZE];
+	size_t len;
+	bool fid;
+	bool fid_valid;
+	unsigned expect[64];
+	unsigned expected;
+	unsigned received;
+	unsigned payloads;
+} host;
+
+static void frame_done(usbd_uvc *_uvc, void *cookie, bool sent)
+{
+	unsigned index = (uintptr_t) cookie;
+
+	(void) _uvc;
+
+	held[index] = false;
+	done_count++;
+	done_sent += sent;
+}
+
+static void commit(usbd_uvc *_uvc, const usbd_uvc_frame_info *frame_info,
+			uint32_t interval)
+{
+	(void) _uvc;
+
+	committed = frame_info;
+	committed_interval = interval;
+}
+
+static void setup_callback(usbd_device *dev, uint8_t addr,
+				const struct usb_setup_data *setup_data)
+{
+	(void) addr;
+
+	if (!usbd_uvc_setup_ep0(&uvc, setup_data)) {
+		usbd_ep0_setup(dev, setup_data);
+	}
+}
+
+static void set_config(usbd_device *dev,
+		const struct usb_config_descriptor *cfg)
+{
+	if (cfg == NULL) {
+		return;
+	}
+
+	usbd_ep_prepare(dev, EP_VIDEO, scenario->ep_type, scenario->ep_size,
+		scenario->ep_type == USBD_EP_ISOCHRONOUS ? 1 : USBD_INTERVAL_NA,
+		USBD_EP_NONE);
+}
+
+static enum usbd_loopback_handshake request(usbd_device *dev, uint8_t req,
+		uint8_t selector, void *buf, uint16_t len)
+{
+	const struct usb_setup_data setup = {
+		.bmRequestType = ((req & 0x80) ? USB_REQ_TYPE_IN : 0) |
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+		.bRequest = req,
+		.wValue = selector << 8,
+		.wIndex = VS_INTERFACE,
+		.wLength = len
+	};
+
+	return usbd_loopback_control(dev, &setup, buf, NULL);
+}
+
+static int configure(usbd_device *dev)
+{
+	const struct usb_setup_data set_configuration = {
+		.bmRequestType = USB_REQ_TYPE_STANDARD | USB_REQ_TYPE_DEVICE,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1
+	};
+
+	CHECK(usbd_loopback_control(dev, &set_configuration, NULL, NULL) ==
+			USBD_LOOPBACK_ACK);
+	return 0;
+}
+
+static uint32_t payload_size(void)
+{
+	if (scenario->ep_type == USBD_EP_ISOCHRONOUS) {
+		return scenario->ep_size * scenario->packets;
+	}
+
+	return scenario->payload_size;
+}
+
+static int test_controls(usbd_device *dev)
+{
+	struct usb_video_probe_commit_control ctl;
+	uint16_t len;
+	uint8_t caps;
+
+	CHECK(request(dev, USB_VIDEO_REQ_GET_INFO, USB_VIDEO_VS_PROBE_CONTROL,
+			&caps, 1) == USBD_LOOPBACK_ACK);
+	CHECK(caps == (USB_VIDEO_INFO_SUPPORTS_GET | USB_VIDEO_INFO_SUPPORTS_SET));
+	CHECK(request(dev, USB_VIDEO_REQ_GET_LEN, USB_VIDEO_VS_PROBE_CONTROL,
+			&len, 2) == USBD_LOOPBACK_ACK);
+	CHECK(len == USB_VIDEO_PROBE_COMMIT_SIZE_15);
+
+	/* Default: first frame */
+	memset(&ctl, 0xff, sizeof(ctl));
+	CHECK(request(dev, USB_VIDEO_REQ_GET_DEF, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(ctl.bFormatIndex == 1 && ctl.bFrameIndex == 1);
+	CHECK(ctl.dwFrameInterval == INTERVAL_DEFAULT);
+	CHECK(ctl.dwMaxVideoFrameSize == FRAME_SIZE / 4);
+	CHECK(ctl.dwMaxPayloadTransferSize == payload_size());
+	CHECK(ctl.bmFramingInfo == (USB_VIDEO_FRAMING_FID | USB_VIDEO_FRAMING_EOF));
+	CHECK(ctl.bUsage == 0xff); /* Not transferred */
+
+	/* Interval too short: clamped */
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.bmHint = USB_VIDEO_HINT_FRAME_INTERVAL;
+	ctl.bFormatIndex = 1;
+	ctl.bFrameIndex = 2;
+	ctl.dwFrameInterval = 100000;
+	CHECK(request(dev, USB_VIDEO_REQ_SET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	memset(&ctl, 0, sizeof(ctl));
+	CHECK(request(dev, USB_VIDEO_REQ_GET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(ctl.bmHint == USB_VIDEO_HINT_FRAME_INTERVAL);
+	CHECK(ctl.bFormatIndex == 1 && ctl.bFrameIndex == 2);
+	CHECK(ctl.dwFrameInterval == INTERVAL_MIN);
+	CHECK(ctl.dwMaxVideoFrameSize == FRAME_SIZE);
+	CHECK(ctl.dwMaxPayloadTransferSize == payload_size());
+
+	CHECK(request(dev, USB_VIDEO_REQ_GET_MAX, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(ctl.bFrameIndex == 2 && ctl.dwFrameInterval == INTERVAL_MAX);
+
+	/* Unknown frame, unknown format: nearest */
+	ctl.bFrameIndex = 9;
+	CHECK(request(dev, USB_VIDEO_REQ_SET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(request(dev, USB_VIDEO_REQ_GET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(ctl.bFormatIndex == 1 && ctl.bFrameIndex == 1);
+	ctl.bFormatIndex = 7;
+	CHECK(request(dev, USB_VIDEO_REQ_SET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(request(dev, USB_VIDEO_REQ_GET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_ACK);
+	CHECK(ctl.bFormatIndex == 1 && ctl.bFrameIndex == 1);
+
+	/* Too short, MIN of commit, commit of an unknown frame */
+	CHECK(request(dev, USB_VIDEO_REQ_SET_CUR, USB_VIDEO_VS_PROBE_CONTROL,
+			&ctl, 10) == USBD_LOOPBACK_STALL);
+	CHECK(request(dev, USB_VIDEO_REQ_GET_MIN, USB_VIDEO_VS_COMMIT_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_STALL);
+	ctl.bFrameIndex = 9;
+	CHECK(request(dev, USB_VIDEO_REQ_SET_CUR, USB_VIDEO_VS_COMMIT_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_11) == USBD_LOOPBACK_STALL);
+	CHECK(committed == NULL);
+
+	/* Commit (UVC 1.0 size), default interval */
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.bFormatIndex = 1;
+	ctl.bFrameIndex = 2;
+	CHECK(request(dev, USB_VIDEO_REQ_SET_CUR, USB_VIDEO_VS_COMMIT_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_10) == USBD_LOOPBACK_ACK);
+	CHECK(committed == &frame_infos[1]);
+	CHECK(committed_interval == INTERVAL_DEFAULT);
+
+	memset(&ctl, 0, sizeof(ctl));
+	CHECK(request(dev, USB_VIDEO_REQ_GET_CUR, USB_VIDEO_VS_COMMIT_CONTROL,
+			&ctl, USB_VIDEO_PROBE_COMMIT_SIZE_10) == USBD_LOOPBACK_ACK);
+	CHECK(ctl.bFrameIndex == 2 && ctl.dwMaxVideoFrameSize == FRAME_SIZE);
+	CHECK(ctl.dwMaxPayloadTransferSize == payload_size());
+
+	return 0;
+}
+
+/**
+ * Read a payload (host)
+ * Bulk: upto a short packet or dwMaxPayloadTransferSize.
+ * Isochronous: the packets of a microframe.
+ * @param[in] dev USB Device
+ * @param[out] buf Buffer (payload_size())
+ * @return length, -1 on NAK
+ */
+static int host_read(usbd_device *dev, uint8_t *buf)
+{
+	const bool iso = scenario->ep_type == USBD_EP_ISOCHRONOUS;
+	const uint16_t ep_size = scenario->ep_size;
+	unsigned packets = 0;
+	size_t pos = 0;
+	uint16_t len;
+
+	do {
+		if (usbd_loopback_in(dev, EP_VIDEO, buf + pos, ep_size, &len) !=
+				USBD_LOOPBACK_ACK) {
+			return pos ? (int) pos : -1;
+		}
+		pos += len;
+		packets++;
+	} while (len == ep_size && pos < payload_size() &&
+		(!iso || packets < scenario->packets));
+
+	return pos;
+}
+
+/**
+ * Parse a payload (host): header, FID toggle, frame rebuilt on EOF
+ * @param[in] buf Payload
+ * @param[in] len Length
+ * @return 0 on success, -1 on error
+ */
+static int host_payload(const uint8_t *buf, size_t len)
+{
+	const struct usb_video_payload_header *header = (const void *) buf;
+	bool fid;
+
+	/* Empty isochronous payload */
+	if (!len) {
+		return 0;
+	}
+
+	CHECK(len >= 2 && len <= payload_size());
+	CHECK(header->bHeaderLength == 2);
+	CHECK(header->bmHeaderInfo & USB_VIDEO_PAYLOAD_EOH);
+	CHECK(!(header->bmHeaderInfo & USB_VIDEO_PAYLOAD_ERR));
+
+	/* Same FID in a frame, toggle on a new frame */
+	fid = header->bmHeaderInfo & USB_VIDEO_PAYLOAD_FID;
+	if (host.len) {
+		CHECK(fid == host.fid);
+	} else if (host.fid_valid) {
+		CHECK(fid != host.fid);
+	}
+	host.fid = fid;
+	host.fid_valid = true;
+
+	CHECK(host.len + len - 2 <= FRAME_SIZE);
+	memcpy(host.frame + host.len, buf + 2, len - 2);
+	host.len += len - 2;
+	host.payloads++;
+
+	if (header->bmHeaderInfo & USB_VIDEO_PAYLOAD_EOF) {
+		unsigned index;
+
+		CHECK(host.received < host.expected);
+		index = host.expect[host.received++];
+		CHECK(host.len == video_len[index]);
+		CHECK(!memcmp(host.frame, video[index], host.len));
+		host.len = 0;
+	}
+
+	return 0;
+}
+
+/**
+ * Host read during @a count microframes
+ * @param[in] dev USB Device
+ * @param[in] count Number of microframes
+ * @return 0 on success, -1 on error
+ */
+static int host_run(usbd_device *dev, unsigned count)
+{
+	int len;
+
+	while (count--) {
+		while ((len = host_read(dev, payload)) >= 0) {
+			CHECK(!host_payload(payload, len));
+
+			/* Isochronous: one payload per microframe */
+			if (scenario->ep_type == USBD_EP_ISOCHRONOUS) {
+				break;
+			}
+		}
+
+		usbd_poll(dev, POLL_US);
+	}
+
+	return 0;
+}
+
+static bool queue(unsigned index)
+{
+	if (!usbd_uvc_queue_frame(&uvc, video[index], video_len[index],
+			(void *) (uintptr_t) index)) {
+		return false;
+	}
+
+	held[index] = true;
+	return true;
+}
+
+static int test_stream(usbd_device *dev)
+{
+	const struct usbd_loopback_stats *bus = usbd_loopback_stats(dev);
+	const unsigned count = 48;
+	unsigned queued = 0, microframes = 0, i;
+	usbd_uvc_stats stats;
+	uint64_t tokens;
+	size_t bytes = 0;
+
+	/* Isochronous: empty payloads till a frame is queued */
+	CHECK(!host_run(dev, 4));
+	usbd_uvc_get_stats(&uvc, &stats);
+	CHECK(scenario->ep_type != USBD_EP_ISOCHRONOUS || stats.idle_payloads >= 4);
+	CHECK(host.payloads == 0);
+
+	tokens = bus->tokens;
+	while (host.received < count) {
+		/* Camera: a new frame as soon as a buffer is free and the
+		 *  queue has room */
+		while (queued < count && !held[queued % FRAMES] &&
+				queued - done_count < USBD_UVC_FRAMES) {
+			unsigned index = queued % FRAMES;
+
+			CHECK(host.expected < sizeof(host.expect) / sizeof(host.expect[0]));
+			CHECK(queue(index));
+			host.expect[host.expected++] = index;
+			bytes += video_len[index];
+			queued++;
+		}
+
+		CHECK(!host_run(dev, 1));
+		CHECK(++microframes < count * 1000);
+	}
+
+	usbd_uvc_get_stats(&uvc, &stats);
+	CHECK(stats.frames == count && stats.frames_dropped == 0);
+	CHECK(stats.frames_incomplete == 0 && stats.errors == 0);
+	CHECK(stats.payloads == host.payloads);
+	CHECK(done_count == count && done_sent == count);
+
+	for (i = 0; i < FRAMES; i++) {
+		CHECK(!held[i]);
+	}
+
+	printf("uvc-test: %s: %u frames (%zu bytes) in %u payloads, "
+		"%u microframes, %.2f IN tokens per KiB\n",
+		scenario->name, count, bytes, (unsigned) stats.payloads,
+		microframes, (double) (bus->tokens - tokens) * 1024 / bytes);
+
+	host.expected = host.received = 0;
+	return 0;
+}
+
+static int test_drops(usbd_device *dev)
+{
+	usbd_uvc_stats before, stats;
+	unsigned i;
+
+	usbd_uvc_get_stats(&uvc, &before);
+	done_count = done_sent = 0;
+
+	/* Queue full */
+	for (i = 0; i < USBD_UVC_FRAMES; i++) {
+		CHECK(queue(i));
+		host.expect[host.expected++] = i;
+	}
+
+	if (scenario->keep_latest) {
+		/* Newest replaced, twice */
+		CHECK(queue(4));
+		CHECK(!held[3] && done_count == 1 && done_sent == 0);
+		CHECK(queue(5));
+		CHECK(!held[4] && done_count == 2 && done_sent == 0);
+		host.expect[host.expected - 1] = 5;
+	} else {
+		CHECK(!queue(4));
+		CHECK(!queue(5));
+		CHECK(done_count == 0);
+	}
+
+	/* Empty and too large frames are refused */
+	CHECK(!usbd_uvc_queue_frame(&uvc, video[0], 0, NULL));
+	CHECK(!usbd_uvc_queue_frame(&uvc, video[0], FRAME_SIZE + 1, NULL));
+
+	CHECK(!host_run(dev, 400));
+	CHECK(host.received == host.expected);
+
+	usbd_uvc_get_stats(&uvc, &stats);
+	CHECK(stats.frames - before.frames == USBD_UVC_FRAMES);
+	CHECK(stats.frames_dropped - before.frames_dropped == 4);
+	CHECK(stats.frames_incomplete == before.frames_incomplete);
+
+	/* Stop in the middle of a frame */
+	host.expected = host.received = 0;
+	done_count = done_sent = 0;
+	CHECK(queue(0));
+	CHECK(queue(1));
+	while (!host.len) {
+		int len = host_read(dev, payload);
+
+		CHECK(len >= 0 && !host_payload(payload, len));
+		usbd_poll(dev, POLL_US);
+	}
+	usbd_uvc_stop(&uvc);
+	CHECK(done_count == 2 && done_sent == 0 && !held[0] && !held[1]);
+	CHECK(!queue(2));
+
+	usbd_uvc_get_stats(&uvc, &stats);
+	CHECK(stats.frames_incomplete - before.frames_incomplete == 1);
+	CHECK(stats.frames_dropped - before.frames_dropped == 4 + 1 + 1);
+
+	return 0;
+}
+
+static int run(const struct scenario *s)
+{
+	const usbd_uvc_config config = {
+		.interface = VS_INTERFACE,
+		.ep_addr = EP_VIDEO,
+		.ep_type = s->ep_type,
+		.ep_size = s->ep_size,
+		.packets = s->packets,
+		.payload_size = s->payload_size,
+		.frames = frame_infos,
+		.frame_count = sizeof(frame_infos) / sizeof(frame_infos[0]),
+		.keep_latest = s->keep_latest,
+		.commit = commit,
+		.frame_done = frame_done
+	};
+	usbd_device *dev;
+
+	scenario = s;
+	memset(&host, 0, sizeof(host));
+	done_count = done_sent = 0;
+	committed = NULL;
+
+	dev = usbd_init(USBD_LOOPBACK, &hs_config, &info);
+	usbd_register_setup_callback(dev, setup_callback);
+	usbd_register_set_config_callback(dev, set_config);
+
+	usbd_uvc_init(&uvc, dev, &config);
+
+	if (configure(dev) || test_controls(dev)) {
+		return -1;
+	}
+
+	/* Isochronous: alternate setting 1 */
+	if (s->ep_type == USBD_EP_ISOCHRONOUS) {
+		usbd_uvc_start(&uvc);
+	}
+
+	return test_stream(dev) || test_drops(dev);
+}
+
+int main(void)
+{
+	static const struct scenario scenarios[] = {{
+		.name = "bulk",
+		.ep_type = USBD_EP_BULK,
+		.ep_size = 512,
+		.payload_size = BULK_PAYLOAD_SIZE
+	}, {
+		.name = "isochronous 3x1024",
+		.ep_type = USBD_EP_ISOCHRONOUS,
+		.ep_size = 1024,
+		.packets = 3,
+		.keep_latest = true
+	}};
+	unsigned i, j;
+
+	/* Full frame, MJPEG like smaller frames, a frame of exactly two
+	 *  bulk payloads (no short packet) */
+	for (i = 0; i < FRAMES; i++) {
+		static const size_t lens[] = {FRAME_SIZE, 30000, 2 * (BULK_PAYLOAD_SIZE - 2)};
+
+		video_len[i] = lens[i % 3];
+		for (j = 0; j < FRAME_SIZE; j++) {
+			video[i][j] = (j * 7) + (i * 31) + (j >> 8);
+		}
+	}
+
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		if (run(&scenarios[i])) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	printf("uvc-test: OK\n");
+	return EXIT_SUCCESS;
+}
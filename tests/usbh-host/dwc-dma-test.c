@@ -0,0 +1,678 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG host backend in internal DMA mode (USBH_DMA), run against the
+ *  register model (dwc_otg_host_model.h) and a high speed device.
+ *
+ * - Enumeration and control transfers through the channel bounce buffer
+ *   (unaligned request data), control IN and OUT of several packets
+ * - Bulk IN programmed with one DMA transfer: one channel halt per URB
+ *   while the device NAK, register access per KB reported
+ * - Bulk OUT with zero length packet, short packet termination,
+ *   USBH_FLAG_NO_SHORT_PACKET
+ * - Data toggle carried from one URB to the next (checked by the model)
+ * - Interrupt IN NAKed till the device has data
+ * - IN packets that would be written past the URB buffer (1 byte
+ *   interrupt IN, 13 bytes bulk IN, last partial packet of a bulk IN)
+ *   received through the bounce buffer
+ * - URB that cannot be handled by DMA are rejected (USBH_ERR_INVALID)
+ * - Cancel of a bulk IN armed on a NAKing endpoint free the channel
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend/dwc_otg-private.h"
+#include "usbh-private.h"
+#include "dwc_otg_host_model.h"
+
+#define EP_BULK_IN 0x81
+#define EP_BULK_OUT 0x02
+#define EP_INT_IN 0x83
+#define BULK_SIZE 512
+#define INT_SIZE 64
+
+#define BULK_LEN (BULK_SIZE * 127)
+#define CTRL_LEN 100
+#define CTRL_IN_LEN 128 /* device return CTRL_LEN (short packet) */
+
+/* Control/bulk packets per microframe (13 x 512 bytes fit in 125us) */
+#define PACKETS 13
+#define FRAME_US 125
+#define TIMEOUT_FRAMES 20000
+
+#define VENDOR_IN 0x01
+#define VENDOR_OUT 0x02
+
+#define FAIL(...) do { \
+		fprintf(stderr, "dwc-dma-test: " __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		return -1; \
+	} while (0)
+
+static usbh_host *init(const usbh_backend_config *config);
+
+static usbh_host host;
+static usbh_dwc_otg_chan channels[DWC_OTG_HOST_MODEL_CHANNELS];
+
+static const usbh_backend dwc_otg_model_backend = {
+	.init = init,
+	.poll = usbh_dwc_otg_poll,
+	.speed = usbh_dwc_otg_speed,
+	.reset = usbh_dwc_otg_reset,
+	.transfer_submit = usbh_dwc_otg_transfer_submit,
+	.transfer_cancel = usbh_dwc_otg_transfer_cancel,
+
+	.base_address = DWC_OTG_HOST_MODEL_BASE,
+	.channels_count = DWC_OTG_HOST_MODEL_CHANNELS,
+	.channels = channels
+};
+
+static const usbh_backend_config backend_config = {
+	.chan_count = DWC_OTG_HOST_MODEL_CHANNELS,
+	.priv_mem = 4096,
+	.speed = USBH_SPEED_HIGH,
+	.feature = USBH_PHY_EXT | USBH_DMA
+};
+
+static usbh_host *init(const usbh_backend_config *config)
+{
+	host.backend = &dwc_otg_model_backend;
+	host.config = config;
+	host.dma = !!(config->feature & USBH_DMA);
+
+	usbh_dwc_otg_init(&host);
+
+	return &host;
+}
+
+/* Device */
+
+static const struct usb_device_descriptor dev_desc = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0xCAFE,
+	.idProduct = 0x0025,
+	.bNumConfigurations = 1
+};
+
+static struct {
+	uint8_t address, pending_address;
+
+	/* Control request in progress */
+	struct usb_setup_data setup;
+	uint8_t ctrl[256];
+	uint16_t ctrl_len, ctrl_pos;
+
+	/* Vendor OUT data received */
+	uint8_t vendor[CTRL_LEN];
+
+	/* Bulk IN source: bytes available, NAK every other token */
+	uint32_t in_avail, in_pos;
+	bool in_nak;
+	unsigned in_tokens;
+
+	/* Bulk OUT sink */
+	uint8_t out[BULK_LEN];
+	uint32_t out_len;
+	unsigned out_zlp;
+
+	/* Interrupt IN: NAK till armed */
+	uint16_t int_avail;
+
+	char error[120];
+} dev;
+
+static uint8_t pattern(uint32_t pos)
+{
+	return (uint8_t) (pos * 7 + 3);
+}
+
+static void dev_setup(uint8_t address, const struct usb_setup_data *setup)
+{
+	if (address != dev.address) {
+		snprintf(dev.error, sizeof(dev.error),
+			"SETUP for address %u (device at %u)", address, dev.address);
+	}
+
+	dev.setup = *setup;
+	dev.ctrl_len = dev.ctrl_pos = 0;
+
+	switch (setup->bRequest) {
+	case USB_REQ_SET_ADDRESS:
+		dev.pending_address = setup->wValue;
+	break;
+	case USB_REQ_GET_DESCRIPTOR:
+		dev.ctrl_len = MIN(setup->wLength, sizeof(dev_desc));
+		memcpy(dev.ctrl, &dev_desc, dev.ctrl_len);
+	break;
+	case VENDOR_IN: {
+		unsigned i;
+		dev.ctrl_len = MIN(setup->wLength, CTRL_LEN);
+		for (i = 0; i < dev.ctrl_len; i++) {
+			dev.ctrl[i] = pattern(i + 100);
+		}
+	} break;
+	}
+}
+
+static bool ctrl_in(void)
+{
+	return !!(dev.setup.bmRequestType & USB_REQ_TYPE_DIRECTION);
+}
+
+static enum dwc_otg_host_model_handshake dev_in(uint8_t address,
+		uint8_t ep_addr, void *buf, uint16_t max_len, uint16_t *len)
+{
+	(void) address;
+
+	switch (ep_addr) {
+	case 0x80:
+		if (!ctrl_in()) {
+			/* Status stage */
+			*len = 0;
+			if (dev.setup.bRequest == USB_REQ_SET_ADDRESS) {
+				dev.address = dev.pending_address;
+			}
+			return DWC_OTG_HOST_MODEL_ACK;
+		}
+
+		*len = MIN(max_len, dev.ctrl_len - dev.ctrl_pos);
+		memcpy(buf, &dev.ctrl[dev.ctrl_pos], *len);
+		dev.ctrl_pos += *len;
+	return DWC_OTG_HOST_MODEL_ACK;
+	case EP_BULK_IN: {
+		uint16_t i;
+
+		if (!dev.in_avail || (dev.in_nak && !(dev.in_tokens++ & 1))) {
+			return DWC_OTG_HOST_MODEL_NAK;
+		}
+
+		*len = MIN(max_len, dev.in_avail);
+		for (i = 0; i < *len; i++) {
+			((uint8_t *) buf)[i] = pattern(dev.in_pos++);
+		}
+		dev.in_avail -= *len;
+	} return DWC_OTG_HOST_MODEL_ACK;
+	case EP_INT_IN:
+		if (!dev.int_avail) {
+			return DWC_OTG_HOST_MODEL_NAK;
+		}
+
+		*len = MIN(max_len, dev.int_avail);
+		memset(buf, 0xA5, *len);
+		dev.int_avail = 0;
+	return DWC_OTG_HOST_MODEL_ACK;
+	}
+
+	return DWC_OTG_HOST_MODEL_STALL;
+}
+
+static enum dwc_otg_host_model_handshake dev_out(uint8_t address,
+		uint8_t ep_addr, const void *buf, uint16_t len)
+{
+	(void) address;
+
+	switch (ep_addr) {
+	case 0x00:
+		if (ctrl_in()) {
+			/* Status stage */
+			return DWC_OTG_HOST_MODEL_ACK;
+		}
+
+		if (dev.ctrl_len + len > sizeof(dev.vendor)) {
+			return DWC_OTG_HOST_MODEL_STALL;
+		}
+
+		memcpy(&dev.vendor[dev.ctrl_len], buf, len);
+		dev.ctrl_len += len;
+	return DWC_OTG_HOST_MODEL_ACK;
+	case EP_BULK_OUT:
+		if (!len) {
+			dev.out_zlp++;
+		} else if (dev.out_len + len <= sizeof(dev.out)) {
+			memcpy(&dev.out[dev.out_len], buf, len);
+			dev.out_len += len;
+		}
+	return DWC_OTG_HOST_MODEL_ACK;
+	}
+
+	return DWC_OTG_HOST_MODEL_STALL;
+}
+
+static const struct dwc_otg_host_model_device model_device = {
+	.setup = dev_setup,
+	.in = dev_in,
+	.out = dev_out
+};
+
+/* Host */
+
+/* DMA address are 32bit, buffers are static (-no-pie) */
+static uint32_t bulk_buf[BULK_LEN / 4];
+static uint8_t ctrl_buf[CTRL_IN_LEN + 1];
+
+static usbh_device *device;
+
+static struct {
+	unsigned count;
+	usbh_transfer_status status;
+	uint16_t transferred;
+} done;
+
+static void device_connected(usbh_device *usbh_dev)
+{
+	device = usbh_dev;
+}
+
+static void callback(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	(void) urb_id;
+
+	done.count++;
+	done.status = status;
+	done.transferred = transfer->transferred;
+}
+
+static void frame(usbh_host *h)
+{
+	dwc_otg_host_model_frame(PACKETS);
+	usbh_poll(h, FRAME_US);
+}
+
+/** Run till the callback, return the number of frames (-1 on timeout) */
+static int run(usbh_host *h)
+{
+	unsigned count = done.count;
+	int frames;
+
+	for (frames = 0; frames < TIMEOUT_FRAMES; frames++) {
+		if (done.count != count) {
+			return frames;
+		}
+		frame(h);
+	}
+
+	return -1;
+}
+
+static usbh_urb_id submit(usbh_ep_type type, uint8_t ep_addr,
+		uint16_t ep_size, void *data, uint16_t length,
+		usbh_transfer_flags flags)
+{
+	usbh_transfer transfer = {
+		.device = device,
+		.ep_type = type,
+		.ep_addr = ep_addr,
+		.ep_size = ep_size,
+		.data = data,
+		.length = length,
+		.flags = flags,
+		.interval = 4,
+		.callback = callback
+	};
+
+	return usbh_transfer_submit(&transfer);
+}
+
+static usbh_urb_id submit_control(uint8_t request, void *data, uint16_t length)
+{
+	usbh_transfer transfer = {
+		.device = device,
+		.ep_type = USBH_EP_CONTROL,
+		.ep_addr = 0,
+		.ep_size = 64,
+		.data = data,
+		.length = length,
+		.flags = USBH_FLAG_NONE,
+		.callback = callback,
+		.setup = {
+			.bmRequestType = USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE |
+				((request == VENDOR_IN) ? USB_REQ_TYPE_IN : 0),
+			.bRequest = request,
+			.wLength = length
+		}
+	};
+
+	return usbh_transfer_submit(&transfer);
+}
+
+static int run_control(usbh_host *h)
+{
+	unsigned i;
+
+	/* Request data unaligned, through the bounce buffer */
+	memset(ctrl_buf, 0, sizeof(ctrl_buf));
+	submit_control(VENDOR_IN, ctrl_buf + 1, CTRL_IN_LEN);
+	if (run(h) < 0 || done.status != USBH_SUCCESS ||
+			done.transferred != CTRL_LEN) {
+		FAIL("control IN: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	for (i = 0; i < CTRL_LEN; i++) {
+		if (ctrl_buf[i + 1] != pattern(i + 100)) {
+			FAIL("control IN: data mismatch at %u", i);
+		}
+	}
+
+	for (i = 0; i < CTRL_LEN; i++) {
+		ctrl_buf[i + 1] = pattern(i);
+	}
+
+	submit_control(VENDOR_OUT, ctrl_buf + 1, CTRL_LEN);
+	if (run(h) < 0 || done.status != USBH_SUCCESS ||
+			done.transferred != CTRL_LEN) {
+		FAIL("control OUT: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	if (dev.ctrl_len != CTRL_LEN || memcmp(dev.vendor, ctrl_buf + 1, CTRL_LEN)) {
+		FAIL("control OUT: device got %u bytes", dev.ctrl_len);
+	}
+
+	return 0;
+}
+
+static int run_bulk(usbh_host *h)
+{
+	const struct dwc_otg_host_model_stats *stats;
+	uint64_t halts, reads, writes;
+	unsigned i;
+	int frames;
+
+	/* Bulk IN, device NAK every other token */
+	memset(bulk_buf, 0, sizeof(bulk_buf));
+	dev.in_avail = BULK_LEN;
+	dev.in_pos = 0;
+	dev.in_nak = true;
+
+	stats = dwc_otg_host_model_stats();
+	halts = stats->halts;
+	reads = stats->reads;
+	writes = stats->writes;
+
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, BULK_LEN,
+		USBH_FLAG_NONE);
+	frames = run(h);
+	if (frames < 0 || done.status != USBH_SUCCESS ||
+			done.transferred != BULK_LEN) {
+		FAIL("bulk IN: status %d, %u bytes", done.status, done.transferred);
+	}
+
+	for (i = 0; i < BULK_LEN; i++) {
+		if (((uint8_t *) bulk_buf)[i] != pattern(i)) {
+			FAIL("bulk IN: data mismatch at %u", i);
+		}
+	}
+
+	stats = dwc_otg_host_model_stats();
+	if (stats->halts - halts != 1) {
+		FAIL("bulk IN: %llu channel halts for one URB",
+			(unsigned long long) (stats->halts - halts));
+	}
+
+	printf("dwc-dma-test: bulk IN %u bytes in %d microframes, "
+		"%.1f register access per KB\n", BULK_LEN, frames,
+		(double) (stats->reads - reads + stats->writes - writes) * 1024 /
+			BULK_LEN);
+	dev.in_nak = false;
+
+	/* Odd packet count: next URB start with DATA1 (checked by model) */
+	dev.in_avail = BULK_SIZE * 3;
+	dev.in_pos = 0;
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, BULK_SIZE * 3,
+		USBH_FLAG_NONE);
+	if (run(h) < 0 || done.status != USBH_SUCCESS ||
+			done.transferred != BULK_SIZE * 3) {
+		FAIL("bulk IN toggle: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	/* Short packet end the transfer */
+	dev.in_avail = 700;
+	dev.in_pos = 0;
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, BULK_SIZE * 4,
+		USBH_FLAG_NONE);
+	if (run(h) < 0 || done.status != USBH_SUCCESS || done.transferred != 700) {
+		FAIL("bulk IN short: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	dev.in_avail = 700;
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, BULK_SIZE * 4,
+		USBH_FLAG_NO_SHORT_PACKET);
+	if (run(h) < 0 || done.status != USBH_ERR_SHORT_PACKET ||
+			done.transferred != 700) {
+		FAIL("bulk IN no short packet: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	/* Bulk OUT with zero length packet */
+	for (i = 0; i < BULK_SIZE * 2; i++) {
+		((uint8_t *) bulk_buf)[i] = pattern(i);
+	}
+
+	submit(USBH_EP_BULK, EP_BULK_OUT, BULK_SIZE, bulk_buf, BULK_SIZE * 2,
+		USBH_FLAG_ZERO_PACKET);
+	if (run(h) < 0 || done.status != USBH_SUCCESS ||
+			done.transferred != BULK_SIZE * 2) {
+		FAIL("bulk OUT: status %d, %u bytes", done.status, done.transferred);
+	}
+
+	if (dev.out_len != BULK_SIZE * 2 || dev.out_zlp != 1 ||
+			memcmp(dev.out, bulk_buf, BULK_SIZE * 2)) {
+		FAIL("bulk OUT: device got %u bytes, %u ZLP", dev.out_len,
+			dev.out_zlp);
+	}
+
+	return 0;
+}
+
+static int run_interrupt(usbh_host *h)
+{
+	unsigned count = done.count;
+	unsigned i;
+
+	memset(bulk_buf, 0, INT_SIZE);
+	submit(USBH_EP_INTERRUPT, EP_INT_IN, INT_SIZE, bulk_buf, INT_SIZE,
+		USBH_FLAG_NONE);
+
+	/* NAKed (channel released every time) */
+	for (i = 0; i < 100; i++) {
+		frame(h);
+	}
+
+	if (done.count != count) {
+		FAIL("interrupt IN: completed without data");
+	}
+
+	dev.int_avail = INT_SIZE;
+	if (run(h) < 0 || done.status != USBH_SUCCESS ||
+			done.transferred != INT_SIZE || ((uint8_t *) bulk_buf)[0] != 0xA5) {
+		FAIL("interrupt IN: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	return 0;
+}
+
+/* Bytes after the URB buffer, not written by the core */
+#define GUARD 0x5A
+
+static int check_guard(const char *name, uint16_t len)
+{
+	const uint8_t *buf = (const uint8_t *) bulk_buf;
+	unsigned i;
+
+	for (i = len; i < len + 4u; i++) {
+		if (buf[i] != GUARD) {
+			FAIL("%s: byte %u after the buffer written", name, i - len);
+		}
+	}
+
+	return 0;
+}
+
+static int run_bounce(usbh_host *h)
+{
+	const uint16_t lengths[] = {13, BULK_SIZE + 13};
+	unsigned i, j;
+
+	/* Interrupt IN of 1 byte (hub status change) */
+	memset(bulk_buf, GUARD, 8);
+	dev.int_avail = 1;
+	submit(USBH_EP_INTERRUPT, EP_INT_IN, 1, bulk_buf, 1, USBH_FLAG_NONE);
+	if (run(h) < 0 || done.status != USBH_SUCCESS || done.transferred != 1 ||
+			((uint8_t *) bulk_buf)[0] != 0xA5) {
+		FAIL("interrupt IN 1 byte: status %d, %u bytes", done.status,
+			done.transferred);
+	}
+
+	if (check_guard("interrupt IN 1 byte", 1)) {
+		return -1;
+	}
+
+	/* Bulk IN of 13 bytes (CSW), then whole packet and partial packet */
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		memset(bulk_buf, GUARD, lengths[i] + 4);
+		dev.in_avail = lengths[i];
+		dev.in_pos = 0;
+		submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, lengths[i],
+			USBH_FLAG_NO_SHORT_PACKET);
+		if (run(h) < 0 || done.status != USBH_SUCCESS ||
+				done.transferred != lengths[i]) {
+			FAIL("bulk IN %u bytes: status %d, %u bytes", lengths[i],
+				done.status, done.transferred);
+		}
+
+		for (j = 0; j < lengths[i]; j++) {
+			if (((uint8_t *) bulk_buf)[j] != pattern(j)) {
+				FAIL("bulk IN %u bytes: data mismatch at %u", lengths[i], j);
+			}
+		}
+
+		if (check_guard("bulk IN", lengths[i])) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int run_reject(usbh_host *h)
+{
+	usbh_urb_id id;
+	unsigned i;
+
+	/* Unaligned buffer */
+	done.count = 0;
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, ctrl_buf + 1, BULK_SIZE,
+		USBH_FLAG_NONE);
+	if (done.count != 1 || done.status != USBH_ERR_INVALID) {
+		FAIL("unaligned buffer accepted");
+	}
+
+	/* IN last partial packet larger than the bounce buffer */
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, 101,
+		USBH_FLAG_NONE);
+	if (done.count != 2 || done.status != USBH_ERR_INVALID) {
+		FAIL("IN length 101 accepted");
+	}
+
+	/* Cancel while the device NAK, channel is free again */
+	dev.in_avail = 0;
+	id = submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, BULK_SIZE,
+		USBH_FLAG_NONE);
+	for (i = 0; i < 10; i++) {
+		frame(h);
+	}
+
+	usbh_transfer_cancel(h, id);
+	if (done.count != 3 || done.status != USBH_ERR_CANCEL) {
+		FAIL("cancel: %u callbacks, status %d", done.count, done.status);
+	}
+
+	frame(h);
+	for (i = 0; i < DWC_OTG_HOST_MODEL_CHANNELS; i++) {
+		if (channels[i].state != USBH_DWC_OTG_CHAN_STATE_FREE) {
+			FAIL("cancel: channel %u not free", i);
+		}
+	}
+
+	dev.in_avail = BULK_SIZE;
+	dev.in_pos = 0;
+	submit(USBH_EP_BULK, EP_BULK_IN, BULK_SIZE, bulk_buf, BULK_SIZE,
+		USBH_FLAG_NONE);
+	if (run(h) < 0 || done.status != USBH_SUCCESS) {
+		FAIL("after cancel: status %d", done.status);
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	usbh_host *h;
+	const char *error;
+	unsigned i;
+
+	if (!dwc_otg_host_model_init(&model_device)) {
+		fprintf(stderr, "dwc-dma-test: cannot map register window\n");
+		return EXIT_FAILURE;
+	}
+
+	h = usbh_init(&dwc_otg_model_backend, &backend_config);
+	usbh_register_connected_callback(h, device_connected);
+
+	/* Enumeration: SET_ADDRESS, device descriptor */
+	dwc_otg_host_model_connect();
+	for (i = 0; i < TIMEOUT_FRAMES && device == NULL; i++) {
+		frame(h);
+	}
+
+	if (device == NULL || dev.address == 0) {
+		fprintf(stderr, "dwc-dma-test: device not enumerated\n");
+		return EXIT_FAILURE;
+	}
+
+	if (run_control(h) || run_bulk(h) || run_interrupt(h) || run_bounce(h) ||
+			run_reject(h)) {
+		error = dwc_otg_host_model_error();
+		if (error != NULL) {
+			fprintf(stderr, "dwc-dma-test: %s\n", error);
+		}
+		return EXIT_FAILURE;
+	}
+
+	error = dwc_otg_host_model_error();
+	if (error == NULL && dev.error[0]) {
+		error = dev.error;
+	}
+
+	if (error != NULL) {
+		fprintf(stderr, "dwc-dma-test: %s\n", error);
+		return EXIT_FAILURE;
+	}
+
+	printf("dwc-dma-test: OK\n");
+	return EXIT_SUCCESS;
+}
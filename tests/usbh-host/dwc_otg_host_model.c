@@ -0,0 +1,562 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unicore-mx/common/dwc_otg.h>
+#include "dwc_otg_host_model.h"
+#include "../usbd-host/mmio_trap.h"
+
+/* Control and status registers, followed by the FIFO windows */
+#define CSR_SIZE 0x1000
+#define WINDOW_SIZE 0x20000
+
+#define CHANNELS DWC_OTG_HOST_MODEL_CHANNELS
+#define FIFO_RAM_WORDS 1024
+#define FRNUM_MASK 0x3FFF
+#define MAX_PACKET 1024
+
+#define ROUND4(v) (((v) + 3) & ~3)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Offset of register (REG is a unicore-mx/common/dwc_otg.h accessor) */
+#define OFF(REG, ...) ((uint32_t) (uintptr_t) &REG(0, ##__VA_ARGS__))
+#define HW(REG, ...) model.reg[OFF(REG, ##__VA_ARGS__) / 4]
+
+#define HPRT_W1C (DWC_OTG_HPRT_PCDET | DWC_OTG_HPRT_PENCHNG | \
+			DWC_OTG_HPRT_POCCHNG)
+#define HPRT_STATUS (DWC_OTG_HPRT_PCSTS | DWC_OTG_HPRT_PENA | \
+			DWC_OTG_HPRT_PSPD_MASK)
+
+static struct {
+	uint32_t reg[CSR_SIZE / 4];
+
+	const struct dwc_otg_host_model_device *device;
+	bool connected;
+
+	/* Data toggle of the device, per address:
+	 *  bit (endpoint number + 16 for IN) set if next packet is DATA1 */
+	uint32_t toggle[128];
+
+	/* Next control/bulk channel to serve */
+	unsigned next;
+
+	struct dwc_otg_host_model_stats stats;
+	char error[160];
+} model;
+
+static void model_error(const char *fmt, ...)
+	__attribute__((format(printf, 1, 2)));
+
+static void model_error(const char *fmt, ...)
+{
+	va_list args;
+
+	if (model.error[0]) {
+		/* Only the first one */
+		return;
+	}
+
+	va_start(args, fmt);
+	vsnprintf(model.error, sizeof(model.error), fmt, args);
+	va_end(args);
+}
+
+/**
+ * Decode the channel number of a per channel register
+ * @param[in] offset Register offset
+ * @param[in] reg0 Offset of the register for channel 0
+ * @param[out] num Channel number
+ * @return true if @a offset is the register of channel @a num
+ */
+static bool chan_reg(uint32_t offset, uint32_t reg0, unsigned *num)
+{
+	const uint32_t stride = OFF(DWC_OTG_HCxCHAR, 1) - OFF(DWC_OTG_HCxCHAR, 0);
+
+	if (offset < reg0 || ((offset - reg0) % stride)) {
+		return false;
+	}
+
+	*num = (offset - reg0) / stride;
+	return *num < CHANNELS;
+}
+
+static bool dma_enabled(void)
+{
+	return !!(HW(DWC_OTG_GAHBCFG) & DWC_OTG_GAHBCFG_DMAEN);
+}
+
+static uint32_t read_haint(void)
+{
+	uint32_t haint = 0;
+	unsigned i;
+
+	for (i = 0; i < CHANNELS; i++) {
+		if (HW(DWC_OTG_HCxINT, i) & HW(DWC_OTG_HCxINTMSK, i)) {
+			haint |= 1 << i;
+		}
+	}
+
+	return haint;
+}
+
+static uint32_t read_reg(uint32_t offset)
+{
+	if (offset >= CSR_SIZE) {
+		return 0;
+	}
+
+	if (offset == OFF(DWC_OTG_GINTSTS)) {
+		return HW(DWC_OTG_GINTSTS) | (read_haint() ? DWC_OTG_GINTSTS_HCINT : 0);
+	}
+
+	if (offset == OFF(DWC_OTG_HAINT)) {
+		return read_haint();
+	}
+
+	return model.reg[offset / 4];
+}
+
+/**
+ * Check that the FIFO do not overlap the DMA registers (top of FIFO RAM,
+ *  one word per channel) in DMA mode
+ * @param[in] name FIFO name
+ * @param[in] start Start (words)
+ * @param[in] depth Depth (words)
+ */
+static void check_fifo(const char *name, uint32_t start, uint32_t depth)
+{
+	uint32_t avail = FIFO_RAM_WORDS;
+
+	if (dma_enabled()) {
+		avail -= CHANNELS;
+	}
+
+	if (start + depth > avail) {
+		model_error("%s FIFO (start %u, depth %u) beyond %u words",
+			name, start, depth, avail);
+	}
+}
+
+/**
+ * Channel halted, raise CHH with @a hcint
+ * @param[in] num Channel number
+ * @param[in] hcint Other HCxINT bits
+ */
+static void halt(unsigned num, uint32_t hcint)
+{
+	HW(DWC_OTG_HCxCHAR, num) &= ~(DWC_OTG_HCCHAR_CHENA | DWC_OTG_HCCHAR_CHDIS);
+	HW(DWC_OTG_HCxINT, num) |= hcint | DWC_OTG_HCINT_CHH;
+	model.stats.halts++;
+}
+
+static void write_hprt(uint32_t value)
+{
+	uint32_t hprt = HW(DWC_OTG_HPRT);
+	uint32_t next = (value & ~(HPRT_W1C | HPRT_STATUS)) |
+			(hprt & HPRT_STATUS) | (hprt & HPRT_W1C & ~value);
+
+	if (value & DWC_OTG_HPRT_PENA) {
+		/* Writing 1 disable the port */
+		next &= ~DWC_OTG_HPRT_PENA;
+		if (hprt & DWC_OTG_HPRT_PENA) {
+			next |= DWC_OTG_HPRT_PENCHNG;
+		}
+	}
+
+	if ((hprt & DWC_OTG_HPRT_PRST) && !(next & DWC_OTG_HPRT_PRST) &&
+			model.connected) {
+		/* Reset released: high speed device enabled at address 0 */
+		next = (next & ~DWC_OTG_HPRT_PSPD_MASK) | DWC_OTG_HPRT_PSPD_HIGH |
+				DWC_OTG_HPRT_PENA | DWC_OTG_HPRT_PENCHNG;
+		memset(model.toggle, 0, sizeof(model.toggle));
+	}
+
+	HW(DWC_OTG_HPRT) = next;
+}
+
+static void write_hcchar(unsigned num, uint32_t value)
+{
+	uint32_t hcchar = HW(DWC_OTG_HCxCHAR, num);
+
+	if (value & DWC_OTG_HCCHAR_CHDIS) {
+		/* Halted at the end of the current transaction (none running) */
+		HW(DWC_OTG_HCxCHAR, num) = value;
+		halt(num, 0);
+		return;
+	}
+
+	if (value & DWC_OTG_HCCHAR_CHENA) {
+		if (hcchar & DWC_OTG_HCCHAR_CHENA) {
+			model_error("channel %u enabled while enabled", num);
+		}
+
+		if (!dma_enabled()) {
+			model_error("channel %u enabled in slave mode (not modelled)", num);
+		}
+
+		if (HW(DWC_OTG_HCxDMA, num) & 0x3) {
+			model_error("channel %u enabled with unaligned DMA address 0x%08x",
+				num, HW(DWC_OTG_HCxDMA, num));
+		}
+	}
+
+	HW(DWC_OTG_HCxCHAR, num) = value;
+}
+
+static void write_reg(uint32_t offset, uint32_t value)
+{
+	unsigned num;
+
+	if (offset >= CSR_SIZE) {
+		/* reported by check_access() */
+		return;
+	}
+
+	if (offset == OFF(DWC_OTG_GRSTCTL)) {
+		if (value & DWC_OTG_GRSTCTL_CSRST) {
+			uint32_t ghwcfg2 = HW(DWC_OTG_GHWCFG2);
+			uint32_t ghwcfg3 = HW(DWC_OTG_GHWCFG3);
+			uint32_t hprt = HW(DWC_OTG_HPRT);
+			memset(model.reg, 0, sizeof(model.reg));
+			HW(DWC_OTG_GHWCFG2) = ghwcfg2;
+			HW(DWC_OTG_GHWCFG3) = ghwcfg3;
+			HW(DWC_OTG_HPRT) = hprt & (DWC_OTG_HPRT_PCSTS | DWC_OTG_HPRT_PCDET);
+		}
+
+		/* Reset and flush complete immediately */
+		HW(DWC_OTG_GRSTCTL) = DWC_OTG_GRSTCTL_AHBIDL;
+	} else if (offset == OFF(DWC_OTG_GINTSTS)) {
+		HW(DWC_OTG_GINTSTS) &= ~value;
+	} else if (offset == OFF(DWC_OTG_HPRT)) {
+		write_hprt(value);
+	} else if (offset == OFF(DWC_OTG_HAINT) ||
+				offset == OFF(DWC_OTG_HFNUM) ||
+				offset == OFF(DWC_OTG_GHWCFG2) ||
+				offset == OFF(DWC_OTG_GHWCFG3)) {
+		/* Read only */
+	} else if (offset == OFF(DWC_OTG_GNPTXFSIZ)) {
+		check_fifo("non periodic TX", value & 0xFFFF, value >> 16);
+		if ((value & 0xFFFF) < HW(DWC_OTG_GRXFSIZ)) {
+			model_error("non periodic TX FIFO overlap RX FIFO");
+		}
+		model.reg[offset / 4] = value;
+	} else if (offset == OFF(DWC_OTG_HPTXFSIZ)) {
+		check_fifo("periodic TX", value & 0xFFFF, value >> 16);
+		model.reg[offset / 4] = value;
+	} else if (chan_reg(offset, OFF(DWC_OTG_HCxINT, 0), &num)) {
+		model.reg[offset / 4] &= ~value;
+	} else if (chan_reg(offset, OFF(DWC_OTG_HCxCHAR, 0), &num)) {
+		write_hcchar(num, value);
+	} else {
+		model.reg[offset / 4] = value;
+	}
+}
+
+/**
+ * Check access that are not part of DMA mode programming model
+ * @param[in] offset Register offset
+ */
+static void check_access(uint32_t offset)
+{
+	if (!dma_enabled()) {
+		return;
+	}
+
+	if (offset >= CSR_SIZE) {
+		model_error("CPU access to FIFO 0x%x in DMA mode", offset);
+	} else if (offset == OFF(DWC_OTG_GRXSTSP) ||
+				offset == OFF(DWC_OTG_GRXSTSR)) {
+		model_error("CPU access to RX status in DMA mode");
+	}
+}
+
+static uint32_t trap_read(uint32_t offset)
+{
+	check_access(offset);
+	return read_reg(offset);
+}
+
+bool dwc_otg_host_model_init(const struct dwc_otg_host_model_device *device)
+{
+	memset(&model, 0, sizeof(model));
+	model.device = device;
+	HW(DWC_OTG_GRSTCTL) = DWC_OTG_GRSTCTL_AHBIDL;
+	HW(DWC_OTG_GHWCFG2) = DWC_OTG_GHWCFG2_NUMHSTCHNL(CHANNELS - 1);
+	HW(DWC_OTG_GHWCFG3) = DWC_OTG_GHWCFG3_DFIFODEPTH(FIFO_RAM_WORDS);
+
+	return mmio_trap_init(DWC_OTG_HOST_MODEL_BASE, WINDOW_SIZE, trap_read,
+				write_reg);
+}
+
+void dwc_otg_host_model_connect(void)
+{
+	model.connected = true;
+	HW(DWC_OTG_HPRT) |= DWC_OTG_HPRT_PCSTS | DWC_OTG_HPRT_PCDET;
+}
+
+static void dma_write(uint32_t addr, const void *data, uint16_t len)
+{
+	if (addr & 0x3) {
+		model_error("DMA write to unaligned address 0x%08x", addr);
+		return;
+	}
+
+	/* Core write whole words */
+	uint8_t *mem = (uint8_t *) (uintptr_t) addr;
+	memcpy(mem, data, len);
+	memset(mem + len, 0, ROUND4(len) - len);
+	model.stats.dma_bytes += len;
+}
+
+static void dma_read(uint32_t addr, void *data, uint16_t len)
+{
+	if (addr & 0x3) {
+		model_error("DMA read from unaligned address 0x%08x", addr);
+		return;
+	}
+
+	memcpy(data, (const void *) (uintptr_t) addr, len);
+	model.stats.dma_bytes += len;
+}
+
+/**
+ * Packet of @a len bytes acknowledged: move HCxDMA, HCxTSIZ to next packet
+ * @param[in] num Channel number
+ * @param[in] len Packet size
+ * @param[in] toggle Toggle DPID (not isochronous)
+ * @return true if the transfer is complete (PKTCNT reached 0)
+ */
+static bool packet_done(unsigned num, uint16_t len, bool toggle)
+{
+	uint32_t hctsiz = HW(DWC_OTG_HCxTSIZ, num);
+	uint32_t xfrsiz = hctsiz & DWC_OTG_HCTSIZ_XFRSIZ_MASK;
+	uint32_t pktcnt = (hctsiz & DWC_OTG_HCTSIZ_PKTCNT_MASK) >> 19;
+	uint32_t dpid = hctsiz & DWC_OTG_HCTSIZ_DPID_MASK;
+
+	if (toggle) {
+		dpid = (dpid == DWC_OTG_HCTSIZ_DPID_DATA1) ?
+			DWC_OTG_HCTSIZ_DPID_DATA0 : DWC_OTG_HCTSIZ_DPID_DATA1;
+	}
+
+	xfrsiz -= MIN(xfrsiz, len);
+	pktcnt--;
+
+	HW(DWC_OTG_HCxTSIZ, num) = dpid | (pktcnt << 19) | xfrsiz;
+	HW(DWC_OTG_HCxDMA, num) += len;
+	HW(DWC_OTG_HCxINT, num) |= DWC_OTG_HCINT_ACK;
+	model.stats.packets++;
+
+	return !pktcnt;
+}
+
+/**
+ * Check the data PID of the channel against the device endpoint toggle,
+ *  and toggle the endpoint
+ * @param[in] num Channel number
+ * @param[in] address Device address
+ * @param[in] ep_addr Endpoint address
+ * @return false if the data PID is not the expected one
+ */
+static bool check_toggle(unsigned num, uint8_t address, uint8_t ep_addr)
+{
+	uint32_t dpid = HW(DWC_OTG_HCxTSIZ, num) & DWC_OTG_HCTSIZ_DPID_MASK;
+	uint32_t bit = (1 << (ep_addr & 0xF)) << ((ep_addr & 0x80) ? 16 : 0);
+	bool data1 = !!(model.toggle[address] & bit);
+
+	if (dpid != (data1 ? DWC_OTG_HCTSIZ_DPID_DATA1 :
+						DWC_OTG_HCTSIZ_DPID_DATA0)) {
+		model_error("channel %u: device %u endpoint 0x%02x expect DATA%u",
+			num, address, ep_addr, data1);
+		return false;
+	}
+
+	model.toggle[address] ^= bit;
+	return true;
+}
+
+/**
+ * Token NAKed (or no response): periodic channel is halted,
+ *  control/bulk retried by the core
+ * @param[in] num Channel number
+ * @param[in] periodic Periodic channel
+ */
+static void nak(unsigned num, bool periodic)
+{
+	model.stats.nak++;
+
+	if (periodic) {
+		halt(num, DWC_OTG_HCINT_NAK);
+	} else {
+		HW(DWC_OTG_HCxINT, num) |= DWC_OTG_HCINT_NAK;
+	}
+}
+
+/**
+ * Perform one transaction of the channel
+ * @param[in] num Channel number
+ */
+static void transaction(unsigned num)
+{
+	uint32_t hcchar = HW(DWC_OTG_HCxCHAR, num);
+	uint32_t hctsiz = HW(DWC_OTG_HCxTSIZ, num);
+	uint32_t addr = HW(DWC_OTG_HCxDMA, num);
+	uint32_t xfrsiz = hctsiz & DWC_OTG_HCTSIZ_XFRSIZ_MASK;
+	uint32_t type = hcchar & DWC_OTG_HCCHAR_EPTYP_MASK;
+	uint8_t address = (hcchar & DWC_OTG_HCCHAR_DAD_MASK) >> 22;
+	uint8_t ep_num = (hcchar & DWC_OTG_HCCHAR_EPNUM_MASK) >> 11;
+	uint16_t mps = hcchar & DWC_OTG_HCCHAR_MPSIZ_MASK;
+	bool in = !!(hcchar & DWC_OTG_HCCHAR_EPDIR_IN);
+	bool iso = (type == DWC_OTG_HCCHAR_EPTYP_ISOCHRONOUS);
+	bool periodic = iso || (type == DWC_OTG_HCCHAR_EPTYP_INTERRUPT);
+	enum dwc_otg_host_model_handshake hs;
+	uint8_t buf[MAX_PACKET + 4];
+	uint16_t len;
+
+	if (!(hctsiz & DWC_OTG_HCTSIZ_PKTCNT_MASK)) {
+		model_error("channel %u enabled with PKTCNT = 0", num);
+		halt(num, DWC_OTG_HCINT_XFRC);
+		return;
+	}
+
+	if (type == DWC_OTG_HCCHAR_EPTYP_CONTROL &&
+			(hctsiz & DWC_OTG_HCTSIZ_DPID_MASK) == DWC_OTG_HCTSIZ_DPID_MDATA) {
+		struct usb_setup_data setup;
+
+		if (in || xfrsiz != 8) {
+			model_error("channel %u: malformed SETUP", num);
+		}
+
+		dma_read(addr, &setup, 8);
+		model.device->setup(address, &setup);
+
+		/* Data and status stage start with DATA1 */
+		model.toggle[address] |= (1 << 0) | (1 << 16);
+		packet_done(num, 8, false);
+		halt(num, DWC_OTG_HCINT_XFRC);
+		return;
+	}
+
+	if (in) {
+		len = 0;
+		hs = model.device->in(address, ep_num | 0x80, buf, mps, &len);
+	} else {
+		len = MIN(xfrsiz, mps);
+		dma_read(addr, buf, len);
+		hs = model.device->out(address, ep_num, buf, len);
+	}
+
+	switch (hs) {
+	case DWC_OTG_HOST_MODEL_NAK:
+		nak(num, periodic);
+	return;
+	case DWC_OTG_HOST_MODEL_STALL:
+		halt(num, DWC_OTG_HCINT_STALL);
+	return;
+	case DWC_OTG_HOST_MODEL_ACK:
+	break;
+	}
+
+	if (!iso && !check_toggle(num, address, ep_num | (in ? 0x80 : 0))) {
+		halt(num, DWC_OTG_HCINT_DTERR);
+		return;
+	}
+
+	if (in) {
+		if (len > mps || len > xfrsiz) {
+			halt(num, DWC_OTG_HCINT_BBERR);
+			return;
+		}
+
+		dma_write(addr, buf, len);
+	}
+
+	if (packet_done(num, len, !iso) || (in && len < mps)) {
+		halt(num, DWC_OTG_HCINT_XFRC);
+	} else if (periodic) {
+		/* One transaction per (micro)frame */
+		halt(num, 0);
+	}
+}
+
+static bool chan_enabled(unsigned num, bool periodic)
+{
+	uint32_t hcchar = HW(DWC_OTG_HCxCHAR, num);
+	uint32_t type = hcchar & DWC_OTG_HCCHAR_EPTYP_MASK;
+
+	if (!(hcchar & DWC_OTG_HCCHAR_CHENA)) {
+		return false;
+	}
+
+	return periodic == (type == DWC_OTG_HCCHAR_EPTYP_ISOCHRONOUS ||
+				type == DWC_OTG_HCCHAR_EPTYP_INTERRUPT);
+}
+
+void dwc_otg_host_model_frame(unsigned packets)
+{
+	uint32_t frame = (HW(DWC_OTG_HFNUM) + 1) & FRNUM_MASK;
+	unsigned i, idle;
+
+	HW(DWC_OTG_HFNUM) = frame;
+	HW(DWC_OTG_GINTSTS) |= DWC_OTG_GINTSTS_SOF;
+
+	if (!(HW(DWC_OTG_HPRT) & DWC_OTG_HPRT_PENA)) {
+		return;
+	}
+
+	/* Periodic transactions, in the frame given by ODDFRM */
+	for (i = 0; i < CHANNELS; i++) {
+		bool odd = !!(HW(DWC_OTG_HCxCHAR, i) & DWC_OTG_HCCHAR_ODDFRM);
+
+		if (chan_enabled(i, true) && odd == (frame & 1)) {
+			transaction(i);
+		}
+	}
+
+	/* Control/bulk channels in turn, one transaction each */
+	for (idle = 0; packets && idle < CHANNELS; ) {
+		i = model.next;
+		model.next = (model.next + 1) % CHANNELS;
+
+		if (!chan_enabled(i, false)) {
+			idle++;
+			continue;
+		}
+
+		idle = 0;
+		packets--;
+		transaction(i);
+	}
+}
+
+uint32_t dwc_otg_host_model_peek(uint32_t offset)
+{
+	return read_reg(offset);
+}
+
+const struct dwc_otg_host_model_stats *dwc_otg_host_model_stats(void)
+{
+	model.stats.reads = mmio_trap_stats()->reads;
+	model.stats.writes = mmio_trap_stats()->writes;
+	return &model.stats;
+}
+
+const char *dwc_otg_host_model_error(void)
+{
+	return model.error[0] ? model.error : NULL;
+}
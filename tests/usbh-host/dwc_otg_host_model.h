@@ -0,0 +1,153 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Register level model of the DWC OTG core (host mode, internal DMA).
+ *
+ * The unmodified backend (lib/usbh/backend/usbh_dwc_otg.c) is run against
+ *  a register window mapped at DWC_OTG_HOST_MODEL_BASE.
+ * Every register access of the backend is trapped (../usbd-host/mmio_trap.h)
+ *  and executed by the model: root port (HPRT write 1 to clear bits, reset
+ *  and enable), channels (enable, disable, halt), HAINT and GINTSTS.
+ *
+ * A channel move the data of HCxTSIZ by DMA from/to HCxDMA, as the core do:
+ *  - Control/bulk: packets till the end of the transfer, a short packet,
+ *    or an error. NAK are retried by the core (the channel stay enabled).
+ *  - Interrupt/isochronous: one transaction, in the (micro)frame of
+ *    HCxCHAR.ODDFRM. NAK halt the channel.
+ *  - The channel halt (CHH) at the end, with XFRC or the error bits.
+ *  - HCxTSIZ (XFRSIZ, PKTCNT, DPID) and HCxDMA are updated per packet.
+ *
+ * The model check that the backend follow the programming model of DMA mode
+ *  (no FIFO access from CPU, aligned DMA address, FIFO RAM not overlapping
+ *  the DMA registers, channel not enabled twice) and the data toggle of
+ *  every data packet against the device (DATA0/DATA1 sequence per endpoint,
+ *  SETUP reset endpoint 0).
+ * The first violation is recorded, see dwc_otg_host_model_error().
+ *
+ * The device (address and endpoints) is given as callbacks, the model
+ *  call them for every token.
+ *
+ * Linux x86-64 only (page fault error code and trap flag are used),
+ *  the program should be linked with -no-pie (DMA address are 32bit).
+ */
+
+#ifndef DWC_OTG_HOST_MODEL_H
+#define DWC_OTG_HOST_MODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <unicore-mx/usb/usbstd.h>
+
+/** Register window (same as OTG_HS on STM32F4) */
+#define DWC_OTG_HOST_MODEL_BASE 0x40040000
+
+/** Channels of the core */
+#define DWC_OTG_HOST_MODEL_CHANNELS 8
+
+/** Handshake of the device for a token */
+enum dwc_otg_host_model_handshake {
+	DWC_OTG_HOST_MODEL_ACK = 0,
+	DWC_OTG_HOST_MODEL_NAK = 1,
+	DWC_OTG_HOST_MODEL_STALL = 2
+};
+
+/** Device connected to the root port (high speed) */
+struct dwc_otg_host_model_device {
+	/**
+	 * SETUP received (always acknowledged)
+	 * @param[in] address Device address
+	 * @param[in] setup Setup data
+	 */
+	void (*setup)(uint8_t address, const struct usb_setup_data *setup);
+
+	/**
+	 * IN token
+	 * @param[in] address Device address
+	 * @param[in] ep_addr Endpoint address (with direction bit)
+	 * @param[out] buf Data packet (1024 bytes available)
+	 * @param[in] max_len Endpoint size (HCxCHAR.MPSIZ)
+	 * @param[out] len Packet size, more than @a max_len is a babble
+	 * @return handshake
+	 */
+	enum dwc_otg_host_model_handshake (*in)(uint8_t address, uint8_t ep_addr,
+			void *buf, uint16_t max_len, uint16_t *len);
+
+	/**
+	 * OUT token with data packet
+	 * @param[in] address Device address
+	 * @param[in] ep_addr Endpoint address
+	 * @param[in] buf Data packet
+	 * @param[in] len Packet size
+	 * @return handshake
+	 */
+	enum dwc_otg_host_model_handshake (*out)(uint8_t address, uint8_t ep_addr,
+			const void *buf, uint16_t len);
+};
+
+struct dwc_otg_host_model_stats {
+	uint64_t reads; /**< Register read by CPU */
+	uint64_t writes; /**< Register write (or read-modify-write) by CPU */
+	uint64_t halts; /**< Channel halted (CHH) */
+	uint64_t packets; /**< Data packets acknowledged */
+	uint64_t nak; /**< Token NAKed */
+	uint64_t dma_bytes; /**< Bytes moved by core DMA */
+};
+
+/**
+ * Map the register window and install the fault handlers.
+ * The core is in reset state (GHWCFG2/GHWCFG3: DWC_OTG_HOST_MODEL_CHANNELS
+ *  channels, 4KB FIFO RAM), nothing connected.
+ * @param[in] device Device callbacks
+ * @return false if the window could not be mapped
+ */
+bool dwc_otg_host_model_init(const struct dwc_otg_host_model_device *device);
+
+/**
+ * Connect the device to the root port (HPRT.PCDET).
+ * The port is enabled (high speed) when the backend release the reset.
+ */
+void dwc_otg_host_model_connect(void);
+
+/**
+ * Run one (micro)frame: SOF (HFNUM, GINTSTS.SOF) then the transactions
+ *  of the enabled channels (periodic first, then control/bulk in turn,
+ *  @a packets at most).
+ * @param[in] packets Control/bulk packet (or NAK) budget of the frame
+ */
+void dwc_otg_host_model_frame(unsigned packets);
+
+/**
+ * Read a register without being accounted (and without side effect)
+ * @param[in] offset Register offset
+ * @return register value
+ */
+uint32_t dwc_otg_host_model_peek(uint32_t offset);
+
+/**
+ * Get the statistics (snapshot, call again to refresh)
+ * @return statistics
+ */
+const struct dwc_otg_host_model_stats *dwc_otg_host_model_stats(void);
+
+/**
+ * Get the first programming model violation
+ * @return description, NULL if none
+ */
+const char *dwc_otg_host_model_error(void);
+
+#endif
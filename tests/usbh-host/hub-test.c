@@ -0,0 +1,815 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbh hub driver (usbh_hub.c) test against a bus model.
+ *
+ * The backend complete URBs at the transaction level: hubs (port power,
+ * reset, status, status change endpoint) and devices (SET_ADDRESS,
+ * descriptors) are modelled, a transfer submitted is answered at the next
+ * poll (1ms). Devices NAK GET_DESCRIPTOR for a while after SET_ADDRESS
+ * (slow firmware).
+ *
+ * - Four devices (low, full, high speed) on a root hub: speed detected,
+ *   never two devices at address 0, port resets overlap enumeration of
+ *   the previous device (compared to the serial time)
+ * - Hot unplug/replug, usbh_device_reset() of a device behind the hub
+ * - Chain of hubs: a device at the 5-tier limit is enumerated, a sixth
+ *   hub is reported as a plain device; unplugging a hub in the middle
+ *   disconnect its subtree and free the hubs, replug enumerate it again
+ * - Root device disconnect
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usbh-private.h"
+
+/* Poll period (us) and limit of a scenario (ms) */
+#define POLL_US 1000
+#define TIMEOUT_MS 5000
+
+/* Device answer GET_DESCRIPTOR this long after SET_ADDRESS */
+#define DESC_DELAY_MS 20
+
+#define PORT_RESET_MS 10
+#define HUB_PORTS 4
+#define MAX_NODES 12
+
+struct node {
+	bool used;
+	bool hub;
+	usbh_speed speed;
+	uint8_t address;
+	uint64_t busy_until;
+	struct node *parent;
+	uint8_t port;
+
+	/* hub */
+	bool configured;
+	uint16_t status[HUB_PORTS + 1];
+	uint16_t change[HUB_PORTS + 1];
+	uint64_t reset_done[HUB_PORTS + 1];
+	struct node *child[HUB_PORTS + 1];
+
+	/* test */
+	uint64_t reset_at;
+	uint64_t enum_done;
+	usbh_device *dev;
+};
+
+static struct {
+	usbh_host host;
+	struct node node[MAX_NODES];
+	struct node *root;
+	bool root_changed;
+	uint64_t now;
+
+	/* checks */
+	unsigned collisions;
+	unsigned max_address0;
+	unsigned resets;
+	unsigned connected;
+	unsigned disconnected;
+} bus;
+
+#define FAIL(...) do { \
+		fprintf(stderr, "hub-test: " __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		return -1; \
+	} while (0)
+
+static struct node *node_new(bool hub, usbh_speed speed)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_NODES; i++) {
+		struct node *n = &bus.node[i];
+		if (!n->used) {
+			memset(n, 0, sizeof(*n));
+			n->used = true;
+			n->hub = hub;
+			n->speed = speed;
+			return n;
+		}
+	}
+
+	fprintf(stderr, "hub-test: out of nodes\n");
+	exit(EXIT_FAILURE);
+}
+
+static void node_free(struct node *n)
+{
+	unsigned i;
+
+	for (i = 1; i <= HUB_PORTS; i++) {
+		if (n->child[i] != NULL) {
+			node_free(n->child[i]);
+		}
+	}
+
+	n->used = false;
+}
+
+static bool reachable(struct node *n)
+{
+	for (; n->parent != NULL; n = n->parent) {
+		uint16_t s = n->parent->status[n->port];
+		if (!(s & USB_HUB_PORT_STATUS_ENABLE) ||
+				(s & USB_HUB_PORT_STATUS_RESET)) {
+			return false;
+		}
+	}
+
+	return n == bus.root;
+}
+
+static void plug(struct node *hub, uint8_t port, struct node *n)
+{
+	n->parent = hub;
+	n->port = port;
+	hub->child[port] = n;
+
+	if (hub->status[port] & USB_HUB_PORT_STATUS_POWER) {
+		hub->status[port] |= USB_HUB_PORT_STATUS_CONNECTION;
+		hub->change[port] |= USB_HUB_PORT_CHANGE_CONNECTION;
+	}
+}
+
+static void unplug(struct node *hub, uint8_t port)
+{
+	hub->status[port] &= ~(USB_HUB_PORT_STATUS_CONNECTION |
+		USB_HUB_PORT_STATUS_ENABLE | USB_HUB_PORT_STATUS_LOW_SPEED |
+		USB_HUB_PORT_STATUS_HIGH_SPEED);
+	hub->change[port] |= USB_HUB_PORT_CHANGE_CONNECTION;
+	node_free(hub->child[port]);
+	hub->child[port] = NULL;
+}
+
+/* Descriptors */
+
+static uint16_t device_desc(struct node *n, uint8_t *buf)
+{
+	struct usb_device_descriptor d = {
+		.bLength = USB_DT_DEVICE_SIZE,
+		.bDescriptorType = USB_DT_DEVICE,
+		.bcdUSB = 0x0200,
+		.bDeviceClass = n->hub ? USB_CLASS_HUB : 0,
+		.bMaxPacketSize0 = (n->speed == USBH_SPEED_LOW) ? 8 : 64,
+		.idVendor = 0xcafe,
+		.idProduct = n->hub ? 0x0009 : 0x0001,
+		.bNumConfigurations = 1
+	};
+
+	memcpy(buf, &d, sizeof(d));
+	return sizeof(d);
+}
+
+static uint16_t config_desc(struct node *n, uint8_t *buf)
+{
+	struct usb_config_descriptor c = {
+		.bLength = USB_DT_CONFIGURATION_SIZE,
+		.bDescriptorType = USB_DT_CONFIGURATION,
+		.wTotalLength = USB_DT_CONFIGURATION_SIZE +
+			USB_DT_INTERFACE_SIZE + USB_DT_ENDPOINT_SIZE,
+		.bNumInterfaces = 1,
+		.bConfigurationValue = 1,
+		.bmAttributes = 0xE0
+	};
+	struct usb_interface_descriptor i = {
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bNumEndpoints = 1,
+		.bInterfaceClass = USB_CLASS_HUB
+	};
+	struct usb_endpoint_descriptor e = {
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = 0x81,
+		.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+		.wMaxPacketSize = 1,
+		.bInterval = (n->speed == USBH_SPEED_HIGH) ? 12 : 255
+	};
+
+	memcpy(buf, &c, USB_DT_CONFIGURATION_SIZE);
+	memcpy(buf + USB_DT_CONFIGURATION_SIZE, &i, USB_DT_INTERFACE_SIZE);
+	memcpy(buf + USB_DT_CONFIGURATION_SIZE + USB_DT_INTERFACE_SIZE, &e,
+		USB_DT_ENDPOINT_SIZE);
+	return c.wTotalLength;
+}
+
+static uint16_t hub_desc(uint8_t *buf)
+{
+	struct usb_hub_descriptor d = {
+		.bDescLength = USB_DT_HUB_SIZE + 2,
+		.bDescriptorType = USB_DT_HUB,
+		.bNbrPorts = HUB_PORTS,
+		.wHubCharacteristics = USB_HUB_CHAR_POWER_INDIVIDUAL,
+		.bPwrOn2PwrGood = 50,
+		.bHubContrCurrent = 100
+	};
+
+	memcpy(buf, &d, USB_DT_HUB_SIZE);
+	buf[USB_DT_HUB_SIZE] = 0;
+	buf[USB_DT_HUB_SIZE + 1] = 0xFF;
+	return USB_DT_HUB_SIZE + 2;
+}
+
+/* Requests */
+
+static void port_reset(struct node *hub, uint8_t port)
+{
+	struct node *child = hub->child[port];
+
+	hub->status[port] |= USB_HUB_PORT_STATUS_RESET;
+	hub->status[port] &= ~USB_HUB_PORT_STATUS_ENABLE;
+	hub->reset_done[port] = bus.now + PORT_RESET_MS * 1000;
+
+	child->address = 0;
+	child->configured = false;
+	child->reset_at = bus.now;
+	child->enum_done = 0;
+	bus.resets++;
+}
+
+static int hub_request(struct node *n, const struct usb_setup_data *setup,
+		uint8_t *buf, uint16_t *len)
+{
+	uint8_t port = setup->wIndex;
+	bool to_port = (setup->bmRequestType & USB_REQ_TYPE_RECIPIENT) ==
+		USB_REQ_TYPE_OTHER;
+
+	if (to_port && (!port || port > HUB_PORTS)) {
+		return -1;
+	}
+
+	switch (setup->bRequest) {
+	case USB_HUB_REQ_GET_DESCRIPTOR:
+		if ((setup->wValue >> 8) != USB_DT_HUB) {
+			return -1;
+		}
+		*len = hub_desc(buf);
+	return 0;
+	case USB_HUB_REQ_GET_STATUS:
+		memset(buf, 0, 4);
+		if (to_port) {
+			memcpy(buf, &n->status[port], 2);
+			memcpy(buf + 2, &n->change[port], 2);
+		}
+		*len = 4;
+	return 0;
+	case USB_HUB_REQ_SET_FEATURE:
+		if (!to_port) {
+			return -1;
+		}
+
+		switch (setup->wValue) {
+		case USB_HUB_FEAT_PORT_POWER:
+			n->status[port] |= USB_HUB_PORT_STATUS_POWER;
+			if (n->child[port] != NULL) {
+				n->status[port] |= USB_HUB_PORT_STATUS_CONNECTION;
+				n->change[port] |= USB_HUB_PORT_CHANGE_CONNECTION;
+			}
+		return 0;
+		case USB_HUB_FEAT_PORT_RESET:
+			if (!(n->status[port] & USB_HUB_PORT_STATUS_CONNECTION)) {
+				return 0;
+			}
+			port_reset(n, port);
+		return 0;
+		}
+	return -1;
+	case USB_HUB_REQ_CLEAR_FEATURE:
+		if (!to_port) {
+			return 0;
+		}
+
+		if (setup->wValue < USB_HUB_FEAT_C_PORT_CONNECTION ||
+				setup->wValue > USB_HUB_FEAT_C_PORT_RESET) {
+			return -1;
+		}
+
+		n->change[port] &= ~(1 <<
+			(setup->wValue - USB_HUB_FEAT_C_PORT_CONNECTION));
+	return 0;
+	}
+
+	return -1;
+}
+
+static int request(struct node *n, const struct usb_setup_data *setup,
+		uint8_t *buf, uint16_t *len)
+{
+	*len = 0;
+
+	if ((setup->bmRequestType & USB_REQ_TYPE_TYPE) == USB_REQ_TYPE_CLASS) {
+		return n->hub ? hub_request(n, setup, buf, len) : -1;
+	}
+
+	switch (setup->bRequest) {
+	case USB_REQ_SET_ADDRESS:
+		n->address = setup->wValue;
+		n->busy_until = bus.now + DESC_DELAY_MS * 1000;
+	return 0;
+	case USB_REQ_GET_DESCRIPTOR:
+		switch (setup->wValue >> 8) {
+		case USB_DT_DEVICE:
+			*len = device_desc(n, buf);
+		return 0;
+		case USB_DT_CONFIGURATION:
+			if (!n->hub) {
+				return -1;
+			}
+			*len = config_desc(n, buf);
+		return 0;
+		}
+	return -1;
+	case USB_REQ_SET_CONFIGURATION:
+		n->configured = true;
+	return 0;
+	}
+
+	return -1;
+}
+
+/* Backend */
+
+static struct node *route(uint8_t address)
+{
+	struct node *found = NULL;
+	unsigned i, count = 0;
+
+	for (i = 0; i < MAX_NODES; i++) {
+		struct node *n = &bus.node[i];
+		if (n->used && reachable(n) && n->address == address) {
+			found = n;
+			count++;
+		}
+	}
+
+	if (count > 1) {
+		bus.collisions++;
+	}
+
+	return found;
+}
+
+static void complete(usbh_urb *urb, const uint8_t *data, uint16_t len,
+		usbh_transfer_status status)
+{
+	if (len) {
+		len = MIN(len, urb->transfer.length);
+		memcpy(urb->transfer.data, data, len);
+	}
+
+	urb->transfer.transferred = len;
+	urb->backend_tag = INVALID_BACKEND_TAG;
+	usbh_urb_free(urb, status);
+}
+
+static void process(usbh_urb *urb)
+{
+	usbh_transfer *transfer = &urb->transfer;
+	struct node *n = route(transfer->device->address);
+	uint8_t buf[64];
+	uint16_t len;
+	unsigned i;
+
+	if (n == NULL) {
+		complete(urb, NULL, 0, USBH_ERR_IO);
+		return;
+	}
+
+	if (transfer->ep_type == USBH_EP_INTERRUPT) {
+		/* Status change bitmap, NAK if nothing */
+		uint8_t bitmap = 0;
+
+		for (i = 1; i <= HUB_PORTS; i++) {
+			if (n->change[i]) {
+				bitmap |= 1 << i;
+			}
+		}
+
+		if (bitmap) {
+			complete(urb, &bitmap, 1, USBH_SUCCESS);
+		}
+		return;
+	}
+
+	if (n->busy_until > bus.now &&
+			transfer->setup.bRequest == USB_REQ_GET_DESCRIPTOR) {
+		return;
+	}
+
+	if (request(n, &transfer->setup, buf, &len)) {
+		complete(urb, NULL, 0, USBH_ERR_STALL);
+	} else {
+		complete(urb, buf, len, USBH_SUCCESS);
+	}
+}
+
+static void count_address0(void)
+{
+	unsigned i, count = 0;
+
+	for (i = 0; i < MAX_NODES; i++) {
+		struct node *n = &bus.node[i];
+		if (n->used && reachable(n) && !n->address) {
+			count++;
+		}
+	}
+
+	bus.max_address0 = MAX(bus.max_address0, count);
+}
+
+static void fake_poll(usbh_host *host, uint64_t now)
+{
+	bool ready[USBH_URB_COUNT];
+	unsigned i, p;
+
+	bus.now = now;
+
+	if (bus.root_changed) {
+		bus.root_changed = false;
+		if (bus.root != NULL) {
+			bus.root->reset_at = now;
+			usbh_root_device_connected(host, bus.root->speed);
+		}
+	}
+
+	for (i = 0; i < MAX_NODES; i++) {
+		struct node *n = &bus.node[i];
+
+		if (!n->used || !n->hub) {
+			continue;
+		}
+
+		for (p = 1; p <= HUB_PORTS; p++) {
+			struct node *child = n->child[p];
+
+			if (!(n->status[p] & USB_HUB_PORT_STATUS_RESET) ||
+					now < n->reset_done[p]) {
+				continue;
+			}
+
+			n->status[p] &= ~USB_HUB_PORT_STATUS_RESET;
+			n->status[p] |= USB_HUB_PORT_STATUS_ENABLE;
+			if (child->speed == USBH_SPEED_LOW) {
+				n->status[p] |= USB_HUB_PORT_STATUS_LOW_SPEED;
+			} else if (child->speed == USBH_SPEED_HIGH) {
+				n->status[p] |= USB_HUB_PORT_STATUS_HIGH_SPEED;
+			}
+			n->change[p] |= USB_HUB_PORT_CHANGE_RESET;
+		}
+	}
+
+	/* Transfers submitted before this poll */
+	for (i = 0; i < USBH_URB_COUNT; i++) {
+		usbh_urb *urb = &host->urbs.arr[i];
+		ready[i] = !IS_URB_INVALID(urb) &&
+			urb->backend_tag != INVALID_BACKEND_TAG;
+	}
+
+	for (i = 0; i < USBH_URB_COUNT; i++) {
+		usbh_urb *urb = &host->urbs.arr[i];
+		if (ready[i] && !IS_URB_INVALID(urb) &&
+				urb->backend_tag != INVALID_BACKEND_TAG) {
+			process(urb);
+		}
+	}
+
+	count_address0();
+}
+
+static usbh_host *fake_init(const usbh_backend_config *config)
+{
+	(void) config;
+	return &bus.host;
+}
+
+static usbh_speed fake_speed(usbh_host *host)
+{
+	(void) host;
+	return USBH_SPEED_HIGH;
+}
+
+static void fake_reset(usbh_host *host)
+{
+	(void) host;
+	bus.root_changed = true;
+}
+
+static void fake_submit(usbh_host *host, usbh_urb *urb)
+{
+	(void) host;
+	urb->backend_tag = 0;
+}
+
+static void fake_cancel(usbh_host *host, usbh_urb *urb)
+{
+	(void) host;
+	urb->backend_tag = INVALID_BACKEND_TAG;
+}
+
+static const usbh_backend fake_backend = {
+	.init = fake_init,
+	.speed = fake_speed,
+	.poll = fake_poll,
+	.reset = fake_reset,
+	.transfer_submit = fake_submit,
+	.transfer_cancel = fake_cancel
+};
+
+/* Application */
+
+static struct node *node_by_address(uint8_t address)
+{
+	unsigned i;
+
+	for (i = 0; i < MAX_NODES; i++) {
+		struct node *n = &bus.node[i];
+		if (n->used && reachable(n) && n->address == address) {
+			return n;
+		}
+	}
+
+	return NULL;
+}
+
+static void device_disconnected(usbh_device *dev)
+{
+	unsigned i;
+
+	bus.disconnected++;
+
+	for (i = 0; i < MAX_NODES; i++) {
+		if (bus.node[i].dev == dev) {
+			bus.node[i].dev = NULL;
+		}
+	}
+}
+
+static void device_connected(usbh_device *dev)
+{
+	struct node *n = node_by_address(usbh_device_address(dev));
+
+	bus.connected++;
+
+	if (n == NULL) {
+		fprintf(stderr, "hub-test: connected device not on bus\n");
+		exit(EXIT_FAILURE);
+	}
+
+	n->dev = dev;
+	n->enum_done = bus.now;
+	usbh_device_register_disconnected_callback(dev, device_disconnected);
+}
+
+static usbh_host *start(void)
+{
+	usbh_host *host;
+
+	memset(&bus, 0, sizeof(bus));
+	host = usbh_init(&fake_backend, NULL);
+	usbh_register_connected_callback(host, device_connected);
+	return host;
+}
+
+static void root_plug(struct node *n)
+{
+	bus.root = n;
+	bus.root_changed = true;
+}
+
+/** Poll till @a connected devices are reported, return time (ms) */
+static int run_until(usbh_host *host, unsigned connected)
+{
+	unsigned ms;
+
+	for (ms = 0; ms < TIMEOUT_MS; ms++) {
+		usbh_poll(host, POLL_US);
+		if (bus.connected >= connected) {
+			return ms;
+		}
+	}
+
+	return -1;
+}
+
+static void run_ms(usbh_host *host, unsigned ms)
+{
+	while (ms--) {
+		usbh_poll(host, POLL_US);
+	}
+}
+
+static unsigned hubs_used(usbh_host *host)
+{
+	unsigned i, count = 0;
+
+	for (i = 0; i < USBH_HUB_COUNT; i++) {
+		if (host->hubs[i].dev != NULL) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static int check_bus(usbh_host *host)
+{
+	if (bus.collisions || bus.max_address0 > 1) {
+		FAIL("address 0 shared (%u collisions, %u devices)",
+			bus.collisions, bus.max_address0);
+	}
+
+	if (host->address0_busy) {
+		FAIL("address 0 still locked");
+	}
+
+	return 0;
+}
+
+static int run_fanout(void)
+{
+	static const usbh_speed speed[HUB_PORTS + 1] = {
+		USBH_SPEED_UNKNOWN, USBH_SPEED_LOW, USBH_SPEED_FULL,
+		USBH_SPEED_HIGH, USBH_SPEED_FULL
+	};
+	usbh_host *host = start();
+	struct node *hub = node_new(true, USBH_SPEED_HIGH);
+	uint64_t first = UINT64_MAX, last = 0, serial = 0;
+	unsigned i, j, overlap = 0;
+
+	for (i = 1; i <= HUB_PORTS; i++) {
+		plug(hub, i, node_new(false, speed[i]));
+	}
+
+	root_plug(hub);
+	if (run_until(host, HUB_PORTS) < 0) {
+		FAIL("fanout: %u of %u devices", bus.connected, HUB_PORTS);
+	}
+
+	if (hubs_used(host) != 1 || hub->dev != NULL) {
+		FAIL("fanout: hub reported to application");
+	}
+
+	for (i = 1; i <= HUB_PORTS; i++) {
+		struct node *n = hub->child[i];
+		usbh_device *parent = usbh_device_parent(n->dev);
+
+		if (usbh_device_speed(n->dev) != speed[i]) {
+			FAIL("fanout: port %u speed %d", i, usbh_device_speed(n->dev));
+		}
+
+		if (usbh_device_port(n->dev) != i || parent == NULL ||
+				usbh_device_address(parent) != hub->address) {
+			FAIL("fanout: port %u topology", i);
+		}
+
+		/* Enumeration of the others running when reset */
+		for (j = 1; j <= HUB_PORTS; j++) {
+			struct node *m = hub->child[j];
+			if (m != n && m->reset_at < n->reset_at &&
+					m->enum_done > n->reset_at) {
+				overlap++;
+				break;
+			}
+		}
+
+		first = MIN(first, n->reset_at);
+		last = MAX(last, n->enum_done);
+		serial += n->enum_done - n->reset_at;
+	}
+
+	if (check_bus(host)) {
+		return -1;
+	}
+
+	if (overlap < HUB_PORTS - 1 || (last - first) >= serial) {
+		FAIL("fanout: resets not overlapping enumeration (%u)", overlap);
+	}
+
+	printf("hub-test: %u ports enumerated in %u ms (one by one: %u ms)\n",
+		HUB_PORTS, (unsigned) ((last - first) / 1000),
+		(unsigned) (serial / 1000));
+
+	/* Unplug and replug port 2 */
+	unplug(hub, 2);
+	run_ms(host, 20);
+	if (bus.disconnected != 1) {
+		FAIL("unplug: %u disconnected", bus.disconnected);
+	}
+
+	plug(hub, 2, node_new(false, USBH_SPEED_FULL));
+	if (run_until(host, HUB_PORTS + 1) < 0 || hub->child[2]->dev == NULL) {
+		FAIL("replug: device not enumerated");
+	}
+
+	/* Reset of a device behind the hub */
+	usbh_device_reset(hub->child[3]->dev);
+	if (bus.disconnected != 2) {
+		FAIL("reset: %u disconnected", bus.disconnected);
+	}
+
+	if (run_until(host, HUB_PORTS + 2) < 0 || hub->child[3]->dev == NULL ||
+			usbh_device_speed(hub->child[3]->dev) != USBH_SPEED_HIGH) {
+		FAIL("reset: device not enumerated again");
+	}
+
+	/* Root gone */
+	bus.root = NULL;
+	usbh_root_device_disconnected(host);
+	if (bus.disconnected != 2 + HUB_PORTS || hubs_used(host)) {
+		FAIL("root disconnect: %u disconnected, %u hubs",
+			bus.disconnected, hubs_used(host));
+	}
+
+	return check_bus(host);
+}
+
+static int run_tiers(void)
+{
+	usbh_host *host = start();
+	struct node *hub[7], *dev, *sixth;
+	unsigned i, depth = 0;
+	usbh_device *d;
+
+	/* hub[1] (root) ... hub[5]: 5 tiers, hub[6] beyond the limit */
+	for (i = 1; i <= 6; i++) {
+		hub[i] = node_new(true, USBH_SPEED_HIGH);
+		if (i > 1) {
+			plug(hub[i - 1], 1, hub[i]);
+		}
+	}
+
+	sixth = hub[6];
+	dev = node_new(false, USBH_SPEED_FULL);
+	plug(hub[5], 2, dev);
+	root_plug(hub[1]);
+
+	if (run_until(host, 2) < 0) {
+		FAIL("tiers: %u of 2 devices", bus.connected);
+	}
+
+	if (dev->dev == NULL || sixth->dev == NULL || hubs_used(host) != 5) {
+		FAIL("tiers: device %s, sixth hub %s, %u hubs",
+			dev->dev ? "ok" : "missing", sixth->dev ? "ok" : "missing",
+			hubs_used(host));
+	}
+
+	for (d = usbh_device_parent(dev->dev); d != NULL;
+			d = usbh_device_parent(d)) {
+		depth++;
+	}
+
+	if (depth != 5) {
+		FAIL("tiers: device behind %u hubs", depth);
+	}
+
+	/* Middle hub unplugged: hub[3] to hub[6] and device gone */
+	unplug(hub[2], 1);
+	run_ms(host, 20);
+	if (bus.disconnected != 2 || hubs_used(host) != 2) {
+		FAIL("tiers unplug: %u disconnected, %u hubs",
+			bus.disconnected, hubs_used(host));
+	}
+
+	for (i = 3; i <= 5; i++) {
+		hub[i] = node_new(true, USBH_SPEED_HIGH);
+		plug(i == 3 ? hub[2] : hub[i - 1], 1, hub[i]);
+	}
+
+	plug(hub[5], 2, node_new(false, USBH_SPEED_LOW));
+	if (run_until(host, 3) < 0 || hubs_used(host) != 5 ||
+			hub[5]->child[2]->dev == NULL) {
+		FAIL("tiers replug: %u connected, %u hubs", bus.connected,
+			hubs_used(host));
+	}
+
+	return check_bus(host);
+}
+
+int main(void)
+{
+	if (run_fanout() || run_tiers()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("hub-test: OK\n");
+	return EXIT_SUCCESS;
+}
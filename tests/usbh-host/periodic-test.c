@@ -0,0 +1,352 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * DWC OTG host periodic schedule (backend/dwc_otg_periodic.h).
+ *
+ * - 10 HID devices and 2 audio streams on a full speed bus: placed in the
+ *   budget, spread over the frames. A pool of channels is handed out at
+ *   every SOF like the backend do (one transaction per channel, free again
+ *   once its frame is over): with dwc_otg_periodic::channels channels every
+ *   endpoint is served in its own frames, with less the worst delay is
+ *   reported with the share of transactions done. Frame number wrap and
+ *   polls missing SOF are part of the run.
+ * - Admission: full speed and high speed budget, isochronous interval
+ *   beyond the frame list, remove give back the bandwidth.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend/dwc_otg_periodic.h"
+
+#define HID_COUNT 10
+#define RUN_FRAMES 4000
+#define FIRST_FRAME 0x3C00 /* run cross the frame number wrap */
+#define MAX_POOL 8
+
+#define FAIL(...) do { \
+		fprintf(stderr, "periodic-test: " __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		return -1; \
+	} while (0)
+
+static struct dwc_otg_periodic sched;
+
+/**
+ * Check that no frame is over budget, and load match the slots
+ * @return 0 on success
+ */
+static int check_load(void)
+{
+	unsigned f, n;
+
+	for (f = 0; f < DWC_OTG_PERIODIC_FRAMES; f++) {
+		uint32_t load = 0;
+
+		for (n = 0; n < DWC_OTG_PERIODIC_SLOTS; n++) {
+			if (sched.due[f] & (1UL << n)) {
+				load += sched.slot[n].cost;
+			}
+		}
+
+		if (load != sched.load[f] || load > sched.budget) {
+			FAIL("frame %u: load %"PRIu32" (slots %"PRIu32") budget %"PRIu32,
+				f, sched.load[f], load, sched.budget);
+		}
+	}
+
+	return 0;
+}
+
+/* Channel of the model */
+enum {
+	CHAN_FREE,
+	CHAN_ARMED, /* transaction of armed_for */
+	CHAN_HALTING /* free on next poll (CHH) */
+};
+
+/**
+ * Hand out @a pool channels at every SOF for RUN_FRAMES frames, as the
+ *  backend do. Transactions of frame f are over at SOF of f (slot can be
+ *  armed again), the channel itself is free one poll later.
+ * @param[in] pool Number of channels
+ * @param[in] miss_sof Every 500 frames, the poll miss 3 SOF
+ * @param[out] worst Worst delay (frames) between a due frame and its
+ *  transaction
+ * @param[out] share Lowest share (percent) of due frames served of a slot
+ * @return 0 on success
+ */
+static int run(unsigned pool, bool miss_sof, unsigned *worst, unsigned *share)
+{
+	uint8_t state[MAX_POOL];
+	uint8_t slot_of[MAX_POOL];
+	uint16_t armed_for[MAX_POOL];
+	bool busy[DWC_OTG_PERIODIC_SLOTS];
+	unsigned served[DWC_OTG_PERIODIC_SLOTS];
+	unsigned i, n, step;
+	uint16_t frame = FIRST_FRAME;
+
+	memset(state, CHAN_FREE, sizeof(state));
+	memset(busy, 0, sizeof(busy));
+	memset(served, 0, sizeof(served));
+	dwc_otg_periodic_restart(&sched);
+	*worst = 0;
+	*share = 100;
+
+	for (step = 0; step < RUN_FRAMES; step++) {
+		uint16_t target = (frame + 1) & DWC_OTG_PERIODIC_FRNUM_MASK;
+		uint32_t skip = 0;
+		int slot;
+
+		for (i = 0; i < pool; i++) {
+			uint16_t age = (frame - armed_for[i]) & DWC_OTG_PERIODIC_FRNUM_MASK;
+
+			if (state[i] == CHAN_HALTING) {
+				state[i] = CHAN_FREE;
+			} else if (state[i] == CHAN_ARMED && age < 0x2000) {
+				state[i] = CHAN_HALTING;
+				busy[slot_of[i]] = false;
+			}
+		}
+
+		dwc_otg_periodic_advance(&sched, target);
+
+		while ((slot = dwc_otg_periodic_next(&sched, skip)) >= 0) {
+			struct dwc_otg_periodic_slot *s = &sched.slot[slot];
+			unsigned delay;
+
+			if (busy[slot]) {
+				skip |= 1UL << slot;
+				continue;
+			}
+
+			for (i = 0; i < pool && state[i] != CHAN_FREE; i++);
+			if (i == pool) {
+				break;
+			}
+
+			state[i] = CHAN_ARMED;
+			slot_of[i] = slot;
+			armed_for[i] = target;
+			busy[slot] = true;
+			dwc_otg_periodic_served(&sched, slot);
+			served[slot]++;
+
+			/* frames since the last due frame of the slot */
+			delay = (target - s->phase) & (s->period - 1);
+			if (delay > *worst) {
+				*worst = delay;
+			}
+		}
+
+		/* poll late: SOF of 3 frames missed */
+		frame = (frame + ((miss_sof && (step % 500) == 499) ? 4 : 1)) &
+			DWC_OTG_PERIODIC_FRNUM_MASK;
+	}
+
+	for (n = 0; n < DWC_OTG_PERIODIC_SLOTS; n++) {
+		unsigned due = RUN_FRAMES / sched.slot[n].period;
+
+		if (!(sched.used & (1UL << n))) {
+			continue;
+		}
+
+		if (served[n] * 100 / due < *share) {
+			*share = served[n] * 100 / due;
+		}
+
+		/* no slot starved */
+		if (served[n] < due / 4) {
+			FAIL("slot %u (period %"PRIu16") served %u times", n,
+				sched.slot[n].period, served[n]);
+		}
+	}
+
+	return 0;
+}
+
+/* 10 HID (8 bytes, 10ms) and 2 audio streams (192 bytes, 1ms) at full speed */
+static int test_hid_audio(void)
+{
+	uint32_t hid = dwc_otg_periodic_cost(USBH_SPEED_FULL, USBH_EP_INTERRUPT,
+		true, 8);
+	uint32_t audio_in = dwc_otg_periodic_cost(USBH_SPEED_FULL,
+		USBH_EP_ISOCHRONOUS, true, 192);
+	uint32_t audio_out = dwc_otg_periodic_cost(USBH_SPEED_FULL,
+		USBH_EP_ISOCHRONOUS, false, 192);
+	uint32_t peak = 0;
+	unsigned i, f, worst, share, pool;
+
+	dwc_otg_periodic_init(&sched, false);
+
+	if (dwc_otg_periodic_add(&sched, 1, audio_in, true) < 0 ||
+			dwc_otg_periodic_add(&sched, 1, audio_out, true) < 0) {
+		FAIL("audio refused");
+	}
+
+	for (i = 0; i < HID_COUNT; i++) {
+		if (dwc_otg_periodic_add(&sched, 10, hid, false) < 0) {
+			FAIL("HID %u refused", i);
+		}
+	}
+
+	if (check_load()) {
+		return -1;
+	}
+
+	for (f = 0; f < DWC_OTG_PERIODIC_FRAMES; f++) {
+		if (sched.load[f] > peak) {
+			peak = sched.load[f];
+		}
+	}
+
+	/* audio in every frame (2 + 2), 10 HID of period 8: 2 per frame at most
+	 *  but not in two frames in a row (2 + 1) */
+	if (sched.channels > 2 * 2 + 2 + 1) {
+		FAIL("%"PRIu8" channels needed", sched.channels);
+	}
+
+	printf("periodic-test: %u HID + 2 audio (FS): peak frame %"PRIu32
+		" of %"PRIu32" ns, %"PRIu8" channels\n", HID_COUNT, peak,
+		sched.budget, sched.channels);
+
+	/* every transaction in its own frame */
+	if (run(sched.channels, false, &worst, &share) || worst || share < 99) {
+		FAIL("worst delay %u frames with %"PRIu8" channels", worst,
+			sched.channels);
+	}
+
+	if (run(sched.channels, true, &worst, &share)) {
+		return -1;
+	}
+
+	printf("periodic-test:  %"PRIu8" channels: on time, "
+		"worst delay %u frames after 3 SOF missed\n", sched.channels, worst);
+
+	/* less than 4 channels cannot even carry the audio streams */
+	for (pool = sched.channels - 1; pool >= 4; pool--) {
+		if (run(pool, false, &worst, &share)) {
+			return -1;
+		}
+
+		printf("periodic-test:  %u channels: worst delay %u frames, "
+			"%u%% of transactions at least\n", pool, worst, share);
+	}
+
+	return 0;
+}
+
+static int test_admission(void)
+{
+	uint32_t iso_max = dwc_otg_periodic_cost(USBH_SPEED_FULL,
+		USBH_EP_ISOCHRONOUS, true, 1023);
+	uint32_t hs_max = dwc_otg_periodic_cost(USBH_SPEED_HIGH,
+		USBH_EP_INTERRUPT, true, 1024);
+	int slot[DWC_OTG_PERIODIC_SLOTS];
+	unsigned i, f;
+
+	/* FS: one 1023 bytes isochronous per frame */
+	dwc_otg_periodic_init(&sched, false);
+	slot[0] = dwc_otg_periodic_add(&sched, 1, iso_max, true);
+	if (slot[0] < 0 ||
+			dwc_otg_periodic_add(&sched, 1, iso_max, true) !=
+				DWC_OTG_PERIODIC_FULL) {
+		FAIL("FS: 1023 bytes isochronous");
+	}
+
+	/* period 2: fit once the first one removed */
+	dwc_otg_periodic_remove(&sched, slot[0]);
+	for (i = 0; i < 2; i++) {
+		slot[i] = dwc_otg_periodic_add(&sched, 2, iso_max, true);
+		if (slot[i] < 0) {
+			FAIL("FS: removed bandwidth not given back");
+		}
+	}
+
+	if (sched.slot[slot[0]].phase == sched.slot[slot[1]].phase ||
+			check_load()) {
+		FAIL("FS: period 2 on the same frames");
+	}
+
+	/* isochronous interval beyond the frame list, interrupt shortened */
+	if (dwc_otg_periodic_add(&sched, 2 * DWC_OTG_PERIODIC_FRAMES, 1000,
+				true) != DWC_OTG_PERIODIC_INVALID ||
+			dwc_otg_periodic_add(&sched, 3, 1000, true) !=
+				DWC_OTG_PERIODIC_INVALID) {
+		FAIL("isochronous interval not refused");
+	}
+
+	slot[2] = dwc_otg_periodic_add(&sched, 255, 1000, false);
+	if (slot[2] < 0 || sched.slot[slot[2]].period != DWC_OTG_PERIODIC_FRAMES) {
+		FAIL("interrupt interval 255");
+	}
+
+	/* HS: 4 x 1024 bytes interrupt per microframe */
+	dwc_otg_periodic_init(&sched, true);
+	for (i = 0; i < 4; i++) {
+		if (dwc_otg_periodic_add(&sched, 1, hs_max, false) < 0) {
+			FAIL("HS: interrupt %u refused", i);
+		}
+	}
+
+	if (dwc_otg_periodic_add(&sched, 1, hs_max, false) !=
+			DWC_OTG_PERIODIC_FULL || check_load()) {
+		FAIL("HS: microframe over budget");
+	}
+
+	/* slots exhausted */
+	dwc_otg_periodic_init(&sched, true);
+	for (i = 0; i < DWC_OTG_PERIODIC_SLOTS; i++) {
+		slot[i] = dwc_otg_periodic_add(&sched, 8, 100, false);
+	}
+
+	if (slot[DWC_OTG_PERIODIC_SLOTS - 1] < 0 ||
+			dwc_otg_periodic_add(&sched, 8, 100, false) !=
+				DWC_OTG_PERIODIC_FULL) {
+		FAIL("slots");
+	}
+
+	for (i = 0; i < DWC_OTG_PERIODIC_SLOTS; i++) {
+		dwc_otg_periodic_remove(&sched, slot[i]);
+	}
+
+	for (f = 0; f < DWC_OTG_PERIODIC_FRAMES; f++) {
+		if (sched.load[f] || sched.due[f]) {
+			FAIL("frame %u not empty", f);
+		}
+	}
+
+	if (sched.used || sched.channels) {
+		FAIL("schedule not empty");
+	}
+
+	printf("periodic-test: admission: FS 1023B iso %"PRIu32" ns, "
+		"HS 1024B interrupt %"PRIu32" ns\n", iso_max, hs_max);
+	return 0;
+}
+
+int main(void)
+{
+	if (test_hid_audio() || test_admission()) {
+		return EXIT_FAILURE;
+	}
+
+	printf("periodic-test: OK\n");
+	return EXIT_SUCCESS;
+}
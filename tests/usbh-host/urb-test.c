@@ -0,0 +1,317 @@
+/*
+ * This file is part of the unicore-mx project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * usbh URB and device tables at full size (USBH_URB_COUNT=256,
+ * USBH_DEVICE_COUNT=127) against a backend with a few channels.
+ *
+ * - 127 devices enumerated, lookup by address, no slot for one more
+ * - URB above the channel count wait in the pending list: the backend is
+ *   asked once per poll while its channels are busy
+ * - Timeouts expire in deadline order, within one poll
+ * - Device disconnect complete only the URB of the device
+ * - Cancel by ID, stale ID ignored
+ * - Cost of an idle usbh_poll() with every URB in use
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "usbh-private.h"
+
+#define CHANNELS 8
+#define POLL_US 1000
+#define IDLE_POLLS 100000
+
+#define FAIL(...) do { \
+		fprintf(stderr, "urb-test: " __VA_ARGS__); \
+		fprintf(stderr, "\n"); \
+		return -1; \
+	} while (0)
+
+static struct {
+	usbh_host host;
+	usbh_urb *channel[CHANNELS];
+	unsigned submit_calls;
+	uint64_t now;
+} bus;
+
+static struct {
+	unsigned connected;
+	unsigned count[16];
+	uint64_t last_deadline;
+	bool out_of_order;
+	bool late;
+} app;
+
+static void fake_poll(usbh_host *host, uint64_t now)
+{
+	usbh_urb *done[CHANNELS];
+	unsigned i;
+	(void) host;
+
+	bus.now = now;
+
+	/* Control transfers complete (SET_ADDRESS, device descriptor) */
+	for (i = 0; i < CHANNELS; i++) {
+		usbh_urb *urb = bus.channel[i];
+		done[i] = (urb != NULL && urb->transfer.ep_type == USBH_EP_CONTROL) ?
+			urb : NULL;
+	}
+
+	for (i = 0; i < CHANNELS; i++) {
+		usbh_urb *urb = done[i];
+		struct usb_device_descriptor desc = {
+			.bLength = USB_DT_DEVICE_SIZE,
+			.bDescriptorType = USB_DT_DEVICE,
+			.bcdUSB = 0x0200,
+			.bMaxPacketSize0 = 64
+		};
+
+		if (urb == NULL || bus.channel[i] != urb) {
+			continue;
+		}
+
+		bus.channel[i] = NULL;
+		urb->backend_tag = INVALID_BACKEND_TAG;
+		urb->transfer.transferred = urb->transfer.length;
+		if (urb->transfer.length) {
+			memcpy(urb->transfer.data, &desc, urb->transfer.length);
+		}
+		usbh_urb_free(urb, USBH_SUCCESS);
+	}
+}
+
+static usbh_host *fake_init(const usbh_backend_config *config)
+{
+	(void) config;
+	return &bus.host;
+}
+
+static usbh_speed fake_speed(usbh_host *host)
+{
+	(void) host;
+	return USBH_SPEED_FULL;
+}
+
+static void fake_reset(usbh_host *host)
+{
+	(void) host;
+}
+
+static void fake_submit(usbh_host *host, usbh_urb *urb)
+{
+	unsigned i;
+	(void) host;
+
+	bus.submit_calls++;
+
+	for (i = 0; i < CHANNELS; i++) {
+		if (bus.channel[i] == NULL) {
+			bus.channel[i] = urb;
+			urb->backend_tag = i;
+			return;
+		}
+	}
+}
+
+static void fake_cancel(usbh_host *host, usbh_urb *urb)
+{
+	(void) host;
+	bus.channel[urb->backend_tag] = NULL;
+	urb->backend_tag = INVALID_BACKEND_TAG;
+}
+
+static const usbh_backend fake_backend = {
+	.init = fake_init,
+	.speed = fake_speed,
+	.poll = fake_poll,
+	.reset = fake_reset,
+	.transfer_submit = fake_submit,
+	.transfer_cancel = fake_cancel
+};
+
+static void device_connected(usbh_device *dev)
+{
+	(void) dev;
+	app.connected++;
+}
+
+static void transfer_done(const usbh_transfer *transfer,
+		usbh_transfer_status status, usbh_urb_id urb_id)
+{
+	uint64_t deadline = (uintptr_t) transfer->user_data;
+	(void) urb_id;
+
+	app.count[-status]++;
+
+	if (status != USBH_ERR_TIMEOUT) {
+		return;
+	}
+
+	if (deadline < app.last_deadline) {
+		app.out_of_order = true;
+	}
+
+	if (bus.now < deadline || bus.now >= deadline + POLL_US) {
+		app.late = true;
+	}
+
+	app.last_deadline = deadline;
+}
+
+static usbh_urb_id submit(usbh_device *dev, uint32_t timeout)
+{
+	static uint8_t buf[64];
+	usbh_transfer transfer = {
+		.device = dev,
+		.ep_type = USBH_EP_BULK,
+		.ep_addr = 0x81,
+		.ep_size = 64,
+		.data = buf,
+		.length = sizeof(buf),
+		.flags = USBH_FLAG_NONE,
+		.timeout = timeout,
+		.callback = transfer_done,
+		.user_data = (void *) (uintptr_t)
+			(bus.host.last_poll + MS2US(timeout))
+	};
+
+	return usbh_transfer_submit(&transfer);
+}
+
+static int run_devices(usbh_host *host)
+{
+	unsigned i;
+
+	usbh_root_device_connected(host, USBH_SPEED_FULL);
+	usbh_poll(host, POLL_US);
+	usbh_poll(host, POLL_US);
+
+	for (i = 1; i < USBH_DEVICE_COUNT; i++) {
+		usbh_device_connected(host, &host->devices[0], i, USBH_SPEED_FULL);
+		usbh_poll(host, POLL_US);
+		usbh_poll(host, POLL_US);
+	}
+
+	if (app.connected != USBH_DEVICE_COUNT) {
+		FAIL("%u of %u devices", app.connected, USBH_DEVICE_COUNT);
+	}
+
+	for (i = 1; i <= USBH_DEVICE_COUNT; i++) {
+		usbh_device *dev = usb_device_by_address(host, i);
+		if (dev == NULL || usbh_device_address(dev) != i) {
+			FAIL("device at address %u not found", i);
+		}
+	}
+
+	/* Device table full */
+	usbh_device_connected(host, &host->devices[0], 200, USBH_SPEED_FULL);
+	if (host->address0_busy || usb_device_by_address(host, 0) != NULL) {
+		FAIL("device beyond the table");
+	}
+
+	return 0;
+}
+
+static int run_urbs(usbh_host *host)
+{
+	usbh_device *dev = usb_device_by_address(host, 5);
+	unsigned i, calls, polls;
+	usbh_urb_id id;
+
+	/* Every URB in use, few accepted by backend */
+	for (i = 0; i < USBH_URB_COUNT; i++) {
+		if (!submit(usb_device_by_address(host, 1 + (i % 127)),
+				10 + (i * 37) % 200)) {
+			FAIL("submit %u failed", i);
+		}
+	}
+
+	if (submit(dev, 10) || app.count[-USBH_ERR_RES_UNAVAIL] != 1) {
+		FAIL("URB beyond the table");
+	}
+
+	bus.submit_calls = 0;
+	usbh_poll(host, POLL_US);
+	if (bus.submit_calls > 1) {
+		FAIL("backend asked %u times with channels busy", bus.submit_calls);
+	}
+
+	/* Timeouts in deadline order */
+	for (polls = 0; polls < 300; polls++) {
+		usbh_poll(host, POLL_US);
+	}
+
+	if (app.count[-USBH_ERR_TIMEOUT] != USBH_URB_COUNT || app.out_of_order ||
+			app.late || host->urbs.timeout.count) {
+		FAIL("%u timeouts, order %s, %s", app.count[-USBH_ERR_TIMEOUT],
+			app.out_of_order ? "wrong" : "ok", app.late ? "late" : "in time");
+	}
+
+	/* Disconnect: only URB of the device */
+	for (i = 0; i < USBH_URB_COUNT; i++) {
+		submit(usb_device_by_address(host, 1 + (i % 16)), 0);
+	}
+
+	usbh_device_disconnected(dev);
+	if (app.count[-USBH_ERR_NO_DEVICE] != USBH_URB_COUNT / 16 ||
+			usb_device_by_address(host, 5) != NULL) {
+		FAIL("disconnect: %u URB completed", app.count[-USBH_ERR_NO_DEVICE]);
+	}
+
+	/* Cancel, stale ID */
+	id = submit(usb_device_by_address(host, 100), 0);
+	usbh_transfer_cancel(host, id);
+	usbh_transfer_cancel(host, id);
+	if (app.count[-USBH_ERR_CANCEL] != 1) {
+		FAIL("cancel: %u callbacks", app.count[-USBH_ERR_CANCEL]);
+	}
+
+	/* Idle poll, all URB in use (NAKed) */
+	submit(usb_device_by_address(host, 100), 0);
+	bus.submit_calls = 0;
+	clock_t start = clock();
+	for (polls = 0; polls < IDLE_POLLS; polls++) {
+		usbh_poll(host, POLL_US);
+	}
+	double ns = (double) (clock() - start) * 1e9 / CLOCKS_PER_SEC / IDLE_POLLS;
+	calls = bus.submit_calls;
+
+	if (calls > IDLE_POLLS) {
+		FAIL("idle: backend asked %u times", calls);
+	}
+
+	printf("urb-test: idle poll %.0f ns (%u URB, %u devices)\n", ns,
+		USBH_URB_COUNT, USBH_DEVICE_COUNT);
+	return 0;
+}
+
+int main(void)
+{
+	usbh_host *host = usbh_init(&fake_backend, NULL);
+
+	usbh_register_connected_callback(host, device_connected);
+
+	if (run_devices(host) || run_urbs(host)) {
+		return EXIT_FAILURE;
+	}
+
+	printf("urb-test: OK\n");
+	return EXIT_SUCCESS;
+}